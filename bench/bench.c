@@ -0,0 +1,200 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <vde3.h>
+
+#include <vde3/context.h>
+#include <vde3/module.h>
+#include <vde3/pool.h>
+
+// after vde3 headers, libevent compat macros clash with their names
+#include <event.h>
+
+#include "bench.h"
+
+extern vde_event_handler libevent_eh;
+
+uint64_t bench_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void bench_hist_init(bench_hist *hist)
+{
+  memset(hist, 0, sizeof(bench_hist));
+  hist->min = UINT64_MAX;
+}
+
+void bench_hist_add(bench_hist *hist, uint64_t ns)
+{
+  unsigned int idx = 0;
+
+  if (ns > 0) {
+    idx = 63 - __builtin_clzll(ns);
+  }
+  if (idx >= BENCH_HIST_BUCKETS) {
+    idx = BENCH_HIST_BUCKETS - 1;
+  }
+  hist->buckets[idx]++;
+  hist->count++;
+  hist->sum += ns;
+  if (ns < hist->min) {
+    hist->min = ns;
+  }
+  if (ns > hist->max) {
+    hist->max = ns;
+  }
+}
+
+uint64_t bench_hist_percentile(bench_hist *hist, double pct)
+{
+  unsigned int i;
+  uint64_t seen = 0;
+  uint64_t rank = (uint64_t)(hist->count * pct / 100.0);
+
+  for (i = 0; i < BENCH_HIST_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen > rank) {
+      // the upper bound could only exceed the real maximum
+      return (2ULL << i) < hist->max ? (2ULL << i) : hist->max;
+    }
+  }
+  return hist->max;
+}
+
+vde_sobj *bench_hist_serialize(bench_hist *hist)
+{
+  unsigned int i;
+  char key[24];
+  vde_sobj *out, *buckets;
+
+  out = vde_sobj_new_hash();
+  buckets = vde_sobj_new_hash();
+  if (out == NULL || buckets == NULL) {
+    vde_sobj_put(out);
+    vde_sobj_put(buckets);
+    return NULL;
+  }
+
+  vde_sobj_hash_insert(out, "count", vde_sobj_new_int64(hist->count));
+  if (hist->count == 0) {
+    vde_sobj_hash_insert(out, "buckets", buckets);
+    return out;
+  }
+  vde_sobj_hash_insert(out, "min_ns", vde_sobj_new_int64(hist->min));
+  vde_sobj_hash_insert(out, "max_ns", vde_sobj_new_int64(hist->max));
+  vde_sobj_hash_insert(out, "mean_ns",
+                       vde_sobj_new_double((double)hist->sum / hist->count));
+  vde_sobj_hash_insert(out, "p50_ns",
+                       vde_sobj_new_int64(bench_hist_percentile(hist, 50)));
+  vde_sobj_hash_insert(out, "p99_ns",
+                       vde_sobj_new_int64(bench_hist_percentile(hist, 99)));
+  vde_sobj_hash_insert(out, "p999_ns",
+                       vde_sobj_new_int64(bench_hist_percentile(hist, 99.9)));
+  for (i = 0; i < BENCH_HIST_BUCKETS; i++) {
+    if (hist->buckets[i]) {
+      snprintf(key, sizeof(key), "%llu", i ? 1ULL << i : 0ULL);
+      vde_sobj_hash_insert(buckets, key,
+                           vde_sobj_new_int64(hist->buckets[i]));
+    }
+  }
+  vde_sobj_hash_insert(out, "buckets", buckets);
+  return out;
+}
+
+void bench_allocs_get(vde_context *ctx, bench_allocs *allocs)
+{
+  unsigned int i;
+  vde_pool_stats stats;
+  vde_pool *pool = vde_context_get_pool(ctx);
+
+  memset(allocs, 0, sizeof(bench_allocs));
+  // the last index is the class of oversized requests
+  for (i = 0; i <= vde_pool_num_classes(pool); i++) {
+    if (vde_pool_get_stats(pool, i, NULL, &stats) == 0) {
+      allocs->allocs += stats.allocs;
+      allocs->misses += stats.misses;
+    }
+  }
+}
+
+int bench_context_new(vde_context **ctx)
+{
+  static int event_initialized = 0;
+
+  if (!event_initialized) {
+    event_init();
+    event_initialized = 1;
+  }
+
+  if (vde_context_new(ctx)) {
+    return -1;
+  }
+  if (vde_context_init(*ctx, &libevent_eh, NULL)) {
+    vde_context_delete(*ctx);
+    return -1;
+  }
+  if (bench_trafgen_register(*ctx)) {
+    bench_context_delete(*ctx);
+    return -1;
+  }
+  return 0;
+}
+
+void bench_context_delete(vde_context *ctx)
+{
+  vde_context_fini(ctx);
+  vde_context_delete(ctx);
+}
+
+vde_sobj *bench_report_new(const char *name)
+{
+  vde_sobj *report;
+
+  report = vde_sobj_new_hash();
+  if (report == NULL) {
+    return NULL;
+  }
+  vde_sobj_hash_insert(report, "benchmark", vde_sobj_new_string(name));
+  vde_sobj_hash_insert(report, "version",
+                       vde_sobj_new_string(PACKAGE_VERSION));
+  vde_sobj_hash_insert(report, "results", vde_sobj_new_array());
+  return report;
+}
+
+void bench_report_add(vde_sobj *report, vde_sobj *result)
+{
+  vde_sobj_array_add(vde_sobj_hash_lookup(report, "results"), result);
+}
+
+void bench_report_print(vde_sobj *report)
+{
+  printf("%s\n", vde_sobj_to_string(report));
+  fflush(stdout);
+  vde_sobj_put(report);
+}
@@ -0,0 +1,195 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file
+ */
+
+#ifndef __VDE3_BENCH_H__
+#define __VDE3_BENCH_H__
+
+#include <stdint.h>
+
+#include <vde3.h>
+
+#include <vde3/packet.h>
+
+/**
+ * @brief Get a monotonic timestamp in nanoseconds
+ */
+uint64_t bench_now_ns(void);
+
+/**
+ * @brief Number of buckets of a latency histogram, bucket i counts samples
+ * in [2^i, 2^(i+1)) nanoseconds
+ */
+#define BENCH_HIST_BUCKETS 40
+
+/**
+ * @brief A latency histogram
+ */
+typedef struct {
+  uint64_t buckets[BENCH_HIST_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+} bench_hist;
+
+/**
+ * @brief Reset a latency histogram
+ *
+ * @param hist The histogram
+ */
+void bench_hist_init(bench_hist *hist);
+
+/**
+ * @brief Add a sample to a latency histogram
+ *
+ * @param hist The histogram
+ * @param ns The sample in nanoseconds
+ */
+void bench_hist_add(bench_hist *hist, uint64_t ns);
+
+/**
+ * @brief Estimate a percentile from a latency histogram, the upper bound of
+ * the bucket holding it is returned
+ *
+ * @param hist The histogram
+ * @param pct The percentile, between 0 and 100
+ *
+ * @return The percentile in nanoseconds
+ */
+uint64_t bench_hist_percentile(bench_hist *hist, double pct);
+
+/**
+ * @brief Serialize a latency histogram: count, min, max, mean, percentiles
+ * and non-empty buckets keyed by their lower bound
+ *
+ * @param hist The histogram
+ *
+ * @return The serialized histogram, NULL on error
+ */
+vde_sobj *bench_hist_serialize(bench_hist *hist);
+
+/**
+ * @brief Allocation counters of a context pool
+ */
+typedef struct {
+  uint64_t allocs; //!< Chunks handed out by the pool
+  uint64_t misses; //!< Chunks asked to the system allocator
+} bench_allocs;
+
+/**
+ * @brief Read the allocation counters of a context pool, summed over classes
+ *
+ * @param ctx The context
+ * @param allocs The counters to fill
+ */
+void bench_allocs_get(vde_context *ctx, bench_allocs *allocs);
+
+/**
+ * @brief Create a context running on the libevent handler, with modules of
+ * the build tree and the traffic generator loaded
+ *
+ * @param ctx reference to new context pointer
+ *
+ * @return zero on success, -1 on error
+ */
+int bench_context_new(vde_context **ctx);
+
+/**
+ * @brief Finalize and delete a context created by bench_context_new()
+ *
+ * @param ctx The context
+ */
+void bench_context_delete(vde_context *ctx);
+
+/**
+ * @brief Create the report of a benchmark program
+ *
+ * @param name The benchmark name
+ *
+ * @return The report, a hash with a "results" array
+ */
+vde_sobj *bench_report_new(const char *name);
+
+/**
+ * @brief Add a result to a report, the result reference is taken
+ *
+ * @param report The report
+ * @param result The result
+ */
+void bench_report_add(vde_sobj *report, vde_sobj *result);
+
+/**
+ * @brief Print a report as a single line of JSON on stdout and release it
+ *
+ * @param report The report
+ */
+void bench_report_print(vde_sobj *report);
+
+/**
+ * @brief Register the traffic generator engine, family "trafgen", in a
+ * context.
+ *
+ * A traffic generator holds a single connection. It sends copies of a
+ * template packet of "pkt_len" bytes (param, 60 by default) on request and
+ * counts received packets, optionally calling a receive callback.
+ *
+ * @param ctx The context
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int bench_trafgen_register(vde_context *ctx);
+
+/**
+ * @brief Callback called for each packet received by a traffic generator
+ */
+typedef void (*bench_trafgen_rx_cb)(vde_component *trafgen, vde_pkt *pkt,
+                                    void *arg);
+
+/**
+ * @brief Set the receive callback of a traffic generator
+ *
+ * @param trafgen The traffic generator
+ * @param cb The callback, NULL to only count packets
+ * @param arg The callback argument
+ */
+void bench_trafgen_set_rx_cb(vde_component *trafgen, bench_trafgen_rx_cb cb,
+                             void *arg);
+
+/**
+ * @brief Send packets from a traffic generator
+ *
+ * @param trafgen The traffic generator
+ * @param count The number of packets to send
+ *
+ * @return The number of packets accepted by the connection, -1 if the
+ * traffic generator is not connected
+ */
+int bench_trafgen_send(vde_component *trafgen, unsigned int count);
+
+/**
+ * @brief Get the number of packets received by a traffic generator
+ *
+ * @param trafgen The traffic generator
+ *
+ * @return The number of packets
+ */
+uint64_t bench_trafgen_rx_pkts(vde_component *trafgen);
+
+#endif /* __VDE3_BENCH_H__ */
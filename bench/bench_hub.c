@@ -0,0 +1,174 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/*
+ * Hub fan-out: one traffic generator floods a hub whose other ports are
+ * traffic generators counting packets, all of them joined by unqueued local
+ * connections so that only the engine path is measured.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <vde3.h>
+
+#include <vde3/localconnection.h>
+
+#include "bench.h"
+
+// packets delivered to sink ports by each run
+#define DEFAULT_DELIVERIES 4000000
+
+static const unsigned int fanout_ports[] = { 2, 16, 64, 256 };
+#define NUM_FANOUTS (sizeof(fanout_ports) / sizeof(unsigned int))
+
+static vde_sobj *bench_fanout(unsigned int ports, unsigned int deliveries,
+                              int pkt_len)
+{
+  unsigned int i, count;
+  char name[16], params_str[32];
+  uint64_t start, elapsed, received = 0;
+  bench_allocs before, after;
+  vde_context *ctx;
+  vde_component *hub, **tgs;
+  vde_sobj *params, *result = NULL;
+
+  if (bench_context_new(&ctx)) {
+    fprintf(stderr, "cannot create context\n");
+    return NULL;
+  }
+  tgs = (vde_component **)vde_calloc(ports * sizeof(vde_component *));
+  if (tgs == NULL) {
+    goto out;
+  }
+
+  params = vde_sobj_from_string("{'stats_interval': 0}");
+  if (vde_context_new_component(ctx, VDE_ENGINE, "hub", "hub", &hub,
+                                params)) {
+    vde_sobj_put(params);
+    fprintf(stderr, "cannot create hub\n");
+    goto out;
+  }
+  vde_sobj_put(params);
+
+  snprintf(params_str, sizeof(params_str), "{'pkt_len': %d}", pkt_len);
+  params = vde_sobj_from_string(params_str);
+  for (i = 0; i < ports; i++) {
+    snprintf(name, sizeof(name), "tg%u", i);
+    if (vde_context_new_component(ctx, VDE_ENGINE, "trafgen", name, &tgs[i],
+                                  params) ||
+        vde_connect_engines_unqueued(ctx, tgs[i], NULL, hub, NULL)) {
+      vde_sobj_put(params);
+      fprintf(stderr, "cannot connect port %u\n", i);
+      goto out;
+    }
+  }
+  vde_sobj_put(params);
+
+  // every packet reaches ports - 1 sinks
+  count = deliveries / (ports - 1);
+  if (count == 0) {
+    count = 1;
+  }
+
+  // warm up the pool and caches
+  bench_trafgen_send(tgs[0], count / 10 + 1);
+
+  bench_allocs_get(ctx, &before);
+  for (i = 1; i < ports; i++) {
+    received -= bench_trafgen_rx_pkts(tgs[i]);
+  }
+  start = bench_now_ns();
+  bench_trafgen_send(tgs[0], count);
+  elapsed = bench_now_ns() - start;
+  for (i = 1; i < ports; i++) {
+    received += bench_trafgen_rx_pkts(tgs[i]);
+  }
+  bench_allocs_get(ctx, &after);
+
+  result = vde_sobj_new_hash();
+  vde_sobj_hash_insert(result, "ports", vde_sobj_new_int(ports));
+  vde_sobj_hash_insert(result, "pkt_len", vde_sobj_new_int(pkt_len));
+  vde_sobj_hash_insert(result, "pkts", vde_sobj_new_int64(count));
+  vde_sobj_hash_insert(result, "deliveries", vde_sobj_new_int64(received));
+  vde_sobj_hash_insert(result, "elapsed_ns", vde_sobj_new_int64(elapsed));
+  vde_sobj_hash_insert(result, "pps",
+                       vde_sobj_new_double(count * 1e9 / elapsed));
+  vde_sobj_hash_insert(result, "deliveries_ps",
+                       vde_sobj_new_double(received * 1e9 / elapsed));
+  vde_sobj_hash_insert(result, "ns_per_pkt",
+                       vde_sobj_new_double((double)elapsed / count));
+  vde_sobj_hash_insert(result, "pool_allocs_per_pkt",
+                       vde_sobj_new_double((double)(after.allocs -
+                                                    before.allocs) / count));
+  vde_sobj_hash_insert(result, "malloc_per_pkt",
+                       vde_sobj_new_double((double)(after.misses -
+                                                    before.misses) / count));
+
+out:
+  vde_free(tgs);
+  bench_context_delete(ctx);
+  return result;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-n deliveries] [-l pkt_len]\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+  unsigned int i;
+  unsigned int deliveries = DEFAULT_DELIVERIES;
+  int pkt_len = 60;
+  vde_sobj *report, *result;
+
+  while ((opt = getopt(argc, argv, "n:l:")) != -1) {
+    switch (opt) {
+      case 'n':
+        deliveries = atoi(optarg);
+        break;
+      case 'l':
+        pkt_len = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (deliveries == 0 || pkt_len <= 0) {
+    usage(argv[0]);
+  }
+
+  report = bench_report_new("hub_fanout");
+  for (i = 0; i < NUM_FANOUTS; i++) {
+    result = bench_fanout(fanout_ports[i], deliveries, pkt_len);
+    if (result == NULL) {
+      vde_sobj_put(report);
+      return 1;
+    }
+    bench_report_add(report, result);
+  }
+  bench_report_print(report);
+  return 0;
+}
@@ -0,0 +1,143 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/*
+ * Ordered hash throughput: insert, lookup and remove a given number of keys,
+ * lookups and removals walk keys in a shuffled order.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vde3.h>
+
+#include <vde3/vde_ordhash.h>
+
+#include "bench.h"
+
+// lookups done for each key
+#define LOOKUP_ROUNDS 8
+
+static const unsigned int table_sizes[] = { 64, 1024, 16384 };
+#define NUM_SIZES (sizeof(table_sizes) / sizeof(unsigned int))
+
+static inline void *key_of(unsigned int i)
+{
+  // never NULL
+  return (void *)(uintptr_t)(i + 1);
+}
+
+static vde_sobj *op_result(uint64_t ops, uint64_t elapsed)
+{
+  vde_sobj *out = vde_sobj_new_hash();
+
+  vde_sobj_hash_insert(out, "ops", vde_sobj_new_int64(ops));
+  vde_sobj_hash_insert(out, "elapsed_ns", vde_sobj_new_int64(elapsed));
+  vde_sobj_hash_insert(out, "ops_per_sec",
+                       vde_sobj_new_double(ops * 1e9 / elapsed));
+  vde_sobj_hash_insert(out, "ns_per_op",
+                       vde_sobj_new_double((double)elapsed / ops));
+  return out;
+}
+
+static vde_sobj *bench_size(unsigned int size)
+{
+  unsigned int i, j, tmp, round;
+  unsigned int *order;
+  uint64_t start, elapsed;
+  unsigned long seed = 1;
+  void *found;
+  vde_ordhash *oh;
+  vde_sobj *result;
+
+  order = (unsigned int *)vde_alloc(size * sizeof(unsigned int));
+  oh = vde_ordhash_new();
+  if (order == NULL || oh == NULL) {
+    vde_free(order);
+    return NULL;
+  }
+
+  // Fisher-Yates with a fixed LCG, runs are comparable
+  for (i = 0; i < size; i++) {
+    order[i] = i;
+  }
+  for (i = size - 1; i > 0; i--) {
+    seed = seed * 1103515245 + 12345;
+    j = (seed >> 16) % (i + 1);
+    tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+
+  result = vde_sobj_new_hash();
+  vde_sobj_hash_insert(result, "size", vde_sobj_new_int(size));
+
+  start = bench_now_ns();
+  for (i = 0; i < size; i++) {
+    vde_ordhash_insert(oh, key_of(i), key_of(i));
+  }
+  elapsed = bench_now_ns() - start;
+  vde_sobj_hash_insert(result, "insert", op_result(size, elapsed));
+
+  found = NULL;
+  start = bench_now_ns();
+  for (round = 0; round < LOOKUP_ROUNDS; round++) {
+    for (i = 0; i < size; i++) {
+      found = vde_ordhash_lookup(oh, key_of(order[i]));
+    }
+  }
+  elapsed = bench_now_ns() - start;
+  // keep the lookups
+  if (found == NULL) {
+    fprintf(stderr, "lookup failed\n");
+  }
+  vde_sobj_hash_insert(result, "lookup",
+                       op_result(size * LOOKUP_ROUNDS, elapsed));
+
+  start = bench_now_ns();
+  for (i = 0; i < size; i++) {
+    vde_ordhash_remove(oh, key_of(order[i]));
+  }
+  elapsed = bench_now_ns() - start;
+  vde_sobj_hash_insert(result, "remove", op_result(size, elapsed));
+
+  vde_ordhash_delete(oh);
+  vde_free(order);
+  return result;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned int i;
+  vde_sobj *report, *result;
+
+  report = bench_report_new("ordhash");
+  for (i = 0; i < NUM_SIZES; i++) {
+    result = bench_size(table_sizes[i]);
+    if (result == NULL) {
+      vde_sobj_put(report);
+      return 1;
+    }
+    bench_report_add(report, result);
+  }
+  bench_report_print(report);
+  return 0;
+}
@@ -0,0 +1,387 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/*
+ * vde2 transport latency: two vde2 clients living in this process are plugged
+ * into a hub through the vde2 transport, a frame sent by the first one is
+ * timed until the second one receives it, then the next frame is sent.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/context.h>
+
+// after vde3 headers, libevent compat macros clash with their names
+#include <event.h>
+
+#include "bench.h"
+
+#define DEFAULT_SAMPLES 100000
+// give up a run if no frame comes back for this many seconds
+#define RUN_TIMEOUT 5
+
+static const int frame_sizes[] = { 60, 1514 };
+#define NUM_SIZES (sizeof(frame_sizes) / sizeof(int))
+
+// taken from vde2 datasock.c
+#define SWITCH_MAGIC 0xfeedface
+
+enum request_type { REQ_NEW_CONTROL, REQ_NEW_PORT0 };
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  enum request_type type;
+  struct sockaddr_un sock;
+  char description[];
+} __attribute__((packed)) vde2_request;
+// end of vde2 datasock.c
+
+typedef struct {
+  int ctl_fd;
+  void *ctl_ev;
+  int data_fd;
+  struct sockaddr_un local_sa;
+  struct sockaddr_un remote_sa; //!< the transport data socket
+  int connected;
+} vde2_client;
+
+typedef struct {
+  vde_context *ctx;
+  vde2_client clients[2];
+  void *rx_ev;
+  void *timeout_ev;
+  char frame[sizeof(struct eth_frame)];
+  int frame_len;
+  unsigned int samples; //!< samples left in the current run
+  unsigned int last_samples; //!< samples left at the previous timeout
+  uint64_t sent_at;
+  bench_hist hist;
+  int failed;
+} vde2_bench;
+
+static void bench_connected_cb(int fd, short events, void *arg);
+
+static int client_connect(vde2_bench *b, vde2_client *c, const char *dir,
+                          const char *name)
+{
+  struct sockaddr_un sa;
+  vde2_request req;
+
+  memset(c, 0, sizeof(vde2_client));
+  c->ctl_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+  c->data_fd = socket(PF_UNIX, SOCK_DGRAM, 0);
+  if (c->ctl_fd < 0 || c->data_fd < 0) {
+    return -1;
+  }
+
+  c->local_sa.sun_family = AF_UNIX;
+  snprintf(c->local_sa.sun_path, sizeof(c->local_sa.sun_path), "%s/%s", dir,
+           name);
+  if (bind(c->data_fd, (struct sockaddr *)&c->local_sa,
+           sizeof(struct sockaddr_un)) < 0) {
+    return -1;
+  }
+
+  sa.sun_family = AF_UNIX;
+  snprintf(sa.sun_path, sizeof(sa.sun_path), "%s/ctl", dir);
+  if (connect(c->ctl_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+    return -1;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.magic = SWITCH_MAGIC;
+  req.version = 3;
+  req.type = REQ_NEW_CONTROL;
+  memcpy(&req.sock, &c->local_sa, sizeof(struct sockaddr_un));
+  if (write(c->ctl_fd, &req, sizeof(req)) != sizeof(req)) {
+    return -1;
+  }
+
+  // the reply comes once the transport has handled the request
+  c->ctl_ev = vde_context_event_add(b->ctx, c->ctl_fd, VDE_EV_READ, NULL,
+                                    &bench_connected_cb, b);
+  if (c->ctl_ev == NULL) {
+    return -1;
+  }
+  return 0;
+}
+
+static void client_close(vde2_client *c)
+{
+  if (c->ctl_fd >= 0) {
+    close(c->ctl_fd);
+  }
+  if (c->data_fd >= 0) {
+    close(c->data_fd);
+  }
+}
+
+static void bench_send(vde2_bench *b)
+{
+  vde2_client *c = &b->clients[0];
+
+  b->sent_at = bench_now_ns();
+  if (sendto(c->data_fd, b->frame, b->frame_len, 0,
+             (struct sockaddr *)&c->remote_sa,
+             sizeof(struct sockaddr_un)) != b->frame_len) {
+    fprintf(stderr, "cannot send frame: %s\n", strerror(errno));
+    b->failed = 1;
+    event_loopbreak();
+  }
+}
+
+static void bench_connected_cb(int fd, short events, void *arg)
+{
+  unsigned int i;
+  vde2_bench *b = (vde2_bench *)arg;
+
+  for (i = 0; i < 2; i++) {
+    if (b->clients[i].ctl_fd == fd) {
+      break;
+    }
+  }
+  vde_context_event_del(b->ctx, b->clients[i].ctl_ev);
+  b->clients[i].ctl_ev = NULL;
+  if (read(fd, &b->clients[i].remote_sa, sizeof(struct sockaddr_un)) !=
+      sizeof(struct sockaddr_un)) {
+    fprintf(stderr, "cannot get data socket\n");
+    b->failed = 1;
+    event_loopbreak();
+    return;
+  }
+  b->clients[i].connected = 1;
+  if (b->clients[0].connected && b->clients[1].connected) {
+    event_loopbreak();
+  }
+}
+
+static void bench_rx_cb(int fd, short events, void *arg)
+{
+  char buf[sizeof(struct eth_frame)];
+  vde2_bench *b = (vde2_bench *)arg;
+
+  if (recv(fd, buf, sizeof(buf), 0) != b->frame_len) {
+    return;
+  }
+  bench_hist_add(&b->hist, bench_now_ns() - b->sent_at);
+  if (--b->samples == 0) {
+    event_loopbreak();
+    return;
+  }
+  bench_send(b);
+}
+
+static void bench_timeout_cb(int fd, short events, void *arg)
+{
+  vde2_bench *b = (vde2_bench *)arg;
+
+  if (b->samples != b->last_samples) {
+    b->last_samples = b->samples;
+    return;
+  }
+  fprintf(stderr, "frames lost, %u samples left\n", b->samples);
+  b->failed = 1;
+  event_loopbreak();
+}
+
+static vde_sobj *bench_latency(vde2_bench *b, int frame_len,
+                               unsigned int samples)
+{
+  struct timeval tv = { RUN_TIMEOUT, 0 };
+  bench_allocs before, after;
+  vde_sobj *result;
+
+  memset(b->frame, 0, sizeof(b->frame));
+  memset(b->frame, 0xff, ETH_ALEN);
+  b->frame[ETH_ALEN + ETH_ALEN - 1] = 0x01;
+  b->frame_len = frame_len;
+  b->samples = samples;
+  b->last_samples = samples + 1;
+  bench_hist_init(&b->hist);
+
+  bench_allocs_get(b->ctx, &before);
+  b->timeout_ev = vde_context_timeout_add(b->ctx, VDE_EV_PERSIST, &tv,
+                                          &bench_timeout_cb, b);
+  bench_send(b);
+  event_dispatch();
+  vde_context_timeout_del(b->ctx, b->timeout_ev);
+  bench_allocs_get(b->ctx, &after);
+
+  if (b->failed) {
+    return NULL;
+  }
+
+  result = vde_sobj_new_hash();
+  vde_sobj_hash_insert(result, "frame_len", vde_sobj_new_int(frame_len));
+  vde_sobj_hash_insert(result, "latency", bench_hist_serialize(&b->hist));
+  vde_sobj_hash_insert(result, "pool_allocs_per_pkt",
+                       vde_sobj_new_double((double)(after.allocs -
+                                                    before.allocs) / samples));
+  vde_sobj_hash_insert(result, "malloc_per_pkt",
+                       vde_sobj_new_double((double)(after.misses -
+                                                    before.misses) / samples));
+  return result;
+}
+
+static void remove_dir(const char *dir)
+{
+  char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  DIR *d;
+  struct dirent *e;
+
+  d = opendir(dir);
+  if (d == NULL) {
+    return;
+  }
+  while ((e = readdir(d)) != NULL) {
+    if (strcmp(e->d_name, ".") && strcmp(e->d_name, "..")) {
+      snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+      unlink(path);
+    }
+  }
+  closedir(d);
+  rmdir(dir);
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-n samples] [-b batch]\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  int opt, rv = 1;
+  unsigned int i;
+  unsigned int samples = DEFAULT_SAMPLES;
+  int batch = 1;
+  char dir[] = "/tmp/vde3_bench.XXXXXX";
+  char params_str[128];
+  vde2_bench b;
+  vde_component *tr, *hub, *cm;
+  vde_sobj *params, *report, *result;
+
+  while ((opt = getopt(argc, argv, "n:b:")) != -1) {
+    switch (opt) {
+      case 'n':
+        samples = atoi(optarg);
+        break;
+      case 'b':
+        batch = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (samples == 0 || batch <= 0) {
+    usage(argv[0]);
+  }
+
+  memset(&b, 0, sizeof(b));
+  b.clients[0].ctl_fd = b.clients[0].data_fd = -1;
+  b.clients[1].ctl_fd = b.clients[1].data_fd = -1;
+  if (mkdtemp(dir) == NULL) {
+    fprintf(stderr, "cannot create socket directory\n");
+    return 1;
+  }
+  if (bench_context_new(&b.ctx)) {
+    fprintf(stderr, "cannot create context\n");
+    rmdir(dir);
+    return 1;
+  }
+
+  snprintf(params_str, sizeof(params_str), "{'path': '%s', 'batch': %d}",
+           dir, batch);
+  params = vde_sobj_from_string(params_str);
+  if (vde_context_new_component(b.ctx, VDE_TRANSPORT, "vde2", "tr", &tr,
+                                params)) {
+    vde_sobj_put(params);
+    fprintf(stderr, "cannot create transport\n");
+    goto out;
+  }
+  vde_sobj_put(params);
+
+  params = vde_sobj_from_string("{'stats_interval': 0}");
+  if (vde_context_new_component(b.ctx, VDE_ENGINE, "hub", "hub", &hub,
+                                params)) {
+    vde_sobj_put(params);
+    fprintf(stderr, "cannot create hub\n");
+    goto out;
+  }
+  vde_sobj_put(params);
+
+  params = vde_sobj_from_string("{'engine': 'hub', 'transport': 'tr'}");
+  if (vde_context_new_component(b.ctx, VDE_CONNECTION_MANAGER, "default",
+                                "cm", &cm, params) ||
+      vde_conn_manager_listen(cm)) {
+    vde_sobj_put(params);
+    fprintf(stderr, "cannot listen\n");
+    goto out;
+  }
+  vde_sobj_put(params);
+
+  if (client_connect(&b, &b.clients[0], dir, "a") ||
+      client_connect(&b, &b.clients[1], dir, "b")) {
+    fprintf(stderr, "cannot connect: %s\n", strerror(errno));
+    goto out;
+  }
+  event_dispatch();
+  if (b.failed) {
+    goto out;
+  }
+
+  b.rx_ev = vde_context_event_add(b.ctx, b.clients[1].data_fd,
+                                  VDE_EV_READ | VDE_EV_PERSIST, NULL,
+                                  &bench_rx_cb, &b);
+
+  report = bench_report_new("vde2_latency");
+  vde_sobj_hash_insert(report, "batch", vde_sobj_new_int(batch));
+  for (i = 0; i < NUM_SIZES; i++) {
+    result = bench_latency(&b, frame_sizes[i], samples);
+    if (result == NULL) {
+      vde_sobj_put(report);
+      goto out_ev;
+    }
+    bench_report_add(report, result);
+  }
+  bench_report_print(report);
+  rv = 0;
+
+out_ev:
+  vde_context_event_del(b.ctx, b.rx_ev);
+out:
+  client_close(&b.clients[0]);
+  client_close(&b.clients[1]);
+  bench_context_delete(b.ctx);
+  remove_dir(dir);
+  return rv;
+}
@@ -0,0 +1,204 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/*
+ * Traffic generator engine: it is linked into benchmark programs and
+ * registered by hand, so that it can be connected to other engines with
+ * vde_connect_engines_unqueued() or through a transport.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+#include <vde3.h>
+
+#include <vde3/module.h>
+#include <vde3/engine.h>
+#include <vde3/context.h>
+#include <vde3/connection.h>
+#include <vde3/packet.h>
+
+#include "bench.h"
+
+#define DEFAULT_PKT_LEN 60
+
+extern int vde_context_register_module(vde_context *ctx, vde_module *module);
+
+typedef struct {
+  vde_component *component;
+  vde_connection *conn;
+  vde_pkt *pkt; //!< template packet, every send takes a reference
+  uint64_t rx_pkts;
+  bench_trafgen_rx_cb rx_cb;
+  void *rx_arg;
+} trafgen;
+
+static int trafgen_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
+{
+  trafgen *tg = (trafgen *)arg;
+
+  tg->rx_pkts++;
+  if (tg->rx_cb) {
+    tg->rx_cb(tg->component, pkt, tg->rx_arg);
+  }
+  return 0;
+}
+
+static int trafgen_errorcb(vde_connection *conn, vde_pkt *pkt,
+                           vde_conn_error err, void *arg)
+{
+  trafgen *tg = (trafgen *)arg;
+
+  if (err == CONN_WRITE_DELAY) {
+    return 0;
+  }
+  tg->conn = NULL;
+  errno = EPIPE;
+  return -1;
+}
+
+static int trafgen_newconn(vde_component *component, vde_connection *conn,
+                           vde_request *req)
+{
+  trafgen *tg = vde_component_get_priv(component);
+
+  if (tg->conn != NULL) {
+    vde_error("%s: traffic generator already connected", __PRETTY_FUNCTION__);
+    errno = EBUSY;
+    return -1;
+  }
+  tg->conn = conn;
+  vde_connection_set_callbacks(conn, &trafgen_readcb, NULL, &trafgen_errorcb,
+                               (void *)tg);
+  vde_connection_set_pkt_properties(conn, 0, 0);
+  return 0;
+}
+
+static int trafgen_init(vde_component *component, vde_sobj *params)
+{
+  int pkt_len = DEFAULT_PKT_LEN;
+  vde_sobj *param;
+  trafgen *tg;
+
+  if (params && vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    param = vde_sobj_hash_lookup(params, "pkt_len");
+    if (param) {
+      if (!vde_sobj_is_type(param, vde_sobj_type_int) ||
+          vde_sobj_get_int(param) < sizeof(struct eth_hdr)) {
+        vde_error("%s: pkt_len must be an integer of at least %d",
+                  __PRETTY_FUNCTION__, (int)sizeof(struct eth_hdr));
+        errno = EINVAL;
+        return -1;
+      }
+      pkt_len = vde_sobj_get_int(param);
+    }
+  }
+
+  tg = (trafgen *)vde_calloc(sizeof(trafgen));
+  if (tg == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  tg->pkt = vde_pkt_new(vde_component_get_context(component), pkt_len, 0, 0);
+  if (tg->pkt == NULL) {
+    vde_free(tg);
+    errno = ENOMEM;
+    return -1;
+  }
+  // broadcast, so that switches flood it as well
+  memset(tg->pkt->payload, 0, pkt_len);
+  memset(tg->pkt->payload, 0xff, ETH_ALEN);
+  tg->pkt->payload[ETH_ALEN + ETH_ALEN - 1] = 0x01;
+  tg->pkt->hdr->pkt_len = pkt_len;
+  tg->component = component;
+
+  vde_component_set_priv(component, tg);
+  return 0;
+}
+
+static void trafgen_fini(vde_component *component)
+{
+  vde_connection *conn;
+  trafgen *tg = vde_component_get_priv(component);
+
+  if (tg->conn != NULL) {
+    conn = tg->conn;
+    tg->conn = NULL;
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+  }
+  vde_pkt_put(tg->pkt);
+  vde_free(tg);
+}
+
+void bench_trafgen_set_rx_cb(vde_component *trafgen_comp,
+                             bench_trafgen_rx_cb cb, void *arg)
+{
+  trafgen *tg = vde_component_get_priv(trafgen_comp);
+
+  tg->rx_cb = cb;
+  tg->rx_arg = arg;
+}
+
+int bench_trafgen_send(vde_component *trafgen_comp, unsigned int count)
+{
+  unsigned int i;
+  int sent = 0;
+  trafgen *tg = vde_component_get_priv(trafgen_comp);
+
+  for (i = 0; i < count; i++) {
+    if (tg->conn == NULL) {
+      return sent ? sent : -1;
+    }
+    if (vde_connection_write(tg->conn, tg->pkt) == 0) {
+      sent++;
+    }
+  }
+  return sent;
+}
+
+uint64_t bench_trafgen_rx_pkts(vde_component *trafgen_comp)
+{
+  trafgen *tg = vde_component_get_priv(trafgen_comp);
+
+  return tg->rx_pkts;
+}
+
+static component_ops trafgen_component_ops = {
+  .init = trafgen_init,
+  .fini = trafgen_fini,
+  .get_configuration = NULL,
+  .set_configuration = NULL,
+  .get_policy = NULL,
+  .set_policy = NULL,
+};
+
+static vde_module trafgen_module = {
+  .kind = VDE_ENGINE,
+  .family = "trafgen",
+  .cops = &trafgen_component_ops,
+  .eng_new_conn = &trafgen_newconn,
+};
+
+int bench_trafgen_register(vde_context *ctx)
+{
+  return vde_context_register_module(ctx, &trafgen_module);
+}
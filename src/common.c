@@ -15,6 +15,11 @@
  *
  */
 
+#include <limits.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
 #include <vde3.h>
 
 #include <vde3/common.h>
@@ -33,3 +38,142 @@ vde_sobj *vde_sobj_from_string(const char *str)
   json_tokener_free(tok);
   return obj;
 }
+
+vde_sobj_parser *vde_sobj_parser_new(void)
+{
+  struct json_tokener *tok;
+
+  tok = json_tokener_new();
+  if (tok == NULL) {
+    errno = ENOMEM;
+  }
+  return tok;
+}
+
+void vde_sobj_parser_delete(vde_sobj_parser *parser)
+{
+  json_tokener_free(parser);
+}
+
+void vde_sobj_parser_reset(vde_sobj_parser *parser)
+{
+  json_tokener_reset(parser);
+}
+
+vde_sobj *vde_sobj_parser_feed(vde_sobj_parser *parser, const char *buf,
+                               size_t len)
+{
+  struct json_object *obj;
+
+  vde_assert(len <= INT_MAX);
+
+  // the tokener keeps partial tokens in its own buffer between calls
+  obj = json_tokener_parse_ex(parser, buf, len);
+  if (obj == NULL) {
+    errno = (parser->err == json_tokener_continue) ? EAGAIN : EINVAL;
+  }
+  return obj;
+}
+
+// string characters that json-c escapes, with their escape sequence
+static const char *sobj_escape(unsigned char c, char *ubuf)
+{
+  switch (c) {
+    case '"': return "\\\"";
+    case '\\': return "\\\\";
+    case '/': return "\\/";
+    case '\b': return "\\b";
+    case '\f': return "\\f";
+    case '\n': return "\\n";
+    case '\r': return "\\r";
+    case '\t': return "\\t";
+  }
+  if (c < ' ') {
+    snprintf(ubuf, 7, "\\u%04x", c);
+    return ubuf;
+  }
+  return NULL;
+}
+
+static int sobj_serialize_string(const char *str, vde_sobj_write_func func,
+                                 void *arg)
+{
+  const char *run = str, *esc;
+  char ubuf[7];
+
+  if (func("\"", 1, arg)) {
+    return -1;
+  }
+  // unescaped runs are written as they are
+  for (; *str; str++) {
+    esc = sobj_escape((unsigned char)*str, ubuf);
+    if (esc == NULL) {
+      continue;
+    }
+    if ((str > run && func(run, str - run, arg)) ||
+        func(esc, strlen(esc), arg)) {
+      return -1;
+    }
+    run = str + 1;
+  }
+  if ((str > run && func(run, str - run, arg)) || func("\"", 1, arg)) {
+    return -1;
+  }
+  return 0;
+}
+
+int vde_sobj_serialize(vde_sobj *obj, vde_sobj_write_func func, void *arg)
+{
+  int i, len;
+  char buf[32];
+  const char *str;
+  struct json_object_iter iter;
+
+  if (obj == NULL) {
+    return func("null", 4, arg);
+  }
+
+  switch (json_object_get_type(obj)) {
+    case json_type_object:
+      if (func("{", 1, arg)) {
+        return -1;
+      }
+      i = 0;
+      json_object_object_foreachC(obj, iter) {
+        if (func(i ? ", " : " ", i ? 2 : 1, arg) ||
+            sobj_serialize_string(iter.key, func, arg) ||
+            func(": ", 2, arg) ||
+            vde_sobj_serialize(iter.val, func, arg)) {
+          return -1;
+        }
+        i++;
+      }
+      return func(" }", 2, arg);
+    case json_type_array:
+      if (func("[", 1, arg)) {
+        return -1;
+      }
+      len = json_object_array_length(obj);
+      for (i = 0; i < len; i++) {
+        if (func(i ? ", " : " ", i ? 2 : 1, arg) ||
+            vde_sobj_serialize(json_object_array_get_idx(obj, i), func,
+                               arg)) {
+          return -1;
+        }
+      }
+      return func(" ]", 2, arg);
+    case json_type_string:
+      return sobj_serialize_string(json_object_get_string(obj), func, arg);
+    case json_type_int:
+      len = snprintf(buf, sizeof(buf), "%" PRId64,
+                     (int64_t)json_object_get_int64(obj));
+      return func(buf, len, arg);
+    case json_type_boolean:
+      return json_object_get_boolean(obj) ? func("true", 4, arg) :
+                                            func("false", 5, arg);
+    default:
+      // doubles and nulls are short, let json-c format them
+      str = json_object_to_json_string(obj);
+      return func(str, strlen(str), arg);
+  }
+}
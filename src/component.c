@@ -16,10 +16,12 @@
  */
 
 #include <stdbool.h>
+#include <string.h>
 
 #include <vde3.h>
 
 #include <vde3/component.h>
+#include <vde3/context.h>
 #include <vde3/engine.h>
 #include <vde3/transport.h>
 #include <vde3/conn_manager.h>
@@ -30,8 +32,10 @@ struct vde_component {
   vde_quark qname;
   vde_component_kind kind;
   vde_char *family;
+  vde_sobj *params; //!< init parameters, saved by vde_context_config_save()
   int refcount;
   vde_hash *commands;
+  vde_command_lookup_func command_lookup;
   vde_hash *signals;
   void *priv;
   bool initialized;
@@ -48,6 +52,13 @@ struct vde_component {
   cm_accept_cb cm_accept_cb;
   cm_error_cb cm_error_cb;
   void *cm_cb_arg;
+  // connection manager - application specific callback:
+  vde_authorize_cb cm_authorize_cb;
+  void *cm_authorize_arg;
+  // connection manager - setup requested by the application, see
+  // vde_context_config_save()
+  bool cm_listening;
+  unsigned int cm_connects;
 };
 
 int vde_component_new(vde_component **component)
@@ -102,6 +113,7 @@ int vde_component_init(vde_component *component, vde_quark qname,
     return -1;
   }
 
+  component->params = vde_sobj_get(params);
   component->initialized = true;
   return 0;
 }
@@ -124,6 +136,8 @@ void vde_component_fini(vde_component *component)
   vde_assert(vde_hash_size(component->commands) == 0);
   vde_assert(vde_hash_size(component->signals) == 0);
 
+  vde_sobj_put(component->params);
+  component->params = NULL;
   component->initialized = false;
 }
 
@@ -137,21 +151,26 @@ void vde_component_delete(vde_component *component)
 
 void vde_component_get(vde_component *component, int *count)
 {
+  int refcount;
+
   vde_assert(component != NULL);
 
-  component->refcount++;
+  // references can be taken from any thread
+  refcount = __sync_add_and_fetch(&component->refcount, 1);
   if(count) {
-      *count = component->refcount;
+      *count = refcount;
   }
 }
 
 void vde_component_put(vde_component *component, int *count)
 {
+  int refcount;
+
   vde_assert(component != NULL);
 
-  component->refcount--;
+  refcount = __sync_sub_and_fetch(&component->refcount, 1);
   if(count) {
-      *count = component->refcount;
+      *count = refcount;
   }
 }
 
@@ -159,12 +178,13 @@ int vde_component_put_if_last(vde_component *component, int *count)
 {
   vde_assert(component != NULL);
 
-  if (component->refcount != 1) {
+  if (!__sync_bool_compare_and_swap(&component->refcount, 1, 0)) {
     return 1;
-  } else {
-    vde_component_put(component, count);
-    return 0;
   }
+  if(count) {
+      *count = 0;
+  }
+  return 0;
 }
 
 void *vde_component_get_priv(vde_component *component)
@@ -209,6 +229,20 @@ const char *vde_component_get_name(vde_component *component)
   return vde_quark_to_string(component->qname);
 }
 
+const char *vde_component_get_family(vde_component *component)
+{
+  vde_assert(component != NULL);
+
+  return component->family;
+}
+
+vde_sobj *vde_component_get_params(vde_component *component)
+{
+  vde_assert(component != NULL);
+
+  return component->params;
+}
+
 int vde_component_commands_register(vde_component *component,
                                     vde_command *commands)
 {
@@ -241,6 +275,23 @@ int vde_component_commands_deregister(vde_component *component,
   return 0;
 }
 
+int vde_component_commands_register_table(vde_component *component,
+                                          vde_command *commands,
+                                          vde_command_lookup_func lookup)
+{
+  vde_assert(lookup != NULL);
+
+  if (vde_component_commands_register(component, commands)) {
+    return -1;
+  }
+  // only one table is looked up, commands of others are found in the hash
+  if (component->command_lookup == NULL) {
+    component->command_lookup = lookup;
+  }
+
+  return 0;
+}
+
 int vde_component_command_add(vde_component *component,
                               vde_command *command)
 {
@@ -283,6 +334,8 @@ int vde_component_command_del(vde_component *component,
     errno = ENOENT;
     return -1;
   }
+  // the table would still return the removed command
+  component->command_lookup = NULL;
 
   return 0;
 }
@@ -291,10 +344,18 @@ vde_command *vde_component_command_get(vde_component *component,
                                        const char *name)
 {
   vde_quark qname;
+  vde_command *command;
 
   vde_assert(component != NULL);
   vde_assert(name != NULL);
 
+  if (component->command_lookup) {
+    command = component->command_lookup(name, strlen(name));
+    if (command) {
+      return command;
+    }
+  }
+
   qname = vde_quark_try_string(name);
 
   return vde_hash_lookup(component->commands, (long)qname);
@@ -367,7 +428,7 @@ int vde_component_signal_add(vde_component *component,
    * sharing the same callback list */
   dup = vde_signal_dup(signal);
   if (dup == NULL) {
-    vde_error("%s: cannot duplicate signal");
+    vde_error("%s: cannot duplicate signal", __PRETTY_FUNCTION__);
     errno = ENOMEM;
     return -1;
   }
@@ -468,6 +529,9 @@ void vde_component_signal_raise(vde_component *component, const char *signal,
 {
   vde_signal *sig;
 
+  // callbacks run in the raising thread, which must be the component's one
+  vde_assert(vde_context_is_current(component->ctx));
+
   sig = vde_component_signal_get(component, signal);
 
   if (!sig) {
@@ -477,6 +541,16 @@ void vde_component_signal_raise(vde_component *component, const char *signal,
   vde_signal_raise(sig, info, component);
 }
 
+void vde_component_signal_emit(vde_component *component, vde_signal *signal,
+                               vde_sobj *info)
+{
+  vde_assert(signal != NULL);
+  // callbacks run in the raising thread, which must be the component's one
+  vde_assert(vde_context_is_current(component->ctx));
+
+  vde_signal_raise(signal, info, component);
+}
+
 /*
  * Engine-specific functions.
  *
@@ -573,7 +647,11 @@ int vde_conn_manager_listen(vde_component *cm)
   vde_assert(cm != NULL);
   vde_assert(cm->kind == VDE_CONNECTION_MANAGER);
 
-  return cm->cm_listen(cm);
+  if (cm->cm_listen(cm)) {
+    return -1;
+  }
+  cm->cm_listening = true;
+  return 0;
 }
 
 /* XXX: memory handling, what happens to local_request/remote_request? should
@@ -586,6 +664,68 @@ int vde_conn_manager_connect(vde_component *cm, vde_request *local,
   vde_assert(cm != NULL);
   vde_assert(cm->kind == VDE_CONNECTION_MANAGER);
 
-  return cm->cm_connect(cm, local, remote, success_cb, error_cb, arg);
+  // counted first, the implementation can report a failure right away
+  cm->cm_connects++;
+  if (cm->cm_connect(cm, local, remote, success_cb, error_cb, arg)) {
+    cm->cm_connects--;
+    return -1;
+  }
+  return 0;
+}
+
+void vde_conn_manager_connect_failed(vde_component *cm)
+{
+  vde_assert(cm != NULL);
+  vde_assert(cm->kind == VDE_CONNECTION_MANAGER);
+  vde_assert(cm->cm_connects > 0);
+
+  cm->cm_connects--;
+}
+
+void vde_conn_manager_set_authorizer(vde_component *cm,
+                                     vde_authorize_cb authorize_cb,
+                                     void *arg)
+{
+  vde_assert(cm != NULL);
+  vde_assert(cm->kind == VDE_CONNECTION_MANAGER);
+
+  cm->cm_authorize_cb = authorize_cb;
+  cm->cm_authorize_arg = arg;
+}
+
+int vde_conn_manager_has_authorizer(vde_component *cm)
+{
+  vde_assert(cm != NULL);
+  vde_assert(cm->kind == VDE_CONNECTION_MANAGER);
+
+  return cm->cm_authorize_cb != NULL;
+}
+
+int vde_conn_manager_is_listening(vde_component *cm)
+{
+  vde_assert(cm != NULL);
+  vde_assert(cm->kind == VDE_CONNECTION_MANAGER);
+
+  return cm->cm_listening;
+}
+
+unsigned int vde_conn_manager_get_connects(vde_component *cm)
+{
+  vde_assert(cm != NULL);
+  vde_assert(cm->kind == VDE_CONNECTION_MANAGER);
+
+  return cm->cm_connects;
+}
+
+int vde_conn_manager_call_authorizer(vde_component *cm, vde_connection *conn,
+                                     vde_request *req)
+{
+  vde_assert(cm != NULL);
+  vde_assert(cm->kind == VDE_CONNECTION_MANAGER);
+
+  if (cm->cm_authorize_cb == NULL) {
+    return 0;
+  }
+  return cm->cm_authorize_cb(cm, conn, req, cm->cm_authorize_arg);
 }
 
@@ -0,0 +1,731 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/*
+ * Configuration snapshots.
+ *
+ * A configuration is a serializable object, e.g.:
+ *
+ * {"version": 1,
+ *  "trace_sample": 64,
+ *  "components": [["transport", "vde2", "tr1", {"path": "/tmp/vde3_sw"}],
+ *                 ["engine", "switch", "sw", null, 0],
+ *                 ["conn_manager", "default", "cm1",
+ *                  {"engine": "sw", "transport": "tr1"}]],
+ *  "listen": ["cm1"],
+ *  "connect": ["cm1", "cm1"],
+ *  "links": [["sw", "hub", 64]]}
+ *
+ * Every component is [kind, family, name, params], followed by the index of
+ * the worker running it if it is not run by the root context. Connection
+ * managers in "listen" are set in listen mode once every component has been
+ * created, the ones in "connect" initiate a connection each time they are
+ * listed. Links are local connections between engines: [engine1, engine2] when
+ * unqueued, [engine1, engine2, qlen] when queued. Connections which failed and
+ * links which have been closed are not saved.
+ */
+
+#include <vde3.h>
+
+#include <vde3/command.h>
+#include <vde3/component.h>
+#include <vde3/conn_manager.h>
+#include <vde3/context.h>
+#include <vde3/localconnection.h>
+#include <vde3/module.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CONFIG_VERSION 1
+
+// a component of the configuration being loaded
+typedef struct {
+  vde_component_kind kind;
+  const char *family;
+  const char *name;
+  vde_sobj *params;
+  vde_context *ctx; //!< the context or worker running the component
+  vde_component *component; //!< NULL until created
+} config_component;
+
+// components are created in this order, connection managers need both their
+// engine and their transport
+static const vde_component_kind config_order[] = {
+  VDE_TRANSPORT,
+  VDE_ENGINE,
+  VDE_CONNECTION_MANAGER,
+};
+
+/**
+ * @brief Write a string to a file, replacing it atomically
+ *
+ * @param file The file path
+ * @param str The string to write
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int config_write(const char *file, const char *str)
+{
+  FILE *f;
+  char *tmp_file;
+  int tmp_errno;
+
+  tmp_file = vde_strdup_printf("%s.tmp", file);
+  f = fopen(tmp_file, "w");
+  if (f == NULL) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create %s: %s", __PRETTY_FUNCTION__, tmp_file,
+              strerror(errno));
+    vde_free(tmp_file);
+    errno = tmp_errno;
+    return -1;
+  }
+
+  fputs(str, f);
+  fputc('\n', f);
+  if (fclose(f) || rename(tmp_file, file)) {
+    tmp_errno = errno;
+    vde_error("%s: cannot write %s: %s", __PRETTY_FUNCTION__, file,
+              strerror(errno));
+    unlink(tmp_file);
+    vde_free(tmp_file);
+    errno = tmp_errno;
+    return -1;
+  }
+
+  vde_free(tmp_file);
+  return 0;
+}
+
+/**
+ * @brief Read and parse a configuration file
+ *
+ * @param file The file path
+ *
+ * @return The configuration, NULL on error (and errno is set appropriately)
+ */
+static vde_sobj *config_read(const char *file)
+{
+  FILE *f;
+  struct stat st;
+  char *buf;
+  size_t len;
+  vde_sobj *config;
+  int tmp_errno;
+
+  f = fopen(file, "r");
+  if (f == NULL) {
+    tmp_errno = errno;
+    vde_error("%s: cannot open %s: %s", __PRETTY_FUNCTION__, file,
+              strerror(errno));
+    errno = tmp_errno;
+    return NULL;
+  }
+  if (fstat(fileno(f), &st)) {
+    tmp_errno = errno;
+    fclose(f);
+    errno = tmp_errno;
+    return NULL;
+  }
+
+  buf = (char *)vde_alloc(st.st_size + 1);
+  len = fread(buf, 1, st.st_size, f);
+  buf[len] = '\0';
+  fclose(f);
+
+  config = vde_sobj_from_string(buf);
+  vde_free(buf);
+  if (config == NULL || !vde_sobj_is_type(config, vde_sobj_type_hash)) {
+    vde_error("%s: %s is not a valid configuration", __PRETTY_FUNCTION__,
+              file);
+    vde_sobj_put(config);
+    errno = EINVAL;
+    return NULL;
+  }
+  return config;
+}
+
+int vde_context_config_save(vde_context *ctx, const char *file)
+{
+  vde_context *root, *comp_ctx;
+  vde_sobj *config, *components, *listen, *connect, *links, *entry;
+  vde_ordhash_entry *iter;
+  vde_list *link_iter;
+  vde_component *component;
+  vde_context_link *link;
+  const char *name;
+  unsigned int i, connects;
+  int rv;
+
+  if (ctx == NULL || ctx->initialized != 1 || file == NULL) {
+    vde_error("%s: cannot save configuration", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  root = vde_context_get_root(ctx);
+
+  components = vde_sobj_new_array();
+  listen = vde_sobj_new_array();
+  connect = vde_sobj_new_array();
+  links = vde_sobj_new_array();
+
+  pthread_mutex_lock(&root->components_lock);
+  for (iter = vde_ordhash_first(root->components); iter != NULL;
+       iter = vde_ordhash_next(iter)) {
+    component = vde_ordhash_entry_lookup(root->components, iter);
+    name = vde_component_get_name(component);
+
+    entry = vde_sobj_new_array();
+    vde_sobj_array_add(entry, vde_sobj_new_string(
+        vde_module_kind_to_string(vde_component_get_kind(component))));
+    vde_sobj_array_add(entry,
+                       vde_sobj_new_string(vde_component_get_family(component)));
+    vde_sobj_array_add(entry, vde_sobj_new_string(name));
+    vde_sobj_array_add(entry, vde_sobj_get(vde_component_get_params(component)));
+    comp_ctx = vde_component_get_context(component);
+    for (i = 0; comp_ctx != root && i < root->nworkers; i++) {
+      if (root->workers[i] == comp_ctx) {
+        vde_sobj_array_add(entry, vde_sobj_new_int(i));
+        break;
+      }
+    }
+    vde_sobj_array_add(components, entry);
+
+    if (vde_component_get_kind(component) == VDE_CONNECTION_MANAGER) {
+      if (vde_conn_manager_is_listening(component)) {
+        vde_sobj_array_add(listen, vde_sobj_new_string(name));
+      }
+      connects = vde_conn_manager_get_connects(component);
+      for (i = 0; i < connects; i++) {
+        vde_sobj_array_add(connect, vde_sobj_new_string(name));
+      }
+    }
+  }
+
+  // links are kept newest first, saved in the order they were made
+  for (link_iter = vde_list_last(root->links); link_iter != NULL;
+       link_iter = vde_list_prev(link_iter)) {
+    link = vde_list_get_data(link_iter);
+    entry = vde_sobj_new_array();
+    vde_sobj_array_add(entry,
+                       vde_sobj_new_string(vde_quark_to_string(link->engine1)));
+    vde_sobj_array_add(entry,
+                       vde_sobj_new_string(vde_quark_to_string(link->engine2)));
+    if (link->qlen) {
+      vde_sobj_array_add(entry, vde_sobj_new_int(link->qlen));
+    }
+    vde_sobj_array_add(links, entry);
+  }
+  pthread_mutex_unlock(&root->components_lock);
+
+  config = vde_sobj_new_hash();
+  vde_sobj_hash_insert(config, "version", vde_sobj_new_int(CONFIG_VERSION));
+  if (root->trace_sample) {
+    vde_sobj_hash_insert(config, "trace_sample",
+                         vde_sobj_new_int(root->trace_sample));
+  }
+  vde_sobj_hash_insert(config, "components", components);
+  vde_sobj_hash_insert(config, "listen", listen);
+  vde_sobj_hash_insert(config, "connect", connect);
+  vde_sobj_hash_insert(config, "links", links);
+
+  rv = config_write(file, vde_sobj_to_string(config));
+  vde_sobj_put(config);
+  return rv;
+}
+
+// requests and callbacks given to the connect being saved are not kept:
+// requests carry nothing yet, failures of the replayed ones are reported here
+static void config_connect_error_cb(vde_component *cm, void *arg)
+{
+  vde_warning("%s: connection of %s failed", __PRETTY_FUNCTION__,
+              vde_component_get_name(cm));
+}
+
+/**
+ * @brief Check a configuration component entry and fill cc from it
+ *
+ * @param root The root context the configuration is loaded into
+ * @param entry The component entry
+ * @param cc The component to fill
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int config_component_parse(vde_context *root, vde_sobj *entry,
+                                  config_component *cc)
+{
+  vde_sobj *kind, *family, *name, *worker;
+  vde_component *component;
+  int len, idx;
+
+  if (!vde_sobj_is_type(entry, vde_sobj_type_array)) {
+    goto err_einval;
+  }
+  len = vde_sobj_array_length(entry);
+  if (len != 4 && len != 5) {
+    goto err_einval;
+  }
+
+  kind = vde_sobj_array_get_idx(entry, 0);
+  family = vde_sobj_array_get_idx(entry, 1);
+  name = vde_sobj_array_get_idx(entry, 2);
+  cc->params = vde_sobj_array_get_idx(entry, 3);
+  if (!vde_sobj_is_type(kind, vde_sobj_type_string) ||
+      !vde_sobj_is_type(family, vde_sobj_type_string) ||
+      !vde_sobj_is_type(name, vde_sobj_type_string) ||
+      vde_module_kind_from_string(vde_sobj_get_string(kind), &cc->kind)) {
+    goto err_einval;
+  }
+  if (cc->params != NULL &&
+      !vde_sobj_is_type(cc->params, vde_sobj_type_hash)) {
+    goto err_einval;
+  }
+  cc->family = vde_sobj_get_string(family);
+  cc->name = vde_sobj_get_string(name);
+
+  cc->ctx = root;
+  if (len == 5) {
+    worker = vde_sobj_array_get_idx(entry, 4);
+    if (!vde_sobj_is_type(worker, vde_sobj_type_int)) {
+      goto err_einval;
+    }
+    idx = vde_sobj_get_int(worker);
+    cc->ctx = idx < 0 ? NULL : vde_context_get_worker(root, idx);
+    if (cc->ctx == NULL) {
+      vde_error("%s: component %s: no worker %d", __PRETTY_FUNCTION__,
+                cc->name, idx);
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  if ((component = vde_context_get_component(root, cc->name)) != NULL) {
+    vde_component_put(component, NULL);
+    vde_error("%s: component %s already exists", __PRETTY_FUNCTION__,
+              cc->name);
+    errno = EEXIST;
+    return -1;
+  }
+  // modules are loaded now, no component is created if one is missing
+  if (vde_context_load_module(root, cc->kind, cc->family)) {
+    return -1;
+  }
+  return 0;
+
+err_einval:
+  vde_error("%s: invalid component entry %s", __PRETTY_FUNCTION__,
+            vde_sobj_to_string(entry));
+  errno = EINVAL;
+  return -1;
+}
+
+/**
+ * @brief Look up a component of the configuration by name
+ *
+ * @param names The hash of configuration components by name
+ * @param name The name, a string sobj
+ * @param kind The expected kind
+ *
+ * @return The component, NULL if not found or of another kind
+ */
+static config_component *config_component_lookup(vde_hash *names,
+                                                 vde_sobj *name,
+                                                 vde_component_kind kind)
+{
+  config_component *cc;
+
+  if (!vde_sobj_is_type(name, vde_sobj_type_string)) {
+    return NULL;
+  }
+  cc = vde_hash_lookup(names, vde_sobj_get_string(name));
+  return cc != NULL && cc->kind == kind ? cc : NULL;
+}
+
+/**
+ * @brief Check every name in a list of connection managers of the
+ * configuration
+ *
+ * @param names The hash of configuration components by name
+ * @param list The list, can be NULL
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int config_cm_list_check(vde_hash *names, vde_sobj *list)
+{
+  int i;
+
+  if (list == NULL) {
+    return 0;
+  }
+  if (!vde_sobj_is_type(list, vde_sobj_type_array)) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (i = 0; i < vde_sobj_array_length(list); i++) {
+    if (!config_component_lookup(names, vde_sobj_array_get_idx(list, i),
+                                 VDE_CONNECTION_MANAGER)) {
+      vde_error("%s: %s is not a connection manager of the configuration",
+                __PRETTY_FUNCTION__,
+                vde_sobj_to_string(vde_sobj_array_get_idx(list, i)));
+      errno = EINVAL;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Check the links of the configuration
+ *
+ * @param names The hash of configuration components by name
+ * @param links The links, can be NULL
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int config_links_check(vde_hash *names, vde_sobj *links)
+{
+  vde_sobj *link, *qlen;
+  int i, len;
+
+  if (links == NULL) {
+    return 0;
+  }
+  if (!vde_sobj_is_type(links, vde_sobj_type_array)) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (i = 0; i < vde_sobj_array_length(links); i++) {
+    link = vde_sobj_array_get_idx(links, i);
+    if (!vde_sobj_is_type(link, vde_sobj_type_array)) {
+      goto err_einval;
+    }
+    len = vde_sobj_array_length(link);
+    if (len != 2 && len != 3) {
+      goto err_einval;
+    }
+    if (!config_component_lookup(names, vde_sobj_array_get_idx(link, 0),
+                                 VDE_ENGINE) ||
+        !config_component_lookup(names, vde_sobj_array_get_idx(link, 1),
+                                 VDE_ENGINE)) {
+      goto err_einval;
+    }
+    qlen = vde_sobj_array_get_idx(link, 2);
+    if (len == 3 && (!vde_sobj_is_type(qlen, vde_sobj_type_int) ||
+                     vde_sobj_get_int(qlen) <= 0)) {
+      goto err_einval;
+    }
+  }
+  return 0;
+
+err_einval:
+  vde_error("%s: invalid link %s", __PRETTY_FUNCTION__,
+            vde_sobj_to_string(link));
+  errno = EINVAL;
+  return -1;
+}
+
+int vde_context_config_load(vde_context *ctx, const char *file)
+{
+  vde_context *root;
+  vde_sobj *config, *version, *trace_sample, *components, *listen, *connect;
+  vde_sobj *links, *link;
+  config_component *ccs, *cc, *cc2;
+  vde_hash *names;
+  unsigned int k;
+  int i, n, rv = -1, tmp_errno;
+
+  if (ctx == NULL || ctx->initialized != 1 || file == NULL) {
+    vde_error("%s: cannot load configuration", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  root = vde_context_get_root(ctx);
+  if (vde_context_workers_running(root)) {
+    vde_error("%s: cannot load configuration while workers are running",
+              __PRETTY_FUNCTION__);
+    errno = EBUSY;
+    return -1;
+  }
+
+  config = config_read(file);
+  if (config == NULL) {
+    return -1;
+  }
+
+  version = vde_sobj_hash_lookup(config, "version");
+  trace_sample = vde_sobj_hash_lookup(config, "trace_sample");
+  components = vde_sobj_hash_lookup(config, "components");
+  listen = vde_sobj_hash_lookup(config, "listen");
+  connect = vde_sobj_hash_lookup(config, "connect");
+  links = vde_sobj_hash_lookup(config, "links");
+  if (!version || !vde_sobj_is_type(version, vde_sobj_type_int) ||
+      vde_sobj_get_int(version) != CONFIG_VERSION ||
+      (trace_sample && (!vde_sobj_is_type(trace_sample, vde_sobj_type_int) ||
+                        vde_sobj_get_int(trace_sample) < 0)) ||
+      !components || !vde_sobj_is_type(components, vde_sobj_type_array)) {
+    vde_error("%s: unsupported configuration %s", __PRETTY_FUNCTION__, file);
+    vde_sobj_put(config);
+    errno = EINVAL;
+    return -1;
+  }
+
+  // the whole configuration is checked before creating anything
+  n = vde_sobj_array_length(components);
+  ccs = (config_component *)vde_calloc(n * sizeof(config_component));
+  names = vde_hash_init_string();
+  for (i = 0; i < n; i++) {
+    cc = &ccs[i];
+    if (config_component_parse(root,
+                               vde_sobj_array_get_idx(components, i), cc)) {
+      goto out;
+    }
+    if (vde_hash_lookup(names, cc->name)) {
+      vde_error("%s: duplicate component %s", __PRETTY_FUNCTION__, cc->name);
+      errno = EEXIST;
+      goto out;
+    }
+    vde_hash_insert(names, cc->name, cc);
+  }
+  if (config_cm_list_check(names, listen) ||
+      config_cm_list_check(names, connect) ||
+      config_links_check(names, links)) {
+    goto out;
+  }
+
+  // components, in dependency order
+  for (k = 0; k < sizeof(config_order) / sizeof(config_order[0]); k++) {
+    for (i = 0; i < n; i++) {
+      cc = &ccs[i];
+      if (cc->kind != config_order[k]) {
+        continue;
+      }
+      if (vde_context_new_component(cc->ctx, cc->kind, cc->family, cc->name,
+                                    &cc->component, cc->params)) {
+        cc->component = NULL;
+        goto out;
+      }
+    }
+  }
+
+  for (i = 0; links && i < vde_sobj_array_length(links); i++) {
+    link = vde_sobj_array_get_idx(links, i);
+    cc = config_component_lookup(names, vde_sobj_array_get_idx(link, 0),
+                                 VDE_ENGINE);
+    cc2 = config_component_lookup(names, vde_sobj_array_get_idx(link, 1),
+                                  VDE_ENGINE);
+    if (vde_sobj_array_length(link) == 3 ?
+        vde_connect_engines_queued(root, cc->component, NULL, cc2->component,
+            NULL, vde_sobj_get_int(vde_sobj_array_get_idx(link, 2))) :
+        vde_connect_engines_unqueued(root, cc->component, NULL,
+                                     cc2->component, NULL)) {
+      goto out;
+    }
+  }
+
+  for (i = 0; listen && i < vde_sobj_array_length(listen); i++) {
+    cc = config_component_lookup(names, vde_sobj_array_get_idx(listen, i),
+                                 VDE_CONNECTION_MANAGER);
+    if (vde_conn_manager_listen(cc->component)) {
+      goto out;
+    }
+  }
+  for (i = 0; connect && i < vde_sobj_array_length(connect); i++) {
+    cc = config_component_lookup(names, vde_sobj_array_get_idx(connect, i),
+                                 VDE_CONNECTION_MANAGER);
+    if (vde_conn_manager_connect(cc->component, NULL, NULL, NULL,
+                                 &config_connect_error_cb, NULL)) {
+      goto out;
+    }
+  }
+
+  if (trace_sample) {
+    vde_context_set_trace_sample(root, vde_sobj_get_int(trace_sample));
+  }
+  rv = 0;
+
+out:
+  tmp_errno = errno;
+  if (rv) {
+    vde_error("%s: cannot load configuration %s", __PRETTY_FUNCTION__, file);
+    // nothing is left behind, connection managers go first
+    for (k = sizeof(config_order) / sizeof(config_order[0]); k-- > 0; ) {
+      for (i = 0; i < n; i++) {
+        if (ccs[i].component && ccs[i].kind == config_order[k]) {
+          vde_context_component_del(root, ccs[i].component);
+        }
+      }
+    }
+  }
+  vde_hash_delete(names);
+  vde_free(ccs);
+  vde_sobj_put(config);
+  errno = tmp_errno;
+  return rv;
+}
+
+/*
+ * Engine state, as opposed to configuration, is what an engine has learned
+ * while running, e.g. the forwarding table of a switch. It is carried across a
+ * hot restart as [[name, state], ...] for the components implementing the
+ * "state_save" and "state_load" commands.
+ */
+vde_sobj *vde_context_state_save(vde_context *ctx)
+{
+  vde_context *root;
+  vde_sobj *states, *entry, *in, *out;
+  vde_ordhash_entry *iter;
+  vde_component *component;
+  vde_command *command;
+
+  vde_assert(ctx != NULL);
+
+  root = vde_context_get_root(ctx);
+  states = vde_sobj_new_array();
+  in = vde_sobj_new_array();
+
+  pthread_mutex_lock(&root->components_lock);
+  for (iter = vde_ordhash_first(root->components); iter != NULL;
+       iter = vde_ordhash_next(iter)) {
+    component = vde_ordhash_entry_lookup(root->components, iter);
+    command = vde_component_command_get(component, "state_save");
+    if (command == NULL) {
+      continue;
+    }
+    out = NULL;
+    if (vde_command_get_func(command)(component, in, &out)) {
+      vde_warning("%s: cannot save state of %s", __PRETTY_FUNCTION__,
+                  vde_component_get_name(component));
+      if (out != NULL) {
+        vde_sobj_put(out);
+      }
+      continue;
+    }
+    entry = vde_sobj_new_array();
+    vde_sobj_array_add(entry,
+                       vde_sobj_new_string(vde_component_get_name(component)));
+    vde_sobj_array_add(entry, out);
+    vde_sobj_array_add(states, entry);
+  }
+  pthread_mutex_unlock(&root->components_lock);
+
+  vde_sobj_put(in);
+  return states;
+}
+
+int vde_context_state_load(vde_context *ctx, vde_sobj *states)
+{
+  vde_sobj *entry, *name, *in, *out;
+  vde_component *component;
+  vde_command *command;
+  int i, rv = 0;
+
+  vde_assert(ctx != NULL);
+
+  if (!states || !vde_sobj_is_type(states, vde_sobj_type_array)) {
+    vde_error("%s: state is not an array", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (i = 0; i < vde_sobj_array_length(states); i++) {
+    entry = vde_sobj_array_get_idx(states, i);
+    name = NULL;
+    if (entry && vde_sobj_is_type(entry, vde_sobj_type_array) &&
+        vde_sobj_array_length(entry) == 2) {
+      name = vde_sobj_array_get_idx(entry, 0);
+    }
+    if (!name || !vde_sobj_is_type(name, vde_sobj_type_string)) {
+      vde_error("%s: invalid state entry %d", __PRETTY_FUNCTION__, i);
+      errno = EINVAL;
+      rv = -1;
+      continue;
+    }
+    // components gone or changed since the state was saved are skipped
+    component = vde_context_get_component(ctx, vde_sobj_get_string(name));
+    command = component ? vde_component_command_get(component, "state_load")
+                        : NULL;
+    if (command == NULL) {
+      if (component) {
+        vde_component_put(component, NULL);
+      }
+      vde_warning("%s: cannot load state of %s", __PRETTY_FUNCTION__,
+                  vde_sobj_get_string(name));
+      continue;
+    }
+    // the command takes the state serialized, as when called remotely
+    in = vde_sobj_new_array();
+    vde_sobj_array_add(in, vde_sobj_new_string(
+        vde_sobj_to_string(vde_sobj_array_get_idx(entry, 1))));
+    out = NULL;
+    if (vde_command_get_func(command)(component, in, &out)) {
+      vde_error("%s: cannot load state of %s", __PRETTY_FUNCTION__,
+                vde_sobj_get_string(name));
+      rv = -1;
+    }
+    if (out != NULL) {
+      vde_sobj_put(out);
+    }
+    vde_sobj_put(in);
+    vde_component_put(component, NULL);
+  }
+  return rv;
+}
+
+vde_sobj *vde_context_handoff_state(vde_context *ctx)
+{
+  vde_context *root;
+
+  vde_assert(ctx != NULL);
+
+  root = vde_context_get_root(ctx);
+  if (root->handoff_state != NULL) {
+    vde_sobj_get(root->handoff_state);
+    return root->handoff_state;
+  }
+  return vde_context_state_save(root);
+}
+
+void vde_context_handoff_keep(vde_context *ctx, vde_sobj *state)
+{
+  vde_context *root;
+
+  vde_assert(ctx != NULL);
+
+  root = vde_context_get_root(ctx);
+  if (root->handoff_state == NULL) {
+    vde_sobj_get(state);
+    root->handoff_state = state;
+  }
+}
+
+int vde_context_handoff_load(vde_context *ctx, vde_sobj *states)
+{
+  vde_context *root;
+
+  vde_assert(ctx != NULL);
+
+  root = vde_context_get_root(ctx);
+  if (root->handoff_loaded) {
+    return 0;
+  }
+  root->handoff_loaded = 1;
+  return vde_context_state_load(root, states);
+}
@@ -15,6 +15,9 @@
  *
  */
 
+#include <stdint.h>
+#include <string.h>
+
 #include <vde3.h>
 
 #include <vde3/module.h>
@@ -22,6 +25,23 @@
 #include <vde3/transport.h>
 #include <vde3/conn_manager.h>
 #include <vde3/context.h>
+#include <vde3/connection.h>
+#include <vde3/qdisc.h>
+#include <vde3/spsc.h>
+#include <vde3/trace.h>
+
+#include <conn_manager_commands.h>
+
+// connections handed to the engine for each pass over the authorized ones, set
+// with "accept_budget" param; the following ones wait for the next pass so that
+// a burst of reconnections doesn't hold the event loop
+#define DEFAULT_ACCEPT_BUDGET 16
+#define MAX_ACCEPT_BUDGET 4096
+
+// authorizations running at once in each worker with "auth_offload"
+#define AUTH_INFLIGHT 256
+// ms before submitting again authorizations a worker couldn't take
+#define AUTH_RETRY_MS 10
 
 enum vde_conn_state {
   CONNECT_WAIT,
@@ -29,10 +49,14 @@ enum vde_conn_state {
   AUTHORIZATION_REQ_WAIT,
   AUTHORIZATION_REPLY_SENT,
   AUTHORIZATION_REPLY_WAIT,
+  LOCAL_AUTHORIZATION_WAIT, //!< waiting for a worker
+  LOCAL_AUTHORIZATION_RUN, //!< the authorizer is running in a worker
   NOT_AUTHORIZED,
   AUTHORIZED
 };
 
+typedef struct conn_manager conn_manager;
+
 struct pending_conn {
   vde_connection *conn;
   vde_request *lreq;
@@ -41,32 +65,122 @@ struct pending_conn {
   vde_connect_success_cb success_cb;
   vde_connect_error_cb error_cb;
   void *connect_cb_arg;
+  conn_manager *cm;
+  unsigned int worker; //!< running the authorizer
+  int auth_result; //!< set by the worker, the rest is not touched there
+  int closed; //!< the transport reported a fatal error
+  int be_closed; //!< the backend is gone, only the connection is left
+  int connecting; //!< initiated by conn_manager_connect()
+  struct pending_conn *next; //!< in a pending_queue
 };
 
 typedef struct {
+  struct pending_conn *head;
+  struct pending_conn *tail;
+  unsigned int length;
+} pending_queue;
+
+struct conn_manager {
   vde_component *transport;
   vde_component *engine;
   vde_component *component;
-  vde_list *pending_conns;
+  vde_hash *pending_conns; //!< keyed by connection
   int do_remote_authorization;
-} conn_manager;
+  unsigned int accept_budget;
+  pending_queue auth_queue; //!< waiting for a worker to authorize them
+  pending_queue admit_queue; //!< authorized or not, waiting for a pass
+  pending_queue close_queue; //!< closed while their authorizer runs
+  // wakes up the connection manager for a pass and for authorization results
+  vde_doorbell doorbell;
+  void *doorbell_ev;
+  void *retry_timeout; //!< armed when a worker couldn't take authorizations
+  // authorizations offloaded to context workers, each one sends back results
+  // through its own ring
+  unsigned int nworkers;
+  unsigned int next_worker;
+  vde_spsc_ring **auth_done;
+  unsigned int *auth_inflight;
+  // metrics, from transport setup to engine
+  vde_trace_hist latency;
+  uint64_t accepted;
+  uint64_t connected;
+  uint64_t rejected;
+  uint64_t deferred; //!< passes which left connections for the next one
+};
 
-static struct pending_conn *lookup_pending_conn(conn_manager *cm,
-                                                vde_connection *conn)
+static inline void pending_queue_push(pending_queue *queue,
+                                      struct pending_conn *pc)
+{
+  pc->next = NULL;
+  if (queue->tail != NULL) {
+    queue->tail->next = pc;
+  } else {
+    queue->head = pc;
+  }
+  queue->tail = pc;
+  queue->length++;
+}
+
+static inline struct pending_conn *pending_queue_pop(pending_queue *queue)
 {
-  struct pending_conn *pc = NULL;
+  struct pending_conn *pc = queue->head;
 
-  vde_list *iter = vde_list_first(cm->pending_conns);
-  while (iter != NULL) {
-    pc = vde_list_get_data(iter);
-    if (pc->conn == conn) {
-      return pc;
+  if (pc != NULL) {
+    queue->head = pc->next;
+    if (queue->head == NULL) {
+      queue->tail = NULL;
     }
-    iter = vde_list_next(iter);
+    queue->length--;
+  }
+  return pc;
+}
+
+static void pending_queue_remove(pending_queue *queue,
+                                 struct pending_conn *pc)
+{
+  struct pending_conn **iter = &queue->head;
+
+  while (*iter != NULL && *iter != pc) {
+    iter = &(*iter)->next;
   }
-  return NULL;
+  if (*iter == NULL) {
+    return;
+  }
+  *iter = pc->next;
+  if (queue->tail == pc) {
+    queue->tail = NULL;
+    for (pc = queue->head; pc != NULL; pc = pc->next) {
+      queue->tail = pc;
+    }
+  }
+  queue->length--;
+}
+
+static struct pending_conn *lookup_pending_conn(conn_manager *cm,
+                                                vde_connection *conn)
+{
+  return vde_hash_lookup(cm->pending_conns, conn);
 }
 
+static void pending_conn_del(conn_manager *cm, struct pending_conn *pc)
+{
+  vde_hash_remove(cm->pending_conns, pc->conn);
+  vde_free(pc); // XXX: free requests here ?
+}
+
+// drop a connection no engine has been given, its backend might be gone
+// already, see conn_manager_close_pass()
+static void pending_conn_close(conn_manager *cm, struct pending_conn *pc)
+{
+  vde_connection *conn = pc->conn;
+  int be_closed = pc->be_closed;
+
+  pending_conn_del(cm, pc);
+  if (!be_closed) {
+    vde_connection_fini(conn);
+  }
+  vde_connection_delete(conn);
+}
 
 // XXX: consider having an application callback here, to be called for each new
 //      connection
@@ -77,6 +191,248 @@ int conn_manager_listen(vde_component *component)
   return vde_transport_listen(cm->transport);
 }
 
+// a connection is rejected, the one initiated by connect is not saved with
+// the configuration anymore
+static void pending_conn_reject(conn_manager *cm, struct pending_conn *pc)
+{
+  cm->rejected++;
+  if (pc->connecting) {
+    vde_conn_manager_connect_failed(cm->component);
+  }
+  if (pc->error_cb) {
+    pc->error_cb(cm->component, pc->connect_cb_arg);
+  }
+}
+
+static void conn_manager_admit(conn_manager *cm, struct pending_conn *pc)
+{
+  pending_queue_push(&cm->admit_queue, pc);
+  if (cm->admit_queue.length == 1) {
+    vde_doorbell_ring(&cm->doorbell);
+  }
+}
+
+// runs in a worker thread, only touches pc->auth_result and the ring the
+// worker owns
+static void conn_manager_auth_job(vde_context *worker, void *arg)
+{
+  struct pending_conn *pc = (struct pending_conn *)arg;
+  conn_manager *cm = pc->cm;
+  struct pending_conn **slot;
+
+  pc->auth_result = vde_conn_manager_call_authorizer(cm->component, pc->conn,
+                                                     pc->lreq);
+
+  // cannot be full: a worker never has more than AUTH_INFLIGHT jobs
+  slot = vde_spsc_ring_reserve(cm->auth_done[pc->worker]);
+  vde_assert(slot != NULL);
+  *slot = pc;
+  if (vde_spsc_ring_commit(cm->auth_done[pc->worker])) {
+    vde_doorbell_ring(&cm->doorbell);
+  }
+}
+
+// until the engine sets its own callbacks
+static int pending_conn_read_cb(vde_connection *conn, vde_pkt *pkt, void *arg)
+{
+  // XXX: frames received before admission are dropped
+  return 0;
+}
+
+static int pending_conn_error_cb(vde_connection *conn, vde_pkt *pkt,
+                                 vde_conn_error err, void *arg)
+{
+  struct pending_conn *pc = (struct pending_conn *)arg;
+  conn_manager *cm = pc->cm;
+
+  if (err == CONN_READ_DELAY || err == CONN_WRITE_DELAY) {
+    return 0;
+  }
+
+  if (pc->state == LOCAL_AUTHORIZATION_RUN) {
+    // the worker is looking at the connection, which can't be deleted before
+    // the authorization is back. Its backend is closed by the next pass, out
+    // of the transport callback, so that the error stops firing
+    if (!pc->closed) {
+      pc->closed = 1;
+      pending_queue_push(&cm->close_queue, pc);
+      if (cm->close_queue.length == 1) {
+        vde_doorbell_ring(&cm->doorbell);
+      }
+    }
+    return 0;
+  }
+
+  if (pc->state == LOCAL_AUTHORIZATION_WAIT) {
+    pending_queue_remove(&cm->auth_queue, pc);
+  } else {
+    pending_queue_remove(&cm->admit_queue, pc);
+  }
+  pending_conn_reject(cm, pc);
+  pending_conn_del(cm, pc);
+  // the transport closes the connection
+  errno = EPIPE;
+  return -1;
+}
+
+static void conn_manager_authorize(conn_manager *cm, struct pending_conn *pc)
+{
+  vde_connection_set_callbacks(pc->conn, &pending_conn_read_cb, NULL,
+                               &pending_conn_error_cb, (void *)pc);
+
+  if (!vde_conn_manager_has_authorizer(cm->component)) {
+    pc->state = AUTHORIZED;
+  } else if (cm->nworkers > 0) {
+    pc->state = LOCAL_AUTHORIZATION_WAIT;
+    pending_queue_push(&cm->auth_queue, pc);
+    if (cm->auth_queue.length == 1) {
+      vde_doorbell_ring(&cm->doorbell);
+    }
+    return;
+  } else if (vde_conn_manager_call_authorizer(cm->component, pc->conn,
+                                              pc->lreq)) {
+    pc->state = NOT_AUTHORIZED;
+  } else {
+    pc->state = AUTHORIZED;
+  }
+  conn_manager_admit(cm, pc);
+}
+
+static void conn_manager_retry_cb(int fd, short events, void *arg)
+{
+  conn_manager *cm = (conn_manager *)arg;
+
+  // one-shot timeouts must be deleted once fired
+  vde_context_timeout_del(vde_component_get_context(cm->component),
+                          cm->retry_timeout);
+  cm->retry_timeout = NULL;
+  vde_doorbell_ring(&cm->doorbell);
+}
+
+// hand out waiting authorizations round robin to workers with room for them
+static void conn_manager_auth_submit(conn_manager *cm)
+{
+  struct pending_conn *pc;
+  unsigned int i, k;
+  struct timeval tv = { 0, AUTH_RETRY_MS * 1000 };
+  vde_context *ctx = vde_component_get_context(cm->component);
+
+  while (cm->auth_queue.head != NULL) {
+    for (i = 0; i < cm->nworkers; i++) {
+      k = (cm->next_worker + i) % cm->nworkers;
+      if (cm->auth_inflight[k] < AUTH_INFLIGHT) {
+        break;
+      }
+    }
+    if (i == cm->nworkers) {
+      // all workers busy, submitted again when results come back
+      return;
+    }
+    cm->next_worker = (k + 1) % cm->nworkers;
+
+    pc = cm->auth_queue.head;
+    pc->worker = k;
+    pc->state = LOCAL_AUTHORIZATION_RUN;
+    // the job keeps the connection manager alive
+    vde_component_get(cm->component, NULL);
+    cm->auth_inflight[k]++;
+    if (vde_context_worker_call(vde_context_get_worker(ctx, k),
+                                &conn_manager_auth_job, pc)) {
+      cm->auth_inflight[k]--;
+      vde_component_put(cm->component, NULL);
+      pc->state = LOCAL_AUTHORIZATION_WAIT;
+      // the worker call queue is full, nothing might ring the doorbell again
+      if (cm->retry_timeout == NULL) {
+        cm->retry_timeout = vde_context_timeout_add(ctx, 0, &tv,
+                                                    &conn_manager_retry_cb,
+                                                    (void *)cm);
+      }
+      vde_warning("%s: cannot submit authorization to worker %u",
+                  __PRETTY_FUNCTION__, k);
+      return;
+    }
+    pending_queue_pop(&cm->auth_queue);
+  }
+}
+
+static void conn_manager_auth_collect(conn_manager *cm)
+{
+  struct pending_conn **slot, *pc;
+  unsigned int k;
+
+  for (k = 0; k < cm->nworkers; k++) {
+    while ((slot = vde_spsc_ring_peek(cm->auth_done[k])) != NULL) {
+      pc = *slot;
+      pc->state = pc->auth_result ? NOT_AUTHORIZED : AUTHORIZED;
+      pending_queue_push(&cm->admit_queue, pc);
+      vde_spsc_ring_release(cm->auth_done[k]);
+      cm->auth_inflight[k]--;
+      vde_component_put(cm->component, NULL);
+    }
+  }
+}
+
+// close the backends of connections closed while being authorized
+static void conn_manager_close_pass(conn_manager *cm)
+{
+  struct pending_conn *pc;
+
+  while ((pc = pending_queue_pop(&cm->close_queue)) != NULL) {
+    vde_connection_fini(pc->conn);
+    pc->be_closed = 1;
+  }
+}
+
+static int post_authorization(conn_manager *cm, struct pending_conn *pc)
+{
+  int rejected;
+  vde_connection *conn = pc->conn;
+
+  vde_trace_hist_add(&cm->latency, vde_qdisc_now() -
+                     vde_connection_get_init_time(conn));
+
+  // invoke user callbacks on error/success
+  rejected = pc->state != AUTHORIZED || pc->closed ||
+    vde_engine_new_connection(cm->engine, conn, pc->lreq);
+  if (rejected) {
+    pending_conn_reject(cm, pc);
+  } else {
+    if (pc->success_cb) {
+      pc->success_cb(cm->component, pc->connect_cb_arg);
+    }
+  }
+  if (rejected) {
+    pending_conn_close(cm, pc);
+  } else {
+    pending_conn_del(cm, pc);
+  }
+  return 0;
+}
+
+static void conn_manager_doorbell_cb(int fd, short events, void *arg)
+{
+  struct pending_conn *pc;
+  unsigned int admitted = 0;
+  conn_manager *cm = (conn_manager *)arg;
+
+  vde_doorbell_clear(&cm->doorbell);
+
+  conn_manager_close_pass(cm);
+  conn_manager_auth_collect(cm);
+  conn_manager_auth_submit(cm);
+
+  while (admitted < cm->accept_budget &&
+         (pc = pending_queue_pop(&cm->admit_queue)) != NULL) {
+    post_authorization(cm, pc);
+    admitted++;
+  }
+  if (cm->admit_queue.head != NULL) {
+    // let the event loop run, then go on with the next pass
+    cm->deferred++;
+    vde_doorbell_ring(&cm->doorbell);
+  }
+}
+
 int conn_manager_connect(vde_component *component,
                          vde_request *local_request,
                          vde_request *remote_request,
@@ -103,6 +459,8 @@ int conn_manager_connect(vde_component *component,
     return -1;
   }
 
+  cm = vde_component_get_priv(component);
+
   // XXX: check requests with do_remote_authorization,
   //      what about normalization?
   //      memdup requests here?
@@ -113,27 +471,18 @@ int conn_manager_connect(vde_component *component,
   pc->success_cb = success_cb;
   pc->error_cb = error_cb;
   pc->connect_cb_arg = arg;
+  pc->cm = cm;
+  pc->connecting = 1;
 
-  cm = vde_component_get_priv(component);
-  cm->pending_conns = vde_list_prepend(cm->pending_conns, pc);
-
-  return vde_transport_connect(cm->transport, conn);
-}
+  vde_hash_insert(cm->pending_conns, conn, pc);
 
-static int post_authorization(conn_manager *cm, struct pending_conn *pc)
-{
-  // invoke user callbacks on error/success
-  if(vde_engine_new_connection(cm->engine, pc->conn, pc->lreq)) {
-    if (pc->error_cb) {
-      pc->error_cb(cm->component, pc->connect_cb_arg);
-    }
-  } else {
-    if (pc->success_cb) {
-      pc->success_cb(cm->component, pc->connect_cb_arg);
-    }
+  if (vde_transport_connect(cm->transport, conn)) {
+    tmp_errno = errno;
+    pending_conn_del(cm, pc);
+    vde_connection_delete(conn);
+    errno = tmp_errno;
+    return -1;
   }
-  cm->pending_conns = vde_list_remove(cm->pending_conns, pc);
-  vde_free(pc); // XXX: free requests here ?
   return 0;
 }
 
@@ -150,6 +499,7 @@ void conn_manager_connect_cb(vde_connection *conn, void *arg)
     vde_error("%s: cannot lookup pending connection", __PRETTY_FUNCTION__);
     return;
   }
+  cm->connected++;
   if (cm->do_remote_authorization) {
     //vde_connection_set_callbacks(conn, connection_read_cb,
     //                             connection_error_cb, component);
@@ -158,8 +508,7 @@ void conn_manager_connect_cb(vde_connection *conn, void *arg)
     // - begin authorization process
     // pc->state = AUTHORIZATION_REQ_SENT
   } else {
-    pc->state = AUTHORIZED;
-    post_authorization(cm, pc);
+    conn_manager_authorize(cm, pc);
   }
 }
 
@@ -169,7 +518,10 @@ void conn_manager_accept_cb(vde_connection *conn, void *arg)
   vde_component *component = (vde_component *)arg;
   conn_manager *cm = (conn_manager *)vde_component_get_priv(component);
 
-  // XXX: safety check: conn not already added to pending_conns
+  if (lookup_pending_conn(cm, conn) != NULL) {
+    vde_error("%s: connection already pending", __PRETTY_FUNCTION__);
+    return;
+  }
 
   pc = (struct pending_conn *)vde_calloc(sizeof(struct pending_conn));
   if (!pc) {
@@ -180,8 +532,10 @@ void conn_manager_accept_cb(vde_connection *conn, void *arg)
   }
 
   pc->conn = conn;
+  pc->cm = cm;
 
-  cm->pending_conns = vde_list_prepend(cm->pending_conns, pc);
+  vde_hash_insert(cm->pending_conns, conn, pc);
+  cm->accepted++;
 
   if (cm->do_remote_authorization) {
     //vde_conn_set_callbacks(conn, connection_read_cb, connection_error_cb,
@@ -191,16 +545,30 @@ void conn_manager_accept_cb(vde_connection *conn, void *arg)
     // pc->state = AUTHORIZATION_REQ_WAIT
   } else {
     // fill local_request with defaults
-    pc->state = AUTHORIZED;
-    post_authorization(cm, pc);
+    conn_manager_authorize(cm, pc);
   }
 }
 
 void conn_manager_error_cb(vde_connection *conn, int tr_errno,
                            void *arg)
 {
-  // if conn in pending_conn and there's an application callback call it,
-  // delete pending_conn and delete conn
+  struct pending_conn *pc;
+  vde_component *component = (vde_component *)arg;
+  conn_manager *cm = (conn_manager *)vde_component_get_priv(component);
+
+  // only connections still waiting for the transport get here, once queued
+  // for authorization they belong to the connection manager
+  pc = lookup_pending_conn(cm, conn);
+  if (!pc) {
+    vde_error("%s: cannot lookup pending connection", __PRETTY_FUNCTION__);
+    return;
+  }
+  vde_assert(pc->state == CONNECT_WAIT);
+
+  pending_conn_reject(cm, pc);
+  pending_conn_del(cm, pc);
+  vde_connection_fini(conn);
+  vde_connection_delete(conn);
 }
 
 // in engine.new_conn: vde_conn_set_callbacks(conn, engine_callbacks..)
@@ -208,12 +576,66 @@ void conn_manager_error_cb(vde_connection *conn, int tr_errno,
 // XXX: cm_read_cb / cm_error_cb, they need to be different for accept/connect
 // callbacks?
 
+int conn_manager_stats(vde_component *component, vde_sobj **out)
+{
+  unsigned int k, inflight = 0;
+  conn_manager *cm = (conn_manager *)vde_component_get_priv(component);
+
+  for (k = 0; k < cm->nworkers; k++) {
+    inflight += cm->auth_inflight[k];
+  }
+
+  *out = vde_sobj_new_hash();
+  vde_sobj_hash_insert(*out, "accepted", vde_sobj_new_int64(cm->accepted));
+  vde_sobj_hash_insert(*out, "connected", vde_sobj_new_int64(cm->connected));
+  vde_sobj_hash_insert(*out, "rejected", vde_sobj_new_int64(cm->rejected));
+  vde_sobj_hash_insert(*out, "deferred", vde_sobj_new_int64(cm->deferred));
+  vde_sobj_hash_insert(*out, "pending",
+                       vde_sobj_new_int(vde_hash_size(cm->pending_conns)));
+  vde_sobj_hash_insert(*out, "auth_waiting",
+                       vde_sobj_new_int(cm->auth_queue.length));
+  vde_sobj_hash_insert(*out, "auth_running", vde_sobj_new_int(inflight));
+  vde_sobj_hash_insert(*out, "latency",
+                       vde_trace_hist_serialize(&cm->latency));
+  return 0;
+}
+
+static void conn_manager_free(conn_manager *cm)
+{
+  unsigned int k;
+
+  if (cm->retry_timeout != NULL) {
+    vde_context_timeout_del(vde_component_get_context(cm->component),
+                            cm->retry_timeout);
+  }
+  if (cm->doorbell_ev != NULL) {
+    vde_context_event_del(vde_component_get_context(cm->component),
+                          cm->doorbell_ev);
+  }
+  if (cm->doorbell.rfd != -1) {
+    vde_doorbell_fini(&cm->doorbell);
+  }
+  if (cm->auth_done != NULL) {
+    for (k = 0; k < cm->nworkers; k++) {
+      if (cm->auth_done[k] != NULL) {
+        vde_spsc_ring_delete(cm->auth_done[k]);
+      }
+    }
+  }
+  vde_free(cm->auth_done);
+  vde_free(cm->auth_inflight);
+  vde_hash_delete(cm->pending_conns);
+  vde_free(cm);
+}
+
 int conn_manager_init(vde_component *component, vde_sobj *params)
 {
   conn_manager *cm;
-  int remote_auth;
-  vde_component *engine, *transport;
-  vde_sobj *engine_sobj, *transport_sobj, *remote_auth_sobj;
+  int remote_auth, auth_offload, tmp_errno;
+  unsigned int k, accept_budget, nworkers = 0;
+  vde_component *engine = NULL, *transport;
+  vde_sobj *engine_sobj, *transport_sobj, *remote_auth_sobj, *offload_sobj,
+    *budget_sobj;
   const char *engine_name, *transport_name;
   vde_context *ctx = vde_component_get_context(component);
 
@@ -247,7 +669,7 @@ int conn_manager_init(vde_component *component, vde_sobj *params)
     vde_error("%s: component transport is not a transport",
               __PRETTY_FUNCTION__);
     errno = EINVAL;
-    return -1;
+    goto err_put;
   }
 
   /* pick engine */
@@ -255,7 +677,7 @@ int conn_manager_init(vde_component *component, vde_sobj *params)
   if (!engine_sobj || !vde_sobj_is_type(engine_sobj, vde_sobj_type_string)) {
     vde_error("%s: no engine name specified", __PRETTY_FUNCTION__);
     errno = EINVAL;
-    return -1;
+    goto err_put;
   }
   engine_name = vde_sobj_get_string(engine_sobj);
 
@@ -264,14 +686,14 @@ int conn_manager_init(vde_component *component, vde_sobj *params)
     vde_error("%s: engine %s not found in context", __PRETTY_FUNCTION__,
               engine_name);
     errno = EINVAL;
-    return -1;
+    goto err_put;
   }
 
   if (vde_component_get_kind(engine) != VDE_ENGINE) {
     vde_error("%s: component engine is not a engine",
               __PRETTY_FUNCTION__);
     errno = EINVAL;
-    return -1;
+    goto err_put;
   }
 
   /* remote authorization, not enabled by default */
@@ -282,48 +704,153 @@ int conn_manager_init(vde_component *component, vde_sobj *params)
     if (!vde_sobj_is_type(remote_auth_sobj, vde_sobj_type_bool)) {
       vde_error("%s: wrong remote authorization param", __PRETTY_FUNCTION__);
       errno = EINVAL;
-      return -1;
+      goto err_put;
     }
     remote_auth = vde_sobj_get_bool(remote_auth_sobj);
   }
 
+  /* authorization in context workers, not enabled by default */
+  auth_offload = 0;
+  offload_sobj = vde_sobj_hash_lookup(params, "auth_offload");
+  if (offload_sobj) {
+    if (!vde_sobj_is_type(offload_sobj, vde_sobj_type_bool)) {
+      vde_error("%s: wrong auth offload param", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      goto err_put;
+    }
+    auth_offload = vde_sobj_get_bool(offload_sobj);
+  }
+  if (auth_offload) {
+    // jobs are submitted with vde_context_worker_call(), from the root thread
+    if (vde_context_get_root(ctx) != ctx) {
+      vde_error("%s: auth offload needs a connection manager outside workers",
+                __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      goto err_put;
+    }
+    // without workers the authorizer runs in the event loop
+    nworkers = vde_context_get_num_workers(ctx);
+  }
+
+  accept_budget = DEFAULT_ACCEPT_BUDGET;
+  budget_sobj = vde_sobj_hash_lookup(params, "accept_budget");
+  if (budget_sobj) {
+    if (!vde_sobj_is_type(budget_sobj, vde_sobj_type_int) ||
+        vde_sobj_get_int(budget_sobj) < 1 ||
+        vde_sobj_get_int(budget_sobj) > MAX_ACCEPT_BUDGET) {
+      vde_error("%s: accept_budget must be an integer between 1 and %d",
+                __PRETTY_FUNCTION__, MAX_ACCEPT_BUDGET);
+      errno = EINVAL;
+      goto err_put;
+    }
+    accept_budget = vde_sobj_get_int(budget_sobj);
+  }
+
   /* create connection manager */
   cm = (conn_manager *)vde_calloc(sizeof(conn_manager));
   if (cm == NULL) {
     vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
     errno = ENOMEM;
-    return -1;
+    goto err_put;
   }
 
   cm->transport = transport;
   cm->engine = engine;
   cm->component = component;
   cm->do_remote_authorization = remote_auth;
-  cm->pending_conns = NULL;
+  cm->accept_budget = accept_budget;
+  cm->pending_conns = vde_hash_init();
+  cm->doorbell.rfd = cm->doorbell.wfd = -1;
+
+  if (nworkers > 0) {
+    cm->auth_done = (vde_spsc_ring **)vde_calloc(nworkers *
+                                                 sizeof(vde_spsc_ring *));
+    cm->auth_inflight = (unsigned int *)vde_calloc(nworkers *
+                                                   sizeof(unsigned int));
+    if (cm->auth_done == NULL || cm->auth_inflight == NULL) {
+      vde_error("%s: could not allocate worker rings", __PRETTY_FUNCTION__);
+      tmp_errno = ENOMEM;
+      goto err_free;
+    }
+    cm->nworkers = nworkers;
+    for (k = 0; k < nworkers; k++) {
+      cm->auth_done[k] = vde_spsc_ring_new(AUTH_INFLIGHT,
+                                           sizeof(struct pending_conn *));
+      if (cm->auth_done[k] == NULL) {
+        tmp_errno = errno;
+        vde_error("%s: could not allocate worker rings", __PRETTY_FUNCTION__);
+        goto err_free;
+      }
+    }
+  }
+
+  if (vde_doorbell_init(&cm->doorbell)) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create doorbell: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto err_free;
+  }
+  cm->doorbell_ev = vde_context_event_add(ctx, cm->doorbell.rfd,
+                                          VDE_EV_READ | VDE_EV_PERSIST, NULL,
+                                          &conn_manager_doorbell_cb,
+                                          (void *)cm);
+  if (cm->doorbell_ev == NULL) {
+    tmp_errno = errno;
+    vde_error("%s: could not add doorbell event", __PRETTY_FUNCTION__);
+    goto err_free;
+  }
 
-  /* Increase reference counter of tracked components */
-  vde_component_get(transport, NULL);
-  vde_component_get(engine, NULL);
+  if (vde_component_commands_register_table(component, conn_manager_commands,
+                                            conn_manager_commands_lookup)) {
+    tmp_errno = errno;
+    vde_error("%s: could not register commands", __PRETTY_FUNCTION__);
+    goto err_free;
+  }
 
+  // the references taken by the lookups are kept for the tracked components
   vde_transport_set_cm_callbacks(transport, &conn_manager_connect_cb,
                                  &conn_manager_accept_cb,
                                  &conn_manager_error_cb, (void *)component);
 
   vde_component_set_priv(component, cm);
   return 0;
+
+err_free:
+  conn_manager_free(cm);
+  errno = tmp_errno;
+err_put:
+  vde_component_put(transport, NULL);
+  if (engine) {
+    vde_component_put(engine, NULL);
+  }
+  return -1;
 }
 
-// XXX to be defined
 void conn_manager_fini(vde_component *component)
 {
+  struct pending_conn *pc;
   conn_manager *cm = vde_component_get_priv(component);
 
   vde_assert(component != NULL);
 
+  vde_component_commands_deregister(component, conn_manager_commands);
+
   vde_component_put(cm->transport, NULL);
   vde_component_put(cm->engine, NULL);
 
-  // XXX what to do with cm->pending_conns if not empty?
+  // running authorizations hold a reference to the component, the ones which
+  // finished or never started are dropped with their connections
+  conn_manager_close_pass(cm);
+  conn_manager_auth_collect(cm);
+  while ((pc = pending_queue_pop(&cm->auth_queue)) != NULL) {
+    pending_queue_push(&cm->admit_queue, pc);
+  }
+  while ((pc = pending_queue_pop(&cm->admit_queue)) != NULL) {
+    pending_conn_close(cm, pc);
+  }
+  // XXX what to do with cm->pending_conns still waiting for the transport?
+
+  conn_manager_free(cm);
 }
 
 component_ops conn_manager_component_ops = {
@@ -19,19 +19,25 @@
 
 #include <vde3/common.h>
 #include <vde3/connection.h>
+#include <vde3/context.h>
+#include <vde3/qdisc.h>
 
 #include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 
 int vde_connection_new(vde_connection **conn) {
 
   vde_assert(conn);
 
-  *conn = (vde_connection *)vde_calloc(sizeof(vde_connection));
-  if (*conn == NULL) {
+  // statistics are cache line aligned
+  if (posix_memalign((void **)conn, VDE_CACHELINE_SIZE,
+                     sizeof(vde_connection))) {
     vde_error("%s: cannot create connection", __PRETTY_FUNCTION__);
     errno = ENOMEM;
     return -1;
   }
+  memset(*conn, 0, sizeof(vde_connection));
   return 0;
 }
 
@@ -43,7 +49,6 @@ int vde_connection_init(vde_connection *conn, vde_context *ctx,
 
   vde_assert(conn != NULL);
   vde_assert(ctx != NULL);
-  vde_assert(payload_size > 0);
   vde_assert(be_write != NULL);
   vde_assert(be_close != NULL);
   vde_assert(be_priv != NULL);
@@ -53,6 +58,8 @@ int vde_connection_init(vde_connection *conn, vde_context *ctx,
   conn->be_write = be_write;
   conn->be_close = be_close;
   conn->be_priv = be_priv;
+  conn->init_time = vde_qdisc_now();
+  conn->trace_sample = &ctx->trace_sample;
   return 0;
 }
 
@@ -68,7 +75,7 @@ void vde_connection_delete(vde_connection *conn)
   vde_assert(conn != NULL);
 
   // XXX free attributes here
-  vde_free(conn);
+  free(conn);
 }
 
 void vde_connection_set_callbacks(vde_connection *conn,
@@ -81,11 +88,30 @@ void vde_connection_set_callbacks(vde_connection *conn,
   vde_assert(read_cb != NULL && error_cb != NULL);
 
   conn->read_cb = read_cb;
+  conn->read_batch_cb = NULL;
+  conn->flow_cb = NULL;
   conn->write_cb = write_cb;
   conn->error_cb = error_cb;
   conn->cb_priv = cb_priv;
 }
 
+void vde_connection_set_read_batch_cb(vde_connection *conn,
+                                      conn_read_batch_cb read_batch_cb)
+{
+  vde_assert(conn != NULL);
+  vde_assert(conn->read_cb != NULL);
+
+  conn->read_batch_cb = read_batch_cb;
+}
+
+void vde_connection_set_flow_cb(vde_connection *conn, conn_flow_cb flow_cb)
+{
+  vde_assert(conn != NULL);
+  vde_assert(conn->read_cb != NULL);
+
+  conn->flow_cb = flow_cb;
+}
+
 unsigned int vde_connection_max_payload(vde_connection *conn)
 {
   vde_assert(conn != NULL);
@@ -105,7 +131,8 @@ void vde_connection_set_pkt_properties(vde_connection *conn,
 
 void vde_connection_set_send_properties(vde_connection *conn,
                                         unsigned int max_tries,
-                                        struct timeval *max_timeout)
+                                        struct timeval *max_timeout,
+                                        unsigned int max_bytes)
 {
   vde_assert(conn != NULL);
   vde_assert(max_timeout != NULL);
@@ -113,6 +140,25 @@ void vde_connection_set_send_properties(vde_connection *conn,
   conn->send_maxtries = max_tries;
   timerclear(&conn->send_maxtimeout);
   timeradd(&conn->send_maxtimeout, max_timeout, &conn->send_maxtimeout);
+  conn->send_maxbytes = max_bytes;
+}
+
+void vde_connection_set_send_watermarks(vde_connection *conn,
+                                        unsigned int low_wm,
+                                        unsigned int high_wm)
+{
+  vde_assert(conn != NULL);
+  vde_assert(high_wm == 0 || low_wm < high_wm);
+
+  conn->send_low_wm = low_wm;
+  conn->send_high_wm = high_wm;
+  // the new marks apply from the next queued packet
+  if (conn->unwritable && (high_wm == 0 || conn->queued_bytes <= low_wm)) {
+    conn->unwritable = 0;
+    if (conn->flow_cb != NULL) {
+      conn->flow_cb(conn, 1, conn->cb_priv);
+    }
+  }
 }
 
 void vde_connection_set_attributes(vde_connection *conn,
@@ -130,3 +176,79 @@ vde_attributes *vde_connection_get_attributes(vde_connection *conn)
   return conn->attributes;
 }
 
+
+void vde_conn_stats_add(vde_conn_stats *total, const vde_conn_stats *stats)
+{
+  unsigned int i;
+
+  vde_assert(total != NULL);
+  vde_assert(stats != NULL);
+
+  total->rx_pkts += stats->rx_pkts;
+  total->rx_bytes += stats->rx_bytes;
+  total->tx_pkts += stats->tx_pkts;
+  total->tx_bytes += stats->tx_bytes;
+  total->retries += stats->retries;
+  total->rx_lost += stats->rx_lost;
+  total->rx_reordered += stats->rx_reordered;
+  for (i = 0; i < VDE_CONN_DROP_MAX; i++) {
+    total->drops[i] += stats->drops[i];
+  }
+  if (stats->queue_hwm > total->queue_hwm) {
+    total->queue_hwm = stats->queue_hwm;
+  }
+  vde_trace_hist_merge(&total->engine, &stats->engine);
+  vde_trace_hist_merge(&total->sojourn, &stats->sojourn);
+}
+
+static const char *conn_drop_names[VDE_CONN_DROP_MAX] = {
+  [VDE_CONN_DROP_QUEUE_FULL] = "queue_full",
+  [VDE_CONN_DROP_NOMEM] = "nomem",
+  [VDE_CONN_DROP_TIMEOUT] = "timeout",
+  [VDE_CONN_DROP_WRITE_ERROR] = "write_error",
+  [VDE_CONN_DROP_RX_ERROR] = "rx_error",
+  [VDE_CONN_DROP_ENGINE] = "engine",
+  [VDE_CONN_DROP_AQM] = "aqm",
+  [VDE_CONN_DROP_STORM] = "storm",
+};
+
+vde_sobj *vde_conn_stats_serialize(const vde_conn_stats *stats)
+{
+  unsigned int i;
+  vde_sobj *out, *drops;
+
+  vde_assert(stats != NULL);
+
+  out = vde_sobj_new_hash();
+  drops = vde_sobj_new_hash();
+  if (out == NULL || drops == NULL) {
+    if (out != NULL) {
+      vde_sobj_put(out);
+    }
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  vde_sobj_hash_insert(out, "rx_pkts", vde_sobj_new_int64(stats->rx_pkts));
+  vde_sobj_hash_insert(out, "rx_bytes", vde_sobj_new_int64(stats->rx_bytes));
+  vde_sobj_hash_insert(out, "tx_pkts", vde_sobj_new_int64(stats->tx_pkts));
+  vde_sobj_hash_insert(out, "tx_bytes", vde_sobj_new_int64(stats->tx_bytes));
+  vde_sobj_hash_insert(out, "retries", vde_sobj_new_int64(stats->retries));
+  vde_sobj_hash_insert(out, "rx_lost", vde_sobj_new_int64(stats->rx_lost));
+  vde_sobj_hash_insert(out, "rx_reordered",
+                       vde_sobj_new_int64(stats->rx_reordered));
+  vde_sobj_hash_insert(out, "queue_hwm", vde_sobj_new_int(stats->queue_hwm));
+  for (i = 0; i < VDE_CONN_DROP_MAX; i++) {
+    vde_sobj_hash_insert(drops, conn_drop_names[i],
+                         vde_sobj_new_int64(stats->drops[i]));
+  }
+  vde_sobj_hash_insert(out, "drops", drops);
+  if (stats->engine.count > 0 || stats->sojourn.count > 0) {
+    vde_sobj_hash_insert(out, "engine",
+                         vde_trace_hist_serialize(&stats->engine));
+    vde_sobj_hash_insert(out, "sojourn",
+                         vde_trace_hist_serialize(&stats->sojourn));
+  }
+
+  return out;
+}
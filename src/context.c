@@ -16,24 +16,44 @@
 */
 
 
+#include <signal.h>
+#include <sched.h>
+
 #include <vde3.h>
 
 #include <vde3/common.h>
 #include <vde3/component.h>
 #include <vde3/context.h>
+#include <vde3/spsc.h>
+
+#define MAX_WORKERS 256
+// pending vde_context_worker_call() for each worker
+#define WORKER_CALLS_QLEN 256
+
+typedef struct {
+  vde_worker_fn fn; //!< NULL asks the worker to exit
+  void *arg;
+} worker_call;
+
+struct vde_worker {
+  // calls from the root thread, the only producer
+  vde_spsc_ring *calls;
+  vde_doorbell doorbell;
+  void *doorbell_ev;
+};
 
 /**
- * @brief Lookup a vde 3 module in the context
+ * @brief Find a vde 3 module in the context, without loading it
  *
  * @param ctx The context to lookup in
  * @param kind The module kind
  * @param family The module family
  *
- * @return The module or NULL if not present
+ * @return The module (possibly a stub) or NULL if not present
  */
-static vde_module *vde_context_lookup_module(vde_context *ctx,
-                                             vde_component_kind kind,
-                                             const char *family)
+static vde_module *vde_context_find_module(vde_context *ctx,
+                                           vde_component_kind kind,
+                                           const char *family)
 {
   vde_component_kind module_kind;
   const char *module_family;
@@ -59,6 +79,405 @@ static vde_module *vde_context_lookup_module(vde_context *ctx,
   return NULL;
 }
 
+/**
+ * @brief Lookup a vde 3 module in the context, loading it if needed
+ *
+ * @param ctx The context to lookup in
+ * @param kind The module kind
+ * @param family The module family
+ *
+ * @return The module or NULL if not present or not loadable (and errno set
+ * appropriately)
+ */
+static vde_module *vde_context_lookup_module(vde_context *ctx,
+                                             vde_component_kind kind,
+                                             const char *family)
+{
+  vde_module *module;
+  int tmp_errno;
+
+  pthread_mutex_lock(&ctx->modules_lock);
+  module = vde_context_find_module(ctx, kind, family);
+  if (module == NULL) {
+    errno = ENOENT;
+  } else if (vde_module_is_stub(module) && vde_module_resolve(module)) {
+    module = NULL;
+  }
+  tmp_errno = errno;
+  pthread_mutex_unlock(&ctx->modules_lock);
+  errno = tmp_errno;
+  return module;
+}
+
+/**
+ * @brief Forget the local connections of an engine, called with
+ * components_lock held
+ *
+ * @param root The root context
+ * @param qname The engine name, 0 to forget every connection
+ */
+static void context_links_remove(vde_context *root, vde_quark qname)
+{
+  vde_list *iter, *next;
+  vde_context_link *link;
+
+  iter = vde_list_first(root->links);
+  while (iter != NULL) {
+    next = vde_list_next(iter);
+    link = vde_list_get_data(iter);
+    if (qname == 0 || link->engine1 == qname || link->engine2 == qname) {
+      root->links = vde_list_remove(root->links, link);
+      vde_free(link);
+    }
+    iter = next;
+  }
+}
+
+/*
+ * Workers
+ *
+ */
+
+static void vde_worker_doorbell_cb(int fd, short events, void *arg)
+{
+  worker_call *call;
+  vde_worker_fn fn;
+  void *fn_arg;
+  vde_context *ctx = (vde_context *)arg;
+  struct vde_worker *worker = ctx->worker;
+
+  vde_doorbell_clear(&worker->doorbell);
+  while ((call = vde_spsc_ring_peek(worker->calls)) != NULL) {
+    fn = call->fn;
+    fn_arg = call->arg;
+    vde_spsc_ring_release(worker->calls);
+    if (fn == NULL) {
+      ctx->loop_ops.loop_break(ctx->loop);
+      return;
+    }
+    fn(ctx, fn_arg);
+  }
+}
+
+static void *vde_worker_main(void *arg)
+{
+  vde_context *ctx = (vde_context *)arg;
+
+  ctx->thread = pthread_self();
+  ctx->loop_ops.loop_enter(ctx->loop);
+  if (ctx->loop_ops.loop_run(ctx->loop)) {
+    vde_error("%s: worker event loop failed", __PRETTY_FUNCTION__);
+  }
+  return NULL;
+}
+
+static void vde_worker_fini(vde_context *ctx)
+{
+  struct vde_worker *worker = ctx->worker;
+
+  if (worker->doorbell_ev != NULL) {
+    vde_context_event_del(ctx, worker->doorbell_ev);
+    vde_doorbell_fini(&worker->doorbell);
+  }
+  if (worker->calls != NULL) {
+    vde_spsc_ring_delete(worker->calls);
+  }
+  vde_free(worker);
+  ctx->worker = NULL;
+
+  if (ctx->loop != NULL) {
+    ctx->loop_ops.loop_delete(ctx->loop);
+    ctx->loop = NULL;
+  }
+  if (ctx->pool != NULL) {
+    vde_pool_delete(ctx->pool);
+    ctx->pool = NULL;
+  }
+  ctx->initialized = 0;
+}
+
+static int vde_worker_init(vde_context *ctx, vde_context *root)
+{
+  int tmp_errno;
+
+  memcpy(&ctx->event_handler, &root->event_handler, sizeof(vde_event_handler));
+  memcpy(&ctx->loop_ops, &root->loop_ops, sizeof(vde_event_loop));
+  ctx->root = root;
+  ctx->trace_sample = root->trace_sample;
+  // components and modules are looked up in the root
+  ctx->components = NULL;
+  ctx->modules = NULL;
+  ctx->initialized = 1;
+
+  ctx->worker = (struct vde_worker *)vde_calloc(sizeof(struct vde_worker));
+  if (ctx->worker == NULL) {
+    ctx->initialized = 0;
+    errno = ENOMEM;
+    return -1;
+  }
+  ctx->pool = vde_pool_new();
+  if (ctx->pool == NULL) {
+    tmp_errno = ENOMEM;
+    goto err_fini;
+  }
+  ctx->loop = ctx->loop_ops.loop_new();
+  if (ctx->loop == NULL) {
+    vde_error("%s: cannot create event loop", __PRETTY_FUNCTION__);
+    tmp_errno = ENOMEM;
+    goto err_fini;
+  }
+  ctx->worker->calls = vde_spsc_ring_new(WORKER_CALLS_QLEN,
+                                         sizeof(worker_call));
+  if (ctx->worker->calls == NULL) {
+    tmp_errno = errno;
+    goto err_fini;
+  }
+  if (vde_doorbell_init(&ctx->worker->doorbell)) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create doorbell: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto err_fini;
+  }
+  ctx->worker->doorbell_ev =
+    vde_context_event_add(ctx, ctx->worker->doorbell.rfd,
+                          VDE_EV_READ | VDE_EV_PERSIST, NULL,
+                          &vde_worker_doorbell_cb, (void *)ctx);
+  if (ctx->worker->doorbell_ev == NULL) {
+    tmp_errno = errno;
+    vde_doorbell_fini(&ctx->worker->doorbell);
+    goto err_fini;
+  }
+
+  return 0;
+
+err_fini:
+  vde_worker_fini(ctx);
+  errno = tmp_errno;
+  return -1;
+}
+
+static void vde_context_workers_delete(vde_context *ctx)
+{
+  unsigned int i;
+
+  vde_assert(ctx->workers_running == 0);
+
+  for (i = 0; i < ctx->nworkers; i++) {
+    vde_worker_fini(ctx->workers[i]);
+    vde_context_delete(ctx->workers[i]);
+  }
+  vde_free(ctx->workers);
+  ctx->workers = NULL;
+  ctx->nworkers = 0;
+
+  if (ctx->loop_ops.loop_enter != NULL) {
+    // the calling thread might still be in a worker loop
+    ctx->loop_ops.loop_enter(NULL);
+    memset(&ctx->loop_ops, 0, sizeof(vde_event_loop));
+  }
+}
+
+static int vde_worker_post(vde_context *ctx, vde_worker_fn fn, void *arg)
+{
+  worker_call *call;
+  struct vde_worker *worker = ctx->worker;
+
+  call = (worker_call *)vde_spsc_ring_reserve(worker->calls);
+  if (call == NULL) {
+    errno = EAGAIN;
+    return -1;
+  }
+  call->fn = fn;
+  call->arg = arg;
+  if (vde_spsc_ring_commit(worker->calls)) {
+    vde_doorbell_ring(&worker->doorbell);
+  }
+  return 0;
+}
+
+int vde_context_set_workers(vde_context *ctx, unsigned int nworkers,
+                            vde_event_loop *loop)
+{
+  unsigned int i;
+  int tmp_errno;
+
+  if (ctx == NULL || ctx->initialized != 1 || ctx->root != NULL ||
+      ctx->nworkers != 0) {
+    vde_error("%s: cannot set workers", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  if (nworkers == 0 || nworkers > MAX_WORKERS) {
+    vde_error("%s: invalid number of workers %u", __PRETTY_FUNCTION__,
+              nworkers);
+    errno = EINVAL;
+    return -1;
+  }
+  if (loop == NULL || loop->loop_new == NULL || loop->loop_delete == NULL ||
+      loop->loop_enter == NULL || loop->loop_run == NULL ||
+      loop->loop_break == NULL) {
+    vde_error("%s: all event loop functions must be implemented",
+              __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  ctx->workers = (vde_context **)vde_calloc(nworkers * sizeof(vde_context *));
+  if (ctx->workers == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  memcpy(&ctx->loop_ops, loop, sizeof(vde_event_loop));
+  ctx->loop = NULL;
+
+  for (i = 0; i < nworkers; i++) {
+    if (vde_context_new(&ctx->workers[i])) {
+      tmp_errno = errno;
+      goto err_workers;
+    }
+    if (vde_worker_init(ctx->workers[i], ctx)) {
+      tmp_errno = errno;
+      vde_error("%s: cannot init worker %u", __PRETTY_FUNCTION__, i);
+      vde_context_delete(ctx->workers[i]);
+      goto err_workers;
+    }
+    ctx->nworkers++;
+  }
+
+  return 0;
+
+err_workers:
+  vde_context_workers_delete(ctx);
+  errno = tmp_errno;
+  return -1;
+}
+
+unsigned int vde_context_get_num_workers(vde_context *ctx)
+{
+  vde_assert(ctx != NULL);
+
+  return ctx->nworkers;
+}
+
+void vde_context_set_trace_sample(vde_context *ctx, unsigned int rate)
+{
+  unsigned int i;
+
+  vde_assert(ctx != NULL);
+
+  ctx = vde_context_get_root(ctx);
+  // workers pick the new rate up at their next packet
+  __atomic_store_n(&ctx->trace_sample, rate, __ATOMIC_RELAXED);
+  for (i = 0; i < ctx->nworkers; i++) {
+    __atomic_store_n(&ctx->workers[i]->trace_sample, rate, __ATOMIC_RELAXED);
+  }
+}
+
+unsigned int vde_context_get_trace_sample(vde_context *ctx)
+{
+  vde_assert(ctx != NULL);
+
+  return vde_context_get_root(ctx)->trace_sample;
+}
+
+vde_context *vde_context_get_worker(vde_context *ctx, unsigned int idx)
+{
+  vde_assert(ctx != NULL);
+
+  if (idx >= ctx->nworkers) {
+    errno = ENOENT;
+    return NULL;
+  }
+  return ctx->workers[idx];
+}
+
+static void vde_context_join_workers(vde_context *ctx, unsigned int count)
+{
+  unsigned int i;
+
+  for (i = 0; i < count; i++) {
+    while (vde_worker_post(ctx->workers[i], NULL, NULL)) {
+      // the worker is still busy with previous calls
+      sched_yield();
+    }
+  }
+  for (i = 0; i < count; i++) {
+    pthread_join(ctx->workers[i]->thread, NULL);
+  }
+  __atomic_store_n(&ctx->workers_running, 0, __ATOMIC_RELEASE);
+}
+
+int vde_context_start_workers(vde_context *ctx)
+{
+  unsigned int i;
+  int rv = 0;
+  sigset_t all, old;
+
+  if (ctx == NULL || ctx->initialized != 1 || ctx->nworkers == 0) {
+    vde_error("%s: cannot start workers", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  if (ctx->workers_running) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  ctx->thread = pthread_self();
+  __atomic_store_n(&ctx->workers_running, 1, __ATOMIC_RELEASE);
+
+  // signals are left to the application thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  for (i = 0; i < ctx->nworkers; i++) {
+    rv = pthread_create(&ctx->workers[i]->thread, NULL, &vde_worker_main,
+                        (void *)ctx->workers[i]);
+    if (rv != 0) {
+      break;
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (rv != 0) {
+    vde_error("%s: cannot start worker %u: %s", __PRETTY_FUNCTION__, i,
+              strerror(rv));
+    vde_context_join_workers(ctx, i);
+    errno = rv;
+    return -1;
+  }
+
+  return 0;
+}
+
+void vde_context_stop_workers(vde_context *ctx)
+{
+  vde_assert(ctx != NULL);
+
+  if (!ctx->workers_running) {
+    return;
+  }
+  vde_assert(pthread_equal(pthread_self(), ctx->thread));
+
+  vde_context_join_workers(ctx, ctx->nworkers);
+}
+
+int vde_context_worker_call(vde_context *worker, vde_worker_fn fn, void *arg)
+{
+  if (worker == NULL || worker->worker == NULL || fn == NULL) {
+    vde_error("%s: invalid worker call", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (!vde_context_workers_running(worker)) {
+    fn(worker, arg);
+    return 0;
+  }
+  vde_assert(pthread_equal(pthread_self(), worker->root->thread));
+
+  return vde_worker_post(worker, fn, arg);
+}
+
 int vde_context_new(vde_context **ctx)
 {
   if (!ctx) {
@@ -79,6 +498,7 @@ int vde_context_init(vde_context *ctx, vde_event_handler *handler,
                      char **modules_path)
 {
   int tmp_errno;
+  vde_event_loop no_loop = { NULL, };
 
   if (ctx == NULL || handler == NULL) {
     vde_error("%s: cannot initialize context", __PRETTY_FUNCTION__);
@@ -94,8 +514,25 @@ int vde_context_init(vde_context *ctx, vde_event_handler *handler,
     return -1;
   }
   memcpy(&ctx->event_handler, handler, sizeof(vde_event_handler));
+  ctx->loop_ops = no_loop;
+  ctx->loop = NULL;
+  ctx->root = NULL;
+  ctx->workers = NULL;
+  ctx->nworkers = 0;
+  ctx->workers_running = 0;
+  ctx->worker = NULL;
   ctx->modules = NULL;
+  pthread_mutex_init(&ctx->modules_lock, NULL);
+  ctx->trace_sample = 0;
+  ctx->pool = vde_pool_new();
+  if (ctx->pool == NULL) {
+    vde_error("%s: cannot create packet pool", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
   ctx->components = vde_ordhash_new();
+  pthread_mutex_init(&ctx->components_lock, NULL);
+  ctx->links = NULL;
   ctx->initialized = 1;
 
   if (vde_modules_load(ctx, modules_path)) {
@@ -108,20 +545,43 @@ int vde_context_init(vde_context *ctx, vde_event_handler *handler,
   return 0;
 }
 
+int vde_context_load_module(vde_context *ctx, vde_component_kind kind,
+                            const char *family)
+{
+  int tmp_errno;
+
+  if (ctx == NULL || ctx->initialized != 1 || family == NULL) {
+    vde_error("%s: cannot load module", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (vde_context_lookup_module(vde_context_get_root(ctx), kind,
+                                family) == NULL) {
+    tmp_errno = errno;
+    vde_error("%s: cannot load module %d %s", __PRETTY_FUNCTION__, kind,
+              family);
+    errno = tmp_errno;
+    return -1;
+  }
+
+  return 0;
+}
+
 void vde_context_fini(vde_context *ctx)
 {
   vde_ordhash_entry *components_iter;
   vde_component *component;
+  vde_list *iter;
+  vde_module *module;
 
-  if (ctx == NULL || ctx->initialized != 1) {
+  if (ctx == NULL || ctx->initialized != 1 || ctx->root != NULL) {
     vde_error("%s: cannot finalize context", __PRETTY_FUNCTION__);
     return;
   }
 
-  ctx->event_handler.event_add = NULL;
-  ctx->event_handler.event_del = NULL;
-  ctx->event_handler.timeout_add = NULL;
-  ctx->event_handler.timeout_del = NULL;
+  // from here on every component is run by the calling thread
+  vde_context_stop_workers(ctx);
 
   /*
    * Finishing components in two steps: first fini connection managers and then
@@ -161,13 +621,38 @@ void vde_context_fini(vde_context *ctx)
   }
 
   vde_ordhash_remove_all(ctx->components);
+  context_links_remove(ctx, 0);
+  if (ctx->handoff_state != NULL) {
+    vde_sobj_put(ctx->handoff_state);
+    ctx->handoff_state = NULL;
+  }
 
   vde_ordhash_delete(ctx->components);
+  pthread_mutex_destroy(&ctx->components_lock);
+
+  // components are gone, no packets should be in use at this point
+  vde_context_workers_delete(ctx);
+  vde_pool_delete(ctx->pool);
+  ctx->pool = NULL;
 
   // XXX remove every module and dlclose() its handle, this works because at
   // this point no components should reference symbols in modules
+  for (iter = vde_list_first(ctx->modules); iter != NULL;
+       iter = vde_list_next(iter)) {
+    module = vde_list_get_data(iter);
+    if (vde_module_is_stub(module)) {
+      vde_module_stub_delete(module);
+    }
+  }
   vde_list_delete(ctx->modules);
   ctx->modules = NULL;
+  pthread_mutex_destroy(&ctx->modules_lock);
+
+  // handlers are reset last, components use them while finishing
+  ctx->event_handler.event_add = NULL;
+  ctx->event_handler.event_del = NULL;
+  ctx->event_handler.timeout_add = NULL;
+  ctx->event_handler.timeout_del = NULL;
 
   ctx->initialized = 0;
   return;
@@ -189,6 +674,7 @@ int vde_context_new_component(vde_context *ctx, vde_component_kind kind,
 {
   vde_quark qname;
   vde_module *module;
+  vde_context *root;
   int refcount, tmp_errno;
 
   if (ctx == NULL || ctx->initialized != 1) {
@@ -198,16 +684,19 @@ int vde_context_new_component(vde_context *ctx, vde_component_kind kind,
     return -1;
   }
   // XXX: check name is not 'context' or 'commands' for config
-  if (vde_context_get_component(ctx, name)) {
+  if ((*component = vde_context_get_component(ctx, name)) != NULL) {
+    vde_component_put(*component, NULL);
     vde_error("%s: cannot create new component, %s already exists",
               __PRETTY_FUNCTION__, name);
     errno = EEXIST;
     return -1;
   }
-  if ((module=vde_context_lookup_module(ctx, kind, family)) == NULL) {
-    vde_error("%s: cannot create new component, module %d %s not found",
+  root = vde_context_get_root(ctx);
+  if ((module=vde_context_lookup_module(root, kind, family)) == NULL) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create new component, module %d %s not available",
               __PRETTY_FUNCTION__, kind, family);
-    errno = ENOENT;
+    errno = tmp_errno;
     return -1;
   }
   if (vde_component_new(component)) {
@@ -224,18 +713,49 @@ int vde_context_new_component(vde_context *ctx, vde_component_kind kind,
     errno = tmp_errno;
     return -1;
   }
+  // the name might have been taken by another worker in the meantime
+  pthread_mutex_lock(&root->components_lock);
+  if (vde_ordhash_lookup(root->components, (void *)qname) != NULL) {
+    pthread_mutex_unlock(&root->components_lock);
+    vde_component_fini(*component);
+    vde_component_delete(*component);
+    vde_error("%s: cannot create new component, %s already exists",
+              __PRETTY_FUNCTION__, name);
+    errno = EEXIST;
+    return -1;
+  }
   // cast because vde_hash_insert keys are pointers
-  vde_ordhash_insert(ctx->components, (void *)qname, *component);
+  if (vde_ordhash_insert(root->components, (void *)qname, *component)) {
+    pthread_mutex_unlock(&root->components_lock);
+    vde_component_fini(*component);
+    vde_component_delete(*component);
+    vde_error("%s: cannot register new component", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
   vde_component_get(*component, &refcount);
+  pthread_mutex_unlock(&root->components_lock);
   return 0;
 }
 
 static vde_component* vde_context_get_component_by_qname(vde_context *ctx,
                                                   vde_quark qname)
 {
+  vde_component *component;
+  vde_context *root;
+
   vde_assert(ctx != NULL);
 
-  return vde_ordhash_lookup(ctx->components, (void *)qname);
+  root = vde_context_get_root(ctx);
+  pthread_mutex_lock(&root->components_lock);
+  component = vde_ordhash_lookup(root->components, (void *)qname);
+  // taken under the lock, vde_context_component_del() can't delete it anymore
+  if (component) {
+    vde_component_get(component, NULL);
+  }
+  pthread_mutex_unlock(&root->components_lock);
+
+  return component;
 }
 
 vde_component* vde_context_get_component(vde_context *ctx, const char *name)
@@ -270,6 +790,7 @@ vde_list *vde_context_list_components(vde_context *ctx);
 int vde_context_component_del(vde_context *ctx, vde_component *component)
 {
   vde_quark qname;
+  vde_context *root;
 
   if (ctx == NULL || ctx->initialized != 1) {
     vde_error("%s: cannot delete component, context not initialized",
@@ -284,7 +805,10 @@ int vde_context_component_del(vde_context *ctx, vde_component *component)
     return -1;
   }
   qname = vde_component_get_qname(component);
-  if (vde_context_get_component_by_qname(ctx, qname) == NULL) {
+  root = vde_context_get_root(ctx);
+  pthread_mutex_lock(&root->components_lock);
+  if (vde_ordhash_lookup(root->components, (void *)qname) == NULL) {
+    pthread_mutex_unlock(&root->components_lock);
     vde_error("%s: cannot delete component, component not found",
               __PRETTY_FUNCTION__);
     errno = ENOENT;
@@ -292,13 +816,16 @@ int vde_context_component_del(vde_context *ctx, vde_component *component)
   }
 
   if (vde_component_put_if_last(component, NULL)) {
+    pthread_mutex_unlock(&root->components_lock);
     vde_error("%s: cannot delete component, component is in use",
               __PRETTY_FUNCTION__);
     errno = EBUSY;
     return -1;
   }
 
-  vde_ordhash_remove(ctx->components, (void *)qname);
+  vde_ordhash_remove(root->components, (void *)qname);
+  context_links_remove(root, qname);
+  pthread_mutex_unlock(&root->components_lock);
 
   // here the component is deleted because it doesn't make sense to have it out
   // of the vde_context
@@ -308,85 +835,75 @@ int vde_context_component_del(vde_context *ctx, vde_component *component)
   return 0;
 }
 
-/**
- * @brief Save current configuration in a file
- *
- * @param ctx The context to save the configuration from
- * @param file The file to save the configuration to
- *
- * @return zero on success, -1 on error (and errno is set appropriately)
- */
-int vde_context_config_save(vde_context *ctx, const char* file);
+unsigned int vde_context_link_add(vde_context *ctx, vde_component *engine1,
+                                  vde_component *engine2, unsigned int qlen)
+{
+  unsigned int id;
+  vde_context_link *link;
+  vde_context *root = vde_context_get_root(ctx);
+
+  link = (vde_context_link *)vde_alloc(sizeof(vde_context_link));
+  link->engine1 = vde_component_get_qname(engine1);
+  link->engine2 = vde_component_get_qname(engine2);
+  link->qlen = qlen;
+
+  pthread_mutex_lock(&root->components_lock);
+  // 0 is left for links never recorded
+  if (++root->last_link_id == 0) {
+    root->last_link_id = 1;
+  }
+  id = link->id = root->last_link_id;
+  // newest first, appending would walk the whole list
+  root->links = vde_list_prepend(root->links, link);
+  pthread_mutex_unlock(&root->components_lock);
+  return id;
+}
 
-/**
- * @brief Load configuration from a file
- *
- * @param ctx The context to load the configuration into
- * @param file The file to read the configuration from
- *
- * @return zero on success, -1 on error (and errno is set appropriately)
- */
-int vde_context_config_load(vde_context *ctx, const char* file);
+void vde_context_link_del(vde_context *ctx, unsigned int id)
+{
+  vde_list *iter;
+  vde_context_link *link;
+  vde_context *root = vde_context_get_root(ctx);
+
+  if (id == 0) {
+    return;
+  }
+  pthread_mutex_lock(&root->components_lock);
+  for (iter = vde_list_first(root->links); iter != NULL;
+       iter = vde_list_next(iter)) {
+    link = vde_list_get_data(iter);
+    if (link->id == id) {
+      root->links = vde_list_remove(root->links, link);
+      vde_free(link);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&root->components_lock);
+}
 
 int vde_context_register_module(vde_context *ctx, vde_module *module)
 {
   vde_component_kind kind;
   const char *family;
-  component_ops *module_cops;
 
   vde_assert(ctx != NULL);
   vde_assert(ctx->initialized == 1);
 
   kind = vde_module_get_kind(module);
   family = vde_module_get_family(module);
-  if(vde_context_lookup_module(ctx, kind, family)) {
+  if(vde_context_find_module(ctx, kind, family)) {
     vde_error("%s: module for kind %d family %s already registered",
               __PRETTY_FUNCTION__, kind, family);
     errno = EEXIST;
     return -1;
   }
 
-  // module's kind ops sanity checks
-  switch (kind) {
-    case VDE_CONNECTION_MANAGER:
-      if (vde_module_get_cm_connect(module) == NULL ||
-          vde_module_get_cm_listen(module) == NULL) {
-        vde_error("%s: invalid conn_manager ops in %s", __PRETTY_FUNCTION__,
-                  family);
-        goto err_einval;
-      }
-      break;
-    case VDE_ENGINE:
-      if (vde_module_get_eng_new_conn(module) == NULL) {
-        vde_error("%s: invalid engine ops in %s", __PRETTY_FUNCTION__,
-                  family);
-        goto err_einval;
-      }
-      break;
-    case VDE_TRANSPORT:
-      if (vde_module_get_tr_connect(module) == NULL ||
-          vde_module_get_tr_listen(module) == NULL) {
-        vde_error("%s: invalid transport ops in %s", __PRETTY_FUNCTION__,
-                  family);
-        goto err_einval;
-      }
-      break;
-  }
-
-  // module's component_ops sanity checks
-  module_cops = vde_module_get_component_ops(module);
-  if (module_cops == NULL ||
-      module_cops->init == NULL ||
-      module_cops->fini == NULL) {
-    vde_error("%s: invalid component ops struct found", __PRETTY_FUNCTION__);
-    goto err_einval;
+  // stubs are checked once their module is loaded
+  if (!vde_module_is_stub(module) && vde_module_check(module)) {
+    return -1;
   }
 
   ctx->modules = vde_list_prepend(ctx->modules, module);
   return 0;
-
-err_einval:
-  errno = EINVAL;
-  return -1;
 }
 
@@ -0,0 +1,1054 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/*
+ * The capture engine writes the frames it receives to pcapng files, it is
+ * meant to be connected to another engine, e.g. a hub port, with a local
+ * connection.
+ *
+ * Frames are copied into a segment file mapped in memory, so that the data
+ * path doesn't make any system call. Segments are preallocated one ahead: when
+ * the current one is full the spare one takes its place and a new spare is
+ * prepared, and the full one closed, by the last worker of the context. A
+ * context without workers does it in the event loop once the callbacks
+ * return. If no spare is ready frames are dropped and counted instead of
+ * waiting for the disk.
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/filter.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vde3.h>
+
+#include <vde3/module.h>
+#include <vde3/engine.h>
+#include <vde3/context.h>
+#include <vde3/connection.h>
+#include <vde3/packet.h>
+#include <vde3/spsc.h>
+
+#include <engine_capture_commands.h>
+
+// size of segment files, set with "segment_size" param
+#define DEFAULT_SEGMENT_SIZE (64 * 1024 * 1024)
+#define MIN_SEGMENT_SIZE (1024 * 1024)
+#define MAX_SEGMENT_SIZE (1024 * 1024 * 1024)
+
+// bytes of a frame kept, set with "snaplen" param
+#define DEFAULT_SNAPLEN 65535
+#define MAX_SNAPLEN 262144
+
+// the current segment and the spare one count as well
+#define MIN_SEGMENTS 2
+
+// delay before trying again to prepare a segment after an error
+#define RETRY_MS 1000
+
+// pcapng blocks, written in host byte order
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_LINKTYPE_ETHERNET 1
+#define PCAPNG_OPT_ENDOFOPT 0
+#define PCAPNG_OPT_IF_TSRESOL 9
+
+#define PCAPNG_PAD(len) (((len) + 3) & ~3U)
+
+struct pcapng_shb {
+  uint32_t type;
+  uint32_t total_len;
+  uint32_t magic;
+  uint16_t major;
+  uint16_t minor;
+  int64_t section_len;
+  uint32_t total_len2;
+} __attribute__((packed));
+
+struct pcapng_idb {
+  uint32_t type;
+  uint32_t total_len;
+  uint16_t linktype;
+  uint16_t reserved;
+  uint32_t snaplen;
+  // timestamps are in nanoseconds
+  uint16_t tsresol_code;
+  uint16_t tsresol_len;
+  uint8_t tsresol;
+  uint8_t tsresol_pad[3];
+  uint16_t end_code;
+  uint16_t end_len;
+  uint32_t total_len2;
+} __attribute__((packed));
+
+// followed by the padded frame and by total_len again
+struct pcapng_epb {
+  uint32_t type;
+  uint32_t total_len;
+  uint32_t if_id;
+  uint32_t ts_high;
+  uint32_t ts_low;
+  uint32_t caplen;
+  uint32_t len;
+} __attribute__((packed));
+
+#define PCAPNG_HEADERS_SIZE \
+  (sizeof(struct pcapng_shb) + sizeof(struct pcapng_idb))
+#define PCAPNG_EPB_SIZE(caplen) \
+  (sizeof(struct pcapng_epb) + PCAPNG_PAD(caplen) + sizeof(uint32_t))
+
+typedef struct {
+  int fd;
+  char *map;
+  size_t used;
+  unsigned int seq;
+} capture_segment;
+
+// the segment job, run by a worker
+enum capture_job_state {
+  JOB_IDLE,
+  JOB_RUNNING,
+  JOB_DONE,
+};
+
+typedef struct {
+  vde_component *component;
+  char *path;
+  size_t segment_size;
+  unsigned int max_segments; //!< files kept, 0 for all
+  unsigned int snaplen;
+  struct sock_filter *filter; //!< NULL to capture every frame
+  unsigned int filter_len;
+  vde_list *ports;
+  capture_segment *cur;
+  capture_segment *spare; //!< NULL until prepared
+  capture_segment *full; //!< waiting to be closed
+  unsigned int next_seq;
+  void *work_timeout;
+  vde_context *worker; //!< NULL to prepare segments in the event loop
+  vde_doorbell doorbell; //!< rung by the worker when the job is done
+  void *doorbell_ev;
+  int job_state; //!< enum capture_job_state, written by both threads
+  capture_segment *job_full; //!< closed by the job
+  unsigned int job_seq;
+  int job_new; //!< 1 if the job prepares segment job_seq
+  capture_segment *job_spare; //!< prepared by the job, NULL on error
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t filtered;
+  uint64_t dropped; //!< no segment ready
+  uint64_t rotations;
+  uint64_t errors; //!< segments which could not be prepared
+} capture_engine;
+
+/*
+ * Classic BPF, as printed by tcpdump -dd, run on the frames before they are
+ * copied. Programs are checked when loaded so that they cannot loop or access
+ * memory outside the scratch words, packet bounds are checked while running.
+ */
+
+static int capture_bpf_check(const struct sock_filter *prog, unsigned int len)
+{
+  unsigned int i;
+  const struct sock_filter *insn;
+
+  if (len == 0 || len > BPF_MAXINSNS) {
+    return -1;
+  }
+  for (i = 0; i < len; i++) {
+    insn = &prog[i];
+    switch (insn->code) {
+      case BPF_LD|BPF_W|BPF_ABS: case BPF_LD|BPF_H|BPF_ABS:
+      case BPF_LD|BPF_B|BPF_ABS: case BPF_LD|BPF_W|BPF_IND:
+      case BPF_LD|BPF_H|BPF_IND: case BPF_LD|BPF_B|BPF_IND:
+      case BPF_LDX|BPF_B|BPF_MSH:
+        // negative offsets are the kernel ancillary data (SKF_AD_OFF) and
+        // network header (SKF_NET_OFF) loads, frames have neither
+        if ((int32_t)insn->k < 0) {
+          vde_error("%s: ancillary load at instruction %u not supported",
+                    __PRETTY_FUNCTION__, i);
+          return -1;
+        }
+        break;
+      case BPF_LD|BPF_W|BPF_LEN: case BPF_LDX|BPF_W|BPF_LEN:
+      case BPF_LD|BPF_IMM: case BPF_LDX|BPF_IMM:
+      case BPF_ALU|BPF_ADD|BPF_K: case BPF_ALU|BPF_ADD|BPF_X:
+      case BPF_ALU|BPF_SUB|BPF_K: case BPF_ALU|BPF_SUB|BPF_X:
+      case BPF_ALU|BPF_MUL|BPF_K: case BPF_ALU|BPF_MUL|BPF_X:
+      case BPF_ALU|BPF_DIV|BPF_X: case BPF_ALU|BPF_MOD|BPF_X:
+      case BPF_ALU|BPF_OR|BPF_K: case BPF_ALU|BPF_OR|BPF_X:
+      case BPF_ALU|BPF_AND|BPF_K: case BPF_ALU|BPF_AND|BPF_X:
+      case BPF_ALU|BPF_XOR|BPF_K: case BPF_ALU|BPF_XOR|BPF_X:
+      case BPF_ALU|BPF_LSH|BPF_K: case BPF_ALU|BPF_LSH|BPF_X:
+      case BPF_ALU|BPF_RSH|BPF_K: case BPF_ALU|BPF_RSH|BPF_X:
+      case BPF_ALU|BPF_NEG:
+      case BPF_MISC|BPF_TAX: case BPF_MISC|BPF_TXA:
+      case BPF_RET|BPF_K: case BPF_RET|BPF_A:
+        break;
+      case BPF_ALU|BPF_DIV|BPF_K: case BPF_ALU|BPF_MOD|BPF_K:
+        if (insn->k == 0) {
+          return -1;
+        }
+        break;
+      case BPF_LD|BPF_MEM: case BPF_LDX|BPF_MEM:
+      case BPF_ST: case BPF_STX:
+        if (insn->k >= BPF_MEMWORDS) {
+          return -1;
+        }
+        break;
+      case BPF_JMP|BPF_JA:
+        if (insn->k >= len - i - 1) {
+          return -1;
+        }
+        break;
+      case BPF_JMP|BPF_JEQ|BPF_K: case BPF_JMP|BPF_JEQ|BPF_X:
+      case BPF_JMP|BPF_JGT|BPF_K: case BPF_JMP|BPF_JGT|BPF_X:
+      case BPF_JMP|BPF_JGE|BPF_K: case BPF_JMP|BPF_JGE|BPF_X:
+      case BPF_JMP|BPF_JSET|BPF_K: case BPF_JMP|BPF_JSET|BPF_X:
+        if (insn->jt >= len - i - 1 || insn->jf >= len - i - 1) {
+          return -1;
+        }
+        break;
+      default:
+        return -1;
+    }
+  }
+  // jumps are forward only, the program ends with a return
+  if (BPF_CLASS(prog[len - 1].code) != BPF_RET) {
+    return -1;
+  }
+  return 0;
+}
+
+// load size bytes at off if they are inside the frame, big endian
+static inline int capture_bpf_load(const uint8_t *p, uint32_t len,
+                                   uint64_t off, unsigned int size,
+                                   uint32_t *value)
+{
+  uint32_t w;
+  uint16_t h;
+
+  if (off + size > len) {
+    return -1;
+  }
+  switch (size) {
+    case 4:
+      memcpy(&w, p + off, 4);
+      *value = ntohl(w);
+      break;
+    case 2:
+      memcpy(&h, p + off, 2);
+      *value = ntohs(h);
+      break;
+    default:
+      *value = p[off];
+  }
+  return 0;
+}
+
+// returns the number of bytes to capture, 0 to skip the frame
+static uint32_t capture_bpf_run(const struct sock_filter *pc,
+                                const uint8_t *p, uint32_t len)
+{
+  uint32_t a = 0, x = 0, tmp;
+  uint32_t mem[BPF_MEMWORDS];
+  unsigned int size;
+
+  memset(mem, 0, sizeof(mem));
+  for (;; pc++) {
+    switch (pc->code) {
+      case BPF_RET|BPF_K:
+        return pc->k;
+      case BPF_RET|BPF_A:
+        return a;
+      case BPF_LD|BPF_W|BPF_ABS: case BPF_LD|BPF_H|BPF_ABS:
+      case BPF_LD|BPF_B|BPF_ABS:
+        size = BPF_SIZE(pc->code) == BPF_W ? 4 :
+               BPF_SIZE(pc->code) == BPF_H ? 2 : 1;
+        if (capture_bpf_load(p, len, pc->k, size, &a)) {
+          return 0;
+        }
+        break;
+      case BPF_LD|BPF_W|BPF_IND: case BPF_LD|BPF_H|BPF_IND:
+      case BPF_LD|BPF_B|BPF_IND:
+        size = BPF_SIZE(pc->code) == BPF_W ? 4 :
+               BPF_SIZE(pc->code) == BPF_H ? 2 : 1;
+        if (capture_bpf_load(p, len, (uint64_t)x + pc->k, size, &a)) {
+          return 0;
+        }
+        break;
+      case BPF_LDX|BPF_B|BPF_MSH:
+        if (capture_bpf_load(p, len, pc->k, 1, &tmp)) {
+          return 0;
+        }
+        x = (tmp & 0xf) << 2;
+        break;
+      case BPF_LD|BPF_W|BPF_LEN:
+        a = len;
+        break;
+      case BPF_LDX|BPF_W|BPF_LEN:
+        x = len;
+        break;
+      case BPF_LD|BPF_IMM:
+        a = pc->k;
+        break;
+      case BPF_LDX|BPF_IMM:
+        x = pc->k;
+        break;
+      case BPF_LD|BPF_MEM:
+        a = mem[pc->k];
+        break;
+      case BPF_LDX|BPF_MEM:
+        x = mem[pc->k];
+        break;
+      case BPF_ST:
+        mem[pc->k] = a;
+        break;
+      case BPF_STX:
+        mem[pc->k] = x;
+        break;
+      case BPF_ALU|BPF_ADD|BPF_K: a += pc->k; break;
+      case BPF_ALU|BPF_ADD|BPF_X: a += x; break;
+      case BPF_ALU|BPF_SUB|BPF_K: a -= pc->k; break;
+      case BPF_ALU|BPF_SUB|BPF_X: a -= x; break;
+      case BPF_ALU|BPF_MUL|BPF_K: a *= pc->k; break;
+      case BPF_ALU|BPF_MUL|BPF_X: a *= x; break;
+      case BPF_ALU|BPF_DIV|BPF_K: a /= pc->k; break;
+      case BPF_ALU|BPF_MOD|BPF_K: a %= pc->k; break;
+      case BPF_ALU|BPF_DIV|BPF_X:
+        if (x == 0) {
+          return 0;
+        }
+        a /= x;
+        break;
+      case BPF_ALU|BPF_MOD|BPF_X:
+        if (x == 0) {
+          return 0;
+        }
+        a %= x;
+        break;
+      case BPF_ALU|BPF_OR|BPF_K: a |= pc->k; break;
+      case BPF_ALU|BPF_OR|BPF_X: a |= x; break;
+      case BPF_ALU|BPF_AND|BPF_K: a &= pc->k; break;
+      case BPF_ALU|BPF_AND|BPF_X: a &= x; break;
+      case BPF_ALU|BPF_XOR|BPF_K: a ^= pc->k; break;
+      case BPF_ALU|BPF_XOR|BPF_X: a ^= x; break;
+      // shifts by 32 or more are undefined in C, they clear the accumulator
+      case BPF_ALU|BPF_LSH|BPF_K: a = pc->k < 32 ? a << pc->k : 0; break;
+      case BPF_ALU|BPF_LSH|BPF_X: a = x < 32 ? a << x : 0; break;
+      case BPF_ALU|BPF_RSH|BPF_K: a = pc->k < 32 ? a >> pc->k : 0; break;
+      case BPF_ALU|BPF_RSH|BPF_X: a = x < 32 ? a >> x : 0; break;
+      case BPF_ALU|BPF_NEG: a = -a; break;
+      case BPF_MISC|BPF_TAX: x = a; break;
+      case BPF_MISC|BPF_TXA: a = x; break;
+      case BPF_JMP|BPF_JA:
+        pc += pc->k;
+        break;
+      case BPF_JMP|BPF_JEQ|BPF_K: pc += a == pc->k ? pc->jt : pc->jf; break;
+      case BPF_JMP|BPF_JEQ|BPF_X: pc += a == x ? pc->jt : pc->jf; break;
+      case BPF_JMP|BPF_JGT|BPF_K: pc += a > pc->k ? pc->jt : pc->jf; break;
+      case BPF_JMP|BPF_JGT|BPF_X: pc += a > x ? pc->jt : pc->jf; break;
+      case BPF_JMP|BPF_JGE|BPF_K: pc += a >= pc->k ? pc->jt : pc->jf; break;
+      case BPF_JMP|BPF_JGE|BPF_X: pc += a >= x ? pc->jt : pc->jf; break;
+      case BPF_JMP|BPF_JSET|BPF_K: pc += a & pc->k ? pc->jt : pc->jf; break;
+      case BPF_JMP|BPF_JSET|BPF_X: pc += a & x ? pc->jt : pc->jf; break;
+      default:
+        // not reached, programs are checked when loaded
+        return 0;
+    }
+  }
+}
+
+/*
+ * Segments
+ */
+
+static void capture_segment_name(capture_engine *cap, unsigned int seq,
+                                 char *name, size_t size)
+{
+  snprintf(name, size, "%s.%u.pcapng", cap->path, seq);
+}
+
+// section and interface headers starting every segment
+static void capture_segment_headers(capture_engine *cap, char *map)
+{
+  struct pcapng_shb shb;
+  struct pcapng_idb idb;
+
+  memset(&shb, 0, sizeof(shb));
+  shb.type = PCAPNG_SHB;
+  shb.total_len = shb.total_len2 = sizeof(shb);
+  shb.magic = PCAPNG_BYTE_ORDER_MAGIC;
+  shb.major = 1;
+  shb.minor = 0;
+  shb.section_len = -1;
+
+  memset(&idb, 0, sizeof(idb));
+  idb.type = PCAPNG_IDB;
+  idb.total_len = idb.total_len2 = sizeof(idb);
+  idb.linktype = PCAPNG_LINKTYPE_ETHERNET;
+  idb.snaplen = cap->snaplen;
+  idb.tsresol_code = PCAPNG_OPT_IF_TSRESOL;
+  idb.tsresol_len = 1;
+  idb.tsresol = 9;
+  idb.end_code = PCAPNG_OPT_ENDOFOPT;
+
+  memcpy(map, &shb, sizeof(shb));
+  memcpy(map + sizeof(shb), &idb, sizeof(idb));
+}
+
+static capture_segment *capture_segment_new(capture_engine *cap,
+                                            unsigned int seq)
+{
+  int rv, tmp_errno;
+  char name[PATH_MAX];
+  capture_segment *seg;
+
+  capture_segment_name(cap, seq, name, sizeof(name));
+
+  seg = (capture_segment *)vde_calloc(sizeof(capture_segment));
+  if (seg == NULL) {
+    vde_error("%s: cannot allocate segment", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return NULL;
+  }
+  seg->seq = seq;
+
+  seg->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (seg->fd == -1) {
+    tmp_errno = errno;
+    vde_error("%s: cannot open %s: %s", __PRETTY_FUNCTION__, name,
+              strerror(errno));
+    goto err_free;
+  }
+  // blocks are reserved now, a full disk is found out here and not by a
+  // SIGBUS on the data path
+  rv = posix_fallocate(seg->fd, 0, cap->segment_size);
+  if (rv != 0) {
+    tmp_errno = rv;
+    vde_error("%s: cannot allocate %s: %s", __PRETTY_FUNCTION__, name,
+              strerror(rv));
+    goto err_unlink;
+  }
+  seg->map = mmap(NULL, cap->segment_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, seg->fd, 0);
+  if (seg->map == MAP_FAILED) {
+    tmp_errno = errno;
+    vde_error("%s: cannot map %s: %s", __PRETTY_FUNCTION__, name,
+              strerror(errno));
+    goto err_unlink;
+  }
+
+  capture_segment_headers(cap, seg->map);
+  seg->used = PCAPNG_HEADERS_SIZE;
+  return seg;
+
+err_unlink:
+  close(seg->fd);
+  unlink(name);
+err_free:
+  vde_free(seg);
+  errno = tmp_errno;
+  return NULL;
+}
+
+// the file is cut to the blocks written, or removed if not wanted
+static void capture_segment_close(capture_engine *cap, capture_segment *seg,
+                                  int remove)
+{
+  char name[PATH_MAX];
+
+  munmap(seg->map, cap->segment_size);
+  if (ftruncate(seg->fd, seg->used)) {
+    vde_warning("%s: cannot truncate segment %u: %s", __PRETTY_FUNCTION__,
+                seg->seq, strerror(errno));
+  }
+  close(seg->fd);
+  if (remove) {
+    capture_segment_name(cap, seg->seq, name, sizeof(name));
+    unlink(name);
+  }
+  vde_free(seg);
+}
+
+static void capture_work_cb(int fd, short events, void *arg);
+
+static void capture_schedule(capture_engine *cap, unsigned int delay_ms)
+{
+  struct timeval tv;
+
+  // the job reschedules itself when it is collected
+  if (cap->work_timeout != NULL ||
+      __atomic_load_n(&cap->job_state, __ATOMIC_ACQUIRE) != JOB_IDLE) {
+    return;
+  }
+  tv.tv_sec = delay_ms / 1000;
+  tv.tv_usec = (delay_ms % 1000) * 1000;
+  cap->work_timeout =
+    vde_context_timeout_add(vde_component_get_context(cap->component), 0,
+                            &tv, &capture_work_cb, (void *)cap);
+  if (cap->work_timeout == NULL) {
+    vde_warning("%s: cannot schedule segment rotation", __PRETTY_FUNCTION__);
+  }
+}
+
+/*
+ * Close the full segment and prepare the spare one, the job only touches the
+ * job_ fields. Segment files are allocated and mapped here since writing them
+ * can take as long as the disk does.
+ */
+static void capture_job(vde_context *worker, void *arg)
+{
+  char name[PATH_MAX];
+  capture_engine *cap = (capture_engine *)arg;
+
+  if (cap->job_full != NULL) {
+    capture_segment_close(cap, cap->job_full, 0);
+    cap->job_full = NULL;
+  }
+
+  if (cap->job_new) {
+    if (cap->max_segments > 0 && cap->job_seq >= cap->max_segments) {
+      capture_segment_name(cap, cap->job_seq - cap->max_segments, name,
+                           sizeof(name));
+      unlink(name);
+    }
+    cap->job_spare = capture_segment_new(cap, cap->job_seq);
+  }
+
+  if (worker != NULL) {
+    __atomic_store_n(&cap->job_state, JOB_DONE, __ATOMIC_RELEASE);
+    vde_doorbell_ring(&cap->doorbell);
+  }
+}
+
+// take the result of the job, in the event loop
+static void capture_job_collect(capture_engine *cap)
+{
+  if (cap->job_new) {
+    if (cap->job_spare == NULL) {
+      cap->errors++;
+    } else {
+      cap->spare = cap->job_spare;
+      cap->next_seq++;
+    }
+  }
+  cap->job_spare = NULL;
+  cap->job_new = 0;
+  cap->job_state = JOB_IDLE;
+
+  if (cap->spare == NULL) {
+    capture_schedule(cap, RETRY_MS);
+  } else if (cap->full != NULL) {
+    // rotated while the job was running
+    capture_schedule(cap, 0);
+  }
+}
+
+static void capture_doorbell_cb(int fd, short events, void *arg)
+{
+  capture_engine *cap = (capture_engine *)arg;
+
+  vde_doorbell_clear(&cap->doorbell);
+  if (__atomic_load_n(&cap->job_state, __ATOMIC_ACQUIRE) != JOB_DONE) {
+    return;
+  }
+  capture_job_collect(cap);
+  // taken when the job has been submitted
+  vde_component_put(cap->component, NULL);
+}
+
+// hand the full segment and the spare one to be prepared to the job
+static void capture_work_cb(int fd, short events, void *arg)
+{
+  capture_engine *cap = (capture_engine *)arg;
+
+  // one-shot timeouts must be deleted once fired
+  vde_context_timeout_del(vde_component_get_context(cap->component),
+                          cap->work_timeout);
+  cap->work_timeout = NULL;
+
+  if (cap->full == NULL && cap->spare != NULL) {
+    return;
+  }
+  cap->job_full = cap->full;
+  cap->full = NULL;
+  cap->job_new = cap->spare == NULL;
+  cap->job_seq = cap->next_seq;
+  cap->job_state = JOB_RUNNING;
+
+  if (cap->worker == NULL) {
+    capture_job(NULL, cap);
+    capture_job_collect(cap);
+    return;
+  }
+
+  // the job keeps the engine alive
+  vde_component_get(cap->component, NULL);
+  if (vde_context_worker_call(cap->worker, &capture_job, cap)) {
+    vde_component_put(cap->component, NULL);
+    vde_warning("%s: cannot submit segment job: %s", __PRETTY_FUNCTION__,
+                strerror(errno));
+    cap->full = cap->job_full;
+    cap->job_full = NULL;
+    cap->job_new = 0;
+    cap->job_state = JOB_IDLE;
+    capture_schedule(cap, RETRY_MS);
+  }
+}
+
+// switch to the spare segment, -1 if it is not ready
+static int capture_rotate(capture_engine *cap)
+{
+  if (cap->spare == NULL) {
+    // nothing prepares it if scheduling failed, try again
+    capture_schedule(cap, 0);
+    return -1;
+  }
+  cap->full = cap->cur;
+  cap->cur = cap->spare;
+  cap->spare = NULL;
+  cap->rotations++;
+  capture_schedule(cap, 0);
+  return 0;
+}
+
+static inline void capture_frame(capture_engine *cap, vde_connection *conn,
+                                 vde_pkt *pkt, uint64_t ts)
+{
+  unsigned int caplen = pkt->hdr->pkt_len;
+  size_t size;
+  uint32_t total_len;
+  struct pcapng_epb epb;
+  char *block;
+
+  if (cap->filter != NULL) {
+    caplen = capture_bpf_run(cap->filter, (const uint8_t *)pkt->payload,
+                             pkt->hdr->pkt_len);
+    if (caplen == 0) {
+      cap->filtered++;
+      return;
+    }
+    if (caplen > pkt->hdr->pkt_len) {
+      caplen = pkt->hdr->pkt_len;
+    }
+  }
+  if (caplen > cap->snaplen) {
+    caplen = cap->snaplen;
+  }
+
+  size = PCAPNG_EPB_SIZE(caplen);
+  if (cap->cur->used + size > cap->segment_size && capture_rotate(cap)) {
+    cap->dropped++;
+    vde_connection_stats_drop(conn, VDE_CONN_DROP_ENGINE);
+    return;
+  }
+
+  total_len = size;
+  epb.type = PCAPNG_EPB;
+  epb.total_len = total_len;
+  epb.if_id = 0;
+  epb.ts_high = ts >> 32;
+  epb.ts_low = ts & 0xffffffff;
+  epb.caplen = caplen;
+  epb.len = pkt->hdr->pkt_len;
+
+  block = cap->cur->map + cap->cur->used;
+  memcpy(block, &epb, sizeof(epb));
+  block += sizeof(epb);
+  memcpy(block, pkt->payload, caplen);
+  memset(block + caplen, 0, PCAPNG_PAD(caplen) - caplen);
+  memcpy(block + PCAPNG_PAD(caplen), &total_len, sizeof(total_len));
+  cap->cur->used += size;
+
+  cap->frames++;
+  cap->bytes += caplen;
+}
+
+static inline uint64_t capture_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int capture_engine_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
+{
+  capture_frame((capture_engine *)arg, conn, pkt, capture_now());
+  return 0;
+}
+
+int capture_engine_read_batchcb(vde_connection *conn, vde_pkt **pkts,
+                                unsigned int count, void *arg)
+{
+  unsigned int i;
+  // frames of a batch have been read at once
+  uint64_t now = capture_now();
+
+  for (i = 0; i < count; i++) {
+    capture_frame((capture_engine *)arg, conn, pkts[i], now);
+  }
+  return 0;
+}
+
+int capture_engine_errorcb(vde_connection *conn, vde_pkt *pkt,
+                           vde_conn_error err, void *arg)
+{
+  capture_engine *cap = (capture_engine *)arg;
+
+  if (err == CONN_WRITE_DELAY) {
+    return 0;
+  }
+
+  cap->ports = vde_list_remove(cap->ports, conn);
+  errno = EPIPE;
+  return -1;
+}
+
+int capture_engine_newconn(vde_component *component, vde_connection *conn,
+                           vde_request *req)
+{
+  capture_engine *cap = vde_component_get_priv(component);
+
+  cap->ports = vde_list_prepend(cap->ports, conn);
+
+  // frames are only read
+  vde_connection_set_callbacks(conn, &capture_engine_readcb, NULL,
+                               &capture_engine_errorcb, (void *)cap);
+  vde_connection_set_read_batch_cb(conn, &capture_engine_read_batchcb);
+  vde_connection_set_pkt_properties(conn, 0, 0);
+
+  return 0;
+}
+
+int engine_capture_stats(vde_component *component, vde_sobj **out)
+{
+  char name[PATH_MAX];
+  capture_engine *cap = vde_component_get_priv(component);
+
+  capture_segment_name(cap, cap->cur->seq, name, sizeof(name));
+
+  *out = vde_sobj_new_hash();
+  vde_sobj_hash_insert(*out, "frames", vde_sobj_new_int64(cap->frames));
+  vde_sobj_hash_insert(*out, "bytes", vde_sobj_new_int64(cap->bytes));
+  vde_sobj_hash_insert(*out, "filtered", vde_sobj_new_int64(cap->filtered));
+  vde_sobj_hash_insert(*out, "dropped", vde_sobj_new_int64(cap->dropped));
+  vde_sobj_hash_insert(*out, "rotations",
+                       vde_sobj_new_int64(cap->rotations));
+  vde_sobj_hash_insert(*out, "errors", vde_sobj_new_int64(cap->errors));
+  vde_sobj_hash_insert(*out, "ports",
+                       vde_sobj_new_int(vde_list_length(cap->ports)));
+  vde_sobj_hash_insert(*out, "file", vde_sobj_new_string(name));
+  vde_sobj_hash_insert(*out, "used", vde_sobj_new_int64(cap->cur->used));
+
+  return 0;
+}
+
+int engine_capture_rotate(vde_component *component, vde_sobj **out)
+{
+  capture_engine *cap = vde_component_get_priv(component);
+
+  if (capture_rotate(cap)) {
+    *out = vde_sobj_new_string("No segment ready");
+    errno = EAGAIN;
+    return -1;
+  }
+
+  *out = vde_sobj_new_string("Segment rotated");
+  return 0;
+}
+
+static int capture_get_int(vde_sobj *params, const char *name, int min,
+                           int max, unsigned int *value)
+{
+  vde_sobj *param = vde_sobj_hash_lookup(params, name);
+
+  if (param == NULL) {
+    return 0;
+  }
+  if (!vde_sobj_is_type(param, vde_sobj_type_int) ||
+      vde_sobj_get_int(param) < min || vde_sobj_get_int(param) > max) {
+    vde_error("%s: %s must be an integer between %d and %d",
+              __PRETTY_FUNCTION__, name, min, max);
+    errno = EINVAL;
+    return -1;
+  }
+  *value = vde_sobj_get_int(param);
+  return 0;
+}
+
+// "filter" is an array of [code, jt, jf, k] instructions
+static int capture_get_filter(capture_engine *cap, vde_sobj *param)
+{
+  int i, j, len;
+  int64_t v[4];
+  vde_sobj *insn, *field;
+
+  if (!vde_sobj_is_type(param, vde_sobj_type_array)) {
+    goto err_inval;
+  }
+  len = vde_sobj_array_length(param);
+  if (len == 0 || len > BPF_MAXINSNS) {
+    goto err_inval;
+  }
+
+  cap->filter = (struct sock_filter *)vde_calloc(len *
+                                                 sizeof(struct sock_filter));
+  if (cap->filter == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  cap->filter_len = len;
+
+  for (i = 0; i < len; i++) {
+    insn = vde_sobj_array_get_idx(param, i);
+    if (!vde_sobj_is_type(insn, vde_sobj_type_array) ||
+        vde_sobj_array_length(insn) != 4) {
+      goto err_inval;
+    }
+    for (j = 0; j < 4; j++) {
+      field = vde_sobj_array_get_idx(insn, j);
+      if (!vde_sobj_is_type(field, vde_sobj_type_int)) {
+        goto err_inval;
+      }
+      v[j] = vde_sobj_get_int64(field);
+    }
+    if (v[0] < 0 || v[0] > UINT16_MAX || v[1] < 0 || v[1] > UINT8_MAX ||
+        v[2] < 0 || v[2] > UINT8_MAX || v[3] < 0 || v[3] > UINT32_MAX) {
+      goto err_inval;
+    }
+    cap->filter[i].code = v[0];
+    cap->filter[i].jt = v[1];
+    cap->filter[i].jf = v[2];
+    cap->filter[i].k = v[3];
+  }
+
+  if (capture_bpf_check(cap->filter, cap->filter_len)) {
+    goto err_inval;
+  }
+  return 0;
+
+err_inval:
+  vde_error("%s: filter must be a valid array of [code, jt, jf, k] BPF "
+            "instructions", __PRETTY_FUNCTION__);
+  vde_free(cap->filter);
+  cap->filter = NULL;
+  errno = EINVAL;
+  return -1;
+}
+
+static void capture_engine_free(capture_engine *cap)
+{
+  if (cap->doorbell_ev != NULL) {
+    vde_context_event_del(vde_component_get_context(cap->component),
+                          cap->doorbell_ev);
+  }
+  if (cap->doorbell.rfd != -1) {
+    vde_doorbell_fini(&cap->doorbell);
+  }
+  vde_free(cap->filter);
+  vde_free(cap->path);
+  vde_free(cap);
+}
+
+static int engine_capture_init(vde_component *component, vde_sobj *params)
+{
+  int tmp_errno;
+  unsigned int segment_size = DEFAULT_SEGMENT_SIZE, nworkers;
+  vde_sobj *param;
+  capture_engine *cap;
+  vde_context *ctx = vde_component_get_context(component);
+
+  vde_assert(component != NULL);
+
+  if (params == NULL || !vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    vde_error("%s: params must be a hash", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  param = vde_sobj_hash_lookup(params, "path");
+  if (param == NULL || !vde_sobj_is_type(param, vde_sobj_type_string)) {
+    vde_error("%s: path of segment files is required", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  cap = (capture_engine *)vde_calloc(sizeof(capture_engine));
+  if (cap == NULL) {
+    vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+  cap->component = component;
+  cap->snaplen = DEFAULT_SNAPLEN;
+  cap->doorbell.rfd = cap->doorbell.wfd = -1;
+  cap->path = vde_strdup(vde_sobj_get_string(param));
+  if (cap->path == NULL) {
+    tmp_errno = ENOMEM;
+    goto err_free;
+  }
+
+  if (capture_get_int(params, "segment_size", MIN_SEGMENT_SIZE,
+                      MAX_SEGMENT_SIZE, &segment_size) ||
+      capture_get_int(params, "segments", 0, INT_MAX, &cap->max_segments) ||
+      capture_get_int(params, "snaplen", sizeof(struct eth_hdr), MAX_SNAPLEN,
+                      &cap->snaplen)) {
+    tmp_errno = errno;
+    goto err_free;
+  }
+  cap->segment_size = segment_size;
+  if (cap->max_segments > 0 && cap->max_segments < MIN_SEGMENTS) {
+    vde_error("%s: at least %d segments must be kept", __PRETTY_FUNCTION__,
+              MIN_SEGMENTS);
+    tmp_errno = EINVAL;
+    goto err_free;
+  }
+  // a segment holds at least a frame
+  if (PCAPNG_HEADERS_SIZE + PCAPNG_EPB_SIZE(cap->snaplen) >
+      cap->segment_size) {
+    vde_error("%s: segment_size too small for snaplen", __PRETTY_FUNCTION__);
+    tmp_errno = EINVAL;
+    goto err_free;
+  }
+  param = vde_sobj_hash_lookup(params, "filter");
+  if (param != NULL && capture_get_filter(cap, param)) {
+    tmp_errno = errno;
+    goto err_free;
+  }
+
+  // jobs are submitted with vde_context_worker_call(), from the root thread
+  nworkers = vde_context_get_num_workers(ctx);
+  if (vde_context_get_root(ctx) == ctx && nworkers > 0) {
+    if (vde_doorbell_init(&cap->doorbell)) {
+      tmp_errno = errno;
+      vde_error("%s: cannot create doorbell: %s", __PRETTY_FUNCTION__,
+                strerror(errno));
+      goto err_free;
+    }
+    cap->doorbell_ev = vde_context_event_add(ctx, cap->doorbell.rfd,
+                                             VDE_EV_READ | VDE_EV_PERSIST,
+                                             NULL, &capture_doorbell_cb,
+                                             (void *)cap);
+    if (cap->doorbell_ev == NULL) {
+      tmp_errno = errno;
+      vde_error("%s: could not add doorbell event", __PRETTY_FUNCTION__);
+      goto err_free;
+    }
+    cap->worker = vde_context_get_worker(ctx, nworkers - 1);
+  }
+
+  // the first segment is ready before any frame, the spare one follows
+  cap->cur = capture_segment_new(cap, 0);
+  if (cap->cur == NULL) {
+    tmp_errno = errno;
+    goto err_free;
+  }
+  cap->next_seq = 1;
+  capture_schedule(cap, 0);
+
+  // command registration phase
+  // - the header for the wrappers has been included at the top
+  // - register the commands array, the name is in the json definition
+  if (vde_component_commands_register_table(component, engine_capture_commands,
+                                        engine_capture_commands_lookup)) {
+    tmp_errno = errno;
+    vde_error("%s: could not register commands", __PRETTY_FUNCTION__);
+    goto err_close;
+  }
+
+  vde_component_set_priv(component, (void *)cap);
+  return 0;
+
+err_close:
+  if (cap->work_timeout != NULL) {
+    vde_context_timeout_del(vde_component_get_context(component),
+                            cap->work_timeout);
+  }
+  capture_segment_close(cap, cap->cur, 1);
+err_free:
+  capture_engine_free(cap);
+  errno = tmp_errno;
+  return -1;
+}
+
+void engine_capture_fini(vde_component *component)
+{
+  vde_list *ports, *iter;
+  capture_engine *cap = (capture_engine *)vde_component_get_priv(component);
+
+  if (cap->work_timeout != NULL) {
+    vde_context_timeout_del(vde_component_get_context(component),
+                            cap->work_timeout);
+  }
+
+  // connections are not removed from the list while it is walked
+  ports = cap->ports;
+  cap->ports = NULL;
+  iter = vde_list_first(ports);
+  while (iter != NULL) {
+    vde_connection_fini(vde_list_get_data(iter));
+    vde_connection_delete(vde_list_get_data(iter));
+    iter = vde_list_next(iter);
+  }
+  vde_list_delete(ports);
+
+  // workers are stopped before components are finished, a job submitted has
+  // run but may not have been collected
+  if (__atomic_load_n(&cap->job_state, __ATOMIC_ACQUIRE) == JOB_DONE) {
+    if (cap->job_spare != NULL) {
+      capture_segment_close(cap, cap->job_spare, 1);
+    }
+    vde_component_put(component, NULL);
+  }
+  if (cap->full != NULL) {
+    capture_segment_close(cap, cap->full, 0);
+  }
+  capture_segment_close(cap, cap->cur, 0);
+  if (cap->spare != NULL) {
+    capture_segment_close(cap, cap->spare, 1);
+  }
+
+  vde_component_commands_deregister(component, engine_capture_commands);
+  capture_engine_free(cap);
+}
+
+component_ops engine_capture_component_ops = {
+  .init = engine_capture_init,
+  .fini = engine_capture_fini,
+  .get_configuration = NULL,
+  .set_configuration = NULL,
+  .get_policy = NULL,
+  .set_policy = NULL,
+};
+
+vde_module VDE_MODULE_START = {
+  .kind = VDE_ENGINE,
+  .family = "capture",
+  .cops = &engine_capture_component_ops,
+  .eng_new_conn = &capture_engine_newconn,
+};
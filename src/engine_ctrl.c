@@ -28,7 +28,8 @@
 
 #include <engine_ctrl_commands.h>
 
-#define MAX_INBUF_SZ 8192
+// component names shorter than this are split from method names on the stack
+#define CTRL_NAME_BUF_SZ 64
 
 // XXX '/' is escaped by json
 #define SEP_CHAR '.'
@@ -37,6 +38,7 @@
 static char const * const builtin_commands[] = {
   "notify_add",
   "notify_del",
+  "notify_coalesce",
   NULL
 };
 
@@ -51,69 +53,149 @@ static int is_builtin(vde_command *command) {
   return 0;
 }
 
+// chunk payload when the connection has no payload limit, each chunk then
+// fills a 4096 bytes pool class
+#define CTRL_CHUNK_SZ (4096 - sizeof(vde_pkt) - sizeof(vde_hdr))
+
+/*
+ * A serialized message, \0 included, split over packets of at most chunk_sz
+ * payload bytes. Connections do not modify the packets they write, so a
+ * message can be queued on any number of ctrl connections by reference.
+ */
+typedef struct {
+  vde_context *ctx;
+  unsigned int chunk_sz;
+  vde_pkt **chunks;
+  unsigned int num_chunks;
+  unsigned int max_chunks;
+} ctrl_msg;
+
 typedef struct {
   // XXX aliases table
   vde_list *ctrl_conns;
   vde_component *component;
+  vde_hash *subs; //!< signal full path -> ctrl_sub
 } ctrl_engine;
 
+/*
+ * A signal ctrl connections are subscribed to. The engine attaches a single
+ * callback to the signal whatever the number of subscribers, each notice is
+ * serialized once and queued on all of them by reference.
+ *
+ * With a coalescing window raises following a notice are held until the
+ * window ends, then the last of them is sent once with the number of raises
+ * it stands for.
+ */
+typedef struct {
+  ctrl_engine *engine;
+  char *full_path; //!< "component.signal", the key in the engine index
+  vde_signal *signal; //!< handle, valid until the destroy callback
+  vde_list *conns; //!< subscribed ctrl_conn
+  unsigned int coalesce_ms; //!< coalescing window, 0 disables it
+  void *window; //!< window timeout, NULL when no window is open
+  unsigned int held; //!< raises held since the window opened
+  vde_sobj *held_info; //!< info of the last of them
+} ctrl_sub;
+
 typedef struct {
   vde_connection *conn;
-  char inbuf[MAX_INBUF_SZ];
-  size_t inbuf_len;
+  vde_sobj_parser *parser;
+  int skip; //!< discard input up to the next message separator
+  int coalesce; //!< replies are appended to pending instead of sent
+  ctrl_msg pending;
   vde_queue *out_queue;
-  vde_list *reg_signals;
+  vde_list *subs; //!< ctrl_sub this connection is subscribed to
   // - permission level
   ctrl_engine *engine;
 } ctrl_conn;
 
-static int ctrl_engine_conn_write(ctrl_conn *cc, vde_sobj *out_obj) {
-  const char *out_str;
-  vde_pkt *new_pkt, *send_pkt;
-  unsigned int out_len, payload_sz, last_chunk_sz, num_chunks, sent_chunks,
-               cpy_sz, rv;
-
-  // no need to free out_str, will be garbage-collected when out_obj is
-  // destroyed
-  out_str = vde_sobj_to_string(out_obj);
-  if (!out_str) {
-    // XXX must be fatal because some component has a bug
-    vde_error("%s: cannot serialize out_obj", __PRETTY_FUNCTION__);
-    return -1;
-  }
+static void ctrl_msg_init(ctrl_msg *msg, vde_context *ctx,
+                          unsigned int chunk_sz)
+{
+  memset(msg, 0, sizeof(ctrl_msg));
+  msg->ctx = ctx;
+  msg->chunk_sz = chunk_sz;
+}
+
+static void ctrl_msg_clear(ctrl_msg *msg)
+{
+  unsigned int i;
 
-  out_len = strlen(out_str) + 1; // send \0 as well
-  payload_sz = vde_connection_max_payload(cc->conn);
-  last_chunk_sz = out_len % payload_sz;
-  num_chunks = out_len / payload_sz;
-  if (last_chunk_sz) {
-    // add non-full chunk
-    num_chunks++;
+  for (i = 0; i < msg->num_chunks; i++) {
+    vde_pkt_put(msg->chunks[i]);
   }
+  vde_free(msg->chunks);
+  msg->chunks = NULL;
+  msg->num_chunks = msg->max_chunks = 0;
+}
 
-  // create packets
-  sent_chunks = 0;
-  while (num_chunks > sent_chunks) {
+// vde_sobj_write_func filling the last chunk and adding new ones when full
+static int ctrl_msg_append(const char *buf, size_t len, void *arg)
+{
+  ctrl_msg *msg = (ctrl_msg *)arg;
+  vde_pkt *pkt = msg->num_chunks ? msg->chunks[msg->num_chunks - 1] : NULL;
+  unsigned int cpy_sz;
+
+  while (len > 0) {
+    if (pkt == NULL || pkt->hdr->pkt_len == msg->chunk_sz) {
+      pkt = vde_pkt_new(msg->ctx, msg->chunk_sz, 0, 0);
+      if (pkt == NULL) {
+        errno = ENOMEM;
+        return -1;
+      }
+      // XXX: set type and version
+      if (msg->num_chunks == msg->max_chunks) {
+        msg->max_chunks = msg->max_chunks ? msg->max_chunks * 2 : 4;
+        msg->chunks = vde_realloc(msg->chunks,
+                                  msg->max_chunks * sizeof(vde_pkt *));
+      }
+      msg->chunks[msg->num_chunks++] = pkt;
+    }
+    cpy_sz = msg->chunk_sz - pkt->hdr->pkt_len;
+    if (cpy_sz > len) {
+      cpy_sz = len;
+    }
+    memcpy(pkt->payload + pkt->hdr->pkt_len, buf, cpy_sz);
+    pkt->hdr->pkt_len += cpy_sz;
+    buf += cpy_sz;
+    len -= cpy_sz;
+  }
+  return 0;
+}
 
-    if ((num_chunks == sent_chunks + 1) && last_chunk_sz) {
-      // sending non-complete last chunk
-      cpy_sz = last_chunk_sz;
-    } else {
-      cpy_sz = payload_sz;
+// append obj to msg, on error msg is left as it was
+static int ctrl_msg_serialize(ctrl_msg *msg, vde_sobj *obj)
+{
+  unsigned int num_chunks = msg->num_chunks;
+  unsigned int last_len = num_chunks ?
+                          msg->chunks[num_chunks - 1]->hdr->pkt_len : 0;
+
+  // send \0 as well
+  if (vde_sobj_serialize(obj, ctrl_msg_append, msg) ||
+      ctrl_msg_append("", 1, msg)) {
+    while (msg->num_chunks > num_chunks) {
+      vde_pkt_put(msg->chunks[--msg->num_chunks]);
     }
+    if (num_chunks) {
+      msg->chunks[num_chunks - 1]->hdr->pkt_len = last_len;
+    }
+    return -1;
+  }
+  return 0;
+}
 
-    new_pkt = vde_pkt_new(cpy_sz, 0, 0);
-    // XXX check pkt NULL
-    new_pkt->hdr->pkt_len = cpy_sz;
-    // XXX: set type and version
-    memcpy(new_pkt->payload, out_str + (sent_chunks*payload_sz), cpy_sz);
+static unsigned int ctrl_conn_chunk_sz(ctrl_conn *cc)
+{
+  unsigned int payload_sz = vde_connection_max_payload(cc->conn);
 
-    vde_queue_push_head(cc->out_queue, new_pkt);
+  return payload_sz ? payload_sz : CTRL_CHUNK_SZ;
+}
 
-    sent_chunks++;
-  }
+static void ctrl_conn_flush(ctrl_conn *cc)
+{
+  vde_pkt *send_pkt;
+  int rv;
 
-  // try to send packets
   send_pkt = vde_queue_pop_tail(cc->out_queue);
   while (send_pkt) {
     rv = vde_connection_write(cc->conn, send_pkt);
@@ -122,9 +204,55 @@ static int ctrl_engine_conn_write(ctrl_conn *cc, vde_sobj *out_obj) {
       vde_queue_push_tail(cc->out_queue, send_pkt);
       break;
     }
-    vde_free(send_pkt);
+    vde_pkt_put(send_pkt);
     send_pkt = vde_queue_pop_tail(cc->out_queue);
   }
+}
+
+static void ctrl_conn_send_msg(ctrl_conn *cc, ctrl_msg *msg)
+{
+  unsigned int i;
+
+  for (i = 0; i < msg->num_chunks; i++) {
+    vde_queue_push_head(cc->out_queue, vde_pkt_get(msg->chunks[i]));
+  }
+  ctrl_conn_flush(cc);
+}
+
+// send the replies coalesced so far
+static void ctrl_conn_send_pending(ctrl_conn *cc)
+{
+  if (cc->pending.num_chunks) {
+    ctrl_conn_send_msg(cc, &cc->pending);
+    ctrl_msg_clear(&cc->pending);
+  }
+}
+
+static int ctrl_engine_conn_write(ctrl_conn *cc, vde_sobj *out_obj) {
+  ctrl_msg msg;
+
+  // while coalescing, replies share chunks and are sent by a single flush
+  if (cc->coalesce) {
+    if (cc->pending.ctx == NULL || cc->pending.num_chunks == 0) {
+      ctrl_msg_init(&cc->pending, vde_connection_get_context(cc->conn),
+                    ctrl_conn_chunk_sz(cc));
+    }
+    if (ctrl_msg_serialize(&cc->pending, out_obj)) {
+      vde_error("%s: cannot serialize out_obj", __PRETTY_FUNCTION__);
+      return -1;
+    }
+    return 0;
+  }
+
+  ctrl_msg_init(&msg, vde_connection_get_context(cc->conn),
+                ctrl_conn_chunk_sz(cc));
+  if (ctrl_msg_serialize(&msg, out_obj)) {
+    ctrl_msg_clear(&msg);
+    vde_error("%s: cannot serialize out_obj", __PRETTY_FUNCTION__);
+    return -1;
+  }
+  ctrl_conn_send_msg(cc, &msg);
+  ctrl_msg_clear(&msg);
 
   return 0;
 }
@@ -327,216 +455,547 @@ static int check_split_path(const char *full_path, char **component_name,
   return 0;
 }
 
-static inline char *build_signal_path(vde_component *component,
-                                      const char *signal_path)
+/**
+ * @brief Send a notice to all the connections subscribed to a signal. The
+ * notice is serialized once for each distinct chunk size.
+ *
+ * @param sub The subscription
+ * @param info The signal information
+ * @param count The number of raises the notice stands for, added to the
+ * notice when greater than one
+ */
+static void ctrl_sub_notify(ctrl_sub *sub, vde_sobj *info, unsigned int count)
+{
+  vde_sobj *full_path_obj, *notice;
+  vde_list *iter;
+  ctrl_conn *cc;
+  ctrl_msg *msgs = NULL;
+  unsigned int i, num_msgs = 0, chunk_sz;
+  vde_context *ctx = vde_component_get_context(sub->engine->component);
+
+  full_path_obj = vde_sobj_new_string(sub->full_path);
+  notice = rpc_10_build_notice(full_path_obj, info);
+  vde_sobj_put(full_path_obj);
+  // XXX check notice == NULL
+  if (count > 1) {
+    vde_sobj_hash_insert(notice, "count", vde_sobj_new_int(count));
+  }
+
+  iter = vde_list_first(sub->conns);
+  while (iter != NULL) {
+    cc = vde_list_get_data(iter);
+    iter = vde_list_next(iter);
+
+    chunk_sz = ctrl_conn_chunk_sz(cc);
+    for (i = 0; i < num_msgs; i++) {
+      if (msgs[i].chunk_sz == chunk_sz) {
+        break;
+      }
+    }
+    if (i == num_msgs) {
+      // vde_realloc aborts on failure
+      msgs = vde_realloc(msgs, (num_msgs + 1) * sizeof(ctrl_msg));
+      ctrl_msg_init(&msgs[num_msgs++], ctx, chunk_sz);
+      if (ctrl_msg_serialize(&msgs[i], notice)) {
+        vde_error("%s: cannot serialize notice", __PRETTY_FUNCTION__);
+        continue;
+      }
+    }
+    if (msgs[i].num_chunks == 0) {
+      continue;
+    }
+
+    // keep notices raised by a command after the replies preceding it
+    ctrl_conn_send_pending(cc);
+    ctrl_conn_send_msg(cc, &msgs[i]);
+  }
+
+  for (i = 0; i < num_msgs; i++) {
+    ctrl_msg_clear(&msgs[i]);
+  }
+  vde_free(msgs);
+  vde_sobj_put(notice);
+}
+
+static void ctrl_sub_window_cb(int fd, short events, void *arg);
+
+static void ctrl_sub_open_window(ctrl_sub *sub)
 {
-  const char *component_name;
-  char *full_path;
-  int full_path_len;
+  struct timeval tv;
+
+  tv.tv_sec = sub->coalesce_ms / 1000;
+  tv.tv_usec = (sub->coalesce_ms % 1000) * 1000;
+  sub->window =
+    vde_context_timeout_add(vde_component_get_context(sub->engine->component),
+                            0, &tv, &ctrl_sub_window_cb, (void *)sub);
+  if (sub->window == NULL) {
+    // raises are not coalesced until the next notice
+    vde_warning("%s: cannot open coalescing window for %s",
+                __PRETTY_FUNCTION__, sub->full_path);
+  }
+}
 
-  component_name = vde_component_get_name(component);
+static void ctrl_sub_close_window(ctrl_sub *sub)
+{
+  if (sub->window != NULL) {
+    vde_context_timeout_del(vde_component_get_context(sub->engine->component),
+                            sub->window);
+    sub->window = NULL;
+  }
+  if (sub->held_info != NULL) {
+    vde_sobj_put(sub->held_info);
+    sub->held_info = NULL;
+  }
+  sub->held = 0;
+}
 
-  full_path_len = strlen(component_name) +
-                  strlen(SEP_STRING) +
-                  strlen(signal_path) +
-                  1;
-  // XXX check error on allocation
-  full_path = vde_calloc(sizeof(char) * full_path_len);
+static void ctrl_sub_window_cb(int fd, short events, void *arg)
+{
+  ctrl_sub *sub = (ctrl_sub *)arg;
+  vde_sobj *info = sub->held_info;
+  unsigned int count = sub->held;
 
-  snprintf(full_path, full_path_len, "%s%s%s",
-           component_name, SEP_STRING, signal_path);
+  // one-shot timeouts must be deleted once fired
+  sub->held_info = NULL;
+  ctrl_sub_close_window(sub);
 
-  return full_path;
+  if (count == 0) {
+    return;
+  }
+  ctrl_sub_notify(sub, info, count);
+  vde_sobj_put(info);
+  // the burst may be going on, keep merging it
+  if (sub->coalesce_ms > 0) {
+    ctrl_sub_open_window(sub);
+  }
 }
 
 static void signal_callback(vde_component *component,
                             const char *signal_path, vde_sobj *info,
                             void *arg)
 {
-  char *full_path;
-  vde_sobj *full_path_obj, *notice;
-  ctrl_conn *cc = (ctrl_conn *)arg;
-
-  full_path = build_signal_path(component, signal_path);
+  ctrl_sub *sub = (ctrl_sub *)arg;
 
-  full_path_obj = vde_sobj_new_string(full_path);
+  if (info == NULL) {
+    return;
+  }
 
-  notice = rpc_10_build_notice(full_path_obj, info);
-  // XXX check notice == NULL
-  ctrl_engine_conn_write(cc, notice);
+  if (sub->window != NULL) {
+    vde_sobj_get(info);
+    if (sub->held_info != NULL) {
+      vde_sobj_put(sub->held_info);
+    }
+    sub->held_info = info;
+    sub->held++;
+    return;
+  }
 
-  vde_sobj_put(full_path_obj);
-  vde_sobj_put(notice);
+  ctrl_sub_notify(sub, info, 1);
+  if (sub->coalesce_ms > 0) {
+    ctrl_sub_open_window(sub);
+  }
+}
 
-  vde_free(full_path);
+static void ctrl_sub_free(ctrl_sub *sub)
+{
+  ctrl_sub_close_window(sub);
+  vde_hash_remove(sub->engine->subs, sub->full_path);
+  vde_list_delete(sub->conns);
+  vde_free(sub->full_path);
+  vde_free(sub);
 }
 
 static void signal_destroy_callback(vde_component *component,
                                     const char *signal_path, void *arg)
 {
-  char *full_path, *reg_full_path;
-  ctrl_conn *cc = (ctrl_conn *)arg;
+  ctrl_sub *sub = (ctrl_sub *)arg;
   vde_list *iter;
+  ctrl_conn *cc;
 
-  // XXX check full_path == NULL
-  full_path = build_signal_path(component, signal_path);
-
-  iter = vde_list_first(cc->reg_signals);
+  // the signal is going away along with its callbacks
+  iter = vde_list_first(sub->conns);
   while (iter != NULL) {
-    reg_full_path = (char *)vde_list_get_data(iter);
-
-    if (!strncmp(reg_full_path, full_path, strlen(reg_full_path))) {
-      cc->reg_signals = vde_list_remove(cc->reg_signals, reg_full_path);
-      free(reg_full_path);
-      break;
-    }
+    cc = vde_list_get_data(iter);
+    cc->subs = vde_list_remove(cc->subs, sub);
     iter = vde_list_next(iter);
   }
-
-  vde_free(full_path);
+  ctrl_sub_free(sub);
 }
 
-int engine_ctrl_notify_add(vde_component *component, const char *full_path,
-                           vde_sobj **out)
+/**
+ * @brief Subscribe a ctrl connection to a signal, the engine attaches to the
+ * signal with its first subscriber
+ *
+ * @param cc The ctrl connection
+ * @param full_path The signal path, "component.signal"
+ * @param err_msg Reference to the error message to reply with on error
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int ctrl_sub_add_conn(ctrl_conn *cc, const char *full_path,
+                             const char **err_msg)
 {
-  char *s_component_name, *signal_name, *reg_full_path;
+  char *s_component_name, *signal_name;
   vde_component *s_component;
-  int rv, tmp_errno = 0;
-
-  // builtin command, casting component
-  ctrl_conn *cc = (ctrl_conn *)component;
+  vde_signal *signal;
+  ctrl_engine *ctrl = cc->engine;
+  ctrl_sub *sub;
+
+  sub = vde_hash_lookup(ctrl->subs, full_path);
+  if (sub != NULL) {
+    if (vde_list_find(sub->conns, cc) != NULL) {
+      *err_msg = "Failed to attach to signal";
+      errno = EEXIST;
+      return -1;
+    }
+    sub->conns = vde_list_prepend(sub->conns, cc);
+    cc->subs = vde_list_prepend(cc->subs, sub);
+    return 0;
+  }
 
   if (check_split_path(full_path, &s_component_name, &signal_name) == -1) {
     // XXX: what if errno == ENOMEM ?
-    *out = vde_sobj_new_string("Signal path not well-formed");
-    tmp_errno = EINVAL;
-    rv = -1;
-    goto out;
+    *err_msg = "Signal path not well-formed";
+    errno = EINVAL;
+    return -1;
   }
-
   s_component = vde_context_get_component(vde_connection_get_context(cc->conn),
                                           s_component_name);
+  signal = s_component ? vde_component_signal_get(s_component, signal_name) :
+                         NULL;
+  free(s_component_name);
+  free(signal_name);
   if (!s_component) {
-    *out = vde_sobj_new_string("Component not found");
-    tmp_errno = ENOENT;
-    rv = -1;
-    goto cleannames;
-  }
-  rv = vde_component_signal_attach(s_component, signal_name, signal_callback,
-                                   signal_destroy_callback, (void *)cc);
-  if (rv != 0) {
-    tmp_errno = errno;
-    *out = vde_sobj_new_string("Failed to attach to signal");
-  } else {
-    *out = vde_sobj_new_string("Signal attached");
-    // XXX check NULL
-    reg_full_path = vde_strndup(full_path, strlen(full_path));
-    cc->reg_signals = vde_list_prepend(cc->reg_signals, reg_full_path);
+    *err_msg = "Component not found";
+    errno = ENOENT;
+    return -1;
+  }
+  if (!signal) {
+    vde_component_put(s_component, NULL);
+    *err_msg = "Failed to attach to signal";
+    errno = ENOENT;
+    return -1;
   }
 
-cleannames:
-  free(s_component_name);
-  free(signal_name);
-out:
-  errno = tmp_errno;
-  return rv;
+  sub = (ctrl_sub *)vde_calloc(sizeof(ctrl_sub));
+  if (sub == NULL) {
+    vde_component_put(s_component, NULL);
+    *err_msg = "Failed to attach to signal";
+    errno = ENOMEM;
+    return -1;
+  }
+  sub->engine = ctrl;
+  sub->signal = signal;
+  sub->full_path = vde_strndup(full_path, strlen(full_path));
+  // the component is held until attached, from then on its deletion is
+  // reported by signal_destroy_callback()
+  if (vde_signal_attach(signal, signal_callback, signal_destroy_callback,
+                        (void *)sub)) {
+    vde_component_put(s_component, NULL);
+    *err_msg = "Failed to attach to signal";
+    vde_free(sub->full_path);
+    vde_free(sub);
+    return -1;
+  }
+  vde_component_put(s_component, NULL);
+  vde_hash_insert(ctrl->subs, sub->full_path, sub);
+
+  sub->conns = vde_list_prepend(sub->conns, cc);
+  cc->subs = vde_list_prepend(cc->subs, sub);
+  return 0;
 }
 
-int engine_ctrl_notify_del(vde_component *component, const char *full_path,
+/**
+ * @brief Unsubscribe a ctrl connection from a signal, the engine detaches
+ * from the signal with its last subscriber
+ *
+ * @param sub The subscription
+ * @param cc The ctrl connection
+ */
+static void ctrl_sub_del_conn(ctrl_sub *sub, ctrl_conn *cc)
+{
+  sub->conns = vde_list_remove(sub->conns, cc);
+  cc->subs = vde_list_remove(cc->subs, sub);
+  if (sub->conns != NULL) {
+    return;
+  }
+
+  if (vde_signal_detach(sub->signal, signal_callback, signal_destroy_callback,
+                        (void *)sub)) {
+    // XXX fatal here?
+    vde_error("%s: cannot detach %s", __PRETTY_FUNCTION__, sub->full_path);
+  }
+  ctrl_sub_free(sub);
+}
+
+// the subscription of cc to full_path, NULL if not subscribed
+static ctrl_sub *ctrl_conn_sub_lookup(ctrl_conn *cc, const char *full_path)
+{
+  ctrl_sub *sub = vde_hash_lookup(cc->engine->subs, full_path);
+
+  if (sub == NULL || vde_list_find(cc->subs, sub) == NULL) {
+    return NULL;
+  }
+  return sub;
+}
+
+int engine_ctrl_notify_add(vde_component *component, const char *full_path,
                            vde_sobj **out)
 {
-  char *s_component_name, *signal_name;
-  char *iter_path, *reg_full_path = NULL;
-  vde_component *s_component;
-  vde_list *iter;
-  int rv, tmp_errno = 0;
+  const char *err_msg;
 
   // builtin command, casting component
   ctrl_conn *cc = (ctrl_conn *)component;
 
-  // search full_path inside cc
-  iter = vde_list_first(cc->reg_signals);
-  while (iter != NULL) {
-    iter_path = (char *)vde_list_get_data(iter);
-    if (!strncmp(iter_path, full_path, strlen(iter_path))) {
-      reg_full_path = iter_path;
-      break;
-    }
-    iter = vde_list_next(iter);
+  if (ctrl_sub_add_conn(cc, full_path, &err_msg)) {
+    *out = vde_sobj_new_string(err_msg);
+    return -1;
   }
-  if (reg_full_path == NULL) {
+
+  *out = vde_sobj_new_string("Signal attached");
+  return 0;
+}
+
+int engine_ctrl_notify_del(vde_component *component, const char *full_path,
+                           vde_sobj **out)
+{
+  ctrl_sub *sub;
+
+  // builtin command, casting component
+  ctrl_conn *cc = (ctrl_conn *)component;
+
+  sub = ctrl_conn_sub_lookup(cc, full_path);
+  if (sub == NULL) {
     *out = vde_sobj_new_string("Signal not registered in connection");
-    tmp_errno = ENOENT;
-    rv = -1;
-    goto out;
+    errno = ENOENT;
+    return -1;
   }
 
-  if (check_split_path(full_path, &s_component_name, &signal_name) == -1) {
-    // XXX: what if errno == ENOMEM ?
-    *out = vde_sobj_new_string("Signal path not well-formed");
-    tmp_errno = EINVAL;
-    rv = -1;
-    goto out;
+  ctrl_sub_del_conn(sub, cc);
+
+  *out = vde_sobj_new_string("Signal detached");
+  return 0;
+}
+
+int engine_ctrl_notify_coalesce(vde_component *component,
+                                const char *full_path, int window_ms,
+                                vde_sobj **out)
+{
+  ctrl_sub *sub;
+
+  // builtin command, casting component
+  ctrl_conn *cc = (ctrl_conn *)component;
+
+  sub = ctrl_conn_sub_lookup(cc, full_path);
+  if (sub == NULL) {
+    *out = vde_sobj_new_string("Signal not registered in connection");
+    errno = ENOENT;
+    return -1;
+  }
+  if (window_ms < 0) {
+    *out = vde_sobj_new_string("Coalescing window must not be negative");
+    errno = EINVAL;
+    return -1;
   }
 
-  s_component = vde_context_get_component(vde_connection_get_context(cc->conn),
-                                          s_component_name);
-  if (!s_component) {
-    *out = vde_sobj_new_string("Component not found");
-    tmp_errno = ENOENT;
-    rv = -1;
-    goto cleannames;
-  }
-  rv = vde_component_signal_detach(s_component, signal_name, signal_callback,
-                                   signal_destroy_callback, (void *)cc);
-  if (rv != 0) {
-    tmp_errno = errno;
-    *out = vde_sobj_new_string("Failed to detach from signal");
-    goto cleannames;
+  // an open window ends as scheduled, the new one applies from then on
+  sub->coalesce_ms = window_ms;
+
+  *out = vde_sobj_new_string("Coalescing window set");
+  return 0;
+}
+
+int engine_ctrl_trace_sample(vde_component *component, int rate,
+                             vde_sobj **out)
+{
+  if (rate < 0) {
+    *out = vde_sobj_new_string("Sampling rate must not be negative");
+    errno = EINVAL;
+    return -1;
   }
 
-  cc->reg_signals = vde_list_remove(cc->reg_signals, reg_full_path);
-  free(reg_full_path);
+  // histograms are in connection stats, e.g. switch port_stats
+  vde_context_set_trace_sample(vde_component_get_context(component), rate);
 
-  *out = vde_sobj_new_string("Signal detached");
+  *out = vde_sobj_new_string("Sampling rate set");
+  return 0;
+}
 
-cleannames:
-  free(s_component_name);
-  free(signal_name);
-out:
-  errno = tmp_errno;
-  return rv;
+int engine_ctrl_config_save(vde_component *component, const char *path,
+                            vde_sobj **out)
+{
+  if (vde_context_config_save(vde_component_get_context(component), path)) {
+    *out = vde_sobj_new_string(strerror(errno));
+    return -1;
+  }
+
+  *out = vde_sobj_new_string("Configuration saved");
+  return 0;
 }
 
-static void ctrl_engine_deserialize_string(char *string, void *arg)
+int engine_ctrl_config_load(vde_component *component, const char *path,
+                            vde_sobj **out)
 {
-  ctrl_conn *cc = (ctrl_conn *)arg;
-  vde_sobj *in_sobj, *out_sobj = NULL, *mesg_id, *reply, *err_code;
-  const char *method_name;
-  char *component_name, *command_name;
-  command_func func;
-  int rv;
+  if (vde_context_config_load(vde_component_get_context(component), path)) {
+    *out = vde_sobj_new_string(strerror(errno));
+    return -1;
+  }
 
-  vde_command *command;
+  *out = vde_sobj_new_string("Configuration loaded");
+  return 0;
+}
+
+/*
+ * A method resolved to its command. Batches keep the methods they call in a
+ * cache, holding a reference on each component so that it stays valid.
+ */
+typedef struct {
   vde_component *component;
+  vde_command *command;
+} ctrl_method;
+
+typedef struct {
+  vde_hash *methods; //!< method name -> ctrl_method
+  vde_list *entries;
+} ctrl_method_cache;
 
-  in_sobj = vde_sobj_from_string(string);
-  if (!in_sobj) {
-    // XXX: here and below check reply == NULL
-    // and check ctrl_engine_conn_write()
-    reply = rpc_XX_build_error_reply(NULL, EINVAL,
-                                     "Cannot deserialize command");
-    ctrl_engine_conn_write(cc, reply);
-    vde_sobj_put(reply);
-    goto out;
+/**
+ * @brief Resolve a method name to its component and command
+ *
+ * @param cc The ctrl connection
+ * @param method_name The method name, "component.command"
+ * @param method The method to fill
+ * @param err_msg Reference to the error message to reply with on error
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately). On
+ * success the method holds a reference to its component.
+ */
+static int ctrl_method_resolve(ctrl_conn *cc, const char *method_name,
+                               ctrl_method *method, const char **err_msg)
+{
+  char name_buf[CTRL_NAME_BUF_SZ], *component_name;
+  const char *sep, *command_name;
+  size_t component_len;
+
+  // same checks as check_split_path(), the command name is the tail of
+  // method_name and short component names are split on the stack
+  sep = strchr(method_name, SEP_CHAR);
+  if (!sep || sep == method_name || *(sep + 1) == '\0') {
+    *err_msg = "Method name not well-formed";
+    errno = EINVAL;
+    return -1;
   }
+  command_name = sep + 1;
+  component_len = sep - method_name;
+  if (component_len < CTRL_NAME_BUF_SZ) {
+    memcpy(name_buf, method_name, component_len);
+    name_buf[component_len] = '\0';
+    component_name = name_buf;
+  } else {
+    component_name = vde_strndup(method_name, component_len);
+  }
+
+  method->component =
+    vde_context_get_component(vde_connection_get_context(cc->conn),
+                              component_name);
+  if (component_name != name_buf) {
+    vde_free(component_name);
+  }
+  if (!method->component) {
+    *err_msg = "Component not found";
+    errno = ENOENT;
+    return -1;
+  }
+
+  method->command = vde_component_command_get(method->component,
+                                              command_name);
+  if (!method->command) {
+    vde_component_put(method->component, NULL);
+    *err_msg = "Command not found";
+    errno = ENOENT;
+    return -1;
+  }
+
+  return 0;
+}
+
+static void ctrl_method_cache_init(ctrl_method_cache *cache)
+{
+  cache->methods = vde_hash_init_string();
+  cache->entries = NULL;
+}
+
+static void ctrl_method_cache_fini(ctrl_method_cache *cache)
+{
+  vde_list *iter;
+  ctrl_method *method;
+
+  iter = vde_list_first(cache->entries);
+  while (iter != NULL) {
+    method = vde_list_get_data(iter);
+    vde_component_put(method->component, NULL);
+    vde_free(method);
+    iter = vde_list_next(iter);
+  }
+  vde_list_delete(cache->entries);
+  vde_hash_delete(cache->methods);
+}
 
+/**
+ * @brief Lookup a method in a cache, resolving and adding it on a miss
+ *
+ * @param cc The ctrl connection
+ * @param cache The cache
+ * @param method_name The method name, it must stay valid while cached
+ * @param err_msg Reference to the error message to reply with on error
+ *
+ * @return The method, NULL on error (and errno is set appropriately)
+ */
+static ctrl_method *ctrl_method_cache_lookup(ctrl_conn *cc,
+                                             ctrl_method_cache *cache,
+                                             const char *method_name,
+                                             const char **err_msg)
+{
+  ctrl_method *method;
+
+  method = vde_hash_lookup(cache->methods, method_name);
+  if (method) {
+    return method;
+  }
+
+  method = vde_alloc(sizeof(ctrl_method));
+  if (ctrl_method_resolve(cc, method_name, method, err_msg)) {
+    vde_free(method);
+    return NULL;
+  }
+  vde_hash_insert(cache->methods, method_name, method);
+  cache->entries = vde_list_prepend(cache->entries, method);
+  return method;
+}
+
+/**
+ * @brief Run a method call received on a ctrl connection
+ *
+ * @param cc The ctrl connection
+ * @param in_sobj The method call
+ * @param cache The cache to resolve the method with, NULL to resolve it
+ * without caching
+ *
+ * @return The reply to the call
+ */
+static vde_sobj *ctrl_engine_call(ctrl_conn *cc, vde_sobj *in_sobj,
+                                  ctrl_method_cache *cache)
+{
+  vde_sobj *out_sobj = NULL, *mesg_id, *reply, *err_code;
+  const char *method_name, *err_msg;
+  ctrl_method *method, resolved;
+  command_func func;
+  int rv;
+
+  // XXX: here and below check reply == NULL
   if (rpc_10_sobj_validate_call(in_sobj)) {
-    reply = rpc_XX_build_error_reply(NULL, EINVAL,
-                                     "Invalid method call received");
-    ctrl_engine_conn_write(cc, reply);
-    vde_sobj_put(reply);
-    goto cleaninsobj;
+    return rpc_XX_build_error_reply(NULL, EINVAL,
+                                    "Invalid method call received");
   }
 
   // mesg_id will be freed by vde_sobj_put(in_sobj)
@@ -546,42 +1005,28 @@ static void ctrl_engine_deserialize_string(char *string, void *arg)
 
   method_name = vde_sobj_get_string(vde_sobj_hash_lookup(in_sobj, "method"));
 
-  if (check_split_path(method_name, &component_name, &command_name) == -1) {
-    // XXX: what if errno == ENOMEM ?
-    reply = rpc_XX_build_error_reply(mesg_id, EINVAL,
-                                     "Method name not well-formed");
-    ctrl_engine_conn_write(cc, reply);
-    vde_sobj_put(reply);
-    goto cleaninsobj;
+  if (cache) {
+    method = ctrl_method_cache_lookup(cc, cache, method_name, &err_msg);
+  } else {
+    method = ctrl_method_resolve(cc, method_name, &resolved, &err_msg) ?
+             NULL : &resolved;
   }
-
-  component = vde_context_get_component(vde_connection_get_context(cc->conn),
-                                        component_name);
-  if (!component) {
-    reply = rpc_XX_build_error_reply(mesg_id, ENOENT, "Component not found");
-    ctrl_engine_conn_write(cc, reply);
-    vde_sobj_put(reply);
-    goto cleannames;
+  if (!method) {
+    return rpc_XX_build_error_reply(mesg_id, errno, err_msg);
   }
 
-  command = vde_component_command_get(component, command_name);
-  if (!command) {
-    reply = rpc_XX_build_error_reply(mesg_id, ENOENT, "Command not found");
-    ctrl_engine_conn_write(cc, reply);
-    vde_sobj_put(reply);
-    goto cleannames;
-  }
-
-  func = vde_command_get_func(command);
+  func = vde_command_get_func(method->command);
   // XXX check permission level
 
-  if (component == cc->engine->component && is_builtin(command)) {
+  if (method->component == cc->engine->component &&
+      is_builtin(method->command)) {
     // ctrl engine builtin commands just need ctrl connection, passing cc
     // instead of component
     rv = func((vde_component *)cc, vde_sobj_hash_lookup(in_sobj, "params"),
               &out_sobj);
   } else {
-    rv = func(component, vde_sobj_hash_lookup(in_sobj, "params"), &out_sobj);
+    rv = func(method->component, vde_sobj_hash_lookup(in_sobj, "params"),
+              &out_sobj);
   }
 
   if (rv) {
@@ -594,153 +1039,140 @@ static void ctrl_engine_deserialize_string(char *string, void *arg)
     vde_sobj_put(out_sobj);
   }
   // XXX check reply == NULL
+  if (method == &resolved) {
+    vde_component_put(method->component, NULL);
+  }
+
+  return reply;
+}
+
+/**
+ * @brief Run a batch of method calls, an array of calls as in JSON-RPC 2.0.
+ * Calls are run in order and methods are resolved once per batch.
+ *
+ * @param cc The ctrl connection
+ * @param batch The batch
+ *
+ * @return The array of replies to the calls, in the same order
+ */
+static vde_sobj *ctrl_engine_batch(ctrl_conn *cc, vde_sobj *batch)
+{
+  vde_sobj *replies;
+  ctrl_method_cache cache;
+  int i, len;
+
+  len = vde_sobj_array_length(batch);
+  if (len == 0) {
+    return rpc_XX_build_error_reply(NULL, EINVAL, "Empty batch received");
+  }
+
+  ctrl_method_cache_init(&cache);
+  replies = vde_sobj_new_array();
+  for (i = 0; i < len; i++) {
+    vde_sobj_array_add(replies,
+                       ctrl_engine_call(cc, vde_sobj_array_get_idx(batch, i),
+                                        &cache));
+  }
+  ctrl_method_cache_fini(&cache);
+
+  return replies;
+}
+
+/**
+ * @brief Run a message received on a ctrl connection and send its reply
+ *
+ * @param cc The ctrl connection
+ * @param in_sobj The message, a method call or a batch of them, its reference
+ * is taken
+ */
+static void ctrl_engine_handle_message(ctrl_conn *cc, vde_sobj *in_sobj)
+{
+  vde_sobj *reply;
+
+  if (vde_sobj_is_type(in_sobj, vde_sobj_type_array)) {
+    reply = ctrl_engine_batch(cc, in_sobj);
+  } else {
+    reply = ctrl_engine_call(cc, in_sobj, NULL);
+  }
 
   // XXX check error
   ctrl_engine_conn_write(cc, reply);
 
   vde_sobj_put(reply);
-
-cleannames:
-  // using free as a result of using strdup as well instead of vde_free
-  free(component_name);
-  free(command_name);
-cleaninsobj:
   vde_sobj_put(in_sobj);
-out:
-  return;
 }
 
 /**
- * @brief Split packet payload using \0 as separator
+ * @brief Feed packet payload to the connection parser, messages are separated
+ * by \0 and may span any number of packets
  *
- * @param pkt The packet to operate on
- * @param inbuf A buffer where to put remainder string
- * @param inbuf_len Length of valid bytes inside inbuf
- * @param inbuf_sz Total length of inbuf
- * @param func The callback to call for each complete string found
- * @param priv A private data pointer passed to func
+ * As with vde_sobj_from_string() only the first object of a message is used,
+ * anything following it up to the separator is discarded. Replies to all the
+ * messages completed by the packet are sent together.
  *
- * @return zero on success, an error code otherwise
+ * @param cc The ctrl connection
+ * @param pkt The packet to operate on
  */
-static int ctrl_split_payload(vde_pkt *pkt,
-                             char *inbuf, size_t *inbuf_len, int inbuf_sz,
-                             void (*func)(char *string, void *priv),
-                             void *priv)
+static void ctrl_parse_payload(ctrl_conn *cc, vde_pkt *pkt)
 {
-  char *buf, *next, *inbuf_tmp = NULL, *to_serial;
-  int remaining, buf_len = 0, rv = 0;
+  char *buf, *sep;
+  size_t remaining, len;
+  vde_sobj *in_sobj, *reply;
+
+  cc->coalesce = 1;
 
   buf = pkt->payload;
   remaining = pkt->hdr->pkt_len;
-  while ((next = memchr(buf, 0, remaining))) {
-    // a token is present in buf
-    buf_len = next - buf;
-    if (*inbuf_len) {
-      // there is a partial string in inbuf, append that and buf into inbuf_tmp
-      inbuf_tmp = vde_alloc(sizeof(char) * (*inbuf_len + buf_len));
-      if (!inbuf_tmp) {
-        vde_error("%s: cannot allocate memory for temp buffer",
-                  __PRETTY_FUNCTION__);
-        // XXX document somewhere that inbuf is not reset in this case
-        errno = ENOMEM;
-        rv = -1;
-        goto exit;
+  while (remaining > 0) {
+    sep = memchr(buf, 0, remaining);
+    // the separator is fed as well, it ends the message for the parser
+    len = sep ? (size_t)(sep - buf) + 1 : remaining;
+
+    if (!cc->skip) {
+      in_sobj = vde_sobj_parser_feed(cc->parser, buf, len);
+      if (in_sobj) {
+        cc->skip = 1;
+        ctrl_engine_handle_message(cc, in_sobj);
+      } else if (errno != EAGAIN) {
+        cc->skip = 1;
+        reply = rpc_XX_build_error_reply(NULL, EINVAL,
+                                         "Cannot deserialize command");
+        ctrl_engine_conn_write(cc, reply);
+        vde_sobj_put(reply);
       }
-      memcpy(inbuf_tmp, inbuf, *inbuf_len);
-      memcpy(inbuf_tmp + *inbuf_len, buf, buf_len);
-
-      *inbuf_len = 0;
-      to_serial = inbuf_tmp;
-    } else {
-      to_serial = buf;
-    }
-
-    func(to_serial, priv);
-
-    if (inbuf_tmp != NULL) {
-      vde_free(inbuf_tmp);
-      inbuf_tmp = NULL;
-    }
-
-    // recalc pointers for next cycle, +1 for separator
-    remaining = remaining - (buf_len + 1);
-    if (remaining > 0) {
-      buf = next + 1;
     }
 
-    // XXX assert(remaining >= 0);
-  }
-
-  // no token left, check if we need to store a partial string in inbuf
-  if (remaining > 0) {
-    if (remaining + *inbuf_len > inbuf_sz) {
-      *inbuf_len = 0;
-      vde_warning("%s: partial string too long for inbuf, dropping",
-                  __PRETTY_FUNCTION__);
-      errno = ENOSPC;
-      rv = -1;
-      goto exit;
-    } else {
-      memcpy(inbuf + *inbuf_len, buf, remaining);
-      *inbuf_len = *inbuf_len + remaining;
+    if (sep) {
+      vde_sobj_parser_reset(cc->parser);
+      cc->skip = 0;
     }
+    buf += len;
+    remaining -= len;
   }
 
-exit:
-  return rv;
+  cc->coalesce = 0;
+  ctrl_conn_send_pending(cc);
 }
 
 static void ctrl_conn_fini_noengine(ctrl_conn *cc)
 {
-  int rv;
   vde_pkt *pkt;
-  vde_list *iter;
-  char *sig_full_path, *component_name, *sig_path;
-  vde_context *ctx;
-  vde_component *component;
 
   // cleanup outgoing packets
   pkt = vde_queue_pop_tail(cc->out_queue);
   while (pkt != NULL) {
-    vde_free(pkt);
+    vde_pkt_put(pkt);
     pkt = vde_queue_pop_tail(cc->out_queue);
   }
   vde_queue_delete(cc->out_queue);
+  ctrl_msg_clear(&cc->pending);
 
-  ctx = vde_connection_get_context(cc->conn);
-
-  // detach from all signals
-  iter = vde_list_first(cc->reg_signals);
-  while (iter != NULL) {
-    sig_full_path = vde_list_get_data(iter);
-    if (check_split_path(sig_full_path, &component_name, &sig_path) == -1) {
-      // XXX fatal here if errno != ENOMEM ?
-      vde_error("%s: cannot split path %s", __PRETTY_FUNCTION__,
-                sig_full_path);
-    } else {
-      component = vde_context_get_component(ctx, component_name);
-      if (!component) {
-        // XXX fatal here?
-        vde_error("%s: cannot lookup component %s", __PRETTY_FUNCTION__,
-                  component_name);
-      } else {
-        rv = vde_component_signal_detach(component, sig_path, signal_callback,
-                                         signal_destroy_callback, (void *)cc);
-        if (rv != 0) {
-          // XXX fatal here?
-          vde_error("%s: cannot detach %s", __PRETTY_FUNCTION__,
-                    sig_full_path);
-        }
-      }
-
-      free(component_name);
-      free(sig_path);
-    }
-    free(sig_full_path);
-
-    iter = vde_list_next(iter);
+  // unsubscribe from all signals, cc->subs shrinks at each step
+  while (cc->subs != NULL) {
+    ctrl_sub_del_conn(vde_list_get_data(vde_list_first(cc->subs)), cc);
   }
-  vde_list_delete(cc->reg_signals);
+
+  vde_sobj_parser_delete(cc->parser);
 
   // free ctrl_conn
   vde_free(cc);
@@ -760,39 +1192,17 @@ int ctrl_engine_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
 
   // XXX check pkt type is CTRL
 
-  if (ctrl_split_payload(pkt, cc->inbuf, &cc->inbuf_len, MAX_INBUF_SZ,
-                        ctrl_engine_deserialize_string, (void *)cc)) {
-
-    // XXX gracefully handle cases where payload cannot fit in inbuf
-    vde_debug("%s: error splitting payload, closing", __PRETTY_FUNCTION__);
-
-    ctrl_conn_fini(cc);
-
-    errno = EPIPE;
-    return -1;
-  }
+  ctrl_parse_payload(cc, pkt);
 
   return 0;
 }
 
 int ctrl_engine_writecb(vde_connection *conn, vde_pkt *pkt, void *arg)
 {
-  vde_pkt *q_pkt;
-  int rv;
   ctrl_conn *cc = (ctrl_conn *)arg;
 
   // try to flush out queue if some packets are waiting
-  q_pkt = vde_queue_pop_tail(cc->out_queue);
-  while (q_pkt) {
-    rv = vde_connection_write(cc->conn, q_pkt);
-    if (rv != 0) {
-      // couldn't write, requeue
-      vde_queue_push_tail(cc->out_queue, q_pkt);
-      break;
-    }
-    vde_free(q_pkt);
-    q_pkt = vde_queue_pop_tail(cc->out_queue);
-  }
+  ctrl_conn_flush(cc);
 
   return 0;
 }
@@ -830,10 +1240,17 @@ int ctrl_engine_newconn(vde_component *component, vde_connection *conn,
     errno = ENOMEM;
     return -1;
   }
+  cc->parser = vde_sobj_parser_new();
+  if (cc->parser == NULL) {
+    vde_error("%s: could not allocate parser", __PRETTY_FUNCTION__);
+    vde_free(cc);
+    errno = ENOMEM;
+    return -1;
+  }
   cc->conn = conn;
   cc->out_queue = vde_queue_init();
   cc->engine = ctrl;
-  cc->reg_signals = NULL;
+  cc->subs = NULL;
 
   ctrl->ctrl_conns = vde_list_prepend(ctrl->ctrl_conns, cc);
 
@@ -844,7 +1261,7 @@ int ctrl_engine_newconn(vde_component *component, vde_connection *conn,
    * XXX: define send properties and policy for discarding packets
   send_timeout.tv_sec = TIMEOUT;
   send_timeout.tv_usec = 0;
-  vde_connection_set_send_properties(conn, TIMES, &send_timeout);
+  vde_connection_set_send_properties(conn, TIMES, &send_timeout, 0);
   */
   return 0;
 }
@@ -864,10 +1281,13 @@ static int engine_ctrl_init(vde_component *component, vde_sobj *params)
   }
 
   ctrl->component = component;
+  ctrl->subs = vde_hash_init_string();
 
-  if (vde_component_commands_register(component, engine_ctrl_commands)) {
+  if (vde_component_commands_register_table(component, engine_ctrl_commands,
+                                        engine_ctrl_commands_lookup)) {
     tmp_errno = errno;
     vde_error("%s: could not register commands", __PRETTY_FUNCTION__);
+    vde_hash_delete(ctrl->subs);
     vde_free(ctrl);
     errno = tmp_errno;
     return -1;
@@ -882,19 +1302,24 @@ void engine_ctrl_fini(vde_component *component)
 {
   vde_list *iter;
   ctrl_conn *cc;
+  vde_connection *conn;
   ctrl_engine *ctrl = vde_component_get_priv(component);
 
   iter = vde_list_first(ctrl->ctrl_conns);
   while (iter != NULL) {
     cc = vde_list_get_data(iter);
-    vde_connection_fini(cc->conn);
-    vde_connection_delete(cc->conn);
+    conn = cc->conn;
+    // cc needs the connection context, release it first
     ctrl_conn_fini_noengine(cc);
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
 
     iter = vde_list_next(iter);
   }
   vde_list_delete(ctrl->ctrl_conns);
 
+  vde_component_commands_deregister(component, engine_ctrl_commands);
+  vde_hash_delete(ctrl->subs);
   vde_free(ctrl);
 }
 
@@ -23,14 +23,28 @@
 #include <vde3/engine.h>
 #include <vde3/context.h>
 #include <vde3/connection.h>
+#include <vde3/packet.h>
+#include <vde3/storm.h>
 
 #include <engine_hub_commands.h>
 
 // from vde_switch/packetq.c
 #define TIMEOUT 5
 #define TIMES 10
+
+// bytes queued on a port before the connection drops packets for it, and
+// watermarks between which the engine stops and resumes writing to it
+#define PORT_QUEUE_BYTES (128 * 1024)
+#define PORT_HIGH_WM (96 * 1024)
+#define PORT_LOW_WM (32 * 1024)
 // end from vde_switch/packetq.c
 
+// packets of a batch forwarded for each walk of the port list
+#define BATCH_CHUNK 64
+
+// seconds between two stats signals, 0 disables them
+#define DEFAULT_STATS_INTERVAL 10
+
 
 // START temporary signals declaration
 // XXX as for commands, signals should be auto-generated
@@ -38,51 +52,322 @@
 static vde_signal engine_hub_signals [] = {
   { "port_new", NULL, NULL, NULL },
   { "port_del", NULL, NULL, NULL },
+  { "stats", NULL, NULL, NULL },
   { NULL, NULL, NULL, NULL },
 };
 // END temporary signals declaration
 
 
+// initial number of slots of the port table, doubled when full
+#define PORTS_INITIAL_SIZE 16
+
+struct hub_engine;
+
+// callbacks private data of a connection attached to the hub
 typedef struct {
+  struct hub_engine *hub;
+  unsigned int index; //!< index in the port table, the port number
+  vde_storm_bucket storm;
+} hub_port;
+
+/*
+ * Ports are kept in a dense table of connections indexed by port number, free
+ * slots are NULL and their index is pushed on free_slots so that they can be
+ * reused in O(1). Port numbers are stable while a connection is attached.
+ */
+typedef struct hub_engine {
   vde_component *component;
-  vde_list *ports;
+  vde_connection **ports;
+  hub_port **port_data;
+  unsigned int *free_slots;
+  unsigned int nfree;
+  unsigned int size; //!< number of allocated slots
+  unsigned int used; //!< slots ever used, iterations stop here
+  unsigned int count; //!< attached ports
+  vde_conn_stats detached; //!< counters of the ports gone so far
+  void *stats_timeout;
+  vde_storm storm;
+  // signal handles, resolved once at registration
+  vde_signal *port_new_sig;
+  vde_signal *port_del_sig;
+  vde_signal *stats_sig;
 } hub_engine;
 
+static void hub_port_add(hub_engine *hub, vde_connection *conn,
+                         hub_port *data)
+{
+  unsigned int idx, new_size;
+
+  if (hub->nfree > 0) {
+    idx = hub->free_slots[--hub->nfree];
+  } else {
+    if (hub->used == hub->size) {
+      new_size = hub->size ? hub->size * 2 : PORTS_INITIAL_SIZE;
+      // vde_realloc aborts on failure
+      hub->ports = vde_realloc(hub->ports, new_size * sizeof(vde_connection *));
+      hub->port_data = vde_realloc(hub->port_data,
+                                   new_size * sizeof(hub_port *));
+      hub->free_slots = vde_realloc(hub->free_slots,
+                                    new_size * sizeof(unsigned int));
+      hub->size = new_size;
+    }
+    idx = hub->used++;
+  }
+
+  hub->ports[idx] = conn;
+  hub->port_data[idx] = data;
+  data->index = idx;
+  hub->count++;
+}
+
+static void hub_port_del(hub_engine *hub, unsigned int idx)
+{
+  vde_assert(idx < hub->used && hub->ports[idx] != NULL);
+
+  hub->ports[idx] = NULL;
+  vde_free(hub->port_data[idx]);
+  hub->port_data[idx] = NULL;
+  hub->free_slots[hub->nfree++] = idx;
+  hub->count--;
+}
+
+static inline void hub_raise_port_signal(hub_engine *hub, vde_signal *signal,
+                                         unsigned int idx)
+{
+  vde_sobj *info;
+
+  if (!vde_signal_has_callbacks(signal)) {
+    return;
+  }
+
+  info = vde_sobj_new_array();
+  // XXX check info not null
+  vde_sobj_array_add(info, vde_sobj_new_int(idx));
+  vde_component_signal_emit(hub->component, signal, info);
+  vde_sobj_put(info);
+}
+
+// serialize the counters of all the ports, attached or not
+static vde_sobj *hub_stats_serialize(hub_engine *hub)
+{
+  unsigned int i;
+  vde_sobj *stats;
+  vde_conn_stats total = hub->detached;
+
+  for (i = 0; i < hub->used; i++) {
+    if (hub->ports[i] != NULL) {
+      vde_conn_stats_add(&total, vde_connection_get_stats(hub->ports[i]));
+    }
+  }
+
+  stats = vde_conn_stats_serialize(&total);
+  if (stats != NULL) {
+    vde_sobj_hash_insert(stats, "ports", vde_sobj_new_int(hub->count));
+  }
+  return stats;
+}
+
+static void hub_stats_cb(int fd, short events, void *arg)
+{
+  vde_sobj *info, *stats;
+  hub_engine *hub = (hub_engine *)arg;
+
+  if (!vde_signal_has_callbacks(hub->stats_sig)) {
+    return;
+  }
+
+  stats = hub_stats_serialize(hub);
+  if (stats == NULL) {
+    return;
+  }
+  // signal parameters are an array, as for port signals
+  info = vde_sobj_new_array();
+  vde_sobj_array_add(info, stats);
+  vde_component_signal_emit(hub->component, hub->stats_sig, info);
+  vde_sobj_put(info);
+}
+
 int engine_hub_status(vde_component *component, vde_sobj **out)
 {
   hub_engine *hub = vde_component_get_priv(component);
 
-  *out = vde_sobj_new_int(vde_list_length(hub->ports));
+  *out = vde_sobj_new_int(hub->count);
 
   return 0;
 }
 
 int engine_hub_printport(vde_component *component, int port, vde_sobj **out)
 {
-  char str[128];
+  vde_connection *conn;
+  hub_engine *hub = vde_component_get_priv(component);
 
-  sprintf(str, "please print something useful for port %i", port);
-  *out = vde_sobj_new_string(str);
+  if (port < 0 || port >= hub->used || hub->ports[port] == NULL) {
+    *out = vde_sobj_new_string("Port not found");
+    errno = ENOENT;
+    return -1;
+  }
+  conn = hub->ports[port];
+
+  *out = vde_sobj_new_hash();
+  vde_sobj_hash_insert(*out, "port", vde_sobj_new_int(port));
+  vde_sobj_hash_insert(*out, "max_payload",
+                       vde_sobj_new_int(vde_connection_max_payload(conn)));
+  vde_sobj_hash_insert(*out, "stats",
+                       vde_conn_stats_serialize(
+                         vde_connection_get_stats(conn)));
 
   return 0;
 }
 
-int hub_engine_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
+int engine_hub_storm_control(vde_component *component, const char *class,
+                             int rate, int burst, vde_sobj **out)
+{
+  hub_engine *hub = vde_component_get_priv(component);
+
+  if (vde_storm_set(&hub->storm, class, rate, burst)) {
+    *out = vde_sobj_new_string("Cannot set storm control");
+    return -1;
+  }
+  *out = vde_sobj_new_string("Storm control set");
+
+  return 0;
+}
+
+int engine_hub_storm_print(vde_component *component, vde_sobj **out)
+{
+  hub_engine *hub = vde_component_get_priv(component);
+
+  *out = vde_storm_serialize(&hub->storm);
+  if (*out == NULL) {
+    *out = vde_sobj_new_string("Cannot serialize storm control");
+    errno = ENOMEM;
+    return -1;
+  }
+
+  return 0;
+}
+
+int engine_hub_stats(vde_component *component, vde_sobj **out)
 {
-  vde_list *iter;
+  hub_engine *hub = vde_component_get_priv(component);
+
+  *out = hub_stats_serialize(hub);
+  if (*out == NULL) {
+    *out = vde_sobj_new_string("Cannot serialize stats");
+    errno = ENOMEM;
+    return -1;
+  }
+
+  return 0;
+}
+
+// write a packet to every port except the one it has been received from
+static inline void hub_flood(hub_engine *hub, vde_connection *conn,
+                             vde_pkt **pkts, unsigned int count)
+{
+  unsigned int i, j;
   vde_connection *port;
 
-  hub_engine *hub = (hub_engine *)arg;
+  for (i = 0; i < hub->used; i++) {
+    port = hub->ports[i];
+    if (port == NULL || port == conn) {
+      continue;
+    }
+    if (i + 1 < hub->used && hub->ports[i + 1] != NULL) {
+      vde_prefetch(hub->ports[i + 1]);
+    }
+    for (j = 0; j < count; j++) {
+      // a slow port gets no more packets until its queue drains, failed
+      // writes are counted by the connection
+      if (!vde_connection_is_writable(port)) {
+        vde_connection_stats_drop(port, VDE_CONN_DROP_QUEUE_FULL);
+        continue;
+      }
+      vde_connection_write(port, pkts[j]);
+    }
+  }
+}
+
+/*
+ * Every frame is flooded by a hub, unicast ones are policed as frames sent to
+ * unknown destinations.
+ */
+static inline int hub_storm_admit(vde_connection *conn, hub_port *data,
+                                  vde_pkt *pkt)
+{
+  vde_storm_class cls = VDE_STORM_UNKNOWN;
+
+  if (pkt->hdr->pkt_len >= ETH_ALEN) {
+    cls = vde_storm_classify((unsigned char *)pkt->payload);
+  }
+  if (vde_storm_admit(&data->hub->storm, &data->storm, cls)) {
+    return 1;
+  }
+  vde_connection_stats_drop(conn, VDE_CONN_DROP_STORM);
+  return 0;
+}
+
+int hub_engine_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
+{
+  vde_pkt *shared;
+
+  hub_engine *hub = ((hub_port *)arg)->hub;
+
+  if (hub->storm.enabled && !hub_storm_admit(conn, (hub_port *)arg, pkt)) {
+    return 0;
+  }
+
+  /* Make the packet shareable once so that ports take a reference on it
+   * instead of copying it */
+  shared = vde_pkt_share(vde_connection_get_context(conn), pkt);
+  if (shared == NULL) {
+    vde_connection_stats_drop(conn, VDE_CONN_DROP_ENGINE);
+    return 0;
+  }
 
   /* Send to all the ports */
-  iter = vde_list_first(hub->ports);
-  while (iter != NULL) {
-    port = vde_list_get_data(iter);
-    if (port != conn) {
-      // XXX: check write retval
-      vde_connection_write(port, pkt);
+  hub_flood(hub, conn, &shared, 1);
+
+  vde_pkt_put(shared);
+
+  return 0;
+}
+
+int hub_engine_read_batchcb(vde_connection *conn, vde_pkt **pkts,
+                            unsigned int count, void *arg)
+{
+  vde_pkt *shared[BATCH_CHUNK];
+  unsigned int i, chunk, nshared;
+
+  hub_engine *hub = ((hub_port *)arg)->hub;
+
+  while (count > 0) {
+    chunk = count < BATCH_CHUNK ? count : BATCH_CHUNK;
+
+    nshared = 0;
+    for (i = 0; i < chunk; i++) {
+      if (hub->storm.enabled &&
+          !hub_storm_admit(conn, (hub_port *)arg, pkts[i])) {
+        continue;
+      }
+      shared[nshared] = vde_pkt_share(vde_connection_get_context(conn),
+                                      pkts[i]);
+      if (shared[nshared] == NULL) {
+        vde_connection_stats_drop(conn, VDE_CONN_DROP_ENGINE);
+        continue;
+      }
+      nshared++;
     }
-    iter = vde_list_next(iter);
+
+    /* Walk the ports once for the whole chunk */
+    hub_flood(hub, conn, shared, nshared);
+
+    for (i = 0; i < nshared; i++) {
+      vde_pkt_put(shared[i]);
+    }
+
+    pkts += chunk;
+    count -= chunk;
   }
 
   return 0;
@@ -91,24 +376,22 @@ int hub_engine_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
 int hub_engine_errorcb(vde_connection *conn, vde_pkt *pkt,
                                   vde_conn_error err, void *arg)
 {
-  vde_sobj *info;
-  hub_engine *hub = (hub_engine *)arg;
+  unsigned int idx;
+  hub_port *data = (hub_port *)arg;
+  hub_engine *hub = data->hub;
 
   if (err == CONN_WRITE_DELAY) {
-    vde_warning("%s: dropping packet", __PRETTY_FUNCTION__);
+    // the drop has been counted by the connection
     return 0;
   }
 
   // XXX: handle different errors, the following is just the fatal case
 
-  hub->ports = vde_list_remove(hub->ports, conn);
+  idx = data->index;
+  vde_conn_stats_add(&hub->detached, vde_connection_get_stats(conn));
+  hub_port_del(hub, idx); // data is freed here
 
-  info = vde_sobj_new_array();
-  // XXX check info not null
-  // XXX print new port number instead of the total number of ports in the hub
-  vde_sobj_array_add(info, vde_sobj_new_int(vde_list_length(hub->ports)));
-  vde_component_signal_raise(hub->component, "port_del", info);
-  vde_sobj_put(info);
+  hub_raise_port_signal(hub, hub->port_del_sig, idx);
 
   errno = EPIPE;
   return -1;
@@ -119,33 +402,38 @@ int hub_engine_newconn(vde_component *component, vde_connection *conn,
 {
   unsigned int max_payload;
   struct timeval send_timeout;
-  vde_sobj *info;
+  hub_port *data;
   hub_engine *hub = vde_component_get_priv(component);
 
   max_payload = vde_connection_max_payload(conn);
   if (max_payload != 0 && max_payload < sizeof(struct eth_frame)) {
-    vde_warning("%s: connection can't handle full eth frames, rejecting");
+    vde_warning("%s: connection can't handle full eth frames, rejecting",
+                __PRETTY_FUNCTION__);
     return -1;
   }
 
-  // XXX: check ports not NULL
-  // XXX: here new port is added as the first one
-  hub->ports = vde_list_prepend(hub->ports, conn);
+  data = (hub_port *)vde_calloc(sizeof(hub_port));
+  if (data == NULL) {
+    vde_error("%s: could not allocate port data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+  data->hub = hub;
+  vde_storm_bucket_init(&hub->storm, &data->storm);
+  hub_port_add(hub, conn, data);
 
   /* Setup connection */
   vde_connection_set_callbacks(conn, &hub_engine_readcb, NULL,
-                               &hub_engine_errorcb, (void *)hub);
+                               &hub_engine_errorcb, (void *)data);
+  vde_connection_set_read_batch_cb(conn, &hub_engine_read_batchcb);
   vde_connection_set_pkt_properties(conn, 0, 0);
   send_timeout.tv_sec = TIMEOUT;
   send_timeout.tv_usec = 0;
-  vde_connection_set_send_properties(conn, TIMES, &send_timeout);
+  vde_connection_set_send_properties(conn, TIMES, &send_timeout,
+                                     PORT_QUEUE_BYTES);
+  vde_connection_set_send_watermarks(conn, PORT_LOW_WM, PORT_HIGH_WM);
 
-  info = vde_sobj_new_array();
-  // XXX check info not null
-  // XXX print new port number instead of the total number of ports in the hub
-  vde_sobj_array_add(info, vde_sobj_new_int(vde_list_length(hub->ports)));
-  vde_component_signal_raise(component, "port_new", info);
-  vde_sobj_put(info);
+  hub_raise_port_signal(hub, hub->port_new_sig, data->index);
 
   return 0;
 }
@@ -154,10 +442,28 @@ int hub_engine_newconn(vde_component *component, vde_connection *conn,
 static int engine_hub_init(vde_component *component, vde_sobj *params)
 {
   int tmp_errno;
+  int stats_interval = DEFAULT_STATS_INTERVAL;
+  struct timeval stats_tv;
+  vde_sobj *param, *storm = NULL;
   hub_engine *hub;
 
   vde_assert(component != NULL);
 
+  if (params && vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    param = vde_sobj_hash_lookup(params, "stats_interval");
+    if (param) {
+      if (!vde_sobj_is_type(param, vde_sobj_type_int) ||
+          vde_sobj_get_int(param) < 0) {
+        vde_error("%s: stats_interval must be a non-negative integer",
+                  __PRETTY_FUNCTION__);
+        errno = EINVAL;
+        return -1;
+      }
+      stats_interval = vde_sobj_get_int(param);
+    }
+    storm = vde_sobj_hash_lookup(params, "storm_control");
+  }
+
   hub = (hub_engine *)vde_calloc(sizeof(hub_engine));
   if (hub == NULL) {
     vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
@@ -166,47 +472,88 @@ static int engine_hub_init(vde_component *component, vde_sobj *params)
   }
 
   hub->component = component;
+  vde_storm_init(&hub->storm, vde_component_get_context(component));
+  if (storm != NULL && vde_storm_parse(&hub->storm, storm)) {
+    tmp_errno = errno;
+    goto err_free;
+  }
+
+  if (stats_interval > 0) {
+    stats_tv.tv_sec = stats_interval;
+    stats_tv.tv_usec = 0;
+    hub->stats_timeout =
+      vde_context_timeout_add(vde_component_get_context(component),
+                              VDE_EV_PERSIST, &stats_tv, &hub_stats_cb,
+                              (void *)hub);
+    if (hub->stats_timeout == NULL) {
+      tmp_errno = errno;
+      vde_error("%s: could not add stats timeout", __PRETTY_FUNCTION__);
+      goto err_free;
+    }
+  }
 
   // command registration phase
   // - the header for the wrappers has been included at the top
   // - register the commands array, the name is in the json definition
-  if (vde_component_commands_register(component, engine_hub_commands)) {
+  if (vde_component_commands_register_table(component, engine_hub_commands,
+                                        engine_hub_commands_lookup)) {
     tmp_errno = errno;
     vde_error("%s: could not register commands", __PRETTY_FUNCTION__);
-    vde_free(hub);
-    errno = tmp_errno;
-    return -1;
+    goto err_free;
   }
 
   if (vde_component_signals_register(component, engine_hub_signals)) {
     tmp_errno = errno;
     vde_error("%s: could not register signals", __PRETTY_FUNCTION__);
-    vde_free(hub);
-    errno = tmp_errno;
-    return -1;
+    vde_component_commands_deregister(component, engine_hub_commands);
+    goto err_free;
   }
+  hub->port_new_sig = vde_component_signal_get(component, "port_new");
+  hub->port_del_sig = vde_component_signal_get(component, "port_del");
+  hub->stats_sig = vde_component_signal_get(component, "stats");
 
   vde_component_set_priv(component, (void *)hub);
   return 0;
+
+err_free:
+  if (hub->stats_timeout != NULL) {
+    vde_context_timeout_del(vde_component_get_context(component),
+                            hub->stats_timeout);
+  }
+  vde_storm_fini(&hub->storm);
+  vde_free(hub);
+  errno = tmp_errno;
+  return -1;
 }
 
 void engine_hub_fini(vde_component *component)
 {
 
-  vde_list *iter;
+  unsigned int i;
   vde_connection *port;
   hub_engine *hub = (hub_engine *)vde_component_get_priv(component);
 
-  iter = vde_list_first(hub->ports);
-  while (iter != NULL) {
-    port = vde_list_get_data(iter);
+  if (hub->stats_timeout != NULL) {
+    vde_context_timeout_del(vde_component_get_context(component),
+                            hub->stats_timeout);
+  }
+  vde_storm_fini(&hub->storm);
+
+  for (i = 0; i < hub->used; i++) {
+    port = hub->ports[i];
+    if (port == NULL) {
+      continue;
+    }
     // XXX check if this is safe here
     vde_connection_fini(port);
     vde_connection_delete(port);
-
-    iter = vde_list_next(iter);
+    if (hub->ports[i] != NULL) {
+      hub_port_del(hub, i);
+    }
   }
-  vde_list_delete(hub->ports);
+  vde_free(hub->ports);
+  vde_free(hub->port_data);
+  vde_free(hub->free_slots);
 
   vde_free(hub);
 
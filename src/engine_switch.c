@@ -0,0 +1,1907 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vde3.h>
+
+#include <vde3/module.h>
+#include <vde3/engine.h>
+#include <vde3/context.h>
+#include <vde3/connection.h>
+#include <vde3/packet.h>
+#include <vde3/storm.h>
+
+#include <engine_switch_commands.h>
+
+// from vde_switch/packetq.c
+#define TIMEOUT 5
+#define TIMES 10
+
+// bytes queued on a port before the connection drops packets for it, and
+// watermarks between which the engine stops and resumes writing to it
+#define PORT_QUEUE_BYTES (128 * 1024)
+#define PORT_HIGH_WM (96 * 1024)
+#define PORT_LOW_WM (32 * 1024)
+// end from vde_switch/packetq.c
+
+#define DEFAULT_TABLE_SIZE 4096
+#define MIN_TABLE_SIZE_BITS 4
+#define MAX_TABLE_SIZE (1 << 20)
+#define DEFAULT_MAX_AGE 300 /* seconds, as in vde_switch */
+#define AGING_TICK 5 /* seconds between two aging passes */
+#define DEFAULT_STATS_INTERVAL 10 /* seconds between two stats signals */
+
+#define ETH_P_8021Q 0x8100
+#define VLAN_VID_MASK 0x0fff
+#define VLAN_HLEN 4
+#define VLAN_IDS 4096 /* 1 to 4094 are usable, 0 means no vlan */
+#define DEFAULT_VLAN 1
+
+// initial number of slots of the port table, doubled when full, it is
+// always a multiple of the bits in a word of the vlan bitmaps
+#define PORTS_INITIAL_SIZE 64
+#define BITMAP_WORD_BITS 64
+
+// learning stops when the table is 3/4 full, lookups of unknown addresses
+// would get too long otherwise
+#define TABLE_MAX_LOAD(size) ((size) / 4 * 3)
+
+// START temporary signals declaration
+// XXX as for commands, signals should be auto-generated
+#include <vde3/signal.h>
+static vde_signal engine_switch_signals [] = {
+  { "port_new", NULL, NULL, NULL },
+  { "port_del", NULL, NULL, NULL },
+  { "stats", NULL, NULL, NULL },
+  { NULL, NULL, NULL, NULL },
+};
+// END temporary signals declaration
+
+/*
+ * Forwarding table entry. The key packs the MAC address in the lower 48 bits,
+ * the VLAN id in the following 12 and a "used" bit on top, so a zero key marks
+ * an empty slot.
+ */
+struct switch_engine;
+
+// callbacks private data of a connection attached to the switch
+typedef struct {
+  struct switch_engine *sw;
+  vde_connection *conn;
+  unsigned int index; //!< index in the port table, the port number
+  unsigned int pvid; //!< vlan of untagged frames, 0 if they are dropped
+  int trunk; //!< accepts frames tagged with the vlans it is member of
+  vde_storm_bucket storm;
+} switch_port;
+
+typedef struct {
+  uint64_t key;
+  uint32_t last_seen; //!< aging tick of the last frame from this address
+  switch_port *port;
+} switch_entry;
+
+#define KEY_USED (1ULL << 63)
+
+typedef struct {
+  switch_entry *entries;
+  unsigned int size; //!< number of slots, power of two
+  unsigned int mask;
+  unsigned int shift; //!< 64 - log2(size), used by the hash function
+  unsigned int count;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long floods;
+  unsigned long full;
+} switch_table;
+
+/*
+ * Frames are classified in batches: addresses are turned into table keys and
+ * flagged as multicast, then the home slots of the whole batch are prefetched
+ * before the first frame is forwarded. The first 16 bytes of a frame hold both
+ * addresses, the ethertype and the vlan tag, so a single vector load and
+ * shuffle give both keys where the CPU supports it.
+ */
+typedef struct {
+  uint64_t src_key;
+  uint64_t dst_key;
+  unsigned int src_slot;
+  unsigned int dst_slot;
+  unsigned int flags;
+  unsigned int vlan; //!< vlan assigned on ingress, for vlan aware switches
+} switch_class;
+
+#define CLASS_SHORT 0x01 /* not an ethernet frame */
+#define CLASS_SRC_MCAST 0x02
+#define CLASS_DST_MCAST 0x04
+#define CLASS_DROP 0x08 /* not accepted by the vlans of the port */
+#define CLASS_SKIP (CLASS_SHORT | CLASS_DROP)
+
+// frames classified and prefetched at once
+#define CLASS_BATCH 16
+// vector code loads 16 bytes, frames too short to hold a vlan tag are left to
+// the scalar one
+#define CLASS_VEC_LEN (sizeof(struct eth_hdr) + 4)
+
+typedef void (*switch_classify_fn)(vde_pkt **pkts, unsigned int count,
+                                   switch_class *cls);
+
+/*
+ * State saved by another process before a hot restart, see
+ * engine_switch_state_load(). It is applied to ports as they are attached
+ * again, recognized by the handoff id of their connection and the transport
+ * the id belongs to: both arrays are sorted by id and scope and what is left
+ * is dropped after a couple of aging ticks.
+ */
+typedef struct {
+  uint32_t id; //!< handoff id of the port connection, first for bsearch
+  vde_quark scope; //!< transport of the connection
+  uint64_t key;
+} switch_saved_entry;
+
+typedef struct {
+  uint32_t id;
+  vde_quark scope;
+  int trunk;
+  unsigned int pvid;
+  uint64_t members[VLAN_IDS / BITMAP_WORD_BITS];
+} switch_saved_port;
+
+#define SAVED_STATE_VERSION 2
+#define SAVED_STATE_TICKS 2
+
+/*
+ * Ports are kept in a dense table indexed by port number as in the hub, free
+ * slots are NULL and their index is reused. A vlan aware switch keeps for each
+ * vlan a bitmap of its member ports, so that a flood only walks the ports of
+ * the vlan of the frame.
+ */
+typedef struct switch_engine {
+  vde_component *component;
+  switch_port **ports;
+  unsigned int *free_slots;
+  unsigned int nfree;
+  unsigned int size; //!< number of allocated slots
+  unsigned int used; //!< slots ever used, iterations stop here
+  unsigned int count; //!< attached ports
+  int vlan_aware;
+  uint64_t **vlans; //!< member bitmaps by vlan id, NULL if never used
+  unsigned int words; //!< words in each bitmap
+  switch_table table;
+  switch_classify_fn classify; //!< for batches, chosen at init
+  const char *classifier;
+  uint32_t now; //!< current aging tick
+  uint32_t max_age; //!< entry lifetime in aging ticks
+  void *aging_timeout;
+  vde_conn_stats detached; //!< counters of the ports gone so far
+  void *stats_timeout;
+  vde_storm storm;
+  switch_saved_entry *saved_entries;
+  unsigned int nsaved_entries;
+  switch_saved_port *saved_ports;
+  unsigned int nsaved_ports;
+  uint32_t saved_tick; //!< aging tick the saved state has been loaded at
+  // signal handles, resolved once at registration
+  vde_signal *port_new_sig;
+  vde_signal *port_del_sig;
+  vde_signal *stats_sig;
+} switch_engine;
+
+static inline uint64_t switch_key(const unsigned char *mac, unsigned int vlan)
+{
+  return KEY_USED | ((uint64_t)(vlan & VLAN_VID_MASK) << 48) |
+         ((uint64_t)mac[0] << 40) | ((uint64_t)mac[1] << 32) |
+         ((uint64_t)mac[2] << 24) | ((uint64_t)mac[3] << 16) |
+         ((uint64_t)mac[4] << 8) | (uint64_t)mac[5];
+}
+
+static inline unsigned int switch_hash(switch_table *table, uint64_t key)
+{
+  // fibonacci hashing: the upper bits of the product are well mixed
+  return (unsigned int)((key * 0x9e3779b97f4a7c15ULL) >> table->shift);
+}
+
+static void switch_port_add(switch_engine *sw, switch_port *port)
+{
+  unsigned int idx, new_size, words, i;
+
+  if (sw->nfree > 0) {
+    idx = sw->free_slots[--sw->nfree];
+  } else {
+    if (sw->used == sw->size) {
+      new_size = sw->size ? sw->size * 2 : PORTS_INITIAL_SIZE;
+      // vde_realloc aborts on failure
+      sw->ports = vde_realloc(sw->ports, new_size * sizeof(switch_port *));
+      sw->free_slots = vde_realloc(sw->free_slots,
+                                   new_size * sizeof(unsigned int));
+      words = new_size / BITMAP_WORD_BITS;
+      for (i = 0; sw->vlans != NULL && i < VLAN_IDS; i++) {
+        if (sw->vlans[i] != NULL) {
+          sw->vlans[i] = vde_realloc(sw->vlans[i], words * sizeof(uint64_t));
+          memset(sw->vlans[i] + sw->words, 0,
+                 (words - sw->words) * sizeof(uint64_t));
+        }
+      }
+      sw->words = words;
+      sw->size = new_size;
+    }
+    idx = sw->used++;
+  }
+
+  sw->ports[idx] = port;
+  port->index = idx;
+  sw->count++;
+}
+
+static void switch_port_del(switch_engine *sw, switch_port *port)
+{
+  unsigned int i, idx = port->index;
+
+  vde_assert(idx < sw->used && sw->ports[idx] == port);
+
+  for (i = 0; sw->vlans != NULL && i < VLAN_IDS; i++) {
+    if (sw->vlans[i] != NULL) {
+      sw->vlans[i][idx / BITMAP_WORD_BITS] &=
+        ~(1ULL << (idx % BITMAP_WORD_BITS));
+    }
+  }
+  sw->ports[idx] = NULL;
+  sw->free_slots[sw->nfree++] = idx;
+  sw->count--;
+}
+
+static inline int switch_bit_test(const uint64_t *bitmap, unsigned int i)
+{
+  return (bitmap[i / BITMAP_WORD_BITS] >> (i % BITMAP_WORD_BITS)) & 1;
+}
+
+static inline int switch_vlan_member(switch_engine *sw, unsigned int vlan,
+                                     unsigned int idx)
+{
+  return sw->vlans[vlan] != NULL && switch_bit_test(sw->vlans[vlan], idx);
+}
+
+static int switch_table_init(switch_table *table, unsigned int size)
+{
+  unsigned int bits = MIN_TABLE_SIZE_BITS;
+
+  while ((1U << bits) < size) {
+    bits++;
+  }
+  table->size = 1U << bits;
+  table->mask = table->size - 1;
+  table->shift = 64 - bits;
+  table->entries = (switch_entry *)vde_calloc(table->size *
+                                              sizeof(switch_entry));
+  if (table->entries == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+// i is the home slot of key, see switch_hash()
+static inline switch_entry *switch_table_lookup(switch_table *table,
+                                                uint64_t key, unsigned int i)
+{
+  while (table->entries[i].key != 0) {
+    if (table->entries[i].key == key) {
+      return &table->entries[i];
+    }
+    i = (i + 1) & table->mask;
+  }
+  return NULL;
+}
+
+/*
+ * Remove the entry in slot i shifting back the following entries of the
+ * cluster, so that no tombstones are needed for linear probing.
+ */
+static void switch_table_remove_slot(switch_table *table, unsigned int i)
+{
+  unsigned int j = i, home;
+
+  while (1) {
+    table->entries[i].key = 0;
+    do {
+      j = (j + 1) & table->mask;
+      if (table->entries[j].key == 0) {
+        table->count--;
+        return;
+      }
+      home = switch_hash(table, table->entries[j].key);
+      // move entry j to i only if its home slot is not in ]i, j]
+    } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+    table->entries[i] = table->entries[j];
+    i = j;
+  }
+}
+
+static void switch_learn(switch_engine *sw, uint64_t key, unsigned int i,
+                         switch_port *port)
+{
+  switch_table *table = &sw->table;
+
+  while (table->entries[i].key != 0) {
+    if (table->entries[i].key == key) {
+      // address seen again, possibly moved to another port
+      table->entries[i].port = port;
+      table->entries[i].last_seen = sw->now;
+      return;
+    }
+    i = (i + 1) & table->mask;
+  }
+
+  if (table->count >= TABLE_MAX_LOAD(table->size)) {
+    table->full++;
+    return;
+  }
+  table->entries[i].key = key;
+  table->entries[i].port = port;
+  table->entries[i].last_seen = sw->now;
+  table->count++;
+}
+
+/*
+ * Remove entries matching the given port (NULL matches every entry) or, when
+ * expire is set, entries older than max_age.
+ */
+static inline int switch_purge_match(switch_engine *sw, switch_entry *entry,
+                                     switch_port *port, int expire)
+{
+  if (expire) {
+    return sw->now - entry->last_seen >= sw->max_age;
+  }
+  return port == NULL || entry->port == port;
+}
+
+static void switch_table_purge(switch_engine *sw, switch_port *port,
+                               int expire)
+{
+  unsigned int i = 0;
+  switch_entry *entry;
+  switch_table *table = &sw->table;
+
+  while (i < table->size) {
+    entry = &table->entries[i];
+    if (entry->key != 0 && switch_purge_match(sw, entry, port, expire)) {
+      // an entry has been shifted into slot i, look at it again
+      switch_table_remove_slot(table, i);
+      continue;
+    }
+    i++;
+  }
+
+  // removals at the end of the table can shift back entries of the cluster
+  // wrapping at slot 0, which has already been scanned
+  i = 0;
+  while (i < table->size && table->entries[i].key != 0) {
+    if (switch_purge_match(sw, &table->entries[i], port, expire)) {
+      switch_table_remove_slot(table, i);
+      continue;
+    }
+    i++;
+  }
+}
+
+static void switch_saved_free(switch_engine *sw)
+{
+  vde_free(sw->saved_entries);
+  vde_free(sw->saved_ports);
+  sw->saved_entries = NULL;
+  sw->saved_ports = NULL;
+  sw->nsaved_entries = 0;
+  sw->nsaved_ports = 0;
+}
+
+static void switch_aging_cb(int fd, short events, void *arg)
+{
+  switch_engine *sw = (switch_engine *)arg;
+
+  sw->now++;
+  switch_table_purge(sw, NULL, 1);
+  // ports not back by now are not coming back
+  if ((sw->saved_entries != NULL || sw->saved_ports != NULL) &&
+      sw->now - sw->saved_tick >= SAVED_STATE_TICKS) {
+    switch_saved_free(sw);
+  }
+}
+
+/*
+ * Make a port member of the vlans set in the members bitmap (VLAN_IDS bits,
+ * NULL for none) and of pvid, used for its untagged frames. The entries learned
+ * on the port are purged as they could belong to vlans it has left.
+ */
+static int switch_port_set_vlans(switch_engine *sw, switch_port *port,
+                                 int trunk, unsigned int pvid,
+                                 const uint64_t *members)
+{
+  unsigned int i, word = port->index / BITMAP_WORD_BITS;
+  uint64_t bit = 1ULL << (port->index % BITMAP_WORD_BITS);
+
+  // allocate the bitmaps first, so that on failure nothing changes
+  for (i = 0; i < VLAN_IDS; i++) {
+    if (((members != NULL && switch_bit_test(members, i)) ||
+         (pvid != 0 && i == pvid)) && sw->vlans[i] == NULL) {
+      sw->vlans[i] = (uint64_t *)vde_calloc(sw->words * sizeof(uint64_t));
+      if (sw->vlans[i] == NULL) {
+        errno = ENOMEM;
+        return -1;
+      }
+    }
+  }
+
+  for (i = 0; i < VLAN_IDS; i++) {
+    if (sw->vlans[i] == NULL) {
+      continue;
+    }
+    if ((members != NULL && switch_bit_test(members, i)) ||
+        (pvid != 0 && i == pvid)) {
+      sw->vlans[i][word] |= bit;
+    } else {
+      sw->vlans[i][word] &= ~bit;
+    }
+  }
+  port->trunk = trunk;
+  port->pvid = pvid;
+
+  switch_table_purge(sw, port, 0);
+  return 0;
+}
+
+// saved entries and ports both start with their id and scope
+typedef struct {
+  uint32_t id;
+  vde_quark scope;
+} switch_saved_key;
+
+static int switch_saved_cmp(const void *a, const void *b)
+{
+  const switch_saved_key *key_a = a, *key_b = b;
+
+  if (key_a->id != key_b->id) {
+    return key_a->id < key_b->id ? -1 : 1;
+  }
+  return key_a->scope < key_b->scope ? -1 : key_a->scope > key_b->scope;
+}
+
+// give a port attached after a hot restart the vlans and addresses it had
+static void switch_port_restore(switch_engine *sw, switch_port *port)
+{
+  unsigned int lo = 0, hi = sw->nsaved_entries, mid;
+  switch_saved_key id = { vde_connection_get_handoff_id(port->conn),
+                          vde_connection_get_handoff_scope(port->conn) };
+  switch_saved_port *saved;
+  uint64_t key;
+
+  if (id.id == 0 || (sw->nsaved_entries == 0 && sw->nsaved_ports == 0)) {
+    return;
+  }
+  // vlans first, setting them purges the entries of the port
+  saved = NULL;
+  if (sw->nsaved_ports > 0) {
+    saved = bsearch(&id, sw->saved_ports, sw->nsaved_ports,
+                    sizeof(switch_saved_port), &switch_saved_cmp);
+  }
+  if (saved != NULL && switch_port_set_vlans(sw, port, saved->trunk,
+                                             saved->pvid, saved->trunk ?
+                                             saved->members : NULL)) {
+    vde_warning("%s: cannot restore vlans of port %u", __PRETTY_FUNCTION__,
+                port->index);
+  }
+
+  // the first entry of the port, addresses count as just seen
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (switch_saved_cmp(&sw->saved_entries[mid], &id) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  for (; lo < sw->nsaved_entries &&
+         switch_saved_cmp(&sw->saved_entries[lo], &id) == 0; lo++) {
+    key = sw->saved_entries[lo].key;
+    switch_learn(sw, key, switch_hash(&sw->table, key), port);
+  }
+}
+
+static unsigned int switch_frame_vlan(vde_pkt *pkt)
+{
+  unsigned char *tag;
+  struct eth_hdr *hdr = (struct eth_hdr *)pkt->payload;
+
+  if (pkt->hdr->pkt_len >= sizeof(struct eth_hdr) + 4 &&
+      ((hdr->proto[0] << 8) | hdr->proto[1]) == ETH_P_8021Q) {
+    tag = (unsigned char *)pkt->payload + sizeof(struct eth_hdr);
+    return ((tag[0] << 8) | tag[1]) & VLAN_VID_MASK;
+  }
+  return 0;
+}
+
+// true if the frame carries the given vlan tag, or no tag if vlan is 0
+static inline int switch_frame_has_tag(vde_pkt *pkt, unsigned int vlan)
+{
+  struct eth_hdr *hdr = (struct eth_hdr *)pkt->payload;
+
+  if (pkt->hdr->pkt_len < sizeof(struct eth_hdr) + VLAN_HLEN ||
+      ((hdr->proto[0] << 8) | hdr->proto[1]) != ETH_P_8021Q) {
+    return vlan == 0;
+  }
+  return vlan != 0 && switch_frame_vlan(pkt) == vlan;
+}
+
+/*
+ * Tag a frame in place with vlan, or untag it if vlan is 0. A tag is pushed
+ * moving the addresses into the space before payload, which copies made by
+ * switch_frame_copy_tag() have, and popped moving them forward over the tag.
+ * The priority of a tagged frame is kept. Only packets allocated by the switch
+ * are retagged, the ones it reads belong to their writer.
+ *
+ * @return 0 on success, -1 if there is no space before payload for the tag
+ */
+static int switch_frame_set_tag(vde_pkt *pkt, unsigned int vlan)
+{
+  unsigned char *tag;
+
+  if (!switch_frame_has_tag(pkt, 0)) {
+    // already tagged
+    if (vlan == 0) {
+      memmove(pkt->payload + VLAN_HLEN, pkt->payload, 2 * ETH_ALEN);
+      pkt->payload += VLAN_HLEN;
+      pkt->hdr->pkt_len -= VLAN_HLEN;
+    } else {
+      tag = (unsigned char *)pkt->payload + sizeof(struct eth_hdr);
+      tag[0] = (tag[0] & ~(VLAN_VID_MASK >> 8)) | (vlan >> 8);
+      tag[1] = vlan & 0xff;
+    }
+    return 0;
+  }
+
+  if (vlan == 0) {
+    return 0;
+  }
+  if (pkt->payload - pkt->head < VLAN_HLEN) {
+    return -1;
+  }
+  pkt->payload -= VLAN_HLEN;
+  memmove(pkt->payload, pkt->payload + VLAN_HLEN, 2 * ETH_ALEN);
+  tag = (unsigned char *)pkt->payload + 2 * ETH_ALEN;
+  tag[0] = ETH_P_8021Q >> 8;
+  tag[1] = ETH_P_8021Q & 0xff;
+  tag[2] = vlan >> 8;
+  tag[3] = vlan & 0xff;
+  pkt->hdr->pkt_len += VLAN_HLEN;
+  return 0;
+}
+
+// copy a frame into a new packet with room for a tag, tagged as above
+static vde_pkt *switch_frame_copy_tag(vde_context *ctx, vde_pkt *pkt,
+                                      unsigned int vlan)
+{
+  vde_pkt *copy;
+
+  copy = vde_pkt_new(ctx, pkt->hdr->pkt_len + VLAN_HLEN, VLAN_HLEN, 0);
+  if (copy == NULL) {
+    return NULL;
+  }
+  memcpy(copy->hdr, pkt->hdr, sizeof(vde_hdr));
+  memcpy(copy->payload, pkt->payload, pkt->hdr->pkt_len);
+  copy->ts = pkt->ts;
+  switch_frame_set_tag(copy, vlan);
+  return copy;
+}
+
+/*
+ * Assign the vlan of a frame received on a port of a vlan aware switch and put
+ * it in the keys of the frame. Untagged and priority tagged frames belong to
+ * the untagged vlan of the port, tagged ones are accepted by trunk ports of
+ * their vlan only.
+ */
+static inline void switch_vlan_ingress(switch_port *port, vde_pkt *pkt,
+                                       switch_class *cls)
+{
+  unsigned int vlan = switch_frame_vlan(pkt);
+  uint64_t vid_bits = (uint64_t)VLAN_VID_MASK << 48;
+
+  if (vlan == 0) {
+    vlan = port->pvid;
+  } else if (!port->trunk ||
+             !switch_vlan_member(port->sw, vlan, port->index)) {
+    vlan = 0;
+  }
+  if (vlan == 0) {
+    cls->flags |= CLASS_DROP;
+    return;
+  }
+  cls->vlan = vlan;
+  cls->src_key = (cls->src_key & ~vid_bits) | ((uint64_t)vlan << 48);
+  cls->dst_key = (cls->dst_key & ~vid_bits) | ((uint64_t)vlan << 48);
+}
+
+static inline void switch_classify_one(vde_pkt *pkt, switch_class *cls)
+{
+  unsigned int vlan;
+  struct eth_hdr *hdr = (struct eth_hdr *)pkt->payload;
+
+  if (pkt->hdr->pkt_len < sizeof(struct eth_hdr)) {
+    cls->flags = CLASS_SHORT;
+    return;
+  }
+  vlan = switch_frame_vlan(pkt);
+  cls->src_key = switch_key(hdr->src, vlan);
+  cls->dst_key = switch_key(hdr->dest, vlan);
+  cls->flags = (hdr->src[0] & 0x01 ? CLASS_SRC_MCAST : 0) |
+               (hdr->dest[0] & 0x01 ? CLASS_DST_MCAST : 0);
+}
+
+static void switch_classify_scalar(vde_pkt **pkts, unsigned int count,
+                                   switch_class *cls)
+{
+  unsigned int i;
+
+  for (i = 0; i < count; i++) {
+    switch_classify_one(pkts[i], &cls[i]);
+  }
+}
+
+/*
+ * Vector code byte swaps each address into a 64 bit word followed by the tag
+ * control information, as switch_key() does, the vlan id is kept only for
+ * tagged frames.
+ */
+static inline void switch_class_set(switch_class *cls, uint64_t dst,
+                                    uint64_t src, int dst_mcast,
+                                    int src_mcast, int tagged)
+{
+  uint64_t keep = 0xffffffffffffULL;
+
+  if (tagged) {
+    keep |= (uint64_t)VLAN_VID_MASK << 48;
+  }
+  cls->dst_key = KEY_USED | (dst & keep);
+  cls->src_key = KEY_USED | (src & keep);
+  cls->flags = (src_mcast ? CLASS_SRC_MCAST : 0) |
+               (dst_mcast ? CLASS_DST_MCAST : 0);
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_CLASSIFY_X86
+#include <immintrin.h>
+
+/*
+ * Shuffle control: dest bytes 5..0 then the tag (15, 14) in the low half, src
+ * bytes 11..6 then the tag in the high half. Bytes 0 and 6 hold the multicast
+ * bits, shifted to bit 7 for movemask; bytes 12-13 are compared with the 802.1Q
+ * ethertype.
+ */
+#define X86_KEYS_SHUFFLE 5, 4, 3, 2, 1, 0, 15, 14, 11, 10, 9, 8, 7, 6, 15, 14
+#define X86_MCAST_SEL -128, 0, 0, 0, 0, 0, -128, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define X86_TPID_SEL 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -128, -128, 0, 0
+// ETH_P_8021Q as read from the wire by a little endian load
+#define X86_TPID 0x0081
+#define X86_DST_MCAST 0x0001
+#define X86_SRC_MCAST 0x0040
+#define X86_TAGGED 0x1000
+
+__attribute__((target("ssse3")))
+static inline int switch_mask_ssse3(__m128i v)
+{
+  __m128i mcast, tpid;
+
+  mcast = _mm_and_si128(_mm_slli_epi64(v, 7), _mm_setr_epi8(X86_MCAST_SEL));
+  tpid = _mm_and_si128(_mm_cmpeq_epi16(v, _mm_set1_epi16(X86_TPID)),
+                       _mm_setr_epi8(X86_TPID_SEL));
+  return _mm_movemask_epi8(_mm_or_si128(mcast, tpid));
+}
+
+__attribute__((target("ssse3")))
+static void switch_classify_ssse3(vde_pkt **pkts, unsigned int count,
+                                  switch_class *cls)
+{
+  uint64_t keys[2];
+  unsigned int i;
+  int mask;
+  __m128i v;
+
+  for (i = 0; i < count; i++) {
+    if (pkts[i]->hdr->pkt_len < CLASS_VEC_LEN) {
+      switch_classify_one(pkts[i], &cls[i]);
+      continue;
+    }
+    v = _mm_loadu_si128((__m128i *)pkts[i]->payload);
+    mask = switch_mask_ssse3(v);
+    _mm_storeu_si128((__m128i *)keys,
+                     _mm_shuffle_epi8(v, _mm_setr_epi8(X86_KEYS_SHUFFLE)));
+    switch_class_set(&cls[i], keys[0], keys[1], mask & X86_DST_MCAST,
+                     mask & X86_SRC_MCAST, mask & X86_TAGGED);
+  }
+}
+
+#endif /* __x86_64__ */
+
+// it has not run on hardware yet, built only with --enable-neon
+#if defined(VDE3_NEON) && defined(__GNUC__) && defined(__aarch64__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HAVE_CLASSIFY_NEON
+#include <arm_neon.h>
+
+// as for x86, but without movemask: the flag bytes are narrowed to a 64 bit
+// mask with 4 bits for each byte of the vector
+static void switch_classify_neon(vde_pkt **pkts, unsigned int count,
+                                 switch_class *cls)
+{
+  static const uint8_t shuffle[16] = {5, 4, 3, 2, 1, 0, 15, 14,
+                                      11, 10, 9, 8, 7, 6, 15, 14};
+  static const uint8_t mcast_sel[16] = {1, 0, 0, 0, 0, 0, 1, 0,
+                                        0, 0, 0, 0, 0, 0, 0, 0};
+  static const uint8_t tpid_sel[16] = {0, 0, 0, 0, 0, 0, 0, 0,
+                                       0, 0, 0, 0, 0xff, 0xff, 0, 0};
+  unsigned int i;
+  uint64_t mask;
+  uint8x16_t v, keys, flags;
+  uint16x8_t tpid;
+
+  for (i = 0; i < count; i++) {
+    if (pkts[i]->hdr->pkt_len < CLASS_VEC_LEN) {
+      switch_classify_one(pkts[i], &cls[i]);
+      continue;
+    }
+    v = vld1q_u8((uint8_t *)pkts[i]->payload);
+    tpid = vceqq_u16(vreinterpretq_u16_u8(v), vdupq_n_u16(0x0081));
+    flags = vorrq_u8(vtstq_u8(v, vld1q_u8(mcast_sel)),
+                     vandq_u8(vreinterpretq_u8_u16(tpid), vld1q_u8(tpid_sel)));
+    mask = vget_lane_u64(vreinterpret_u64_u8(
+             vshrn_n_u16(vreinterpretq_u16_u8(flags), 4)), 0);
+    keys = vqtbl1q_u8(v, vld1q_u8(shuffle));
+    switch_class_set(&cls[i],
+                     vgetq_lane_u64(vreinterpretq_u64_u8(keys), 0),
+                     vgetq_lane_u64(vreinterpretq_u64_u8(keys), 1),
+                     mask & 0xfULL, mask & (0xfULL << 24),
+                     mask & (0xfULL << 48));
+  }
+}
+#endif /* __aarch64__ */
+
+// pick the widest implementation the CPU runs, unless simd is disabled
+static switch_classify_fn switch_classifier_select(int simd,
+                                                   const char **name)
+{
+  if (simd) {
+#ifdef HAVE_CLASSIFY_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+      *name = "ssse3";
+      return &switch_classify_ssse3;
+    }
+#endif
+#ifdef HAVE_CLASSIFY_NEON
+    // always there on aarch64
+    *name = "neon";
+    return &switch_classify_neon;
+#endif
+  }
+  *name = "scalar";
+  return &switch_classify_scalar;
+}
+
+// a slow port gets no more packets until its queue drains, failed writes are
+// counted by the connection
+static inline void switch_port_write(vde_connection *port, vde_pkt *pkt)
+{
+  if (!vde_connection_is_writable(port)) {
+    vde_connection_stats_drop(port, VDE_CONN_DROP_QUEUE_FULL);
+    return;
+  }
+  vde_connection_write(port, pkt);
+}
+
+/*
+ * Send a frame of a vlan to a port, tagged unless it is the untagged vlan of
+ * the port. A frame which is not tagged as the port wants is sent as a copy.
+ */
+static void switch_vlan_write(switch_port *port, vde_pkt *pkt,
+                              unsigned int vlan)
+{
+  vde_pkt *copy;
+  unsigned int tag = port->pvid == vlan ? 0 : vlan;
+
+  if (switch_frame_has_tag(pkt, tag)) {
+    switch_port_write(port->conn, pkt);
+    return;
+  }
+  copy = switch_frame_copy_tag(vde_connection_get_context(port->conn), pkt,
+                               tag);
+  if (copy == NULL) {
+    vde_connection_stats_drop(port->conn, VDE_CONN_DROP_NOMEM);
+    return;
+  }
+  switch_port_write(port->conn, copy);
+  vde_pkt_put(copy);
+}
+
+static void switch_flood(switch_engine *sw, switch_port *port,
+                         vde_pkt *pkt)
+{
+  unsigned int i;
+
+  for (i = 0; i < sw->used; i++) {
+    if (sw->ports[i] != NULL && sw->ports[i] != port) {
+      switch_port_write(sw->ports[i]->conn, pkt);
+    }
+  }
+}
+
+/*
+ * Flood a frame to the member ports of its vlan, walking the bitmap of the
+ * vlan twice: ports taking the frame as it has been received come first, then
+ * the others share a single retagged copy. out holds the reference taken for
+ * the flood, which is released here.
+ */
+static void switch_flood_vlan(switch_engine *sw, switch_port *port,
+                              vde_pkt *out, unsigned int vlan)
+{
+  unsigned int pass, w, i, want, tag;
+  uint64_t bits;
+  vde_pkt *copy;
+  switch_port *member;
+  uint64_t *members = sw->vlans[vlan];
+
+  want = switch_frame_has_tag(out, vlan) ? vlan : 0;
+  for (pass = 0; pass < 2; pass++) {
+    // a priority tagged frame is not sent as received to any port
+    copy = switch_frame_has_tag(out, want) ? vde_pkt_get(out) : NULL;
+    for (w = 0; w < sw->used / BITMAP_WORD_BITS + 1 && w < sw->words; w++) {
+      bits = members[w];
+      while (bits != 0) {
+        i = w * BITMAP_WORD_BITS + __builtin_ctzll(bits);
+        bits &= bits - 1;
+        member = sw->ports[i];
+        tag = member->pvid == vlan ? 0 : vlan;
+        if (member == port || tag != want) {
+          continue;
+        }
+        if (copy == NULL) {
+          copy = switch_frame_copy_tag(vde_connection_get_context(port->conn),
+                                       out, tag);
+          if (copy == NULL) {
+            vde_connection_stats_drop(member->conn, VDE_CONN_DROP_NOMEM);
+            continue;
+          }
+        }
+        switch_port_write(member->conn, copy);
+      }
+    }
+    if (copy != NULL) {
+      vde_pkt_put(copy);
+    }
+    want = want ? 0 : vlan;
+  }
+  vde_pkt_put(out);
+}
+
+static void switch_forward(switch_engine *sw, switch_port *port,
+                           vde_pkt *pkt, switch_class *cls)
+{
+  switch_entry *entry;
+  vde_pkt *shared;
+
+  if (cls->flags & CLASS_SKIP) {
+    if (cls->flags & CLASS_DROP) {
+      vde_connection_stats_drop(port->conn, VDE_CONN_DROP_ENGINE);
+    }
+    return;
+  }
+
+  // multicast source addresses are bogus, don't learn them
+  if (!(cls->flags & CLASS_SRC_MCAST)) {
+    switch_learn(sw, cls->src_key, cls->src_slot, port);
+  }
+
+  if (!(cls->flags & CLASS_DST_MCAST)) {
+    entry = switch_table_lookup(&sw->table, cls->dst_key, cls->dst_slot);
+    if (entry != NULL) {
+      sw->table.hits++;
+      if (entry->port == port) {
+        return;
+      }
+      // addresses are learned per vlan, the port is a member of this one
+      if (sw->vlan_aware) {
+        switch_vlan_write(entry->port, pkt, cls->vlan);
+      } else {
+        switch_port_write(entry->port->conn, pkt);
+      }
+      return;
+    }
+    sw->table.misses++;
+  }
+
+  if (sw->storm.enabled &&
+      !vde_storm_admit(&sw->storm, &port->storm,
+                       vde_storm_classify((unsigned char *)pkt->payload))) {
+    vde_connection_stats_drop(port->conn, VDE_CONN_DROP_STORM);
+    return;
+  }
+
+  /* Broadcast, multicast or unknown destination: share the packet once so
+   * that ports take a reference on it instead of copying it */
+  sw->table.floods++;
+  shared = vde_pkt_share(vde_connection_get_context(port->conn), pkt);
+  if (shared == NULL) {
+    vde_connection_stats_drop(port->conn, VDE_CONN_DROP_ENGINE);
+    return;
+  }
+  if (sw->vlan_aware) {
+    // the reference on shared is released there
+    switch_flood_vlan(sw, port, shared, cls->vlan);
+    return;
+  }
+  switch_flood(sw, port, shared);
+  vde_pkt_put(shared);
+}
+
+int switch_engine_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
+{
+  switch_class cls;
+  switch_port *port = (switch_port *)arg;
+  switch_engine *sw = port->sw;
+
+  switch_classify_one(pkt, &cls);
+  if (!(cls.flags & CLASS_SHORT) && sw->vlan_aware) {
+    switch_vlan_ingress(port, pkt, &cls);
+  }
+  if (!(cls.flags & CLASS_SKIP)) {
+    cls.src_slot = switch_hash(&sw->table, cls.src_key);
+    cls.dst_slot = switch_hash(&sw->table, cls.dst_key);
+  }
+  switch_forward(sw, port, pkt, &cls);
+
+  return 0;
+}
+
+int switch_engine_read_batchcb(vde_connection *conn, vde_pkt **pkts,
+                               unsigned int count, void *arg)
+{
+  switch_class cls[CLASS_BATCH];
+  unsigned int i, chunk;
+  switch_port *port = (switch_port *)arg;
+  switch_engine *sw = port->sw;
+  switch_table *table = &sw->table;
+
+  while (count > 0) {
+    chunk = count < CLASS_BATCH ? count : CLASS_BATCH;
+
+    sw->classify(pkts, chunk, cls);
+    // the slots of a batch are usually spread over the whole table
+    for (i = 0; i < chunk; i++) {
+      if (!(cls[i].flags & CLASS_SHORT) && sw->vlan_aware) {
+        switch_vlan_ingress(port, pkts[i], &cls[i]);
+      }
+      if (cls[i].flags & CLASS_SKIP) {
+        continue;
+      }
+      cls[i].src_slot = switch_hash(table, cls[i].src_key);
+      cls[i].dst_slot = switch_hash(table, cls[i].dst_key);
+      if (!(cls[i].flags & CLASS_SRC_MCAST)) {
+        __builtin_prefetch(&table->entries[cls[i].src_slot], 1);
+      }
+      if (!(cls[i].flags & CLASS_DST_MCAST)) {
+        __builtin_prefetch(&table->entries[cls[i].dst_slot], 0);
+      }
+    }
+
+    for (i = 0; i < chunk; i++) {
+      switch_forward(sw, port, pkts[i], &cls[i]);
+    }
+
+    pkts += chunk;
+    count -= chunk;
+  }
+
+  return 0;
+}
+
+// port signals carry the number of ports and the port number
+static inline void switch_raise_port_signal(switch_engine *sw,
+                                            vde_signal *signal,
+                                            unsigned int idx)
+{
+  vde_sobj *info;
+
+  if (!vde_signal_has_callbacks(signal)) {
+    return;
+  }
+
+  info = vde_sobj_new_array();
+  // XXX check info not null
+  vde_sobj_array_add(info, vde_sobj_new_int(sw->count));
+  vde_sobj_array_add(info, vde_sobj_new_int(idx));
+  vde_component_signal_emit(sw->component, signal, info);
+  vde_sobj_put(info);
+}
+
+int switch_engine_errorcb(vde_connection *conn, vde_pkt *pkt,
+                          vde_conn_error err, void *arg)
+{
+  unsigned int idx;
+  switch_port *port = (switch_port *)arg;
+  switch_engine *sw = port->sw;
+
+  if (err == CONN_WRITE_DELAY) {
+    // the drop has been counted by the connection
+    return 0;
+  }
+
+  // XXX: handle different errors, the following is just the fatal case
+
+  idx = port->index;
+  vde_conn_stats_add(&sw->detached, vde_connection_get_stats(conn));
+  switch_port_del(sw, port);
+  switch_table_purge(sw, port, 0);
+  vde_free(port);
+
+  switch_raise_port_signal(sw, sw->port_del_sig, idx);
+
+  errno = EPIPE;
+  return -1;
+}
+
+int switch_engine_newconn(vde_component *component, vde_connection *conn,
+                          vde_request *req)
+{
+  unsigned int max_payload;
+  struct timeval send_timeout;
+  switch_port *port;
+  switch_engine *sw = vde_component_get_priv(component);
+
+  max_payload = vde_connection_max_payload(conn);
+  if (max_payload != 0 && max_payload < sizeof(struct eth_frame)) {
+    vde_warning("%s: connection can't handle full eth frames, rejecting",
+                __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  port = (switch_port *)vde_calloc(sizeof(switch_port));
+  if (port == NULL) {
+    vde_error("%s: could not allocate port data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+  port->sw = sw;
+  port->conn = conn;
+  vde_storm_bucket_init(&sw->storm, &port->storm);
+  switch_port_add(sw, port);
+
+  // new ports of a vlan aware switch are access ports of the default vlan
+  if (sw->vlan_aware &&
+      switch_port_set_vlans(sw, port, 0, DEFAULT_VLAN, NULL)) {
+    vde_error("%s: could not add port to the default vlan",
+              __PRETTY_FUNCTION__);
+    switch_port_del(sw, port);
+    vde_free(port);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  /* Setup connection */
+  vde_connection_set_callbacks(conn, &switch_engine_readcb, NULL,
+                               &switch_engine_errorcb, (void *)port);
+  vde_connection_set_read_batch_cb(conn, &switch_engine_read_batchcb);
+  vde_connection_set_pkt_properties(conn, 0, 0);
+  send_timeout.tv_sec = TIMEOUT;
+  send_timeout.tv_usec = 0;
+  vde_connection_set_send_properties(conn, TIMES, &send_timeout,
+                                     PORT_QUEUE_BYTES);
+  vde_connection_set_send_watermarks(conn, PORT_LOW_WM, PORT_HIGH_WM);
+
+  switch_port_restore(sw, port);
+  switch_raise_port_signal(sw, sw->port_new_sig, port->index);
+
+  return 0;
+}
+
+int engine_switch_status(vde_component *component, vde_sobj **out)
+{
+  switch_engine *sw = vde_component_get_priv(component);
+
+  *out = vde_sobj_new_int(sw->count);
+
+  return 0;
+}
+
+int engine_switch_table_stats(vde_component *component, vde_sobj **out)
+{
+  switch_engine *sw = vde_component_get_priv(component);
+  switch_table *table = &sw->table;
+
+  *out = vde_sobj_new_hash();
+  vde_sobj_hash_insert(*out, "size", vde_sobj_new_int(table->size));
+  vde_sobj_hash_insert(*out, "entries", vde_sobj_new_int(table->count));
+  vde_sobj_hash_insert(*out, "hits", vde_sobj_new_int(table->hits));
+  vde_sobj_hash_insert(*out, "misses", vde_sobj_new_int(table->misses));
+  vde_sobj_hash_insert(*out, "floods", vde_sobj_new_int(table->floods));
+  vde_sobj_hash_insert(*out, "full", vde_sobj_new_int(table->full));
+  vde_sobj_hash_insert(*out, "classifier",
+                       vde_sobj_new_string(sw->classifier));
+
+  return 0;
+}
+
+// serialize the counters of all the ports, attached or not
+static vde_sobj *switch_stats_serialize(switch_engine *sw)
+{
+  unsigned int i;
+  vde_sobj *stats;
+  vde_conn_stats total = sw->detached;
+
+  for (i = 0; i < sw->used; i++) {
+    if (sw->ports[i] != NULL) {
+      vde_conn_stats_add(&total, vde_connection_get_stats(sw->ports[i]->conn));
+    }
+  }
+
+  stats = vde_conn_stats_serialize(&total);
+  if (stats != NULL) {
+    vde_sobj_hash_insert(stats, "ports", vde_sobj_new_int(sw->count));
+  }
+  return stats;
+}
+
+static void switch_stats_cb(int fd, short events, void *arg)
+{
+  vde_sobj *info, *stats;
+  switch_engine *sw = (switch_engine *)arg;
+
+  if (!vde_signal_has_callbacks(sw->stats_sig)) {
+    return;
+  }
+
+  stats = switch_stats_serialize(sw);
+  if (stats == NULL) {
+    return;
+  }
+  // signal parameters are an array, as for port signals
+  info = vde_sobj_new_array();
+  vde_sobj_array_add(info, stats);
+  vde_component_signal_emit(sw->component, sw->stats_sig, info);
+  vde_sobj_put(info);
+}
+
+int engine_switch_stats(vde_component *component, vde_sobj **out)
+{
+  switch_engine *sw = vde_component_get_priv(component);
+
+  *out = switch_stats_serialize(sw);
+  if (*out == NULL) {
+    *out = vde_sobj_new_string("Cannot serialize stats");
+    errno = ENOMEM;
+    return -1;
+  }
+
+  return 0;
+}
+
+int engine_switch_port_stats(vde_component *component, vde_sobj **out)
+{
+  unsigned int i;
+  vde_sobj *stats;
+  switch_engine *sw = vde_component_get_priv(component);
+
+  *out = vde_sobj_new_array();
+  for (i = 0; i < sw->used; i++) {
+    if (sw->ports[i] == NULL) {
+      continue;
+    }
+    stats = vde_conn_stats_serialize(
+              vde_connection_get_stats(sw->ports[i]->conn));
+    if (stats == NULL) {
+      vde_sobj_put(*out);
+      *out = vde_sobj_new_string("Cannot serialize stats");
+      errno = ENOMEM;
+      return -1;
+    }
+    vde_sobj_hash_insert(stats, "port", vde_sobj_new_int(i));
+    vde_sobj_array_add(*out, stats);
+  }
+
+  return 0;
+}
+
+int engine_switch_storm_control(vde_component *component, const char *class,
+                                int rate, int burst, vde_sobj **out)
+{
+  switch_engine *sw = vde_component_get_priv(component);
+
+  if (vde_storm_set(&sw->storm, class, rate, burst)) {
+    *out = vde_sobj_new_string("Cannot set storm control");
+    return -1;
+  }
+  *out = vde_sobj_new_string("Storm control set");
+
+  return 0;
+}
+
+int engine_switch_storm_print(vde_component *component, vde_sobj **out)
+{
+  switch_engine *sw = vde_component_get_priv(component);
+
+  *out = vde_storm_serialize(&sw->storm);
+  if (*out == NULL) {
+    *out = vde_sobj_new_string("Cannot serialize storm control");
+    errno = ENOMEM;
+    return -1;
+  }
+
+  return 0;
+}
+
+int engine_switch_table_flush(vde_component *component, vde_sobj **out)
+{
+  switch_engine *sw = vde_component_get_priv(component);
+
+  switch_table_purge(sw, NULL, 0);
+  *out = vde_sobj_new_string("Table flushed");
+
+  return 0;
+}
+
+static switch_port *switch_vlan_port(switch_engine *sw, int port,
+                                     vde_sobj **out)
+{
+  if (!sw->vlan_aware) {
+    *out = vde_sobj_new_string("Switch is not vlan aware");
+    errno = ENOTSUP;
+    return NULL;
+  }
+  if (port < 0 || port >= sw->used || sw->ports[port] == NULL) {
+    *out = vde_sobj_new_string("Port not found");
+    errno = ENOENT;
+    return NULL;
+  }
+  return sw->ports[port];
+}
+
+static inline int switch_vlan_valid(long vlan)
+{
+  // 4095 is reserved
+  return vlan >= 1 && vlan < VLAN_IDS - 1;
+}
+
+/*
+ * Parse a list of vlan ids and ranges, as in "10,20-29", into a bitmap of
+ * VLAN_IDS bits.
+ */
+static int switch_vlan_list_parse(const char *list, uint64_t *members)
+{
+  long first, last, i;
+  char *end;
+
+  memset(members, 0, VLAN_IDS / 8);
+  while (*list != '\0') {
+    first = last = strtol(list, &end, 10);
+    if (end != list && *end == '-') {
+      list = end + 1;
+      last = strtol(list, &end, 10);
+    }
+    if (end == list || (*end != ',' && *end != '\0') ||
+        !switch_vlan_valid(first) || !switch_vlan_valid(last) ||
+        first > last) {
+      errno = EINVAL;
+      return -1;
+    }
+    for (i = first; i <= last; i++) {
+      members[i / BITMAP_WORD_BITS] |= 1ULL << (i % BITMAP_WORD_BITS);
+    }
+    list = *end == ',' ? end + 1 : end;
+  }
+  return 0;
+}
+
+// the inverse of switch_vlan_list_parse(), each vlan takes at most 5 chars
+#define VLAN_LIST_LEN (VLAN_IDS * 5 + 1)
+static void switch_vlan_list_format(const uint64_t *members, char *list)
+{
+  unsigned int first, last;
+  char *end = list;
+
+  *end = '\0';
+  for (first = 1; first < VLAN_IDS - 1; first++) {
+    if (!switch_bit_test(members, first)) {
+      continue;
+    }
+    last = first;
+    while (last + 1 < VLAN_IDS - 1 && switch_bit_test(members, last + 1)) {
+      last++;
+    }
+    end += sprintf(end, end == list ? "%u" : ",%u", first);
+    if (last > first) {
+      end += sprintf(end, "-%u", last);
+    }
+    first = last;
+  }
+}
+
+int engine_switch_vlan_access(vde_component *component, int port, int vlan,
+                              vde_sobj **out)
+{
+  switch_port *p;
+  switch_engine *sw = vde_component_get_priv(component);
+
+  p = switch_vlan_port(sw, port, out);
+  if (p == NULL) {
+    return -1;
+  }
+  if (!switch_vlan_valid(vlan)) {
+    *out = vde_sobj_new_string("Invalid vlan");
+    errno = EINVAL;
+    return -1;
+  }
+  if (switch_port_set_vlans(sw, p, 0, vlan, NULL)) {
+    *out = vde_sobj_new_string("Cannot set port vlans");
+    return -1;
+  }
+  *out = vde_sobj_new_string("Port vlans set");
+
+  return 0;
+}
+
+int engine_switch_vlan_trunk(vde_component *component, int port, int native,
+                             const char *vlans, vde_sobj **out)
+{
+  uint64_t members[VLAN_IDS / BITMAP_WORD_BITS];
+  switch_port *p;
+  switch_engine *sw = vde_component_get_priv(component);
+
+  p = switch_vlan_port(sw, port, out);
+  if (p == NULL) {
+    return -1;
+  }
+  if ((native != 0 && !switch_vlan_valid(native)) ||
+      switch_vlan_list_parse(vlans, members)) {
+    *out = vde_sobj_new_string("Invalid vlan");
+    errno = EINVAL;
+    return -1;
+  }
+  if (switch_port_set_vlans(sw, p, 1, native, members)) {
+    *out = vde_sobj_new_string("Cannot set port vlans");
+    return -1;
+  }
+  *out = vde_sobj_new_string("Port vlans set");
+
+  return 0;
+}
+
+int engine_switch_vlan_print(vde_component *component, vde_sobj **out)
+{
+  unsigned int vlan, i;
+  vde_sobj *untagged, *tagged, *info;
+  switch_engine *sw = vde_component_get_priv(component);
+
+  if (!sw->vlan_aware) {
+    *out = vde_sobj_new_string("Switch is not vlan aware");
+    errno = ENOTSUP;
+    return -1;
+  }
+
+  *out = vde_sobj_new_array();
+  for (vlan = 1; vlan < VLAN_IDS; vlan++) {
+    if (sw->vlans[vlan] == NULL) {
+      continue;
+    }
+    untagged = vde_sobj_new_array();
+    tagged = vde_sobj_new_array();
+    for (i = 0; i < sw->used; i++) {
+      if (!switch_bit_test(sw->vlans[vlan], i)) {
+        continue;
+      }
+      vde_sobj_array_add(sw->ports[i]->pvid == vlan ? untagged : tagged,
+                         vde_sobj_new_int(i));
+    }
+    if (vde_sobj_array_length(untagged) == 0 &&
+        vde_sobj_array_length(tagged) == 0) {
+      vde_sobj_put(untagged);
+      vde_sobj_put(tagged);
+      continue;
+    }
+    info = vde_sobj_new_hash();
+    vde_sobj_hash_insert(info, "vlan", vde_sobj_new_int(vlan));
+    vde_sobj_hash_insert(info, "untagged", untagged);
+    vde_sobj_hash_insert(info, "tagged", tagged);
+    vde_sobj_array_add(*out, info);
+  }
+
+  return 0;
+}
+
+/*
+ * The state is {"version": 2, "entries": [[transport, id, key], ...],
+ * "ports": [[transport, id, trunk, pvid, vlans], ...]}: ports are identified
+ * by the name of their transport and the handoff id of their connection, which
+ * the transport keeps across a hot restart, and their vlans are listed as in
+ * vlan_trunk. Ports of connections without an id are not saved.
+ */
+int engine_switch_state_save(vde_component *component, vde_sobj **out)
+{
+  uint64_t members[VLAN_IDS / BITMAP_WORD_BITS];
+  unsigned int i, vlan;
+  uint32_t id;
+  switch_entry *entry;
+  switch_port *port;
+  vde_sobj *entries, *ports, *info;
+  char *list = NULL;
+  switch_engine *sw = vde_component_get_priv(component);
+
+  if (sw->vlan_aware) {
+    list = (char *)vde_alloc(VLAN_LIST_LEN);
+    if (list == NULL) {
+      *out = vde_sobj_new_string("Cannot save state");
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+
+  entries = vde_sobj_new_array();
+  for (i = 0; i < sw->table.size; i++) {
+    entry = &sw->table.entries[i];
+    if (entry->key == 0) {
+      continue;
+    }
+    id = vde_connection_get_handoff_id(entry->port->conn);
+    if (id == 0) {
+      continue;
+    }
+    info = vde_sobj_new_array();
+    vde_sobj_array_add(info, vde_sobj_new_string(vde_quark_to_string(
+                         vde_connection_get_handoff_scope(entry->port->conn))));
+    vde_sobj_array_add(info, vde_sobj_new_int64(id));
+    vde_sobj_array_add(info, vde_sobj_new_int64(entry->key & ~KEY_USED));
+    vde_sobj_array_add(entries, info);
+  }
+
+  ports = vde_sobj_new_array();
+  for (i = 0; sw->vlan_aware && i < sw->used; i++) {
+    port = sw->ports[i];
+    if (port == NULL ||
+        (id = vde_connection_get_handoff_id(port->conn)) == 0) {
+      continue;
+    }
+    memset(members, 0, sizeof(members));
+    for (vlan = 1; port->trunk && vlan < VLAN_IDS; vlan++) {
+      if (switch_vlan_member(sw, vlan, i)) {
+        members[vlan / BITMAP_WORD_BITS] |= 1ULL << (vlan % BITMAP_WORD_BITS);
+      }
+    }
+    switch_vlan_list_format(members, list);
+    info = vde_sobj_new_array();
+    vde_sobj_array_add(info, vde_sobj_new_string(vde_quark_to_string(
+                         vde_connection_get_handoff_scope(port->conn))));
+    vde_sobj_array_add(info, vde_sobj_new_int64(id));
+    vde_sobj_array_add(info, vde_sobj_new_int(port->trunk));
+    vde_sobj_array_add(info, vde_sobj_new_int(port->pvid));
+    vde_sobj_array_add(info, vde_sobj_new_string(list));
+    vde_sobj_array_add(ports, info);
+  }
+  vde_free(list);
+
+  *out = vde_sobj_new_hash();
+  vde_sobj_hash_insert(*out, "version", vde_sobj_new_int(SAVED_STATE_VERSION));
+  vde_sobj_hash_insert(*out, "entries", entries);
+  vde_sobj_hash_insert(*out, "ports", ports);
+
+  return 0;
+}
+
+// a transport name followed by a handoff id from 1 to UINT32_MAX, the first
+// two items of info
+static int switch_saved_id(vde_sobj *info, switch_saved_key *key)
+{
+  vde_sobj *obj;
+  int64_t value;
+
+  obj = vde_sobj_array_get_idx(info, 0);
+  if (!obj || !vde_sobj_is_type(obj, vde_sobj_type_string)) {
+    return -1;
+  }
+  key->scope = vde_quark_from_string(vde_sobj_get_string(obj));
+  obj = vde_sobj_array_get_idx(info, 1);
+  if (!obj || !vde_sobj_is_type(obj, vde_sobj_type_int)) {
+    return -1;
+  }
+  value = vde_sobj_get_int64(obj);
+  if (value < 1 || value > UINT32_MAX) {
+    return -1;
+  }
+  key->id = (uint32_t)value;
+  return 0;
+}
+
+static int switch_saved_parse(switch_engine *sw, vde_sobj *state)
+{
+  vde_sobj *version, *entries, *ports, *info, *obj;
+  switch_saved_entry *saved_entries = NULL;
+  switch_saved_port *saved_ports = NULL;
+  switch_saved_port *saved;
+  unsigned int nentries, nports = 0, vlan, i;
+  int64_t key;
+
+  version = vde_sobj_hash_lookup(state, "version");
+  entries = vde_sobj_hash_lookup(state, "entries");
+  ports = vde_sobj_hash_lookup(state, "ports");
+  if (!version || !vde_sobj_is_type(version, vde_sobj_type_int) ||
+      vde_sobj_get_int(version) != SAVED_STATE_VERSION ||
+      !entries || !vde_sobj_is_type(entries, vde_sobj_type_array) ||
+      !ports || !vde_sobj_is_type(ports, vde_sobj_type_array)) {
+    goto err_inval;
+  }
+
+  nentries = vde_sobj_array_length(entries);
+  saved_entries = (switch_saved_entry *)vde_alloc(
+                    (nentries + 1) * sizeof(switch_saved_entry));
+  // vlans of a switch which is not vlan aware are ignored
+  if (sw->vlan_aware) {
+    nports = vde_sobj_array_length(ports);
+    saved_ports = (switch_saved_port *)vde_alloc(
+                    (nports + 1) * sizeof(switch_saved_port));
+  }
+  if (saved_entries == NULL || (sw->vlan_aware && saved_ports == NULL)) {
+    vde_free(saved_entries);
+    vde_free(saved_ports);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  for (i = 0; i < nentries; i++) {
+    info = vde_sobj_array_get_idx(entries, i);
+    if (!info || !vde_sobj_is_type(info, vde_sobj_type_array) ||
+        vde_sobj_array_length(info) != 3 ||
+        switch_saved_id(info, (switch_saved_key *)&saved_entries[i])) {
+      goto err_inval;
+    }
+    obj = vde_sobj_array_get_idx(info, 2);
+    if (!obj || !vde_sobj_is_type(obj, vde_sobj_type_int)) {
+      goto err_inval;
+    }
+    // a vlan and an address, as in switch_key()
+    key = vde_sobj_get_int64(obj);
+    if (key <= 0 || key >= ((int64_t)VLAN_IDS << 48)) {
+      goto err_inval;
+    }
+    saved_entries[i].key = KEY_USED | (uint64_t)key;
+  }
+
+  for (i = 0; i < nports; i++) {
+    saved = &saved_ports[i];
+    info = vde_sobj_array_get_idx(ports, i);
+    if (!info || !vde_sobj_is_type(info, vde_sobj_type_array) ||
+        vde_sobj_array_length(info) != 5 ||
+        switch_saved_id(info, (switch_saved_key *)saved)) {
+      goto err_inval;
+    }
+    obj = vde_sobj_array_get_idx(info, 2);
+    if (!obj || !vde_sobj_is_type(obj, vde_sobj_type_int)) {
+      goto err_inval;
+    }
+    saved->trunk = vde_sobj_get_int(obj) != 0;
+    obj = vde_sobj_array_get_idx(info, 3);
+    if (!obj || !vde_sobj_is_type(obj, vde_sobj_type_int)) {
+      goto err_inval;
+    }
+    vlan = vde_sobj_get_int(obj);
+    // only trunk ports can drop untagged frames
+    if ((vlan != 0 || !saved->trunk) && !switch_vlan_valid(vlan)) {
+      goto err_inval;
+    }
+    saved->pvid = vlan;
+    obj = vde_sobj_array_get_idx(info, 4);
+    if (!obj || !vde_sobj_is_type(obj, vde_sobj_type_string) ||
+        switch_vlan_list_parse(vde_sobj_get_string(obj), saved->members)) {
+      goto err_inval;
+    }
+  }
+
+  qsort(saved_entries, nentries, sizeof(switch_saved_entry),
+        &switch_saved_cmp);
+  if (nports > 0) {
+    qsort(saved_ports, nports, sizeof(switch_saved_port), &switch_saved_cmp);
+  }
+
+  switch_saved_free(sw);
+  sw->saved_entries = saved_entries;
+  sw->nsaved_entries = nentries;
+  sw->saved_ports = saved_ports;
+  sw->nsaved_ports = nports;
+  sw->saved_tick = sw->now;
+  return 0;
+
+err_inval:
+  vde_free(saved_entries);
+  vde_free(saved_ports);
+  errno = EINVAL;
+  return -1;
+}
+
+/*
+ * Ports attached after the state is loaded get their vlans and addresses
+ * back, usually as their connections are handed over by the transport of the
+ * process which saved it. Ports already attached get them at once.
+ */
+int engine_switch_state_load(vde_component *component, const char *state,
+                             vde_sobj **out)
+{
+  unsigned int i;
+  vde_sobj *obj;
+  switch_engine *sw = vde_component_get_priv(component);
+
+  obj = vde_sobj_from_string(state);
+  if (!obj || !vde_sobj_is_type(obj, vde_sobj_type_hash)) {
+    if (obj) {
+      vde_sobj_put(obj);
+    }
+    *out = vde_sobj_new_string("Invalid state");
+    errno = EINVAL;
+    return -1;
+  }
+  if (switch_saved_parse(sw, obj)) {
+    vde_sobj_put(obj);
+    *out = vde_sobj_new_string(errno == ENOMEM ? "Cannot load state" :
+                                                 "Invalid state");
+    return -1;
+  }
+  vde_sobj_put(obj);
+
+  for (i = 0; i < sw->used; i++) {
+    if (sw->ports[i] != NULL) {
+      switch_port_restore(sw, sw->ports[i]);
+    }
+  }
+  *out = vde_sobj_new_string("State loaded");
+
+  return 0;
+}
+
+static int engine_switch_init(vde_component *component, vde_sobj *params)
+{
+  int tmp_errno;
+  unsigned int table_size = DEFAULT_TABLE_SIZE;
+  unsigned int max_age = DEFAULT_MAX_AGE;
+  int stats_interval = DEFAULT_STATS_INTERVAL;
+  int simd = 1;
+  int vlan_aware = 0;
+  struct timeval aging_tick, stats_tv;
+  vde_sobj *param, *storm = NULL;
+  switch_engine *sw;
+
+  vde_assert(component != NULL);
+
+  if (params && vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    param = vde_sobj_hash_lookup(params, "table_size");
+    if (param) {
+      if (!vde_sobj_is_type(param, vde_sobj_type_int) ||
+          vde_sobj_get_int(param) < 1 ||
+          vde_sobj_get_int(param) > MAX_TABLE_SIZE) {
+        vde_error("%s: table_size must be an integer between 1 and %d",
+                  __PRETTY_FUNCTION__, MAX_TABLE_SIZE);
+        // sizes are rounded up to a power of two
+        errno = EINVAL;
+        return -1;
+      }
+      table_size = vde_sobj_get_int(param);
+    }
+    param = vde_sobj_hash_lookup(params, "max_age");
+    if (param) {
+      if (!vde_sobj_is_type(param, vde_sobj_type_int) ||
+          vde_sobj_get_int(param) < AGING_TICK) {
+        vde_error("%s: max_age must be an integer not lower than %d",
+                  __PRETTY_FUNCTION__, AGING_TICK);
+        errno = EINVAL;
+        return -1;
+      }
+      max_age = vde_sobj_get_int(param);
+    }
+    param = vde_sobj_hash_lookup(params, "stats_interval");
+    if (param) {
+      if (!vde_sobj_is_type(param, vde_sobj_type_int) ||
+          vde_sobj_get_int(param) < 0) {
+        vde_error("%s: stats_interval must be a non-negative integer",
+                  __PRETTY_FUNCTION__);
+        errno = EINVAL;
+        return -1;
+      }
+      stats_interval = vde_sobj_get_int(param);
+    }
+    // vector classification is used where available unless disabled
+    param = vde_sobj_hash_lookup(params, "simd");
+    if (param) {
+      if (!vde_sobj_is_type(param, vde_sobj_type_bool)) {
+        vde_error("%s: simd must be a boolean", __PRETTY_FUNCTION__);
+        errno = EINVAL;
+        return -1;
+      }
+      simd = vde_sobj_get_bool(param);
+    }
+    param = vde_sobj_hash_lookup(params, "vlan_aware");
+    if (param) {
+      if (!vde_sobj_is_type(param, vde_sobj_type_bool)) {
+        vde_error("%s: vlan_aware must be a boolean", __PRETTY_FUNCTION__);
+        errno = EINVAL;
+        return -1;
+      }
+      vlan_aware = vde_sobj_get_bool(param);
+    }
+    storm = vde_sobj_hash_lookup(params, "storm_control");
+  }
+
+  sw = (switch_engine *)vde_calloc(sizeof(switch_engine));
+  if (sw == NULL) {
+    vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  sw->component = component;
+  sw->max_age = max_age / AGING_TICK;
+  sw->classify = switch_classifier_select(simd, &sw->classifier);
+
+  if (switch_table_init(&sw->table, table_size)) {
+    vde_error("%s: could not allocate forwarding table", __PRETTY_FUNCTION__);
+    vde_free(sw);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  vde_storm_init(&sw->storm, vde_component_get_context(component));
+  if (storm != NULL && vde_storm_parse(&sw->storm, storm)) {
+    tmp_errno = errno;
+    goto err_free;
+  }
+
+  if (vlan_aware) {
+    sw->vlan_aware = 1;
+    sw->vlans = (uint64_t **)vde_calloc(VLAN_IDS * sizeof(uint64_t *));
+    if (sw->vlans == NULL) {
+      vde_error("%s: could not allocate vlans", __PRETTY_FUNCTION__);
+      tmp_errno = ENOMEM;
+      goto err_free;
+    }
+  }
+
+  aging_tick.tv_sec = AGING_TICK;
+  aging_tick.tv_usec = 0;
+  sw->aging_timeout =
+    vde_context_timeout_add(vde_component_get_context(component),
+                            VDE_EV_PERSIST, &aging_tick, &switch_aging_cb,
+                            (void *)sw);
+  if (sw->aging_timeout == NULL) {
+    vde_error("%s: could not add aging timeout", __PRETTY_FUNCTION__);
+    tmp_errno = errno;
+    goto err_free;
+  }
+
+  if (stats_interval > 0) {
+    stats_tv.tv_sec = stats_interval;
+    stats_tv.tv_usec = 0;
+    sw->stats_timeout =
+      vde_context_timeout_add(vde_component_get_context(component),
+                              VDE_EV_PERSIST, &stats_tv, &switch_stats_cb,
+                              (void *)sw);
+    if (sw->stats_timeout == NULL) {
+      tmp_errno = errno;
+      vde_error("%s: could not add stats timeout", __PRETTY_FUNCTION__);
+      goto err_timeout;
+    }
+  }
+
+  // command registration phase
+  // - the header for the wrappers has been included at the top
+  // - register the commands array, the name is in the json definition
+  if (vde_component_commands_register_table(component, engine_switch_commands,
+                                        engine_switch_commands_lookup)) {
+    tmp_errno = errno;
+    vde_error("%s: could not register commands", __PRETTY_FUNCTION__);
+    goto err_timeout;
+  }
+
+  if (vde_component_signals_register(component, engine_switch_signals)) {
+    tmp_errno = errno;
+    vde_error("%s: could not register signals", __PRETTY_FUNCTION__);
+    vde_component_commands_deregister(component, engine_switch_commands);
+    goto err_timeout;
+  }
+  sw->port_new_sig = vde_component_signal_get(component, "port_new");
+  sw->port_del_sig = vde_component_signal_get(component, "port_del");
+  sw->stats_sig = vde_component_signal_get(component, "stats");
+
+  vde_component_set_priv(component, (void *)sw);
+  return 0;
+
+err_timeout:
+  if (sw->stats_timeout != NULL) {
+    vde_context_timeout_del(vde_component_get_context(component),
+                            sw->stats_timeout);
+  }
+  vde_context_timeout_del(vde_component_get_context(component),
+                          sw->aging_timeout);
+err_free:
+  vde_storm_fini(&sw->storm);
+  vde_free(sw->vlans);
+  vde_free(sw->table.entries);
+  vde_free(sw);
+  errno = tmp_errno;
+  return -1;
+}
+
+void engine_switch_fini(vde_component *component)
+{
+  unsigned int i;
+  switch_port *port;
+  switch_engine *sw = (switch_engine *)vde_component_get_priv(component);
+
+  vde_context_timeout_del(vde_component_get_context(component),
+                          sw->aging_timeout);
+  if (sw->stats_timeout != NULL) {
+    vde_context_timeout_del(vde_component_get_context(component),
+                            sw->stats_timeout);
+  }
+  vde_storm_fini(&sw->storm);
+
+  for (i = 0; i < sw->used; i++) {
+    port = sw->ports[i];
+    if (port == NULL) {
+      continue;
+    }
+    // XXX check if this is safe here
+    vde_connection_fini(port->conn);
+    vde_connection_delete(port->conn);
+    if (sw->ports[i] != NULL) {
+      switch_port_del(sw, port);
+      vde_free(port);
+    }
+  }
+  vde_free(sw->ports);
+  vde_free(sw->free_slots);
+  for (i = 0; sw->vlans != NULL && i < VLAN_IDS; i++) {
+    vde_free(sw->vlans[i]);
+  }
+  vde_free(sw->vlans);
+  switch_saved_free(sw);
+
+  vde_free(sw->table.entries);
+  vde_free(sw);
+
+  vde_component_commands_deregister(component, engine_switch_commands);
+  vde_component_signals_deregister(component, engine_switch_signals);
+}
+
+component_ops engine_switch_component_ops = {
+  .init = engine_switch_init,
+  .fini = engine_switch_fini,
+  .get_configuration = NULL,
+  .set_configuration = NULL,
+  .get_policy = NULL,
+  .set_policy = NULL,
+};
+
+vde_module VDE_MODULE_START = {
+  .kind = VDE_ENGINE,
+  .family = "switch",
+  .cops = &engine_switch_component_ops,
+  .eng_new_conn = &switch_engine_newconn,
+};
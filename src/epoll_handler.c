@@ -0,0 +1,802 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <vde3.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+/*
+ * vde_event_handler which uses epoll directly, without other dependencies.
+ *
+ * usage can be like something this:
+ *
+ * epoll_eh_init();
+ * ...
+ * vde_context_init(ctx, &epoll_eh, NULL);
+ * ...
+ * epoll_eh_dispatch();
+ *
+ * epoll_loop can be used to run context workers, as libevent_loop does.
+ *
+ * - events are allocated in chunks and reused, adding and deleting an event
+ *   doesn't hit the allocator once the loop is warm
+ * - an fd has at most one read and one write event; read interest is a level
+ *   triggered registration of the fd itself, write interest is an edge
+ *   triggered registration of a duplicate of the fd which is kept until the
+ *   read event goes away: deleting and adding the write event again, as
+ *   transports do when their queue empties and fills up, only toggles a flag.
+ *   A write event is run once right after it is added, then on edges only,
+ *   thus its callback must write until the fd would block (or delete it).
+ * - timeouts are kept in a binary heap, the earliest one arms a timerfd
+ *
+ */
+
+#define EPOLL_MAX_EVENTS 64
+#define EPOLL_EV_CHUNK 64
+#define EPOLL_HEAP_INITIAL_SIZE 64
+#define EPOLL_TIMER_TAG UINT64_MAX
+
+#define NSEC_PER_SEC 1000000000ULL
+
+struct epoll_loop;
+
+// circular list with sentinel, events are unlinked without knowing the list
+struct ev_list {
+  struct ev_list *prev;
+  struct ev_list *next;
+};
+
+struct epoll_ev {
+  struct ev_list pending; //!< linked while waiting for a synthetic run
+  struct epoll_ev *next_free;
+  int fd;
+  short events;
+  event_cb cb;
+  void *arg;
+  uint64_t expire; //!< absolute expiration in ns, valid if heap_idx != 0
+  uint64_t interval; //!< timeout in ns, 0 if none
+  unsigned int heap_idx; //!< 1-based position in the timer heap, 0 if none
+  unsigned int active: 1; //!< not yet fired if not persistent
+};
+
+struct ev_chunk {
+  struct ev_chunk *next;
+  struct epoll_ev evs[EPOLL_EV_CHUNK];
+};
+
+struct epoll_fd {
+  struct epoll_ev *rd;
+  struct epoll_ev *wr;
+  int wr_fd; //!< duplicate registered for write edges, -1 if none
+  unsigned int rd_registered: 1;
+};
+
+struct epoll_loop {
+  int epfd;
+  int tfd;
+  uint64_t armed; //!< expiration the timerfd is armed with, 0 if disarmed
+  int brk;
+  struct epoll_fd *fds;
+  unsigned int nfds;
+  struct epoll_ev **heap;
+  unsigned int heap_len;
+  unsigned int heap_size;
+  struct ev_list pending;
+  struct epoll_ev *free;
+  struct ev_chunk *chunks;
+  struct epoll_event events[EPOLL_MAX_EVENTS];
+};
+
+// default loop, created by epoll_eh_init()
+static struct epoll_loop *default_loop;
+// loop entered by the thread, NULL for the default one
+static __thread struct epoll_loop *current_loop;
+
+static inline struct epoll_loop *epoll_eh_loop(void)
+{
+  return current_loop != NULL ? current_loop : default_loop;
+}
+
+static inline uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static inline uint64_t timeval_ns(const struct timeval *tv)
+{
+  return (uint64_t)tv->tv_sec * NSEC_PER_SEC + tv->tv_usec * 1000ULL;
+}
+
+static inline void ev_list_init(struct ev_list *l)
+{
+  l->prev = l->next = l;
+}
+
+static inline int ev_list_empty(struct ev_list *l)
+{
+  return l->next == l;
+}
+
+static inline void ev_list_add_tail(struct ev_list *l, struct ev_list *e)
+{
+  e->prev = l->prev;
+  e->next = l;
+  l->prev->next = e;
+  l->prev = e;
+}
+
+static inline void ev_list_unlink(struct ev_list *e)
+{
+  e->prev->next = e->next;
+  e->next->prev = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static inline int ev_list_linked(struct ev_list *e)
+{
+  return e->next != NULL;
+}
+
+static inline struct epoll_ev *ev_of_pending(struct ev_list *e)
+{
+  return (struct epoll_ev *)((char *)e - offsetof(struct epoll_ev, pending));
+}
+
+/*
+ * Events allocation
+ */
+
+static struct epoll_ev *ev_alloc(struct epoll_loop *loop)
+{
+  unsigned int i;
+  struct ev_chunk *chunk;
+  struct epoll_ev *ev;
+
+  if (loop->free == NULL) {
+    chunk = (struct ev_chunk *)malloc(sizeof(struct ev_chunk));
+    if (chunk == NULL) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    chunk->next = loop->chunks;
+    loop->chunks = chunk;
+    for (i = 0; i < EPOLL_EV_CHUNK; i++) {
+      chunk->evs[i].next_free = loop->free;
+      loop->free = &chunk->evs[i];
+    }
+  }
+
+  ev = loop->free;
+  loop->free = ev->next_free;
+  memset(ev, 0, sizeof(struct epoll_ev));
+  return ev;
+}
+
+static inline void ev_free(struct epoll_loop *loop, struct epoll_ev *ev)
+{
+  ev->next_free = loop->free;
+  loop->free = ev;
+}
+
+/*
+ * Timer heap, ordered by expiration
+ */
+
+static inline void heap_set(struct epoll_loop *loop, unsigned int pos,
+                            struct epoll_ev *ev)
+{
+  loop->heap[pos] = ev;
+  ev->heap_idx = pos + 1;
+}
+
+static void heap_sift_up(struct epoll_loop *loop, unsigned int pos)
+{
+  unsigned int parent;
+  struct epoll_ev *ev = loop->heap[pos];
+
+  while (pos > 0) {
+    parent = (pos - 1) / 2;
+    if (loop->heap[parent]->expire <= ev->expire) {
+      break;
+    }
+    heap_set(loop, pos, loop->heap[parent]);
+    pos = parent;
+  }
+  heap_set(loop, pos, ev);
+}
+
+static void heap_sift_down(struct epoll_loop *loop, unsigned int pos)
+{
+  unsigned int child;
+  struct epoll_ev *ev = loop->heap[pos];
+
+  while ((child = 2 * pos + 1) < loop->heap_len) {
+    if (child + 1 < loop->heap_len &&
+        loop->heap[child + 1]->expire < loop->heap[child]->expire) {
+      child++;
+    }
+    if (ev->expire <= loop->heap[child]->expire) {
+      break;
+    }
+    heap_set(loop, pos, loop->heap[child]);
+    pos = child;
+  }
+  heap_set(loop, pos, ev);
+}
+
+static int heap_push(struct epoll_loop *loop, struct epoll_ev *ev)
+{
+  unsigned int size;
+  struct epoll_ev **heap;
+
+  if (loop->heap_len == loop->heap_size) {
+    size = loop->heap_size ? loop->heap_size * 2 : EPOLL_HEAP_INITIAL_SIZE;
+    heap = (struct epoll_ev **)realloc(loop->heap,
+                                       size * sizeof(struct epoll_ev *));
+    if (heap == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    loop->heap = heap;
+    loop->heap_size = size;
+  }
+  heap_set(loop, loop->heap_len++, ev);
+  heap_sift_up(loop, loop->heap_len - 1);
+  return 0;
+}
+
+static void heap_remove(struct epoll_loop *loop, struct epoll_ev *ev)
+{
+  unsigned int pos = ev->heap_idx - 1;
+  struct epoll_ev *last;
+
+  ev->heap_idx = 0;
+  last = loop->heap[--loop->heap_len];
+  if (last == ev) {
+    return;
+  }
+  heap_set(loop, pos, last);
+  if (pos > 0 && loop->heap[(pos - 1) / 2]->expire > last->expire) {
+    heap_sift_up(loop, pos);
+  } else {
+    heap_sift_down(loop, pos);
+  }
+}
+
+// move a timer already in the heap, expiration can only grow
+static inline void heap_reschedule(struct epoll_loop *loop,
+                                   struct epoll_ev *ev, uint64_t expire)
+{
+  ev->expire = expire;
+  heap_sift_down(loop, ev->heap_idx - 1);
+}
+
+static void timer_arm(struct epoll_loop *loop)
+{
+  struct itimerspec its;
+  uint64_t expire = loop->heap_len ? loop->heap[0]->expire : 0;
+
+  if (expire == loop->armed) {
+    return;
+  }
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = expire / NSEC_PER_SEC;
+  its.it_value.tv_nsec = expire % NSEC_PER_SEC;
+  if (timerfd_settime(loop->tfd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+    vde_error("%s: cannot arm timer: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    return;
+  }
+  loop->armed = expire;
+}
+
+/*
+ * fd registrations
+ */
+
+static struct epoll_fd *fd_get(struct epoll_loop *loop, int fd)
+{
+  unsigned int i, size;
+  struct epoll_fd *fds;
+
+  if ((unsigned int)fd >= loop->nfds) {
+    size = loop->nfds ? loop->nfds : 64;
+    while (size <= (unsigned int)fd) {
+      size *= 2;
+    }
+    fds = (struct epoll_fd *)realloc(loop->fds, size * sizeof(struct epoll_fd));
+    if (fds == NULL) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    for (i = loop->nfds; i < size; i++) {
+      memset(&fds[i], 0, sizeof(struct epoll_fd));
+      fds[i].wr_fd = -1;
+    }
+    loop->fds = fds;
+    loop->nfds = size;
+  }
+  return &loop->fds[fd];
+}
+
+static int fd_update_read(struct epoll_loop *loop, int fd,
+                          struct epoll_fd *entry)
+{
+  struct epoll_event event;
+  int want = entry->rd != NULL && entry->rd->active;
+
+  if (want == entry->rd_registered) {
+    return 0;
+  }
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.u64 = (uint64_t)fd << 1;
+  if (!want) {
+    // fails if fd has been closed already, the registration is gone anyway
+    // once the write duplicate is closed too
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, &event);
+    entry->rd_registered = 0;
+    return 0;
+  }
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    return -1;
+  }
+  entry->rd_registered = 1;
+  return 0;
+}
+
+// a new registration reports the current state, like the first edge
+static int fd_register_write(struct epoll_loop *loop, int fd,
+                             struct epoll_fd *entry)
+{
+  struct epoll_event event;
+  int wr_fd;
+
+  wr_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (wr_fd == -1) {
+    return -1;
+  }
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLOUT | EPOLLET;
+  event.data.u64 = ((uint64_t)fd << 1) | 1;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, wr_fd, &event) == -1) {
+    close(wr_fd);
+    return -1;
+  }
+  entry->wr_fd = wr_fd;
+  return 0;
+}
+
+// drop registrations of an fd with no events left, it might be closed soon
+static void fd_release(struct epoll_loop *loop, int fd, struct epoll_fd *entry)
+{
+  if (entry->rd != NULL || entry->wr != NULL) {
+    return;
+  }
+  fd_update_read(loop, fd, entry);
+  if (entry->wr_fd != -1) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, entry->wr_fd, NULL);
+    close(entry->wr_fd);
+    entry->wr_fd = -1;
+  }
+}
+
+/*
+ * Event handler
+ */
+
+void *epoll_eh_event_add(int fd, short events, const struct timeval *timeout,
+                         event_cb cb, void *arg)
+{
+  int tmp_errno;
+  struct epoll_fd *entry = NULL;
+  struct epoll_ev *ev;
+  struct epoll_loop *loop = epoll_eh_loop();
+  short kind = events & (VDE_EV_READ | VDE_EV_WRITE);
+
+  if (loop == NULL) {
+    vde_error("%s: epoll event handler not initialized", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return NULL;
+  }
+  if (kind == (VDE_EV_READ | VDE_EV_WRITE) || (kind && fd < 0) ||
+      (!kind && timeout == NULL)) {
+    vde_error("%s: invalid event %d on fd %d", __PRETTY_FUNCTION__, events,
+              fd);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (kind) {
+    entry = fd_get(loop, fd);
+    if (entry == NULL) {
+      vde_error("%s: can't allocate memory for fd %d", __PRETTY_FUNCTION__,
+                fd);
+      return NULL;
+    }
+    if ((kind == VDE_EV_READ && entry->rd != NULL) ||
+        (kind == VDE_EV_WRITE && entry->wr != NULL)) {
+      vde_error("%s: fd %d already has an event of type %d",
+                __PRETTY_FUNCTION__, fd, kind);
+      errno = EEXIST;
+      return NULL;
+    }
+  }
+
+  ev = ev_alloc(loop);
+  if (ev == NULL) {
+    vde_error("%s: can't allocate memory for new event", __PRETTY_FUNCTION__);
+    return NULL;
+  }
+  ev->fd = fd;
+  ev->events = events;
+  ev->cb = cb;
+  ev->arg = arg;
+  ev->active = 1;
+
+  if (timeout != NULL) {
+    ev->interval = timeval_ns(timeout);
+    ev->expire = now_ns() + ev->interval;
+    if (heap_push(loop, ev)) {
+      tmp_errno = errno;
+      ev_free(loop, ev);
+      errno = tmp_errno;
+      return NULL;
+    }
+  }
+
+  if (kind == VDE_EV_READ) {
+    entry->rd = ev;
+    if (fd_update_read(loop, fd, entry)) {
+      goto err_fd;
+    }
+  } else if (kind == VDE_EV_WRITE) {
+    entry->wr = ev;
+    if (entry->wr_fd != -1) {
+      // the fd may already be writable and no edge would be reported
+      ev_list_add_tail(&loop->pending, &ev->pending);
+    } else if (fd_register_write(loop, fd, entry)) {
+      goto err_fd;
+    }
+  }
+
+  return ev;
+
+err_fd:
+  tmp_errno = errno;
+  vde_error("%s: cannot register fd %d: %s", __PRETTY_FUNCTION__, fd,
+            strerror(errno));
+  if (kind == VDE_EV_READ) {
+    entry->rd = NULL;
+  } else {
+    entry->wr = NULL;
+  }
+  if (ev->heap_idx) {
+    heap_remove(loop, ev);
+  }
+  ev_free(loop, ev);
+  fd_release(loop, fd, entry);
+  errno = tmp_errno;
+  return NULL;
+}
+
+void epoll_eh_event_del(void *event)
+{
+  struct epoll_fd *entry;
+  struct epoll_ev *ev = (struct epoll_ev *)event;
+  struct epoll_loop *loop = epoll_eh_loop();
+
+  if (ev->heap_idx) {
+    heap_remove(loop, ev);
+  }
+  if (ev_list_linked(&ev->pending)) {
+    ev_list_unlink(&ev->pending);
+  }
+  if (ev->events & (VDE_EV_READ | VDE_EV_WRITE)) {
+    entry = &loop->fds[ev->fd];
+    if (entry->rd == ev) {
+      entry->rd = NULL;
+    } else if (entry->wr == ev) {
+      entry->wr = NULL;
+    }
+    fd_release(loop, ev->fd, entry);
+  }
+  ev_free(loop, ev);
+}
+
+void *epoll_eh_timeout_add(const struct timeval *timeout, short events,
+                           event_cb cb, void *arg)
+{
+  return epoll_eh_event_add(-1, events & VDE_EV_PERSIST, timeout, cb, arg);
+}
+
+void epoll_eh_timeout_del(void *timeout)
+{
+  epoll_eh_event_del(timeout);
+}
+
+vde_event_handler epoll_eh = {
+  .event_add = epoll_eh_event_add,
+  .event_del = epoll_eh_event_del,
+  .timeout_add = epoll_eh_timeout_add,
+  .timeout_del = epoll_eh_timeout_del,
+};
+
+/*
+ * Dispatch
+ */
+
+// an event fired, callbacks can delete it thus it must not be used afterwards
+static void ev_fire(struct epoll_loop *loop, struct epoll_ev *ev, short what,
+                    uint64_t now)
+{
+  if (!(ev->events & VDE_EV_PERSIST)) {
+    ev->active = 0;
+    if (ev->heap_idx) {
+      heap_remove(loop, ev);
+    }
+    if (ev->events & VDE_EV_READ) {
+      fd_update_read(loop, ev->fd, &loop->fds[ev->fd]);
+    }
+  } else if (ev->heap_idx) {
+    // a zero timeout is run once per iteration
+    heap_reschedule(loop, ev, now + (ev->interval ? ev->interval : 1));
+  }
+  ev->cb(ev->fd, what, ev->arg);
+}
+
+static void run_pending(struct epoll_loop *loop, uint64_t now)
+{
+  struct ev_list list;
+  struct epoll_ev *ev;
+
+  if (ev_list_empty(&loop->pending)) {
+    return;
+  }
+  // events added by the callbacks are run on the next iteration
+  list.next = loop->pending.next;
+  list.prev = loop->pending.prev;
+  list.next->prev = &list;
+  list.prev->next = &list;
+  ev_list_init(&loop->pending);
+
+  while (!ev_list_empty(&list) && !loop->brk) {
+    ev = ev_of_pending(list.next);
+    ev_list_unlink(&ev->pending);
+    if (ev->active) {
+      ev_fire(loop, ev, VDE_EV_WRITE, now);
+    }
+  }
+  // back to the loop if it has been stopped
+  while (!ev_list_empty(&list)) {
+    ev = ev_of_pending(list.next);
+    ev_list_unlink(&ev->pending);
+    ev_list_add_tail(&loop->pending, &ev->pending);
+  }
+}
+
+static void run_timers(struct epoll_loop *loop, uint64_t now)
+{
+  struct epoll_ev *ev;
+
+  while (loop->heap_len && loop->heap[0]->expire <= now && !loop->brk) {
+    ev = loop->heap[0];
+    ev_fire(loop, ev, VDE_EV_TIMEOUT, now);
+  }
+}
+
+static void run_fd(struct epoll_loop *loop, uint64_t data, uint64_t now)
+{
+  struct epoll_ev *ev;
+  struct epoll_fd *entry;
+  unsigned int fd = data >> 1;
+
+  if (fd >= loop->nfds) {
+    return;
+  }
+  entry = &loop->fds[fd];
+  ev = (data & 1) ? entry->wr : entry->rd;
+  if (ev == NULL || !ev->active) {
+    // write interest is off until the next event_add
+    return;
+  }
+  if (ev_list_linked(&ev->pending)) {
+    ev_list_unlink(&ev->pending);
+  }
+  ev_fire(loop, ev, (data & 1) ? VDE_EV_WRITE : VDE_EV_READ, now);
+}
+
+static int epoll_loop_once(struct epoll_loop *loop)
+{
+  int i, count, timeout = -1;
+  uint64_t expirations, now;
+
+  now = now_ns();
+  run_pending(loop, now);
+
+  if (!ev_list_empty(&loop->pending) ||
+      (loop->heap_len && loop->heap[0]->expire <= now)) {
+    timeout = 0;
+  } else {
+    timer_arm(loop);
+  }
+
+  count = epoll_wait(loop->epfd, loop->events, EPOLL_MAX_EVENTS, timeout);
+  if (count == -1) {
+    if (errno == EINTR) {
+      return 0;
+    }
+    vde_error("%s: epoll_wait failed: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    return -1;
+  }
+
+  now = now_ns();
+  for (i = 0; i < count && !loop->brk; i++) {
+    if (loop->events[i].data.u64 == EPOLL_TIMER_TAG) {
+      // absolute one-shot timer: it is disarmed once expired
+      if (read(loop->tfd, &expirations, sizeof(expirations)) > 0) {
+        loop->armed = 0;
+      }
+      continue;
+    }
+    run_fd(loop, loop->events[i].data.u64, now);
+  }
+
+  run_timers(loop, now);
+  return 0;
+}
+
+/*
+ * Event loops
+ */
+
+void *epoll_loop_new(void)
+{
+  struct epoll_event event;
+  struct epoll_loop *loop;
+
+  loop = (struct epoll_loop *)calloc(1, sizeof(struct epoll_loop));
+  if (loop == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  ev_list_init(&loop->pending);
+
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epfd == -1) {
+    goto err_free;
+  }
+  loop->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (loop->tfd == -1) {
+    goto err_epfd;
+  }
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.u64 = EPOLL_TIMER_TAG;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->tfd, &event) == -1) {
+    goto err_tfd;
+  }
+
+  return loop;
+
+err_tfd:
+  close(loop->tfd);
+err_epfd:
+  close(loop->epfd);
+err_free:
+  vde_error("%s: cannot create epoll loop: %s", __PRETTY_FUNCTION__,
+            strerror(errno));
+  free(loop);
+  return NULL;
+}
+
+void epoll_loop_delete(void *arg)
+{
+  unsigned int i;
+  struct ev_chunk *chunk;
+  struct epoll_loop *loop = (struct epoll_loop *)arg;
+
+  for (i = 0; i < loop->nfds; i++) {
+    if (loop->fds[i].wr_fd != -1) {
+      close(loop->fds[i].wr_fd);
+    }
+  }
+  while (loop->chunks != NULL) {
+    chunk = loop->chunks;
+    loop->chunks = chunk->next;
+    free(chunk);
+  }
+  free(loop->fds);
+  free(loop->heap);
+  close(loop->tfd);
+  close(loop->epfd);
+  if (current_loop == loop) {
+    current_loop = NULL;
+  }
+  free(loop);
+}
+
+void epoll_loop_enter(void *loop)
+{
+  current_loop = (struct epoll_loop *)loop;
+}
+
+int epoll_loop_run(void *arg)
+{
+  struct epoll_loop *loop = (struct epoll_loop *)arg;
+
+  loop->brk = 0;
+  while (!loop->brk) {
+    if (epoll_loop_once(loop)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void epoll_loop_break(void *loop)
+{
+  ((struct epoll_loop *)loop)->brk = 1;
+}
+
+vde_event_loop epoll_loop = {
+  .loop_new = epoll_loop_new,
+  .loop_delete = epoll_loop_delete,
+  .loop_enter = epoll_loop_enter,
+  .loop_run = epoll_loop_run,
+  .loop_break = epoll_loop_break,
+};
+
+int epoll_eh_init(void)
+{
+  if (default_loop != NULL) {
+    return 0;
+  }
+  default_loop = (struct epoll_loop *)epoll_loop_new();
+  return default_loop != NULL ? 0 : -1;
+}
+
+int epoll_eh_dispatch(void)
+{
+  if (default_loop == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  return epoll_loop_run(default_loop);
+}
+
+void epoll_eh_break(void)
+{
+  if (default_loop != NULL) {
+    epoll_loop_break(default_loop);
+  }
+}
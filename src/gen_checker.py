@@ -67,6 +67,61 @@ typemap = {'int': ('int', 'vde_sobj_type_int', 'vde_sobj_get_int'),
 
 # XXX: escape descriptions?
 
+FNV_OFFSET = 2166136261
+FNV_PRIME = 16777619
+MAX_SEEDS = 1 << 16
+
+def fnv1a(name, seed):
+  h = seed
+  for c in name:
+    h = ((h ^ ord(c)) * FNV_PRIME) & 0xffffffff
+  return h
+
+def find_perfect_hash(names):
+  """Return (seed, size) such that FNV-1a seeded with seed maps every name to
+  a distinct slot of a power of two sized table"""
+  size = 1
+  while size < len(names):
+    size *= 2
+  while True:
+    for k in range(MAX_SEEDS):
+      seed = (FNV_OFFSET + k) & 0xffffffff
+      slots = set([fnv1a(n, seed) & (size - 1) for n in names])
+      if len(slots) == len(names):
+        return seed, size
+    size *= 2
+
+def gen_lookup(basename, wrappable):
+  names = [info['name'] for info in wrappable]
+  seed, size = find_perfect_hash(names)
+  slots = [-1] * size
+  for i, n in enumerate(names):
+    slots[fnv1a(n, seed) & (size - 1)] = i
+  info = {'basename': basename, 'seed': seed, 'mask': size - 1, 'size': size,
+          'slots': ', '.join([str(s) for s in slots])}
+  res = []
+  res.append('UNUSED static vde_command *%(basename)s_commands_lookup('
+             'const char *name,' % info)
+  res.append('    size_t len) {')
+  res.append('  // perfect hash of the command names: seeded FNV-1a')
+  res.append('  static const int slots[%(size)d] = { %(slots)s };' % info)
+  res.append('  uint32_t h = %(seed)du;' % info)
+  res.append('  size_t i;')
+  res.append('  int idx;')
+  res.append('  for (i = 0; i < len; i++) {')
+  res.append('    h = (h ^ (unsigned char)name[i]) * %du;' % FNV_PRIME)
+  res.append('  }')
+  res.append('  idx = slots[h & %(mask)d];' % info)
+  res.append('  if (idx < 0 || strncmp(%(basename)s_commands[idx].name, '
+             'name, len) ||' % info)
+  res.append('      %(basename)s_commands[idx].name[len] != \'\\0\') {'
+             % info)
+  res.append('    return NULL;')
+  res.append('  }')
+  res.append('  return &%(basename)s_commands[idx];' % info)
+  res.append('}')
+  return res
+
 def gen_command(info):
   return ['{ "%(name)s", %(fun)s_wrapper, '
           '  "%(description)s", %(fun)s_wrapper_params },' % info]
@@ -227,6 +282,8 @@ def main():
   cmd_out.write('#define %s\n' % header_guard)
   cmd_out.write('\n')
   cmd_out.write('#include <stdbool.h>\n')
+  cmd_out.write('#include <stdint.h>\n')
+  cmd_out.write('#include <string.h>\n')
   cmd_out.write('#include <vde3.h>\n')
   cmd_out.write('#include <vde3/common.h>\n')
   cmd_out.write('#include <vde3/command.h>\n')
@@ -244,6 +301,9 @@ def main():
     cmd_out.write('  %s\n' % c)
   cmd_out.write('};\n')
   cmd_out.write('\n')
+  for el in gen_lookup(basename, data['wrappables']):
+    cmd_out.write(el + '\n')
+  cmd_out.write('\n')
   cmd_out.write('#endif /* %s */\n' % header_guard)
   cmd_out.write('\n')
 
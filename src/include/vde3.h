@@ -95,6 +95,11 @@ typedef struct {
    * is called, if timeout is NULL then the callback is called only if events of
    * the specified type occur on fd.
    *
+   * Handlers may implement persistent write events as edge triggered: the
+   * callback is called once after event_add and then only when fd becomes
+   * writable again, thus it must write until fd would block or delete the
+   * event. A timeout, if any, is still honoured.
+   *
    */
   void *(*event_add)(int fd, short events, const struct timeval *timeout,
                      event_cb cb, void *arg);
@@ -141,6 +146,59 @@ typedef struct {
   void (*timeout_del)(void *tout);
 } vde_event_handler;
 
+/**
+ * @brief Event loops the application must supply to run context workers.
+ *
+ * Every worker of a context runs its own event loop in its own thread. The
+ * functions of vde_event_handler don't name a loop: they must act on the loop
+ * last entered by the calling thread with loop_enter, or on the application
+ * default loop if none has been entered. vde enters the right loop before
+ * every call to the event handler made on behalf of a worker.
+ *
+ * Except for loop_enter, these functions are called only by the thread
+ * running the loop or while it is not running.
+ */
+typedef struct {
+  /**
+   * @brief Function to create a new event loop
+   *
+   * @return a token representing the loop, NULL on error
+   */
+  void *(*loop_new)(void);
+
+  /**
+   * @brief Function to delete an event loop, no events are left in it
+   *
+   * @param loop The loop to delete, as returned by loop_new
+   */
+  void (*loop_delete)(void *loop);
+
+  /**
+   * @brief Function to select the loop used by the calling thread
+   *
+   * @param loop The loop, as returned by loop_new, or NULL to select the
+   * application default loop
+   */
+  void (*loop_enter)(void *loop);
+
+  /**
+   * @brief Function to run a loop in the calling thread until loop_break is
+   * called from one of the loop callbacks
+   *
+   * @param loop The loop to run
+   *
+   * @return zero on success, -1 on error
+   */
+  int (*loop_run)(void *loop);
+
+  /**
+   * @brief Function to make loop_run return, called from a loop callback
+   *
+   * @param loop The loop to stop
+   */
+  void (*loop_break)(void *loop);
+} vde_event_loop;
+
 /**
  * @brief Serializable object API
  *
@@ -153,7 +211,77 @@ vde_sobj *vde_sobj_from_string(const char *string);
 #define vde_sobj_put(o) json_object_put(o)
 #define vde_sobj_get(o) json_object_get(o)
 
+/**
+ * @brief Incremental deserializer of serializable objects
+ *
+ * A parser is fed a string in any number of pieces and returns the object as
+ * soon as it is complete, no copy of the whole string is made. A \0 in the
+ * input ends the string being parsed.
+ */
+typedef struct json_tokener vde_sobj_parser;
+
+/**
+ * @brief Alloc a new parser
+ *
+ * @return The new parser, NULL on error (and errno is set appropriately)
+ */
+vde_sobj_parser *vde_sobj_parser_new(void);
+
+/**
+ * @brief Deallocate a parser
+ *
+ * @param parser The parser to delete
+ */
+void vde_sobj_parser_delete(vde_sobj_parser *parser);
+
+/**
+ * @brief Discard the input fed to a parser, it is then ready to parse a new
+ * string. Call it after an object is returned or after an error.
+ *
+ * @param parser The parser to reset
+ */
+void vde_sobj_parser_reset(vde_sobj_parser *parser);
+
+/**
+ * @brief Feed a piece of string to a parser
+ *
+ * @param parser The parser
+ * @param buf The string piece, it need not be \0 terminated
+ * @param len The number of bytes in buf
+ *
+ * @return The deserialized object once complete, otherwise NULL and errno is
+ * set to EAGAIN if more input is needed or to EINVAL if the string is not
+ * well-formed (a null object is reported as EINVAL as well)
+ */
+vde_sobj *vde_sobj_parser_feed(vde_sobj_parser *parser, const char *buf,
+                               size_t len);
+
+/**
+ * @brief Function receiving a piece of a serialized object
+ *
+ * @param buf The piece, not \0 terminated
+ * @param len The piece length
+ * @param arg The argument given to vde_sobj_serialize()
+ *
+ * @return zero on success, -1 on error to stop the serialization
+ */
+typedef int (*vde_sobj_write_func)(const char *buf, size_t len, void *arg);
+
+/**
+ * @brief Serialize an object piece by piece, the output is the same as
+ * vde_sobj_to_string() but the whole string is never built, so that it can
+ * be written straight into its final buffers.
+ *
+ * @param obj The object to serialize
+ * @param func The function receiving the serialized pieces, in order
+ * @param arg The argument passed to func
+ *
+ * @return zero on success, -1 if func returned an error
+ */
+int vde_sobj_serialize(vde_sobj *obj, vde_sobj_write_func func, void *arg);
+
 #define vde_sobj_new_int(i) json_object_new_int(i)
+#define vde_sobj_new_int64(i) json_object_new_int64(i)
 #define vde_sobj_new_double(d) json_object_new_double(d)
 #define vde_sobj_new_bool(b) json_object_new_bool(b)
 #define vde_sobj_new_string(s) json_object_new_string(s)
@@ -177,6 +305,7 @@ vde_sobj *vde_sobj_from_string(const char *string);
 #define vde_sobj_type_hash json_type_object
 
 #define vde_sobj_get_int(o) json_object_get_int(o)
+#define vde_sobj_get_int64(o) json_object_get_int64(o)
 #define vde_sobj_get_double(o) json_object_get_double(o)
 #define vde_sobj_get_bool(o) json_object_get_boolean(o)
 #define vde_sobj_get_string(o) json_object_get_string(o)
@@ -263,6 +392,38 @@ int vde_conn_manager_connect(vde_component *cm, vde_request *local,
                              vde_connect_success_cb success_cb,
                              vde_connect_error_cb error_cb, void *arg);
 
+/**
+ * @brief The callback called by connection manager to authorize a new
+ * connection, before handing it to the engine
+ *
+ * With the "auth_offload" parameter of the connection manager it is called
+ * from the context workers, possibly from more than one at a time: the
+ * connection can only be used to look at its attributes.
+ *
+ * @param cm The calling connection manager
+ * @param conn The new connection
+ * @param req The connection request, NULL for accepted connections
+ * @param arg The callback private data
+ *
+ * @return zero if the connection is authorized, -1 otherwise
+ */
+struct vde_connection;
+typedef int (*vde_authorize_cb)(vde_component *cm,
+                                struct vde_connection *conn,
+                                vde_request *req, void *arg);
+
+/**
+ * @brief Set the callback authorizing new connections, to be called before
+ * listen or connect
+ *
+ * @param cm The connection manager
+ * @param authorize_cb The callback, NULL authorizes every connection
+ * @param arg A pointer to private data, passed to the callback
+ */
+void vde_conn_manager_set_authorizer(vde_component *cm,
+                                     vde_authorize_cb authorize_cb,
+                                     void *arg);
+
 
 /*
  * context
@@ -295,6 +456,22 @@ int vde_context_new(vde_context **ctx);
 int vde_context_init(vde_context *ctx, vde_event_handler *handler,
                      char **modules_path);
 
+/**
+ * @brief Load a module listed in a modules index before its first use
+ *
+ * Modules found through an index are loaded when the first component of their
+ * family is created, applications can preload their hot set right after
+ * vde_context_init() to keep that cost off the data path.
+ *
+ * @param ctx The context
+ * @param kind The module kind
+ * @param family The module family
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_context_load_module(vde_context *ctx, vde_component_kind kind,
+                            const char *family);
+
 /**
  * @brief Stop and reset a VDE 3 context
  *
@@ -328,6 +505,9 @@ int vde_context_new_component(vde_context *ctx, vde_component_kind kind,
 /**
  * @brief Lookup a component by name
  *
+ * A reference is taken on the component found, the caller releases it with
+ * vde_component_put().
+ *
  * @param ctx The context where to lookup
  * @param name The component name
  *
@@ -348,6 +528,11 @@ int vde_context_component_del(vde_context *ctx, vde_component *component);
 /**
  * @brief Save current configuration in a file
  *
+ * The configuration holds every component with its init parameters, the
+ * connection managers set in listen mode or connected and the local
+ * connections between engines (see src/config.c for the format). The file is
+ * replaced atomically.
+ *
  * @param ctx The context to save the configuration from
  * @param file The file to save the configuration to
  *
@@ -358,6 +543,11 @@ int vde_context_config_save(vde_context *ctx, const char* file);
 /**
  * @brief Load configuration from a file
  *
+ * The whole configuration is checked first, then components are created
+ * (transports, engines and connection managers last), engines are connected
+ * and connection managers listen or connect. On error every component created
+ * by the configuration is removed. Workers must not be running.
+ *
  * @param ctx The context to load the configuration into
  * @param file The file to read the configuration from
  *
@@ -365,6 +555,143 @@ int vde_context_config_save(vde_context *ctx, const char* file);
  */
 int vde_context_config_load(vde_context *ctx, const char* file);
 
+/**
+ * @brief Save the state of the components of a context, e.g. the forwarding
+ * table of a switch, so that a new process can take over after a hot restart
+ *
+ * Only components implementing the "state_save" command have a state.
+ *
+ * @param ctx The context to save the state from
+ *
+ * @return The state, as [[component name, state], ...]
+ */
+vde_sobj *vde_context_state_save(vde_context *ctx);
+
+/**
+ * @brief Load a state saved by vde_context_state_save() into the components
+ * with the same names, through their "state_load" command
+ *
+ * @param ctx The context to load the state into
+ * @param states The state to load
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_context_state_load(vde_context *ctx, vde_sobj *states);
+
+/**
+ * @brief Set how often packets read by connections of a context and of its
+ * workers are timestamped, see vde_conn_stats for the resulting histograms.
+ * To be called from the thread running the root context.
+ *
+ * @param ctx The context
+ * @param rate One packet out of rate is timestamped, 0 disables sampling
+ */
+void vde_context_set_trace_sample(vde_context *ctx, unsigned int rate);
+
+/**
+ * @brief Get the packet timestamping rate of a context
+ *
+ * @param ctx The context
+ *
+ * @return The rate set with vde_context_set_trace_sample(), 0 if disabled
+ */
+unsigned int vde_context_get_trace_sample(vde_context *ctx);
+
+/*
+ * Workers
+ *
+ * A context can own a number of worker threads, each one running its own event
+ * loop. Every worker is represented by a worker context which shares modules
+ * and the component namespace with the context owning it, but has its own
+ * event loop and packet pool. Components created in a worker context run in
+ * that worker, and so do the connections made to them: a queued local
+ * connection between engines of different workers exchanges packets through
+ * lock-free rings.
+ *
+ * Threading rules:
+ * - vde_context_get_component(), vde_component_get() and vde_component_put()
+ *   can be called from any thread; the reference is what keeps a component
+ *   looked up from another thread from being deleted.
+ * - Everything else about a component (commands, signals, connections) must
+ *   happen in the thread running its context. Signal callbacks are run by the
+ *   thread raising the signal.
+ * - Components and connections can be created in a worker context only while
+ *   workers are stopped or from the worker thread itself, see
+ *   vde_context_worker_call().
+ */
+
+/**
+ * @brief The function run by a worker on behalf of vde_context_worker_call()
+ *
+ * @param worker The worker context
+ * @param arg The argument given to vde_context_worker_call()
+ */
+typedef void (*vde_worker_fn)(vde_context *worker, void *arg);
+
+/**
+ * @brief Create worker contexts, they are started by
+ * vde_context_start_workers()
+ *
+ * @param ctx The context owning the workers, must be initialized and without
+ * workers
+ * @param nworkers The number of workers to create
+ * @param loop The event loop implementation used by workers
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_context_set_workers(vde_context *ctx, unsigned int nworkers,
+                            vde_event_loop *loop);
+
+/**
+ * @brief Get the number of workers of a context
+ *
+ * @param ctx The context owning the workers
+ *
+ * @return The number of workers, zero if workers have not been set
+ */
+unsigned int vde_context_get_num_workers(vde_context *ctx);
+
+/**
+ * @brief Get a worker context
+ *
+ * @param ctx The context owning the workers
+ * @param idx The worker index, less than vde_context_get_num_workers()
+ *
+ * @return The worker context, NULL if not found
+ */
+vde_context *vde_context_get_worker(vde_context *ctx, unsigned int idx);
+
+/**
+ * @brief Start a thread for each worker of a context
+ *
+ * @param ctx The context owning the workers
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_context_start_workers(vde_context *ctx);
+
+/**
+ * @brief Stop worker threads of a context and wait for them to exit,
+ * vde_context_fini() calls it as well
+ *
+ * @param ctx The context owning the workers
+ */
+void vde_context_stop_workers(vde_context *ctx);
+
+/**
+ * @brief Run a function in a worker thread, to be called from the thread
+ * running the context owning the worker
+ *
+ * If the worker is not running the function is called immediately.
+ *
+ * @param worker The worker context
+ * @param fn The function to call
+ * @param arg The argument to pass to fn
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_context_worker_call(vde_context *worker, vde_worker_fn fn, void *arg);
+
 
 /*
  * logging
@@ -411,15 +738,97 @@ void vvde_log(int priority, const char *format, va_list arg);
  */
 void vde_log(int priority, const char *format, ...);
 
-// XXX this could prepend __PRETTY_FUNCTION__ to avoid repeating
-#define vde_error(fmt, ...) vde_log(VDE3_LOG_ERROR, fmt, ##__VA_ARGS__)
-#define vde_warning(fmt, ...) vde_log(VDE3_LOG_WARNING, fmt, ##__VA_ARGS__)
-#define vde_notice(fmt, ...) vde_log(VDE3_LOG_NOTICE, fmt, ##__VA_ARGS__)
-#define vde_info(fmt, ...) vde_log(VDE3_LOG_INFO, fmt, ##__VA_ARGS__)
+/**
+ * @brief The most verbose priority compiled in, messages of a lower priority
+ * logged with vde_error() ... vde_debug() are removed by the compiler. It can
+ * be defined before including vde3.h.
+ */
+#ifndef VDE3_LOG_LEVEL
 #ifdef VDE3_DEBUG
-#define vde_debug(fmt, ...) vde_log(VDE3_LOG_DEBUG, fmt, ##__VA_ARGS__)
+#define VDE3_LOG_LEVEL VDE3_LOG_DEBUG
 #else
-#define vde_debug(fmt, ...)
+#define VDE3_LOG_LEVEL VDE3_LOG_INFO
+#endif
 #endif
 
+/**
+ * @brief The most verbose priority logged at runtime by vde_error() ...
+ * vde_debug(), do not modify it directly
+ */
+extern int vde_log_level;
+
+/**
+ * @brief Set the most verbose priority logged at runtime
+ *
+ * @param priority VDE3_LOG_ERROR, ..., VDE3_LOG_DEBUG. Priorities beyond
+ * VDE3_LOG_LEVEL are never logged.
+ */
+void vde_log_set_level(int priority);
+
+/**
+ * @brief Rate limiting state of a call site
+ */
+typedef struct {
+  unsigned long window; //!< start of the current window in ms, 0 if none
+  unsigned int count; //!< messages in the current window
+  unsigned int suppressed; //!< messages dropped since the last logged one
+} vde_log_ratelimit;
+
+/**
+ * @brief Set the rate limiting of vde_error() ... vde_debug(): every call
+ * site logs at most burst messages each interval, the number of suppressed
+ * messages is logged along with the first message of the next interval.
+ *
+ * @param interval_ms The interval length in milliseconds
+ * @param burst The messages allowed per interval, 0 disables rate limiting
+ */
+void vde_log_set_ratelimit(unsigned int interval_ms, unsigned int burst);
+
+/**
+ * @brief Log a message from a rate limited call site, used by vde_error() ...
+ * vde_debug()
+ *
+ * @param rl The call site state
+ * @param file The call site file
+ * @param line The call site line
+ * @param priority Logging priority
+ * @param format Message format
+ */
+void vde_log_ratelimited(vde_log_ratelimit *rl, const char *file, int line,
+                         int priority, const char *format, ...)
+  __attribute__((format(printf, 5, 6)));
+
+/**
+ * @brief Pass log messages to the log handler from a dedicated thread. Callers
+ * only format messages into a ring, messages are dropped (and counted) if the
+ * ring is full.
+ *
+ * @param slots The number of messages the ring can hold
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_log_start_async(unsigned int slots);
+
+/**
+ * @brief Flush pending messages and stop the logging thread, no other thread
+ * must log meanwhile
+ */
+void vde_log_stop_async(void);
+
+#define vde_log_site(priority, fmt, ...) \
+  do { \
+    static vde_log_ratelimit vde_log_site_rl; \
+    if ((priority) <= VDE3_LOG_LEVEL && (priority) <= vde_log_level) { \
+      vde_log_ratelimited(&vde_log_site_rl, __FILE__, __LINE__, priority, \
+                          fmt, ##__VA_ARGS__); \
+    } \
+  } while (0)
+
+#define vde_error(fmt, ...) vde_log_site(VDE3_LOG_ERROR, fmt, ##__VA_ARGS__)
+#define vde_warning(fmt, ...) \
+  vde_log_site(VDE3_LOG_WARNING, fmt, ##__VA_ARGS__)
+#define vde_notice(fmt, ...) vde_log_site(VDE3_LOG_NOTICE, fmt, ##__VA_ARGS__)
+#define vde_info(fmt, ...) vde_log_site(VDE3_LOG_INFO, fmt, ##__VA_ARGS__)
+#define vde_debug(fmt, ...) vde_log_site(VDE3_LOG_DEBUG, fmt, ##__VA_ARGS__)
+
 #endif /* __VDE3_H__ */
@@ -62,6 +62,17 @@ typedef struct {
   vde_argument const * const args;
 } vde_command;
 
+/**
+ * @brief A function looking up a command by name in a static table of
+ * commands, as generated by gen_checker.py
+ *
+ * @param name The command name, not necessarily \0 terminated
+ * @param len The command name length
+ *
+ * @return The command, NULL if not found
+ */
+typedef vde_command *(*vde_command_lookup_func)(const char *name, size_t len);
+
 static inline const char *vde_command_get_name(vde_command *command)
 {
   vde_assert(command != NULL);
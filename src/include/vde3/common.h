@@ -29,24 +29,21 @@
 #include <assert.h>
 #endif
 
-#define vde_cached_alloc(s) g_malloc(s)
-#define vde_cached_calloc(s) g_slice_alloc0(s)
-#define vde_cached_free_type(t, d) g_free(d)
-/*
- * XXX(shammash):
- *  This cannot be easily remapped to a non-sliced allocator, so let's not use
- *  it until we're sure sliced-stuff will give us a good speedup.
-#define vde_cached_free_chunk(s, d) g_slice_free1(s, d)
- */
-
 /*
+ * NOTE: packets should be allocated from the context pool (see vde3/pool.h)
+ *
  * NOTE: g_malloc _aborts_ if the underlying malloc fails and
  * returns NULL only if s == 0
  */
 #define vde_alloc(s) g_malloc(s)
 #define vde_calloc(s) g_malloc0(s)
+#define vde_realloc(p, s) g_realloc(p, s)
 #define vde_free(s) g_free(s)
 
+#define vde_prefetch(addr) __builtin_prefetch(addr)
+
+#define VDE_CACHELINE_SIZE 64
+
 typedef GList vde_list;
 #define vde_list_first(list) g_list_first(list)
 #define vde_list_last(list) g_list_last(list)
@@ -57,10 +54,12 @@ typedef GList vde_list;
 #define vde_list_append(list, data) g_list_append(list, data)
 #define vde_list_prepend(list, data) g_list_prepend(list, data)
 #define vde_list_remove(list, data) g_list_remove(list, data)
+#define vde_list_find(list, data) g_list_find(list, data)
 #define vde_list_delete(list) g_list_free(list)
 
 typedef GHashTable vde_hash;
 #define vde_hash_init() g_hash_table_new(NULL, NULL)
+#define vde_hash_init_string() g_hash_table_new(g_str_hash, g_str_equal)
 #define vde_hash_insert(h, k, v) g_hash_table_insert(h, (gpointer)k, v)
 #define vde_hash_remove(h, k) g_hash_table_remove(h, (gconstpointer)k)
 #define vde_hash_lookup(h, k) g_hash_table_lookup(h, (gconstpointer)k)
@@ -85,6 +84,7 @@ typedef GQuark vde_quark;
 typedef gchar vde_char;
 #define vde_strdup(s) g_strdup(s)
 #define vde_strndup(s, n) g_strndup(s, n)
+#define vde_strdup_printf(...) g_strdup_printf(__VA_ARGS__)
 
 /*
  * Decorating assert instead of defining NDEBUG if we don't want assert because
@@ -65,7 +65,7 @@ void vde_component_fini(vde_component *component);
 void vde_component_delete(vde_component *component);
 
 /**
- * @brief Increase reference counter
+ * @brief Increase reference counter, can be called from any thread
  *
  * @param component The component
  * @param count The pointer where to store reference counter value (might be
@@ -74,7 +74,7 @@ void vde_component_delete(vde_component *component);
 void vde_component_get(vde_component *component, int *count);
 
 /**
- * @brief Decrease reference counter
+ * @brief Decrease reference counter, can be called from any thread
  *
  * @param component The component
  * @param count The pointer where to store reference counter value (might be
@@ -83,7 +83,8 @@ void vde_component_get(vde_component *component, int *count);
 void vde_component_put(vde_component *component, int *count);
 
 /**
- * @brief Decrease reference counter if there's only one reference
+ * @brief Decrease reference counter if there's only one reference, atomically
+ * with respect to vde_component_get() and vde_component_put()
  *
  * @param component The component
  * @param count The pointer where to store reference counter value (might be
@@ -146,6 +147,25 @@ vde_quark vde_component_get_qname(vde_component *component);
  */
 const char *vde_component_get_name(vde_component *component);
 
+/**
+ * @brief Return component family
+ *
+ * @param component The component
+ *
+ * @return The string with component family
+ */
+const char *vde_component_get_family(vde_component *component);
+
+/**
+ * @brief Return the parameters the component has been initialized with
+ *
+ * @param component The component
+ *
+ * @return The parameters, NULL if there were none. The component keeps its
+ * reference.
+ */
+vde_sobj *vde_component_get_params(vde_component *component);
+
 /**
  * @brief vde_component utility to register commands
  *
@@ -168,6 +188,24 @@ int vde_component_commands_register(vde_component *component,
 int vde_component_commands_deregister(vde_component *component,
                                       vde_command *commands);
 
+/**
+ * @brief vde_component utility to register a static table of commands along
+ * with its lookup function, as generated by gen_checker.py.
+ *
+ * Commands are registered as with vde_component_commands_register(), then
+ * vde_component_command_get() resolves them through lookup, without quark
+ * hashing. The lookup is dropped as soon as a command is removed.
+ *
+ * @param component The component to add commands to
+ * @param commands The NULL-terminated array of commands
+ * @param lookup The lookup function of commands
+ *
+ * @return zero on success, -1 on error
+ */
+int vde_component_commands_register_table(vde_component *component,
+                                          vde_command *commands,
+                                          vde_command_lookup_func lookup);
+
 /**
  * @brief vde_component utility to add a command
  *
@@ -310,6 +348,11 @@ int vde_component_signal_detach(vde_component *component, const char *signal,
 /**
  * @brief Raise a signal from this component
  *
+ * Callbacks are called by the raising thread, which must be the one running
+ * the component context: a callback interested in a component of another
+ * worker must hand the information over, e.g. with vde_context_worker_call().
+ * Attaching and detaching callbacks follows the same rule.
+ *
  * @param component The component to raise signal from
  * @param signal The signal name
  * @param info The information attached to the signal
@@ -317,4 +360,19 @@ int vde_component_signal_detach(vde_component *component, const char *signal,
 void vde_component_signal_raise(vde_component *component, const char *signal,
                                 vde_sobj *info);
 
+/**
+ * @brief Raise a signal from this component through its handle
+ *
+ * Same as vde_component_signal_raise() without the name lookup: components
+ * raising a signal often resolve its handle once with
+ * vde_component_signal_get() after registering it. The handle stays valid
+ * until the signal is removed.
+ *
+ * @param component The component to raise signal from
+ * @param signal The signal handle
+ * @param info The information attached to the signal
+ */
+void vde_component_signal_emit(vde_component *component, vde_signal *signal,
+                               vde_sobj *info);
+
 #endif /* __VDE3_COMPONENT_H__ */
@@ -23,4 +23,55 @@
 
 #include <vde3/component.h>
 
+/**
+ * @brief Check if an authorizer has been set on a connection manager
+ *
+ * @param cm The connection manager
+ *
+ * @return 1 if an authorizer has been set, 0 otherwise
+ */
+int vde_conn_manager_has_authorizer(vde_component *cm);
+
+/**
+ * @brief Check if a connection manager has been put in listen mode
+ *
+ * @param cm The connection manager
+ *
+ * @return 1 if vde_conn_manager_listen() succeeded on cm, 0 otherwise
+ */
+int vde_conn_manager_is_listening(vde_component *cm);
+
+/**
+ * @brief Get the number of connections initiated by a connection manager
+ *
+ * @param cm The connection manager
+ *
+ * @return The number of times vde_conn_manager_connect() succeeded on cm,
+ * less the connections reported with vde_conn_manager_connect_failed()
+ */
+unsigned int vde_conn_manager_get_connects(vde_component *cm);
+
+/**
+ * @brief Function called by connection manager implementation when a
+ * connection initiated by vde_conn_manager_connect() fails, before calling
+ * its error callback
+ *
+ * @param cm The connection manager
+ */
+void vde_conn_manager_connect_failed(vde_component *cm);
+
+/**
+ * @brief Function called by connection manager implementation to authorize a
+ * new connection, see vde_conn_manager_set_authorizer()
+ *
+ * @param cm The connection manager
+ * @param conn The new connection
+ * @param req The connection request, can be NULL
+ *
+ * @return zero if the connection is authorized or there is no authorizer, -1
+ * otherwise
+ */
+int vde_conn_manager_call_authorizer(vde_component *cm, vde_connection *conn,
+                                     vde_request *req);
+
 #endif /* __VDE3_CONN_MANAGER_H__ */
@@ -23,10 +23,13 @@
 
 #include <sys/time.h>
 #include <limits.h>
+#include <stdint.h>
 
 #include <vde3/attributes.h>
 #include <vde3/packet.h>
 #include <vde3/common.h>
+#include <vde3/qdisc.h>
+#include <vde3/trace.h>
 
 
 /**
@@ -40,6 +43,48 @@ typedef enum {
   CONN_WRITE_DELAY, //!< non-fatal error occurred during write
 } vde_conn_error;
 
+/**
+ * @brief The reason a packet has been dropped by a connection
+ */
+typedef enum {
+  VDE_CONN_DROP_QUEUE_FULL, //!< the send queue was full
+  VDE_CONN_DROP_NOMEM, //!< no memory to queue or receive the packet
+  VDE_CONN_DROP_TIMEOUT, //!< not sent within the send properties
+  VDE_CONN_DROP_WRITE_ERROR, //!< fatal error while sending
+  VDE_CONN_DROP_RX_ERROR, //!< invalid packet received
+  VDE_CONN_DROP_ENGINE, //!< received but discarded by the connection user
+  VDE_CONN_DROP_AQM, //!< dropped by the send queue discipline to cut delay
+  VDE_CONN_DROP_STORM, //!< received but over the storm control limits
+  VDE_CONN_DROP_MAX,
+} vde_conn_drop;
+
+/**
+ * @brief Connection statistics
+ *
+ * Counters are updated by the thread running the connection without any
+ * locking, in a connection they live on their own cache lines. Received packets are counted by
+ * vde_connection_call_read*(), sent packets by vde_connection_call_write() or
+ * by backends which don't report sent packets; drops, retries and the queue
+ * high-water mark are updated by backends and connection users.
+ *
+ * When sampling is enabled with vde_context_set_trace_sample() one packet
+ * every few read by a connection is timestamped, the latency histograms of the
+ * connections it is then written to measure the time passed since that read.
+ */
+typedef struct {
+  uint64_t rx_pkts;
+  uint64_t rx_bytes;
+  uint64_t tx_pkts;
+  uint64_t tx_bytes;
+  uint64_t retries; //!< send attempts which had to be repeated
+  uint64_t rx_lost; //!< packets lost on the way, for backends numbering them
+  uint64_t rx_reordered; //!< packets received after a later one
+  uint64_t drops[VDE_CONN_DROP_MAX];
+  unsigned int queue_hwm; //!< highest number of packets waiting to be sent
+  vde_trace_hist engine; //!< from the read to the write of a packet
+  vde_trace_hist sojourn; //!< from the read to the send of a packet
+} vde_conn_stats;
+
 /**
  * @brief A VDE 3 connection
  */
@@ -55,17 +100,12 @@ typedef struct vde_connection vde_connection;
  *
  * @param conn The connection to send the packet to
  * @param pkt The packet to send, if the backend doesn't send the packet
- * immediately it must reserve its own copy of the packet.
+ * immediately it must keep it with vde_pkt_share(): a reference is taken if the
+ * packet is reference counted, otherwise the packet is copied. The packet can
+ * be shared with other connections, the backend must not modify it.
  *
  * @return zero on success, an error code otherwise
  */
-/*
- * XXX(shammash): add a flag here to tell the connection backend if the packet
- * needs to be copied or the same memory area / pointer can be used? This can be
- * useful if, for instance, we have a send-queue in the engine and in the
- * connection: right now the engine would have its own copy of the packet which
- * needs to be copied again in the connection.
- */
 typedef int (*conn_be_write)(vde_connection *conn, vde_pkt *pkt);
 
 /**
@@ -89,7 +129,7 @@ typedef void (*conn_be_close)(vde_connection *conn);
 
 /**
  * @brief Callback called when a connection has a packet ready to serve, after
- * this callback returns the pkt will be free()d
+ * this callback returns the pkt will be released
  *
  * @param conn The connection with the packet ready
  * @param pkt The new packet
@@ -99,9 +139,24 @@ typedef void (*conn_be_close)(vde_connection *conn);
  */
 typedef int (*conn_read_cb)(vde_connection *conn, vde_pkt *pkt, void *arg);
 
+/**
+ * @brief (Optional) Callback called when a connection has a batch of packets
+ * ready to serve, after this callback returns the packets will be released.
+ * Each packet follows the same rules of conn_read_cb.
+ *
+ * @param conn The connection with the packets ready
+ * @param pkts The new packets
+ * @param count The number of packets in pkts
+ * @param arg The argument which has previously been set by connection user
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+typedef int (*conn_read_batch_cb)(vde_connection *conn, vde_pkt **pkts,
+                                  unsigned int count, void *arg);
+
 /**
  * @brief (Optional) Callback called when a packet has been sent by the
- * connection, after this callback returns the pkt will be free()d.
+ * connection, after this callback returns the pkt will be released.
  *
  * @param conn The connection which has sent the packet
  * @param pkt The sent packet
@@ -129,6 +184,18 @@ typedef int (*conn_write_cb)(vde_connection *conn, vde_pkt *pkt, void *arg);
 typedef int (*conn_error_cb)(vde_connection *conn, vde_pkt *pkt,
                              vde_conn_error err, void *arg);
 
+/**
+ * @brief (Optional) Callback called when the bytes queued by a connection
+ * cross its send watermarks: the connection becomes unwritable when they
+ * reach the high watermark and writable again when they fall to the low one.
+ * The callback must not close the connection.
+ *
+ * @param conn The connection
+ * @param writable 1 if the connection became writable, 0 otherwise
+ * @param arg The argument which has previously been set by connection user
+ */
+typedef void (*conn_flow_cb)(vde_connection *conn, int writable, void *arg);
+
 
 /**
  * @brief A vde connection.
@@ -141,13 +208,27 @@ struct vde_connection {
   unsigned int pkt_tail_sz;
   unsigned int send_maxtries;
   struct timeval send_maxtimeout;
+  unsigned int send_maxbytes; //!< send queue limit in bytes, 0 for none
+  unsigned int send_low_wm;
+  unsigned int send_high_wm; //!< 0 disables flow notifications
   conn_be_write be_write;
   conn_be_close be_close;
   void *be_priv;
   conn_read_cb read_cb;
+  conn_read_batch_cb read_batch_cb;
   conn_write_cb write_cb;
   conn_error_cb error_cb;
+  conn_flow_cb flow_cb;
   void *cb_priv;
+  uint64_t init_time; //!< monotonic ns, taken by vde_connection_init()
+  uint32_t handoff_id; //!< kept across a hot restart, 0 if not supported
+  vde_quark handoff_scope; //!< name of the transport the id is unique in
+  const unsigned int *trace_sample; //!< sampling rate of the context
+  // written for every packet, kept away from the fields above
+  vde_conn_stats stats __attribute__((aligned(VDE_CACHELINE_SIZE)));
+  unsigned int queued_bytes; //!< bytes in the backend send queue
+  int unwritable;
+  unsigned int trace_skipped; //!< packets read since the last sampled one
 };
 
 
@@ -203,16 +284,52 @@ static inline int vde_connection_write(vde_connection *conn, vde_pkt *pkt)
 {
   vde_assert(conn != NULL);
 
+  VDE_PROBE2(conn__write, conn, pkt);
+  if (pkt->ts != 0) {
+    vde_trace_hist_add(&conn->stats.engine, vde_qdisc_now() - pkt->ts);
+  }
   return conn->be_write(conn, pkt);
 }
 
+// stamp a packet about to be read if it is its turn, otherwise clear what a
+// previous reader left in it. Shared packets are immutable and keep the
+// timestamp they have.
+// XXX: a direct local connection accounts a packet as sent after its peer
+// read it, the sojourn sample is then relative to the peer's read
+static inline void vde_connection_trace_read(vde_connection *conn,
+                                             vde_pkt *pkt)
+{
+  unsigned int rate = __atomic_load_n(conn->trace_sample, __ATOMIC_RELAXED);
+
+  VDE_PROBE2(conn__read, conn, pkt);
+  if (vde_pkt_is_shared(pkt)) {
+    return;
+  }
+  pkt->ts = 0;
+  if (rate != 0 && ++conn->trace_skipped >= rate) {
+    conn->trace_skipped = 0;
+    pkt->ts = vde_qdisc_now();
+  }
+}
+
+// account the time since ingress of a sent packet
+static inline void vde_connection_trace_sent(vde_connection *conn,
+                                             vde_pkt *pkt)
+{
+  VDE_PROBE2(conn__sent, conn, pkt);
+  if (pkt->ts != 0) {
+    vde_trace_hist_add(&conn->stats.sojourn, vde_qdisc_now() - pkt->ts);
+  }
+}
+
 /**
  * @brief Function called by connection backend to tell the connection user a
  * new packet is available.
  *
  * @param conn The connection whom backend has a new packet available
- * @param pkt The new packet. Connection users will duplicate the pkt if they
- * need it after this callback will return, so it can be free()d afterwards
+ * @param pkt The new packet. Connection users will share the pkt with
+ * vde_pkt_share() if they need it after this callback will return, so it can
+ * be released afterwards
  *
  * @return zero on success, -1 on error (and errno is set appropriately)
  */
@@ -221,16 +338,69 @@ static inline int vde_connection_call_read(vde_connection *conn, vde_pkt *pkt)
   vde_assert(conn != NULL);
   vde_assert(conn->read_cb != NULL);
 
+  conn->stats.rx_pkts++;
+  conn->stats.rx_bytes += pkt->hdr->pkt_len;
+  vde_connection_trace_read(conn, pkt);
   return conn->read_cb(conn, pkt, conn->cb_priv);
 }
 
+/**
+ * @brief Function called by connection backend to tell the connection user a
+ * batch of packets is available. If the user didn't set a batch callback
+ * read_cb is called for every packet.
+ *
+ * @param conn The connection whom backend has new packets available
+ * @param pkts The new packets, same rules of vde_connection_call_read() apply
+ * @param count The number of packets in pkts
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately). When
+ * read_cb is called for every packet the first error is returned, EPIPE stops
+ * the delivery of remaining packets.
+ */
+static inline int vde_connection_call_read_batch(vde_connection *conn,
+                                                 vde_pkt **pkts,
+                                                 unsigned int count)
+{
+  unsigned int i;
+  int rv = 0, tmp_errno = 0;
+
+  vde_assert(conn != NULL);
+  vde_assert(conn->read_cb != NULL);
+
+  conn->stats.rx_pkts += count;
+  for (i = 0; i < count; i++) {
+    conn->stats.rx_bytes += pkts[i]->hdr->pkt_len;
+    vde_connection_trace_read(conn, pkts[i]);
+  }
+
+  if (conn->read_batch_cb != NULL) {
+    return conn->read_batch_cb(conn, pkts, count, conn->cb_priv);
+  }
+
+  for (i = 0; i < count; i++) {
+    if (conn->read_cb(conn, pkts[i], conn->cb_priv)) {
+      if (rv == 0 || errno == EPIPE) {
+        tmp_errno = errno;
+        rv = -1;
+      }
+      if (errno == EPIPE) {
+        break;
+      }
+    }
+  }
+
+  errno = tmp_errno;
+  return rv;
+}
+
 /**
  * @brief Function called by connection backend to tell the connection user a
  * packet has been successfully sent.
  *
  * @param conn The connection whom backend has a sent the packet
- * @param pkt The sent packet. Connection users will duplicate the pkt if they
- * need it after this callback will return, so it can be free()d afterwards
+ * @param pkt The sent packet. Connection users will share the pkt with
+ * vde_pkt_share() if they need it after this callback will return, so it can
+ * be released afterwards
  *
  * @return zero on success, -1 on error (and errno is set appropriately)
  */
@@ -238,6 +408,9 @@ static inline int vde_connection_call_write(vde_connection *conn, vde_pkt *pkt)
 {
   vde_assert(conn != NULL);
 
+  conn->stats.tx_pkts++;
+  conn->stats.tx_bytes += pkt->hdr->pkt_len;
+  vde_connection_trace_sent(conn, pkt);
   if (conn->write_cb != NULL) {
     return conn->write_cb(conn, pkt, conn->cb_priv);
   }
@@ -263,6 +436,233 @@ static inline int vde_connection_call_error(vde_connection *conn, vde_pkt *pkt,
   return conn->error_cb(conn, pkt, err, conn->cb_priv);
 }
 
+/**
+ * @brief Account a packet handed to the peer by a backend which doesn't call
+ * vde_connection_call_write()
+ *
+ * @param conn The connection which has sent the packet
+ * @param pkt The sent packet
+ */
+static inline void vde_connection_stats_tx(vde_connection *conn, vde_pkt *pkt)
+{
+  conn->stats.tx_pkts++;
+  conn->stats.tx_bytes += pkt->hdr->pkt_len;
+  vde_connection_trace_sent(conn, pkt);
+}
+
+/**
+ * @brief Account a packet sent by a backend after the packet has been copied
+ * to a send queue of the backend and released
+ *
+ * @param conn The connection which has sent the packet
+ * @param len The payload length of the packet
+ * @param ts The ingress time of the packet, 0 if not sampled
+ */
+static inline void vde_connection_stats_sent(vde_connection *conn,
+                                             unsigned int len, uint64_t ts)
+{
+  conn->stats.tx_pkts++;
+  conn->stats.tx_bytes += len;
+  VDE_PROBE2(conn__sent, conn, NULL);
+  if (ts != 0) {
+    vde_trace_hist_add(&conn->stats.sojourn, vde_qdisc_now() - ts);
+  }
+}
+
+/**
+ * @brief Account a dropped packet
+ *
+ * @param conn The connection which dropped the packet
+ * @param reason Why the packet has been dropped
+ */
+static inline void vde_connection_stats_drop(vde_connection *conn,
+                                             vde_conn_drop reason)
+{
+  conn->stats.drops[reason]++;
+}
+
+/**
+ * @brief Account a send attempt which has to be repeated
+ *
+ * @param conn The connection
+ */
+static inline void vde_connection_stats_retry(vde_connection *conn)
+{
+  conn->stats.retries++;
+}
+
+/**
+ * @brief Account packets the peer has sent but never arrived, as told by a
+ * gap in their sequence numbers
+ *
+ * @param conn The connection
+ * @param count The number of missing packets
+ */
+static inline void vde_connection_stats_lost(vde_connection *conn,
+                                             unsigned int count)
+{
+  conn->stats.rx_lost += count;
+}
+
+/**
+ * @brief Account a packet received after a later one, it was accounted as
+ * lost meanwhile
+ *
+ * @param conn The connection
+ */
+static inline void vde_connection_stats_reorder(vde_connection *conn)
+{
+  conn->stats.rx_reordered++;
+  if (conn->stats.rx_lost > 0) {
+    conn->stats.rx_lost--;
+  }
+}
+
+/**
+ * @brief Account the length of a backend send queue
+ *
+ * @param conn The connection
+ * @param len The number of packets waiting to be sent
+ */
+static inline void vde_connection_stats_queue(vde_connection *conn,
+                                              unsigned int len)
+{
+  if (len > conn->stats.queue_hwm) {
+    conn->stats.queue_hwm = len;
+  }
+}
+
+/**
+ * @brief Check if a packet would exceed the send queue limit of a connection,
+ * backends drop it as for a full queue
+ *
+ * @param conn The connection
+ * @param pkt The packet to be queued
+ *
+ * @return 1 if the packet doesn't fit in the queue, 0 otherwise
+ */
+static inline int vde_connection_queue_exceeded(vde_connection *conn,
+                                                vde_pkt *pkt)
+{
+  return conn->send_maxbytes != 0 &&
+         conn->queued_bytes + pkt->hdr->pkt_len > conn->send_maxbytes;
+}
+
+/**
+ * @brief Account a packet added to a backend send queue, the connection
+ * becomes unwritable when the high watermark is reached
+ *
+ * @param conn The connection
+ * @param pkt The queued packet
+ */
+static inline void vde_connection_queue_add(vde_connection *conn,
+                                            vde_pkt *pkt)
+{
+  conn->queued_bytes += pkt->hdr->pkt_len;
+  if (!conn->unwritable && conn->send_high_wm != 0 &&
+      conn->queued_bytes >= conn->send_high_wm) {
+    conn->unwritable = 1;
+    if (conn->flow_cb != NULL) {
+      conn->flow_cb(conn, 0, conn->cb_priv);
+    }
+  }
+}
+
+/**
+ * @brief Account a packet leaving a backend send queue, sent or dropped, the
+ * connection becomes writable again when the low watermark is reached
+ *
+ * @param conn The connection
+ * @param pkt The dequeued packet
+ */
+static inline void vde_connection_queue_del(vde_connection *conn,
+                                            vde_pkt *pkt)
+{
+  vde_assert(conn->queued_bytes >= pkt->hdr->pkt_len);
+
+  conn->queued_bytes -= pkt->hdr->pkt_len;
+  if (conn->unwritable && conn->queued_bytes <= conn->send_low_wm) {
+    conn->unwritable = 0;
+    if (conn->flow_cb != NULL) {
+      conn->flow_cb(conn, 1, conn->cb_priv);
+    }
+  }
+}
+
+/**
+ * @brief Reset the accounting of a backend send queue being flushed, e.g.
+ * on close. No flow notification is sent.
+ *
+ * @param conn The connection
+ */
+static inline void vde_connection_queue_clear(vde_connection *conn)
+{
+  conn->queued_bytes = 0;
+  conn->unwritable = 0;
+}
+
+/**
+ * @brief Check if a connection is writable, i.e. its send queue is below the
+ * high watermark. Engines can drop packets for an unwritable connection
+ * before writing them.
+ *
+ * @param conn The connection
+ *
+ * @return 1 if the connection is writable, 0 otherwise
+ */
+static inline int vde_connection_is_writable(vde_connection *conn)
+{
+  return !conn->unwritable;
+}
+
+/**
+ * @brief Get the number of bytes waiting in the send queue of a connection
+ *
+ * @param conn The connection
+ *
+ * @return The number of bytes, always 0 for backends without a send queue
+ */
+static inline unsigned int vde_connection_get_queued_bytes(
+                             vde_connection *conn)
+{
+  return conn->queued_bytes;
+}
+
+/**
+ * @brief Get connection statistics
+ *
+ * @param conn The connection
+ *
+ * @return The statistics, valid until the connection is deleted
+ */
+static inline const vde_conn_stats *vde_connection_get_stats(
+                                      vde_connection *conn)
+{
+  vde_assert(conn != NULL);
+
+  return &conn->stats;
+}
+
+/**
+ * @brief Add the counters of a connection to an aggregate, e.g. of all the
+ * connections of an engine. The high-water mark is the highest of the two.
+ *
+ * @param total The aggregate to update
+ * @param stats The statistics to add
+ */
+void vde_conn_stats_add(vde_conn_stats *total, const vde_conn_stats *stats);
+
+/**
+ * @brief Serialize connection statistics
+ *
+ * @param stats The statistics
+ *
+ * @return A new hash with a key for each counter, a "drops" hash keyed by
+ * reason and, if packets have been sampled, an "engine" and a "sojourn"
+ * latency histogram as serialized by vde_trace_hist_serialize(). NULL on error
+ */
+vde_sobj *vde_conn_stats_serialize(const vde_conn_stats *stats);
+
 /**
  * @brief Set user's callbacks in a connection
  *
@@ -271,6 +671,9 @@ static inline int vde_connection_call_error(vde_connection *conn, vde_pkt *pkt,
  * @param write_cb Function called when a packet has been sent (can be NULL)
  * @param error_cb Function called when an error occurs
  * @param cb_priv User's private data
+ *
+ * The batch read and the flow callbacks are reset, see
+ * vde_connection_set_read_batch_cb() and vde_connection_set_flow_cb().
  */
 void vde_connection_set_callbacks(vde_connection *conn,
                                   conn_read_cb read_cb,
@@ -278,6 +681,27 @@ void vde_connection_set_callbacks(vde_connection *conn,
                                   conn_error_cb error_cb,
                                   void *cb_priv);
 
+/**
+ * @brief Set user's batch read callback in a connection, it must be called
+ * after vde_connection_set_callbacks() and receives the same cb_priv.
+ *
+ * @param conn The connection to set the callback to
+ * @param read_batch_cb Function called when a batch of packets is available,
+ * NULL to receive packets one at a time through read_cb
+ */
+void vde_connection_set_read_batch_cb(vde_connection *conn,
+                                      conn_read_batch_cb read_batch_cb);
+
+/**
+ * @brief Set user's flow callback in a connection, it must be called after
+ * vde_connection_set_callbacks() and receives the same cb_priv.
+ *
+ * @param conn The connection to set the callback to
+ * @param flow_cb Function called when the connection becomes writable or
+ * unwritable, NULL to only poll vde_connection_is_writable()
+ */
+void vde_connection_set_flow_cb(vde_connection *conn, conn_flow_cb flow_cb);
+
 /**
  * @brief Get connection context
  *
@@ -301,6 +725,70 @@ static inline vde_context *vde_connection_get_context(vde_connection *conn)
  */
 unsigned int vde_connection_max_payload(vde_connection *conn);
 
+/**
+ * @brief Get the time a connection has been initialized by its backend,
+ * usually when the transport started setting it up
+ *
+ * @param conn The connection
+ *
+ * @return A monotonic timestamp in nanoseconds, as vde_qdisc_now()
+ */
+static inline uint64_t vde_connection_get_init_time(vde_connection *conn)
+{
+  vde_assert(conn != NULL);
+
+  return conn->init_time;
+}
+
+/**
+ * @brief Get the identifier of a connection which is kept when its transport
+ * hands it over to another process, so that engines can find their state
+ * again after a hot restart
+ *
+ * @param conn The connection
+ *
+ * @return The identifier, 0 if the transport does not hand connections over
+ */
+static inline uint32_t vde_connection_get_handoff_id(vde_connection *conn)
+{
+  vde_assert(conn != NULL);
+
+  return conn->handoff_id;
+}
+
+/**
+ * @brief Get the scope of the handoff identifier of a connection: the name of
+ * its transport, as identifiers of different transports can be equal
+ *
+ * @param conn The connection
+ *
+ * @return The transport name quark, 0 if the transport does not hand
+ * connections over
+ */
+static inline vde_quark vde_connection_get_handoff_scope(vde_connection *conn)
+{
+  vde_assert(conn != NULL);
+
+  return conn->handoff_scope;
+}
+
+/**
+ * @brief Called by the backend to set the handoff identifier, unique among the
+ * connections of its transport
+ *
+ * @param conn The connection
+ * @param scope The name quark of the transport
+ * @param id The identifier, not 0
+ */
+static inline void vde_connection_set_handoff_id(vde_connection *conn,
+                                                 vde_quark scope, uint32_t id)
+{
+  vde_assert(conn != NULL);
+
+  conn->handoff_scope = scope;
+  conn->handoff_id = id;
+}
+
 /**
  * @brief Get connection backend private data
  *
@@ -362,14 +850,33 @@ unsigned int vde_connection_get_pkt_tailsize(vde_connection *conn)
  * max_timeout x max_tries time; after that if the send is failed conn_error_cb
  * is called to inform a packet has been dropped.
  *
+ * Backends with a send queue drop packets which would take it beyond
+ * max_bytes, on top of their own limit on the number of packets.
+ *
  * @param conn The connection to set packet sending options to
  * @param max_tries The maximum number of attempts for sending a packet
  * @param max_timeout The maximum amount of time between two packet send
  * attempts
+ * @param max_bytes The maximum number of bytes queued, 0 for no limit
  */
 void vde_connection_set_send_properties(vde_connection *conn,
                                         unsigned int max_tries,
-                                        struct timeval *max_timeout);
+                                        struct timeval *max_timeout,
+                                        unsigned int max_bytes);
+
+/**
+ * @brief Set the send watermarks of a connection, in bytes queued by its
+ * backend. The connection becomes unwritable when the queue reaches high_wm
+ * and writable again when it falls to low_wm, the flow callback is called on
+ * both transitions. Connections without a send queue are always writable.
+ *
+ * @param conn The connection
+ * @param low_wm The low watermark, lower than high_wm
+ * @param high_wm The high watermark, 0 to keep the connection writable
+ */
+void vde_connection_set_send_watermarks(vde_connection *conn,
+                                        unsigned int low_wm,
+                                        unsigned int high_wm);
 
 /**
  * @brief Get the maximum number of tries a send should be performed
@@ -386,6 +893,21 @@ unsigned int vde_connection_get_send_maxtries(vde_connection *conn)
   return conn->send_maxtries;
 }
 
+/**
+ * @brief Get the maximum number of bytes in the send queue
+ *
+ * @param conn The connection to get the limit from
+ *
+ * @return The maximum number of bytes, 0 if there is no limit
+ */
+static inline
+unsigned int vde_connection_get_send_maxbytes(vde_connection *conn)
+{
+  vde_assert(conn != NULL);
+
+  return conn->send_maxbytes;
+}
+
 /**
  * @brief Get the maximum timeout between two send attempts
  *
@@ -422,20 +944,27 @@ vde_attributes *vde_connection_get_attributes(vde_connection *conn);
 /*
  * Memory management:
  * - a connection calls read_cb iff a packet is ready
- * - when write() is called the connection must be responsible for copying the
- * packet because because it will be free()ed right after write() returns
- * - a local connection duplicate the packet passed with write(), calls its
- * peer's read_cb and then free()s the duplicated packet
- *
- * DGRAM/STACK flow:
- * - connection: read on stack space
+ * - when write() is called the connection must be responsible for keeping the
+ * packet because it will be released right after write() returns: pooled
+ * packets are reference counted so vde_pkt_share() only takes a reference,
+ * other packets (e.g. on the stack) are copied
+ * - a packet with more than one reference is read-only
+ * - a local connection passes the packet given to write() straight to its
+ * peer's read_cb
+ *
+ * DGRAM/POOL flow:
+ * - connection: vde_pkt_new() from the context pool, read into it
  * - connection: call read_cb()
  * - engine/cm: does stuff considering that when read_cb() returns the packet
- * will be free()d. e.g.:
+ * will be released. e.g.:
+ * shared = share(pkt)
  * for each c in connections:
  * if c != incoming_connection:
- * c.write(pkt)
- * - connection: memcpy(pkt) -> add(packetq)
+ * c.write(shared)
+ * put(shared)
+ * - connection: share(pkt) (refcount++) -> add(packetq)
+ * - connection: put(pkt) after it has been sent, the last put gives the memory
+ * back to the pool
  *
  * STREAM/BUFFER, incoming flow:
  * n = 0;
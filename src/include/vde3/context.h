@@ -21,19 +21,74 @@
 #ifndef __VDE3_CONTEXT_H__
 #define __VDE3_CONTEXT_H__
 
+#include <pthread.h>
+
 #include <vde3/module.h>
+#include <vde3/pool.h>
 #include <vde3/vde_ordhash.h>
 
+struct vde_worker;
+
+/**
+ * @brief A local connection between two engines, kept to save it with the
+ * configuration
+ */
+typedef struct {
+  unsigned int id; //!< never 0, see vde_context_link_add()
+  vde_quark engine1;
+  vde_quark engine2;
+  unsigned int qlen; //!< 0 for unqueued connections
+} vde_context_link;
+
 /**
  * @brief A vde context
+ *
+ * Worker contexts (see vde_context_set_workers()) have a root, the context
+ * owning them: modules and components are kept only by the root.
  */
 struct vde_context {
   int initialized;
   vde_event_handler event_handler;
+  // event loop implementation, set only on contexts with workers and on
+  // workers themselves
+  vde_event_loop loop_ops;
+  // event loop entered before calling the event handler, NULL for the
+  // application default loop
+  void *loop;
   // hash table vde_quark component_name: vde_component *component
   vde_ordhash *components;
-  // list of vde_module*
+  // protects components, they can be looked up from workers, and links
+  pthread_mutex_t components_lock;
+  // list of vde_context_link*, local connections between engines, newest
+  // first
+  vde_list *links;
+  // id of the last link added
+  unsigned int last_link_id;
+  // list of vde_module*, modules listed in an index are stubs until first used
   vde_list *modules;
+  // protects loading stubs, modules are looked up from workers
+  pthread_mutex_t modules_lock;
+  // packet pool shared by connections running in this context, pools are not
+  // thread-safe and every worker has its own
+  vde_pool *pool;
+  // one packet in trace_sample read by connections of this context gets an
+  // ingress timestamp, 0 disables sampling
+  unsigned int trace_sample;
+  // the context owning this worker, NULL if this is not a worker
+  vde_context *root;
+  // workers owned by this context
+  vde_context **workers;
+  unsigned int nworkers;
+  int workers_running;
+  // thread running this context while workers are running
+  pthread_t thread;
+  // worker private state, NULL if this is not a worker
+  struct vde_worker *worker;
+  // engine state kept once a transport has handed its connections over in a
+  // hot restart, see vde_context_handoff_state()
+  vde_sobj *handoff_state;
+  // an engine state has been taken over, see vde_context_handoff_load()
+  int handoff_loaded;
   // configuration path
   // list of startup commands (from configuration)
 };
@@ -48,6 +103,118 @@ struct vde_context {
  */
 int vde_context_register_module(vde_context *ctx, vde_module *module);
 
+/**
+ * @brief Record a local connection between two engines, called once the
+ * connection has been established
+ *
+ * @param ctx The context the connection has been requested in
+ * @param engine1 The first engine
+ * @param engine2 The second engine
+ * @param qlen The queue length of the connection, 0 if unqueued
+ *
+ * @return The id of the link, to forget it with vde_context_link_del()
+ */
+unsigned int vde_context_link_add(vde_context *ctx, vde_component *engine1,
+                                  vde_component *engine2, unsigned int qlen);
+
+/**
+ * @brief Forget a local connection between two engines, called once the
+ * connection is closed
+ *
+ * Links are forgotten as well when one of their engines is deleted, an id no
+ * longer recorded is ignored.
+ *
+ * @param ctx A context of the connection
+ * @param id The id returned by vde_context_link_add(), 0 is ignored
+ */
+void vde_context_link_del(vde_context *ctx, unsigned int id);
+
+/**
+ * @brief Get the engine state to hand over to a restarting process
+ *
+ * Transports hand their connections over one after the other, and the ports
+ * of the connections already gone are missing from the engines: the state
+ * kept by vde_context_handoff_keep() is returned if there is one, otherwise
+ * it is saved now with vde_context_state_save().
+ *
+ * @param ctx The context
+ *
+ * @return The state, to be released with vde_sobj_put()
+ */
+vde_sobj *vde_context_handoff_state(vde_context *ctx);
+
+/**
+ * @brief Keep the state sent to a restarting process, called once a transport
+ * is about to let its connections go
+ *
+ * @param ctx The context
+ * @param state The state returned by vde_context_handoff_state()
+ */
+void vde_context_handoff_keep(vde_context *ctx, vde_sobj *state);
+
+/**
+ * @brief Load the engine state received from a process handing its
+ * connections over, once: every transport receives the same state and only
+ * the first one is loaded
+ *
+ * @param ctx The context
+ * @param states The state, see vde_context_state_load()
+ *
+ * @return zero on success or if a state has already been loaded, -1 on error
+ * (and errno is set appropriately)
+ */
+int vde_context_handoff_load(vde_context *ctx, vde_sobj *states);
+
+/**
+ * @brief Get the context owning modules and components of a context
+ *
+ * @param ctx The context
+ *
+ * @return The context owning ctx if it is a worker, ctx otherwise
+ */
+static inline vde_context *vde_context_get_root(vde_context *ctx)
+{
+  vde_assert(ctx != NULL);
+
+  return ctx->root != NULL ? ctx->root : ctx;
+}
+
+/**
+ * @brief Check if workers of a context, or the workers sharing the root of a
+ * worker context, are running
+ *
+ * @param ctx The context
+ *
+ * @return 1 if workers are running, 0 otherwise
+ */
+static inline int vde_context_workers_running(vde_context *ctx)
+{
+  return __atomic_load_n(&vde_context_get_root(ctx)->workers_running,
+                         __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Check if the calling thread is allowed to run a context, meant for
+ * assertions
+ *
+ * @param ctx The context
+ *
+ * @return 1 if workers are stopped or the calling thread is the one running
+ * ctx, 0 otherwise
+ */
+static inline int vde_context_is_current(vde_context *ctx)
+{
+  return !vde_context_workers_running(ctx) ||
+         pthread_equal(pthread_self(), ctx->thread);
+}
+
+static inline void vde_context_enter_loop(vde_context *ctx)
+{
+  if (ctx->loop_ops.loop_enter != NULL) {
+    ctx->loop_ops.loop_enter(ctx->loop);
+  }
+}
+
 static inline void *vde_context_event_add(vde_context *ctx, int fd,
                                           short events,
                                           const struct timeval *timeout,
@@ -56,6 +223,7 @@ static inline void *vde_context_event_add(vde_context *ctx, int fd,
   vde_assert(ctx != NULL);
   vde_assert(ctx->initialized == 1);
 
+  vde_context_enter_loop(ctx);
   return ctx->event_handler.event_add(fd, events, timeout, cb, arg);
 }
 
@@ -65,6 +233,7 @@ static inline void vde_context_event_del(vde_context *ctx, void *event)
   vde_assert(ctx->initialized == 1);
   vde_assert(event != NULL);
 
+  vde_context_enter_loop(ctx);
   ctx->event_handler.event_del(event);
 }
 
@@ -75,6 +244,7 @@ static inline void *vde_context_timeout_add(vde_context *ctx, short events,
   vde_assert(ctx != NULL);
   vde_assert(ctx->initialized == 1);
 
+  vde_context_enter_loop(ctx);
   return ctx->event_handler.timeout_add(timeout, events, cb, arg);
 }
 
@@ -84,7 +254,23 @@ static inline void vde_context_timeout_del(vde_context *ctx, void *timeout)
   vde_assert(ctx->initialized == 1);
   vde_assert(timeout != NULL);
 
+  vde_context_enter_loop(ctx);
   ctx->event_handler.timeout_del(timeout);
 }
 
+/**
+ * @brief Get the packet pool of a context
+ *
+ * @param ctx The context
+ *
+ * @return The packet pool
+ */
+static inline vde_pool *vde_context_get_pool(vde_context *ctx)
+{
+  vde_assert(ctx != NULL);
+  vde_assert(ctx->initialized == 1);
+
+  return ctx->pool;
+}
+
 #endif /* __VDE3_CONTEXT_H__ */
@@ -37,10 +37,21 @@
  * There are two kinds of local connection: queued and unqueued.
  *
  * Queued connections behave exactly like non-local connection: when an
- * engine delivers the packet a packet copy is performed and an event is
- * registered to deliver the copy to the other engine. After the read callback
- * on the second engine has returned with success a write callback on the first
- * one is called.
+ * engine delivers the packet a reference to it (or a copy, see vde_pkt_share())
+ * is stored in a bounded ring and an event is registered to deliver queued
+ * packets in batches to the other engine. After the read callback on the
+ * second engine has returned with success a write callback on the first one is
+ * called. When the ring is full the packet is dropped, the error callback of
+ * the writer is called with CONN_WRITE_DELAY and the write fails with EAGAIN.
+ * Packets never cross the two engines on the same stack, thus chains (or
+ * loops) of engines don't recurse.
+ *
+ * Engines run by different workers (see vde_context_set_workers()) can be
+ * connected only with queued connections. Each direction has a lock-free ring
+ * shared by the two worker threads: the writer copies the packet into the ring
+ * and the reader thread is woken up to deliver it, so no packet memory is
+ * shared across pools. The reader sees packets which are not reference
+ * counted and the write callback of the writer is not called.
  *
  * Non queued connections deliver the packet to the second engine as soon as a
  * write is called, so they don't create a copy of the packet and neither they
@@ -64,5 +75,23 @@ int vde_connect_engines_unqueued(vde_context *ctx, vde_component *engine1,
                                  vde_request *req1, vde_component *engine2,
                                  vde_request *req2);
 
+/**
+ * @brief Connect two engines together using a queued local connection.
+ *
+ * @param ctx The context of the two engines, each engine's own context is used
+ * if they run in different workers, which must be stopped.
+ * @param engine1 The first engine to connect
+ * @param req1 The request for the first engine
+ * @param engine2 The second engine to connect
+ * @param req2 The request for the second engine
+ * @param qlen The maximum number of packets queued in each direction, rounded
+ * up to a power of two. 0 selects the default length.
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_connect_engines_queued(vde_context *ctx, vde_component *engine1,
+                               vde_request *req1, vde_component *engine2,
+                               vde_request *req2, unsigned int qlen);
+
 #endif /* __VDE3_LOCALCONNECTION_H__ */
 
@@ -35,6 +35,11 @@
 #define VDE_MODULE_START_S "vde_module_start"
 #endif
 
+/**
+ * @brief Name of the index listing the modules of a directory
+ */
+#define VDE_MODULES_INDEX "modules.index"
+
 /**
  * @brief Function called on a connection manager to set it in listen mode.
  * Connection managers must implement it.
@@ -137,6 +142,7 @@ typedef struct {
   tr_connect tr_connect;
   tr_listen tr_listen;
   void *dlhandle;
+  char *path; //!< file to load the module from, set only on stubs
 } vde_module;
 
 static inline vde_component_kind vde_module_get_kind(vde_module *module)
@@ -179,9 +185,83 @@ static inline tr_listen vde_module_get_tr_listen(vde_module *module)
   return module->tr_listen;
 }
 
+/**
+ * @brief Get the name of a component kind, as used in modules indexes and
+ * configurations
+ *
+ * @param kind The component kind
+ *
+ * @return The kind name
+ */
+const char *vde_module_kind_to_string(vde_component_kind kind);
+
+/**
+ * @brief Get a component kind from its name
+ *
+ * @param name The kind name
+ * @param kind Where to store the kind
+ *
+ * @return 0 on success, -1 if name is not a kind (and errno set to EINVAL)
+ */
+int vde_module_kind_from_string(const char *name, vde_component_kind *kind);
+
+/**
+ * @brief Check a module implements the ops required by its kind
+ *
+ * @param module The module to check
+ *
+ * @return 0 if the module is valid, -1 otherwise (and errno set to EINVAL)
+ */
+int vde_module_check(vde_module *module);
+
+/**
+ * @brief Create a stub for a module which has not been loaded yet
+ *
+ * A stub has only kind and family set, vde_module_resolve() loads the module
+ * from path and fills in its ops.
+ *
+ * @param kind The module kind
+ * @param family The module family
+ * @param path The file to load the module from
+ *
+ * @return the new stub
+ */
+vde_module *vde_module_stub_new(vde_component_kind kind, const char *family,
+                                const char *path);
+
+/**
+ * @brief Delete a stub, its module (if loaded) stays in memory
+ *
+ * @param stub The stub to delete
+ */
+void vde_module_stub_delete(vde_module *stub);
+
+static inline int vde_module_is_stub(vde_module *module)
+{
+  return module->path != NULL;
+}
+
+static inline int vde_module_is_loaded(vde_module *module)
+{
+  return module->dlhandle != NULL;
+}
+
+/**
+ * @brief Load the module of a stub, does nothing if already loaded
+ *
+ * @param stub The stub
+ *
+ * @return 0 on success, -1 on error (and errno set appropriately)
+ */
+int vde_module_resolve(vde_module *stub);
+
 /**
  * @brief Load vde modules found in path
  *
+ * Directories with a VDE_MODULES_INDEX only get a stub registered for every
+ * module listed there, modules are loaded on first use. Other directories are
+ * scanned and all their modules are loaded.
+ *
  * @param ctx The context to load modules into
  * @param path The search path of modules, if NULL use default path
  *
@@ -190,4 +270,17 @@ static inline tr_listen vde_module_get_tr_listen(vde_module *module)
  */
 int vde_modules_load(vde_context *ctx, char **path);
 
+/**
+ * @brief Write the VDE_MODULES_INDEX of a directory
+ *
+ * Every module in dir is loaded once to read its kind and family, the index
+ * is replaced atomically. Shared objects not exporting VDE_MODULE_START_S,
+ * such as libvde in the build directory, are not listed.
+ *
+ * @param dir The modules directory
+ *
+ * @return 0 on success, -1 on error (and errno set appropriately)
+ */
+int vde_modules_write_index(const char *dir);
+
 #endif /* __VDE3_MODULE_H__ */
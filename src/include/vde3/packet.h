@@ -24,14 +24,23 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <vde3.h>
+
 #include <vde3/common.h>
+#include <vde3/pool.h>
 
 // A packet exchanged by vde engines
 // (it should be used more or less like Linux socket buffers).
 //
-// - allocated/freed by the same connection (probably using cached memory)
-// - copied mostly by connections, but also by engines if they need to cache it
-//   or to mangle it in particular ways
+// - allocated from the context packet pool
+// - packets allocated from the pool are reference counted: a connection or an
+//   engine which needs the packet after a callback/write returns takes a
+//   reference with vde_pkt_get() instead of copying it, the last
+//   vde_pkt_put() gives the memory back to the pool
+// - packets living elsewhere (e.g. on the stack) have a zero refcount and must
+//   be copied, vde_pkt_share() does the right thing in both cases
+// - a packet with more than one reference is shared and must be considered
+//   immutable, an engine which wants to mangle it must work on a copy
 
 /**
  * @brief A vde packet header.
@@ -53,29 +62,77 @@ typedef struct {
   char *payload; //!< Pointer to payload inside data
   char *tail; //!< Pointer to an empty tail space inside data
   unsigned int data_size; //!< The total size of memory allocated in data
+  unsigned int refcount; //!< References to a pooled packet, 0 if not pooled
+  uint64_t ts; //!< Ingress time in ns of a sampled packet, 0 if not sampled
   char data[0]; //!< Allocated memory
 } vde_pkt;
 
 /**
- * @brief Initialize vde packet fields.
+ * @brief Set pointers of a vde packet according to the given sizes, refcount
+ * is left untouched and the ingress timestamp cleared.
  *
- * @param pkt The packet to initialize
+ * @param pkt The packet to lay out
  * @param data The size of preallocated memory
  * @param head The size of the space before payload
  * @param tail The size of the space after payload
  */
-static inline void vde_pkt_init(vde_pkt *pkt, unsigned int data,
-                                unsigned int head, unsigned int tail) {
+static inline void vde_pkt_layout(vde_pkt *pkt, unsigned int data,
+                                  unsigned int head, unsigned int tail) {
   pkt->hdr = (vde_hdr *)pkt->data;
   pkt->head = pkt->data + sizeof(vde_hdr);
   pkt->payload = pkt->head + head;
   pkt->tail = pkt->data + data - tail;
   pkt->data_size = data;
+  pkt->ts = 0;
+}
+
+/**
+ * @brief Initialize vde packet fields. The packet is considered not
+ * reference counted (e.g. on the stack).
+ *
+ * @param pkt The packet to initialize
+ * @param data The size of preallocated memory
+ * @param head The size of the space before payload
+ * @param tail The size of the space after payload
+ */
+static inline void vde_pkt_init(vde_pkt *pkt, unsigned int data,
+                                unsigned int head, unsigned int tail) {
+  vde_pkt_layout(pkt, data, head, tail);
+  pkt->refcount = 0;
+}
+
+/**
+ * @brief Initialize a packet viewing memory owned by someone else, e.g. a
+ * ring shared with the kernel. The packet is not reference counted, readers
+ * wishing to keep it get a copy from vde_pkt_share().
+ *
+ * @param pkt The packet to initialize, its data member is not used
+ * @param hdr The vde header
+ * @param head The start of the head space, followed by payload and tail space
+ * @param head_sz The size of the space before payload
+ * @param len The payload length
+ * @param tail_sz The size of the space after payload
+ */
+static inline void vde_pkt_init_view(vde_pkt *pkt, vde_hdr *hdr, char *head,
+                                     unsigned int head_sz, unsigned int len,
+                                     unsigned int tail_sz) {
+  pkt->hdr = hdr;
+  pkt->head = head;
+  pkt->payload = head + head_sz;
+  pkt->tail = pkt->payload + len;
+  pkt->data_size = sizeof(vde_hdr) + head_sz + len + tail_sz;
+  pkt->refcount = 0;
+  pkt->ts = 0;
+  memset(hdr, 0, sizeof(vde_hdr));
+  hdr->pkt_len = len;
 }
 
 /**
- * @brief Allocate and initialize a new vde_pkt
+ * @brief Allocate and initialize a new vde_pkt from the context packet pool.
+ * Packet data is not zeroed, only the vde header is. The packet is returned
+ * with one reference held by the caller.
  *
+ * @param ctx The context whose pool is used
  * @param payload_sz The size of the payload
  * @param head The size of the space before payload
  * @param tail The size of the space after payload
@@ -83,22 +140,94 @@ static inline void vde_pkt_init(vde_pkt *pkt, unsigned int data,
  * @return The new packet on success, NULL on error (and errno is set
  * appropriately)
  */
-static inline vde_pkt *vde_pkt_new(unsigned int payload_sz, unsigned int head,
-                                   unsigned int tail)
+vde_pkt *vde_pkt_new(vde_context *ctx, unsigned int payload_sz,
+                     unsigned int head, unsigned int tail);
+
+/**
+ * @brief Duplicate a packet into a new pooled packet, keeping head/tail space
+ * sizes. Header, payload and the ingress timestamp are copied.
+ *
+ * @param ctx The context whose pool is used
+ * @param pkt The packet to duplicate
+ *
+ * @return The new packet with one reference, NULL on error (and errno is set
+ * appropriately)
+ */
+vde_pkt *vde_pkt_dup(vde_context *ctx, vde_pkt *pkt);
+
+/**
+ * @brief Check if a reference can be taken on a packet
+ *
+ * @param pkt The packet
+ *
+ * @return Nonzero if the packet is reference counted
+ */
+static inline int vde_pkt_is_refcounted(vde_pkt *pkt)
 {
-  unsigned int data_sz = sizeof(vde_hdr) + head + payload_sz + tail;
-  unsigned int pkt_sz = sizeof(vde_pkt) + data_sz;
-  // XXX consider using cached allocator
-  vde_pkt *pkt = (vde_pkt *)vde_calloc(pkt_sz);
-
-  if (pkt == NULL) {
-    errno = ENOMEM;
-    return NULL;
-  }
-  vde_pkt_init(pkt, data_sz, head, tail);
+  return pkt->refcount != 0;
+}
+
+/**
+ * @brief Check if a packet is shared, thus immutable
+ *
+ * @param pkt The packet
+ *
+ * @return Nonzero if more than one reference is held on the packet
+ */
+static inline int vde_pkt_is_shared(vde_pkt *pkt)
+{
+  return pkt->refcount > 1;
+}
+
+/**
+ * @brief Take a reference on a pooled packet
+ *
+ * @param pkt The packet, must be reference counted
+ *
+ * @return The packet
+ */
+static inline vde_pkt *vde_pkt_get(vde_pkt *pkt)
+{
+  vde_assert(vde_pkt_is_refcounted(pkt));
+
+  pkt->refcount++;
   return pkt;
 }
 
+/**
+ * @brief Release a reference on a pooled packet, the packet goes back to its
+ * pool when the last reference is released.
+ *
+ * @param pkt The packet, must be reference counted
+ */
+static inline void vde_pkt_put(vde_pkt *pkt)
+{
+  vde_assert(vde_pkt_is_refcounted(pkt));
+
+  if (--pkt->refcount == 0) {
+    vde_pool_free(pkt);
+  }
+}
+
+/**
+ * @brief Get a packet that can be kept after the current callback returns:
+ * if the packet is reference counted a new reference is taken, otherwise it is
+ * duplicated.
+ *
+ * @param ctx The context whose pool is used for duplication
+ * @param pkt The packet to share
+ *
+ * @return A packet the caller holds one reference on, it must be released with
+ * vde_pkt_put(). NULL on error (and errno is set appropriately)
+ */
+static inline vde_pkt *vde_pkt_share(vde_context *ctx, vde_pkt *pkt)
+{
+  if (vde_pkt_is_refcounted(pkt)) {
+    return vde_pkt_get(pkt);
+  }
+  return vde_pkt_dup(ctx, pkt);
+}
+
 /**
  * @brief Copy the content of a packet into another pre-allocated packet
  *
@@ -107,10 +236,11 @@ static inline vde_pkt *vde_pkt_new(unsigned int payload_sz, unsigned int head,
  * @param src The source of the copy
  */
 static inline void vde_pkt_cpy(vde_pkt *dst, vde_pkt *src) {
-  vde_pkt_init(dst, src->data_size,
+  vde_pkt_layout(dst, src->data_size,
                src->payload - src->head,
                src->data + src->data_size - src->tail);
   memcpy(&dst->data, &src->data, src->data_size);
+  dst->ts = src->ts;
 }
 
 /**
@@ -122,9 +252,10 @@ static inline void vde_pkt_cpy(vde_pkt *dst, vde_pkt *src) {
  * @param src The source of the copy
  */
 static inline void vde_pkt_compact_cpy(vde_pkt *dst, vde_pkt *src) {
-  vde_pkt_init(dst, src->data_size, 0, 0);
+  vde_pkt_layout(dst, src->data_size, 0, 0);
   memcpy(dst->hdr, src->hdr, sizeof(vde_hdr));
   memcpy(dst->payload, src->payload, src->hdr->pkt_len);
+  dst->ts = src->ts;
 }
 
 // When a packet is read from the network by a connection the payload always
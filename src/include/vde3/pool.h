@@ -0,0 +1,146 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file
+ */
+
+#ifndef __VDE3_POOL_H__
+#define __VDE3_POOL_H__
+
+#include <stddef.h>
+
+#include <vde3/common.h>
+
+/**
+ * @brief VDE 3 memory pool
+ *
+ * A pool of fixed-size memory chunks grouped in size classes. Each class keeps
+ * a free list of previously released chunks so that the packet path doesn't
+ * hit the system allocator once the pool is warm. Memory returned by the pool
+ * is NOT zeroed.
+ *
+ * Every class has two watermarks:
+ * - low: number of chunks preallocated when the watermarks are set and kept
+ *   cached by vde_pool_trim()
+ * - high: maximum number of free chunks cached, chunks freed beyond this
+ *   limit are given back to the system
+ *
+ * Requests larger than the biggest class are served by the system allocator
+ * and accounted separately.
+ */
+typedef struct vde_pool vde_pool;
+
+/**
+ * @brief The chunk size of the biggest class, e.g. to bound the size of
+ * packets kept out of the system allocator
+ */
+#define VDE_POOL_MAX_CHUNK 16384
+
+/**
+ * @brief Counters of a pool size class
+ */
+typedef struct {
+  unsigned long allocs; //!< Number of chunks handed out
+  unsigned long frees; //!< Number of chunks given back
+  unsigned long hits; //!< Allocations served from the free list
+  unsigned long misses; //!< Allocations served by the system allocator
+  unsigned long releases; //!< Chunks released to the system (above high wm)
+  unsigned long in_use; //!< Chunks currently in use
+  unsigned long peak_in_use; //!< Maximum value reached by in_use
+  unsigned long cached; //!< Chunks currently in the free list
+} vde_pool_stats;
+
+/**
+ * @brief Alloc a new pool with default size classes and watermarks
+ *
+ * @return a pool on success, NULL on error (and errno is set appropriately)
+ */
+vde_pool *vde_pool_new();
+
+/**
+ * @brief Deallocate a pool and all its cached chunks. Chunks still in use
+ * must not be freed after this call.
+ *
+ * @param pool The pool to delete
+ */
+void vde_pool_delete(vde_pool *pool);
+
+/**
+ * @brief Get a chunk of memory from the pool
+ *
+ * @param pool The pool to allocate from
+ * @param size The requested size
+ *
+ * @return The chunk on success, NULL on error (and errno is set
+ * appropriately)
+ */
+void *vde_pool_alloc(vde_pool *pool, size_t size);
+
+/**
+ * @brief Give a chunk back to the pool it was allocated from
+ *
+ * @param ptr The chunk, as returned by vde_pool_alloc()
+ */
+void vde_pool_free(void *ptr);
+
+/**
+ * @brief Set watermarks of the size class serving a given size, the free list
+ * is filled up to the low watermark.
+ *
+ * @param pool The pool
+ * @param size The size to select the class with
+ * @param low The low watermark
+ * @param high The high watermark, must not be lower than low
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_pool_set_watermarks(vde_pool *pool, size_t size, unsigned int low,
+                            unsigned int high);
+
+/**
+ * @brief Release cached chunks down to the low watermark of each class
+ *
+ * @param pool The pool to trim
+ */
+void vde_pool_trim(vde_pool *pool);
+
+/**
+ * @brief Get the number of size classes of a pool
+ *
+ * @param pool The pool
+ *
+ * @return The number of classes, the class serving oversized requests is not
+ * counted
+ */
+unsigned int vde_pool_num_classes(vde_pool *pool);
+
+/**
+ * @brief Get counters of a pool class
+ *
+ * @param pool The pool
+ * @param idx The class index, vde_pool_num_classes() selects the class of
+ * oversized requests
+ * @param size If not NULL it will contain the chunk size served by the class
+ * (zero for oversized requests)
+ * @param stats The structure to fill with counters
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_pool_get_stats(vde_pool *pool, unsigned int idx, size_t *size,
+                       vde_pool_stats *stats);
+
+#endif /* __VDE3_POOL_H__ */
@@ -0,0 +1,257 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file
+ */
+
+#ifndef __VDE3_QDISC_H__
+#define __VDE3_QDISC_H__
+
+#include <stdint.h>
+
+#include <vde3.h>
+
+#include <vde3/packet.h>
+
+/**
+ * @brief An entry of a queue discipline.
+ *
+ * Entries are intrusive: transports embed them as the first member of their
+ * own queue entries, the queue discipline only links them and never allocates
+ * or frees them.
+ */
+typedef struct vde_qentry vde_qentry;
+
+struct vde_qentry {
+  vde_qentry *next;
+  vde_pkt *pkt;
+  uint64_t enqueue_ns; //!< set by vde_qdisc_enqueue()
+};
+
+/**
+ * @brief A queue discipline, it decides the order in which queued packets are
+ * sent and which ones are dropped to keep the queueing delay low.
+ */
+typedef struct vde_qdisc vde_qdisc;
+
+/**
+ * @brief Callback called for each entry dropped by a queue discipline, the
+ * entry is not referenced by the queue anymore and can be freed.
+ */
+typedef void (*vde_qdisc_drop_cb)(vde_qentry *entry, void *arg);
+
+/**
+ * @brief Operations of a queue discipline.
+ *
+ * Entries requeued by vde_qdisc_requeue() and the queue length are handled by
+ * the generic layer, disciplines only see new entries.
+ */
+typedef struct {
+  const char *name;
+  /**
+   * @brief Allocate the private data of a queue discipline
+   */
+  int (*init)(vde_qdisc *qdisc);
+  /**
+   * @brief Release the private data, the queue is empty
+   */
+  void (*fini)(vde_qdisc *qdisc);
+  void (*enqueue)(vde_qdisc *qdisc, vde_qentry *entry);
+  /**
+   * @brief Get the next entry to send, entries dropped meanwhile must be
+   * given to vde_qdisc_drop()
+   */
+  vde_qentry *(*dequeue)(vde_qdisc *qdisc, uint64_t now);
+  /**
+   * @brief Unlink every entry, returned as a list chained by next
+   */
+  vde_qentry *(*purge)(vde_qdisc *qdisc);
+} vde_qdisc_ops;
+
+/**
+ * @brief Configuration of a queue discipline
+ */
+typedef struct {
+  const vde_qdisc_ops *ops;
+  uint64_t target_ns; //!< acceptable standing queue delay (codel, fq)
+  uint64_t interval_ns; //!< window to measure the minimum delay (codel, fq)
+  unsigned int flows; //!< number of flow buckets, a power of two (fq)
+  unsigned int quantum; //!< bytes sent by a flow on each round (fq)
+} vde_qdisc_conf;
+
+struct vde_qdisc {
+  const vde_qdisc_ops *ops;
+  vde_qdisc_conf conf;
+  vde_qentry *requeued; //!< entries put back by the sender, sent first
+  unsigned int length; //!< entries in the queue, requeued ones included
+  unsigned int bytes; //!< payload bytes in the queue
+  uint64_t drops; //!< entries dropped by the discipline
+  vde_qdisc_drop_cb drop_cb;
+  void *drop_arg;
+  void *priv;
+};
+
+/**
+ * @brief Lookup the operations of a queue discipline: "fifo", "codel" (RFC
+ * 8289) or "fq", a fair queue of codel flows hashed by source and destination
+ * MAC address.
+ *
+ * @param name The name of the queue discipline
+ *
+ * @return The operations, NULL if not found
+ */
+const vde_qdisc_ops *vde_qdisc_ops_lookup(const char *name);
+
+/**
+ * @brief Fill a configuration from its serialized form: either the name of a
+ * queue discipline or a hash with a "type" name and the optional
+ * "target_ms", "interval_ms", "flows" and "quantum" parameters. Missing
+ * parameters get the defaults: 5ms target, 100ms interval, 1024 flows and a
+ * 1514 bytes quantum.
+ *
+ * @param params The serialized configuration, NULL for the default "fifo"
+ * @param conf The configuration to fill
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_qdisc_conf_parse(vde_sobj *params, vde_qdisc_conf *conf);
+
+/**
+ * @brief Alloc a new queue discipline
+ *
+ * @param conf The configuration
+ * @param drop_cb The callback called for dropped entries
+ * @param drop_arg The callback argument
+ *
+ * @return a queue discipline on success, NULL on error (and errno is set
+ * appropriately)
+ */
+vde_qdisc *vde_qdisc_new(const vde_qdisc_conf *conf,
+                         vde_qdisc_drop_cb drop_cb, void *drop_arg);
+
+/**
+ * @brief Deallocate a queue discipline, every queued entry is given to
+ * free_cb first
+ *
+ * @param qdisc The queue discipline
+ * @param free_cb The callback releasing entries
+ * @param arg The callback argument
+ */
+void vde_qdisc_delete(vde_qdisc *qdisc, vde_qdisc_drop_cb free_cb, void *arg);
+
+/**
+ * @brief Get a monotonic timestamp in nanoseconds to be passed to
+ * vde_qdisc_enqueue() and vde_qdisc_dequeue()
+ */
+uint64_t vde_qdisc_now(void);
+
+/**
+ * @brief Queue an entry, its pkt member must be set
+ *
+ * @param qdisc The queue discipline
+ * @param entry The entry
+ * @param now The current time
+ */
+static inline void vde_qdisc_enqueue(vde_qdisc *qdisc, vde_qentry *entry,
+                                     uint64_t now)
+{
+  entry->enqueue_ns = now;
+  qdisc->length++;
+  qdisc->bytes += entry->pkt->hdr->pkt_len;
+  qdisc->ops->enqueue(qdisc, entry);
+}
+
+/**
+ * @brief Get the next entry to send, it might drop other entries.
+ *
+ * @param qdisc The queue discipline
+ * @param now The current time
+ *
+ * @return The entry, NULL if the queue is empty
+ */
+static inline vde_qentry *vde_qdisc_dequeue(vde_qdisc *qdisc, uint64_t now)
+{
+  vde_qentry *entry = qdisc->requeued;
+
+  if (entry != NULL) {
+    qdisc->requeued = entry->next;
+  } else {
+    entry = qdisc->ops->dequeue(qdisc, now);
+    if (entry == NULL) {
+      return NULL;
+    }
+  }
+  qdisc->length--;
+  qdisc->bytes -= entry->pkt->hdr->pkt_len;
+  return entry;
+}
+
+/**
+ * @brief Put back an entry which could not be sent, it will be returned by
+ * the next vde_qdisc_dequeue() without being checked again by the
+ * discipline. Entries requeued together must be requeued last first.
+ *
+ * @param qdisc The queue discipline
+ * @param entry The entry
+ */
+static inline void vde_qdisc_requeue(vde_qdisc *qdisc, vde_qentry *entry)
+{
+  entry->next = qdisc->requeued;
+  qdisc->requeued = entry;
+  qdisc->length++;
+  qdisc->bytes += entry->pkt->hdr->pkt_len;
+}
+
+/**
+ * @brief Drop an entry unlinked by a discipline dequeue operation
+ *
+ * @param qdisc The queue discipline
+ * @param entry The entry
+ */
+static inline void vde_qdisc_drop(vde_qdisc *qdisc, vde_qentry *entry)
+{
+  qdisc->length--;
+  qdisc->bytes -= entry->pkt->hdr->pkt_len;
+  qdisc->drops++;
+  qdisc->drop_cb(entry, qdisc->drop_arg);
+}
+
+/**
+ * @brief Get the number of queued entries
+ *
+ * @param qdisc The queue discipline
+ *
+ * @return The number of entries
+ */
+static inline unsigned int vde_qdisc_get_length(vde_qdisc *qdisc)
+{
+  return qdisc->length;
+}
+
+/**
+ * @brief Get the name of a queue discipline
+ *
+ * @param qdisc The queue discipline
+ *
+ * @return The name
+ */
+static inline const char *vde_qdisc_get_name(vde_qdisc *qdisc)
+{
+  return qdisc->ops->name;
+}
+
+#endif /* __VDE3_QDISC_H__ */
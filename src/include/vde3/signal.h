@@ -128,6 +128,19 @@ void vde_signal_fini(vde_signal *signal, vde_component *component);
  */
 void vde_signal_delete(vde_signal *signal);
 
+/**
+ * @brief Check if a signal has callbacks attached, raisers can skip building
+ * the signal information when it has none
+ *
+ * @param signal The signal
+ *
+ * @return 1 if at least a callback is attached, 0 otherwise
+ */
+static inline int vde_signal_has_callbacks(vde_signal *signal)
+{
+  return signal->callbacks != NULL;
+}
+
 static inline const char *vde_signal_get_name(vde_signal *signal)
 {
   if (!signal) {
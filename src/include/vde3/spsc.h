@@ -0,0 +1,277 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file
+ */
+
+#ifndef __VDE3_SPSC_H__
+#define __VDE3_SPSC_H__
+
+#include <stddef.h>
+
+#include <vde3/common.h>
+
+/**
+ * @brief Lock-free single producer single consumer ring
+ *
+ * A bounded ring of fixed-size slots shared by exactly two threads: one
+ * producer which reserves and commits slots, one consumer which peeks and
+ * releases them in the same order. Slots are used in place, the producer fills
+ * the slot returned by vde_spsc_ring_reserve() and makes it visible with
+ * vde_spsc_ring_commit(), the consumer reads the slot returned by
+ * vde_spsc_ring_peek() and gives it back with vde_spsc_ring_release().
+ *
+ * head and tail are free-running counters, each one written by a single side.
+ * Every side keeps a cached copy of the other counter so that the shared cache
+ * line is read only when the ring looks full (producer) or empty (consumer).
+ *
+ * The counters and the slots are the only state shared by the two sides, a
+ * ring can be attached to them in memory it does not own (e.g. shared with
+ * another process) with vde_spsc_ring_attach(). Sides never trust the
+ * counters of each other with anything but a slot index, slots are always
+ * taken from the slots attached.
+ */
+
+/**
+ * @brief Counters of a ring, shared by its two sides
+ */
+typedef struct {
+  unsigned int head __attribute__((aligned(VDE_CACHELINE_SIZE)));
+  unsigned int tail __attribute__((aligned(VDE_CACHELINE_SIZE)));
+} vde_spsc_index;
+
+typedef struct {
+  // producer side
+  unsigned int head __attribute__((aligned(VDE_CACHELINE_SIZE)));
+  unsigned int cached_tail;
+  // consumer side
+  unsigned int tail __attribute__((aligned(VDE_CACHELINE_SIZE)));
+  unsigned int cached_head;
+  // read-only after creation
+  unsigned int mask __attribute__((aligned(VDE_CACHELINE_SIZE)));
+  size_t slot_size;
+  char *slots;
+  vde_spsc_index *index;
+  vde_spsc_index storage; //!< counters of rings from vde_spsc_ring_new()
+} vde_spsc_ring;
+
+/**
+ * @brief Alloc a new ring
+ *
+ * @param count The number of slots, rounded up to a power of two
+ * @param slot_size The size of each slot
+ *
+ * @return a ring on success, NULL on error (and errno is set appropriately)
+ */
+vde_spsc_ring *vde_spsc_ring_new(unsigned int count, size_t slot_size);
+
+/**
+ * @brief Deallocate a ring, neither side must use it anymore
+ *
+ * @param ring The ring to delete
+ */
+void vde_spsc_ring_delete(vde_spsc_ring *ring);
+
+/**
+ * @brief Attach a ring to counters and slots allocated by the caller, each
+ * side attaches its own ring to the same memory. Counters must be zeroed
+ * before the first side attaches, the ring is not deleted but just forgotten.
+ *
+ * @param ring The ring to initialize
+ * @param index The shared counters
+ * @param slots The shared slots, count * slot_size bytes
+ * @param count The number of slots, a power of two
+ * @param slot_size The size of each slot
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_spsc_ring_attach(vde_spsc_ring *ring, vde_spsc_index *index,
+                         void *slots, unsigned int count, size_t slot_size);
+
+static inline void *vde_spsc_ring_slot(vde_spsc_ring *ring, unsigned int idx)
+{
+  return ring->slots + (size_t)(idx & ring->mask) * ring->slot_size;
+}
+
+/**
+ * @brief Get the next free slot, producer only
+ *
+ * @param ring The ring
+ *
+ * @return The slot to fill, NULL if the ring is full
+ */
+static inline void *vde_spsc_ring_reserve(vde_spsc_ring *ring)
+{
+  if (ring->head - ring->cached_tail > ring->mask) {
+    ring->cached_tail = __atomic_load_n(&ring->index->tail, __ATOMIC_ACQUIRE);
+    if (ring->head - ring->cached_tail > ring->mask) {
+      return NULL;
+    }
+  }
+  return vde_spsc_ring_slot(ring, ring->head);
+}
+
+/**
+ * @brief Publish the slot returned by the last vde_spsc_ring_reserve(),
+ * producer only
+ *
+ * @param ring The ring
+ *
+ * @return 1 if the ring was empty, i.e. the consumer might be waiting for a
+ * wake up, 0 otherwise
+ */
+static inline int vde_spsc_ring_commit(vde_spsc_ring *ring)
+{
+  unsigned int head = ring->head++;
+
+  // sequentially consistent store and load pair with the ones in
+  // vde_spsc_ring_release() and vde_spsc_ring_peek(): either the consumer sees
+  // the new slot or the producer sees the ring empty and wakes it up
+  __atomic_store_n(&ring->index->head, head + 1, __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&ring->index->tail, __ATOMIC_SEQ_CST) == head;
+}
+
+/**
+ * @brief Get the oldest committed slot, consumer only
+ *
+ * @param ring The ring
+ *
+ * @return The slot to read, NULL if the ring is empty
+ */
+static inline void *vde_spsc_ring_peek(vde_spsc_ring *ring)
+{
+  if (ring->cached_head == ring->tail) {
+    ring->cached_head = __atomic_load_n(&ring->index->head, __ATOMIC_SEQ_CST);
+    if (ring->cached_head == ring->tail) {
+      return NULL;
+    }
+  }
+  return vde_spsc_ring_slot(ring, ring->tail);
+}
+
+/**
+ * @brief Give back the slot returned by the last vde_spsc_ring_peek(),
+ * consumer only
+ *
+ * @param ring The ring
+ */
+static inline void vde_spsc_ring_release(vde_spsc_ring *ring)
+{
+  __atomic_store_n(&ring->index->tail, ++ring->tail, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Get the oldest committed slots, consumer only
+ *
+ * @param ring The ring
+ * @param slots The array to fill with slot pointers
+ * @param max The size of slots
+ *
+ * @return The number of slots stored in slots, they are given back with
+ * vde_spsc_ring_release_n()
+ */
+static inline unsigned int vde_spsc_ring_peek_n(vde_spsc_ring *ring,
+                                                void **slots, unsigned int max)
+{
+  unsigned int i, count;
+
+  count = ring->cached_head - ring->tail;
+  if (count < max) {
+    ring->cached_head = __atomic_load_n(&ring->index->head, __ATOMIC_SEQ_CST);
+    count = ring->cached_head - ring->tail;
+  }
+  // more than the ring holds only if the other side is broken
+  if (count > ring->mask + 1) {
+    count = 0;
+  }
+  if (count > max) {
+    count = max;
+  }
+  for (i = 0; i < count; i++) {
+    slots[i] = vde_spsc_ring_slot(ring, ring->tail + i);
+  }
+  return count;
+}
+
+/**
+ * @brief Give back the oldest count slots, consumer only
+ *
+ * @param ring The ring
+ * @param count The number of slots, as returned by vde_spsc_ring_peek_n()
+ */
+static inline void vde_spsc_ring_release_n(vde_spsc_ring *ring,
+                                           unsigned int count)
+{
+  ring->tail += count;
+  __atomic_store_n(&ring->index->tail, ring->tail, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Get the number of slots in the ring
+ *
+ * @param ring The ring
+ *
+ * @return The ring size
+ */
+static inline unsigned int vde_spsc_ring_size(vde_spsc_ring *ring)
+{
+  return ring->mask + 1;
+}
+
+/**
+ * @brief A wake up channel between two threads
+ *
+ * The waiting side monitors the read fd with the event handler, the other side
+ * rings it. Rings are not counted: after a wake up the waiting side must clear
+ * the doorbell and then look for work until there's none left.
+ */
+typedef struct {
+  int rfd;
+  int wfd;
+} vde_doorbell;
+
+/**
+ * @brief Initialize a doorbell, both fds are non blocking
+ *
+ * @param db The doorbell to initialize
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_doorbell_init(vde_doorbell *db);
+
+/**
+ * @brief Release a doorbell fds
+ *
+ * @param db The doorbell
+ */
+void vde_doorbell_fini(vde_doorbell *db);
+
+/**
+ * @brief Wake up the other side, can be called from any thread
+ *
+ * @param db The doorbell
+ */
+void vde_doorbell_ring(vde_doorbell *db);
+
+/**
+ * @brief Consume pending wake ups, to be called before looking for work
+ *
+ * @param db The doorbell
+ */
+void vde_doorbell_clear(vde_doorbell *db);
+
+#endif /* __VDE3_SPSC_H__ */
@@ -0,0 +1,185 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file
+ */
+
+#ifndef __VDE3_STORM_H__
+#define __VDE3_STORM_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+
+/**
+ * @brief Ticks in a second of the timer refilling storm control buckets
+ */
+#define VDE_STORM_HZ 100
+
+/**
+ * @brief Classes of flooded frames policed by storm control
+ */
+typedef enum {
+  VDE_STORM_BROADCAST,
+  VDE_STORM_MULTICAST,
+  VDE_STORM_UNKNOWN, //!< unicast to a destination not known to the engine
+  VDE_STORM_MAX,
+} vde_storm_class;
+
+/**
+ * @brief Storm control of an engine: limits on the frames of each class its
+ * ports can flood, enforced by a token bucket for each port and class.
+ *
+ * Buckets are not refilled on each frame: a coarse timer shared by all the
+ * ports of the engine advances a tick counter, a bucket is refilled with the
+ * ticks gone by when it is used.
+ */
+typedef struct {
+  uint32_t rate[VDE_STORM_MAX]; //!< frames per second, 0 if not policed
+  uint32_t burst[VDE_STORM_MAX]; //!< frames admitted back to back
+  uint64_t drops[VDE_STORM_MAX]; //!< frames dropped on all the ports
+  uint32_t now; //!< current tick
+  int enabled; //!< a class is policed
+  vde_context *ctx;
+  void *timeout;
+} vde_storm;
+
+/**
+ * @brief The token buckets of a port, credits are counted in 1/VDE_STORM_HZ
+ * of a frame so that a tick adds rate credits.
+ */
+typedef struct {
+  uint64_t credits[VDE_STORM_MAX];
+  uint32_t last[VDE_STORM_MAX]; //!< tick of the last refill
+} vde_storm_bucket;
+
+/**
+ * @brief Initialize the storm control of an engine, no class is policed.
+ *
+ * @param storm The storm control
+ * @param ctx The context of the engine, running the timer
+ */
+void vde_storm_init(vde_storm *storm, vde_context *ctx);
+
+/**
+ * @brief Stop the timer of a storm control
+ *
+ * @param storm The storm control
+ */
+void vde_storm_fini(vde_storm *storm);
+
+/**
+ * @brief Set the limit of a class, the timer is started when the first class
+ * is policed.
+ *
+ * @param storm The storm control
+ * @param name The class: "broadcast", "multicast" or "unknown"
+ * @param rate Frames per second, 0 to stop policing the class
+ * @param burst Frames admitted back to back, 0 for a tenth of a second of
+ * rate
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_storm_set(vde_storm *storm, const char *name, int rate, int burst);
+
+/**
+ * @brief Set the limits from their serialized form, a hash of classes each
+ * with a "rate" and an optional "burst", e.g.
+ * {"broadcast": {"rate": 1000, "burst": 100}}
+ *
+ * @param storm The storm control
+ * @param params The serialized limits
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_storm_parse(vde_storm *storm, vde_sobj *params);
+
+/**
+ * @brief Serialize the limits and the drops of each class
+ *
+ * @param storm The storm control
+ *
+ * @return The serialized storm control, NULL on error
+ */
+vde_sobj *vde_storm_serialize(vde_storm *storm);
+
+/**
+ * @brief Fill the buckets of a new port
+ *
+ * @param storm The storm control of the engine
+ * @param bucket The buckets of the port
+ */
+void vde_storm_bucket_init(vde_storm *storm, vde_storm_bucket *bucket);
+
+/**
+ * @brief Get the class of a flooded frame from its destination address
+ *
+ * @param dest The destination address
+ *
+ * @return The class
+ */
+static inline vde_storm_class vde_storm_classify(const unsigned char *dest)
+{
+  static const unsigned char bcast[ETH_ALEN] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+  };
+
+  if (!(dest[0] & 0x01)) {
+    return VDE_STORM_UNKNOWN;
+  }
+  return memcmp(dest, bcast, ETH_ALEN) ? VDE_STORM_MULTICAST :
+                                         VDE_STORM_BROADCAST;
+}
+
+/**
+ * @brief Take a frame from the bucket of its class
+ *
+ * @param storm The storm control of the engine
+ * @param bucket The buckets of the port the frame has been received from
+ * @param cls The class of the frame
+ *
+ * @return Nonzero if the frame can be flooded, zero if it must be dropped
+ */
+static inline int vde_storm_admit(vde_storm *storm, vde_storm_bucket *bucket,
+                                  vde_storm_class cls)
+{
+  uint64_t max;
+
+  if (storm->rate[cls] == 0) {
+    return 1;
+  }
+  if (bucket->last[cls] != storm->now) {
+    max = (uint64_t)storm->burst[cls] * VDE_STORM_HZ;
+    bucket->credits[cls] += (uint64_t)(storm->now - bucket->last[cls]) *
+                            storm->rate[cls];
+    if (bucket->credits[cls] > max) {
+      bucket->credits[cls] = max;
+    }
+    bucket->last[cls] = storm->now;
+  }
+  if (bucket->credits[cls] < VDE_STORM_HZ) {
+    storm->drops[cls]++;
+    return 0;
+  }
+  bucket->credits[cls] -= VDE_STORM_HZ;
+  return 1;
+}
+
+#endif /* __VDE3_STORM_H__ */
@@ -0,0 +1,117 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file
+ */
+
+#ifndef __VDE3_TRACE_H__
+#define __VDE3_TRACE_H__
+
+#include <stdint.h>
+
+#include <vde3.h>
+
+/*
+ * Probe points
+ *
+ * Built with --enable-probes (VDE3_PROBES defined) every probe is a USDT
+ * probe of the "vde3" provider, usable by any tool reading <sys/sdt.h> notes
+ * (perf, bpftrace, systemtap): a probe costs a nop until a tracer attaches to
+ * it. Otherwise probes are compiled out.
+ *
+ * Probes on the packet path all take the connection and the packet as
+ * arguments, so that a packet can be followed across stages:
+ * - vde2__rx: a frame has been read by the vde2 transport
+ * - conn__read: a packet is handed to the connection user
+ * - conn__write: a connection user is sending a packet (be_write)
+ * - vde2__tx: a frame has been sent by the vde2 transport
+ * - conn__sent: a packet has been accounted as sent by a connection
+ *   (the packet is NULL if the backend had already released it)
+ */
+
+#ifdef VDE3_PROBES
+#include <sys/sdt.h>
+#define VDE_PROBE1(name, a) DTRACE_PROBE1(vde3, name, a)
+#define VDE_PROBE2(name, a, b) DTRACE_PROBE2(vde3, name, a, b)
+#define VDE_PROBE3(name, a, b, c) DTRACE_PROBE3(vde3, name, a, b, c)
+#else
+#define VDE_PROBE1(name, a) do { } while (0)
+#define VDE_PROBE2(name, a, b) do { } while (0)
+#define VDE_PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+/**
+ * @brief Number of buckets of a latency histogram, bucket i counts samples
+ * in [2^i, 2^(i+1)) ns (the first one counts 0 as well), the last one
+ * everything above.
+ */
+#define VDE_TRACE_BUCKETS 40
+
+/**
+ * @brief A log-bucketed latency histogram
+ */
+typedef struct {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+  uint64_t buckets[VDE_TRACE_BUCKETS];
+} vde_trace_hist;
+
+/**
+ * @brief Add a sample to a latency histogram
+ *
+ * @param hist The histogram
+ * @param ns The sample in nanoseconds
+ */
+static inline void vde_trace_hist_add(vde_trace_hist *hist, uint64_t ns)
+{
+  unsigned int idx = 0;
+
+  if (ns > 0) {
+    idx = 63 - __builtin_clzll(ns);
+  }
+  if (idx >= VDE_TRACE_BUCKETS) {
+    idx = VDE_TRACE_BUCKETS - 1;
+  }
+  hist->buckets[idx]++;
+  hist->count++;
+  hist->sum_ns += ns;
+  if (ns > hist->max_ns) {
+    hist->max_ns = ns;
+  }
+}
+
+/**
+ * @brief Add the samples of a histogram to another one
+ *
+ * @param total The histogram to update
+ * @param hist The histogram to add
+ */
+void vde_trace_hist_merge(vde_trace_hist *total, const vde_trace_hist *hist);
+
+/**
+ * @brief Serialize a latency histogram
+ *
+ * @param hist The histogram
+ *
+ * @return A new hash with "count", "max_ns" and "mean_ns" (if there are
+ * samples) and a "buckets" hash mapping the lower bound in ns of non-empty
+ * buckets to their count, NULL on error
+ */
+vde_sobj *vde_trace_hist_serialize(const vde_trace_hist *hist);
+
+#endif /* __VDE3_TRACE_H__ */
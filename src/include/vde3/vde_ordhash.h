@@ -37,15 +37,18 @@ typedef struct vde_ordhash vde_ordhash;
 /**
  * @brief VDE 3 ordered hash entry
  *
- * An element handled by ordhash iterator.
+ * An element handled by ordhash iterator, it stays valid until its element
+ * is removed.
  *
  */
-typedef vde_list vde_ordhash_entry;
+typedef struct vde_ordhash_entry vde_ordhash_entry;
 
 
 /**
  * @brief Alloc a new ordered hash
  *
+ * Insertion, removal and lookup take constant time.
+ *
  * @return an ordhash on succes, NULL on error (and errno is set appropriately)
  */
 vde_ordhash *vde_ordhash_new();
@@ -63,8 +66,10 @@ void vde_ordhash_delete(vde_ordhash *oh);
  * @param oh The ordhash to insert the element into
  * @param k The key used for looking up the element (must not be present)
  * @param v The value to insert
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
  */
-void vde_ordhash_insert(vde_ordhash *oh, void *k, void *v);
+int vde_ordhash_insert(vde_ordhash *oh, void *k, void *v);
 
 /**
  * @brief Remove an element from the ordhash
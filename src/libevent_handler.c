@@ -36,8 +36,24 @@
  * ...
  * event_dispatch();
  *
+ * libevent_loop provides an event base to each context worker, e.g.:
+ *
+ * vde_context_set_workers(ctx, 4, &libevent_loop);
+ * vde_context_start_workers(ctx);
+ * event_dispatch();
+ *
  */
 
+// event base entered by the thread, NULL for the default one (event_init)
+static __thread struct event_base *current_base;
+
+static inline void libevent_set_base(struct event *ev)
+{
+  if (current_base != NULL) {
+    event_base_set(current_base, ev);
+  }
+}
+
 // recurring timeout handling
 struct rtimeout {
   struct event *ev;
@@ -71,6 +87,7 @@ void *libevent_event_add(int fd, short events, const struct timeval *timeout,
   }
 
   event_set(ev, fd, events, cb, arg);
+  libevent_set_base(ev);
   event_add(ev, timeout);
 
   return ev;
@@ -115,9 +132,11 @@ void *libevent_timeout_add(const struct timeval *timeout, short events,
     rt->cb = cb;
     rt->arg = arg;
     timeout_set(ev, rtimeout_cb, rt);
+    libevent_set_base(ev);
     timeout_add(ev, timeout);
   } else {
     timeout_set(ev, cb, arg);
+    libevent_set_base(ev);
     timeout_add(ev, timeout);
   }
   // XXX check calls to timeout_set / timeout_add for failure
@@ -144,3 +163,36 @@ vde_event_handler libevent_eh = {
   .timeout_add = libevent_timeout_add,
   .timeout_del = libevent_timeout_del,
 };
+
+void *libevent_loop_new(void)
+{
+  return event_base_new();
+}
+
+void libevent_loop_delete(void *loop)
+{
+  event_base_free((struct event_base *)loop);
+}
+
+void libevent_loop_enter(void *loop)
+{
+  current_base = (struct event_base *)loop;
+}
+
+int libevent_loop_run(void *loop)
+{
+  return event_base_dispatch((struct event_base *)loop) == -1 ? -1 : 0;
+}
+
+void libevent_loop_break(void *loop)
+{
+  event_base_loopbreak((struct event_base *)loop);
+}
+
+vde_event_loop libevent_loop = {
+  .loop_new = libevent_loop_new,
+  .loop_delete = libevent_loop_delete,
+  .loop_enter = libevent_loop_enter,
+  .loop_run = libevent_loop_run,
+  .loop_break = libevent_loop_break,
+};
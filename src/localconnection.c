@@ -19,6 +19,9 @@
 
 #include <vde3/common.h>
 #include <vde3/engine.h>
+#include <vde3/context.h>
+#include <vde3/packet.h>
+#include <vde3/spsc.h>
 
 /*
  * Unqueued Local Connection
@@ -29,6 +32,7 @@
 typedef struct __vde_lc {
   vde_connection *conn;
   struct __vde_lc *peer;
+  unsigned int link_id; //!< see vde_context_link_add()
 } vde_lc;
 
 int vde_lc_write(vde_connection *conn, vde_pkt *pkt)
@@ -36,11 +40,12 @@ int vde_lc_write(vde_connection *conn, vde_pkt *pkt)
   int tmp_errno;
   vde_lc *lc = (vde_lc *)vde_connection_get_priv(conn);
   vde_lc *peer = lc->peer;
-  vde_connection *peer_conn = peer->conn;
+  vde_connection *peer_conn;
 
   if (peer == NULL) {
     return -1;
   }
+  peer_conn = peer->conn;
   if (vde_connection_call_read(peer_conn, pkt)) {
     tmp_errno = errno;
     if (errno == EPIPE) {
@@ -50,6 +55,7 @@ int vde_lc_write(vde_connection *conn, vde_pkt *pkt)
     errno = tmp_errno;
     return -1;
   }
+  vde_connection_stats_tx(conn, pkt);
   return 0;
 }
 
@@ -57,9 +63,12 @@ void vde_lc_close(vde_connection *conn)
 {
   vde_lc *lc = (vde_lc *)vde_connection_get_priv(conn);
   vde_lc *peer = lc->peer;
-  vde_connection *peer_conn = peer->conn;
+  vde_connection *peer_conn;
 
   if (peer != NULL) {
+    // the first side closing forgets the link
+    vde_context_link_del(vde_connection_get_context(conn), lc->link_id);
+    peer_conn = peer->conn;
     peer->peer = NULL; // detach from peer to avoid circular close calls
     if (vde_connection_call_error(peer_conn, NULL, CONN_READ_CLOSED) &&
         (errno == EPIPE)) {
@@ -91,13 +100,13 @@ int vde_connect_engines_unqueued(vde_context *ctx, vde_component *engine1,
 
   lc1 = (vde_lc *)vde_calloc(sizeof(vde_lc));
   if (lc1 == NULL) {
-    vde_error("%s: cannot create local connection data");
+    vde_error("%s: cannot create local connection data", __PRETTY_FUNCTION__);
     tmp_errno = ENOMEM;
     goto err_out;
   }
   lc2 = (vde_lc *)vde_calloc(sizeof(vde_lc));
   if (lc2 == NULL) {
-    vde_error("%s: cannot create local connection data");
+    vde_error("%s: cannot create local connection data", __PRETTY_FUNCTION__);
     tmp_errno = ENOMEM;
     goto err_lc1;
   }
@@ -115,14 +124,15 @@ int vde_connect_engines_unqueued(vde_context *ctx, vde_component *engine1,
   vde_connection_init(c2, ctx, 0, &vde_lc_write, &vde_lc_close, (void *)lc2);
 
   if (vde_engine_new_connection(engine1, c1, req1) != 0) {
-    vde_error("%s: cannot connect to first engine");
+    vde_error("%s: cannot connect to first engine", __PRETTY_FUNCTION__);
     goto err_lc2;
   }
   if (vde_engine_new_connection(engine2, c2, req2) != 0) {
-    vde_error("%s: cannot connect to second engine");
+    vde_error("%s: cannot connect to second engine", __PRETTY_FUNCTION__);
     goto err_eng1;
   }
 
+  lc1->link_id = lc2->link_id = vde_context_link_add(ctx, engine1, engine2, 0);
   return 0;
 
 err_eng1:
@@ -144,3 +154,687 @@ err_out:
   return -1;
 }
 
+
+/*
+ * Queued Local Connection
+ * (packets are delivered from a context event, the write callback is called
+ * after the peer has read them).
+ *
+ */
+
+#define QLC_DEFAULT_QLEN 1024
+#define QLC_MAX_QLEN (1 << 16)
+// packets delivered to the peer for each drain event
+#define QLC_DRAIN_BATCH 64
+
+typedef struct __vde_qlc {
+  vde_context *ctx;
+  vde_connection *conn;
+  struct __vde_qlc *peer;
+  unsigned int link_id; //!< see vde_context_link_add()
+  // references on packets written on conn and not yet read by the peer,
+  // head and tail are free-running counters
+  vde_pkt **ring;
+  unsigned int mask;
+  unsigned int head;
+  unsigned int tail;
+  void *drain_timeout;
+  unsigned int draining: 1; //!< drain callback running, don't free
+  unsigned int closed: 1; //!< closed while draining, free when done
+  unsigned int close_pending: 1; //!< close from the next drain event
+} vde_qlc;
+
+static void vde_qlc_drain_cb(int fd, short events, void *arg);
+
+static inline unsigned int vde_qlc_queued(vde_qlc *lc)
+{
+  return lc->head - lc->tail;
+}
+
+static inline void vde_qlc_schedule(vde_qlc *lc)
+{
+  struct timeval now = { 0, 0 };
+
+  if (lc->drain_timeout == NULL) {
+    lc->drain_timeout = vde_context_timeout_add(lc->ctx, 0, &now,
+                                                &vde_qlc_drain_cb, (void *)lc);
+    if (lc->drain_timeout == NULL) {
+      vde_warning("%s: cannot schedule packets delivery", __PRETTY_FUNCTION__);
+    }
+  }
+}
+
+static void vde_qlc_flush(vde_qlc *lc)
+{
+  if (lc->drain_timeout != NULL) {
+    vde_context_timeout_del(lc->ctx, lc->drain_timeout);
+    lc->drain_timeout = NULL;
+  }
+  while (lc->tail != lc->head) {
+    vde_pkt_put(lc->ring[lc->tail++ & lc->mask]);
+  }
+  vde_connection_queue_clear(lc->conn);
+}
+
+static void vde_qlc_free(vde_qlc *lc)
+{
+  vde_free(lc->ring);
+  vde_free(lc);
+}
+
+static void vde_qlc_drain_cb(int fd, short events, void *arg)
+{
+  vde_pkt *pkts[QLC_DRAIN_BATCH];
+  unsigned int i, count;
+  int close_self = 0;
+  vde_connection *peer_conn;
+  vde_qlc *lc = (vde_qlc *)arg;
+
+  vde_context_timeout_del(lc->ctx, lc->drain_timeout);
+  lc->drain_timeout = NULL;
+
+  if (lc->close_pending) {
+    vde_connection_fini(lc->conn);
+    vde_connection_delete(lc->conn);
+    return;
+  }
+
+  count = vde_qlc_queued(lc);
+  if (count > QLC_DRAIN_BATCH) {
+    count = QLC_DRAIN_BATCH;
+  }
+  for (i = 0; i < count; i++) {
+    pkts[i] = lc->ring[lc->tail++ & lc->mask];
+    vde_connection_queue_del(lc->conn, pkts[i]);
+  }
+  // let other events run before delivering the next batch
+  if (vde_qlc_queued(lc) > 0) {
+    vde_qlc_schedule(lc);
+  }
+
+  if (lc->peer == NULL || count == 0) {
+    goto put_pkts;
+  }
+
+  // callbacks below can close both connections, lc is kept until the end
+  lc->draining = 1;
+  peer_conn = lc->peer->conn;
+  if (vde_connection_call_read_batch(peer_conn, pkts, count)) {
+    if (errno == EPIPE) {
+      vde_connection_fini(peer_conn);
+      vde_connection_delete(peer_conn);
+    }
+  } else {
+    for (i = 0; i < count && !lc->closed; i++) {
+      if (vde_connection_call_write(lc->conn, pkts[i]) && errno == EPIPE) {
+        close_self = 1;
+        break;
+      }
+    }
+  }
+  lc->draining = 0;
+
+put_pkts:
+  for (i = 0; i < count; i++) {
+    vde_pkt_put(pkts[i]);
+  }
+
+  if (lc->closed) {
+    vde_qlc_free(lc);
+  } else if (close_self) {
+    vde_connection_fini(lc->conn);
+    vde_connection_delete(lc->conn);
+  }
+}
+
+int vde_qlc_write(vde_connection *conn, vde_pkt *pkt)
+{
+  vde_qlc *lc = (vde_qlc *)vde_connection_get_priv(conn);
+
+  if (lc->peer == NULL || lc->close_pending) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  if (vde_qlc_queued(lc) > lc->mask ||
+      vde_connection_queue_exceeded(conn, pkt)) {
+    // queue full, the packet is dropped: report back pressure to the writer
+    // and close the connection later if asked to
+    vde_connection_stats_drop(conn, VDE_CONN_DROP_QUEUE_FULL);
+    if (vde_connection_call_error(conn, pkt, CONN_WRITE_DELAY) &&
+        (errno == EPIPE)) {
+      lc->close_pending = 1;
+      vde_qlc_schedule(lc);
+    }
+    errno = EAGAIN;
+    return -1;
+  }
+
+  pkt = vde_pkt_share(lc->ctx, pkt);
+  if (pkt == NULL) {
+    vde_connection_stats_drop(conn, VDE_CONN_DROP_NOMEM);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  lc->ring[lc->head++ & lc->mask] = pkt;
+  vde_connection_stats_queue(conn, vde_qlc_queued(lc));
+  vde_connection_queue_add(conn, pkt);
+  vde_qlc_schedule(lc);
+
+  return 0;
+}
+
+void vde_qlc_close(vde_connection *conn)
+{
+  vde_qlc *lc = (vde_qlc *)vde_connection_get_priv(conn);
+  vde_qlc *peer = lc->peer;
+  vde_connection *peer_conn;
+
+  vde_qlc_flush(lc);
+
+  if (peer != NULL) {
+    // the first side closing forgets the link
+    vde_context_link_del(lc->ctx, lc->link_id);
+    // detach from peer to avoid circular close calls, packets it queued
+    // can't be delivered anymore
+    peer->peer = NULL;
+    lc->peer = NULL;
+    vde_qlc_flush(peer);
+    peer_conn = peer->conn;
+    if (vde_connection_call_error(peer_conn, NULL, CONN_READ_CLOSED) &&
+        (errno == EPIPE)) {
+        vde_connection_fini(peer_conn);
+        vde_connection_delete(peer_conn);
+    } else {
+      vde_warning("%s: called fatal error but engine did not close",
+          __PRETTY_FUNCTION__);
+    }
+  }
+
+  if (lc->draining) {
+    lc->closed = 1;
+    return;
+  }
+  vde_qlc_free(lc);
+}
+
+static vde_qlc *vde_qlc_new(vde_context *ctx, unsigned int size)
+{
+  vde_qlc *lc;
+
+  lc = (vde_qlc *)vde_calloc(sizeof(vde_qlc));
+  if (lc == NULL) {
+    return NULL;
+  }
+  lc->ring = (vde_pkt **)vde_calloc(size * sizeof(vde_pkt *));
+  if (lc->ring == NULL) {
+    vde_free(lc);
+    return NULL;
+  }
+  lc->ctx = ctx;
+  lc->mask = size - 1;
+  return lc;
+}
+
+/*
+ * Cross-worker Queued Local Connection
+ * (engines run by different workers: packets are copied into a lock-free ring
+ * for each direction and delivered by the thread of the reader, which is woken
+ * up by a doorbell).
+ *
+ */
+
+// data of a ring slot, enough for a full ethernet frame with head room:
+// larger packets (e.g. jumbo frames) are copied into memory from the system
+// allocator, the slot only points to it
+#define XLC_SLOT_DATA 2048
+#define XLC_SLOT_SIZE (sizeof(vde_pkt) + XLC_SLOT_DATA)
+
+typedef struct __vde_xlc_link vde_xlc_link;
+
+typedef struct {
+  vde_context *ctx;
+  vde_connection *conn;
+  vde_xlc_link *link;
+  unsigned int side;
+  vde_spsc_ring *tx; //!< written by this side, read by the peer
+  vde_spsc_ring *rx; //!< written by the peer, read by this side
+  void *doorbell_ev;
+  unsigned int close_pending: 1; //!< close from the next doorbell event
+} vde_xlc;
+
+// shared by the two threads, released by the last side closing
+struct __vde_xlc_link {
+  vde_xlc sides[2];
+  vde_spsc_ring *rings[2]; //!< rings[i] is written by side i
+  vde_doorbell doorbells[2]; //!< doorbells[i] wakes side i up
+  int closed[2];
+  int refcount;
+  unsigned int link_id; //!< taken by the first side closing
+};
+
+static inline int vde_xlc_peer_closed(vde_xlc *lc)
+{
+  return __atomic_load_n(&lc->link->closed[!lc->side], __ATOMIC_ACQUIRE);
+}
+
+static inline void vde_xlc_kick(vde_xlc *lc, unsigned int side)
+{
+  vde_doorbell_ring(&lc->link->doorbells[side]);
+}
+
+// release count slots read from ring, freeing memory of oversized packets
+static void vde_xlc_release(vde_spsc_ring *ring, vde_pkt **slots,
+                            unsigned int count)
+{
+  unsigned int i;
+
+  for (i = 0; i < count; i++) {
+    if ((char *)slots[i]->hdr != slots[i]->data) {
+      vde_free(slots[i]->hdr);
+    }
+  }
+  vde_spsc_ring_release_n(ring, count);
+}
+
+static void vde_xlc_link_free(vde_xlc_link *link)
+{
+  vde_pkt *pkts[QLC_DRAIN_BATCH];
+  unsigned int i, count;
+
+  for (i = 0; i < 2; i++) {
+    if (link->rings[i] != NULL) {
+      // both sides are gone, packets never read are dropped here
+      while ((count = vde_spsc_ring_peek_n(link->rings[i], (void **)pkts,
+                                           QLC_DRAIN_BATCH)) > 0) {
+        vde_xlc_release(link->rings[i], pkts, count);
+      }
+      vde_spsc_ring_delete(link->rings[i]);
+    }
+    if (link->doorbells[i].rfd != -1) {
+      vde_doorbell_fini(&link->doorbells[i]);
+    }
+  }
+  vde_free(link);
+}
+
+static void vde_xlc_link_put(vde_xlc_link *link)
+{
+  if (__sync_sub_and_fetch(&link->refcount, 1) == 0) {
+    vde_xlc_link_free(link);
+  }
+}
+
+static void vde_xlc_doorbell_cb(int fd, short events, void *arg)
+{
+  vde_pkt *pkts[QLC_DRAIN_BATCH];
+  unsigned int count;
+  vde_xlc *lc = (vde_xlc *)arg;
+  vde_connection *conn = lc->conn;
+
+  vde_doorbell_clear(&lc->link->doorbells[lc->side]);
+
+  if (lc->close_pending) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return;
+  }
+
+  if (vde_xlc_peer_closed(lc)) {
+    // packets queued by the peer can't be delivered anymore
+    if (vde_connection_call_error(conn, NULL, CONN_READ_CLOSED) &&
+        (errno == EPIPE)) {
+      vde_connection_fini(conn);
+      vde_connection_delete(conn);
+    } else {
+      vde_warning("%s: called fatal error but engine did not close",
+          __PRETTY_FUNCTION__);
+    }
+    return;
+  }
+
+  count = vde_spsc_ring_peek_n(lc->rx, (void **)pkts, QLC_DRAIN_BATCH);
+  if (count == 0) {
+    return;
+  }
+  // slots are not reference counted, a reader keeping a packet copies it into
+  // the pool of this worker with vde_pkt_share()
+  if (vde_connection_call_read_batch(conn, pkts, count) && errno == EPIPE) {
+    vde_xlc_release(lc->rx, pkts, count);
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return;
+  }
+  vde_xlc_release(lc->rx, pkts, count);
+
+  // let other events run before delivering the next batch. Packets committed
+  // while this one was read found the ring not empty and didn't ring the
+  // doorbell: look again now that the batch has been released
+  if (count == QLC_DRAIN_BATCH ||
+      vde_spsc_ring_peek_n(lc->rx, (void **)pkts, 1) > 0) {
+    vde_xlc_kick(lc, lc->side);
+  }
+}
+
+int vde_xlc_write(vde_connection *conn, vde_pkt *pkt)
+{
+  vde_pkt *slot;
+  char *buf;
+  unsigned int head_sz, tail_sz, size;
+  vde_xlc *lc = (vde_xlc *)vde_connection_get_priv(conn);
+
+  if (lc->close_pending || vde_xlc_peer_closed(lc)) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  head_sz = pkt->payload - pkt->head;
+  // not relative to data, which is unused by views
+  tail_sz = pkt->head + pkt->data_size - sizeof(vde_hdr) - pkt->tail;
+  size = sizeof(vde_hdr) + head_sz + pkt->hdr->pkt_len + tail_sz;
+
+  slot = (vde_pkt *)vde_spsc_ring_reserve(lc->tx);
+  if (slot == NULL) {
+    // ring full, as for queued local connections
+    vde_connection_stats_drop(conn, VDE_CONN_DROP_QUEUE_FULL);
+    if (vde_connection_call_error(conn, pkt, CONN_WRITE_DELAY) &&
+        (errno == EPIPE)) {
+      lc->close_pending = 1;
+      vde_xlc_kick(lc, lc->side);
+    }
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (size <= XLC_SLOT_DATA) {
+    vde_pkt_init(slot, size, head_sz, tail_sz);
+  } else {
+    // freed by the reader, see vde_xlc_release()
+    buf = (char *)vde_alloc(size);
+    vde_pkt_init_view(slot, (vde_hdr *)buf, buf + sizeof(vde_hdr), head_sz,
+                      pkt->hdr->pkt_len, tail_sz);
+  }
+  memcpy(slot->hdr, pkt->hdr, sizeof(vde_hdr));
+  memcpy(slot->payload, pkt->payload, pkt->hdr->pkt_len);
+  // no write callback here, the packet is sent once in the ring
+  vde_connection_stats_tx(conn, pkt);
+  if (vde_spsc_ring_commit(lc->tx)) {
+    vde_xlc_kick(lc, !lc->side);
+  }
+
+  return 0;
+}
+
+void vde_xlc_close(vde_connection *conn)
+{
+  vde_xlc *lc = (vde_xlc *)vde_connection_get_priv(conn);
+  vde_xlc_link *link = lc->link;
+
+  vde_context_event_del(lc->ctx, lc->doorbell_ev);
+  lc->doorbell_ev = NULL;
+
+  // the sides can close at the same time from their own threads
+  vde_context_link_del(lc->ctx, __atomic_exchange_n(&link->link_id, 0,
+                                                    __ATOMIC_ACQ_REL));
+
+  // the peer reports the close to its engine from its own thread
+  __atomic_store_n(&link->closed[lc->side], 1, __ATOMIC_RELEASE);
+  vde_xlc_kick(lc, !lc->side);
+
+  vde_xlc_link_put(link);
+}
+
+static vde_xlc_link *vde_xlc_link_new(vde_context *ctx1, vde_context *ctx2,
+                                      unsigned int size)
+{
+  unsigned int i;
+  int tmp_errno;
+  vde_xlc_link *link;
+  vde_context *ctxs[2] = { ctx1, ctx2 };
+
+  link = (vde_xlc_link *)vde_calloc(sizeof(vde_xlc_link));
+  if (link == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  link->doorbells[0].rfd = link->doorbells[1].rfd = -1;
+  link->refcount = 2;
+
+  for (i = 0; i < 2; i++) {
+    link->rings[i] = vde_spsc_ring_new(size, XLC_SLOT_SIZE);
+    if (link->rings[i] == NULL) {
+      tmp_errno = errno;
+      goto err_link;
+    }
+    if (vde_doorbell_init(&link->doorbells[i])) {
+      tmp_errno = errno;
+      link->doorbells[i].rfd = -1;
+      goto err_link;
+    }
+  }
+  for (i = 0; i < 2; i++) {
+    link->sides[i].ctx = ctxs[i];
+    link->sides[i].link = link;
+    link->sides[i].side = i;
+    link->sides[i].tx = link->rings[i];
+    link->sides[i].rx = link->rings[!i];
+  }
+
+  return link;
+
+err_link:
+  vde_xlc_link_free(link);
+  errno = tmp_errno;
+  return NULL;
+}
+
+static int vde_xlc_side_init(vde_xlc *lc, vde_connection *conn)
+{
+  lc->conn = conn;
+  vde_connection_init(conn, lc->ctx, 0, &vde_xlc_write, &vde_xlc_close,
+                      (void *)lc);
+  // entering the loop of a worker from this thread is allowed only while
+  // workers are stopped
+  lc->doorbell_ev =
+    vde_context_event_add(lc->ctx, lc->link->doorbells[lc->side].rfd,
+                          VDE_EV_READ | VDE_EV_PERSIST, NULL,
+                          &vde_xlc_doorbell_cb, (void *)lc);
+  if (lc->doorbell_ev == NULL) {
+    return -1;
+  }
+  return 0;
+}
+
+static int vde_connect_engines_xlc(vde_component *engine1, vde_request *req1,
+                                   vde_component *engine2, vde_request *req2,
+                                   unsigned int size, unsigned int qlen)
+{
+  int tmp_errno;
+  vde_connection *c1, *c2;
+  vde_xlc_link *link;
+  vde_context *ctx1 = vde_component_get_context(engine1);
+  vde_context *ctx2 = vde_component_get_context(engine2);
+
+  if (vde_context_get_root(ctx1) != vde_context_get_root(ctx2)) {
+    vde_error("%s: engines belong to different contexts", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  if (vde_context_workers_running(ctx1)) {
+    vde_error("%s: cannot connect engines of different workers while workers "
+              "are running", __PRETTY_FUNCTION__);
+    errno = EBUSY;
+    return -1;
+  }
+
+  link = vde_xlc_link_new(ctx1, ctx2, size);
+  if (link == NULL) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create local connection data", __PRETTY_FUNCTION__);
+    errno = tmp_errno;
+    return -1;
+  }
+
+  if (vde_connection_new(&c1)) {
+    tmp_errno = errno;
+    goto err_link;
+  }
+  if (vde_connection_new(&c2)) {
+    tmp_errno = errno;
+    vde_connection_delete(c1);
+    goto err_link;
+  }
+  if (vde_xlc_side_init(&link->sides[0], c1) ||
+      vde_xlc_side_init(&link->sides[1], c2)) {
+    tmp_errno = errno;
+    vde_error("%s: cannot add doorbell event", __PRETTY_FUNCTION__);
+    goto err_conns;
+  }
+
+  if (vde_engine_new_connection(engine1, c1, req1) != 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot connect to first engine", __PRETTY_FUNCTION__);
+    goto err_conns;
+  }
+  if (vde_engine_new_connection(engine2, c2, req2) != 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot connect to second engine", __PRETTY_FUNCTION__);
+    // the second side goes away without being closed, the first engine is
+    // told the connection is closed, as for unqueued
+    vde_context_event_del(ctx2, link->sides[1].doorbell_ev);
+    vde_connection_delete(c2);
+    link->closed[1] = 1;
+    link->refcount--;
+    if (vde_connection_call_error(c1, NULL, CONN_READ_CLOSED) &&
+        (errno == EPIPE)) {
+      vde_connection_fini(c1); // releases the link
+      vde_connection_delete(c1);
+    } else {
+      vde_warning("%s: called fatal error but engine did not close",
+          __PRETTY_FUNCTION__);
+    }
+    errno = tmp_errno;
+    return -1;
+  }
+
+  // workers are stopped, no side can close yet
+  link->link_id = vde_context_link_add(ctx1, engine1, engine2, qlen);
+  return 0;
+
+err_conns:
+  if (link->sides[0].doorbell_ev != NULL) {
+    vde_context_event_del(ctx1, link->sides[0].doorbell_ev);
+  }
+  if (link->sides[1].doorbell_ev != NULL) {
+    vde_context_event_del(ctx2, link->sides[1].doorbell_ev);
+  }
+  vde_connection_delete(c2);
+  vde_connection_delete(c1);
+err_link:
+  vde_xlc_link_free(link);
+  errno = tmp_errno;
+  return -1;
+}
+
+int vde_connect_engines_queued(vde_context *ctx, vde_component *engine1,
+                               vde_request *req1, vde_component *engine2,
+                               vde_request *req2, unsigned int qlen)
+{
+  int tmp_errno;
+  unsigned int size = 1;
+  vde_connection *c1, *c2;
+  vde_qlc *lc1, *lc2;
+
+  vde_assert(ctx != NULL);
+  vde_assert(engine1 != NULL);
+  vde_assert(engine2 != NULL);
+
+  // XXX: request must be normalized here (assert != NULL as well?)
+
+  if (qlen == 0) {
+    qlen = QLC_DEFAULT_QLEN;
+  }
+  if (qlen > QLC_MAX_QLEN) {
+    vde_error("%s: queue length too large", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  while (size < qlen) {
+    size <<= 1;
+  }
+
+  if (vde_component_get_context(engine1) !=
+      vde_component_get_context(engine2)) {
+    return vde_connect_engines_xlc(engine1, req1, engine2, req2, size, qlen);
+  }
+
+  lc1 = vde_qlc_new(ctx, size);
+  if (lc1 == NULL) {
+    vde_error("%s: cannot create local connection data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+  lc2 = vde_qlc_new(ctx, size);
+  if (lc2 == NULL) {
+    vde_error("%s: cannot create local connection data", __PRETTY_FUNCTION__);
+    vde_qlc_free(lc1);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  if (vde_connection_new(&c1)) {
+    tmp_errno = errno;
+    goto err_lc;
+  }
+  if (vde_connection_new(&c2)) {
+    tmp_errno = errno;
+    vde_connection_delete(c1);
+    goto err_lc;
+  }
+
+  lc1->conn = c1;
+  lc2->conn = c2;
+
+  lc1->peer = lc2;
+  lc2->peer = lc1;
+
+  vde_connection_init(c1, ctx, 0, &vde_qlc_write, &vde_qlc_close, (void *)lc1);
+  vde_connection_init(c2, ctx, 0, &vde_qlc_write, &vde_qlc_close, (void *)lc2);
+
+  if (vde_engine_new_connection(engine1, c1, req1) != 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot connect to first engine", __PRETTY_FUNCTION__);
+    vde_connection_delete(c1);
+    vde_connection_delete(c2);
+    goto err_lc;
+  }
+  if (vde_engine_new_connection(engine2, c2, req2) != 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot connect to second engine", __PRETTY_FUNCTION__);
+    vde_connection_delete(c2);
+    // the first engine is told the connection is closed, as for unqueued
+    lc1->peer = NULL;
+    if (vde_connection_call_error(c1, NULL, CONN_READ_CLOSED) &&
+        (errno == EPIPE)) {
+      vde_connection_fini(c1); // frees lc1
+      vde_connection_delete(c1);
+    } else {
+      vde_warning("%s: called fatal error but engine did not close",
+          __PRETTY_FUNCTION__);
+    }
+    vde_qlc_free(lc2);
+    errno = tmp_errno;
+    return -1;
+  }
+
+  lc1->link_id = lc2->link_id = vde_context_link_add(ctx, engine1, engine2,
+                                                      qlen);
+  return 0;
+
+err_lc:
+  vde_qlc_free(lc2);
+  vde_qlc_free(lc1);
+  errno = tmp_errno;
+  return -1;
+}
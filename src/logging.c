@@ -17,16 +17,72 @@
 
 #include <vde3.h>
 
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_RATELIMIT_INTERVAL 1000 /* ms */
+#define LOG_RATELIMIT_BURST 10
+// longer messages are truncated by the asynchronous sink
+#define LOG_ASYNC_MSG_SIZE 256
+#define LOG_ASYNC_MAX_SLOTS (1U << 20)
 
 static vde_log_handler global_log_handler = NULL;
 
+int vde_log_level = VDE3_LOG_LEVEL;
+
+static unsigned int ratelimit_interval = LOG_RATELIMIT_INTERVAL;
+static unsigned int ratelimit_burst = LOG_RATELIMIT_BURST;
+
+/*
+ * Asynchronous sink: a bounded multi-producer ring of preformatted messages
+ * consumed by a single thread. Each slot has a sequence number telling
+ * whether it is free for the producer claiming position pos (seq == pos) or
+ * holds the message written at position pos (seq == pos + 1).
+ */
+typedef struct {
+  unsigned int seq;
+  int priority;
+  char msg[LOG_ASYNC_MSG_SIZE];
+} log_slot;
+
+static struct {
+  log_slot *slots;
+  unsigned int mask;
+  unsigned int head; //!< next position claimed by producers
+  unsigned int tail; //!< next position read by the consumer
+  unsigned int dropped; //!< messages lost because the ring was full
+  int running;
+  int sleeping; //!< the consumer waits on cond
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} async_sink = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+};
+
 void vde_log_set_handler(vde_log_handler handler)
 {
   global_log_handler = handler;
 }
 
-void vvde_log(int priority, const char *format, va_list arg)
+void vde_log_set_level(int priority)
+{
+  vde_log_level = priority;
+}
+
+void vde_log_set_ratelimit(unsigned int interval_ms, unsigned int burst)
+{
+  ratelimit_interval = interval_ms;
+  ratelimit_burst = burst;
+}
+
+static void log_write_va(int priority, const char *format, va_list arg)
 {
   if (global_log_handler)
     global_log_handler(priority, format, arg);
@@ -36,6 +92,180 @@ void vvde_log(int priority, const char *format, va_list arg)
   }
 }
 
+static void log_write(int priority, const char *format, ...)
+{
+  va_list arg;
+  va_start (arg, format);
+  log_write_va(priority, format, arg);
+  va_end (arg);
+}
+
+static void log_async_wake(void)
+{
+  if (__atomic_load_n(&async_sink.sleeping, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&async_sink.lock);
+    pthread_cond_signal(&async_sink.cond);
+    pthread_mutex_unlock(&async_sink.lock);
+  }
+}
+
+static void log_async_push(int priority, const char *format, va_list arg)
+{
+  int diff;
+  unsigned int pos, seq;
+  log_slot *slot;
+
+  pos = __atomic_load_n(&async_sink.head, __ATOMIC_RELAXED);
+  while (1) {
+    slot = &async_sink.slots[pos & async_sink.mask];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    diff = (int)(seq - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&async_sink.head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // full, the consumer reports the loss
+      __atomic_add_fetch(&async_sink.dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      pos = __atomic_load_n(&async_sink.head, __ATOMIC_RELAXED);
+    }
+  }
+
+  vsnprintf(slot->msg, sizeof(slot->msg), format, arg);
+  slot->priority = priority;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+  log_async_wake();
+}
+
+// returns 1 if a message has been written
+static int log_async_pop(void)
+{
+  unsigned int dropped;
+  unsigned int pos = async_sink.tail;
+  log_slot *slot = &async_sink.slots[pos & async_sink.mask];
+
+  dropped = __atomic_exchange_n(&async_sink.dropped, 0, __ATOMIC_RELAXED);
+  if (dropped) {
+    log_write(VDE3_LOG_WARNING, "%s: %u log messages dropped",
+              __PRETTY_FUNCTION__, dropped);
+  }
+
+  if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+    return dropped != 0;
+  }
+  log_write(slot->priority, "%s", slot->msg);
+  __atomic_store_n(&slot->seq, pos + async_sink.mask + 1, __ATOMIC_RELEASE);
+  async_sink.tail = pos + 1;
+  return 1;
+}
+
+static int log_async_pending(void)
+{
+  unsigned int pos = async_sink.tail;
+  log_slot *slot = &async_sink.slots[pos & async_sink.mask];
+
+  return __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == pos + 1 ||
+         __atomic_load_n(&async_sink.dropped, __ATOMIC_RELAXED) != 0;
+}
+
+static void *log_async_main(void *arg)
+{
+  while (1) {
+    if (log_async_pop()) {
+      continue;
+    }
+    pthread_mutex_lock(&async_sink.lock);
+    // paired with the producer store and load in log_async_push(): either the
+    // consumer sees the message or the producer sees it sleeping
+    __atomic_store_n(&async_sink.sleeping, 1, __ATOMIC_SEQ_CST);
+    while (!log_async_pending() && async_sink.running) {
+      pthread_cond_wait(&async_sink.cond, &async_sink.lock);
+    }
+    __atomic_store_n(&async_sink.sleeping, 0, __ATOMIC_SEQ_CST);
+    if (!async_sink.running && !log_async_pending()) {
+      pthread_mutex_unlock(&async_sink.lock);
+      break;
+    }
+    pthread_mutex_unlock(&async_sink.lock);
+  }
+  return NULL;
+}
+
+int vde_log_start_async(unsigned int slots)
+{
+  int rv;
+  unsigned int i, size = 2; // a free slot and a full one must differ
+  sigset_t all, old;
+
+  if (__atomic_load_n(&async_sink.running, __ATOMIC_ACQUIRE)) {
+    errno = EBUSY;
+    return -1;
+  }
+  if (slots == 0 || slots > LOG_ASYNC_MAX_SLOTS) {
+    errno = EINVAL;
+    return -1;
+  }
+  while (size < slots) {
+    size <<= 1;
+  }
+
+  async_sink.slots = (log_slot *)malloc(size * sizeof(log_slot));
+  if (async_sink.slots == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  for (i = 0; i < size; i++) {
+    async_sink.slots[i].seq = i;
+  }
+  async_sink.mask = size - 1;
+  async_sink.head = async_sink.tail = 0;
+  async_sink.dropped = 0;
+  async_sink.running = 1;
+
+  // signals are left to the application threads
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  rv = pthread_create(&async_sink.thread, NULL, &log_async_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (rv) {
+    async_sink.running = 0;
+    free(async_sink.slots);
+    async_sink.slots = NULL;
+    errno = rv;
+    return -1;
+  }
+  return 0;
+}
+
+void vde_log_stop_async(void)
+{
+  if (!__atomic_load_n(&async_sink.running, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+
+  pthread_mutex_lock(&async_sink.lock);
+  __atomic_store_n(&async_sink.running, 0, __ATOMIC_RELEASE);
+  pthread_cond_signal(&async_sink.cond);
+  pthread_mutex_unlock(&async_sink.lock);
+  pthread_join(async_sink.thread, NULL);
+
+  free(async_sink.slots);
+  async_sink.slots = NULL;
+}
+
+void vvde_log(int priority, const char *format, va_list arg)
+{
+  if (__atomic_load_n(&async_sink.running, __ATOMIC_ACQUIRE)) {
+    log_async_push(priority, format, arg);
+  } else {
+    log_write_va(priority, format, arg);
+  }
+}
+
 void vde_log(int priority, const char *format, ...)
 {
   va_list arg;
@@ -44,3 +274,65 @@ void vde_log(int priority, const char *format, ...)
   va_end (arg);
 }
 
+static inline unsigned long log_now_ms(void)
+{
+  struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Call sites can be shared by worker threads, the state is updated with
+ * atomic operations: a race at a window boundary can only let a few more
+ * messages through.
+ */
+static int log_ratelimit_pass(vde_log_ratelimit *rl, unsigned int *suppressed)
+{
+  unsigned long window, now;
+  unsigned int burst = ratelimit_burst;
+
+  *suppressed = 0;
+  if (burst == 0) {
+    return 1;
+  }
+
+  // 0 marks a site which never logged
+  now = log_now_ms() | 1;
+  window = __atomic_load_n(&rl->window, __ATOMIC_RELAXED);
+  if ((window == 0 || now - window >= ratelimit_interval) &&
+      __atomic_compare_exchange_n(&rl->window, &window, now, 0,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&rl->count, 0, __ATOMIC_RELAXED);
+  }
+
+  if (__atomic_add_fetch(&rl->count, 1, __ATOMIC_RELAXED) > burst) {
+    __atomic_add_fetch(&rl->suppressed, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  *suppressed = __atomic_exchange_n(&rl->suppressed, 0, __ATOMIC_RELAXED);
+  return 1;
+}
+
+void vde_log_ratelimited(vde_log_ratelimit *rl, const char *file, int line,
+                         int priority, const char *format, ...)
+{
+  va_list arg;
+  unsigned int suppressed;
+
+  if (!log_ratelimit_pass(rl, &suppressed)) {
+    return;
+  }
+  if (suppressed) {
+    vde_log(priority, "%s:%d: %u messages suppressed", file, line,
+            suppressed);
+  }
+
+  va_start (arg, format);
+  vvde_log(priority, format, arg);
+  va_end (arg);
+}
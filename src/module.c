@@ -21,6 +21,7 @@
 
 #include <dlfcn.h>
 #include <errno.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -29,35 +30,49 @@
 // defined here, including contex.h would required module.h in turn
 extern int vde_context_register_module(vde_context *ctx, vde_module *module);
 
+// index file names, the temporary one is renamed over the index once written
+#define MODULES_INDEX VDE_MODULES_INDEX
+#define MODULES_INDEX_TMP VDE_MODULES_INDEX ".tmp"
+
+// kind names used in the index and in configurations
+static const char *module_kinds[] = {
+  [VDE_ENGINE] = "engine",
+  [VDE_TRANSPORT] = "transport",
+  [VDE_CONNECTION_MANAGER] = "conn_manager",
+};
+#define MODULE_KINDS (sizeof(module_kinds) / sizeof(module_kinds[0]))
+
 /**
- * @brief Try loading a vde_module from path and register to context
+ * @brief Open a module file and look up its vde_module
  *
- * @param ctx The context to register the module in
  * @param path The path to a file to load the module from
+ * @param handle Where to store the dlopen() handle, to be closed by the caller
+ * @param quiet Don't warn if path is not a module, the caller reports it
  *
- * @return 0 on success, -1 on error (and errno set appropriately)
+ * @return the vde_module found in path, NULL on error (and errno set
+ * appropriately, ENOENT if path is not a module)
  */
-static int module_try_load(vde_context *ctx, char *path)
+static vde_module *module_open(const char *path, void **handle, int quiet)
 {
-  void *handle;
-  int rv = 0, tmp_errno;
   char *last_dlerror;
   vde_module *mod;
+  int tmp_errno;
 
-  handle = dlopen(path, RTLD_LAZY | RTLD_GLOBAL);
-  if (!handle) {
+  *handle = dlopen(path, RTLD_LAZY | RTLD_GLOBAL);
+  if (!*handle) {
     vde_warning("%s: dlopen error: %s", __PRETTY_FUNCTION__, dlerror());
     errno = EINVAL;
-    return -1;
+    return NULL;
   }
 
   dlerror(); // reset error
-  mod = (vde_module *)dlsym(handle, VDE_MODULE_START_S);
+  mod = (vde_module *)dlsym(*handle, VDE_MODULE_START_S);
   last_dlerror = dlerror();
   if (last_dlerror) {
-    vde_warning("%s: dlsym error: %s", __PRETTY_FUNCTION__, last_dlerror);
+    if (!quiet) {
+      vde_warning("%s: dlsym error: %s", __PRETTY_FUNCTION__, last_dlerror);
+    }
     errno = ENOENT;
-    rv = -1;
     goto cleanup;
   }
 
@@ -65,59 +80,293 @@ static int module_try_load(vde_context *ctx, char *path)
     vde_warning("%s: symbol %s is NULL", __PRETTY_FUNCTION__,
                 VDE_MODULE_START_S);
     errno = EINVAL;
-    rv = -1;
     goto cleanup;
   }
 
-  rv = vde_context_register_module(ctx, mod);
-  if (rv) {
+  if (vde_module_get_kind(mod) >= MODULE_KINDS ||
+      vde_module_get_family(mod) == NULL) {
+    vde_warning("%s: invalid kind or family in %s", __PRETTY_FUNCTION__,
+                path);
+    errno = EINVAL;
+    goto cleanup;
+  }
+
+  return mod;
+
+cleanup:
+  tmp_errno = errno;
+  dlclose(*handle);
+  *handle = NULL;
+  errno = tmp_errno;
+  return NULL;
+}
+
+/**
+ * @brief Try loading a vde_module from path and register to context
+ *
+ * @param path The path to a file to load the module from
+ * @param arg The context to register the module in
+ *
+ * @return 0 on success, -1 on error (and errno set appropriately)
+ */
+static int module_try_load(const char *path, void *arg)
+{
+  vde_context *ctx = (vde_context *)arg;
+  void *handle;
+  int tmp_errno;
+  vde_module *mod;
+
+  mod = module_open(path, &handle, 0);
+  if (!mod) {
+    return -1;
+  }
+
+  if (vde_context_register_module(ctx, mod)) {
     tmp_errno = errno;
     vde_error("%s: unable to register module to context", __PRETTY_FUNCTION__);
+    dlclose(handle);
     errno = tmp_errno;
-    rv = -1;
-    goto cleanup;
+    return -1;
   }
 
   mod->dlhandle = handle;
-  rv = 0;
-  goto exit;
+  return 0;
+}
+
+const char *vde_module_kind_to_string(vde_component_kind kind)
+{
+  vde_assert(kind < MODULE_KINDS);
+
+  return module_kinds[kind];
+}
+
+int vde_module_kind_from_string(const char *name, vde_component_kind *kind)
+{
+  unsigned int i;
+
+  for (i = 0; i < MODULE_KINDS; i++) {
+    if (strcmp(name, module_kinds[i]) == 0) {
+      *kind = i;
+      return 0;
+    }
+  }
+  errno = EINVAL;
+  return -1;
+}
+
+int vde_module_check(vde_module *module)
+{
+  const char *family = vde_module_get_family(module);
+  component_ops *module_cops;
+
+  // module's kind ops sanity checks
+  switch (vde_module_get_kind(module)) {
+    case VDE_CONNECTION_MANAGER:
+      if (vde_module_get_cm_connect(module) == NULL ||
+          vde_module_get_cm_listen(module) == NULL) {
+        vde_error("%s: invalid conn_manager ops in %s", __PRETTY_FUNCTION__,
+                  family);
+        goto err_einval;
+      }
+      break;
+    case VDE_ENGINE:
+      if (vde_module_get_eng_new_conn(module) == NULL) {
+        vde_error("%s: invalid engine ops in %s", __PRETTY_FUNCTION__,
+                  family);
+        goto err_einval;
+      }
+      break;
+    case VDE_TRANSPORT:
+      if (vde_module_get_tr_connect(module) == NULL ||
+          vde_module_get_tr_listen(module) == NULL) {
+        vde_error("%s: invalid transport ops in %s", __PRETTY_FUNCTION__,
+                  family);
+        goto err_einval;
+      }
+      break;
+  }
+
+  // module's component_ops sanity checks
+  module_cops = vde_module_get_component_ops(module);
+  if (module_cops == NULL ||
+      module_cops->init == NULL ||
+      module_cops->fini == NULL) {
+    vde_error("%s: invalid component ops struct found", __PRETTY_FUNCTION__);
+    goto err_einval;
+  }
+
+  return 0;
+
+err_einval:
+  errno = EINVAL;
+  return -1;
+}
+
+/*
+ * Lazy modules
+ *
+ */
+
+vde_module *vde_module_stub_new(vde_component_kind kind, const char *family,
+                                const char *path)
+{
+  vde_module *stub;
+
+  stub = (vde_module *)vde_calloc(sizeof(vde_module));
+  stub->kind = kind;
+  stub->family = vde_strdup(family);
+  stub->path = vde_strdup(path);
+  return stub;
+}
+
+void vde_module_stub_delete(vde_module *stub)
+{
+  vde_assert(stub->path != NULL);
+
+  vde_free(stub->family);
+  vde_free(stub->path);
+  vde_free(stub);
+}
+
+int vde_module_resolve(vde_module *stub)
+{
+  void *handle;
+  vde_module *mod;
+  int tmp_errno;
+
+  vde_assert(stub->path != NULL);
+
+  if (stub->dlhandle) {
+    return 0;
+  }
+
+  vde_debug("loading module %s", stub->path);
+  mod = module_open(stub->path, &handle, 0);
+  if (!mod) {
+    tmp_errno = errno;
+    vde_error("%s: cannot load %s for module %d %s", __PRETTY_FUNCTION__,
+              stub->path, stub->kind, stub->family);
+    errno = tmp_errno;
+    return -1;
+  }
+
+  if (vde_module_get_kind(mod) != stub->kind ||
+      strcmp(vde_module_get_family(mod), stub->family)) {
+    vde_error("%s: %s does not provide module %d %s, stale index?",
+              __PRETTY_FUNCTION__, stub->path, stub->kind, stub->family);
+    errno = ENOENT;
+    goto cleanup;
+  }
+
+  if (vde_module_check(mod)) {
+    goto cleanup;
+  }
+
+  stub->cops = mod->cops;
+  stub->cm_connect = mod->cm_connect;
+  stub->cm_listen = mod->cm_listen;
+  stub->eng_new_conn = mod->eng_new_conn;
+  stub->tr_connect = mod->tr_connect;
+  stub->tr_listen = mod->tr_listen;
+  stub->dlhandle = handle;
+  return 0;
 
 cleanup:
   tmp_errno = errno;
   dlclose(handle);
   errno = tmp_errno;
-exit:
-  return rv;
+  return -1;
 }
 
-#ifdef VDE_DEFAULT_MODULES_PATH
-char *default_modules_path[] = VDE_DEFAULT_MODULES_PATH;
-#else
-char *default_modules_path[] = {".", NULL};
-#endif
+/**
+ * @brief Register a stub for every module listed in the index of dir
+ *
+ * Every line of the index is "kind family file", file being relative to dir
+ * unless absolute. Empty lines and lines starting with '#' are skipped, as
+ * are invalid lines.
+ *
+ * @param ctx The context to register stubs into
+ * @param dir The modules directory
+ *
+ * @return 0 on success, -1 if the index cannot be read (and errno set
+ * appropriately)
+ */
+static int modules_index_load(vde_context *ctx, const char *dir)
+{
+  FILE *index;
+  char *index_path, *line = NULL, *kind_name, *family, *file, *save, *path;
+  size_t line_size = 0;
+  unsigned int lineno = 0;
+  vde_component_kind kind;
+  vde_module *stub;
+  int tmp_errno;
 
-// XXX move this elsewhere?
-char **vde_modules_default_path() {
-  return default_modules_path;
+  index_path = vde_strdup_printf("%s/%s", dir, MODULES_INDEX);
+  index = fopen(index_path, "r");
+  if (!index) {
+    tmp_errno = errno;
+    vde_free(index_path);
+    errno = tmp_errno;
+    return -1;
+  }
+
+  while (getline(&line, &line_size, index) != -1) {
+    lineno++;
+    kind_name = strtok_r(line, " \t\n", &save);
+    if (kind_name == NULL || kind_name[0] == '#') {
+      continue;
+    }
+    family = strtok_r(NULL, " \t\n", &save);
+    file = strtok_r(NULL, " \t\n", &save);
+    if (family == NULL || file == NULL ||
+        vde_module_kind_from_string(kind_name, &kind)) {
+      vde_warning("%s: invalid entry at %s:%u", __PRETTY_FUNCTION__,
+                  index_path, lineno);
+      continue;
+    }
+
+    if (file[0] == '/') {
+      path = vde_strdup(file);
+    } else {
+      path = vde_strdup_printf("%s/%s", dir, file);
+    }
+    stub = vde_module_stub_new(kind, family, path);
+    vde_free(path);
+    // modules from an earlier directory take precedence, as when scanning
+    if (vde_context_register_module(ctx, stub)) {
+      vde_module_stub_delete(stub);
+    }
+  }
+
+  free(line);
+  fclose(index);
+  vde_free(index_path);
+  return 0;
 }
 
-int vde_modules_load(vde_context *ctx, char **path)
+/**
+ * @brief Call fn on every module file found in dir
+ *
+ * @param dir The directory to scan, subdirectories are not examined
+ * @param fn The function to call with the path of every module
+ * @param arg Private data for fn
+ *
+ * @return 0 on success, -1 on error (and errno set appropriately)
+ */
+static int modules_scan(const char *dir, int (*fn)(const char *, void *),
+                        void *arg)
 {
   FTS *ftsp;
   FTSENT *p;
+  char *path[] = {(char *)dir, NULL};
 
   // symlinks in root path are followed
   // follow symlinks
   // don't chdir
   // don't stat
   int fts_options = FTS_COMFOLLOW | FTS_LOGICAL | FTS_NOCHDIR | FTS_NOSTAT;
-  int rv = 0;
   int tmp_errno;
 
-  if (!path) {
-    path = vde_modules_default_path();
-  }
-
   ftsp = fts_open(path, fts_options, NULL);
   if (!ftsp) {
     tmp_errno = errno;
@@ -137,7 +386,7 @@ int vde_modules_load(vde_context *ctx, char **path)
         vde_debug("loading module %s", p->fts_path);
 
         // XXX define semantics for final rv, see include/vde3/module.h
-        module_try_load(ctx, p->fts_path);
+        fn(p->fts_path, arg);
       }
       break;
     case FTS_ERR:
@@ -166,6 +415,131 @@ int vde_modules_load(vde_context *ctx, char **path)
     return -1;
   }
 
-  return rv;
+  return 0;
+}
+
+#ifdef VDE_DEFAULT_MODULES_PATH
+char *default_modules_path[] = VDE_DEFAULT_MODULES_PATH;
+#else
+char *default_modules_path[] = {".", NULL};
+#endif
+
+// XXX move this elsewhere?
+char **vde_modules_default_path() {
+  return default_modules_path;
+}
+
+int vde_modules_load(vde_context *ctx, char **path)
+{
+  char **dir;
+
+  if (!path) {
+    path = vde_modules_default_path();
+  }
+
+  for (dir = path; *dir != NULL; dir++) {
+    if (modules_index_load(ctx, *dir) == 0) {
+      continue;
+    }
+    if (errno != ENOENT) {
+      vde_warning("%s: cannot read index in %s, scanning: %s",
+                  __PRETTY_FUNCTION__, *dir, strerror(errno));
+    }
+    if (modules_scan(*dir, module_try_load, ctx)) {
+      return -1;
+    }
+  }
+
+  return 0;
 }
 
+// index being written, modules which cannot be opened are counted in errors
+// while shared objects not exporting VDE_MODULE_START_S are skipped
+struct index_writer {
+  FILE *index;
+  unsigned int errors;
+};
+
+/**
+ * @brief Append the index entry of a module file
+ *
+ * @param path The path of the module file
+ * @param arg The index_writer
+ *
+ * @return 0 on success, -1 on error (and errno set appropriately)
+ */
+static int module_index_entry(const char *path, void *arg)
+{
+  struct index_writer *writer = (struct index_writer *)arg;
+  const char *file;
+  void *handle;
+  vde_module *mod;
+
+  mod = module_open(path, &handle, 1);
+  if (!mod && errno == ENOENT) {
+    // e.g. libvde itself when indexing the build directory
+    vde_debug("%s: %s is not a module, skipped", __PRETTY_FUNCTION__, path);
+    return 0;
+  }
+  if (!mod) {
+    writer->errors++;
+    return -1;
+  }
+
+  file = strrchr(path, '/');
+  file = file ? file + 1 : path;
+  fprintf(writer->index, "%s %s %s\n",
+          vde_module_kind_to_string(vde_module_get_kind(mod)),
+          vde_module_get_family(mod), file);
+
+  dlclose(handle);
+  return 0;
+}
+
+int vde_modules_write_index(const char *dir)
+{
+  struct index_writer writer = { NULL, 0 };
+  FILE *index;
+  char *index_path, *tmp_path;
+  int rv = -1, tmp_errno;
+
+  index_path = vde_strdup_printf("%s/%s", dir, MODULES_INDEX);
+  tmp_path = vde_strdup_printf("%s/%s", dir, MODULES_INDEX_TMP);
+
+  index = fopen(tmp_path, "w");
+  if (!index) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create %s: %s", __PRETTY_FUNCTION__, tmp_path,
+              strerror(errno));
+    errno = tmp_errno;
+    goto out;
+  }
+
+  fprintf(index, "# vde3 modules index: kind family file\n");
+  writer.index = index;
+  if (modules_scan(dir, module_index_entry, &writer) || writer.errors) {
+    // an index missing a module would hide it, leave the directory unindexed
+    tmp_errno = writer.errors ? EINVAL : errno;
+    vde_error("%s: cannot index every module in %s", __PRETTY_FUNCTION__, dir);
+    fclose(index);
+    unlink(tmp_path);
+    unlink(index_path);
+    errno = tmp_errno;
+    goto out;
+  }
+
+  if (fclose(index) || rename(tmp_path, index_path)) {
+    tmp_errno = errno;
+    vde_error("%s: cannot write %s: %s", __PRETTY_FUNCTION__, index_path,
+              strerror(errno));
+    unlink(tmp_path);
+    errno = tmp_errno;
+    goto out;
+  }
+  rv = 0;
+
+out:
+  vde_free(tmp_path);
+  vde_free(index_path);
+  return rv;
+}
@@ -0,0 +1,67 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/context.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+
+vde_pkt *vde_pkt_new(vde_context *ctx, unsigned int payload_sz,
+                     unsigned int head, unsigned int tail)
+{
+  unsigned int data_sz = sizeof(vde_hdr) + head + payload_sz + tail;
+  vde_pkt *pkt;
+
+  vde_assert(ctx != NULL);
+
+  pkt = (vde_pkt *)vde_pool_alloc(vde_context_get_pool(ctx),
+                                  sizeof(vde_pkt) + data_sz);
+  if (pkt == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  vde_pkt_layout(pkt, data_sz, head, tail);
+  memset(pkt->hdr, 0, sizeof(vde_hdr));
+  pkt->refcount = 1;
+  return pkt;
+}
+
+vde_pkt *vde_pkt_dup(vde_context *ctx, vde_pkt *pkt)
+{
+  vde_pkt *dup;
+  unsigned int head_sz = pkt->payload - pkt->head;
+  // not relative to data, which is unused by views
+  unsigned int tail_sz = pkt->head + pkt->data_size - sizeof(vde_hdr)
+                         - pkt->tail;
+
+  vde_assert(ctx != NULL);
+
+  dup = (vde_pkt *)vde_pool_alloc(vde_context_get_pool(ctx),
+                                  sizeof(vde_pkt) + pkt->data_size);
+  if (dup == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  vde_pkt_layout(dup, pkt->data_size, head_sz, tail_sz);
+  memcpy(dup->hdr, pkt->hdr, sizeof(vde_hdr));
+  memcpy(dup->payload, pkt->payload, pkt->hdr->pkt_len);
+  dup->refcount = 1;
+  dup->ts = pkt->ts;
+  return dup;
+}
@@ -0,0 +1,287 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <string.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/pool.h>
+
+/*
+ * Chunk sizes served by the pool (usable size, header excluded).
+ * 2048 fits the vde2 transport queued packet (a full ethernet frame plus vde
+ * header and head space), the larger ones are for jumbo frames.
+ */
+static const size_t pool_class_sizes[] = {
+  256,
+  1024,
+  2048,
+  4096,
+  VDE_POOL_MAX_CHUNK,
+};
+#define POOL_NUM_CLASSES (sizeof(pool_class_sizes) / sizeof(size_t))
+
+#define POOL_DEFAULT_LOW_WM 0
+#define POOL_DEFAULT_HIGH_WM 4096
+
+struct pool_class;
+
+/*
+ * Header prepended to every chunk: while the chunk is cached it links the free
+ * list, while it is in use it points to the class it must be returned to. The
+ * long double member keeps the user memory suitably aligned.
+ */
+typedef union pool_chunk {
+  union pool_chunk *next;
+  struct pool_class *cls;
+  long double align;
+} pool_chunk;
+
+typedef struct pool_class {
+  size_t size;
+  unsigned int low_wm;
+  unsigned int high_wm;
+  pool_chunk *free_list;
+  vde_pool_stats stats;
+} pool_class;
+
+struct vde_pool {
+  pool_class classes[POOL_NUM_CLASSES];
+  // oversized requests, size is zero and free list is never used
+  pool_class oversize;
+};
+
+static inline pool_class *pool_lookup_class(vde_pool *pool, size_t size)
+{
+  unsigned int i;
+
+  for (i = 0; i < POOL_NUM_CLASSES; i++) {
+    if (size <= pool->classes[i].size) {
+      return &pool->classes[i];
+    }
+  }
+  return NULL;
+}
+
+static inline void pool_class_account_alloc(pool_class *cls)
+{
+  cls->stats.allocs++;
+  cls->stats.in_use++;
+  if (cls->stats.in_use > cls->stats.peak_in_use) {
+    cls->stats.peak_in_use = cls->stats.in_use;
+  }
+}
+
+static int pool_class_fill(pool_class *cls, unsigned int count)
+{
+  pool_chunk *chunk;
+
+  while (cls->stats.cached < count) {
+    chunk = (pool_chunk *)vde_alloc(sizeof(pool_chunk) + cls->size);
+    if (chunk == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    chunk->next = cls->free_list;
+    cls->free_list = chunk;
+    cls->stats.cached++;
+  }
+  return 0;
+}
+
+static void pool_class_drain(pool_class *cls, unsigned int count)
+{
+  pool_chunk *chunk;
+
+  while (cls->stats.cached > count) {
+    chunk = cls->free_list;
+    cls->free_list = chunk->next;
+    cls->stats.cached--;
+    vde_free(chunk);
+  }
+}
+
+vde_pool *vde_pool_new()
+{
+  unsigned int i;
+  vde_pool *pool;
+
+  pool = (vde_pool *)vde_calloc(sizeof(vde_pool));
+  if (pool == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  for (i = 0; i < POOL_NUM_CLASSES; i++) {
+    pool->classes[i].size = pool_class_sizes[i];
+    pool->classes[i].low_wm = POOL_DEFAULT_LOW_WM;
+    pool->classes[i].high_wm = POOL_DEFAULT_HIGH_WM;
+  }
+
+  return pool;
+}
+
+void vde_pool_delete(vde_pool *pool)
+{
+  unsigned int i;
+
+  vde_assert(pool != NULL);
+
+  for (i = 0; i < POOL_NUM_CLASSES; i++) {
+    if (pool->classes[i].stats.in_use) {
+      vde_warning("%s: deleting pool with %lu chunks of size %zu in use",
+                  __PRETTY_FUNCTION__, pool->classes[i].stats.in_use,
+                  pool->classes[i].size);
+    }
+    pool_class_drain(&pool->classes[i], 0);
+  }
+
+  vde_free(pool);
+}
+
+void *vde_pool_alloc(vde_pool *pool, size_t size)
+{
+  pool_class *cls;
+  pool_chunk *chunk;
+
+  vde_assert(pool != NULL);
+
+  cls = pool_lookup_class(pool, size);
+  if (cls == NULL) {
+    chunk = (pool_chunk *)vde_alloc(sizeof(pool_chunk) + size);
+    if (chunk == NULL) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    pool->oversize.stats.misses++;
+    pool_class_account_alloc(&pool->oversize);
+    chunk->cls = &pool->oversize;
+    return chunk + 1;
+  }
+
+  chunk = cls->free_list;
+  if (chunk != NULL) {
+    cls->free_list = chunk->next;
+    cls->stats.cached--;
+    cls->stats.hits++;
+  } else {
+    chunk = (pool_chunk *)vde_alloc(sizeof(pool_chunk) + cls->size);
+    if (chunk == NULL) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    cls->stats.misses++;
+  }
+  pool_class_account_alloc(cls);
+  chunk->cls = cls;
+
+  return chunk + 1;
+}
+
+void vde_pool_free(void *ptr)
+{
+  pool_chunk *chunk;
+  pool_class *cls;
+
+  if (ptr == NULL) {
+    return;
+  }
+
+  chunk = (pool_chunk *)ptr - 1;
+  cls = chunk->cls;
+
+  vde_assert(cls != NULL);
+  vde_assert(cls->stats.in_use > 0);
+
+  cls->stats.frees++;
+  cls->stats.in_use--;
+
+  // oversized chunks have size zero and a zero high watermark
+  if (cls->stats.cached >= cls->high_wm) {
+    cls->stats.releases++;
+    vde_free(chunk);
+    return;
+  }
+
+  chunk->next = cls->free_list;
+  cls->free_list = chunk;
+  cls->stats.cached++;
+}
+
+int vde_pool_set_watermarks(vde_pool *pool, size_t size, unsigned int low,
+                            unsigned int high)
+{
+  pool_class *cls;
+
+  vde_assert(pool != NULL);
+
+  if (low > high) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  cls = pool_lookup_class(pool, size);
+  if (cls == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  cls->low_wm = low;
+  cls->high_wm = high;
+
+  pool_class_drain(cls, high);
+  return pool_class_fill(cls, low);
+}
+
+void vde_pool_trim(vde_pool *pool)
+{
+  unsigned int i;
+
+  vde_assert(pool != NULL);
+
+  for (i = 0; i < POOL_NUM_CLASSES; i++) {
+    pool_class_drain(&pool->classes[i], pool->classes[i].low_wm);
+  }
+}
+
+unsigned int vde_pool_num_classes(vde_pool *pool)
+{
+  return POOL_NUM_CLASSES;
+}
+
+int vde_pool_get_stats(vde_pool *pool, unsigned int idx, size_t *size,
+                       vde_pool_stats *stats)
+{
+  pool_class *cls;
+
+  vde_assert(pool != NULL);
+  vde_assert(stats != NULL);
+
+  if (idx > POOL_NUM_CLASSES) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  cls = (idx == POOL_NUM_CLASSES) ? &pool->oversize : &pool->classes[idx];
+  if (size) {
+    *size = cls->size;
+  }
+  memcpy(stats, &cls->stats, sizeof(vde_pool_stats));
+
+  return 0;
+}
@@ -0,0 +1,612 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/packet.h>
+#include <vde3/qdisc.h>
+
+#define DEFAULT_TARGET_MS 5
+#define DEFAULT_INTERVAL_MS 100
+#define DEFAULT_FLOWS 1024
+#define DEFAULT_QUANTUM sizeof(struct eth_frame)
+#define MAX_FLOWS 65536
+#define MAX_QUANTUM 65536
+#define MS 1000000ULL
+
+/*
+ * A codel queue does not drop while less than a full frame is queued, the
+ * link is not the bottleneck then.
+ */
+#define CODEL_MIN_BYTES sizeof(struct eth_frame)
+
+uint64_t vde_qdisc_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Plain list of entries, shared by every discipline
+ */
+
+typedef struct {
+  vde_qentry *head;
+  vde_qentry *tail;
+  unsigned int bytes;
+} qlist;
+
+static inline void qlist_push(qlist *list, vde_qentry *entry)
+{
+  entry->next = NULL;
+  if (list->tail != NULL) {
+    list->tail->next = entry;
+  } else {
+    list->head = entry;
+  }
+  list->tail = entry;
+  list->bytes += entry->pkt->hdr->pkt_len;
+}
+
+static inline vde_qentry *qlist_pop(qlist *list)
+{
+  vde_qentry *entry = list->head;
+
+  if (entry != NULL) {
+    list->head = entry->next;
+    if (list->head == NULL) {
+      list->tail = NULL;
+    }
+    list->bytes -= entry->pkt->hdr->pkt_len;
+  }
+  return entry;
+}
+
+// append every entry of src to dst, src is left empty
+static inline void qlist_splice(qlist *dst, qlist *src)
+{
+  if (src->head == NULL) {
+    return;
+  }
+  if (dst->tail != NULL) {
+    dst->tail->next = src->head;
+  } else {
+    dst->head = src->head;
+  }
+  dst->tail = src->tail;
+  dst->bytes += src->bytes;
+  memset(src, 0, sizeof(qlist));
+}
+
+/*
+ * fifo: the historical behaviour, packets are never dropped once queued
+ */
+
+static int fifo_init(vde_qdisc *qdisc)
+{
+  qdisc->priv = vde_calloc(sizeof(qlist));
+  if (qdisc->priv == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+static void fifo_fini(vde_qdisc *qdisc)
+{
+  vde_free(qdisc->priv);
+}
+
+static void fifo_enqueue(vde_qdisc *qdisc, vde_qentry *entry)
+{
+  qlist_push((qlist *)qdisc->priv, entry);
+}
+
+static vde_qentry *fifo_dequeue(vde_qdisc *qdisc, uint64_t now)
+{
+  return qlist_pop((qlist *)qdisc->priv);
+}
+
+static vde_qentry *fifo_purge(vde_qdisc *qdisc)
+{
+  qlist *list = (qlist *)qdisc->priv;
+  vde_qentry *entries = list->head;
+
+  memset(list, 0, sizeof(qlist));
+  return entries;
+}
+
+/*
+ * codel, as in the pseudocode of RFC 8289: once packets have been queued for
+ * more than target during a whole interval the head is dropped, and then
+ * again at intervals shrinking with the square root of the drop count until
+ * the sojourn time is back below target.
+ */
+
+typedef struct {
+  uint64_t first_above; //!< when the sojourn time may start to be too high
+  uint64_t drop_next; //!< when the next packet will be dropped
+  unsigned int count; //!< drops since entering the dropping state
+  unsigned int lastcount; //!< count when the dropping state was last left
+  int dropping;
+} codel_vars;
+
+typedef struct {
+  qlist list;
+  codel_vars vars;
+} codel_queue;
+
+// integer square root, by bits
+static uint64_t isqrt(uint64_t x)
+{
+  uint64_t r = 0, bit = 1ULL << 62;
+
+  while (bit > x) {
+    bit >>= 2;
+  }
+  while (bit != 0) {
+    if (x >= r + bit) {
+      x -= r + bit;
+      r = (r >> 1) + bit;
+    } else {
+      r >>= 1;
+    }
+    bit >>= 2;
+  }
+  return r;
+}
+
+// t + interval / sqrt(count), sqrt is scaled by 1024 to keep the precision
+static inline uint64_t codel_control_law(vde_qdisc *qdisc, uint64_t t,
+                                         unsigned int count)
+{
+  return t + (qdisc->conf.interval_ns << 10) /
+             isqrt((uint64_t)count << 20);
+}
+
+static vde_qentry *codel_do_dequeue(vde_qdisc *qdisc, codel_queue *cq,
+                                    uint64_t now, int *ok_to_drop)
+{
+  vde_qentry *entry = qlist_pop(&cq->list);
+  codel_vars *vars = &cq->vars;
+
+  *ok_to_drop = 0;
+  if (entry == NULL) {
+    vars->first_above = 0;
+    return NULL;
+  }
+  if (now < entry->enqueue_ns + qdisc->conf.target_ns ||
+      cq->list.bytes <= CODEL_MIN_BYTES) {
+    vars->first_above = 0;
+  } else if (vars->first_above == 0) {
+    vars->first_above = now + qdisc->conf.interval_ns;
+  } else if (now >= vars->first_above) {
+    *ok_to_drop = 1;
+  }
+  return entry;
+}
+
+static vde_qentry *codel_queue_dequeue(vde_qdisc *qdisc, codel_queue *cq,
+                                       uint64_t now)
+{
+  int ok_to_drop;
+  unsigned int delta;
+  codel_vars *vars = &cq->vars;
+  vde_qentry *entry = codel_do_dequeue(qdisc, cq, now, &ok_to_drop);
+
+  if (entry == NULL) {
+    vars->dropping = 0;
+    return NULL;
+  }
+
+  if (vars->dropping) {
+    if (!ok_to_drop) {
+      vars->dropping = 0;
+    }
+    while (vars->dropping && now >= vars->drop_next) {
+      vde_qdisc_drop(qdisc, entry);
+      vars->count++;
+      entry = codel_do_dequeue(qdisc, cq, now, &ok_to_drop);
+      if (entry == NULL || !ok_to_drop) {
+        vars->dropping = 0;
+      } else {
+        vars->drop_next = codel_control_law(qdisc, vars->drop_next,
+                                            vars->count);
+      }
+    }
+  } else if (ok_to_drop) {
+    vde_qdisc_drop(qdisc, entry);
+    entry = codel_do_dequeue(qdisc, cq, now, &ok_to_drop);
+    vars->dropping = 1;
+    // restart close to the previous drop rate if the queue went back under
+    // control only shortly ago
+    delta = vars->count - vars->lastcount;
+    if (delta > 1 &&
+        (int64_t)(now - vars->drop_next) <
+        (int64_t)(16 * qdisc->conf.interval_ns)) {
+      vars->count = delta;
+    } else {
+      vars->count = 1;
+    }
+    vars->drop_next = codel_control_law(qdisc, now, vars->count);
+    vars->lastcount = vars->count;
+  }
+  return entry;
+}
+
+static int codel_init(vde_qdisc *qdisc)
+{
+  qdisc->priv = vde_calloc(sizeof(codel_queue));
+  if (qdisc->priv == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+static void codel_enqueue(vde_qdisc *qdisc, vde_qentry *entry)
+{
+  qlist_push(&((codel_queue *)qdisc->priv)->list, entry);
+}
+
+static vde_qentry *codel_dequeue(vde_qdisc *qdisc, uint64_t now)
+{
+  return codel_queue_dequeue(qdisc, (codel_queue *)qdisc->priv, now);
+}
+
+static vde_qentry *codel_purge(vde_qdisc *qdisc)
+{
+  codel_queue *cq = (codel_queue *)qdisc->priv;
+  vde_qentry *entries = cq->list.head;
+
+  memset(cq, 0, sizeof(codel_queue));
+  return entries;
+}
+
+/*
+ * fq: packets are hashed by source and destination MAC address into flows,
+ * each flow is a codel queue. Flows are served by deficit round robin, flows
+ * which just became active are served before the others so that sparse
+ * flows (ARP, DNS, interactive sessions) are not queued behind bulk ones.
+ */
+
+typedef struct fq_flow fq_flow;
+
+struct fq_flow {
+  codel_queue cq;
+  int deficit;
+  int listed; //!< in new_flows or old_flows
+  fq_flow *next;
+};
+
+typedef struct {
+  fq_flow *head;
+  fq_flow *tail;
+} fq_flow_list;
+
+typedef struct {
+  fq_flow *flows;
+  fq_flow_list new_flows;
+  fq_flow_list old_flows;
+} fq_sched;
+
+static inline void fq_list_push(fq_flow_list *list, fq_flow *flow)
+{
+  flow->next = NULL;
+  if (list->tail != NULL) {
+    list->tail->next = flow;
+  } else {
+    list->head = flow;
+  }
+  list->tail = flow;
+}
+
+static inline void fq_list_pop(fq_flow_list *list)
+{
+  list->head = list->head->next;
+  if (list->head == NULL) {
+    list->tail = NULL;
+  }
+}
+
+static inline fq_flow *fq_classify(vde_qdisc *qdisc, fq_sched *sched,
+                                   vde_pkt *pkt)
+{
+  uint64_t key = 0;
+  uint32_t tail = 0;
+
+  // destination and source address, mixed with fibonacci hashing
+  if (pkt->hdr->pkt_len >= 2 * ETH_ALEN) {
+    memcpy(&key, pkt->payload, sizeof(uint64_t));
+    memcpy(&tail, pkt->payload + sizeof(uint64_t), sizeof(uint32_t));
+    key = (key * 0x9e3779b97f4a7c15ULL) ^ tail;
+    key = key * 0x9e3779b97f4a7c15ULL;
+  }
+  return &sched->flows[(key >> 32) & (qdisc->conf.flows - 1)];
+}
+
+static int fq_init(vde_qdisc *qdisc)
+{
+  fq_sched *sched = (fq_sched *)vde_calloc(sizeof(fq_sched));
+
+  if (sched == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  sched->flows = (fq_flow *)vde_calloc(qdisc->conf.flows * sizeof(fq_flow));
+  if (sched->flows == NULL) {
+    vde_free(sched);
+    errno = ENOMEM;
+    return -1;
+  }
+  qdisc->priv = sched;
+  return 0;
+}
+
+static void fq_fini(vde_qdisc *qdisc)
+{
+  fq_sched *sched = (fq_sched *)qdisc->priv;
+
+  vde_free(sched->flows);
+  vde_free(sched);
+}
+
+static void fq_enqueue(vde_qdisc *qdisc, vde_qentry *entry)
+{
+  fq_sched *sched = (fq_sched *)qdisc->priv;
+  fq_flow *flow = fq_classify(qdisc, sched, entry->pkt);
+
+  qlist_push(&flow->cq.list, entry);
+  if (!flow->listed) {
+    flow->listed = 1;
+    flow->deficit = qdisc->conf.quantum;
+    fq_list_push(&sched->new_flows, flow);
+  }
+}
+
+static vde_qentry *fq_dequeue(vde_qdisc *qdisc, uint64_t now)
+{
+  fq_sched *sched = (fq_sched *)qdisc->priv;
+  fq_flow_list *list;
+  fq_flow *flow;
+  vde_qentry *entry;
+
+  for (;;) {
+    if (sched->new_flows.head != NULL) {
+      list = &sched->new_flows;
+    } else if (sched->old_flows.head != NULL) {
+      list = &sched->old_flows;
+    } else {
+      return NULL;
+    }
+    flow = list->head;
+
+    if (flow->deficit <= 0) {
+      flow->deficit += qdisc->conf.quantum;
+      fq_list_pop(list);
+      fq_list_push(&sched->old_flows, flow);
+      continue;
+    }
+
+    entry = codel_queue_dequeue(qdisc, &flow->cq, now);
+    if (entry == NULL) {
+      fq_list_pop(list);
+      // a new flow becomes old before leaving, or it would always be served
+      // first by sending a packet at a time
+      if (list == &sched->new_flows && sched->old_flows.head != NULL) {
+        fq_list_push(&sched->old_flows, flow);
+      } else {
+        flow->listed = 0;
+      }
+      continue;
+    }
+    flow->deficit -= entry->pkt->hdr->pkt_len;
+    return entry;
+  }
+}
+
+static vde_qentry *fq_purge(vde_qdisc *qdisc)
+{
+  fq_sched *sched = (fq_sched *)qdisc->priv;
+  fq_flow_list *lists[2] = { &sched->new_flows, &sched->old_flows };
+  fq_flow *flow;
+  qlist all;
+  unsigned int i;
+
+  // flows holding packets are always listed
+  memset(&all, 0, sizeof(qlist));
+  for (i = 0; i < 2; i++) {
+    for (flow = lists[i]->head; flow != NULL; flow = flow->next) {
+      qlist_splice(&all, &flow->cq.list);
+      memset(&flow->cq.vars, 0, sizeof(codel_vars));
+      flow->listed = 0;
+    }
+    memset(lists[i], 0, sizeof(fq_flow_list));
+  }
+  return all.head;
+}
+
+static const vde_qdisc_ops qdisc_ops[] = {
+  {
+    .name = "fifo",
+    .init = fifo_init,
+    .fini = fifo_fini,
+    .enqueue = fifo_enqueue,
+    .dequeue = fifo_dequeue,
+    .purge = fifo_purge,
+  },
+  {
+    .name = "codel",
+    .init = codel_init,
+    .fini = fifo_fini,
+    .enqueue = codel_enqueue,
+    .dequeue = codel_dequeue,
+    .purge = codel_purge,
+  },
+  {
+    .name = "fq",
+    .init = fq_init,
+    .fini = fq_fini,
+    .enqueue = fq_enqueue,
+    .dequeue = fq_dequeue,
+    .purge = fq_purge,
+  },
+};
+#define NUM_QDISCS (sizeof(qdisc_ops) / sizeof(vde_qdisc_ops))
+
+const vde_qdisc_ops *vde_qdisc_ops_lookup(const char *name)
+{
+  unsigned int i;
+
+  for (i = 0; i < NUM_QDISCS; i++) {
+    if (strcmp(qdisc_ops[i].name, name) == 0) {
+      return &qdisc_ops[i];
+    }
+  }
+  return NULL;
+}
+
+static int qdisc_conf_get_int(vde_sobj *params, const char *name, int min,
+                              int max, int *value)
+{
+  vde_sobj *param = vde_sobj_hash_lookup(params, name);
+
+  if (param == NULL) {
+    return 0;
+  }
+  if (!vde_sobj_is_type(param, vde_sobj_type_int) ||
+      vde_sobj_get_int(param) < min || vde_sobj_get_int(param) > max) {
+    vde_error("%s: %s must be an integer between %d and %d",
+              __PRETTY_FUNCTION__, name, min, max);
+    errno = EINVAL;
+    return -1;
+  }
+  *value = vde_sobj_get_int(param);
+  return 0;
+}
+
+int vde_qdisc_conf_parse(vde_sobj *params, vde_qdisc_conf *conf)
+{
+  const char *name;
+  vde_sobj *type;
+  int target = DEFAULT_TARGET_MS, interval = DEFAULT_INTERVAL_MS;
+  int flows = DEFAULT_FLOWS, quantum = DEFAULT_QUANTUM;
+
+  vde_assert(conf != NULL);
+
+  if (params == NULL) {
+    name = "fifo";
+  } else if (vde_sobj_is_type(params, vde_sobj_type_string)) {
+    name = vde_sobj_get_string(params);
+  } else if (vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    type = vde_sobj_hash_lookup(params, "type");
+    if (type == NULL || !vde_sobj_is_type(type, vde_sobj_type_string)) {
+      vde_error("%s: queue discipline type must be a string",
+                __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+    name = vde_sobj_get_string(type);
+    if (qdisc_conf_get_int(params, "target_ms", 1, 10000, &target) ||
+        qdisc_conf_get_int(params, "interval_ms", 1, 100000, &interval) ||
+        qdisc_conf_get_int(params, "flows", 1, MAX_FLOWS, &flows) ||
+        qdisc_conf_get_int(params, "quantum", sizeof(struct eth_hdr),
+                           MAX_QUANTUM, &quantum)) {
+      return -1;
+    }
+    if (flows & (flows - 1)) {
+      vde_error("%s: flows must be a power of two", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+  } else {
+    vde_error("%s: queue discipline must be a string or a hash",
+              __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  conf->ops = vde_qdisc_ops_lookup(name);
+  if (conf->ops == NULL) {
+    vde_error("%s: unknown queue discipline %s", __PRETTY_FUNCTION__, name);
+    errno = EINVAL;
+    return -1;
+  }
+  conf->target_ns = target * MS;
+  conf->interval_ns = interval * MS;
+  conf->flows = flows;
+  conf->quantum = quantum;
+  return 0;
+}
+
+vde_qdisc *vde_qdisc_new(const vde_qdisc_conf *conf,
+                         vde_qdisc_drop_cb drop_cb, void *drop_arg)
+{
+  vde_qdisc *qdisc;
+
+  vde_assert(conf != NULL && conf->ops != NULL);
+  vde_assert(drop_cb != NULL);
+
+  qdisc = (vde_qdisc *)vde_calloc(sizeof(vde_qdisc));
+  if (qdisc == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  qdisc->ops = conf->ops;
+  qdisc->conf = *conf;
+  qdisc->drop_cb = drop_cb;
+  qdisc->drop_arg = drop_arg;
+  if (qdisc->ops->init(qdisc)) {
+    vde_free(qdisc);
+    return NULL;
+  }
+  return qdisc;
+}
+
+void vde_qdisc_delete(vde_qdisc *qdisc, vde_qdisc_drop_cb free_cb, void *arg)
+{
+  vde_qentry *entry, *next;
+
+  vde_assert(qdisc != NULL);
+
+  entry = qdisc->requeued;
+  while (entry != NULL) {
+    next = entry->next;
+    free_cb(entry, arg);
+    entry = next;
+  }
+  entry = qdisc->ops->purge(qdisc);
+  while (entry != NULL) {
+    next = entry->next;
+    free_cb(entry, arg);
+    entry = next;
+  }
+  qdisc->ops->fini(qdisc);
+  vde_free(qdisc);
+}
@@ -0,0 +1,194 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/spsc.h>
+
+#define SPSC_MAX_COUNT (1U << 24)
+
+vde_spsc_ring *vde_spsc_ring_new(unsigned int count, size_t slot_size)
+{
+  unsigned int size = 1;
+  vde_spsc_ring *ring;
+
+  if (count == 0 || count > SPSC_MAX_COUNT || slot_size == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  while (size < count) {
+    size <<= 1;
+  }
+
+  if (posix_memalign((void **)&ring, VDE_CACHELINE_SIZE,
+                     sizeof(vde_spsc_ring))) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  memset(&ring->storage, 0, sizeof(vde_spsc_index));
+  if (vde_spsc_ring_attach(ring, &ring->storage,
+                           vde_calloc(size * slot_size), size, slot_size)) {
+    free(ring);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  return ring;
+}
+
+void vde_spsc_ring_delete(vde_spsc_ring *ring)
+{
+  vde_assert(ring != NULL);
+
+  vde_free(ring->slots);
+  free(ring);
+}
+
+int vde_spsc_ring_attach(vde_spsc_ring *ring, vde_spsc_index *index,
+                         void *slots, unsigned int count, size_t slot_size)
+{
+  vde_assert(ring != NULL);
+
+  if (index == NULL || slots == NULL || count == 0 ||
+      count > SPSC_MAX_COUNT || (count & (count - 1)) || slot_size == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  ring->index = index;
+  ring->slots = (char *)slots;
+  ring->mask = count - 1;
+  ring->slot_size = slot_size;
+  // the other side might have attached and used the counters already
+  ring->head = ring->cached_tail =
+    __atomic_load_n(&index->head, __ATOMIC_ACQUIRE);
+  ring->tail = ring->cached_head =
+    __atomic_load_n(&index->tail, __ATOMIC_ACQUIRE);
+
+  return 0;
+}
+
+#ifdef HAVE_SYS_EVENTFD_H
+
+int vde_doorbell_init(vde_doorbell *db)
+{
+  vde_assert(db != NULL);
+
+  db->rfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (db->rfd == -1) {
+    return -1;
+  }
+  db->wfd = db->rfd;
+  return 0;
+}
+
+void vde_doorbell_fini(vde_doorbell *db)
+{
+  vde_assert(db != NULL);
+
+  close(db->rfd);
+  db->rfd = db->wfd = -1;
+}
+
+void vde_doorbell_ring(vde_doorbell *db)
+{
+  uint64_t one = 1;
+
+  // EAGAIN means the counter is saturated, the other side is woken up anyway
+  if (write(db->wfd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+    vde_warning("%s: cannot ring doorbell: %s", __PRETTY_FUNCTION__,
+                strerror(errno));
+  }
+}
+
+void vde_doorbell_clear(vde_doorbell *db)
+{
+  uint64_t count;
+
+  if (read(db->rfd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+    vde_warning("%s: cannot clear doorbell: %s", __PRETTY_FUNCTION__,
+                strerror(errno));
+  }
+}
+
+#else /* HAVE_SYS_EVENTFD_H */
+
+int vde_doorbell_init(vde_doorbell *db)
+{
+  int fds[2], i;
+
+  vde_assert(db != NULL);
+
+  if (pipe(fds) == -1) {
+    return -1;
+  }
+  for (i = 0; i < 2; i++) {
+    if (fcntl(fds[i], F_SETFL, O_NONBLOCK) == -1 ||
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC) == -1) {
+      close(fds[0]);
+      close(fds[1]);
+      return -1;
+    }
+  }
+  db->rfd = fds[0];
+  db->wfd = fds[1];
+  return 0;
+}
+
+void vde_doorbell_fini(vde_doorbell *db)
+{
+  vde_assert(db != NULL);
+
+  close(db->rfd);
+  close(db->wfd);
+  db->rfd = db->wfd = -1;
+}
+
+void vde_doorbell_ring(vde_doorbell *db)
+{
+  char c = 0;
+
+  // EAGAIN means the pipe is full, the other side is woken up anyway
+  if (write(db->wfd, &c, sizeof(c)) == -1 && errno != EAGAIN) {
+    vde_warning("%s: cannot ring doorbell: %s", __PRETTY_FUNCTION__,
+                strerror(errno));
+  }
+}
+
+void vde_doorbell_clear(vde_doorbell *db)
+{
+  char buf[64];
+
+  while (read(db->rfd, buf, sizeof(buf)) > 0);
+}
+
+#endif /* HAVE_SYS_EVENTFD_H */
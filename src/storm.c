@@ -0,0 +1,188 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/context.h>
+#include <vde3/storm.h>
+
+// frames per second admitted at most for a class
+#define MAX_RATE 10000000
+
+static const char *storm_class_names[VDE_STORM_MAX] = {
+  [VDE_STORM_BROADCAST] = "broadcast",
+  [VDE_STORM_MULTICAST] = "multicast",
+  [VDE_STORM_UNKNOWN] = "unknown",
+};
+
+static void storm_tick_cb(int fd, short events, void *arg)
+{
+  vde_storm *storm = (vde_storm *)arg;
+
+  storm->now++;
+}
+
+void vde_storm_init(vde_storm *storm, vde_context *ctx)
+{
+  vde_assert(storm != NULL);
+
+  memset(storm, 0, sizeof(vde_storm));
+  storm->ctx = ctx;
+}
+
+void vde_storm_fini(vde_storm *storm)
+{
+  if (storm->timeout != NULL) {
+    vde_context_timeout_del(storm->ctx, storm->timeout);
+    storm->timeout = NULL;
+  }
+}
+
+int vde_storm_set(vde_storm *storm, const char *name, int rate, int burst)
+{
+  int i, cls = -1;
+  struct timeval tick;
+
+  for (i = 0; i < VDE_STORM_MAX; i++) {
+    if (strcmp(name, storm_class_names[i]) == 0) {
+      cls = i;
+    }
+  }
+  if (cls == -1) {
+    vde_error("%s: unknown storm control class %s", __PRETTY_FUNCTION__,
+              name);
+    errno = EINVAL;
+    return -1;
+  }
+  if (rate < 0 || rate > MAX_RATE || burst < 0 || burst > MAX_RATE) {
+    vde_error("%s: rate and burst must be between 0 and %d",
+              __PRETTY_FUNCTION__, MAX_RATE);
+    errno = EINVAL;
+    return -1;
+  }
+
+  // the timeout is kept afterwards, a tick costs nothing to idle ports
+  if (rate != 0 && storm->timeout == NULL) {
+    tick.tv_sec = 0;
+    tick.tv_usec = 1000000 / VDE_STORM_HZ;
+    storm->timeout = vde_context_timeout_add(storm->ctx, VDE_EV_PERSIST,
+                                             &tick, &storm_tick_cb,
+                                             (void *)storm);
+    if (storm->timeout == NULL) {
+      vde_error("%s: could not add storm control timeout",
+                __PRETTY_FUNCTION__);
+      return -1;
+    }
+  }
+
+  if (rate != 0 && burst == 0) {
+    burst = rate / 10 ? rate / 10 : 1;
+  }
+  storm->rate[cls] = rate;
+  storm->burst[cls] = burst;
+
+  storm->enabled = 0;
+  for (i = 0; i < VDE_STORM_MAX; i++) {
+    storm->enabled |= storm->rate[i] != 0;
+  }
+  return 0;
+}
+
+int vde_storm_parse(vde_storm *storm, vde_sobj *params)
+{
+  int i, rate, burst;
+  vde_sobj *limit, *param;
+
+  if (!vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    vde_error("%s: storm control must be a hash", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (i = 0; i < VDE_STORM_MAX; i++) {
+    limit = vde_sobj_hash_lookup(params, storm_class_names[i]);
+    if (limit == NULL) {
+      continue;
+    }
+    param = vde_sobj_is_type(limit, vde_sobj_type_hash) ?
+            vde_sobj_hash_lookup(limit, "rate") : NULL;
+    if (param == NULL || !vde_sobj_is_type(param, vde_sobj_type_int)) {
+      vde_error("%s: %s rate must be an integer", __PRETTY_FUNCTION__,
+                storm_class_names[i]);
+      errno = EINVAL;
+      return -1;
+    }
+    rate = vde_sobj_get_int(param);
+    burst = 0;
+    param = vde_sobj_hash_lookup(limit, "burst");
+    if (param) {
+      if (!vde_sobj_is_type(param, vde_sobj_type_int)) {
+        vde_error("%s: %s burst must be an integer", __PRETTY_FUNCTION__,
+                  storm_class_names[i]);
+        errno = EINVAL;
+        return -1;
+      }
+      burst = vde_sobj_get_int(param);
+    }
+    if (vde_storm_set(storm, storm_class_names[i], rate, burst)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+vde_sobj *vde_storm_serialize(vde_storm *storm)
+{
+  int i;
+  vde_sobj *out, *limit;
+
+  out = vde_sobj_new_hash();
+  if (out == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < VDE_STORM_MAX; i++) {
+    limit = vde_sobj_new_hash();
+    if (limit == NULL) {
+      vde_sobj_put(out);
+      return NULL;
+    }
+    vde_sobj_hash_insert(limit, "rate", vde_sobj_new_int(storm->rate[i]));
+    vde_sobj_hash_insert(limit, "burst", vde_sobj_new_int(storm->burst[i]));
+    vde_sobj_hash_insert(limit, "drops", vde_sobj_new_int64(storm->drops[i]));
+    vde_sobj_hash_insert(out, storm_class_names[i], limit);
+  }
+  return out;
+}
+
+void vde_storm_bucket_init(vde_storm *storm, vde_storm_bucket *bucket)
+{
+  int i;
+
+  for (i = 0; i < VDE_STORM_MAX; i++) {
+    bucket->credits[i] = (uint64_t)storm->burst[i] * VDE_STORM_HZ;
+    bucket->last[i] = storm->now;
+  }
+}
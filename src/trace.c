@@ -0,0 +1,75 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/trace.h>
+
+void vde_trace_hist_merge(vde_trace_hist *total, const vde_trace_hist *hist)
+{
+  unsigned int i;
+
+  vde_assert(total != NULL);
+  vde_assert(hist != NULL);
+
+  for (i = 0; i < VDE_TRACE_BUCKETS; i++) {
+    total->buckets[i] += hist->buckets[i];
+  }
+  total->count += hist->count;
+  total->sum_ns += hist->sum_ns;
+  if (hist->max_ns > total->max_ns) {
+    total->max_ns = hist->max_ns;
+  }
+}
+
+vde_sobj *vde_trace_hist_serialize(const vde_trace_hist *hist)
+{
+  unsigned int i;
+  char key[24];
+  vde_sobj *out, *buckets;
+
+  vde_assert(hist != NULL);
+
+  out = vde_sobj_new_hash();
+  buckets = vde_sobj_new_hash();
+  if (out == NULL || buckets == NULL) {
+    vde_sobj_put(out);
+    vde_sobj_put(buckets);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  vde_sobj_hash_insert(out, "count", vde_sobj_new_int64(hist->count));
+  if (hist->count > 0) {
+    vde_sobj_hash_insert(out, "max_ns", vde_sobj_new_int64(hist->max_ns));
+    vde_sobj_hash_insert(out, "mean_ns",
+                         vde_sobj_new_double((double)hist->sum_ns /
+                                             hist->count));
+  }
+  for (i = 0; i < VDE_TRACE_BUCKETS; i++) {
+    if (hist->buckets[i]) {
+      snprintf(key, sizeof(key), "%llu", i ? 1ULL << i : 0ULL);
+      vde_sobj_hash_insert(buckets, key,
+                           vde_sobj_new_int64(hist->buckets[i]));
+    }
+  }
+  vde_sobj_hash_insert(out, "buckets", buckets);
+  return out;
+}
@@ -0,0 +1,901 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/*
+ * Packet transport: plugs a network interface into an engine, either a
+ * physical one through an AF_PACKET socket with TPACKET_V3 memory mapped
+ * rings, or a tap device with a virtio net header and one or more queues.
+ *
+ * A transport holds a single connection, created by listen (and given to the
+ * connection manager accept callback) or by connect.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/if_tun.h>
+#include <linux/virtio_net.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/module.h>
+#include <vde3/connection.h>
+#include <vde3/transport.h>
+#include <vde3/context.h>
+#include <vde3/packet.h>
+
+#define DEFAULT_MAX_PAYLOAD sizeof(struct eth_frame)
+#define MAX_PAYLOAD 65535
+
+// rx and tx rings get block_size * blocks bytes each
+#define DEFAULT_BLOCK_SIZE (1 << 20)
+#define DEFAULT_BLOCKS 16
+#define MAX_BLOCK_SIZE (1 << 28)
+#define MAX_BLOCKS 1024
+// a partially filled block is handed over after this many milliseconds
+#define DEFAULT_BLOCK_TIMEOUT 1
+
+/*
+ * Head space reserved in rx ring frames: engines get views on the ring as
+ * long as the head space they ask for fits in it, vlan tags stripped by the
+ * kernel are put back there as well.
+ */
+#define RX_RESERVE 32
+#define VLAN_HLEN 4
+// tx ring frames are sent from right after the frame header
+#define TX_DATA_OFFSET TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+// frames delivered with a single read callback, also frames queued in the tx
+// ring before flushing it right away
+#define MAX_BATCH 64
+// rx blocks handled by a single read event, other events get a chance then
+#define RX_BLOCK_BUDGET 4
+
+#define TUN_DEV "/dev/net/tun"
+#define MAX_QUEUES 16
+
+typedef enum {
+  PACKET_MODE_MMAP,
+  PACKET_MODE_TAP,
+} packet_mode;
+
+typedef struct {
+  char ifname[IFNAMSIZ];
+  packet_mode mode;
+  unsigned int max_payload;
+  unsigned int block_size;
+  unsigned int blocks;
+  unsigned int block_timeout;
+  unsigned int queues;
+  int promisc;
+  int qdisc_bypass;
+  vde_connection *conn; //!< the interface connection, NULL if not open
+} packet_tr;
+
+typedef struct {
+  vde_connection *conn;
+  packet_tr *tr; //!< NULL once the transport has gone
+  packet_mode mode;
+  unsigned int max_payload;
+  // a single socket in mmap mode, one per queue for a tap
+  unsigned int queues;
+  int fds[MAX_QUEUES];
+  void *rd_evs[MAX_QUEUES];
+  // memory mapped rings, rx first
+  char *map;
+  size_t map_size;
+  unsigned int block_size;
+  unsigned int blocks;
+  unsigned int rx_block; //!< next rx block to be handed by the kernel
+  char *tx_ring;
+  unsigned int tx_frame_size;
+  unsigned int tx_frames_per_block;
+  unsigned int tx_frames;
+  unsigned int tx_frame; //!< next tx frame to fill
+  unsigned int tx_pending; //!< frames filled since the last flush
+  void *tx_ev; //!< deferred flush of the tx ring
+} packet_conn;
+
+/*
+ * AF_PACKET rings
+ */
+
+static inline struct tpacket3_hdr *packet_tx_frame(packet_conn *pc,
+                                                   unsigned int idx)
+{
+  unsigned int block = idx / pc->tx_frames_per_block;
+  unsigned int frame = idx % pc->tx_frames_per_block;
+
+  return (struct tpacket3_hdr *)(pc->tx_ring + (size_t)block * pc->block_size
+                                 + frame * pc->tx_frame_size);
+}
+
+// hand every filled tx frame to the kernel
+static void packet_tx_flush(packet_conn *pc)
+{
+  pc->tx_pending = 0;
+  if (send(pc->fds[0], NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN &&
+      errno != ENOBUFS) {
+    vde_warning("%s: cannot flush tx ring of %d: %s", __PRETTY_FUNCTION__,
+                pc->fds[0], strerror(errno));
+  }
+}
+
+static void packet_tx_flush_event(int fd, short event_type, void *arg)
+{
+  packet_conn *pc = (packet_conn *)arg;
+
+  vde_context_event_del(vde_connection_get_context(pc->conn), pc->tx_ev);
+  pc->tx_ev = NULL;
+  if (pc->tx_pending > 0) {
+    packet_tx_flush(pc);
+  }
+}
+
+static int packet_mmap_write(vde_connection *conn, vde_pkt *pkt)
+{
+  unsigned int status;
+  struct tpacket3_hdr *th;
+  packet_conn *pc = vde_connection_get_priv(conn);
+
+  if (pkt->hdr->pkt_len > pc->max_payload) {
+    vde_connection_stats_drop(conn, VDE_CONN_DROP_WRITE_ERROR);
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  th = packet_tx_frame(pc, pc->tx_frame);
+  status = __atomic_load_n(&th->tp_status, __ATOMIC_ACQUIRE);
+  if (status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+    // the kernel is behind, let it catch up once
+    packet_tx_flush(pc);
+    status = __atomic_load_n(&th->tp_status, __ATOMIC_ACQUIRE);
+    if (status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+      vde_connection_stats_drop(conn, VDE_CONN_DROP_QUEUE_FULL);
+      errno = EAGAIN;
+      return -1;
+    }
+  }
+  if (status & TP_STATUS_WRONG_FORMAT) {
+    // refused by the kernel last time this frame was used
+    vde_connection_stats_drop(conn, VDE_CONN_DROP_WRITE_ERROR);
+  }
+
+  memcpy((char *)th + TX_DATA_OFFSET, pkt->payload, pkt->hdr->pkt_len);
+  th->tp_len = pkt->hdr->pkt_len;
+  __atomic_store_n(&th->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+  pc->tx_frame = (pc->tx_frame + 1) % pc->tx_frames;
+  vde_connection_stats_tx(conn, pkt);
+
+  // frames written during the same loop iteration are flushed together
+  if (++pc->tx_pending >= MAX_BATCH) {
+    packet_tx_flush(pc);
+  } else if (pc->tx_ev == NULL) {
+    pc->tx_ev = vde_context_event_add(vde_connection_get_context(conn),
+                                      pc->fds[0], VDE_EV_WRITE, NULL,
+                                      &packet_tx_flush_event, (void *)pc);
+    if (pc->tx_ev == NULL) {
+      packet_tx_flush(pc);
+    }
+  }
+  return 0;
+}
+
+// move addresses back to put the tag stripped by the kernel in front of the
+// ethertype again
+static inline char *packet_vlan_restore(struct tpacket3_hdr *th, char *frame)
+{
+  uint16_t tag[2];
+
+  tag[0] = htons((th->tp_status & TP_STATUS_VLAN_TPID_VALID) ?
+                 th->hv1.tp_vlan_tpid : ETH_P_8021Q);
+  tag[1] = htons(th->hv1.tp_vlan_tci);
+  memmove(frame - VLAN_HLEN, frame, 2 * ETH_ALEN);
+  memcpy(frame - VLAN_HLEN + 2 * ETH_ALEN, tag, VLAN_HLEN);
+  return frame - VLAN_HLEN;
+}
+
+// returns -1 if the connection has to be closed
+static inline int packet_rx_deliver(vde_connection *conn, vde_pkt **pkts,
+                                    unsigned int count, int pooled)
+{
+  unsigned int i;
+  int rv = vde_connection_call_read_batch(conn, pkts, count);
+  int tmp_errno = errno;
+
+  if (pooled) {
+    for (i = 0; i < count; i++) {
+      vde_pkt_put(pkts[i]);
+    }
+  }
+  return (rv && tmp_errno == EPIPE) ? -1 : 0;
+}
+
+/*
+ * Deliver the frames of a rx block, views on the ring unless the connection
+ * wants more head or tail space than the ring has. Returns -1 if the
+ * connection has to be closed.
+ */
+static int packet_mmap_rx_block(packet_conn *pc,
+                                struct tpacket_block_desc *bd)
+{
+  vde_pkt views[MAX_BATCH];
+  vde_hdr hdrs[MAX_BATCH];
+  vde_pkt *ready[MAX_BATCH];
+  struct tpacket3_hdr *th;
+  struct sockaddr_ll *sll;
+  char *frame;
+  unsigned int i, len, count = 0;
+  vde_connection *conn = pc->conn;
+  vde_context *ctx = vde_connection_get_context(conn);
+  unsigned int head_sz = vde_connection_get_pkt_headsize(conn);
+  unsigned int tail_sz = vde_connection_get_pkt_tailsize(conn);
+  int copy = head_sz > RX_RESERVE - VLAN_HLEN || tail_sz > 0;
+
+  th = (struct tpacket3_hdr *)((char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+  for (i = 0; i < bd->hdr.bh1.num_pkts;
+       i++, th = (struct tpacket3_hdr *)((char *)th + th->tp_next_offset)) {
+    sll = (struct sockaddr_ll *)((char *)th + TX_DATA_OFFSET);
+    if (sll->sll_pkttype == PACKET_OUTGOING) {
+      continue;
+    }
+    frame = (char *)th + th->tp_mac;
+    len = th->tp_snaplen;
+    if (th->tp_status & TP_STATUS_VLAN_VALID) {
+      frame = packet_vlan_restore(th, frame);
+      len += VLAN_HLEN;
+    }
+    if (th->tp_snaplen != th->tp_len || len < sizeof(struct eth_hdr) ||
+        len > pc->max_payload) {
+      vde_connection_stats_drop(conn, VDE_CONN_DROP_RX_ERROR);
+      continue;
+    }
+
+    if (!copy) {
+      vde_pkt_init_view(&views[count], &hdrs[count], frame - head_sz, head_sz,
+                        len, 0);
+      ready[count] = &views[count];
+    } else {
+      ready[count] = vde_pkt_new(ctx, len, head_sz, tail_sz);
+      if (ready[count] == NULL) {
+        vde_connection_stats_drop(conn, VDE_CONN_DROP_NOMEM);
+        continue;
+      }
+      memcpy(ready[count]->payload, frame, len);
+      ready[count]->hdr->pkt_len = len;
+    }
+
+    if (++count == MAX_BATCH) {
+      if (packet_rx_deliver(conn, ready, count, copy)) {
+        return -1;
+      }
+      count = 0;
+    }
+  }
+  if (count > 0) {
+    return packet_rx_deliver(conn, ready, count, copy);
+  }
+  return 0;
+}
+
+static void packet_mmap_read(packet_conn *pc)
+{
+  unsigned int budget = RX_BLOCK_BUDGET;
+  struct tpacket_block_desc *bd;
+  vde_connection *conn = pc->conn;
+
+  while (budget-- > 0) {
+    bd = (struct tpacket_block_desc *)(pc->map +
+                                       (size_t)pc->rx_block * pc->block_size);
+    if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+          TP_STATUS_USER)) {
+      return;
+    }
+    if (packet_mmap_rx_block(pc, bd)) {
+      vde_connection_fini(conn);
+      vde_connection_delete(conn);
+      return;
+    }
+    __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                     __ATOMIC_RELEASE);
+    pc->rx_block = (pc->rx_block + 1) % pc->blocks;
+  }
+}
+
+static int packet_mmap_open(packet_conn *pc, packet_tr *tr)
+{
+  int fd, opt;
+  unsigned int frame_size;
+  struct tpacket_req3 req;
+  struct sockaddr_ll sll;
+  struct packet_mreq mreq;
+  unsigned int ifindex = if_nametoindex(tr->ifname);
+
+  if (ifindex == 0) {
+    vde_error("%s: no interface %s", __PRETTY_FUNCTION__, tr->ifname);
+    errno = ENODEV;
+    return -1;
+  }
+  frame_size = TPACKET_ALIGN(TPACKET3_HDRLEN + RX_RESERVE + tr->max_payload);
+  if (tr->block_size % sysconf(_SC_PAGESIZE) || tr->block_size < frame_size) {
+    vde_error("%s: block_size must be a multiple of the page size of at "
+              "least %u bytes", __PRETTY_FUNCTION__, frame_size);
+    errno = EINVAL;
+    return -1;
+  }
+
+  fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+  if (fd < 0) {
+    vde_error("%s: cannot create packet socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    return -1;
+  }
+  pc->fds[0] = fd;
+  pc->queues = 1;
+
+  opt = TPACKET_V3;
+  if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &opt, sizeof(opt)) < 0) {
+    vde_error("%s: TPACKET_V3 not supported: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    return -1;
+  }
+  opt = RX_RESERVE;
+  if (setsockopt(fd, SOL_PACKET, PACKET_RESERVE, &opt, sizeof(opt)) < 0) {
+    vde_error("%s: cannot reserve head space: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    return -1;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = tr->block_size;
+  req.tp_block_nr = tr->blocks;
+  req.tp_frame_size = frame_size;
+  req.tp_frame_nr = (tr->block_size / frame_size) * tr->blocks;
+  req.tp_retire_blk_tov = tr->block_timeout;
+  if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+    vde_error("%s: cannot setup rx ring: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    return -1;
+  }
+  // tx rings are frame based, blocks are only a unit of allocation
+  req.tp_retire_blk_tov = 0;
+  if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+    vde_error("%s: cannot setup tx ring: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    return -1;
+  }
+
+  pc->block_size = tr->block_size;
+  pc->blocks = tr->blocks;
+  pc->map_size = 2 * (size_t)tr->block_size * tr->blocks;
+  pc->map = mmap(NULL, pc->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                 0);
+  if (pc->map == MAP_FAILED) {
+    pc->map = NULL;
+    vde_error("%s: cannot map rings: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    return -1;
+  }
+  pc->tx_ring = pc->map + (size_t)tr->block_size * tr->blocks;
+  pc->tx_frame_size = frame_size;
+  pc->tx_frames_per_block = tr->block_size / frame_size;
+  pc->tx_frames = req.tp_frame_nr;
+
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons(ETH_P_ALL);
+  sll.sll_ifindex = ifindex;
+  if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+    vde_error("%s: cannot bind to %s: %s", __PRETTY_FUNCTION__, tr->ifname,
+              strerror(errno));
+    return -1;
+  }
+
+  // failures below only cost performance or extra traffic
+  if (tr->promisc) {
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+                   sizeof(mreq)) < 0) {
+      vde_warning("%s: cannot set %s promiscuous: %s", __PRETTY_FUNCTION__,
+                  tr->ifname, strerror(errno));
+    }
+  }
+#ifdef PACKET_IGNORE_OUTGOING
+  // frames sent by the host are otherwise skipped one by one
+  opt = 1;
+  setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &opt, sizeof(opt));
+#endif
+  if (tr->qdisc_bypass) {
+    opt = 1;
+    if (setsockopt(fd, SOL_PACKET, PACKET_QDISC_BYPASS, &opt,
+                   sizeof(opt)) < 0) {
+      vde_warning("%s: cannot bypass qdisc of %s: %s", __PRETTY_FUNCTION__,
+                  tr->ifname, strerror(errno));
+    }
+  }
+  if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+    vde_error("%s: cannot set O_NONBLOCK: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * tap
+ *
+ * Offloads are left disabled so that the kernel never hands out GSO frames,
+ * the virtio net header still tells about checksums left to be completed.
+ */
+
+static inline unsigned int packet_tap_queue(packet_conn *pc, vde_pkt *pkt)
+{
+  uint64_t key = 0;
+
+  if (pc->queues == 1 || pkt->hdr->pkt_len < 2 * ETH_ALEN) {
+    return 0;
+  }
+  // the same queue for a pair of addresses keeps frames in order
+  uint32_t tail = 0;
+
+  memcpy(&key, pkt->payload, sizeof(uint64_t));
+  memcpy(&tail, pkt->payload + sizeof(uint64_t), sizeof(uint32_t));
+  key = (key * 0x9e3779b97f4a7c15ULL) ^ tail;
+  key = key * 0x9e3779b97f4a7c15ULL;
+  return (key >> 32) % pc->queues;
+}
+
+static int packet_tap_write(vde_connection *conn, vde_pkt *pkt)
+{
+  struct virtio_net_hdr vnet;
+  struct iovec iov[2];
+  int fd;
+  packet_conn *pc = vde_connection_get_priv(conn);
+
+  if (pkt->hdr->pkt_len > pc->max_payload) {
+    vde_connection_stats_drop(conn, VDE_CONN_DROP_WRITE_ERROR);
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  memset(&vnet, 0, sizeof(vnet));
+  iov[0].iov_base = &vnet;
+  iov[0].iov_len = sizeof(vnet);
+  iov[1].iov_base = pkt->payload;
+  iov[1].iov_len = pkt->hdr->pkt_len;
+  fd = pc->fds[packet_tap_queue(pc, pkt)];
+  if (writev(fd, iov, 2) < 0) {
+    vde_connection_stats_drop(conn, errno == EAGAIN ?
+                              VDE_CONN_DROP_QUEUE_FULL :
+                              VDE_CONN_DROP_WRITE_ERROR);
+    return -1;
+  }
+  vde_connection_stats_tx(conn, pkt);
+  return 0;
+}
+
+// fold the ones' complement sum from start to the end of the frame into the
+// checksum field at start + offset, which holds the pseudo header sum
+static void packet_csum_complete(char *frame, unsigned int len,
+                                 unsigned int start, unsigned int offset)
+{
+  unsigned int i;
+  uint32_t sum = 0;
+  uint16_t csum;
+
+  if (start + offset + sizeof(uint16_t) > len) {
+    return;
+  }
+  for (i = start; i + 1 < len; i += 2) {
+    sum += (uint8_t)frame[i] << 8 | (uint8_t)frame[i + 1];
+  }
+  if (i < len) {
+    sum += (uint8_t)frame[i] << 8;
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  csum = htons(~sum & 0xffff);
+  memcpy(frame + start + offset, &csum, sizeof(uint16_t));
+}
+
+static void packet_tap_read(packet_conn *pc, int fd)
+{
+  struct virtio_net_hdr vnet;
+  struct iovec iov[2];
+  vde_pkt *ready[MAX_BATCH];
+  vde_pkt *pkt;
+  unsigned int count = 0;
+  int len;
+  vde_connection *conn = pc->conn;
+  vde_context *ctx = vde_connection_get_context(conn);
+
+  // frames are read right into pooled packets, readers can keep them
+  while (count < MAX_BATCH) {
+    pkt = vde_pkt_new(ctx, pc->max_payload,
+                      vde_connection_get_pkt_headsize(conn),
+                      vde_connection_get_pkt_tailsize(conn));
+    if (pkt == NULL) {
+      vde_warning("%s: cannot alloc new pkt, skipping", __PRETTY_FUNCTION__);
+      break;
+    }
+    iov[0].iov_base = &vnet;
+    iov[0].iov_len = sizeof(vnet);
+    iov[1].iov_base = pkt->payload;
+    iov[1].iov_len = pc->max_payload;
+    len = readv(fd, iov, 2);
+    if (len < 0) {
+      if (errno != EAGAIN) {
+        vde_warning("%s: error reading from %d: %s", __PRETTY_FUNCTION__, fd,
+                    strerror(errno));
+      }
+      vde_pkt_put(pkt);
+      break;
+    }
+    len -= sizeof(vnet);
+    if (len < (int)sizeof(struct eth_hdr) ||
+        vnet.gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+      vde_connection_stats_drop(conn, VDE_CONN_DROP_RX_ERROR);
+      vde_pkt_put(pkt);
+      continue;
+    }
+    if (vnet.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+      packet_csum_complete(pkt->payload, len, vnet.csum_start,
+                           vnet.csum_offset);
+    }
+    pkt->hdr->pkt_len = len;
+    ready[count++] = pkt;
+  }
+
+  if (count > 0 && packet_rx_deliver(conn, ready, count, 1)) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+  }
+}
+
+static int packet_tap_open(packet_conn *pc, packet_tr *tr)
+{
+  unsigned int i;
+  int hdr_sz = sizeof(struct virtio_net_hdr);
+  struct ifreq ifr;
+
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, tr->ifname, IFNAMSIZ - 1);
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+  if (tr->queues > 1) {
+    ifr.ifr_flags |= IFF_MULTI_QUEUE;
+  }
+
+  for (i = 0; i < tr->queues; i++) {
+    pc->fds[i] = open(TUN_DEV, O_RDWR | O_NONBLOCK);
+    if (pc->fds[i] < 0) {
+      vde_error("%s: cannot open %s: %s", __PRETTY_FUNCTION__, TUN_DEV,
+                strerror(errno));
+      return -1;
+    }
+    pc->queues++;
+    if (ioctl(pc->fds[i], TUNSETIFF, &ifr) < 0) {
+      vde_error("%s: cannot attach to tap %s: %s", __PRETTY_FUNCTION__,
+                tr->ifname, strerror(errno));
+      return -1;
+    }
+    if (ioctl(pc->fds[i], TUNSETVNETHDRSZ, &hdr_sz) < 0 ||
+        ioctl(pc->fds[i], TUNSETOFFLOAD, 0) < 0) {
+      vde_error("%s: cannot setup tap %s: %s", __PRETTY_FUNCTION__,
+                tr->ifname, strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Connection
+ */
+
+static void packet_conn_read_event(int fd, short event_type, void *arg)
+{
+  packet_conn *pc = (packet_conn *)arg;
+
+  if (pc->mode == PACKET_MODE_MMAP) {
+    packet_mmap_read(pc);
+  } else {
+    packet_tap_read(pc, fd);
+  }
+}
+
+static void packet_conn_free(packet_conn *pc, vde_context *ctx)
+{
+  unsigned int i;
+
+  for (i = 0; i < pc->queues; i++) {
+    if (pc->rd_evs[i] != NULL) {
+      vde_context_event_del(ctx, pc->rd_evs[i]);
+    }
+  }
+  if (pc->tx_ev != NULL) {
+    vde_context_event_del(ctx, pc->tx_ev);
+  }
+  if (pc->tx_pending > 0) {
+    packet_tx_flush(pc);
+  }
+  if (pc->map != NULL) {
+    munmap(pc->map, pc->map_size);
+  }
+  for (i = 0; i < pc->queues; i++) {
+    close(pc->fds[i]);
+  }
+  if (pc->tr != NULL) {
+    pc->tr->conn = NULL;
+  }
+  vde_free(pc);
+}
+
+static void packet_conn_close(vde_connection *conn)
+{
+  packet_conn_free(vde_connection_get_priv(conn),
+                   vde_connection_get_context(conn));
+}
+
+static int packet_conn_open(vde_component *component, vde_connection *conn)
+{
+  unsigned int i;
+  int rv, tmp_errno;
+  packet_conn *pc;
+  packet_tr *tr = (packet_tr *)vde_component_get_priv(component);
+  vde_context *ctx = vde_component_get_context(component);
+
+  if (tr->conn != NULL) {
+    vde_error("%s: %s already in use", __PRETTY_FUNCTION__, tr->ifname);
+    errno = EBUSY;
+    return -1;
+  }
+  pc = (packet_conn *)vde_calloc(sizeof(packet_conn));
+  if (pc == NULL) {
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+  pc->conn = conn;
+  pc->tr = tr;
+  pc->mode = tr->mode;
+  pc->max_payload = tr->max_payload;
+
+  if (pc->mode == PACKET_MODE_MMAP) {
+    rv = packet_mmap_open(pc, tr);
+  } else {
+    rv = packet_tap_open(pc, tr);
+  }
+  for (i = 0; rv == 0 && i < pc->queues; i++) {
+    pc->rd_evs[i] = vde_context_event_add(ctx, pc->fds[i],
+                                          VDE_EV_READ | VDE_EV_PERSIST, NULL,
+                                          &packet_conn_read_event,
+                                          (void *)pc);
+    if (pc->rd_evs[i] == NULL) {
+      vde_error("%s: cannot add read event", __PRETTY_FUNCTION__);
+      errno = ENOMEM;
+      rv = -1;
+    }
+  }
+  if (rv) {
+    tmp_errno = errno;
+    pc->tr = NULL;
+    packet_conn_free(pc, ctx);
+    errno = tmp_errno;
+    return -1;
+  }
+
+  vde_connection_init(conn, ctx, tr->max_payload,
+                      pc->mode == PACKET_MODE_MMAP ? &packet_mmap_write :
+                                                     &packet_tap_write,
+                      &packet_conn_close, (void *)pc);
+  tr->conn = conn;
+  return 0;
+}
+
+static int packet_listen(vde_component *component)
+{
+  vde_connection *conn;
+  int tmp_errno;
+
+  if (vde_connection_new(&conn)) {
+    vde_error("%s: cannot create connection", __PRETTY_FUNCTION__);
+    return -1;
+  }
+  if (packet_conn_open(component, conn)) {
+    tmp_errno = errno;
+    vde_connection_delete(conn);
+    errno = tmp_errno;
+    return -1;
+  }
+  vde_transport_call_cm_accept_cb(component, conn);
+  return 0;
+}
+
+static int packet_connect(vde_component *component, vde_connection *conn)
+{
+  if (packet_conn_open(component, conn)) {
+    return -1;
+  }
+  vde_transport_call_cm_connect_cb(component, conn);
+  return 0;
+}
+
+/*
+ * Component
+ */
+
+static int packet_get_int(vde_sobj *params, const char *name, int min,
+                          int max, unsigned int *value)
+{
+  vde_sobj *param = vde_sobj_hash_lookup(params, name);
+
+  if (param == NULL) {
+    return 0;
+  }
+  if (!vde_sobj_is_type(param, vde_sobj_type_int) ||
+      vde_sobj_get_int(param) < min || vde_sobj_get_int(param) > max) {
+    vde_error("%s: %s must be an integer between %d and %d",
+              __PRETTY_FUNCTION__, name, min, max);
+    errno = EINVAL;
+    return -1;
+  }
+  *value = vde_sobj_get_int(param);
+  return 0;
+}
+
+static int packet_get_bool(vde_sobj *params, const char *name, int *value)
+{
+  vde_sobj *param = vde_sobj_hash_lookup(params, name);
+
+  if (param == NULL) {
+    return 0;
+  }
+  if (!vde_sobj_is_type(param, vde_sobj_type_bool)) {
+    vde_error("%s: %s must be a boolean", __PRETTY_FUNCTION__, name);
+    errno = EINVAL;
+    return -1;
+  }
+  *value = vde_sobj_get_bool(param);
+  return 0;
+}
+
+static int transport_packet_init(vde_component *component, vde_sobj *params)
+{
+  packet_tr *tr;
+  vde_sobj *ifname_sobj, *mode_sobj;
+  const char *mode;
+
+  vde_assert(component != NULL);
+
+  if (!params || !vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    vde_error("%s: no parameters hash received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  ifname_sobj = vde_sobj_hash_lookup(params, "ifname");
+  if (!ifname_sobj || !vde_sobj_is_type(ifname_sobj, vde_sobj_type_string) ||
+      strlen(vde_sobj_get_string(ifname_sobj)) == 0 ||
+      strlen(vde_sobj_get_string(ifname_sobj)) >= IFNAMSIZ) {
+    vde_error("%s: no valid interface name received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  tr = (packet_tr *)vde_calloc(sizeof(packet_tr));
+  if (tr == NULL) {
+    vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+  strncpy(tr->ifname, vde_sobj_get_string(ifname_sobj), IFNAMSIZ - 1);
+  tr->mode = PACKET_MODE_MMAP;
+  tr->max_payload = DEFAULT_MAX_PAYLOAD;
+  tr->block_size = DEFAULT_BLOCK_SIZE;
+  tr->blocks = DEFAULT_BLOCKS;
+  tr->block_timeout = DEFAULT_BLOCK_TIMEOUT;
+  tr->queues = 1;
+  tr->promisc = 1;
+
+  mode_sobj = vde_sobj_hash_lookup(params, "mode");
+  if (mode_sobj) {
+    mode = vde_sobj_is_type(mode_sobj, vde_sobj_type_string) ?
+           vde_sobj_get_string(mode_sobj) : "";
+    if (strcmp(mode, "tap") == 0) {
+      tr->mode = PACKET_MODE_TAP;
+    } else if (strcmp(mode, "mmap") != 0) {
+      vde_error("%s: mode must be either mmap or tap", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      goto error;
+    }
+  }
+  if (packet_get_int(params, "max_payload", DEFAULT_MAX_PAYLOAD, MAX_PAYLOAD,
+                     &tr->max_payload) ||
+      packet_get_int(params, "block_size", 4096, MAX_BLOCK_SIZE,
+                     &tr->block_size) ||
+      packet_get_int(params, "blocks", 1, MAX_BLOCKS, &tr->blocks) ||
+      packet_get_int(params, "block_timeout_ms", 0, 1000,
+                     &tr->block_timeout) ||
+      packet_get_int(params, "queues", 1, MAX_QUEUES, &tr->queues) ||
+      packet_get_bool(params, "promisc", &tr->promisc) ||
+      packet_get_bool(params, "qdisc_bypass", &tr->qdisc_bypass)) {
+    goto error;
+  }
+  if (tr->queues > 1 && tr->mode != PACKET_MODE_TAP) {
+    vde_warning("%s: queues apply to tap mode only, ignored",
+                __PRETTY_FUNCTION__);
+    tr->queues = 1;
+  }
+
+  vde_component_set_priv(component, (void *)tr);
+  return 0;
+
+error:
+  vde_free(tr);
+  return -1;
+}
+
+static void transport_packet_fini(vde_component *component)
+{
+  packet_conn *pc;
+  packet_tr *tr = (packet_tr *)vde_component_get_priv(component);
+
+  vde_assert(component != NULL);
+
+  // the connection belongs to its engine, it just forgets the transport
+  if (tr->conn != NULL) {
+    pc = vde_connection_get_priv(tr->conn);
+    pc->tr = NULL;
+  }
+  vde_free(tr);
+}
+
+component_ops transport_packet_component_ops = {
+  .init = transport_packet_init,
+  .fini = transport_packet_fini,
+  .get_configuration = NULL,
+  .set_configuration = NULL,
+  .get_policy = NULL,
+  .set_policy = NULL,
+};
+
+vde_module VDE_MODULE_START = {
+  .kind = VDE_TRANSPORT,
+  .family = "packet",
+  .cops = &transport_packet_component_ops,
+  .tr_listen = &packet_listen,
+  .tr_connect = &packet_connect,
+};
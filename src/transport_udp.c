@@ -0,0 +1,1100 @@
+/* Copyright (C) 2010 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/*
+ * UDP transport: tunnels vde packets between hosts, one datagram per packet
+ * made of a small tunnel header, the vde header and the frame.
+ *
+ * Every connection is a peer address on a socket. A listening transport owns
+ * a socket bound to its port and creates a connection for each new address
+ * it receives valid datagrams from, a connection created by connect gets a
+ * socket of its own connected to the configured peer. Sockets are shared by
+ * their connections and freed with the last one, a listening socket can
+ * outlive its transport.
+ *
+ * Frames written during a loop iteration are sent together by sendmmsg, runs
+ * of frames of the same size to the same peer are handed to the kernel as a
+ * single UDP_SEGMENT (GSO) datagram. Receive side coalescing (UDP_GRO) is
+ * split back into frames delivered as views on the receive buffers.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/module.h>
+#include <vde3/connection.h>
+#include <vde3/transport.h>
+#include <vde3/context.h>
+#include <vde3/packet.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP IPPROTO_UDP
+#endif
+// older headers, kernels without support refuse them at socket setup
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+// largest UDP payload over IPv4
+#define UDP_MAX_DGRAM 65507
+
+#define UDP_MAGIC 0x56
+#define UDP_HDR_F_SEQ 0x01
+
+/**
+ * @brief Header of a tunnel datagram, followed by the frame
+ */
+typedef struct {
+  uint8_t magic;
+  uint8_t flags;
+  uint16_t reserved;
+  uint32_t seq; //!< network byte order, meaningful with UDP_HDR_F_SEQ
+  vde_hdr vhdr; //!< pkt_len in network byte order
+} udp_hdr;
+
+#define UDP_HLEN sizeof(udp_hdr)
+
+#define DEFAULT_MAX_PAYLOAD sizeof(struct eth_frame)
+#define MAX_PAYLOAD (UDP_MAX_DGRAM - UDP_HLEN)
+
+#define DEFAULT_MAX_PEERS 256
+#define MAX_PEERS 65536
+#define PEER_BUCKETS 256
+
+// frames sent by a sendmmsg, also the segments of a GSO datagram (the limit of
+// older kernels)
+#define MAX_BATCH 64
+// receive buffers take up to RX_AREA bytes, a GRO buffer holds 64k
+#define RX_AREA (256 * 1024)
+#define RX_MAX_MSGS 32
+#define GRO_BUF_SIZE 65536
+// recvmmsg calls made by a single read event
+#define RX_BUDGET 4
+
+// a larger jump in sequence numbers is a peer restart, not a loss
+#define SEQ_RESYNC (1 << 16)
+
+typedef struct udp_tr udp_tr;
+typedef struct udp_sock udp_sock;
+typedef struct udp_peer udp_peer;
+
+/**
+ * @brief A peer address, zero padded to be compared and hashed as a whole
+ */
+typedef struct {
+  uint8_t addr[16];
+  uint16_t port;
+  uint16_t family;
+} udp_key;
+
+struct udp_peer {
+  udp_peer *next; //!< in the socket bucket
+  udp_key key;
+  uint32_t hash;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  vde_connection *conn;
+  udp_sock *sock;
+  uint32_t tx_seq;
+  uint32_t rx_seq; //!< next sequence number expected
+  int rx_seq_valid;
+  int gso_off; //!< segmentation refused on the path to this peer
+};
+
+typedef struct {
+  udp_peer *peer;
+  unsigned int off; //!< in tx_buf
+  unsigned int len; //!< datagram length
+  uint64_t ts; //!< ingress time of the packet, accounted once sent
+} udp_txent;
+
+typedef union {
+  char buf[CMSG_SPACE(sizeof(int))];
+  struct cmsghdr align;
+} udp_cmsg;
+
+struct udp_sock {
+  int fd;
+  vde_context *ctx;
+  unsigned int refcount; //!< peers and the listening transport
+  udp_tr *tr; //!< the listening transport, NULL otherwise
+  int connected;
+  int gso;
+  int gro;
+  int seq;
+  unsigned int max_payload;
+  void *rd_ev;
+  void *tx_ev; //!< deferred flush of tx
+  unsigned int npeers;
+  udp_peer *peers[PEER_BUCKETS];
+  // receive buffers
+  char *rx_area;
+  unsigned int rx_msgs;
+  unsigned int rx_buf_size;
+  struct mmsghdr rx_hdrs[RX_MAX_MSGS];
+  struct iovec rx_iovs[RX_MAX_MSGS];
+  struct sockaddr_storage rx_addrs[RX_MAX_MSGS];
+  udp_cmsg rx_cmsgs[RX_MAX_MSGS];
+  // datagrams waiting to be sent, contiguous in tx_buf
+  char *tx_buf;
+  unsigned int tx_used;
+  unsigned int tx_count;
+  udp_txent tx[MAX_BATCH];
+};
+
+struct udp_tr {
+  vde_component *component;
+  char *host; //!< local address, NULL for any
+  unsigned int port;
+  char *peer_host; //!< peer of connect
+  unsigned int peer_port;
+  unsigned int max_payload;
+  unsigned int max_peers;
+  int reuseport;
+  int gso;
+  int seq;
+  udp_sock *listen_sock;
+};
+
+/*
+ * Peers
+ */
+
+static void udp_key_init(udp_key *key, const struct sockaddr_storage *ss)
+{
+  const struct sockaddr_in *sin = (const struct sockaddr_in *)ss;
+  const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)ss;
+
+  memset(key, 0, sizeof(udp_key));
+  key->family = ss->ss_family;
+  if (ss->ss_family == AF_INET) {
+    memcpy(key->addr, &sin->sin_addr, sizeof(sin->sin_addr));
+    key->port = sin->sin_port;
+  } else if (ss->ss_family == AF_INET6) {
+    memcpy(key->addr, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+    key->port = sin6->sin6_port;
+  }
+}
+
+static inline uint32_t udp_key_hash(const udp_key *key)
+{
+  uint64_t a, b;
+  uint32_t c;
+
+  memcpy(&a, key->addr, sizeof(uint64_t));
+  memcpy(&b, key->addr + sizeof(uint64_t), sizeof(uint64_t));
+  memcpy(&c, &key->port, sizeof(uint32_t));
+  a = (a * 0x9e3779b97f4a7c15ULL) ^ b;
+  a = (a * 0x9e3779b97f4a7c15ULL) ^ c;
+  a = a * 0x9e3779b97f4a7c15ULL;
+  return a >> 32;
+}
+
+static inline udp_peer *udp_peer_lookup(udp_sock *sock, const udp_key *key,
+                                        uint32_t hash)
+{
+  udp_peer *peer = sock->peers[hash % PEER_BUCKETS];
+
+  while (peer != NULL &&
+         (peer->hash != hash || memcmp(&peer->key, key, sizeof(udp_key)))) {
+    peer = peer->next;
+  }
+  return peer;
+}
+
+static udp_peer *udp_peer_new(udp_sock *sock,
+                              const struct sockaddr_storage *addr,
+                              socklen_t addrlen)
+{
+  udp_peer *peer = (udp_peer *)vde_calloc(sizeof(udp_peer));
+
+  if (peer == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  udp_key_init(&peer->key, addr);
+  peer->hash = udp_key_hash(&peer->key);
+  memcpy(&peer->addr, addr, addrlen);
+  peer->addrlen = addrlen;
+  peer->sock = sock;
+  peer->next = sock->peers[peer->hash % PEER_BUCKETS];
+  sock->peers[peer->hash % PEER_BUCKETS] = peer;
+  sock->npeers++;
+  sock->refcount++;
+  return peer;
+}
+
+static void udp_sock_put(udp_sock *sock);
+static void udp_tx_flush(udp_sock *sock);
+static void udp_conn_close(vde_connection *conn);
+
+static void udp_peer_free(udp_peer *peer)
+{
+  udp_peer **pp;
+  udp_sock *sock = peer->sock;
+
+  // queued datagrams refer to their peer
+  if (sock->tx_count > 0) {
+    udp_tx_flush(sock);
+  }
+  for (pp = &sock->peers[peer->hash % PEER_BUCKETS]; *pp != peer;
+       pp = &(*pp)->next);
+  *pp = peer->next;
+  sock->npeers--;
+  vde_free(peer);
+  udp_sock_put(sock);
+}
+
+/*
+ * Send
+ */
+
+// account the datagrams from first to last as sent by their peers
+static void udp_tx_sent(udp_sock *sock, unsigned int first, unsigned int last)
+{
+  udp_txent *ent;
+
+  for (; first < last; first++) {
+    ent = &sock->tx[first];
+    vde_connection_stats_sent(ent->peer->conn, ent->len - UDP_HLEN, ent->ts);
+  }
+}
+
+// send the datagrams of a message one at a time, without segmentation
+static void udp_tx_unsegmented(udp_sock *sock, struct msghdr *msg,
+                               unsigned int first, unsigned int last)
+{
+  unsigned int i;
+  udp_txent *ent;
+
+  for (i = first; i < last; i++) {
+    ent = &sock->tx[i];
+    if (sendto(sock->fd, sock->tx_buf + ent->off, ent->len, MSG_DONTWAIT,
+               msg->msg_name, msg->msg_namelen) < 0) {
+      vde_connection_stats_drop(ent->peer->conn,
+                                (errno == EAGAIN || errno == ENOBUFS) ?
+                                VDE_CONN_DROP_QUEUE_FULL :
+                                VDE_CONN_DROP_WRITE_ERROR);
+    } else {
+      udp_tx_sent(sock, i, i + 1);
+    }
+  }
+}
+
+static void udp_tx_flush(udp_sock *sock)
+{
+  struct mmsghdr msgs[MAX_BATCH];
+  struct iovec iovs[MAX_BATCH];
+  udp_cmsg cmsgs[MAX_BATCH];
+  unsigned int firsts[MAX_BATCH + 1];
+  struct cmsghdr *cmsg;
+  udp_txent *ent;
+  udp_peer *peer;
+  uint16_t segment;
+  unsigned int i, j, bytes, nmsgs = 0;
+  int rv;
+
+  memset(msgs, 0, sizeof(struct mmsghdr) * MAX_BATCH);
+  for (i = 0; i < sock->tx_count; i = j, nmsgs++) {
+    ent = &sock->tx[i];
+    peer = ent->peer;
+    bytes = ent->len;
+    // segments of the same size, the last one can be shorter
+    for (j = i + 1; sock->gso && !peer->gso_off && j < sock->tx_count &&
+         sock->tx[j].peer == peer && sock->tx[j].len <= ent->len &&
+         sock->tx[j - 1].len == ent->len &&
+         bytes + sock->tx[j].len <= UDP_MAX_DGRAM; j++) {
+      bytes += sock->tx[j].len;
+    }
+
+    firsts[nmsgs] = i;
+    iovs[nmsgs].iov_base = sock->tx_buf + ent->off;
+    iovs[nmsgs].iov_len = bytes;
+    msgs[nmsgs].msg_hdr.msg_iov = &iovs[nmsgs];
+    msgs[nmsgs].msg_hdr.msg_iovlen = 1;
+    if (!sock->connected) {
+      msgs[nmsgs].msg_hdr.msg_name = &peer->addr;
+      msgs[nmsgs].msg_hdr.msg_namelen = peer->addrlen;
+    }
+    if (j - i > 1) {
+      msgs[nmsgs].msg_hdr.msg_control = cmsgs[nmsgs].buf;
+      msgs[nmsgs].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+      cmsg = CMSG_FIRSTHDR(&msgs[nmsgs].msg_hdr);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      segment = ent->len;
+      memcpy(CMSG_DATA(cmsg), &segment, sizeof(uint16_t));
+    }
+  }
+  firsts[nmsgs] = sock->tx_count;
+
+  for (i = 0; i < nmsgs; ) {
+    rv = sendmmsg(sock->fd, &msgs[i], nmsgs - i, MSG_DONTWAIT);
+    if (rv > 0) {
+      udp_tx_sent(sock, firsts[i], firsts[i + rv]);
+      i += rv;
+      continue;
+    }
+    // the message which failed, those before it have been sent
+    peer = sock->tx[firsts[i]].peer;
+    if (msgs[i].msg_hdr.msg_control != NULL &&
+        (errno == EINVAL || errno == EIO || errno == EMSGSIZE)) {
+      // the segment does not fit the path or the device can't do it
+      vde_warning("%s: segmentation refused on the path to the peer of %p: "
+                  "%s", __PRETTY_FUNCTION__, peer->conn, strerror(errno));
+      peer->gso_off = 1;
+      udp_tx_unsegmented(sock, &msgs[i].msg_hdr, firsts[i], firsts[i + 1]);
+    } else {
+      for (j = firsts[i]; j < firsts[i + 1]; j++) {
+        vde_connection_stats_drop(peer->conn,
+                                  (errno == EAGAIN || errno == ENOBUFS) ?
+                                  VDE_CONN_DROP_QUEUE_FULL :
+                                  VDE_CONN_DROP_WRITE_ERROR);
+      }
+    }
+    i++;
+  }
+  sock->tx_count = 0;
+  sock->tx_used = 0;
+}
+
+static void udp_tx_flush_event(int fd, short event_type, void *arg)
+{
+  udp_sock *sock = (udp_sock *)arg;
+
+  vde_context_event_del(sock->ctx, sock->tx_ev);
+  sock->tx_ev = NULL;
+  if (sock->tx_count > 0) {
+    udp_tx_flush(sock);
+  }
+}
+
+static int udp_conn_write(vde_connection *conn, vde_pkt *pkt)
+{
+  udp_hdr hdr;
+  udp_txent *ent;
+  udp_peer *peer = vde_connection_get_priv(conn);
+  udp_sock *sock = peer->sock;
+
+  if (pkt->hdr->pkt_len > sock->max_payload) {
+    vde_connection_stats_drop(conn, VDE_CONN_DROP_WRITE_ERROR);
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  hdr.magic = UDP_MAGIC;
+  hdr.flags = 0;
+  hdr.reserved = 0;
+  hdr.seq = 0;
+  if (sock->seq) {
+    hdr.flags |= UDP_HDR_F_SEQ;
+    hdr.seq = htonl(peer->tx_seq++);
+  }
+  hdr.vhdr.version = pkt->hdr->version;
+  hdr.vhdr.type = pkt->hdr->type;
+  hdr.vhdr.pkt_len = htons(pkt->hdr->pkt_len);
+
+  ent = &sock->tx[sock->tx_count++];
+  ent->peer = peer;
+  ent->off = sock->tx_used;
+  ent->len = UDP_HLEN + pkt->hdr->pkt_len;
+  ent->ts = pkt->ts;
+  memcpy(sock->tx_buf + ent->off, &hdr, UDP_HLEN);
+  memcpy(sock->tx_buf + ent->off + UDP_HLEN, pkt->payload, pkt->hdr->pkt_len);
+  sock->tx_used += ent->len;
+
+  // datagrams written during the same loop iteration are sent together
+  if (sock->tx_count == MAX_BATCH) {
+    udp_tx_flush(sock);
+  } else if (sock->tx_ev == NULL) {
+    sock->tx_ev = vde_context_event_add(sock->ctx, sock->fd, VDE_EV_WRITE,
+                                        NULL, &udp_tx_flush_event,
+                                        (void *)sock);
+    if (sock->tx_ev == NULL) {
+      udp_tx_flush(sock);
+    }
+  }
+  return 0;
+}
+
+/*
+ * Receive
+ */
+
+/**
+ * @brief Frames received from a peer waiting to be delivered together
+ */
+typedef struct {
+  udp_peer *peer;
+  int copy; //!< the connection wants more room than the buffers have
+  unsigned int count;
+  vde_pkt views[MAX_BATCH];
+  vde_hdr hdrs[MAX_BATCH];
+  vde_pkt *ready[MAX_BATCH];
+} udp_rx;
+
+static void udp_rx_deliver(udp_rx *rx)
+{
+  unsigned int i;
+  int rv, tmp_errno;
+  vde_connection *conn;
+
+  if (rx->count > 0) {
+    conn = rx->peer->conn;
+    rv = vde_connection_call_read_batch(conn, rx->ready, rx->count);
+    tmp_errno = errno;
+    if (rx->copy) {
+      for (i = 0; i < rx->count; i++) {
+        vde_pkt_put(rx->ready[i]);
+      }
+    }
+    if (rv && tmp_errno == EPIPE) {
+      vde_connection_fini(conn);
+      vde_connection_delete(conn);
+    }
+  }
+  // readers might have closed any connection
+  rx->peer = NULL;
+  rx->count = 0;
+}
+
+static void udp_rx_seq(udp_peer *peer, uint32_t seq)
+{
+  int32_t delta = (int32_t)(seq - peer->rx_seq);
+
+  if (!peer->rx_seq_valid || delta >= SEQ_RESYNC || delta <= -SEQ_RESYNC) {
+    peer->rx_seq = seq + 1;
+    peer->rx_seq_valid = 1;
+    return;
+  }
+  if (delta < 0) {
+    vde_connection_stats_reorder(peer->conn);
+    return;
+  }
+  if (delta > 0) {
+    vde_connection_stats_lost(peer->conn, delta);
+  }
+  peer->rx_seq = seq + 1;
+}
+
+// a connection for a new address, NULL if it has been refused
+static udp_peer *udp_peer_accept(udp_sock *sock,
+                                 const struct sockaddr_storage *addr,
+                                 socklen_t addrlen, const udp_key *key,
+                                 uint32_t hash)
+{
+  vde_connection *conn;
+  udp_peer *peer;
+
+  if (sock->npeers >= sock->tr->max_peers) {
+    return NULL;
+  }
+  if (vde_connection_new(&conn)) {
+    vde_error("%s: cannot create connection", __PRETTY_FUNCTION__);
+    return NULL;
+  }
+  peer = udp_peer_new(sock, addr, addrlen);
+  if (peer == NULL) {
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    vde_connection_delete(conn);
+    return NULL;
+  }
+  peer->conn = conn;
+  vde_connection_init(conn, sock->ctx, sock->max_payload, &udp_conn_write,
+                      &udp_conn_close, (void *)peer);
+  vde_transport_call_cm_accept_cb(sock->tr->component, conn);
+  // the connection manager might have closed it already
+  return udp_peer_lookup(sock, key, hash);
+}
+
+static void udp_rx_frame(udp_sock *sock, udp_rx *rx, char *data,
+                         unsigned int dlen, unsigned int msg)
+{
+  udp_hdr hdr;
+  udp_key key;
+  uint32_t hash;
+  unsigned int len, head_sz;
+  vde_pkt *pkt;
+  vde_connection *conn;
+
+  if (rx->peer == NULL ||
+      memcmp(&rx->peer->addr, &sock->rx_addrs[msg],
+             sock->rx_hdrs[msg].msg_hdr.msg_namelen)) {
+    udp_rx_deliver(rx);
+    udp_key_init(&key, &sock->rx_addrs[msg]);
+    hash = udp_key_hash(&key);
+    rx->peer = udp_peer_lookup(sock, &key, hash);
+    if (rx->peer == NULL) {
+      if (sock->tr == NULL || dlen < UDP_HLEN || data[0] != UDP_MAGIC) {
+        return;
+      }
+      rx->peer = udp_peer_accept(sock, &sock->rx_addrs[msg],
+                                 sock->rx_hdrs[msg].msg_hdr.msg_namelen, &key,
+                                 hash);
+      if (rx->peer == NULL) {
+        return;
+      }
+    }
+    conn = rx->peer->conn;
+    rx->copy = vde_connection_get_pkt_headsize(conn) > UDP_HLEN ||
+               vde_connection_get_pkt_tailsize(conn) > 0;
+  }
+  conn = rx->peer->conn;
+
+  if (dlen < UDP_HLEN) {
+    vde_connection_stats_drop(conn, VDE_CONN_DROP_RX_ERROR);
+    return;
+  }
+  memcpy(&hdr, data, UDP_HLEN);
+  len = ntohs(hdr.vhdr.pkt_len);
+  if (hdr.magic != UDP_MAGIC || len != dlen - UDP_HLEN ||
+      len > sock->max_payload) {
+    vde_connection_stats_drop(conn, VDE_CONN_DROP_RX_ERROR);
+    return;
+  }
+  if (hdr.flags & UDP_HDR_F_SEQ) {
+    udp_rx_seq(rx->peer, ntohl(hdr.seq));
+  }
+
+  if (!rx->copy) {
+    // head space is taken from the tunnel header
+    head_sz = vde_connection_get_pkt_headsize(conn);
+    pkt = &rx->views[rx->count];
+    vde_pkt_init_view(pkt, &rx->hdrs[rx->count], data + UDP_HLEN - head_sz,
+                      head_sz, len, 0);
+  } else {
+    pkt = vde_pkt_new(sock->ctx, len, vde_connection_get_pkt_headsize(conn),
+                      vde_connection_get_pkt_tailsize(conn));
+    if (pkt == NULL) {
+      vde_connection_stats_drop(conn, VDE_CONN_DROP_NOMEM);
+      return;
+    }
+    memcpy(pkt->payload, data + UDP_HLEN, len);
+    pkt->hdr->pkt_len = len;
+  }
+  pkt->hdr->version = hdr.vhdr.version;
+  pkt->hdr->type = hdr.vhdr.type;
+  rx->ready[rx->count++] = pkt;
+  if (rx->count == MAX_BATCH) {
+    udp_rx_deliver(rx);
+  }
+}
+
+// the size of coalesced datagrams, the whole message otherwise
+static unsigned int udp_rx_segment(struct msghdr *hdr, unsigned int len)
+{
+  struct cmsghdr *cmsg;
+  int segment;
+
+  for (cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+      memcpy(&segment, CMSG_DATA(cmsg), sizeof(int));
+      return segment > 0 ? (unsigned int)segment : len;
+    }
+  }
+  return len;
+}
+
+static void udp_sock_read_event(int fd, short event_type, void *arg)
+{
+  udp_rx rx;
+  struct msghdr *hdr;
+  unsigned int i, len, off, segment, budget = RX_BUDGET;
+  int n;
+  udp_sock *sock = (udp_sock *)arg;
+
+  rx.peer = NULL;
+  rx.count = 0;
+  // readers might close the last connection of the socket
+  sock->refcount++;
+  while (budget-- > 0) {
+    for (i = 0; i < sock->rx_msgs; i++) {
+      sock->rx_hdrs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+      sock->rx_hdrs[i].msg_hdr.msg_controllen =
+        sock->gro ? sizeof(udp_cmsg) : 0;
+    }
+    n = recvmmsg(fd, sock->rx_hdrs, sock->rx_msgs, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+      if (errno != EAGAIN) {
+        vde_warning("%s: error reading from %d: %s", __PRETTY_FUNCTION__, fd,
+                    strerror(errno));
+      }
+      break;
+    }
+    for (i = 0; i < (unsigned int)n; i++) {
+      hdr = &sock->rx_hdrs[i].msg_hdr;
+      len = sock->rx_hdrs[i].msg_len;
+      segment = sock->gro ? udp_rx_segment(hdr, len) : len;
+      if (len == 0 || (hdr->msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        continue;
+      }
+      for (off = 0; off < len; off += segment) {
+        udp_rx_frame(sock, &rx, (char *)sock->rx_iovs[i].iov_base + off,
+                     len - off < segment ? len - off : segment, i);
+      }
+    }
+    udp_rx_deliver(&rx);
+    if ((unsigned int)n < sock->rx_msgs) {
+      break;
+    }
+  }
+  udp_sock_put(sock);
+}
+
+/*
+ * Sockets
+ */
+
+static void udp_sock_free(udp_sock *sock)
+{
+  if (sock->rd_ev != NULL) {
+    vde_context_event_del(sock->ctx, sock->rd_ev);
+  }
+  if (sock->tx_ev != NULL) {
+    vde_context_event_del(sock->ctx, sock->tx_ev);
+  }
+  if (sock->fd >= 0) {
+    close(sock->fd);
+  }
+  if (sock->rx_area != NULL) {
+    vde_free(sock->rx_area);
+  }
+  if (sock->tx_buf != NULL) {
+    vde_free(sock->tx_buf);
+  }
+  vde_free(sock);
+}
+
+static void udp_sock_put(udp_sock *sock)
+{
+  if (--sock->refcount == 0) {
+    udp_sock_free(sock);
+  }
+}
+
+/*
+ * Open a socket bound to local, if not NULL, and connected to remote, if not
+ * NULL. It's returned without references.
+ */
+static udp_sock *udp_sock_open(udp_tr *tr, const struct sockaddr *local,
+                               socklen_t local_len,
+                               const struct sockaddr *remote,
+                               socklen_t remote_len)
+{
+  int opt, tmp_errno;
+  unsigned int i;
+  udp_sock *sock;
+  vde_context *ctx = vde_component_get_context(tr->component);
+  int family = local != NULL ? local->sa_family : remote->sa_family;
+
+  sock = (udp_sock *)vde_calloc(sizeof(udp_sock));
+  if (sock == NULL) {
+    vde_error("%s: cannot allocate socket", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return NULL;
+  }
+  sock->ctx = ctx;
+  sock->max_payload = tr->max_payload;
+  sock->seq = tr->seq;
+  sock->connected = remote != NULL;
+
+  sock->fd = socket(family, SOCK_DGRAM, 0);
+  if (sock->fd < 0) {
+    tmp_errno = errno;
+    vde_free(sock);
+    errno = tmp_errno;
+    return NULL;
+  }
+  if (fcntl(sock->fd, F_SETFL, O_NONBLOCK) < 0) {
+    vde_error("%s: cannot set O_NONBLOCK: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  if (tr->reuseport) {
+    opt = 1;
+    if (setsockopt(sock->fd, SOL_SOCKET, SO_REUSEPORT, &opt,
+                   sizeof(opt)) < 0) {
+      vde_error("%s: cannot set SO_REUSEPORT: %s", __PRETTY_FUNCTION__,
+                strerror(errno));
+      goto error;
+    }
+  }
+  if (family == AF_INET6) {
+    // a wildcard address takes IPv4 peers as well
+    opt = 0;
+    setsockopt(sock->fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt));
+  }
+  if (local != NULL && bind(sock->fd, local, local_len) < 0) {
+    vde_error("%s: cannot bind: %s", __PRETTY_FUNCTION__, strerror(errno));
+    goto error;
+  }
+  if (remote != NULL && connect(sock->fd, remote, remote_len) < 0) {
+    vde_error("%s: cannot connect: %s", __PRETTY_FUNCTION__, strerror(errno));
+    goto error;
+  }
+
+  // segmentation is asked for each datagram, the option tells if it works
+  if (tr->gso) {
+    opt = 0;
+    sock->gso = setsockopt(sock->fd, SOL_UDP, UDP_SEGMENT, &opt,
+                           sizeof(opt)) == 0;
+    opt = 1;
+    sock->gro = setsockopt(sock->fd, SOL_UDP, UDP_GRO, &opt,
+                           sizeof(opt)) == 0;
+    if (!sock->gso || !sock->gro) {
+      vde_warning("%s: UDP segmentation offloads not available",
+                  __PRETTY_FUNCTION__);
+    }
+  }
+
+  sock->rx_buf_size = sock->gro ? GRO_BUF_SIZE : UDP_HLEN + tr->max_payload;
+  sock->rx_msgs = RX_AREA / sock->rx_buf_size;
+  if (sock->rx_msgs > RX_MAX_MSGS) {
+    sock->rx_msgs = RX_MAX_MSGS;
+  } else if (sock->rx_msgs == 0) {
+    sock->rx_msgs = 1;
+  }
+  sock->rx_area = (char *)vde_alloc(sock->rx_msgs * sock->rx_buf_size);
+  sock->tx_buf = (char *)vde_alloc(MAX_BATCH * (UDP_HLEN + tr->max_payload));
+  if (sock->rx_area == NULL || sock->tx_buf == NULL) {
+    vde_error("%s: cannot allocate buffers", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    goto error;
+  }
+  for (i = 0; i < sock->rx_msgs; i++) {
+    sock->rx_iovs[i].iov_base = sock->rx_area + i * sock->rx_buf_size;
+    sock->rx_iovs[i].iov_len = sock->rx_buf_size;
+    sock->rx_hdrs[i].msg_hdr.msg_iov = &sock->rx_iovs[i];
+    sock->rx_hdrs[i].msg_hdr.msg_iovlen = 1;
+    sock->rx_hdrs[i].msg_hdr.msg_name = &sock->rx_addrs[i];
+    sock->rx_hdrs[i].msg_hdr.msg_control = sock->rx_cmsgs[i].buf;
+  }
+
+  sock->rd_ev = vde_context_event_add(ctx, sock->fd,
+                                      VDE_EV_READ | VDE_EV_PERSIST, NULL,
+                                      &udp_sock_read_event, (void *)sock);
+  if (sock->rd_ev == NULL) {
+    vde_error("%s: cannot add read event", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    goto error;
+  }
+  return sock;
+
+error:
+  tmp_errno = errno;
+  udp_sock_free(sock);
+  errno = tmp_errno;
+  return NULL;
+}
+
+static int udp_resolve(const char *host, unsigned int port, int family,
+                       int passive, struct sockaddr_storage *addr,
+                       socklen_t *addrlen)
+{
+  struct addrinfo hints, *res;
+  char service[8];
+  int rv;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = family;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_NUMERICSERV | (passive ? AI_PASSIVE : 0);
+  snprintf(service, sizeof(service), "%u", port);
+  rv = getaddrinfo(host, service, &hints, &res);
+  if (rv) {
+    vde_error("%s: cannot resolve %s: %s", __PRETTY_FUNCTION__, host,
+              gai_strerror(rv));
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy(addr, res->ai_addr, res->ai_addrlen);
+  *addrlen = res->ai_addrlen;
+  freeaddrinfo(res);
+  return 0;
+}
+
+/*
+ * Connection
+ */
+
+static void udp_conn_close(vde_connection *conn)
+{
+  udp_peer_free(vde_connection_get_priv(conn));
+}
+
+static int udp_listen(vde_component *component)
+{
+  struct sockaddr_storage addr;
+  struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&addr;
+  socklen_t addrlen;
+  udp_sock *sock;
+  udp_tr *tr = (udp_tr *)vde_component_get_priv(component);
+
+  if (tr->listen_sock != NULL) {
+    vde_error("%s: already listening", __PRETTY_FUNCTION__);
+    errno = EBUSY;
+    return -1;
+  }
+  if (tr->port == 0) {
+    vde_error("%s: no port to listen on", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (tr->host != NULL) {
+    if (udp_resolve(tr->host, tr->port, AF_UNSPEC, 1, &addr, &addrlen)) {
+      return -1;
+    }
+    sock = udp_sock_open(tr, (struct sockaddr *)&addr, addrlen, NULL, 0);
+  } else {
+    memset(&addr, 0, sizeof(addr));
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_addr = in6addr_any;
+    sin6->sin6_port = htons(tr->port);
+    sock = udp_sock_open(tr, (struct sockaddr *)&addr, sizeof(*sin6), NULL, 0);
+    if (sock == NULL && errno == EAFNOSUPPORT) {
+      memset(&addr, 0, sizeof(addr));
+      sin->sin_family = AF_INET;
+      sin->sin_addr.s_addr = htonl(INADDR_ANY);
+      sin->sin_port = htons(tr->port);
+      sock = udp_sock_open(tr, (struct sockaddr *)&addr, sizeof(*sin), NULL,
+                           0);
+    }
+  }
+  if (sock == NULL) {
+    vde_error("%s: cannot open socket on port %u: %s", __PRETTY_FUNCTION__,
+              tr->port, strerror(errno));
+    return -1;
+  }
+  sock->tr = tr;
+  sock->refcount = 1;
+  tr->listen_sock = sock;
+  return 0;
+}
+
+static int udp_connect(vde_component *component, vde_connection *conn)
+{
+  struct sockaddr_storage local, remote;
+  socklen_t local_len = 0, remote_len;
+  udp_sock *sock;
+  udp_peer *peer;
+  udp_tr *tr = (udp_tr *)vde_component_get_priv(component);
+
+  if (tr->peer_host == NULL) {
+    vde_error("%s: no peer to connect to", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  if (udp_resolve(tr->peer_host, tr->peer_port, AF_UNSPEC, 0, &remote,
+                  &remote_len) ||
+      (tr->host != NULL &&
+       udp_resolve(tr->host, 0, remote.ss_family, 1, &local, &local_len))) {
+    return -1;
+  }
+  sock = udp_sock_open(tr, tr->host != NULL ? (struct sockaddr *)&local : NULL,
+                       local_len, (struct sockaddr *)&remote, remote_len);
+  if (sock == NULL) {
+    vde_error("%s: cannot open socket to %s: %s", __PRETTY_FUNCTION__,
+              tr->peer_host, strerror(errno));
+    return -1;
+  }
+  peer = udp_peer_new(sock, &remote, remote_len);
+  if (peer == NULL) {
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    udp_sock_free(sock);
+    errno = ENOMEM;
+    return -1;
+  }
+  peer->conn = conn;
+  vde_connection_init(conn, sock->ctx, tr->max_payload, &udp_conn_write,
+                      &udp_conn_close, (void *)peer);
+  vde_transport_call_cm_connect_cb(component, conn);
+  return 0;
+}
+
+/*
+ * Component
+ */
+
+static int udp_get_int(vde_sobj *params, const char *name, int min, int max,
+                       unsigned int *value)
+{
+  vde_sobj *param = vde_sobj_hash_lookup(params, name);
+
+  if (param == NULL) {
+    return 0;
+  }
+  if (!vde_sobj_is_type(param, vde_sobj_type_int) ||
+      vde_sobj_get_int(param) < min || vde_sobj_get_int(param) > max) {
+    vde_error("%s: %s must be an integer between %d and %d",
+              __PRETTY_FUNCTION__, name, min, max);
+    errno = EINVAL;
+    return -1;
+  }
+  *value = vde_sobj_get_int(param);
+  return 0;
+}
+
+static int udp_get_bool(vde_sobj *params, const char *name, int *value)
+{
+  vde_sobj *param = vde_sobj_hash_lookup(params, name);
+
+  if (param == NULL) {
+    return 0;
+  }
+  if (!vde_sobj_is_type(param, vde_sobj_type_bool)) {
+    vde_error("%s: %s must be a boolean", __PRETTY_FUNCTION__, name);
+    errno = EINVAL;
+    return -1;
+  }
+  *value = vde_sobj_get_bool(param);
+  return 0;
+}
+
+static int udp_get_string(vde_sobj *params, const char *name, char **value)
+{
+  vde_sobj *param = vde_sobj_hash_lookup(params, name);
+
+  if (param == NULL) {
+    return 0;
+  }
+  if (!vde_sobj_is_type(param, vde_sobj_type_string) ||
+      strlen(vde_sobj_get_string(param)) == 0) {
+    vde_error("%s: %s must be a non empty string", __PRETTY_FUNCTION__, name);
+    errno = EINVAL;
+    return -1;
+  }
+  *value = strdup(vde_sobj_get_string(param));
+  if (*value == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+static void udp_tr_free(udp_tr *tr)
+{
+  if (tr->host != NULL) {
+    free(tr->host);
+  }
+  if (tr->peer_host != NULL) {
+    free(tr->peer_host);
+  }
+  vde_free(tr);
+}
+
+static int transport_udp_init(vde_component *component, vde_sobj *params)
+{
+  udp_tr *tr;
+
+  vde_assert(component != NULL);
+
+  if (!params || !vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    vde_error("%s: no parameters hash received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  tr = (udp_tr *)vde_calloc(sizeof(udp_tr));
+  if (tr == NULL) {
+    vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+  tr->component = component;
+  tr->max_payload = DEFAULT_MAX_PAYLOAD;
+  tr->max_peers = DEFAULT_MAX_PEERS;
+  tr->gso = 1;
+
+  if (udp_get_string(params, "host", &tr->host) ||
+      udp_get_int(params, "port", 0, 65535, &tr->port) ||
+      udp_get_string(params, "peer_host", &tr->peer_host) ||
+      udp_get_int(params, "peer_port", 1, 65535, &tr->peer_port) ||
+      udp_get_int(params, "max_payload", DEFAULT_MAX_PAYLOAD, MAX_PAYLOAD,
+                  &tr->max_payload) ||
+      udp_get_int(params, "max_peers", 1, MAX_PEERS, &tr->max_peers) ||
+      udp_get_bool(params, "reuseport", &tr->reuseport) ||
+      udp_get_bool(params, "gso", &tr->gso) ||
+      udp_get_bool(params, "seq", &tr->seq)) {
+    udp_tr_free(tr);
+    return -1;
+  }
+  if (tr->peer_host != NULL && tr->peer_port == 0) {
+    vde_error("%s: no peer_port received", __PRETTY_FUNCTION__);
+    udp_tr_free(tr);
+    errno = EINVAL;
+    return -1;
+  }
+
+  vde_component_set_priv(component, (void *)tr);
+  return 0;
+}
+
+static void transport_udp_fini(vde_component *component)
+{
+  udp_tr *tr = (udp_tr *)vde_component_get_priv(component);
+
+  vde_assert(component != NULL);
+
+  // connections belong to their engines, the listening socket stays with
+  // them but takes no new peers
+  if (tr->listen_sock != NULL) {
+    tr->listen_sock->tr = NULL;
+    udp_sock_put(tr->listen_sock);
+  }
+  udp_tr_free(tr);
+}
+
+component_ops transport_udp_component_ops = {
+  .init = transport_udp_init,
+  .fini = transport_udp_fini,
+  .get_configuration = NULL,
+  .set_configuration = NULL,
+  .get_policy = NULL,
+  .set_policy = NULL,
+};
+
+vde_module VDE_MODULE_START = {
+  .kind = VDE_TRANSPORT,
+  .family = "udp",
+  .cops = &transport_udp_component_ops,
+  .tr_listen = &udp_listen,
+  .tr_connect = &udp_connect,
+};
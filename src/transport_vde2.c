@@ -23,6 +23,12 @@
 #include <sys/un.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
 
 #include <vde3.h>
 
@@ -32,20 +38,40 @@
 #include <vde3/transport.h>
 #include <vde3/context.h>
 #include <vde3/packet.h>
-
-#define LISTEN_QUEUE 15
-#define MAX_HEAD_SZ 4 /* size of prellocated space before payload */
-#define MAX_TAIL_SZ 0 /* size of prellocated space after payload */
-#define PKT_DATA_SZ (sizeof(vde_hdr) + MAX_HEAD_SZ + sizeof(struct eth_frame) \
-                     + MAX_TAIL_SZ)
+#include <vde3/pool.h>
+#include <vde3/qdisc.h>
+#include <vde3/spsc.h>
+#include <vde3/trace.h>
+
+// listen backlog, set with "listen_backlog" param
+#define DEFAULT_LISTEN_BACKLOG 15
+#define MAX_LISTEN_BACKLOG 65535
+// time peers have to complete the handshake, "handshake_timeout_ms" param
+#define DEFAULT_HANDSHAKE_TIMEOUT 5000
+#define MAX_HANDSHAKE_TIMEOUT 600000
+// accepted connections still in the handshake, set with "max_half_open"
+// param: over the limit new ones are closed right away
+#define DEFAULT_MAX_HALF_OPEN 64
+#define MAX_HALF_OPEN 65536
+#define DEFAULT_HEAD_SZ 4 /* head space usually requested by engines */
+#define DEFAULT_TAIL_SZ 0 /* tail space usually requested by engines */
+#define PKT_DATA_SZ(payload) (sizeof(vde_hdr) + DEFAULT_HEAD_SZ + (payload) \
+                              + DEFAULT_TAIL_SZ)
 /*
  * pkt_data_sz = vde 3 header (sizeof(vde_hdr))
  *             + space reserved for vlan tags (4)
- *             + frame (1500)
- *             + trailing space (4)
+ *             + frame (max_payload, 1514 + 4 trailer by default)
  *             + further tail space (0)
+ *
+ * Any other head/tail size works as well, packets just come from another
+ * pool size class.
  */
 
+// largest frame accepted with "max_payload" param, e.g. 9018 for jumbo frames:
+// packets must still come from a pool size class
+#define DEFAULT_MAX_PAYLOAD sizeof(struct eth_frame)
+#define MAX_PAYLOAD (VDE_POOL_MAX_CHUNK - sizeof(vde_pkt) - PKT_DATA_SZ(0))
+
 // size of sockaddr_un.sun_path
 #define UNIX_PATH_MAX 108
 
@@ -53,12 +79,45 @@
 #define MAXQLEN 4192
 // end of vde2 packetq.c
 
+// number of packets preallocated in the context pool
+#define POOL_LOW_WM 64
+
+// frames read/sent with a single recvmmsg/sendmmsg, set with "batch" param
+#define DEFAULT_BATCH 16
+#define MAX_BATCH 64
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define HAVE_MMSG
+#endif
+
+// slots of each shared memory ring, set with "shm_slots" param
+#define DEFAULT_SHM_SLOTS 256
+#define MAX_SHM_SLOTS 4096
+// room in front of frames in ring buffers, as for PKT_DATA_SZ()
+#define SHM_HEADROOM 32
+#define SHM_VERSION 1
+#define SHM_DESCRIPTION "vde3 shm"
+// batches read before letting other events run
+#define SHM_READ_BUDGET 4
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_EVENTFD_H)
+#define HAVE_SHM
+#endif
+
+// hot restart, see vde2_handoff_send()
+#define HANDOFF_MAGIC 0x76646568 /* "vdeh" */
+#define HANDOFF_VERSION 1
+#define HANDOFF_SOCK "/handoff"
+// ms each process waits for the other one during the handoff
+#define HANDOFF_TIMEOUT 2000
+#define MAX_HANDOFF_CONNS 65536
+#define MAX_HANDOFF_STATE (256 << 20)
+
 // taken from vde2 datasock.c
 #define DATA_BUF_SIZE 131072
 #define SWITCH_MAGIC 0xfeedface
 #define REQBUFLEN 256
 
-enum request_type { REQ_NEW_CONTROL, REQ_NEW_PORT0 };
+enum request_type { REQ_NEW_CONTROL, REQ_NEW_PORT0,
+                    REQ_NEW_SHM = 0x53484d /* vde 3 only */ };
 
 // this is request_v3
 typedef struct {
@@ -70,11 +129,29 @@ typedef struct {
 } __attribute__((packed)) vde2_request;
 // end of vde2 datasock.c
 
+// first message of a handoff, it carries the listen and handoff sockets
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t conns; //!< connection messages following this one
+  uint32_t connections; //!< data sockets named so far
+  uint32_t state_len; //!< serialized engine state following the connections
+} vde2_handoff_hdr;
+
+// a connection, it carries its ctl and data sockets
+typedef struct {
+  uint32_t id; //!< see vde_connection_get_handoff_id()
+  struct sockaddr_un local_sa;
+  struct sockaddr_un remote_sa;
+} vde2_handoff_conn;
+
+// an entry of the send queue, it holds a reference on the packet
 typedef struct {
+  vde_qentry entry;
   unsigned int numtries;
-  vde_pkt pkt;
-  char data[PKT_DATA_SZ];
-} vde2_pkt;
+} vde2_qpkt;
+
+typedef struct vde2_shm vde2_shm;
 
 typedef struct {
   int data_fd;
@@ -82,12 +159,20 @@ typedef struct {
   void *data_ev_wr;
   int ctl_fd;
   void *ctl_ev;
-  vde_queue *pkt_queue;
+  vde_qdisc *pkt_queue;
   struct sockaddr_un local_sa;
   struct sockaddr_un remote_sa;
   vde2_request *remote_request;
+  uint64_t deadline; //!< monotonic ns, end of the handshake
   vde_connection *conn;
   vde_component *transport;
+  unsigned int batch;
+  unsigned int max_payload;
+  // receive buffers, kept across read events unless a reader shares them
+  vde_pkt *rx_pkts[MAX_BATCH];
+  // shared memory rings used in place of data_fd, if any
+  vde2_shm *shm;
+  int handed_off; //!< its sockets belong to another process now
 } vde2_conn;
 
 typedef struct {
@@ -96,6 +181,21 @@ typedef struct {
   void *listen_event;
   unsigned int connections;
   vde_list *pending_conns;
+  unsigned int half_open; //!< length of pending_conns
+  unsigned int max_half_open;
+  unsigned int listen_backlog;
+  uint64_t handshake_timeout; //!< ns
+  uint64_t rejected; //!< over max_half_open
+  uint64_t timeouts; //!< handshakes not completed in time
+  unsigned int batch;
+  unsigned int max_payload;
+  unsigned int shm_slots;
+  vde_qdisc_conf qdisc;
+  vde_list *conns; //!< accepted connections past the handshake
+  int handoff; //!< connections can be handed over to a restarting process
+  int resume; //!< connections are taken over from a running process
+  int handoff_fd;
+  void *handoff_event;
 } vde2_tr;
 
 void vde2_conn_read_ctl_event(int ctl_fd, short event_type, void *arg)
@@ -107,8 +207,8 @@ void vde2_conn_read_ctl_event(int ctl_fd, short event_type, void *arg)
   len = read(v2_conn->ctl_fd, reqbuf, REQBUFLEN);
   if (len < 0) {
     if (errno == EAGAIN) {
-      vde_warning("%s: got EAGAIN on ctl_fd %d", __PRETTY_FUNCTION__,
-                  v2_conn->ctl_fd);
+      vde_debug("%s: got EAGAIN on ctl_fd %d", __PRETTY_FUNCTION__,
+                v2_conn->ctl_fd);
       return;
     }
     if (vde_connection_call_error(conn, NULL, CONN_READ_CLOSED) &&
@@ -140,9 +240,144 @@ err_close:
   vde_connection_delete(conn);
 }
 
+static inline void vde2_qpkt_free(vde2_qpkt *qpkt)
+{
+  vde_pkt_put(qpkt->entry.pkt);
+  vde_pool_free(qpkt);
+}
+
+// called by the queue discipline for packets waiting too long
+static void vde2_qpkt_drop(vde_qentry *entry, void *arg)
+{
+  vde_connection *conn = (vde_connection *)arg;
+
+  vde_connection_stats_drop(conn, VDE_CONN_DROP_AQM);
+  vde_connection_queue_del(conn, entry->pkt);
+  vde2_qpkt_free((vde2_qpkt *)entry);
+}
+
+static void vde2_qpkt_release(vde_qentry *entry, void *arg)
+{
+  vde2_qpkt_free((vde2_qpkt *)entry);
+}
+
+static inline void vde2_conn_read_error(vde2_conn *v2_conn, int len)
+{
+  if (len < 0) {
+    if (errno == EAGAIN) {
+      vde_debug("%s: got EAGAIN on data_fd %d", __PRETTY_FUNCTION__,
+                v2_conn->data_fd);
+    } else {
+    // XXX: handle this error situation, call error_cb?
+    vde_warning("%s: error reading from data_fd %d: %s", __PRETTY_FUNCTION__,
+                v2_conn->data_fd, strerror(errno));
+    }
+  } else if (len == 0) {
+    vde_warning("%s: EOF from data_fd %d: %s", __PRETTY_FUNCTION__,
+                v2_conn->data_fd, strerror(errno));
+  }
+}
+
+#ifdef HAVE_MMSG
+/*
+ * Make sure every receive buffer is a private pooled packet laid out for the
+ * current head/tail sizes, returns the number of available buffers.
+ */
+static unsigned int vde2_conn_rx_refill(vde2_conn *v2_conn)
+{
+  unsigned int i;
+  vde_pkt *pkt;
+  vde_connection *conn = v2_conn->conn;
+  unsigned int head_sz = vde_connection_get_pkt_headsize(conn);
+  unsigned int tail_sz = vde_connection_get_pkt_tailsize(conn);
+  unsigned int data_sz = sizeof(vde_hdr) + head_sz + v2_conn->max_payload
+                         + tail_sz;
+
+  for (i = 0; i < v2_conn->batch; i++) {
+    pkt = v2_conn->rx_pkts[i];
+    if (pkt != NULL && pkt->data_size == data_sz) {
+      vde_pkt_layout(pkt, data_sz, head_sz, tail_sz);
+      memset(pkt->hdr, 0, sizeof(vde_hdr));
+      continue;
+    }
+    if (pkt != NULL) {
+      vde_pkt_put(pkt);
+    }
+    v2_conn->rx_pkts[i] = vde_pkt_new(vde_connection_get_context(conn),
+                                      v2_conn->max_payload, head_sz, tail_sz);
+    if (v2_conn->rx_pkts[i] == NULL) {
+      break;
+    }
+  }
+  return i;
+}
+
+static void vde2_conn_read_data_batch(vde2_conn *v2_conn)
+{
+  struct mmsghdr msgs[MAX_BATCH];
+  struct iovec iovs[MAX_BATCH];
+  vde_pkt *ready[MAX_BATCH];
+  vde_pkt *pkt;
+  unsigned int i, avail, count = 0;
+  int len;
+  int cb_errno = 0;
+  vde_connection *conn = v2_conn->conn;
+
+  avail = vde2_conn_rx_refill(v2_conn);
+  if (avail == 0) {
+    vde_warning("%s: cannot alloc new pkt, skipping", __PRETTY_FUNCTION__);
+    return;
+  }
+
+  memset(msgs, 0, avail * sizeof(struct mmsghdr));
+  for (i = 0; i < avail; i++) {
+    iovs[i].iov_base = v2_conn->rx_pkts[i]->payload;
+    iovs[i].iov_len = v2_conn->max_payload;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  len = recvmmsg(v2_conn->data_fd, msgs, avail, 0, NULL);
+  if (len <= 0) {
+    vde2_conn_read_error(v2_conn, len);
+    return;
+  }
+
+  for (i = 0; i < len; i++) {
+    // XXX: check received sock with remote path??
+    if (msgs[i].msg_len >= sizeof(struct eth_hdr) &&
+        !(msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+      // XXX: set hdr version and type
+      pkt = v2_conn->rx_pkts[i];
+      pkt->hdr->pkt_len = msgs[i].msg_len;
+      VDE_PROBE2(vde2__rx, conn, pkt);
+      ready[count++] = pkt;
+    } else {
+      vde_connection_stats_drop(conn, VDE_CONN_DROP_RX_ERROR);
+    }
+  }
+
+  if (count > 0 && vde_connection_call_read_batch(conn, ready, count)) {
+    cb_errno = errno;
+  }
+
+  // buffers kept by readers are left to them, new ones will be allocated
+  for (i = 0; i < len; i++) {
+    if (vde_pkt_is_shared(v2_conn->rx_pkts[i])) {
+      vde_pkt_put(v2_conn->rx_pkts[i]);
+      v2_conn->rx_pkts[i] = NULL;
+    }
+  }
+
+  if (cb_errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+  }
+}
+#endif
+
 void vde2_conn_read_data_event(int data_fd, short event_type, void *arg)
 {
-  vde2_pkt stack_pkt;
   vde_pkt *pkt;
   struct sockaddr sock;
   int len;
@@ -151,42 +386,42 @@ void vde2_conn_read_data_event(int data_fd, short event_type, void *arg)
   vde2_conn *v2_conn = (vde2_conn *)arg;
   vde_connection *conn = v2_conn->conn;
 
-  if ( (vde_connection_get_pkt_headsize(conn) <= MAX_HEAD_SZ)
-        && (vde_connection_get_pkt_tailsize(conn) <= MAX_TAIL_SZ) ) {
-    pkt = &stack_pkt.pkt;
-    vde_pkt_init(pkt, PKT_DATA_SZ, vde_connection_get_pkt_headsize(conn),
-                 vde_connection_get_pkt_tailsize(conn));
-  } else {
-    // XXX: perform dynamic allocation
-    vde_warning("%s: requested head + tail size too large, skipping",
-                __PRETTY_FUNCTION__);
+#ifdef HAVE_MMSG
+  if (v2_conn->batch > 1) {
+    vde2_conn_read_data_batch(v2_conn);
+    return;
+  }
+#endif
+
+  // the packet comes from the pool so readers can take a reference on it
+  // instead of copying
+  pkt = vde_pkt_new(vde_connection_get_context(conn), v2_conn->max_payload,
+                    vde_connection_get_pkt_headsize(conn),
+                    vde_connection_get_pkt_tailsize(conn));
+  if (pkt == NULL) {
+    vde_warning("%s: cannot alloc new pkt, skipping", __PRETTY_FUNCTION__);
     return;
   }
 
-  len = recvfrom(v2_conn->data_fd, pkt->payload, sizeof(struct eth_frame), 0,
-                 &sock, &socklen);
+  // with MSG_TRUNC the real length of frames larger than the buffer is
+  // returned
+  len = recvfrom(v2_conn->data_fd, pkt->payload, v2_conn->max_payload,
+                 MSG_TRUNC, &sock, &socklen);
   // XXX: check received sock with remote path??
-  if (len >= sizeof(struct eth_hdr)) {
+  if (len >= sizeof(struct eth_hdr) && len <= v2_conn->max_payload) {
     // XXX: set hdr version and type
     pkt->hdr->pkt_len = len;
+    VDE_PROBE2(vde2__rx, conn, pkt);
     if (vde_connection_call_read(conn, pkt)) {
       cb_errno = errno;
     }
-  } else if (len < 0) {
-    if (errno == EAGAIN) {
-      vde_warning("%s: got EAGAIN on data_fd %d", __PRETTY_FUNCTION__,
-                  v2_conn->data_fd);
-    } else {
-    // XXX: handle this error situation, call error_cb?
-    vde_warning("%s: error reading from data_fd %d: %s", __PRETTY_FUNCTION__,
-                v2_conn->data_fd, strerror(errno));
-    }
-  } else if (len == 0) {
-    vde_warning("%s: EOF from data_fd %d: %s", __PRETTY_FUNCTION__,
-                v2_conn->data_fd, strerror(errno));
+  } else if (len > 0) {
+    vde_connection_stats_drop(conn, VDE_CONN_DROP_RX_ERROR);
+  } else {
+    vde2_conn_read_error(v2_conn, len);
   }
 
-  // XXX: free packet if previously allocated with dynamic allocation
+  vde_pkt_put(pkt);
 
   if (cb_errno == EPIPE) {
     vde_connection_fini(conn);
@@ -194,60 +429,174 @@ void vde2_conn_read_data_event(int data_fd, short event_type, void *arg)
   }
 }
 
-void vde2_conn_write_data_event(int data_fd, short event_type, void *arg)
+/*
+ * Handle the outcome of sending a queued packet, len is the value returned by
+ * the send call: returns 0 if the next packet can be sent, 1 if sending must
+ * stop for now and -1 if the connection has to be closed.
+ */
+static int vde2_conn_tx_done(vde2_conn *v2_conn, vde2_qpkt *v2_pkt, int len)
 {
-  int len;
-  vde2_pkt *v2_pkt;
-  vde_pkt *pkt;
   int cb_errno = 0;
-  vde2_conn *v2_conn = (vde2_conn *)arg;
+  vde_pkt *pkt = v2_pkt->entry.pkt;
   vde_connection *conn = v2_conn->conn;
 
-  v2_pkt = vde_queue_pop_tail(v2_conn->pkt_queue);
-  while (v2_pkt != NULL) {
-    pkt = &v2_pkt->pkt;
+  if (len == pkt->hdr->pkt_len) {
+    VDE_PROBE2(vde2__tx, conn, pkt);
+    vde_connection_queue_del(conn, pkt);
+    if (vde_connection_call_write(conn, pkt)) {
+      cb_errno = errno;
+    }
+    vde2_qpkt_free(v2_pkt);
+    if (cb_errno == EPIPE) {
+      return -1;
+    }
+    return 0;
+  } else if ((len < 0) && (errno != EAGAIN)) {
+    vde_connection_stats_drop(conn, VDE_CONN_DROP_WRITE_ERROR);
+    vde_connection_queue_del(conn, pkt);
+    if (vde_connection_call_error(conn, pkt, CONN_WRITE_CLOSED)) {
+      cb_errno = errno;
+    }
+    vde2_qpkt_free(v2_pkt);
+    if (cb_errno == EPIPE) {
+      return -1;
+    }
+    vde_warning("%s: fatal error on data_fd %d but connection not closed",
+                __PRETTY_FUNCTION__, v2_conn->data_fd);
+    return 1;
+  }
+
+  /* (0 < len < pkt_len) || (len < 0 && errno == EAGAIN) */
+  v2_pkt->numtries++;
+  if (v2_pkt->numtries > vde_connection_get_send_maxtries(conn)) {
+    vde_connection_stats_drop(conn, VDE_CONN_DROP_TIMEOUT);
+    vde_connection_queue_del(conn, pkt);
+    if (vde_connection_call_error(conn, pkt, CONN_WRITE_DELAY)) {
+      cb_errno = errno;
+    }
+    vde2_qpkt_free(v2_pkt);
+    if (cb_errno == EPIPE) {
+      return -1;
+    }
+  } else {
+    vde_connection_stats_retry(conn);
+    vde_qdisc_requeue(v2_conn->pkt_queue, &v2_pkt->entry);
+  }
+  return 1; // give up sending
+}
+
+#ifdef HAVE_MMSG
+// put back unsent packets so that v2_pkts[from] is the next to be sent
+static inline void vde2_conn_tx_requeue(vde2_conn *v2_conn,
+                                        vde2_qpkt **v2_pkts,
+                                        unsigned int from, unsigned int to)
+{
+  while (to > from) {
+    vde_qdisc_requeue(v2_conn->pkt_queue, &v2_pkts[--to]->entry);
+  }
+}
+
+// returns 0 if the queue has been drained, 1 if sending must stop for now
+// and -1 if the connection has to be closed
+static int vde2_conn_write_data_batch(vde2_conn *v2_conn)
+{
+  struct mmsghdr msgs[MAX_BATCH];
+  struct iovec iovs[MAX_BATCH];
+  vde2_qpkt *v2_pkts[MAX_BATCH];
+  vde_pkt *pkt;
+  unsigned int i, count;
+  int sent, rv, tmp_errno;
+  vde_qdisc *queue = v2_conn->pkt_queue;
+  uint64_t now = vde_qdisc_now();
+
+  do {
+    count = 0;
+    while (count < v2_conn->batch &&
+           (v2_pkts[count] = (vde2_qpkt *)vde_qdisc_dequeue(queue, now))) {
+      pkt = v2_pkts[count]->entry.pkt;
+      iovs[count].iov_base = pkt->payload;
+      iovs[count].iov_len = pkt->hdr->pkt_len;
+      memset(&msgs[count], 0, sizeof(struct mmsghdr));
+      msgs[count].msg_hdr.msg_name = &v2_conn->remote_sa;
+      msgs[count].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+      msgs[count].msg_hdr.msg_iov = &iovs[count];
+      msgs[count].msg_hdr.msg_iovlen = 1;
+      count++;
+    }
+    if (count == 0) {
+      return 0;
+    }
+
+    sent = sendmmsg(v2_conn->data_fd, msgs, count, 0);
+    if (sent < 0) {
+      // nothing sent, the first packet gets the error: retried on EAGAIN,
+      // dropped otherwise
+      tmp_errno = errno;
+      vde2_conn_tx_requeue(v2_conn, v2_pkts, 1, count);
+      errno = tmp_errno;
+      return vde2_conn_tx_done(v2_conn, v2_pkts[0], -1);
+    }
+    for (i = 0; i < (unsigned int)sent; i++) {
+      rv = vde2_conn_tx_done(v2_conn, v2_pkts[i], msgs[i].msg_len);
+      if (rv) {
+        vde2_conn_tx_requeue(v2_conn, v2_pkts, i + 1, count);
+        return rv;
+      }
+    }
+    if (i < count) {
+      // the error of the first unsent packet is unknown, it will be retried
+      vde2_conn_tx_requeue(v2_conn, v2_pkts, i + 1, count);
+      errno = EAGAIN;
+      return vde2_conn_tx_done(v2_conn, v2_pkts[i], -1);
+    }
+  } while (count == v2_conn->batch);
+
+  return 0;
+}
+#endif
+
+// same return values as vde2_conn_write_data_batch
+static int vde2_conn_write_data_single(vde2_conn *v2_conn)
+{
+  int len;
+  int rv = 0;
+  vde2_qpkt *v2_pkt;
+  vde_pkt *pkt;
+  uint64_t now = vde_qdisc_now();
+
+  while (rv == 0 &&
+         (v2_pkt = (vde2_qpkt *)vde_qdisc_dequeue(v2_conn->pkt_queue,
+                                                  now)) != NULL) {
+    pkt = v2_pkt->entry.pkt;
     len = sendto(v2_conn->data_fd, pkt->payload, pkt->hdr->pkt_len, 0,
                  (const struct sockaddr *)&v2_conn->remote_sa,
                  sizeof(struct sockaddr_un));
-    if (len == pkt->hdr->pkt_len) {
-      if (vde_connection_call_write(conn, pkt)) {
-        cb_errno = errno;
-      }
-      vde_cached_free_type(vde2_pkt, v2_pkt);
-      if (cb_errno == EPIPE) {
-        goto err_close;
-      }
-    } else if ((len < 0) && (errno != EAGAIN)) {
-      if (vde_connection_call_error(conn, pkt, CONN_WRITE_CLOSED)) {
-        cb_errno = errno;
-      }
-      vde_cached_free_type(vde2_pkt, v2_pkt);
-      if (cb_errno == EPIPE) {
-        goto err_close;
-      } else {
-        vde_warning("%s: fatal error on data_fd %d but connection not closed",
-                    __PRETTY_FUNCTION__, v2_conn->data_fd);
-        break;
-      }
-    } else { /* (0 < len < pkt_len) || (len < 0 && errno == EAGAIN) */
-      v2_pkt->numtries++;
-      if (v2_pkt->numtries > vde_connection_get_send_maxtries(conn)) {
-        if (vde_connection_call_error(conn, pkt, CONN_WRITE_DELAY)) {
-          cb_errno = errno;
-        }
-        vde_cached_free_type(vde2_pkt, v2_pkt);
-        if (cb_errno == EPIPE) {
-          goto err_close;
-        }
-      } else {
-        vde_queue_push_tail(v2_conn->pkt_queue, v2_pkt);
-      }
-      break; // give up sending
-    }
-    v2_pkt = vde_queue_pop_tail(v2_conn->pkt_queue);
+    rv = vde2_conn_tx_done(v2_conn, v2_pkt, len);
   }
+  return rv;
+}
 
-  if (v2_pkt == NULL) {
+void vde2_conn_write_data_event(int data_fd, short event_type, void *arg)
+{
+  int rv;
+  vde2_conn *v2_conn = (vde2_conn *)arg;
+  vde_connection *conn = v2_conn->conn;
+
+#ifdef HAVE_MMSG
+  if (v2_conn->batch > 1) {
+    rv = vde2_conn_write_data_batch(v2_conn);
+  } else {
+    rv = vde2_conn_write_data_single(v2_conn);
+  }
+#else
+  rv = vde2_conn_write_data_single(v2_conn);
+#endif
+
+  if (rv < 0) {
+    goto err_close;
+  }
+
+  if (vde_qdisc_get_length(v2_conn->pkt_queue) == 0) {
     vde_context_event_del(vde_connection_get_context(conn),
                           v2_conn->data_ev_wr);
     v2_conn->data_ev_wr = NULL;
@@ -260,99 +609,629 @@ err_close:
   vde_connection_delete(conn);
 }
 
-int vde2_conn_write(vde_connection *conn, vde_pkt *pkt)
+// the timeout for the next handshake event, at least 1ms so that an expired
+// deadline is still reported through the callback
+static struct timeval *vde2_handshake_left(vde2_conn *v2_conn,
+                                           struct timeval *tv)
 {
-  vde2_pkt *v2_pkt;
-  vde2_conn *v2_conn = vde_connection_get_priv(conn);
+  uint64_t now = vde_qdisc_now();
+  uint64_t left = v2_conn->deadline > now ? v2_conn->deadline - now : 0;
 
-  if (vde_queue_get_length(v2_conn->pkt_queue) >= MAXQLEN) {
-    vde_warning("%s: packet queue for %d is full, discarding",
-                __PRETTY_FUNCTION__, v2_conn->data_fd);
-    errno = EAGAIN;
-    return -1; // discard pkt
-  }
-  if (pkt->data_size > PKT_DATA_SZ) {
-    // XXX: should alloc a struct greater than sizeof(vde2_pkt)
-    vde_warning("%s: packet size larger than vde2_pkt, discarding",
-                __PRETTY_FUNCTION__);
-    errno = EBADMSG;
-    return -1;
-  }
-  v2_pkt = vde_cached_alloc(sizeof(vde2_pkt));
-  if (v2_pkt == NULL) {
-    vde_warning("%s: cannot alloc new pkt, discarding", __PRETTY_FUNCTION__);
-    errno = ENOMEM;
-    return -1;
+  if (left < 1000000) {
+    left = 1000000;
   }
+  tv->tv_sec = left / 1000000000;
+  tv->tv_usec = (left % 1000000000) / 1000;
+  return tv;
+}
 
-  v2_pkt->numtries = 0;
+/*
+ * Shared memory rings
+ *
+ * vde 3 peers on the same host can ask with a REQ_NEW_SHM request for a
+ * memfd holding a pair of descriptor rings, each one with its own frame
+ * buffers, instead of a data socket. The memfd and the two doorbells come
+ * with the reply to the request, over the control socket.
+ *
+ * Ring i is written by side i, doorbell i wakes side i up: the switch is side
+ * 0, the peer side 1. A frame is copied by the writer into the buffer of the
+ * slot it is described by, readers get views on it. A side about to wait for
+ * its doorbell flags itself sleeping and looks at the ring once more, writers
+ * ring the doorbell only if they find the flag set, then clear it.
+ *
+ * The peer is trusted as far as it can reach the switch control socket: the
+ * layout is decided by the switch, descriptors are checked against it and
+ * frames are read in place. A peer changing a frame being read only changes
+ * what it has sent.
+ */
 
-  vde_pkt_compact_cpy(&v2_pkt->pkt, pkt);
+#ifdef HAVE_SHM
 
-  // XXX: check push ok
-  vde_queue_push_head(v2_conn->pkt_queue, v2_pkt);
+typedef struct {
+  uint32_t off; //!< of the frame, from the start of the ring buffers
+  uint16_t len;
+  uint8_t version;
+  uint8_t type;
+} vde2_shm_desc;
 
-  if (v2_conn->data_ev_wr == NULL) {
-    v2_conn->data_ev_wr = vde_context_event_add(
-                            vde_connection_get_context(conn),
-                            v2_conn->data_fd,
-                            VDE_EV_WRITE|VDE_EV_PERSIST,
-                            vde_connection_get_send_maxtimeout(conn),
-                            &vde2_conn_write_data_event,
-                            (void *)v2_conn);
-  }
-  return 0;
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slots;
+  uint32_t buf_size;
+  // written by both sides
+  struct {
+    uint32_t sleeping __attribute__((aligned(VDE_CACHELINE_SIZE)));
+  } waiters[2];
+  vde_spsc_index index[2];
+} vde2_shm_hdr;
+
+// sent along with the memfd and the doorbells
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slots;
+  uint32_t buf_size;
+} vde2_shm_reply;
+
+struct vde2_shm {
+  vde_spsc_ring tx;
+  vde_spsc_ring rx;
+  unsigned int side;
+  unsigned int slots;
+  unsigned int buf_size;
+  char *map;
+  size_t map_size;
+  vde2_shm_hdr *hdr;
+  vde2_shm_desc *tx_descs;
+  char *tx_bufs;
+  vde2_shm_desc *rx_descs;
+  char *rx_bufs;
+  size_t rx_bufs_size;
+  vde_doorbell doorbells[2];
+  void *db_ev;
+};
+
+static inline size_t vde2_shm_descs_off(unsigned int slots, unsigned int side)
+{
+  return sizeof(vde2_shm_hdr) + (size_t)side * slots * sizeof(vde2_shm_desc);
 }
 
-void vde2_conn_close(vde_connection *conn)
+static inline size_t vde2_shm_bufs_off(unsigned int slots,
+                                       unsigned int buf_size,
+                                       unsigned int side)
 {
-  vde2_pkt *pkt;
-  vde2_conn *v2_conn = vde_connection_get_priv(conn);
-  vde_context *ctx = vde_connection_get_context(conn);
+  return vde2_shm_descs_off(slots, 2) + (size_t)side * slots * buf_size;
+}
 
-  if (v2_conn->data_fd >= 0){
-    close(v2_conn->data_fd);
+static vde2_shm *vde2_shm_new(unsigned int side)
+{
+  vde2_shm *shm;
+
+  // rings are cache line aligned
+  if (posix_memalign((void **)&shm, VDE_CACHELINE_SIZE, sizeof(vde2_shm))) {
+    errno = ENOMEM;
+    return NULL;
   }
-  if (v2_conn->data_ev_rd != NULL) {
-    vde_context_event_del(ctx, v2_conn->data_ev_rd);
+  memset(shm, 0, sizeof(vde2_shm));
+  shm->side = side;
+  shm->doorbells[0].rfd = shm->doorbells[0].wfd = -1;
+  shm->doorbells[1].rfd = shm->doorbells[1].wfd = -1;
+  return shm;
+}
+
+static void vde2_shm_delete(vde2_shm *shm, vde_context *ctx)
+{
+  unsigned int i;
+
+  if (shm->db_ev != NULL) {
+    vde_context_event_del(ctx, shm->db_ev);
   }
-  if (v2_conn->data_ev_wr != NULL) {
-    vde_context_event_del(ctx, v2_conn->data_ev_wr);
+  if (shm->map != NULL) {
+    munmap(shm->map, shm->map_size);
   }
-  if (v2_conn->local_sa.sun_path != NULL) {
-    unlink(v2_conn->local_sa.sun_path);
+  for (i = 0; i < 2; i++) {
+    if (shm->doorbells[i].rfd != -1) {
+      vde_doorbell_fini(&shm->doorbells[i]);
+    }
   }
-  if (v2_conn->ctl_fd >= 0){
-    close(v2_conn->ctl_fd);
+  free(shm);
+}
+
+static int vde2_shm_map(vde2_shm *shm, int fd, unsigned int slots,
+                        unsigned int buf_size)
+{
+  unsigned int side = shm->side;
+
+  shm->slots = slots;
+  shm->buf_size = buf_size;
+  shm->map_size = vde2_shm_bufs_off(slots, buf_size, 2);
+  shm->map = mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                  0);
+  if (shm->map == MAP_FAILED) {
+    shm->map = NULL;
+    return -1;
   }
-  if (v2_conn->ctl_ev != NULL) {
-    vde_context_event_del(ctx, v2_conn->ctl_ev);
+  shm->hdr = (vde2_shm_hdr *)shm->map;
+  shm->tx_descs = (vde2_shm_desc *)(shm->map +
+                                    vde2_shm_descs_off(slots, side));
+  shm->tx_bufs = shm->map + vde2_shm_bufs_off(slots, buf_size, side);
+  shm->rx_descs = (vde2_shm_desc *)(shm->map +
+                                    vde2_shm_descs_off(slots, !side));
+  shm->rx_bufs = shm->map + vde2_shm_bufs_off(slots, buf_size, !side);
+  shm->rx_bufs_size = (size_t)slots * buf_size;
+  if (vde_spsc_ring_attach(&shm->tx, &shm->hdr->index[side], shm->tx_descs,
+                           slots, sizeof(vde2_shm_desc)) ||
+      vde_spsc_ring_attach(&shm->rx, &shm->hdr->index[!side], shm->rx_descs,
+                           slots, sizeof(vde2_shm_desc))) {
+    return -1;
   }
-  if (v2_conn->remote_request) {
-    vde_free(v2_conn->remote_request);
+  return 0;
+}
+
+// switch side, returns the memfd to be sent to the peer
+static int vde2_shm_create(vde2_shm *shm, unsigned int slots,
+                           unsigned int max_payload)
+{
+  int fd, tmp_errno;
+  unsigned int buf_size = (SHM_HEADROOM + max_payload + VDE_CACHELINE_SIZE - 1)
+                          & ~(VDE_CACHELINE_SIZE - 1);
+
+  fd = memfd_create("vde2_shm", MFD_CLOEXEC);
+  if (fd < 0) {
+    return -1;
   }
-  pkt = vde_queue_pop_tail(v2_conn->pkt_queue);
-  while (pkt != NULL) {
-    // XXX: handle dynamic allocation case
-    vde_cached_free_type(vde2_pkt, pkt);
-    pkt = vde_queue_pop_tail(v2_conn->pkt_queue);
+  if (ftruncate(fd, vde2_shm_bufs_off(slots, buf_size, 2)) < 0 ||
+      vde2_shm_map(shm, fd, slots, buf_size) ||
+      vde_doorbell_init(&shm->doorbells[0]) ||
+      vde_doorbell_init(&shm->doorbells[1])) {
+    tmp_errno = errno;
+    close(fd);
+    errno = tmp_errno;
+    return -1;
   }
-  vde_queue_delete(v2_conn->pkt_queue);
-
-  vde_free(v2_conn);
+  shm->hdr->magic = SWITCH_MAGIC;
+  shm->hdr->version = SHM_VERSION;
+  shm->hdr->slots = slots;
+  shm->hdr->buf_size = buf_size;
+  // nothing to read yet
+  shm->hdr->waiters[0].sleeping = 1;
+  shm->hdr->waiters[1].sleeping = 1;
+  return fd;
 }
 
-static int vde2_remove_sock_if_unused(struct sockaddr_un *sa_unix)
+static int vde2_shm_write(vde2_conn *v2_conn, vde_pkt *pkt)
 {
-  int test_fd, ret = 1;
-
-  if ((test_fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) {
-    vde_error("%s: socket %s", __PRETTY_FUNCTION__, strerror(errno));
-    return 1;
+  unsigned int idx;
+  vde2_shm_desc *desc;
+  vde2_shm *shm = v2_conn->shm;
+  unsigned int peer = !shm->side;
+
+  desc = (vde2_shm_desc *)vde_spsc_ring_reserve(&shm->tx);
+  if (desc == NULL) {
+    vde_connection_stats_drop(v2_conn->conn, VDE_CONN_DROP_QUEUE_FULL);
+    errno = EAGAIN;
+    return -1;
   }
-  if (connect(test_fd, (struct sockaddr *) sa_unix, sizeof(*sa_unix)) < 0) {
-    if (errno == ECONNREFUSED) {
-      if (unlink(sa_unix->sun_path) < 0) {
+  // each slot has its own buffer
+  idx = desc - shm->tx_descs;
+  desc->off = idx * shm->buf_size + SHM_HEADROOM;
+  desc->len = pkt->hdr->pkt_len;
+  desc->version = pkt->hdr->version;
+  desc->type = pkt->hdr->type;
+  memcpy(shm->tx_bufs + desc->off, pkt->payload, pkt->hdr->pkt_len);
+  vde_spsc_ring_commit(&shm->tx);
+  VDE_PROBE2(vde2__tx, v2_conn->conn, pkt);
+  vde_connection_stats_tx(v2_conn->conn, pkt);
+
+  // pairs with the store of the flag and the load of head by the peer
+  if (__atomic_load_n(&shm->hdr->waiters[peer].sleeping, __ATOMIC_SEQ_CST) &&
+      __atomic_exchange_n(&shm->hdr->waiters[peer].sleeping, 0,
+                          __ATOMIC_SEQ_CST)) {
+    vde_doorbell_ring(&shm->doorbells[peer]);
+  }
+  return 0;
+}
+
+// deliver up to MAX_BATCH frames, returns the number of slots read or -1 if
+// the connection has been closed
+static int vde2_shm_read_batch(vde2_conn *v2_conn)
+{
+  vde2_shm_desc *descs[MAX_BATCH];
+  vde_pkt views[MAX_BATCH];
+  vde_hdr hdrs[MAX_BATCH];
+  vde_pkt *ready[MAX_BATCH];
+  vde2_shm_desc desc;
+  unsigned int i, count, nready = 0;
+  int rv = 0, tmp_errno = 0;
+  vde2_shm *shm = v2_conn->shm;
+  vde_connection *conn = v2_conn->conn;
+  vde_context *ctx = vde_connection_get_context(conn);
+  unsigned int head_sz = vde_connection_get_pkt_headsize(conn);
+  unsigned int tail_sz = vde_connection_get_pkt_tailsize(conn);
+  int copy = head_sz > SHM_HEADROOM || tail_sz > 0;
+
+  count = vde_spsc_ring_peek_n(&shm->rx, (void **)descs, MAX_BATCH);
+  for (i = 0; i < count; i++) {
+    // a single read of what the peer can change
+    memcpy(&desc, descs[i], sizeof(desc));
+    if (desc.off < head_sz ||
+        (size_t)desc.off + desc.len > shm->rx_bufs_size ||
+        desc.len < sizeof(struct eth_hdr) || desc.len > v2_conn->max_payload) {
+      vde_connection_stats_drop(conn, VDE_CONN_DROP_RX_ERROR);
+      continue;
+    }
+    if (!copy) {
+      vde_pkt_init_view(&views[nready], &hdrs[nready],
+                        shm->rx_bufs + desc.off - head_sz, head_sz, desc.len,
+                        0);
+      ready[nready] = &views[nready];
+    } else {
+      ready[nready] = vde_pkt_new(ctx, desc.len, head_sz, tail_sz);
+      if (ready[nready] == NULL) {
+        vde_connection_stats_drop(conn, VDE_CONN_DROP_NOMEM);
+        continue;
+      }
+      memcpy(ready[nready]->payload, shm->rx_bufs + desc.off, desc.len);
+      ready[nready]->hdr->pkt_len = desc.len;
+    }
+    ready[nready]->hdr->version = desc.version;
+    ready[nready]->hdr->type = desc.type;
+    VDE_PROBE2(vde2__rx, conn, ready[nready]);
+    nready++;
+  }
+
+  if (nready > 0) {
+    rv = vde_connection_call_read_batch(conn, ready, nready);
+    tmp_errno = errno;
+  }
+  if (copy) {
+    for (i = 0; i < nready; i++) {
+      vde_pkt_put(ready[i]);
+    }
+  }
+  // views are not used anymore, the peer can reuse their buffers
+  vde_spsc_ring_release_n(&shm->rx, count);
+  if (rv && tmp_errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return -1;
+  }
+  return count;
+}
+
+static void vde2_shm_read_event(int fd, short event_type, void *arg)
+{
+  int count;
+  unsigned int budget = SHM_READ_BUDGET;
+  vde2_conn *v2_conn = (vde2_conn *)arg;
+  vde2_shm *shm = v2_conn->shm;
+  uint32_t *sleeping = &shm->hdr->waiters[shm->side].sleeping;
+
+  vde_doorbell_clear(&shm->doorbells[shm->side]);
+  while (budget-- > 0) {
+    count = vde2_shm_read_batch(v2_conn);
+    if (count < 0) {
+      return;
+    }
+    if (count > 0) {
+      continue;
+    }
+    // pairs with the commit and the load of the flag by the peer
+    __atomic_store_n(sleeping, 1, __ATOMIC_SEQ_CST);
+    if (vde_spsc_ring_peek(&shm->rx) == NULL) {
+      return;
+    }
+    __atomic_store_n(sleeping, 0, __ATOMIC_SEQ_CST);
+  }
+  // other events get a chance, then go on reading
+  vde_doorbell_ring(&shm->doorbells[shm->side]);
+}
+
+static int vde2_shm_start(vde2_conn *v2_conn)
+{
+  vde2_shm *shm = v2_conn->shm;
+
+  shm->db_ev = vde_context_event_add(vde_connection_get_context(v2_conn->conn),
+                                     shm->doorbells[shm->side].rfd,
+                                     VDE_EV_READ | VDE_EV_PERSIST, NULL,
+                                     &vde2_shm_read_event, (void *)v2_conn);
+  if (shm->db_ev == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+// switch side: reply to a REQ_NEW_SHM request with the rings
+static int vde2_srv_send_shm(vde2_conn *v2_conn, unsigned int slots)
+{
+  vde2_shm_reply reply;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  int fds[3], tmp_errno;
+
+  v2_conn->shm = vde2_shm_new(0);
+  if (v2_conn->shm == NULL) {
+    return -1;
+  }
+  fds[0] = vde2_shm_create(v2_conn->shm, slots, v2_conn->max_payload);
+  if (fds[0] < 0) {
+    return -1;
+  }
+  fds[1] = v2_conn->shm->doorbells[0].rfd;
+  fds[2] = v2_conn->shm->doorbells[1].rfd;
+
+  reply.magic = SWITCH_MAGIC;
+  reply.version = SHM_VERSION;
+  reply.slots = slots;
+  reply.buf_size = v2_conn->shm->buf_size;
+  iov.iov_base = &reply;
+  iov.iov_len = sizeof(reply);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if (sendmsg(v2_conn->ctl_fd, &msg, 0) != sizeof(reply)) {
+    tmp_errno = errno;
+    close(fds[0]);
+    errno = tmp_errno;
+    return -1;
+  }
+  // the mapping keeps the memory
+  close(fds[0]);
+  return vde2_shm_start(v2_conn);
+}
+
+// peer side: map the rings received with the reply
+static int vde2_clt_get_shm(vde2_conn *v2_conn)
+{
+  vde2_shm_reply reply;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  unsigned int i, nfds = 0;
+  int fds[3], len, rv = -1;
+  struct stat st;
+  vde2_shm *shm;
+
+  iov.iov_base = &reply;
+  iov.iov_len = sizeof(reply);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  len = recvmsg(v2_conn->ctl_fd, &msg, MSG_CMSG_CLOEXEC);
+  if (len < 0 && errno == EAGAIN) {
+    // no reply yet, errno tells the caller to wait again
+    return -1;
+  }
+  for (cmsg = CMSG_FIRSTHDR(&msg); len >= 0 && cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      nfds = nfds > 3 ? 3 : nfds;
+      memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+    }
+  }
+  if (len != sizeof(reply) || nfds != 3 || reply.magic != SWITCH_MAGIC ||
+      reply.version != SHM_VERSION || reply.slots == 0 ||
+      reply.slots > MAX_SHM_SLOTS || reply.buf_size < SHM_HEADROOM ||
+      reply.buf_size - SHM_HEADROOM < v2_conn->max_payload) {
+    vde_error("%s: received an invalid reply", __PRETTY_FUNCTION__);
+    errno = EPROTO;
+    goto out;
+  }
+
+  // a short file would fault on access
+  if (fstat(fds[0], &st) || st.st_size < vde2_shm_bufs_off(reply.slots,
+                                                          reply.buf_size, 2)) {
+    vde_error("%s: shared memory too small", __PRETTY_FUNCTION__);
+    errno = EPROTO;
+    goto out;
+  }
+  shm = vde2_shm_new(1);
+  if (shm == NULL) {
+    goto out;
+  }
+  v2_conn->shm = shm;
+  if (vde2_shm_map(shm, fds[0], reply.slots, reply.buf_size)) {
+    goto out;
+  }
+  // eventfds, the same fd is read and written
+  shm->doorbells[0].rfd = shm->doorbells[0].wfd = fds[1];
+  shm->doorbells[1].rfd = shm->doorbells[1].wfd = fds[2];
+  nfds = 1;
+  rv = vde2_shm_start(v2_conn);
+
+out:
+  for (i = 0; i < nfds; i++) {
+    close(fds[i]);
+  }
+  return rv;
+}
+
+// peer side: the reply to the REQ_NEW_SHM request has been received
+static void vde2_clt_get_reply(int ctl_fd, short event_type, void *arg)
+{
+  int rv;
+  struct timeval tv;
+  vde2_conn *v2_conn = (vde2_conn *)arg;
+  vde_connection *conn = v2_conn->conn;
+  vde_context *ctx = vde_component_get_context(v2_conn->transport);
+
+  vde_context_event_del(ctx, v2_conn->ctl_ev);
+  v2_conn->ctl_ev = NULL;
+
+  if (event_type & VDE_EV_TIMEOUT) {
+    vde_error("%s: no reply from switch", __PRETTY_FUNCTION__);
+    vde_transport_call_cm_error_cb(v2_conn->transport, conn, ETIMEDOUT);
+    return;
+  }
+  rv = vde2_clt_get_shm(v2_conn);
+  if (rv && errno == EAGAIN) {
+    // spurious wake up, wait again until the deadline
+    v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd,
+                                            VDE_EV_READ,
+                                            vde2_handshake_left(v2_conn, &tv),
+                                            &vde2_clt_get_reply,
+                                            (void *)v2_conn);
+    if (v2_conn->ctl_ev == NULL) {
+      vde_error("%s: cannot wait for reply", __PRETTY_FUNCTION__);
+      vde_transport_call_cm_error_cb(v2_conn->transport, conn, errno);
+    }
+    return;
+  }
+  if (rv) {
+    vde_error("%s: cannot map shared memory rings: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    vde_transport_call_cm_error_cb(v2_conn->transport, conn, errno);
+    return;
+  }
+  // XXX: check event not NULL
+  v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd,
+                                          VDE_EV_READ|VDE_EV_PERSIST, NULL,
+                                          &vde2_conn_read_ctl_event,
+                                          (void *)v2_conn);
+  vde_transport_call_cm_connect_cb(v2_conn->transport, conn);
+}
+
+#endif /* HAVE_SHM */
+
+int vde2_conn_write(vde_connection *conn, vde_pkt *pkt)
+{
+  vde2_qpkt *v2_pkt;
+  vde2_conn *v2_conn = vde_connection_get_priv(conn);
+  vde_context *ctx = vde_connection_get_context(conn);
+
+  // the peer would truncate it
+  if (pkt->hdr->pkt_len > v2_conn->max_payload) {
+    vde_connection_stats_drop(conn, VDE_CONN_DROP_WRITE_ERROR);
+    errno = EMSGSIZE;
+    return -1;
+  }
+#ifdef HAVE_SHM
+  if (v2_conn->shm != NULL) {
+    return vde2_shm_write(v2_conn, pkt);
+  }
+#endif
+
+  // drops are only counted, logging each of them would slow things down
+  // further when the peer can't keep up
+  if (vde_qdisc_get_length(v2_conn->pkt_queue) >= MAXQLEN ||
+      vde_connection_queue_exceeded(conn, pkt)) {
+    vde_connection_stats_drop(conn, VDE_CONN_DROP_QUEUE_FULL);
+    errno = EAGAIN;
+    return -1; // discard pkt
+  }
+  v2_pkt = vde_pool_alloc(vde_context_get_pool(ctx), sizeof(vde2_qpkt));
+  if (v2_pkt == NULL) {
+    vde_connection_stats_drop(conn, VDE_CONN_DROP_NOMEM);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  // a reference is enough for pooled packets, others are copied
+  v2_pkt->entry.pkt = vde_pkt_share(ctx, pkt);
+  if (v2_pkt->entry.pkt == NULL) {
+    vde_connection_stats_drop(conn, VDE_CONN_DROP_NOMEM);
+    vde_pool_free(v2_pkt);
+    errno = ENOMEM;
+    return -1;
+  }
+  v2_pkt->numtries = 0;
+
+  vde_qdisc_enqueue(v2_conn->pkt_queue, &v2_pkt->entry, vde_qdisc_now());
+  vde_connection_stats_queue(conn, vde_qdisc_get_length(v2_conn->pkt_queue));
+  vde_connection_queue_add(conn, pkt);
+
+  if (v2_conn->data_ev_wr == NULL) {
+    v2_conn->data_ev_wr = vde_context_event_add(
+                            vde_connection_get_context(conn),
+                            v2_conn->data_fd,
+                            VDE_EV_WRITE|VDE_EV_PERSIST,
+                            vde_connection_get_send_maxtimeout(conn),
+                            &vde2_conn_write_data_event,
+                            (void *)v2_conn);
+  }
+  return 0;
+}
+
+void vde2_conn_close(vde_connection *conn)
+{
+  unsigned int i;
+  vde2_conn *v2_conn = vde_connection_get_priv(conn);
+  vde_context *ctx = vde_connection_get_context(conn);
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(v2_conn->transport);
+
+  tr->conns = vde_list_remove(tr->conns, v2_conn);
+  if (v2_conn->data_fd >= 0){
+    close(v2_conn->data_fd);
+  }
+  if (v2_conn->data_ev_rd != NULL) {
+    vde_context_event_del(ctx, v2_conn->data_ev_rd);
+  }
+  if (v2_conn->data_ev_wr != NULL) {
+    vde_context_event_del(ctx, v2_conn->data_ev_wr);
+  }
+  // the peer is still talking to the process which took the socket over
+  if (v2_conn->local_sa.sun_path[0] != '\0' && !v2_conn->handed_off) {
+    unlink(v2_conn->local_sa.sun_path);
+  }
+  if (v2_conn->ctl_fd >= 0){
+    close(v2_conn->ctl_fd);
+  }
+  if (v2_conn->ctl_ev != NULL) {
+    vde_context_event_del(ctx, v2_conn->ctl_ev);
+  }
+  if (v2_conn->remote_request) {
+    vde_free(v2_conn->remote_request);
+  }
+  vde_qdisc_delete(v2_conn->pkt_queue, &vde2_qpkt_release, NULL);
+  vde_connection_queue_clear(conn);
+  for (i = 0; i < MAX_BATCH; i++) {
+    if (v2_conn->rx_pkts[i] != NULL) {
+      vde_pkt_put(v2_conn->rx_pkts[i]);
+    }
+  }
+#ifdef HAVE_SHM
+  if (v2_conn->shm != NULL) {
+    vde2_shm_delete(v2_conn->shm, ctx);
+  }
+#endif
+
+  vde_free(v2_conn);
+}
+
+static int vde2_remove_sock_if_unused(struct sockaddr_un *sa_unix)
+{
+  int test_fd, ret = 1;
+
+  if ((test_fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) {
+    vde_error("%s: socket %s", __PRETTY_FUNCTION__, strerror(errno));
+    return 1;
+  }
+  if (connect(test_fd, (struct sockaddr *) sa_unix, sizeof(*sa_unix)) < 0) {
+    if (errno == ECONNREFUSED) {
+      if (unlink(sa_unix->sun_path) < 0) {
         vde_error("%s: failed to removed unused socket '%s': %s",
             __PRETTY_FUNCTION__, sa_unix->sun_path, strerror(errno));
       }
@@ -365,6 +1244,13 @@ static int vde2_remove_sock_if_unused(struct sockaddr_un *sa_unix)
   return ret;
 }
 
+// the handshake is over, either way
+static void vde2_srv_pending_del(vde2_tr *tr, vde2_conn *v2_conn)
+{
+  tr->pending_conns = vde_list_remove(tr->pending_conns, v2_conn);
+  tr->half_open--;
+}
+
 // XXX: check VDE_DARWIN defines here!!!
 void vde2_srv_send_request(int ctl_fd, short event_type, void *arg)
 {
@@ -381,7 +1267,23 @@ void vde2_srv_send_request(int ctl_fd, short event_type, void *arg)
   vde_context_event_del(ctx, v2_conn->ctl_ev);
   v2_conn->ctl_ev = NULL;
 
-  // XXX: define a behaviour when called if event timeout expired
+  if (event_type & VDE_EV_TIMEOUT) {
+    tr->timeouts++;
+    vde_warning("%s: peer not reading the reply, %llu handshakes timed out",
+                __PRETTY_FUNCTION__, (unsigned long long)tr->timeouts);
+    goto error;
+  }
+
+#ifdef HAVE_SHM
+  if (v2_conn->remote_request->type == REQ_NEW_SHM) {
+    if (vde2_srv_send_shm(v2_conn, tr->shm_slots)) {
+      vde_error("%s: cannot set up shared memory rings: %s",
+                __PRETTY_FUNCTION__, strerror(errno));
+      goto error;
+    }
+    goto accepted;
+  }
+#endif
 
   if ((v2_conn->data_fd = socket(PF_UNIX, SOCK_DGRAM, 0)) < 0) {
     vde_error("%s: cannot create datagram socket: %s", __PRETTY_FUNCTION__,
@@ -431,19 +1333,27 @@ void vde2_srv_send_request(int ctl_fd, short event_type, void *arg)
     vde_error("%s: cannot reply to peer", __PRETTY_FUNCTION__);
     goto error;
   }
+  v2_conn->data_ev_rd = vde_context_event_add(ctx, v2_conn->data_fd,
+                                              VDE_EV_READ|VDE_EV_PERSIST,
+                                              NULL, &vde2_conn_read_data_event,
+                                              (void *)v2_conn);
 
+#ifdef HAVE_SHM
+accepted:
+#endif
+  // data sockets are named after it, ids too so that they never repeat
   tr->connections++;
-  tr->pending_conns = vde_list_remove(tr->pending_conns, v2_conn);
+  vde_connection_set_handoff_id(conn,
+                                vde_component_get_qname(v2_conn->transport),
+                                tr->connections);
+  vde2_srv_pending_del(tr, v2_conn);
+  tr->conns = vde_list_prepend(tr->conns, v2_conn);
 
   // XXX: check events not NULL
   v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd,
                                           VDE_EV_READ|VDE_EV_PERSIST, NULL,
                                           &vde2_conn_read_ctl_event,
                                           (void *)v2_conn);
-  v2_conn->data_ev_rd = vde_context_event_add(ctx, v2_conn->data_fd,
-                                              VDE_EV_READ|VDE_EV_PERSIST,
-                                              NULL, &vde2_conn_read_data_event,
-                                              (void *)v2_conn);
 
   vde_transport_call_cm_accept_cb(v2_conn->transport, conn);
 
@@ -451,7 +1361,7 @@ void vde2_srv_send_request(int ctl_fd, short event_type, void *arg)
 
 error:
   // XXX: call connection manager error callback here?
-  tr->pending_conns = vde_list_remove(tr->pending_conns, v2_conn);
+  vde2_srv_pending_del(tr, v2_conn);
   vde_connection_fini(conn);
   vde_connection_delete(conn);
 }
@@ -460,6 +1370,7 @@ void vde2_srv_get_request(int ctl_fd, short event_type, void *arg)
 {
   int len;
   char reqbuf[REQBUFLEN+1];
+  struct timeval tv;
   vde2_request *req=(vde2_request *)reqbuf;
   vde2_conn *v2_conn = (vde2_conn *)arg;
   vde_connection *conn = v2_conn->conn;
@@ -469,12 +1380,27 @@ void vde2_srv_get_request(int ctl_fd, short event_type, void *arg)
   vde_context_event_del(ctx, v2_conn->ctl_ev);
   v2_conn->ctl_ev = NULL;
 
-  // XXX: define a behaviour when called if event timeout expired
+  if (event_type & VDE_EV_TIMEOUT) {
+    tr->timeouts++;
+    vde_warning("%s: no request from peer, %llu handshakes timed out",
+                __PRETTY_FUNCTION__, (unsigned long long)tr->timeouts);
+    goto error;
+  }
+
   len = read(v2_conn->ctl_fd, reqbuf, REQBUFLEN);
   if (len < 0) {
     if (errno != EAGAIN) {
       goto error;
     }
+    // spurious wake up, wait again until the deadline
+    v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd,
+                                            VDE_EV_READ,
+                                            vde2_handshake_left(v2_conn, &tv),
+                                            &vde2_srv_get_request,
+                                            (void *)v2_conn);
+    if (v2_conn->ctl_ev == NULL) {
+      goto error;
+    }
   } else if (len == 0) {
     goto error;
   } else {
@@ -485,12 +1411,20 @@ void vde2_srv_get_request(int ctl_fd, short event_type, void *arg)
 
     reqbuf[len] = 0;
 
-    if (req->sock.sun_path[0] == 0) {
-      vde_error("%s: received an invalid socket path", __PRETTY_FUNCTION__);
+    if (len < sizeof(vde2_request)) {
+      vde_error("%s: received a short request", __PRETTY_FUNCTION__);
       goto error;
     }
-
-    if (access(req->sock.sun_path, R_OK | W_OK) != 0) {
+    // the reply carries the rings, there's no peer socket
+    if (req->type == REQ_NEW_SHM) {
+#ifndef HAVE_SHM
+      vde_error("%s: shared memory rings not supported", __PRETTY_FUNCTION__);
+      goto error;
+#endif
+    } else if (req->sock.sun_path[0] == 0) {
+      vde_error("%s: received an invalid socket path", __PRETTY_FUNCTION__);
+      goto error;
+    } else if (access(req->sock.sun_path, R_OK | W_OK) != 0) {
       vde_error("%s: cannot access peer socket %s", __PRETTY_FUNCTION__,
                 req->sock.sun_path);
       goto error;
@@ -507,18 +1441,22 @@ void vde2_srv_get_request(int ctl_fd, short event_type, void *arg)
     // XXX: add peer credentials to conn.attributes
 
     memcpy(&v2_conn->remote_sa, &req->sock, sizeof(struct sockaddr_un));
-    // XXX: check event NULL and define a timeout
     v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd,
-                                            VDE_EV_WRITE, NULL,
+                                            VDE_EV_WRITE,
+                                            vde2_handshake_left(v2_conn, &tv),
                                             &vde2_srv_send_request,
                                             (void *)v2_conn);
+    if (v2_conn->ctl_ev == NULL) {
+      vde_error("%s: cannot wait for peer", __PRETTY_FUNCTION__);
+      goto error;
+    }
   }
 
   return;
 
 error:
   // XXX: call connection manager error callback here?
-  tr->pending_conns = vde_list_remove(tr->pending_conns, v2_conn);
+  vde2_srv_pending_del(tr, v2_conn);
   vde_connection_fini(conn);
   vde_connection_delete(conn);
 }
@@ -528,6 +1466,7 @@ void vde2_accept(int listen_fd, short event_type, void *arg)
   struct sockaddr sa;
   socklen_t sa_len = sizeof(struct sockaddr);
   int new;
+  struct timeval tv;
   vde_connection *conn;
   vde2_conn *v2_conn;
   vde_component *component = (vde_component *)arg;
@@ -540,6 +1479,16 @@ void vde2_accept(int listen_fd, short event_type, void *arg)
     vde_warning("%s: accept %s", __PRETTY_FUNCTION__, strerror(errno));
     return;
   }
+  // closing the connection instead of leaving it in the backlog lets the peer
+  // know it has to retry later
+  if (tr->half_open >= tr->max_half_open) {
+    tr->rejected++;
+    vde_warning("%s: %u connections in handshake, %llu rejected",
+                __PRETTY_FUNCTION__, tr->half_open,
+                (unsigned long long)tr->rejected);
+    close(new);
+    return;
+  }
   if (fcntl(new, F_SETFL, O_NONBLOCK) < 0) {
     vde_warning("%s: cannot set O_NONBLOCK for new connection %s",
                 __PRETTY_FUNCTION__, strerror(errno));
@@ -556,21 +1505,38 @@ void vde2_accept(int listen_fd, short event_type, void *arg)
   }
 
   v2_conn->ctl_fd = new;
+  v2_conn->data_fd = -1;
   v2_conn->conn = conn;
   v2_conn->transport = component;
-  // XXX: check init result
-  v2_conn->pkt_queue = vde_queue_init();
+  v2_conn->batch = tr->batch;
+  v2_conn->max_payload = tr->max_payload;
+  v2_conn->pkt_queue = vde_qdisc_new(&tr->qdisc, &vde2_qpkt_drop,
+                                     (void *)conn);
+  if (v2_conn->pkt_queue == NULL) {
+    vde_error("%s: cannot create send queue", __PRETTY_FUNCTION__);
+    vde_free(v2_conn);
+    goto error_conn_del;
+  }
 
   // XXX: check error on list
   tr->pending_conns = vde_list_prepend(tr->pending_conns, v2_conn);
+  tr->half_open++;
 
-  vde_connection_init(conn, ctx, sizeof(struct eth_frame), &vde2_conn_write,
+  vde_connection_init(conn, ctx, tr->max_payload, &vde2_conn_write,
                       &vde2_conn_close, (void *)v2_conn);
 
-  // XXX: check event NULL and define a timeout
+  v2_conn->deadline = vde_connection_get_init_time(conn) +
+    tr->handshake_timeout;
   v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd, VDE_EV_READ,
-                                          NULL, &vde2_srv_get_request,
+                                          vde2_handshake_left(v2_conn, &tv),
+                                          &vde2_srv_get_request,
                                           (void *)v2_conn);
+  if (v2_conn->ctl_ev == NULL) {
+    vde_error("%s: cannot wait for peer request", __PRETTY_FUNCTION__);
+    vde2_srv_pending_del(tr, v2_conn);
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+  }
 
   return;
 
@@ -581,36 +1547,616 @@ error_close:
   close(new);
 }
 
-int vde2_listen(vde_component *component)
+/*
+ * Hot restart: a process started with the "resume" param connects to
+ * <path>/handoff, where the running one listens when started with "handoff".
+ * The running process sends
+ * - a vde2_handoff_hdr along with its listen and handoff sockets,
+ * - a vde2_handoff_conn along with the ctl and data sockets of each connection
+ *   past the handshake,
+ * - the state of its engines, see vde_context_handoff_state(): every
+ *   transport sends the same one and the new process loads the first only.
+ * The new process takes everything over only once all of it has been
+ * received, then it replies with HANDOFF_MAGIC: from then on the old process
+ * closes its copies of the sockets without removing them. Peers keep using
+ * the same sockets and never notice, frames arriving meanwhile wait in them.
+ * Until the reply the old process keeps its connections, so a new process
+ * failing half way leaves nothing broken.
+ */
+
+static int vde2_handoff_set_timeout(int fd)
 {
-  int tmp_errno; /* errno will be set back in last goto label */
-  struct sockaddr_un sa_unix;
-  int one = 1;
-  vde_context *ctx = vde_component_get_context(component);
-  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+  struct timeval tv;
 
-  tr->listen_fd = socket(PF_UNIX, SOCK_STREAM, 0);
-  if (tr->listen_fd < 0) {
-    tmp_errno = errno;
-    vde_error("%s: Could not obtain a BSD socket: %s", __PRETTY_FUNCTION__,
-              strerror(errno));
-    goto error;
+  tv.tv_sec = HANDOFF_TIMEOUT / 1000;
+  tv.tv_usec = (HANDOFF_TIMEOUT % 1000) * 1000;
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+    return -1;
   }
-  if (setsockopt(tr->listen_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&one,
-                 sizeof(one)) < 0) {
-    tmp_errno = errno;
-    vde_error("%s: Could not set socket options: %s", __PRETTY_FUNCTION__,
-              strerror(errno));
-    goto error_close;
+  return 0;
+}
+
+// a message along with two sockets
+static int vde2_handoff_sendfds(int fd, void *buf, size_t len, int fds[2])
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  ssize_t rv;
+
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, 2 * sizeof(int));
+
+  rv = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  if (rv != len) {
+    errno = rv < 0 ? errno : EPROTO;
+    return -1;
   }
-  if (fcntl(tr->listen_fd, F_SETFL, O_NONBLOCK) < 0) {
-    tmp_errno = errno;
-    vde_error("%s: Could not set O_NONBLOCK: %s", __PRETTY_FUNCTION__,
-              strerror(errno));
-    goto error_close;
+  return 0;
+}
+
+static int vde2_handoff_recvfds(int fd, void *buf, size_t len, int fds[2])
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  unsigned int i, nfds = 0;
+  ssize_t rv;
+
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  rv = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+  for (cmsg = CMSG_FIRSTHDR(&msg); rv >= 0 && cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      nfds = nfds > 2 ? 2 : nfds;
+      memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+    }
   }
-  if (((mkdir(tr->vdesock_dir, 0777) < 0) && (errno != EEXIST))) {
-    tmp_errno = errno;
+  if (rv != len || nfds != 2 || (msg.msg_flags & MSG_CTRUNC)) {
+    for (i = 0; i < nfds; i++) {
+      close(fds[i]);
+      fds[i] = -1;
+    }
+    errno = rv < 0 ? errno : EPROTO;
+    return -1;
+  }
+  return 0;
+}
+
+static int vde2_handoff_write(int fd, const char *buf, size_t len)
+{
+  ssize_t rv;
+
+  while (len > 0) {
+    rv = send(fd, buf, len, MSG_NOSIGNAL);
+    if (rv < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    buf += rv;
+    len -= rv;
+  }
+  return 0;
+}
+
+static int vde2_handoff_read(int fd, char *buf, size_t len)
+{
+  ssize_t rv;
+
+  while (len > 0) {
+    rv = read(fd, buf, len);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      errno = rv < 0 ? errno : EPROTO;
+      return -1;
+    }
+    buf += rv;
+    len -= rv;
+  }
+  return 0;
+}
+
+// connections backed by shared memory rings are not handed off
+static inline int vde2_handoff_eligible(vde2_conn *v2_conn)
+{
+  return v2_conn->data_fd >= 0 && v2_conn->shm == NULL;
+}
+
+// old process side, nothing changes until the new process replies
+static int vde2_handoff_send(vde_component *component, int fd)
+{
+  vde2_handoff_hdr hdr;
+  vde2_handoff_conn hconn;
+  vde_list *iter;
+  vde2_conn *v2_conn;
+  vde_sobj *state;
+  const char *state_str;
+  uint32_t reply;
+  int fds[2], rv = -1;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
+  state = vde_context_handoff_state(vde_component_get_context(component));
+  state_str = vde_sobj_to_string(state);
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = HANDOFF_MAGIC;
+  hdr.version = HANDOFF_VERSION;
+  hdr.connections = tr->connections;
+  hdr.state_len = strlen(state_str);
+  for (iter = vde_list_first(tr->conns); iter != NULL;
+       iter = vde_list_next(iter)) {
+    hdr.conns += vde2_handoff_eligible(vde_list_get_data(iter));
+  }
+  fds[0] = tr->listen_fd;
+  fds[1] = tr->handoff_fd;
+  if (vde2_handoff_sendfds(fd, &hdr, sizeof(hdr), fds)) {
+    goto out;
+  }
+
+  // oldest first, so that engines number ports back in the same order
+  for (iter = vde_list_last(tr->conns); iter != NULL;
+       iter = vde_list_prev(iter)) {
+    v2_conn = vde_list_get_data(iter);
+    if (!vde2_handoff_eligible(v2_conn)) {
+      continue;
+    }
+    memset(&hconn, 0, sizeof(hconn));
+    hconn.id = vde_connection_get_handoff_id(v2_conn->conn);
+    hconn.local_sa = v2_conn->local_sa;
+    hconn.remote_sa = v2_conn->remote_sa;
+    fds[0] = v2_conn->ctl_fd;
+    fds[1] = v2_conn->data_fd;
+    if (vde2_handoff_sendfds(fd, &hconn, sizeof(hconn), fds)) {
+      goto out;
+    }
+  }
+
+  if (vde2_handoff_write(fd, state_str, hdr.state_len) ||
+      vde2_handoff_read(fd, (char *)&reply, sizeof(reply))) {
+    goto out;
+  }
+  if (reply != HANDOFF_MAGIC) {
+    errno = EPROTO;
+    goto out;
+  }
+  // the ports of these connections are gone once they are released, other
+  // transports send the state as it was before
+  vde_context_handoff_keep(vde_component_get_context(component), state);
+
+  for (iter = vde_list_first(tr->conns); iter != NULL;
+       iter = vde_list_next(iter)) {
+    v2_conn = vde_list_get_data(iter);
+    v2_conn->handed_off = vde2_handoff_eligible(v2_conn);
+  }
+  vde_info("%s: %u connections handed off", __PRETTY_FUNCTION__, hdr.conns);
+  rv = 0;
+
+out:
+  vde_sobj_put(state);
+  return rv;
+}
+
+// old process side, the new one owns the sockets now
+static void vde2_handoff_release(vde_component *component)
+{
+  vde_list *iter, *next;
+  vde2_conn *v2_conn;
+  vde_connection *conn;
+  vde_context *ctx = vde_component_get_context(component);
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
+  vde_context_event_del(ctx, tr->listen_event);
+  tr->listen_event = NULL;
+  close(tr->listen_fd);
+  tr->listen_fd = -1;
+  vde_context_event_del(ctx, tr->handoff_event);
+  tr->handoff_event = NULL;
+  close(tr->handoff_fd);
+  tr->handoff_fd = -1;
+
+  // peers still in the handshake will retry with the new process, which names
+  // data sockets from now on
+  while (tr->pending_conns != NULL) {
+    v2_conn = vde_list_get_data(tr->pending_conns);
+    conn = v2_conn->conn;
+    vde2_srv_pending_del(tr, v2_conn);
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+  }
+
+  for (iter = vde_list_first(tr->conns); iter != NULL; iter = next) {
+    next = vde_list_next(iter);
+    v2_conn = vde_list_get_data(iter);
+    if (!v2_conn->handed_off) {
+      continue;
+    }
+    // nothing is read or written any more, then users let the connection go
+    if (v2_conn->data_ev_rd != NULL) {
+      vde_context_event_del(ctx, v2_conn->data_ev_rd);
+      v2_conn->data_ev_rd = NULL;
+    }
+    if (v2_conn->data_ev_wr != NULL) {
+      vde_context_event_del(ctx, v2_conn->data_ev_wr);
+      v2_conn->data_ev_wr = NULL;
+    }
+    if (v2_conn->ctl_ev != NULL) {
+      vde_context_event_del(ctx, v2_conn->ctl_ev);
+      v2_conn->ctl_ev = NULL;
+    }
+    close(v2_conn->data_fd);
+    v2_conn->data_fd = -1;
+    close(v2_conn->ctl_fd);
+    v2_conn->ctl_fd = -1;
+
+    conn = v2_conn->conn;
+    // a connection manager running its authorization keeps the connection
+    // and finishes it on its own, vde2_conn_close() finds the sockets and
+    // events gone
+    if (vde_connection_call_error(conn, NULL, CONN_READ_CLOSED)) {
+      vde_connection_fini(conn);
+      vde_connection_delete(conn);
+    }
+  }
+}
+
+void vde2_handoff_accept(int handoff_fd, short event_type, void *arg)
+{
+  int fd;
+  vde_component *component = (vde_component *)arg;
+
+  fd = accept(handoff_fd, NULL, NULL);
+  if (fd < 0) {
+    vde_warning("%s: accept %s", __PRETTY_FUNCTION__, strerror(errno));
+    return;
+  }
+  if (vde2_handoff_set_timeout(fd) || vde2_handoff_send(component, fd)) {
+    vde_warning("%s: handoff failed, connections kept: %s",
+                __PRETTY_FUNCTION__, strerror(errno));
+    close(fd);
+    return;
+  }
+  close(fd);
+  vde2_handoff_release(component);
+}
+
+// new process side, a connection as it would be at the end of the handshake;
+// the sockets are closed on error
+static int vde2_handoff_adopt(vde_component *component,
+                              vde2_handoff_conn *hconn, int fds[2])
+{
+  vde_connection *conn;
+  vde2_conn *v2_conn;
+  vde_context *ctx = vde_component_get_context(component);
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
+  if (vde_connection_new(&conn)) {
+    goto error;
+  }
+  v2_conn = (vde2_conn *)vde_calloc(sizeof(vde2_conn));
+  if (!v2_conn) {
+    vde_connection_delete(conn);
+    errno = ENOMEM;
+    goto error;
+  }
+  v2_conn->ctl_fd = fds[0];
+  v2_conn->data_fd = fds[1];
+  v2_conn->local_sa = hconn->local_sa;
+  v2_conn->remote_sa = hconn->remote_sa;
+  v2_conn->conn = conn;
+  v2_conn->transport = component;
+  v2_conn->batch = tr->batch;
+  v2_conn->max_payload = tr->max_payload;
+  v2_conn->pkt_queue = vde_qdisc_new(&tr->qdisc, &vde2_qpkt_drop,
+                                     (void *)conn);
+  if (v2_conn->pkt_queue == NULL) {
+    vde_free(v2_conn);
+    vde_connection_delete(conn);
+    goto error;
+  }
+  tr->conns = vde_list_prepend(tr->conns, v2_conn);
+
+  vde_connection_init(conn, ctx, tr->max_payload, &vde2_conn_write,
+                      &vde2_conn_close, (void *)v2_conn);
+  vde_connection_set_handoff_id(conn, vde_component_get_qname(component),
+                                hconn->id);
+
+  v2_conn->data_ev_rd = vde_context_event_add(ctx, v2_conn->data_fd,
+                                              VDE_EV_READ|VDE_EV_PERSIST,
+                                              NULL, &vde2_conn_read_data_event,
+                                              (void *)v2_conn);
+  v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd,
+                                          VDE_EV_READ|VDE_EV_PERSIST, NULL,
+                                          &vde2_conn_read_ctl_event,
+                                          (void *)v2_conn);
+  if (v2_conn->data_ev_rd == NULL || v2_conn->ctl_ev == NULL) {
+    // closes the sockets too
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  vde_transport_call_cm_accept_cb(component, conn);
+  return 0;
+
+error:
+  close(fds[0]);
+  close(fds[1]);
+  return -1;
+}
+
+/*
+ * New process side: returns 1 if there is no process to take over from, so
+ * that the transport listens on its own.
+ */
+static int vde2_resume(vde_component *component)
+{
+  struct sockaddr_un sa_unix;
+  vde2_handoff_hdr hdr;
+  vde2_handoff_conn *hconns = NULL;
+  int fd, tmp_errno, listen_fds[2] = {-1, -1}, *fds = NULL;
+  unsigned int i, nfds = 0;
+  uint32_t reply = HANDOFF_MAGIC;
+  char *state_str = NULL;
+  vde_sobj *state = NULL;
+  vde_context *ctx = vde_component_get_context(component);
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
+  fd = socket(PF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    vde_error("%s: Could not obtain a BSD socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    return -1;
+  }
+  sa_unix.sun_family = AF_UNIX;
+  snprintf(sa_unix.sun_path, sizeof(sa_unix.sun_path), "%s" HANDOFF_SOCK,
+           tr->vdesock_dir);
+  if (connect(fd, (struct sockaddr *)&sa_unix, sizeof(sa_unix)) < 0) {
+    tmp_errno = errno;
+    close(fd);
+    if (tmp_errno == ENOENT || tmp_errno == ECONNREFUSED) {
+      vde_info("%s: no process to resume from in %s", __PRETTY_FUNCTION__,
+               tr->vdesock_dir);
+      return 1;
+    }
+    vde_error("%s: Could not connect to %s: %s", __PRETTY_FUNCTION__,
+              sa_unix.sun_path, strerror(tmp_errno));
+    errno = tmp_errno;
+    return -1;
+  }
+
+  if (vde2_handoff_set_timeout(fd) ||
+      vde2_handoff_recvfds(fd, &hdr, sizeof(hdr), listen_fds)) {
+    tmp_errno = errno;
+    goto error;
+  }
+  if (hdr.magic != HANDOFF_MAGIC || hdr.version != HANDOFF_VERSION ||
+      hdr.conns > MAX_HANDOFF_CONNS || hdr.state_len > MAX_HANDOFF_STATE) {
+    tmp_errno = EPROTO;
+    goto error;
+  }
+
+  hconns = (vde2_handoff_conn *)vde_alloc((hdr.conns + 1) *
+                                          sizeof(vde2_handoff_conn));
+  fds = (int *)vde_alloc((hdr.conns + 1) * 2 * sizeof(int));
+  state_str = (char *)vde_alloc(hdr.state_len + 1);
+  if (hconns == NULL || fds == NULL || state_str == NULL) {
+    tmp_errno = ENOMEM;
+    goto error;
+  }
+  for (i = 0; i < hdr.conns; i++) {
+    if (vde2_handoff_recvfds(fd, &hconns[i], sizeof(vde2_handoff_conn),
+                             &fds[2 * i])) {
+      tmp_errno = errno;
+      goto error;
+    }
+    nfds += 2;
+  }
+  if (vde2_handoff_read(fd, state_str, hdr.state_len)) {
+    tmp_errno = errno;
+    goto error;
+  }
+  state_str[hdr.state_len] = '\0';
+  state = vde_sobj_from_string(state_str);
+  if (state == NULL) {
+    tmp_errno = EPROTO;
+    goto error;
+  }
+
+  // the old process lets everything go once it reads the reply
+  if (vde2_handoff_write(fd, (char *)&reply, sizeof(reply))) {
+    tmp_errno = errno;
+    goto error;
+  }
+  close(fd);
+
+  tr->connections = hdr.connections;
+  tr->listen_fd = listen_fds[0];
+  tr->listen_event = vde_context_event_add(ctx, tr->listen_fd,
+                                           VDE_EV_READ | VDE_EV_PERSIST, NULL,
+                                           &vde2_accept, (void *)component);
+  tr->handoff_fd = listen_fds[1];
+  if (tr->handoff) {
+    tr->handoff_event = vde_context_event_add(ctx, tr->handoff_fd,
+                                              VDE_EV_READ | VDE_EV_PERSIST,
+                                              NULL, &vde2_handoff_accept,
+                                              (void *)component);
+  } else {
+    // this process will not hand connections over in turn
+    unlink(sa_unix.sun_path);
+    close(tr->handoff_fd);
+    tr->handoff_fd = -1;
+  }
+
+  // the engines are ready before their ports are back
+  if (vde_context_handoff_load(ctx, state)) {
+    vde_warning("%s: engine state not fully restored", __PRETTY_FUNCTION__);
+  }
+  vde_sobj_put(state);
+
+  for (i = 0; i < hdr.conns; i++) {
+    if (vde2_handoff_adopt(component, &hconns[i], &fds[2 * i])) {
+      vde_error("%s: cannot take connection %u over: %s", __PRETTY_FUNCTION__,
+                hconns[i].id, strerror(errno));
+    }
+  }
+  vde_info("%s: %u connections taken over", __PRETTY_FUNCTION__, hdr.conns);
+
+  vde_free(state_str);
+  vde_free(fds);
+  vde_free(hconns);
+  return 0;
+
+error:
+  vde_error("%s: cannot resume from %s: %s", __PRETTY_FUNCTION__,
+            sa_unix.sun_path, strerror(tmp_errno));
+  close(fd);
+  for (i = 0; i < nfds; i++) {
+    close(fds[i]);
+  }
+  for (i = 0; i < 2; i++) {
+    if (listen_fds[i] >= 0) {
+      close(listen_fds[i]);
+    }
+  }
+  if (state != NULL) {
+    vde_sobj_put(state);
+  }
+  vde_free(state_str);
+  vde_free(fds);
+  vde_free(hconns);
+  errno = tmp_errno;
+  return -1;
+}
+
+// the socket a restarting process connects to, only the same user can
+static int vde2_handoff_listen(vde_component *component)
+{
+  int tmp_errno;
+  struct sockaddr_un sa_unix;
+  vde_context *ctx = vde_component_get_context(component);
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
+  tr->handoff_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+  if (tr->handoff_fd < 0) {
+    vde_error("%s: Could not obtain a BSD socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    return -1;
+  }
+  if (fcntl(tr->handoff_fd, F_SETFL, O_NONBLOCK) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not set O_NONBLOCK: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error_close;
+  }
+  sa_unix.sun_family = AF_UNIX;
+  snprintf(sa_unix.sun_path, sizeof(sa_unix.sun_path), "%s" HANDOFF_SOCK,
+           tr->vdesock_dir);
+  if (bind(tr->handoff_fd, (struct sockaddr *)&sa_unix,
+           sizeof(sa_unix)) < 0) {
+    if (errno != EADDRINUSE || vde2_remove_sock_if_unused(&sa_unix) ||
+        bind(tr->handoff_fd, (struct sockaddr *)&sa_unix,
+             sizeof(sa_unix)) < 0) {
+      tmp_errno = errno;
+      vde_error("%s: Could not bind to %s: %s", __PRETTY_FUNCTION__,
+                sa_unix.sun_path, strerror(errno));
+      goto error_close;
+    }
+  }
+  if (chmod(sa_unix.sun_path, 0600) < 0 || listen(tr->handoff_fd, 1) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not listen on %s: %s", __PRETTY_FUNCTION__,
+              sa_unix.sun_path, strerror(errno));
+    goto error_unlink;
+  }
+  tr->handoff_event = vde_context_event_add(ctx, tr->handoff_fd,
+                                            VDE_EV_READ | VDE_EV_PERSIST, NULL,
+                                            &vde2_handoff_accept,
+                                            (void *)component);
+  if (tr->handoff_event == NULL) {
+    tmp_errno = errno;
+    vde_error("%s: cannot wait for a restarting process",
+              __PRETTY_FUNCTION__);
+    goto error_unlink;
+  }
+  return 0;
+
+error_unlink:
+  unlink(sa_unix.sun_path);
+error_close:
+  close(tr->handoff_fd);
+  tr->handoff_fd = -1;
+  errno = tmp_errno;
+  return -1;
+}
+
+int vde2_listen(vde_component *component)
+{
+  int tmp_errno; /* errno will be set back in last goto label */
+  int rv;
+  struct sockaddr_un sa_unix;
+  int one = 1;
+  vde_context *ctx = vde_component_get_context(component);
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
+  // the sockets of a running process are taken over if there is one
+  if (tr->resume && (rv = vde2_resume(component)) <= 0) {
+    return rv;
+  }
+
+  tr->listen_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+  if (tr->listen_fd < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not obtain a BSD socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  if (setsockopt(tr->listen_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&one,
+                 sizeof(one)) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not set socket options: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error_close;
+  }
+  if (fcntl(tr->listen_fd, F_SETFL, O_NONBLOCK) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not set O_NONBLOCK: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error_close;
+  }
+  if (((mkdir(tr->vdesock_dir, 0777) < 0) && (errno != EEXIST))) {
+    tmp_errno = errno;
     vde_error("%s: Could not create vdesock directory %s: %s",
               __PRETTY_FUNCTION__, tr->vdesock_dir, strerror(errno));
     goto error_close;
@@ -634,12 +2180,16 @@ int vde2_listen(vde_component *component)
       }
     }
   }
-  if (listen(tr->listen_fd, LISTEN_QUEUE) < 0) {
+  if (listen(tr->listen_fd, tr->listen_backlog) < 0) {
     tmp_errno = errno;
     vde_error("%s: Could not listen: %s", __PRETTY_FUNCTION__,
               strerror(errno));
     goto error_unlink;
   }
+  if (tr->handoff && vde2_handoff_listen(component)) {
+    tmp_errno = errno;
+    goto error_unlink;
+  }
 
   // XXX: check event not NULL, define a timeout?
   tr->listen_event = vde_context_event_add(ctx, tr->listen_fd,
@@ -659,17 +2209,161 @@ error:
   return -1;
 }
 
+/*
+ * Only vde 3 peers are connected to, through shared memory rings: a vde 2
+ * switch does not know how to reply to REQ_NEW_SHM.
+ */
 int vde2_connect(vde_component *component, vde_connection *conn)
 {
+#ifdef HAVE_SHM
+  int tmp_errno;
+  struct sockaddr_un sa_unix;
+  struct timeval tv;
+  char reqbuf[sizeof(vde2_request) + sizeof(SHM_DESCRIPTION)];
+  vde2_request *req = (vde2_request *)reqbuf;
+  vde2_conn *v2_conn;
+  vde_context *ctx = vde_component_get_context(component);
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
+  v2_conn = (vde2_conn *)vde_calloc(sizeof(vde2_conn));
+  if (!v2_conn) {
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+  v2_conn->data_fd = -1;
+  v2_conn->conn = conn;
+  v2_conn->transport = component;
+  v2_conn->batch = tr->batch;
+  v2_conn->max_payload = tr->max_payload;
+
+  v2_conn->ctl_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+  if (v2_conn->ctl_fd < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not obtain a BSD socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  // with a full backlog connect fails with EAGAIN instead of blocking
+  if (fcntl(v2_conn->ctl_fd, F_SETFL, O_NONBLOCK) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not set O_NONBLOCK: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error_close;
+  }
+  sa_unix.sun_family = AF_UNIX;
+  snprintf(sa_unix.sun_path, sizeof(sa_unix.sun_path), "%s/ctl",
+           tr->vdesock_dir);
+  if (connect(v2_conn->ctl_fd, (struct sockaddr *)&sa_unix,
+              sizeof(sa_unix)) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not connect to %s/ctl: %s", __PRETTY_FUNCTION__,
+              tr->vdesock_dir, strerror(errno));
+    goto error_close;
+  }
+
+  memset(reqbuf, 0, sizeof(reqbuf));
+  req->magic = SWITCH_MAGIC;
+  req->version = 3;
+  req->type = REQ_NEW_SHM;
+  strcpy(req->description, SHM_DESCRIPTION);
+  // the socket is still empty, the request fits in its buffer
+  if (write(v2_conn->ctl_fd, reqbuf, sizeof(reqbuf)) != sizeof(reqbuf)) {
+    tmp_errno = errno;
+    vde_error("%s: cannot send request: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error_close;
+  }
+  // never used, frames are not queued on the rings
+  v2_conn->pkt_queue = vde_qdisc_new(&tr->qdisc, &vde2_qpkt_drop,
+                                     (void *)conn);
+  if (v2_conn->pkt_queue == NULL) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create send queue", __PRETTY_FUNCTION__);
+    goto error_close;
+  }
+
+  vde_connection_init(conn, ctx, tr->max_payload, &vde2_conn_write,
+                      &vde2_conn_close, (void *)v2_conn);
+
+  v2_conn->deadline = vde_connection_get_init_time(conn) +
+    tr->handshake_timeout;
+  v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd, VDE_EV_READ,
+                                          vde2_handshake_left(v2_conn, &tv),
+                                          &vde2_clt_get_reply,
+                                          (void *)v2_conn);
+  if (v2_conn->ctl_ev == NULL) {
+    tmp_errno = errno;
+    vde_error("%s: cannot wait for reply", __PRETTY_FUNCTION__);
+    vde_connection_fini(conn);
+    errno = tmp_errno;
+    return -1;
+  }
+  return 0;
+
+error_close:
+  close(v2_conn->ctl_fd);
+error:
+  vde_free(v2_conn);
+  errno = tmp_errno;
   return -1;
+#else
+  vde_error("%s: shared memory rings not supported", __PRETTY_FUNCTION__);
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static int vde2_get_bool(vde_sobj *params, const char *name, int *value)
+{
+  vde_sobj *param = vde_sobj_hash_lookup(params, name);
+
+  if (param == NULL) {
+    return 0;
+  }
+  if (!vde_sobj_is_type(param, vde_sobj_type_bool)) {
+    vde_error("%s: %s must be a boolean", __PRETTY_FUNCTION__, name);
+    errno = EINVAL;
+    return -1;
+  }
+  *value = vde_sobj_get_bool(param);
+  return 0;
+}
+
+static int vde2_get_int(vde_sobj *params, const char *name, int min, int max,
+                        unsigned int *value)
+{
+  vde_sobj *param = vde_sobj_hash_lookup(params, name);
+
+  if (param == NULL) {
+    return 0;
+  }
+  if (!vde_sobj_is_type(param, vde_sobj_type_int) ||
+      vde_sobj_get_int(param) < min || vde_sobj_get_int(param) > max) {
+    vde_error("%s: %s must be an integer between %d and %d",
+              __PRETTY_FUNCTION__, name, min, max);
+    errno = EINVAL;
+    return -1;
+  }
+  *value = vde_sobj_get_int(param);
+  return 0;
 }
 
 static int transport_vde2_init(vde_component *component, vde_sobj *params)
 {
 
   vde2_tr *tr;
-  vde_sobj *path_sobj;
+  vde_sobj *path_sobj, *batch_sobj, *payload_sobj, *slots_sobj;
   const char *path;
+  unsigned int batch = DEFAULT_BATCH;
+  unsigned int max_payload = DEFAULT_MAX_PAYLOAD;
+  unsigned int shm_slots = DEFAULT_SHM_SLOTS;
+  unsigned int listen_backlog = DEFAULT_LISTEN_BACKLOG;
+  unsigned int handshake_timeout = DEFAULT_HANDSHAKE_TIMEOUT;
+  unsigned int max_half_open = DEFAULT_MAX_HALF_OPEN;
+  int handoff = 0, resume = 0;
+  vde_qdisc_conf qdisc;
+  vde_context *ctx;
 
   vde_assert(component != NULL);
 
@@ -692,12 +2386,93 @@ static int transport_vde2_init(vde_component *component, vde_sobj *params)
     errno = EINVAL;
     return -1;
   }
+
+  batch_sobj = vde_sobj_hash_lookup(params, "batch");
+  if (batch_sobj) {
+    if (!vde_sobj_is_type(batch_sobj, vde_sobj_type_int) ||
+        vde_sobj_get_int(batch_sobj) < 1 ||
+        vde_sobj_get_int(batch_sobj) > MAX_BATCH) {
+      vde_error("%s: batch must be an integer between 1 and %d",
+                __PRETTY_FUNCTION__, MAX_BATCH);
+      errno = EINVAL;
+      return -1;
+    }
+    batch = vde_sobj_get_int(batch_sobj);
+  }
+
+  payload_sobj = vde_sobj_hash_lookup(params, "max_payload");
+  if (payload_sobj) {
+    if (!vde_sobj_is_type(payload_sobj, vde_sobj_type_int) ||
+        vde_sobj_get_int(payload_sobj) < DEFAULT_MAX_PAYLOAD ||
+        vde_sobj_get_int(payload_sobj) > MAX_PAYLOAD) {
+      vde_error("%s: max_payload must be an integer between %d and %d",
+                __PRETTY_FUNCTION__, (int)DEFAULT_MAX_PAYLOAD,
+                (int)MAX_PAYLOAD);
+      errno = EINVAL;
+      return -1;
+    }
+    max_payload = vde_sobj_get_int(payload_sobj);
+  }
+
+  slots_sobj = vde_sobj_hash_lookup(params, "shm_slots");
+  if (slots_sobj) {
+    if (!vde_sobj_is_type(slots_sobj, vde_sobj_type_int) ||
+        vde_sobj_get_int(slots_sobj) < 2 ||
+        vde_sobj_get_int(slots_sobj) > MAX_SHM_SLOTS ||
+        (vde_sobj_get_int(slots_sobj) & (vde_sobj_get_int(slots_sobj) - 1))) {
+      vde_error("%s: shm_slots must be a power of two between 2 and %d",
+                __PRETTY_FUNCTION__, MAX_SHM_SLOTS);
+      errno = EINVAL;
+      return -1;
+    }
+    shm_slots = vde_sobj_get_int(slots_sobj);
+  }
+
+  if (vde2_get_int(params, "listen_backlog", 1, MAX_LISTEN_BACKLOG,
+                   &listen_backlog) ||
+      vde2_get_int(params, "handshake_timeout_ms", 1, MAX_HANDSHAKE_TIMEOUT,
+                   &handshake_timeout) ||
+      vde2_get_int(params, "max_half_open", 1, MAX_HALF_OPEN,
+                   &max_half_open) ||
+      vde2_get_bool(params, "handoff", &handoff) ||
+      vde2_get_bool(params, "resume", &resume)) {
+    return -1;
+  }
+  if ((handoff || resume) &&
+      strlen(path) > UNIX_PATH_MAX - sizeof(HANDOFF_SOCK)) {
+    vde_error("%s: directory name is too long for a handoff",
+              __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  // "fifo" by default, see vde_qdisc_conf_parse()
+  if (vde_qdisc_conf_parse(vde_sobj_hash_lookup(params, "qdisc"), &qdisc)) {
+    return -1;
+  }
+#ifndef HAVE_MMSG
+  // the default batch is silently ignored
+  if (batch_sobj && batch > 1) {
+    vde_warning("%s: recvmmsg/sendmmsg not available, batch ignored",
+                __PRETTY_FUNCTION__);
+  }
+#endif
   tr = (vde2_tr *)vde_calloc(sizeof(vde2_tr));
   if (tr == NULL) {
     vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
     errno = ENOMEM;
     return -1;
   }
+  tr->batch = batch;
+  tr->max_payload = max_payload;
+  tr->shm_slots = shm_slots;
+  tr->listen_backlog = listen_backlog;
+  tr->handshake_timeout = (uint64_t)handshake_timeout * 1000000;
+  tr->max_half_open = max_half_open;
+  tr->qdisc = qdisc;
+  tr->handoff = handoff;
+  tr->resume = resume;
+  tr->handoff_fd = -1;
 
   // XXX: path needs to be normalized/checked somewhere
   tr->vdesock_dir = strdup(path);
@@ -708,6 +2483,16 @@ static int transport_vde2_init(vde_component *component, vde_sobj *params)
     return -1;
   }
 
+  // warm up the pool for packets and queue entries of this transport
+  ctx = vde_component_get_context(component);
+  if (vde_pool_set_watermarks(vde_context_get_pool(ctx),
+                              sizeof(vde_pkt) + PKT_DATA_SZ(max_payload),
+                              POOL_LOW_WM, MAXQLEN) ||
+      vde_pool_set_watermarks(vde_context_get_pool(ctx), sizeof(vde2_qpkt),
+                              POOL_LOW_WM, MAXQLEN)) {
+    vde_warning("%s: cannot preallocate packets", __PRETTY_FUNCTION__);
+  }
+
   vde_component_set_priv(component, (void *)tr);
   return 0;
 }
@@ -15,33 +15,65 @@
  *
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <vde3.h>
 #include <stdio.h>
+#include <string.h>
 #include <event.h>
 
 extern vde_event_handler libevent_eh;
+#ifdef HAVE_EPOLL
+extern vde_event_handler epoll_eh;
+int epoll_eh_init(void);
+int epoll_eh_dispatch(void);
+#endif
 
 int main(int argc, char **argv)
 {
-  int res;
+  int res, i, resume = 0;
   vde_context *ctx;
   vde_component *transport, *engine, *cm;
   vde_component *ctransport, *cengine, *ccm;
   vde_sobj *params;
-
-  event_init();
+  vde_event_handler *eh = &libevent_eh;
+  char buf[128];
+
+  for (i = 1; i < argc; i++) {
+#ifdef HAVE_EPOLL
+    // -e uses the epoll event handler instead of libevent
+    if (!strcmp(argv[i], "-e")) {
+      if (epoll_eh_init()) {
+        printf("no epoll event handler\n");
+        return 1;
+      }
+      eh = &epoll_eh;
+    }
+#endif
+    // -r takes the ports of a running vde_hub over, which can then be stopped
+    if (!strcmp(argv[i], "-r")) {
+      resume = 1;
+    }
+  }
+  if (eh == &libevent_eh) {
+    event_init();
+  }
 
   res = vde_context_new(&ctx);
   if (res) {
     printf("no new ctx, %d\n", res);
   }
 
-  res = vde_context_init(ctx, &libevent_eh, NULL);
+  res = vde_context_init(ctx, eh, NULL);
   if (res) {
     printf("no init ctx: %d\n", res);
   }
 
-  params = vde_sobj_from_string("{'path': '/tmp/vde3_test'}");
+  snprintf(buf, sizeof(buf), "{'path': '/tmp/vde3_test', 'handoff': true, "
+           "'resume': %s}", resume ? "true" : "false");
+  params = vde_sobj_from_string(buf);
   res = vde_context_new_component(ctx, VDE_TRANSPORT, "vde2", "tr1", &transport,
                                   params);
   if (res) {
@@ -68,7 +100,9 @@ int main(int argc, char **argv)
   }
 
   // control part
-  params = vde_sobj_from_string("{'path': '/tmp/vde3_test_ctrl'}");
+  snprintf(buf, sizeof(buf), "{'path': '/tmp/vde3_test_ctrl', 'handoff': true, "
+           "'resume': %s}", resume ? "true" : "false");
+  params = vde_sobj_from_string(buf);
   res = vde_context_new_component(ctx, VDE_TRANSPORT, "vde2", "tr2", &ctransport,
                                   params);
   if (res) {
@@ -94,6 +128,12 @@ int main(int argc, char **argv)
     printf("no listen on ccm: %d\n", res);
   }
 
+#ifdef HAVE_EPOLL
+  if (eh == &epoll_eh) {
+    epoll_eh_dispatch();
+    return 0;
+  }
+#endif
   event_dispatch();
 
   return 0;
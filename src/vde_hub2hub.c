@@ -16,15 +16,19 @@
  */
 
 #include <vde3.h>
+#include <vde3/localconnection.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <event.h>
 
 extern vde_event_handler libevent_eh;
+extern vde_event_loop libevent_loop;
 
 int main(int argc, char **argv)
 {
   int res;
-  vde_context *ctx;
+  vde_context *ctx, *ctx1, *ctx2;
   vde_component *tr1, *tr2, *e1, *e2, *cm1, *cm2;
   vde_sobj *params;
 
@@ -40,22 +44,34 @@ int main(int argc, char **argv)
     printf("no init ctx: %d\n", res);
   }
 
+  // -t runs each hub with its transport in its own worker thread
+  ctx1 = ctx2 = ctx;
+  if (argc > 1 && !strcmp(argv[1], "-t")) {
+    res = vde_context_set_workers(ctx, 2, &libevent_loop);
+    if (res) {
+      printf("no workers: %d\n", res);
+    } else {
+      ctx1 = vde_context_get_worker(ctx, 0);
+      ctx2 = vde_context_get_worker(ctx, 1);
+    }
+  }
+
   params = vde_sobj_from_string("{'path': '/tmp/vde3_test_1'}");
-  res = vde_context_new_component(ctx, VDE_TRANSPORT, "vde2", "tr1", &tr1,
+  res = vde_context_new_component(ctx1, VDE_TRANSPORT, "vde2", "tr1", &tr1,
                                   params);
   if (res) {
     printf("no new tr1: %d\n", res);
   }
   vde_sobj_put(params);
 
-  res = vde_context_new_component(ctx, VDE_ENGINE, "hub", "e1", &e1, NULL);
+  res = vde_context_new_component(ctx1, VDE_ENGINE, "hub", "e1", &e1, NULL);
   if (res) {
     printf("no new e1: %d\n", res);
   }
 
   params = vde_sobj_from_string("{'engine': 'e1', 'transport': 'tr1'}");
-  res = vde_context_new_component(ctx, VDE_CONNECTION_MANAGER, "default", "cm1",
-                                  &cm1, params);
+  res = vde_context_new_component(ctx1, VDE_CONNECTION_MANAGER, "default",
+                                  "cm1", &cm1, params);
   if (res) {
     printf("no new cm1: %d\n", res);
   }
@@ -67,21 +83,21 @@ int main(int argc, char **argv)
   }
 
   params = vde_sobj_from_string("{'path': '/tmp/vde3_test_2'}");
-  res = vde_context_new_component(ctx, VDE_TRANSPORT, "vde2", "tr2", &tr2,
+  res = vde_context_new_component(ctx2, VDE_TRANSPORT, "vde2", "tr2", &tr2,
                                   params);
   if (res) {
     printf("no new tr2: %d\n", res);
   }
   vde_sobj_put(params);
 
-  res = vde_context_new_component(ctx, VDE_ENGINE, "hub", "e2", &e2, NULL);
+  res = vde_context_new_component(ctx2, VDE_ENGINE, "hub", "e2", &e2, NULL);
   if (res) {
     printf("no new e2: %d\n", res);
   }
 
   params = vde_sobj_from_string("{'engine': 'e2', 'transport': 'tr2'}");
-  res = vde_context_new_component(ctx, VDE_CONNECTION_MANAGER, "default", "cm2",
-                                  &cm2, params);
+  res = vde_context_new_component(ctx2, VDE_CONNECTION_MANAGER, "default",
+                                  "cm2", &cm2, params);
   if (res) {
     printf("no new cm2: %d\n", res);
   }
@@ -92,12 +108,24 @@ int main(int argc, char **argv)
     printf("no listen on cm2: %d\n", res);
   }
 
-  res = vde_connect_engines_unqueued(ctx, e1, NULL, e2, NULL);
+  res = vde_connect_engines_queued(ctx, e1, NULL, e2, NULL, 0);
   if (res) {
     printf("no local connection: %d\n", res);
   }
 
+  if (vde_context_get_num_workers(ctx) > 0) {
+    res = vde_context_start_workers(ctx);
+    if (res) {
+      printf("no workers start: %d\n", res);
+    }
+  }
+
   event_dispatch();
 
+  // nothing left to run on the default loop, workers do the job
+  while (vde_context_get_num_workers(ctx) > 0) {
+    pause();
+  }
+
   return 0;
 }
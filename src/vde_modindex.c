@@ -0,0 +1,49 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/*
+ * Write the modules index of every directory given on the command line.
+ * Contexts read the index at init and load modules on first use instead of
+ * loading every module found.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <vde3.h>
+#include <vde3/module.h>
+#include <stdio.h>
+
+int main(int argc, char **argv)
+{
+  int i, rv = 0;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s DIR...\n", argv[0]);
+    return 2;
+  }
+
+  for (i = 1; i < argc; i++) {
+    if (vde_modules_write_index(argv[i])) {
+      fprintf(stderr, "%s: cannot index %s\n", argv[0], argv[i]);
+      rv = 1;
+    }
+  }
+
+  return rv;
+}
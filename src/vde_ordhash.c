@@ -19,9 +19,21 @@
 
 #include <vde3/vde_ordhash.h>
 
+/*
+ * Every hash value is the list node of its element, so that insertion
+ * (append at the tail), removal (unlink) and lookup are all O(1).
+ */
+struct vde_ordhash_entry {
+  void *key;
+  void *value;
+  vde_ordhash_entry *prev;
+  vde_ordhash_entry *next;
+};
+
 struct vde_ordhash {
   vde_hash *hash;
-  vde_list *list;
+  vde_ordhash_entry *head; //!< oldest element
+  vde_ordhash_entry *tail; //!< youngest element
 };
 
 
@@ -32,86 +44,112 @@ vde_ordhash *vde_ordhash_new() {
     return NULL;
   }
   oh->hash = vde_hash_init();
-  /* list init not needed */
   return oh;
 }
 
 void vde_ordhash_delete(vde_ordhash *oh) {
   vde_assert(oh != NULL);
   vde_assert(vde_hash_size(oh->hash) == 0);
-  vde_assert(vde_list_length(oh->list) == 0);
+  vde_assert(oh->head == NULL && oh->tail == NULL);
   vde_hash_delete(oh->hash);
-  /* list delete not needed as it's empty (NULL) */
+  free(oh);
 }
 
-void vde_ordhash_insert(vde_ordhash *oh, void *k, void *v) {
+int vde_ordhash_insert(vde_ordhash *oh, void *k, void *v) {
+  vde_ordhash_entry *e;
+
   vde_assert(oh != NULL);
   vde_assert(vde_hash_lookup(oh->hash, k) == NULL);
-  oh->list = vde_list_append(oh->list, k);
-  /*
-   * XXX: consider using vde_list_prepend if optimizations are needed, the list
-   * will then express an inverse temporal relation (e.g.: vde_ordhash_first()
-   * calls vde_list_last(), vde_ordhash_next() calls vde_list_prev())
-   */
-  vde_hash_insert(oh->hash, k, v);
+  e = malloc(sizeof(vde_ordhash_entry));
+  if (e == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  e->key = k;
+  e->value = v;
+  e->next = NULL;
+  e->prev = oh->tail;
+  if (oh->tail) {
+    oh->tail->next = e;
+  } else {
+    oh->head = e;
+  }
+  oh->tail = e;
+  vde_hash_insert(oh->hash, k, e);
+  return 0;
 }
 
 int vde_ordhash_remove(vde_ordhash *oh, void *k) {
+  vde_ordhash_entry *e;
+
   vde_assert(oh != NULL);
-  vde_assert(vde_hash_lookup(oh->hash, k) != NULL);
-  oh->list = vde_list_remove(oh->list, k);
+  e = vde_hash_lookup(oh->hash, k);
+  vde_assert(e != NULL);
+  if (e == NULL) {
+    return 0;
+  }
+  if (e->prev) {
+    e->prev->next = e->next;
+  } else {
+    oh->head = e->next;
+  }
+  if (e->next) {
+    e->next->prev = e->prev;
+  } else {
+    oh->tail = e->prev;
+  }
+  free(e);
   return vde_hash_remove(oh->hash, k);
 }
 
 void *vde_ordhash_lookup(vde_ordhash *oh, void *k) {
+  vde_ordhash_entry *e;
+
   vde_assert(oh != NULL);
-  return vde_hash_lookup(oh->hash, k);
+  e = vde_hash_lookup(oh->hash, k);
+  return e ? e->value : NULL;
 }
 
 vde_ordhash_entry *vde_ordhash_first(vde_ordhash *oh) {
   vde_assert(oh != NULL);
-  return (vde_ordhash_entry *)vde_list_first(oh->list);
+  return oh->head;
 }
 
 vde_ordhash_entry *vde_ordhash_last(vde_ordhash *oh) {
   vde_assert(oh != NULL);
-  return (vde_ordhash_entry *)vde_list_last(oh->list);
+  return oh->tail;
 }
 
 vde_ordhash_entry *vde_ordhash_next(vde_ordhash_entry *e) {
-  return (vde_ordhash_entry *)vde_list_next(e);
+  return e->next;
 }
 
 vde_ordhash_entry *vde_ordhash_prev(vde_ordhash_entry *e) {
-  return (vde_ordhash_entry *)vde_list_prev(e);
+  return e->prev;
 }
 
 void *vde_ordhash_entry_lookup(vde_ordhash *oh, vde_ordhash_entry *e) {
-  void *k, *v;
   vde_assert(oh != NULL);
   vde_assert(e != NULL);
-  k = vde_list_get_data((vde_list *)e);
-  v = vde_hash_lookup(oh->hash, k);
-  vde_assert(v); /* Ensure the given entry has a corresponding value */
-  return v;
+  vde_assert(e->value); /* Ensure the given entry has a corresponding value */
+  return e->value;
 }
 
 void *vde_ordhash_entry_getkey(vde_ordhash *oh, vde_ordhash_entry *e) {
-  void *k;
   vde_assert(oh != NULL);
   vde_assert(e != NULL);
-  k = vde_list_get_data((vde_list *)e);
-  vde_assert(k); /* Ensure the given entry has a corresponding key */
-  return k;
+  vde_assert(e->key); /* Ensure the given entry has a corresponding key */
+  return e->key;
 }
 
 void vde_ordhash_remove_all(vde_ordhash *oh) {
-  vde_list *head;
-  void *k;
+  vde_ordhash_entry *e, *next;
+
   vde_assert(oh != NULL);
-  while ((head = vde_list_first(oh->list))){
-    k = vde_list_get_data(head);
-    vde_ordhash_remove(oh, k);
+  for (e = oh->head; e != NULL; e = next) {
+    next = e->next;
+    vde_hash_remove(oh->hash, e->key);
+    free(e);
   }
+  oh->head = oh->tail = NULL;
 }
-
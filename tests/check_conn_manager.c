@@ -0,0 +1,518 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/command.h>
+#include <vde3/component.h>
+#include <vde3/conn_manager.h>
+#include <vde3/connection.h>
+#include <vde3/context.h>
+#include <vde3/module.h>
+#include <vde3/transport.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+extern vde_event_handler epoll_eh;
+extern vde_event_loop epoll_loop;
+extern int epoll_eh_init(void);
+extern int epoll_eh_dispatch(void);
+extern void epoll_eh_break(void);
+
+#define MAX_CONNS 64
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_component *f_tr, *f_eng, *f_cm;
+// connections handed to the engine
+vde_connection *f_admitted[MAX_CONNS];
+unsigned int f_nadmitted;
+// backends closed
+unsigned int f_closed;
+// authorizer calls, from workers with auth_offload
+int f_authorized;
+int f_auth_in_root;
+// the authorizer waits while set
+int f_auth_hold;
+int f_auth_running;
+pthread_t f_root;
+// connect callbacks
+int f_connect_success, f_connect_error;
+// the last connection given to the transport to connect, and their number
+vde_connection *f_connecting;
+unsigned int f_nconnecting;
+// backend data of connections, telling the authorizer what to do
+int f_accept, f_reject;
+
+static int be_write(vde_connection *conn, vde_pkt *pkt)
+{
+  return 0;
+}
+
+static void be_close(vde_connection *conn)
+{
+  f_closed++;
+}
+
+/*
+ * Fake transport, connections are made up by tests
+ */
+
+static int tr_init(vde_component *component, vde_sobj *params)
+{
+  return 0;
+}
+
+static void tr_fini(vde_component *component)
+{
+}
+
+static int fake_listen(vde_component *transport)
+{
+  return 0;
+}
+
+// the test reports the result with vde_transport_call_cm_*_cb()
+static int fake_connect(vde_component *transport, vde_connection *conn)
+{
+  if (vde_connection_init(conn, vde_component_get_context(transport), 0,
+                          &be_write, &be_close, &f_accept)) {
+    return -1;
+  }
+  f_connecting = conn;
+  f_nconnecting++;
+  return 0;
+}
+
+static component_ops tr_component_ops = {
+  .init = tr_init,
+  .fini = tr_fini,
+};
+
+static vde_module tr_module = {
+  .kind = VDE_TRANSPORT,
+  .family = "fake",
+  .cops = &tr_component_ops,
+  .tr_listen = &fake_listen,
+  .tr_connect = &fake_connect,
+};
+
+// a connection of the fake transport, rejected by the authorizer if reject
+static vde_connection *fake_conn(int reject)
+{
+  vde_connection *conn;
+
+  fail_unless (vde_connection_new(&conn) == 0, "cannot create connection");
+  fail_unless (vde_connection_init(conn, f_ctx, 0, &be_write, &be_close,
+                                   reject ? &f_reject : &f_accept) == 0,
+               "cannot init connection");
+  return conn;
+}
+
+/*
+ * Engine keeping the connections it gets
+ */
+
+static int sink_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
+{
+  return 0;
+}
+
+static int sink_errorcb(vde_connection *conn, vde_pkt *pkt,
+                        vde_conn_error err, void *arg)
+{
+  return 0;
+}
+
+static int sink_init(vde_component *component, vde_sobj *params)
+{
+  return 0;
+}
+
+static void sink_fini(vde_component *component)
+{
+  unsigned int i;
+
+  for (i = 0; i < f_nadmitted; i++) {
+    vde_connection_fini(f_admitted[i]);
+    vde_connection_delete(f_admitted[i]);
+  }
+}
+
+static int sink_newconn(vde_component *engine, vde_connection *conn,
+                        vde_request *req)
+{
+  if (f_nadmitted == MAX_CONNS) {
+    errno = ENOSPC;
+    return -1;
+  }
+  vde_connection_set_callbacks(conn, &sink_readcb, NULL, &sink_errorcb, NULL);
+  f_admitted[f_nadmitted++] = conn;
+  return 0;
+}
+
+static component_ops sink_component_ops = {
+  .init = sink_init,
+  .fini = sink_fini,
+};
+
+static vde_module sink_module = {
+  .kind = VDE_ENGINE,
+  .family = "sink",
+  .cops = &sink_component_ops,
+  .eng_new_conn = &sink_newconn,
+};
+
+// only looks at the connection, as allowed from workers
+static int authorize(vde_component *cm, vde_connection *conn,
+                     vde_request *req, void *arg)
+{
+  if (pthread_equal(pthread_self(), f_root)) {
+    __atomic_store_n(&f_auth_in_root, 1, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&f_auth_running, 1, __ATOMIC_RELEASE);
+  while (__atomic_load_n(&f_auth_hold, __ATOMIC_ACQUIRE)) {
+    sched_yield();
+  }
+  __atomic_add_fetch(&f_authorized, 1, __ATOMIC_RELAXED);
+  return vde_connection_get_priv(conn) == &f_reject ? -1 : 0;
+}
+
+static void connect_success(vde_component *cm, void *arg)
+{
+  f_connect_success++;
+}
+
+static void connect_error(vde_component *cm, void *arg)
+{
+  f_connect_error++;
+}
+
+// the fixture context, with workers if nworkers > 0, and its connection
+// manager created with params
+static void cm_setup(unsigned int nworkers, const char *params)
+{
+  char *mpath[] = {"src/.libs", NULL};
+
+  f_nadmitted = f_closed = 0;
+  f_authorized = f_auth_in_root = f_auth_hold = f_auth_running = 0;
+  f_connect_success = f_connect_error = 0;
+  f_nconnecting = 0;
+  f_root = pthread_self();
+
+  fail_unless (epoll_eh_init() == 0, "cannot init epoll handler");
+  vde_context_new(&f_ctx);
+  fail_unless (vde_context_init(f_ctx, &epoll_eh, mpath) == 0,
+               "cannot init context %s", strerror(errno));
+  fail_unless (vde_context_register_module(f_ctx, &tr_module) == 0 &&
+               vde_context_register_module(f_ctx, &sink_module) == 0,
+               "cannot register modules");
+  if (nworkers > 0) {
+    fail_unless (vde_context_set_workers(f_ctx, nworkers, &epoll_loop) == 0,
+                 "cannot set workers");
+  }
+  vde_context_new_component(f_ctx, VDE_TRANSPORT, "fake", "tr", &f_tr, NULL);
+  vde_context_new_component(f_ctx, VDE_ENGINE, "sink", "e", &f_eng, NULL);
+  fail_unless (vde_context_new_component(f_ctx, VDE_CONNECTION_MANAGER,
+                                         "default", "cm", &f_cm,
+                                         vde_sobj_from_string(params)) == 0,
+               "cannot create connection manager %s", strerror(errno));
+  if (nworkers > 0) {
+    fail_unless (vde_context_start_workers(f_ctx) == 0,
+                 "cannot start workers");
+  }
+}
+
+void
+teardown (void)
+{
+  f_auth_hold = 0;
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+}
+
+static void stop_cb(int fd, short events, void *arg)
+{
+  epoll_eh_break();
+}
+
+// run the root loop for msec milliseconds
+static void run_for(int msec)
+{
+  void *stop;
+  struct timeval tv = { 0, msec * 1000 };
+
+  stop = epoll_eh.timeout_add(&tv, 0, &stop_cb, NULL);
+  fail_unless (stop != NULL, "cannot add stop timeout");
+  fail_unless (epoll_eh_dispatch() == 0, "loop failed");
+  epoll_eh.timeout_del(stop);
+}
+
+// run the root loop until count connections have been handed to the engine
+// or dropped, for at most 3 seconds
+static int run_until_done(unsigned int count)
+{
+  unsigned int ms;
+
+  for (ms = 0; ms < 3000; ms += 10) {
+    if (f_nadmitted + f_closed >= count) {
+      return 0;
+    }
+    run_for(10);
+  }
+  return -1;
+}
+
+static int64_t cm_stat(const char *name)
+{
+  vde_sobj *in, *out = NULL;
+  int64_t val;
+  vde_command *command = vde_component_command_get(f_cm, "stats");
+
+  fail_unless (command != NULL, "no stats command");
+  in = vde_sobj_new_array();
+  fail_unless (vde_command_get_func(command)(f_cm, in, &out) == 0,
+               "stats failed");
+  val = vde_sobj_get_int64(vde_sobj_hash_lookup(out, name));
+  vde_sobj_put(in);
+  vde_sobj_put(out);
+  return val;
+}
+
+V_START_TEST (test_accept_budget)
+{
+  unsigned int i;
+
+  cm_setup(0, "{'transport': 'tr', 'engine': 'e', 'accept_budget': 4}");
+  for (i = 0; i < 10; i++) {
+    vde_transport_call_cm_accept_cb(f_tr, fake_conn(0));
+  }
+  fail_unless (f_nadmitted == 0, "connections admitted out of a pass");
+  fail_unless (run_until_done(10) == 0, "connections not admitted");
+  fail_unless (f_nadmitted == 10 && f_closed == 0,
+               "%u admitted %u closed", f_nadmitted, f_closed);
+  // 4 + 4 + 2
+  fail_unless (cm_stat("deferred") == 2, "passes not deferred");
+  fail_unless (cm_stat("accepted") == 10 && cm_stat("pending") == 0,
+               "wrong counters");
+}
+END_TEST
+
+V_START_TEST (test_reject)
+{
+  cm_setup(0, "{'transport': 'tr', 'engine': 'e'}");
+  vde_conn_manager_set_authorizer(f_cm, &authorize, NULL);
+  vde_transport_call_cm_accept_cb(f_tr, fake_conn(0));
+  vde_transport_call_cm_accept_cb(f_tr, fake_conn(1));
+  fail_unless (run_until_done(2) == 0, "connections not handled");
+  fail_unless (f_authorized == 2, "authorizer called %d times",
+               f_authorized);
+  fail_unless (f_nadmitted == 1 && f_closed == 1,
+               "%u admitted %u closed", f_nadmitted, f_closed);
+  fail_unless (cm_stat("rejected") == 1, "rejection not counted");
+}
+END_TEST
+
+V_START_TEST (test_auth_offload)
+{
+  unsigned int i;
+
+  cm_setup(2, "{'transport': 'tr', 'engine': 'e', 'auth_offload': true}");
+  vde_conn_manager_set_authorizer(f_cm, &authorize, NULL);
+  for (i = 0; i < 20; i++) {
+    vde_transport_call_cm_accept_cb(f_tr, fake_conn(i % 2));
+  }
+  // nothing is authorized in the transport callback
+  fail_unless (f_nadmitted == 0 && f_closed == 0, "authorized synchronously");
+  fail_unless (run_until_done(20) == 0, "authorizations not collected");
+  fail_unless (f_nadmitted == 10 && f_closed == 10,
+               "%u admitted %u closed", f_nadmitted, f_closed);
+  fail_unless (f_authorized == 20 && !f_auth_in_root,
+               "authorizer not run by workers");
+  fail_unless (cm_stat("auth_waiting") == 0 && cm_stat("auth_running") == 0,
+               "authorizations left");
+}
+END_TEST
+
+V_START_TEST (test_close_while_authorizing)
+{
+  vde_connection *conn;
+  unsigned int ms;
+
+  cm_setup(1, "{'transport': 'tr', 'engine': 'e', 'auth_offload': true}");
+  vde_conn_manager_set_authorizer(f_cm, &authorize, NULL);
+  f_auth_hold = 1;
+  conn = fake_conn(0);
+  vde_transport_call_cm_accept_cb(f_tr, conn);
+  for (ms = 0; ms < 3000 && !__atomic_load_n(&f_auth_running,
+                                             __ATOMIC_ACQUIRE); ms += 10) {
+    run_for(10);
+  }
+  fail_unless (f_auth_running, "authorizer not started");
+
+  // the transport reports it closed: the connection is kept for the worker,
+  // its backend is closed by the next pass
+  fail_unless (vde_connection_call_error(conn, NULL, CONN_READ_CLOSED) == 0,
+               "connection closed under the worker");
+  run_for(10);
+  fail_unless (f_closed == 1, "backend not closed");
+
+  __atomic_store_n(&f_auth_hold, 0, __ATOMIC_RELEASE);
+  for (ms = 0; ms < 3000 && cm_stat("pending") > 0; ms += 10) {
+    run_for(10);
+  }
+  fail_unless (cm_stat("pending") == 0, "connection not dropped");
+  fail_unless (f_nadmitted == 0 && f_closed == 1 && cm_stat("rejected") == 1,
+               "%u admitted %u closed", f_nadmitted, f_closed);
+}
+END_TEST
+
+V_START_TEST (test_pending_lookup)
+{
+  vde_connection *conn;
+
+  cm_setup(0, "{'transport': 'tr', 'engine': 'e'}");
+
+  // accepted once
+  conn = fake_conn(0);
+  vde_transport_call_cm_accept_cb(f_tr, conn);
+  vde_transport_call_cm_accept_cb(f_tr, conn);
+  fail_unless (cm_stat("accepted") == 1 && cm_stat("pending") == 1,
+               "connection accepted twice");
+  fail_unless (run_until_done(1) == 0 && f_nadmitted == 1,
+               "connection not admitted");
+
+  // connections are found again when the transport reports back
+  fail_unless (vde_conn_manager_connect(f_cm, NULL, NULL, &connect_success,
+                                        &connect_error, NULL) == 0,
+               "connect failed %s", strerror(errno));
+  fail_unless (cm_stat("pending") == 1, "connection not pending");
+  vde_transport_call_cm_connect_cb(f_tr, f_connecting);
+  fail_unless (run_until_done(2) == 0 && f_nadmitted == 2,
+               "connection not admitted");
+  fail_unless (f_connect_success == 1 && f_connect_error == 0,
+               "connect callbacks not called");
+
+  fail_unless (vde_conn_manager_connect(f_cm, NULL, NULL, &connect_success,
+                                        &connect_error, NULL) == 0,
+               "connect failed %s", strerror(errno));
+  vde_transport_call_cm_error_cb(f_tr, f_connecting, ECONNREFUSED);
+  fail_unless (f_connect_error == 1 && f_closed == 1,
+               "failed connection not dropped");
+
+  // connections never seen are dropped
+  conn = fake_conn(0);
+  vde_transport_call_cm_connect_cb(f_tr, conn);
+  fail_unless (f_closed == 2, "unknown connection not closed");
+  fail_unless (cm_stat("pending") == 0 && cm_stat("connected") == 1,
+               "wrong counters");
+}
+END_TEST
+
+V_START_TEST (test_config_connects)
+{
+  char *mpath[] = {"src/.libs", NULL};
+  char file[] = "/tmp/check_conn_manager.XXXXXX";
+  vde_context *ctx;
+  vde_component *cm, *tr;
+  unsigned int nadmitted;
+  int fd;
+
+  fd = mkstemp(file);
+  fail_unless (fd >= 0, "cannot create file %s", strerror(errno));
+  close(fd);
+
+  cm_setup(0, "{'transport': 'tr', 'engine': 'e'}");
+
+  // one connected, one still waiting for the transport, one failed
+  fail_unless (vde_conn_manager_connect(f_cm, NULL, NULL, &connect_success,
+                                        &connect_error, NULL) == 0,
+               "connect failed %s", strerror(errno));
+  vde_transport_call_cm_connect_cb(f_tr, f_connecting);
+  fail_unless (run_until_done(1) == 0 && f_connect_success == 1,
+               "connection not admitted");
+  fail_unless (vde_conn_manager_connect(f_cm, NULL, NULL, &connect_success,
+                                        &connect_error, NULL) == 0 &&
+               vde_conn_manager_connect(f_cm, NULL, NULL, &connect_success,
+                                        &connect_error, NULL) == 0,
+               "connect failed %s", strerror(errno));
+  vde_transport_call_cm_error_cb(f_tr, f_connecting, ECONNREFUSED);
+  fail_unless (f_connect_error == 1, "connection not failed");
+  fail_unless (vde_conn_manager_get_connects(f_cm) == 2, "%u connects",
+               vde_conn_manager_get_connects(f_cm));
+  fail_unless (vde_context_config_save(f_ctx, file) == 0,
+               "cannot save configuration %s", strerror(errno));
+
+  // every connect is made again, the failures of the new ones are counted.
+  // The engine of the new context must not close the admitted connection
+  nadmitted = f_nadmitted;
+  f_nadmitted = 0;
+  vde_context_new(&ctx);
+  fail_unless (vde_context_init(ctx, &epoll_eh, mpath) == 0 &&
+               vde_context_register_module(ctx, &tr_module) == 0 &&
+               vde_context_register_module(ctx, &sink_module) == 0,
+               "cannot init context %s", strerror(errno));
+  f_nconnecting = 0;
+  fail_unless (vde_context_config_load(ctx, file) == 0,
+               "cannot load configuration %s", strerror(errno));
+  fail_unless (f_nconnecting == 2, "%u connects made", f_nconnecting);
+  cm = vde_context_get_component(ctx, "cm");
+  fail_unless (cm != NULL && vde_conn_manager_get_connects(cm) == 2,
+               "connects not counted");
+  tr = vde_context_get_component(ctx, "tr");
+  vde_transport_call_cm_error_cb(tr, f_connecting, ECONNREFUSED);
+  fail_unless (vde_conn_manager_get_connects(cm) == 1, "failure not counted");
+  vde_component_put(tr, NULL);
+  vde_component_put(cm, NULL);
+
+  vde_context_fini(ctx);
+  vde_context_delete(ctx);
+  f_nadmitted = nadmitted;
+  unlink(file);
+}
+END_TEST
+
+Suite *
+conn_manager_suite (void)
+{
+  Suite *s = suite_create ("conn_manager");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, NULL, teardown);
+  tcase_add_test (tc_core, test_accept_budget);
+  tcase_add_test (tc_core, test_reject);
+  tcase_add_test (tc_core, test_auth_offload);
+  tcase_add_test (tc_core, test_close_while_authorizing);
+  tcase_add_test (tc_core, test_pending_lookup);
+  tcase_add_test (tc_core, test_config_connects);
+  suite_add_tcase (s, tc_core);
+
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = conn_manager_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
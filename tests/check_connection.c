@@ -0,0 +1,350 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/connection.h>
+#include <vde3/packet.h>
+#include <vde3/qdisc.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+#define PKT_LEN 60
+#define BATCH 4
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_event_handler f_eh = {(void *)0x1, (void *)0x1, (void *)0x1, (void *)0x1};
+vde_connection *f_conn;
+vde_pkt *f_pkts[BATCH];
+
+static int be_write(vde_connection *conn, vde_pkt *pkt)
+{
+  return 0;
+}
+
+static void be_close(vde_connection *conn)
+{
+}
+
+static int read_cb(vde_connection *conn, vde_pkt *pkt, void *arg)
+{
+  return 0;
+}
+
+static int error_cb(vde_connection *conn, vde_pkt *pkt, vde_conn_error err,
+                    void *arg)
+{
+  return 0;
+}
+
+// flow notifications received, writable ones count as 1 and others as -1
+int f_flow_events;
+int f_flow_state;
+
+static void flow_cb(vde_connection *conn, int writable, void *arg)
+{
+  f_flow_events++;
+  f_flow_state = writable ? 1 : -1;
+}
+
+void
+setup (void)
+{
+  unsigned int i;
+
+  vde_context_new(&f_ctx);
+  vde_context_init(f_ctx, &f_eh, NULL);
+  vde_connection_new(&f_conn);
+  vde_connection_init(f_conn, f_ctx, 1500, &be_write, &be_close,
+                      (void *)0x1);
+  vde_connection_set_callbacks(f_conn, &read_cb, NULL, &error_cb, NULL);
+  f_flow_events = f_flow_state = 0;
+  for (i = 0; i < BATCH; i++) {
+    f_pkts[i] = vde_pkt_new(f_ctx, PKT_LEN, 0, 0);
+    f_pkts[i]->hdr->pkt_len = PKT_LEN;
+  }
+}
+
+void
+teardown (void)
+{
+  unsigned int i;
+
+  for (i = 0; i < BATCH; i++) {
+    vde_pkt_put(f_pkts[i]);
+  }
+  vde_connection_delete(f_conn);
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+}
+
+V_START_TEST (test_stats_new)
+{
+  unsigned int i;
+  const vde_conn_stats *stats = vde_connection_get_stats(f_conn);
+
+  fail_unless (((uintptr_t)stats % VDE_CACHELINE_SIZE) == 0,
+               "stats not cache line aligned");
+  fail_unless (stats->rx_pkts == 0 && stats->tx_pkts == 0 &&
+               stats->retries == 0 && stats->queue_hwm == 0,
+               "stats not zeroed");
+  for (i = 0; i < VDE_CONN_DROP_MAX; i++) {
+    fail_unless (stats->drops[i] == 0, "drops %u not zeroed", i);
+  }
+}
+END_TEST
+
+V_START_TEST (test_stats_count)
+{
+  const vde_conn_stats *stats = vde_connection_get_stats(f_conn);
+
+  vde_connection_call_read(f_conn, f_pkts[0]);
+  vde_connection_call_read_batch(f_conn, f_pkts, BATCH);
+  fail_unless (stats->rx_pkts == BATCH + 1, "rx_pkts %llu",
+               (unsigned long long)stats->rx_pkts);
+  fail_unless (stats->rx_bytes == (BATCH + 1) * PKT_LEN, "rx_bytes %llu",
+               (unsigned long long)stats->rx_bytes);
+
+  vde_connection_call_write(f_conn, f_pkts[0]);
+  vde_connection_stats_tx(f_conn, f_pkts[1]);
+  fail_unless (stats->tx_pkts == 2 && stats->tx_bytes == 2 * PKT_LEN,
+               "tx_pkts %llu", (unsigned long long)stats->tx_pkts);
+
+  vde_connection_stats_drop(f_conn, VDE_CONN_DROP_QUEUE_FULL);
+  vde_connection_stats_retry(f_conn);
+  vde_connection_stats_queue(f_conn, 5);
+  vde_connection_stats_queue(f_conn, 3);
+  fail_unless (stats->drops[VDE_CONN_DROP_QUEUE_FULL] == 1, "drop not counted");
+  fail_unless (stats->retries == 1, "retry not counted");
+  fail_unless (stats->queue_hwm == 5, "queue_hwm %u", stats->queue_hwm);
+
+  vde_connection_stats_lost(f_conn, 3);
+  vde_connection_stats_reorder(f_conn);
+  fail_unless (stats->rx_lost == 2 && stats->rx_reordered == 1,
+               "rx_lost %llu", (unsigned long long)stats->rx_lost);
+}
+END_TEST
+
+V_START_TEST (test_stats_add)
+{
+  vde_conn_stats total;
+
+  memset(&total, 0, sizeof(total));
+  total.rx_pkts = 1;
+  total.queue_hwm = 10;
+
+  vde_connection_call_read(f_conn, f_pkts[0]);
+  vde_connection_stats_drop(f_conn, VDE_CONN_DROP_NOMEM);
+  vde_connection_stats_queue(f_conn, 4);
+  vde_conn_stats_add(&total, vde_connection_get_stats(f_conn));
+
+  fail_unless (total.rx_pkts == 2, "rx_pkts %llu",
+               (unsigned long long)total.rx_pkts);
+  fail_unless (total.rx_bytes == PKT_LEN, "rx_bytes not added");
+  fail_unless (total.drops[VDE_CONN_DROP_NOMEM] == 1, "drops not added");
+  fail_unless (total.queue_hwm == 10, "queue_hwm %u", total.queue_hwm);
+}
+END_TEST
+
+V_START_TEST (test_stats_serialize)
+{
+  vde_sobj *out, *drops;
+
+  vde_connection_call_read(f_conn, f_pkts[0]);
+  vde_connection_stats_drop(f_conn, VDE_CONN_DROP_TIMEOUT);
+
+  out = vde_conn_stats_serialize(vde_connection_get_stats(f_conn));
+  fail_unless (out != NULL, "cannot serialize");
+  fail_unless (vde_sobj_get_int(vde_sobj_hash_lookup(out, "rx_pkts")) == 1,
+               "wrong rx_pkts");
+  fail_unless (vde_sobj_get_int(vde_sobj_hash_lookup(out, "rx_bytes")) ==
+               PKT_LEN, "wrong rx_bytes");
+  drops = vde_sobj_hash_lookup(out, "drops");
+  fail_unless (drops != NULL && vde_sobj_is_type(drops, vde_sobj_type_hash),
+               "no drops hash");
+  fail_unless (vde_sobj_get_int(vde_sobj_hash_lookup(drops, "timeout")) == 1,
+               "wrong timeout drops");
+  vde_sobj_put(out);
+}
+END_TEST
+
+V_START_TEST (test_trace_sample)
+{
+  unsigned int i;
+  vde_sobj *out;
+  const vde_conn_stats *stats = vde_connection_get_stats(f_conn);
+
+  vde_connection_call_read_batch(f_conn, f_pkts, BATCH);
+  for (i = 0; i < BATCH; i++) {
+    fail_unless (f_pkts[i]->ts == 0, "pkt %u sampled while disabled", i);
+  }
+
+  vde_context_set_trace_sample(f_ctx, 2);
+  fail_unless (vde_context_get_trace_sample(f_ctx) == 2, "rate not set");
+  vde_connection_call_read_batch(f_conn, f_pkts, BATCH);
+  for (i = 0; i < BATCH; i++) {
+    fail_unless ((f_pkts[i]->ts != 0) == (i % 2 == 1),
+                 "pkt %u wrongly sampled", i);
+  }
+
+  for (i = 0; i < BATCH; i++) {
+    vde_connection_write(f_conn, f_pkts[i]);
+    vde_connection_stats_tx(f_conn, f_pkts[i]);
+  }
+  fail_unless (stats->engine.count == BATCH / 2 &&
+               stats->sojourn.count == BATCH / 2, "engine %llu sojourn %llu",
+               (unsigned long long)stats->engine.count,
+               (unsigned long long)stats->sojourn.count);
+
+  out = vde_conn_stats_serialize(stats);
+  fail_unless (vde_sobj_hash_lookup(out, "sojourn") != NULL,
+               "no sojourn histogram");
+  vde_sobj_put(out);
+
+  // a packet read again gets a new timestamp or none
+  vde_context_set_trace_sample(f_ctx, 0);
+  vde_connection_call_read(f_conn, f_pkts[1]);
+  fail_unless (f_pkts[1]->ts == 0, "stale timestamp kept");
+}
+END_TEST
+
+V_START_TEST (test_flow_watermarks)
+{
+  unsigned int i;
+
+  vde_connection_set_flow_cb(f_conn, &flow_cb);
+  vde_connection_set_send_watermarks(f_conn, PKT_LEN, 3 * PKT_LEN);
+  fail_unless (vde_connection_is_writable(f_conn), "new conn not writable");
+
+  for (i = 0; i < 2; i++) {
+    vde_connection_queue_add(f_conn, f_pkts[i]);
+  }
+  fail_unless (vde_connection_is_writable(f_conn) && f_flow_events == 0,
+               "unwritable below high watermark");
+  vde_connection_queue_add(f_conn, f_pkts[2]);
+  fail_unless (!vde_connection_is_writable(f_conn), "writable at high mark");
+  fail_unless (f_flow_events == 1 && f_flow_state == -1,
+               "unwritable not notified");
+  fail_unless (vde_connection_get_queued_bytes(f_conn) == 3 * PKT_LEN,
+               "queued bytes %u", vde_connection_get_queued_bytes(f_conn));
+
+  // hysteresis: still unwritable until the low watermark
+  vde_connection_queue_del(f_conn, f_pkts[0]);
+  fail_unless (!vde_connection_is_writable(f_conn) && f_flow_events == 1,
+               "writable above low watermark");
+  vde_connection_queue_del(f_conn, f_pkts[1]);
+  fail_unless (vde_connection_is_writable(f_conn), "unwritable at low mark");
+  fail_unless (f_flow_events == 2 && f_flow_state == 1,
+               "writable not notified");
+
+  vde_connection_queue_add(f_conn, f_pkts[0]);
+  vde_connection_queue_add(f_conn, f_pkts[1]);
+  fail_unless (!vde_connection_is_writable(f_conn), "writable at high mark");
+  vde_connection_queue_clear(f_conn);
+  fail_unless (vde_connection_is_writable(f_conn) &&
+               vde_connection_get_queued_bytes(f_conn) == 0,
+               "queue not cleared");
+  fail_unless (f_flow_events == 3, "clear notified");
+}
+END_TEST
+
+V_START_TEST (test_flow_disabled)
+{
+  unsigned int i;
+
+  vde_connection_set_flow_cb(f_conn, &flow_cb);
+  for (i = 0; i < BATCH; i++) {
+    vde_connection_queue_add(f_conn, f_pkts[i]);
+  }
+  fail_unless (vde_connection_is_writable(f_conn) && f_flow_events == 0,
+               "unwritable without watermarks");
+
+  // lowering the marks below the queue doesn't notify until the next packet
+  vde_connection_set_send_watermarks(f_conn, PKT_LEN, 2 * PKT_LEN);
+  fail_unless (vde_connection_is_writable(f_conn), "unwritable by setting");
+  // disabling them makes the connection writable again
+  vde_connection_queue_add(f_conn, f_pkts[0]);
+  fail_unless (!vde_connection_is_writable(f_conn), "writable at high mark");
+  vde_connection_set_send_watermarks(f_conn, 0, 0);
+  fail_unless (vde_connection_is_writable(f_conn) && f_flow_state == 1,
+               "still unwritable without watermarks");
+}
+END_TEST
+
+V_START_TEST (test_queue_limit)
+{
+  struct timeval tv = { 1, 0 };
+
+  fail_unless (!vde_connection_queue_exceeded(f_conn, f_pkts[0]),
+               "limit without max_bytes");
+
+  vde_connection_set_send_properties(f_conn, 1, &tv, 2 * PKT_LEN);
+  fail_unless (vde_connection_get_send_maxbytes(f_conn) == 2 * PKT_LEN,
+               "max_bytes not set");
+  vde_connection_queue_add(f_conn, f_pkts[0]);
+  fail_unless (!vde_connection_queue_exceeded(f_conn, f_pkts[1]),
+               "packet fitting the limit exceeds it");
+  vde_connection_queue_add(f_conn, f_pkts[1]);
+  fail_unless (vde_connection_queue_exceeded(f_conn, f_pkts[2]),
+               "limit not enforced");
+  vde_connection_queue_del(f_conn, f_pkts[0]);
+  fail_unless (!vde_connection_queue_exceeded(f_conn, f_pkts[2]),
+               "limit enforced after dequeue");
+}
+END_TEST
+
+V_START_TEST (test_init_time)
+{
+  uint64_t init_time = vde_connection_get_init_time(f_conn);
+
+  fail_unless (init_time != 0, "init time not set");
+  fail_unless (init_time <= vde_qdisc_now(), "init time in the future");
+}
+END_TEST
+
+Suite *
+connection_suite (void)
+{
+  Suite *s = suite_create ("connection");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_stats_new);
+  tcase_add_test (tc_core, test_stats_count);
+  tcase_add_test (tc_core, test_stats_add);
+  tcase_add_test (tc_core, test_stats_serialize);
+  tcase_add_test (tc_core, test_trace_sample);
+  tcase_add_test (tc_core, test_flow_watermarks);
+  tcase_add_test (tc_core, test_flow_disabled);
+  tcase_add_test (tc_core, test_queue_limit);
+  tcase_add_test (tc_core, test_init_time);
+  suite_add_tcase (s, tc_core);
+
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = connection_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,9 +1,16 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <check.h>
 #include <vde3.h>
+#include <vde3/component.h>
+#include <vde3/connection.h>
+#include <vde3/context.h>
+#include <vde3/localconnection.h>
+#include <vde3/module.h>
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -16,9 +23,117 @@
 #define V_START_TEST(n) START_TEST(n)
 #endif
 
+// fixture event handler, callbacks are never run and events are dummies
+static void *f_event_add(int fd, short events, const struct timeval *timeout,
+                         event_cb cb, void *arg)
+{
+  return (void *)0x1;
+}
+
+static void f_event_del(void *ev)
+{
+}
+
+static void *f_timeout_add(const struct timeval *timeout, short events,
+                           event_cb cb, void *arg)
+{
+  return (void *)0x1;
+}
+
+static void f_timeout_del(void *tout)
+{
+}
+
 // fixture components, always present
 vde_context *f_ctx;
-vde_event_handler f_eh = {(void *)0x1, (void *)0x1, (void *)0x1, (void *)0x1};
+vde_event_handler f_eh = {f_event_add, f_event_del, f_timeout_add,
+                          f_timeout_del};
+
+/*
+ * Engine keeping the connections it gets, closing them on request
+ */
+
+#define SINK_CONNS 8
+
+typedef struct {
+  vde_connection *conns[SINK_CONNS];
+  unsigned int nconns;
+} sink;
+
+static int sink_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
+{
+  return 0;
+}
+
+// the peer closed, the connection is closed by the caller
+static int sink_errorcb(vde_connection *conn, vde_pkt *pkt,
+                        vde_conn_error err, void *arg)
+{
+  sink *snk = (sink *)arg;
+  unsigned int i;
+
+  for (i = 0; i < snk->nconns; i++) {
+    if (snk->conns[i] == conn) {
+      snk->conns[i] = NULL;
+    }
+  }
+  errno = EPIPE;
+  return -1;
+}
+
+static int sink_init(vde_component *component, vde_sobj *params)
+{
+  vde_component_set_priv(component, vde_calloc(sizeof(sink)));
+  return 0;
+}
+
+static void sink_close(sink *snk, unsigned int idx)
+{
+  vde_connection *conn = snk->conns[idx];
+
+  if (conn != NULL) {
+    snk->conns[idx] = NULL;
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+  }
+}
+
+static void sink_fini(vde_component *component)
+{
+  sink *snk = (sink *)vde_component_get_priv(component);
+  unsigned int i;
+
+  for (i = 0; i < snk->nconns; i++) {
+    sink_close(snk, i);
+  }
+  vde_free(snk);
+}
+
+static int sink_newconn(vde_component *engine, vde_connection *conn,
+                        vde_request *req)
+{
+  sink *snk = (sink *)vde_component_get_priv(engine);
+
+  if (snk->nconns == SINK_CONNS) {
+    errno = ENOSPC;
+    return -1;
+  }
+  vde_connection_set_callbacks(conn, &sink_readcb, NULL, &sink_errorcb, snk);
+  snk->conns[snk->nconns++] = conn;
+  return 0;
+}
+
+static component_ops sink_component_ops = {
+  .init = sink_init,
+  .fini = sink_fini,
+};
+
+static vde_module sink_module = {
+  .kind = VDE_ENGINE,
+  .family = "sink",
+  .cops = &sink_component_ops,
+  .eng_new_conn = &sink_newconn,
+};
 
 void
 setup (void)
@@ -134,6 +249,13 @@ V_START_TEST (test_component_get)
   fail_unless(vde_context_get_component(f_ctx, "test_e") == comp,
               "fail to return component");
 
+  // the reference returned keeps the component from being deleted
+  rv = vde_context_component_del(f_ctx, comp);
+  fail_unless(rv == -1 && errno == EBUSY, "success on referenced component");
+  vde_component_put(comp, NULL);
+  rv = vde_context_component_del(f_ctx, comp);
+  fail_unless(rv == 0, "del fails on released component %s", strerror(errno));
+
   fail_unless(vde_context_get_component(f_ctx, "") == NULL,
               "fail to return NULL on empty name");
 }
@@ -169,6 +291,274 @@ V_START_TEST (test_component_del_invalid)
 }
 END_TEST
 
+V_START_TEST (test_vde2_max_payload)
+{
+  int rv;
+  vde_component *comp;
+
+  // packets of the largest payload must still fit a pool size class
+  rv = vde_context_new_component(f_ctx, VDE_TRANSPORT, "vde2", "test_t",
+                                 &comp, vde_sobj_from_string(
+                                   "{'path': '/tmp', 'max_payload': 65535}"));
+  fail_unless(rv == -1 && errno == EINVAL, "success on oversized payload");
+
+  rv = vde_context_new_component(f_ctx, VDE_TRANSPORT, "vde2", "test_t",
+                                 &comp, vde_sobj_from_string(
+                                   "{'path': '/tmp', 'max_payload': 9018}"));
+  fail_unless(rv == 0, "fail on jumbo frames %s", strerror(errno));
+}
+END_TEST
+
+V_START_TEST (test_module_load)
+{
+  int rv;
+
+  rv = vde_context_load_module(f_ctx, VDE_ENGINE, "hub");
+  fail_unless(rv == 0, "load fails on valid arguments %s", strerror(errno));
+
+  rv = vde_context_load_module(f_ctx, VDE_ENGINE, "thisisnotsupposedtoexists");
+  fail_unless(rv == -1 && errno == ENOENT, "success on unknown family %s",
+              strerror(errno));
+}
+END_TEST
+
+V_START_TEST (test_module_index)
+{
+  int rv;
+  vde_context *ctx;
+  vde_component *comp;
+  char dir[] = "/tmp/check_context.XXXXXX";
+  char *mpath[] = {dir, NULL};
+  char index[64];
+  FILE *f;
+
+  fail_unless(mkdtemp(dir) != NULL, "cannot create directory %s",
+              strerror(errno));
+  snprintf(index, sizeof(index), "%s/%s", dir, VDE_MODULES_INDEX);
+
+  rv = vde_modules_write_index(dir);
+  fail_unless(rv == 0, "index fails on empty directory %s", strerror(errno));
+  f = fopen(index, "a");
+  fail_unless(f != NULL, "index not written %s", strerror(errno));
+  fprintf(f, "engine hub missing.so\nnotakind hub\n");
+  fclose(f);
+
+  // modules listed in the index are loaded on first use only
+  vde_context_new(&ctx);
+  rv = vde_context_init(ctx, &f_eh, mpath);
+  fail_unless(rv == 0, "init fails on stale index %s", strerror(errno));
+
+  rv = vde_context_new_component(ctx, VDE_ENGINE, "switch", "test_e", &comp,
+                                 NULL);
+  fail_unless(rv == -1 && errno == ENOENT, "success on module not in index");
+
+  rv = vde_context_new_component(ctx, VDE_ENGINE, "hub", "test_e", &comp,
+                                 NULL);
+  fail_unless(rv == -1, "success on missing module file");
+
+  vde_context_fini(ctx);
+  vde_context_delete(ctx);
+  unlink(index);
+  rmdir(dir);
+}
+END_TEST
+
+// modules are built in src/.libs along with libvde, which is not a module
+V_START_TEST (test_module_index_build)
+{
+  int rv;
+  vde_context *ctx;
+  vde_component *comp;
+  char *mpath[] = {"src/.libs", NULL};
+  char *line = NULL;
+  size_t line_size = 0;
+  int hub_found = 0;
+  FILE *f;
+
+  rv = vde_modules_write_index("src/.libs");
+  fail_unless(rv == 0, "index fails on build directory %s", strerror(errno));
+  f = fopen("src/.libs/" VDE_MODULES_INDEX, "r");
+  fail_unless(f != NULL, "index not written %s", strerror(errno));
+  while (getline(&line, &line_size, f) != -1) {
+    fail_unless(strstr(line, "libvde") == NULL, "libvde indexed: %s", line);
+    if (strcmp(line, "engine hub engine_hub.so\n") == 0) {
+      hub_found = 1;
+    }
+  }
+  free(line);
+  fclose(f);
+  fail_unless(hub_found, "hub not indexed");
+
+  vde_context_new(&ctx);
+  rv = vde_context_init(ctx, &f_eh, mpath);
+  fail_unless(rv == 0, "init fails on build index %s", strerror(errno));
+  rv = vde_context_new_component(ctx, VDE_ENGINE, "hub", "test_e", &comp,
+                                 NULL);
+  fail_unless(rv == 0, "indexed module not loaded %s", strerror(errno));
+  vde_context_fini(ctx);
+  vde_context_delete(ctx);
+}
+END_TEST
+
+V_START_TEST (test_config_save_load)
+{
+  int rv;
+  vde_context *ctx;
+  vde_component *comp, *e1, *e2;
+  char file[] = "/tmp/check_context.XXXXXX";
+  int fd;
+
+  fd = mkstemp(file);
+  fail_unless(fd >= 0, "cannot create file %s", strerror(errno));
+  close(fd);
+
+  vde_context_new_component(f_ctx, VDE_ENGINE, "hub", "e1", &e1,
+                            vde_sobj_from_string("{'stats_interval': 0}"));
+  vde_context_new_component(f_ctx, VDE_ENGINE, "hub", "e2", &e2, NULL);
+  vde_connect_engines_unqueued(f_ctx, e1, NULL, e2, NULL);
+  rv = vde_context_config_save(f_ctx, file);
+  fail_unless(rv == 0, "save fails on valid arguments %s", strerror(errno));
+
+  vde_context_new(&ctx);
+  vde_context_init(ctx, &f_eh, NULL);
+  rv = vde_context_config_load(ctx, file);
+  fail_unless(rv == 0, "load fails on saved configuration %s",
+              strerror(errno));
+  comp = vde_context_get_component(ctx, "e1");
+  fail_unless(comp != NULL && vde_component_get_kind(comp) == VDE_ENGINE,
+              "component not loaded");
+  vde_component_put(comp, NULL);
+  comp = vde_context_get_component(ctx, "e2");
+  fail_unless(comp != NULL, "component not loaded");
+  vde_component_put(comp, NULL);
+
+  // components are never created twice
+  rv = vde_context_config_load(ctx, file);
+  fail_unless(rv == -1 && errno == EEXIST, "success on existing components");
+
+  vde_context_fini(ctx);
+  vde_context_delete(ctx);
+  unlink(file);
+}
+END_TEST
+
+// the links of a saved configuration, as a string
+static char *config_links(const char *file)
+{
+  FILE *f;
+  char buf[4096];
+  size_t len;
+  vde_sobj *config;
+  char *links;
+
+  f = fopen(file, "r");
+  fail_unless(f != NULL, "cannot open %s", file);
+  len = fread(buf, 1, sizeof(buf) - 1, f);
+  buf[len] = '\0';
+  fclose(f);
+  config = vde_sobj_from_string(buf);
+  fail_unless(config != NULL, "invalid configuration %s", buf);
+  links = vde_strdup(vde_sobj_to_string(vde_sobj_hash_lookup(config,
+                                                             "links")));
+  vde_sobj_put(config);
+  return links;
+}
+
+V_START_TEST (test_config_links)
+{
+  int rv;
+  vde_context *ctx;
+  vde_component *e1, *e2, *e3;
+  sink *snk;
+  char file[] = "/tmp/check_context.XXXXXX";
+  char *links;
+  int fd;
+
+  fd = mkstemp(file);
+  fail_unless(fd >= 0, "cannot create file %s", strerror(errno));
+  close(fd);
+
+  fail_unless(vde_context_register_module(f_ctx, &sink_module) == 0,
+              "cannot register module");
+  vde_context_new_component(f_ctx, VDE_ENGINE, "sink", "e1", &e1, NULL);
+  vde_context_new_component(f_ctx, VDE_ENGINE, "sink", "e2", &e2, NULL);
+  vde_context_new_component(f_ctx, VDE_ENGINE, "sink", "e3", &e3, NULL);
+  fail_unless(vde_connect_engines_unqueued(f_ctx, e1, NULL, e2, NULL) == 0 &&
+              vde_connect_engines_unqueued(f_ctx, e1, NULL, e2, NULL) == 0 &&
+              vde_connect_engines_queued(f_ctx, e1, NULL, e3, NULL, 8) == 0 &&
+              vde_connect_engines_queued(f_ctx, e2, NULL, e3, NULL, 8) == 0,
+              "cannot connect engines %s", strerror(errno));
+
+  // closed from either side, the other links are left
+  snk = (sink *)vde_component_get_priv(e1);
+  sink_close(snk, 0);
+  snk = (sink *)vde_component_get_priv(e3);
+  sink_close(snk, 1);
+  rv = vde_context_config_save(f_ctx, file);
+  fail_unless(rv == 0, "save fails on valid arguments %s", strerror(errno));
+  links = config_links(file);
+  fail_unless(strcmp(links, "[ [ \"e1\", \"e2\" ], [ \"e1\", \"e3\", 8 ] ]")
+              == 0, "wrong links %s", links);
+  vde_free(links);
+
+  // every link is made again
+  vde_context_new(&ctx);
+  vde_context_init(ctx, &f_eh, NULL);
+  fail_unless(vde_context_register_module(ctx, &sink_module) == 0,
+              "cannot register module");
+  rv = vde_context_config_load(ctx, file);
+  fail_unless(rv == 0, "load fails on saved configuration %s",
+              strerror(errno));
+  e1 = vde_context_get_component(ctx, "e1");
+  snk = (sink *)vde_component_get_priv(e1);
+  fail_unless(snk->nconns == 2, "%u links made", snk->nconns);
+  vde_component_put(e1, NULL);
+
+  // links of a deleted engine are gone too
+  e3 = vde_context_get_component(ctx, "e3");
+  vde_component_put(e3, NULL);
+  fail_unless(vde_context_component_del(ctx, e3) == 0,
+              "cannot delete engine %s", strerror(errno));
+  rv = vde_context_config_save(ctx, file);
+  fail_unless(rv == 0, "save fails on valid arguments %s", strerror(errno));
+  links = config_links(file);
+  fail_unless(strcmp(links, "[ [ \"e1\", \"e2\" ] ]") == 0,
+              "wrong links %s", links);
+  vde_free(links);
+
+  vde_context_fini(ctx);
+  vde_context_delete(ctx);
+  unlink(file);
+}
+END_TEST
+
+V_START_TEST (test_config_load_invalid)
+{
+  int rv;
+  char file[] = "/tmp/check_context.XXXXXX";
+  FILE *f;
+  int fd;
+
+  rv = vde_context_config_load(f_ctx, "nonexistantfile");
+  fail_unless(rv == -1 && errno == ENOENT, "success on missing file");
+
+  fd = mkstemp(file);
+  fail_unless(fd >= 0, "cannot create file %s", strerror(errno));
+  f = fdopen(fd, "w");
+  fprintf(f, "{'version': 1, 'components': [['engine', 'hub', 'e1', null],"
+             " ['engine', 'hub', 'e2', null]], 'listen': ['e1']}");
+  fclose(f);
+
+  // nothing is created from an invalid configuration
+  rv = vde_context_config_load(f_ctx, file);
+  fail_unless(rv == -1 && errno == EINVAL, "success on engine listening");
+  fail_unless(vde_context_get_component(f_ctx, "e1") == NULL,
+              "component created from invalid configuration");
+
+  unlink(file);
+}
+END_TEST
+
 Suite *
 context_suite (void)
 {
@@ -191,7 +581,24 @@ context_suite (void)
   tcase_add_test (tc_component, test_component_get);
   tcase_add_test (tc_component, test_component_del);
   tcase_add_test (tc_component, test_component_del_invalid);
+  tcase_add_test (tc_component, test_vde2_max_payload);
   suite_add_tcase (s, tc_component);
+
+  /* Module test case */
+  TCase *tc_module = tcase_create ("Module");
+  tcase_add_checked_fixture (tc_module, setup, teardown);
+  tcase_add_test (tc_module, test_module_load);
+  tcase_add_test (tc_module, test_module_index);
+  tcase_add_test (tc_module, test_module_index_build);
+  suite_add_tcase (s, tc_module);
+
+  /* Configuration test case */
+  TCase *tc_config = tcase_create ("Config");
+  tcase_add_checked_fixture (tc_config, setup, teardown);
+  tcase_add_test (tc_config, test_config_save_load);
+  tcase_add_test (tc_config, test_config_links);
+  tcase_add_test (tc_config, test_config_load_invalid);
+  suite_add_tcase (s, tc_config);
   return s;
 }
 
@@ -0,0 +1,493 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/command.h>
+#include <vde3/component.h>
+#include <vde3/connection.h>
+#include <vde3/engine.h>
+#include <vde3/packet.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+extern vde_event_handler epoll_eh;
+extern vde_event_loop epoll_loop;
+extern int epoll_eh_init(void);
+extern int epoll_eh_dispatch(void);
+extern void epoll_eh_break(void);
+
+#define SEGMENT_SIZE (1024 * 1024)
+#define SHB_LEN 28
+#define IDB_LEN 32
+#define EPB_LEN 28
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_component *f_cap;
+vde_connection *f_conn;
+// directory of the segment files
+char f_dir[64];
+int f_be_priv;
+
+static int be_write(vde_connection *conn, vde_pkt *pkt)
+{
+  return 0;
+}
+
+static void be_close(vde_connection *conn)
+{
+}
+
+static void ctx_setup(unsigned int nworkers)
+{
+  char *mpath[] = {"src/.libs", NULL};
+
+  strcpy(f_dir, "/tmp/check_capture.XXXXXX");
+  fail_unless (mkdtemp(f_dir) != NULL, "cannot create directory");
+  fail_unless (epoll_eh_init() == 0, "cannot init epoll handler");
+  vde_context_new(&f_ctx);
+  fail_unless (vde_context_init(f_ctx, &epoll_eh, mpath) == 0,
+               "cannot init context %s", strerror(errno));
+  if (nworkers > 0) {
+    fail_unless (vde_context_set_workers(f_ctx, nworkers, &epoll_loop) == 0,
+                 "cannot set workers");
+    fail_unless (vde_context_start_workers(f_ctx) == 0,
+                 "cannot start workers");
+  }
+  f_cap = NULL;
+}
+
+void
+setup (void)
+{
+  ctx_setup(0);
+}
+
+void
+setup_workers (void)
+{
+  ctx_setup(1);
+}
+
+void
+teardown (void)
+{
+  DIR *dir;
+  struct dirent *entry;
+  char name[PATH_MAX];
+
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+
+  dir = opendir(f_dir);
+  if (dir != NULL) {
+    while ((entry = readdir(dir)) != NULL) {
+      if (entry->d_name[0] != '.') {
+        snprintf(name, sizeof(name), "%s/%s", f_dir, entry->d_name);
+        unlink(name);
+      }
+    }
+    closedir(dir);
+  }
+  rmdir(f_dir);
+}
+
+static void stop_cb(int fd, short events, void *arg)
+{
+  epoll_eh_break();
+}
+
+// run the root loop for msec milliseconds
+static void run_for(int msec)
+{
+  void *stop;
+  struct timeval tv = { msec / 1000, (msec % 1000) * 1000 };
+
+  stop = epoll_eh.timeout_add(&tv, 0, &stop_cb, NULL);
+  fail_unless (stop != NULL, "cannot add stop timeout");
+  fail_unless (epoll_eh_dispatch() == 0, "loop failed");
+  epoll_eh.timeout_del(stop);
+}
+
+// a capture engine writing segments of SEGMENT_SIZE to the fixture directory
+// and its port, other params are given as the members of a hash
+static int capture_new(const char *params)
+{
+  char buf[1024];
+  vde_component *cap;
+
+  snprintf(buf, sizeof(buf), "{'path': '%s/cap', 'segment_size': %d%s%s}",
+           f_dir, SEGMENT_SIZE, *params != '\0' ? ", " : "", params);
+  if (vde_context_new_component(f_ctx, VDE_ENGINE, "capture", "cap", &cap,
+                                vde_sobj_from_string(buf))) {
+    return -1;
+  }
+  f_cap = cap;
+  fail_unless (vde_connection_new(&f_conn) == 0, "cannot create connection");
+  fail_unless (vde_connection_init(f_conn, f_ctx, 0, &be_write, &be_close,
+                                   &f_be_priv) == 0, "cannot init connection");
+  fail_unless (vde_engine_new_connection(f_cap, f_conn, NULL) == 0,
+               "cannot attach port %s", strerror(errno));
+  return 0;
+}
+
+// a frame of len bytes with the given ethertype, byte i of the payload after
+// the ethernet header is i, except the first which is first
+static void frame_send(unsigned int len, unsigned int type,
+                       unsigned char first)
+{
+  vde_pkt *pkt;
+  unsigned char *frame;
+  unsigned int i;
+
+  pkt = vde_pkt_new(f_ctx, len, 0, 0);
+  fail_unless (pkt != NULL, "cannot allocate packet");
+  pkt->hdr->pkt_len = len;
+  frame = (unsigned char *)pkt->payload;
+  memset(frame, 0xff, 6);
+  memset(frame + 6, 0x02, 6);
+  frame[12] = type >> 8;
+  frame[13] = type & 0xff;
+  for (i = 14; i < len; i++) {
+    frame[i] = i - 14;
+  }
+  if (len > 14) {
+    frame[14] = first;
+  }
+  vde_connection_call_read(f_conn, pkt);
+  vde_pkt_put(pkt);
+}
+
+static int64_t capture_stat(const char *name)
+{
+  vde_sobj *out;
+  vde_command *command = vde_component_command_get(f_cap, "stats");
+  int64_t value;
+
+  fail_unless (command != NULL, "no stats command");
+  fail_unless (vde_command_get_func(command)(f_cap, vde_sobj_new_array(),
+                                             &out) == 0, "stats failed");
+  value = vde_sobj_get_int64(vde_sobj_hash_lookup(out, name));
+  vde_sobj_put(out);
+  return value;
+}
+
+static int capture_rotate(void)
+{
+  vde_sobj *in, *out;
+  vde_command *command = vde_component_command_get(f_cap, "rotate");
+  int rv;
+
+  fail_unless (command != NULL, "no rotate command");
+  in = vde_sobj_new_array();
+  rv = vde_command_get_func(command)(f_cap, in, &out);
+  vde_sobj_put(in);
+  vde_sobj_put(out);
+  return rv;
+}
+
+// size of segment seq, -1 if it doesn't exist
+static long segment_size(unsigned int seq)
+{
+  char name[PATH_MAX];
+  struct stat st;
+
+  snprintf(name, sizeof(name), "%s/cap.%u.pcapng", f_dir, seq);
+  if (stat(name, &st)) {
+    return -1;
+  }
+  return st.st_size;
+}
+
+static unsigned char *segment_read(unsigned int seq, long *size)
+{
+  char name[PATH_MAX];
+  unsigned char *buf;
+  FILE *f;
+
+  *size = segment_size(seq);
+  fail_unless (*size > 0, "no segment %u", seq);
+  buf = malloc(*size);
+  snprintf(name, sizeof(name), "%s/cap.%u.pcapng", f_dir, seq);
+  f = fopen(name, "r");
+  fail_unless (f != NULL && fread(buf, 1, *size, f) == *size,
+               "cannot read segment %u", seq);
+  fclose(f);
+  return buf;
+}
+
+static uint32_t u32(const unsigned char *p)
+{
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+V_START_TEST (test_bpf_check)
+{
+  unsigned int i;
+  const char *invalid[] = {
+    "[ ]",
+    "[ [ 6, 0, 0 ] ]",
+    // unknown opcode
+    "[ [ 255, 0, 0, 0 ], [ 6, 0, 0, 0 ] ]",
+    // no return at the end
+    "[ [ 40, 0, 0, 12 ] ]",
+    // jumps past the end
+    "[ [ 5, 0, 0, 1 ], [ 6, 0, 0, 0 ] ]",
+    "[ [ 21, 1, 0, 0 ], [ 6, 0, 0, 0 ] ]",
+    // division by a zero constant
+    "[ [ 52, 0, 0, 0 ], [ 6, 0, 0, 0 ] ]",
+    // scratch memory out of range
+    "[ [ 2, 0, 0, 16 ], [ 6, 0, 0, 0 ] ]",
+    // ancillary loads, as vlan_tci and a negative indirect offset
+    "[ [ 40, 0, 0, 4294963244 ], [ 6, 0, 0, 0 ] ]",
+    "[ [ 80, 0, 0, 4294963200 ], [ 6, 0, 0, 0 ] ]",
+    "[ [ 177, 0, 0, 4293918720 ], [ 6, 0, 0, 0 ] ]",
+    // fields out of range
+    "[ [ 6, 256, 0, 0 ] ]",
+    "[ [ 6, 0, 0, 4294967296 ] ]",
+  };
+  char params[256];
+
+  for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+    snprintf(params, sizeof(params), "'filter': %s", invalid[i]);
+    fail_unless (capture_new(params) == -1 && errno == EINVAL,
+                 "filter %s accepted", invalid[i]);
+  }
+  fail_unless (capture_new("'filter': [ [ 6, 0, 0, 65535 ] ]") == 0,
+               "valid filter rejected");
+}
+END_TEST
+
+V_START_TEST (test_bpf_run)
+{
+  // the arp filter of the documentation
+  fail_unless (capture_new("'filter': [ [ 40, 0, 0, 12 ], "
+                           "[ 21, 0, 1, 2054 ], [ 6, 0, 0, 262144 ], "
+                           "[ 6, 0, 0, 0 ] ]") == 0,
+               "cannot create capture engine");
+  frame_send(60, 0x0806, 0);
+  frame_send(60, 0x0800, 0x45);
+  frame_send(60, 0x0806, 0);
+  fail_unless (capture_stat("frames") == 2 && capture_stat("filtered") == 1,
+               "arp filter: %lld frames %lld filtered",
+               (long long)capture_stat("frames"),
+               (long long)capture_stat("filtered"));
+}
+END_TEST
+
+V_START_TEST (test_bpf_headers)
+{
+  long size;
+  unsigned char *buf, *epb;
+
+  /*
+   * capture the ethernet and ip headers, if there is a byte after them:
+   *   ldxb 4*([14]&0xf); txa; add #14; st M[1]; ldx M[1]; ldb [x+0];
+   *   ld M[1]; ret a
+   */
+  fail_unless (capture_new("'filter': [ [ 177, 0, 0, 14 ], [ 135, 0, 0, 0 ], "
+                           "[ 4, 0, 0, 14 ], [ 2, 0, 0, 1 ], "
+                           "[ 97, 0, 0, 1 ], [ 80, 0, 0, 0 ], "
+                           "[ 96, 0, 0, 1 ], [ 22, 0, 0, 0 ] ]") == 0,
+               "cannot create capture engine");
+  run_for(50);
+  frame_send(60, 0x0800, 0x45);
+  frame_send(34, 0x0800, 0x45);
+  frame_send(60, 0x0800, 0x46);
+  fail_unless (capture_stat("frames") == 2 && capture_stat("filtered") == 1,
+               "%lld frames %lld filtered", (long long)capture_stat("frames"),
+               (long long)capture_stat("filtered"));
+
+  fail_unless (capture_rotate() == 0, "cannot rotate");
+  run_for(50);
+  buf = segment_read(0, &size);
+  epb = buf + SHB_LEN + IDB_LEN;
+  fail_unless (u32(epb + 20) == 34 && u32(epb + 24) == 60,
+               "wrong caplen %u, len %u", u32(epb + 20), u32(epb + 24));
+  epb += u32(epb + 4);
+  fail_unless (u32(epb + 20) == 38 && u32(epb + 24) == 60,
+               "wrong caplen %u, len %u", u32(epb + 20), u32(epb + 24));
+  free(buf);
+}
+END_TEST
+
+V_START_TEST (test_epb_layout)
+{
+  long size;
+  unsigned int i;
+  unsigned char *buf, *epb;
+
+  fail_unless (capture_new("'snaplen': 64") == 0,
+               "cannot create capture engine");
+  run_for(50);
+  frame_send(61, 0x0800, 0);
+  frame_send(100, 0x0800, 0);
+  fail_unless (capture_stat("frames") == 2 && capture_stat("bytes") == 125,
+               "wrong stats");
+  fail_unless (capture_rotate() == 0, "cannot rotate");
+  // the full segment is cut to the blocks written
+  run_for(50);
+  buf = segment_read(0, &size);
+  fail_unless (size == SHB_LEN + IDB_LEN + (EPB_LEN + 64 + 4) +
+                       (EPB_LEN + 64 + 4), "wrong segment size %ld", size);
+
+  // section header, in host byte order, and interface with ns timestamps
+  fail_unless (u32(buf) == 0x0A0D0D0A && u32(buf + 4) == SHB_LEN &&
+               u32(buf + 8) == 0x1A2B3C4D && u32(buf + 24) == SHB_LEN,
+               "wrong section header");
+  fail_unless (u32(buf + SHB_LEN) == 1 && u32(buf + SHB_LEN + 4) == IDB_LEN &&
+               u32(buf + SHB_LEN + 12) == 64 &&
+               buf[SHB_LEN + 20] == 9 &&
+               u32(buf + SHB_LEN + IDB_LEN - 4) == IDB_LEN,
+               "wrong interface block");
+
+  // frames padded to 4 bytes, followed by the block length
+  epb = buf + SHB_LEN + IDB_LEN;
+  fail_unless (u32(epb) == 6 && u32(epb + 4) == EPB_LEN + 64 + 4 &&
+               u32(epb + 8) == 0 && u32(epb + 20) == 61 &&
+               u32(epb + 24) == 61 && u32(epb + EPB_LEN + 64) == EPB_LEN + 68,
+               "wrong block of a short frame");
+  fail_unless (u32(epb + 12) != 0 || u32(epb + 16) != 0, "no timestamp");
+  for (i = 14; i < 61; i++) {
+    fail_unless (epb[EPB_LEN + i] == i - 14, "wrong byte %u", i);
+  }
+  for (i = 61; i < 64; i++) {
+    fail_unless (epb[EPB_LEN + i] == 0, "padding not cleared");
+  }
+  epb += EPB_LEN + 68;
+  fail_unless (u32(epb) == 6 && u32(epb + 20) == 64 && u32(epb + 24) == 100 &&
+               epb[EPB_LEN + 63] == 63 - 14 &&
+               u32(epb + EPB_LEN + 64) == EPB_LEN + 68,
+               "wrong block of a frame cut to snaplen");
+  free(buf);
+}
+END_TEST
+
+V_START_TEST (test_rotation)
+{
+  unsigned int i, per_segment;
+
+  per_segment = (SEGMENT_SIZE - SHB_LEN - IDB_LEN) / (EPB_LEN + 1500 + 4);
+  fail_unless (capture_new("'segments': 3") == 0,
+               "cannot create capture engine");
+  run_for(50);
+  fail_unless (segment_size(1) == SEGMENT_SIZE, "spare segment not ready");
+
+  // the spare takes the place of the full segment
+  for (i = 0; i < per_segment + 1; i++) {
+    frame_send(1500, 0x0800, 0);
+  }
+  fail_unless (capture_stat("rotations") == 1 &&
+               capture_stat("dropped") == 0, "segment not rotated");
+  // with no spare ready frames are dropped rather than waited for
+  for (i = 0; i < per_segment; i++) {
+    frame_send(1500, 0x0800, 0);
+  }
+  fail_unless (capture_stat("rotations") == 1 && capture_stat("dropped") == 1,
+               "frames not dropped");
+
+  // the next one is there once the loop runs, the full one is cut
+  run_for(50);
+  fail_unless (segment_size(2) == SEGMENT_SIZE, "segment 2 not prepared");
+  fail_unless (segment_size(0) == SHB_LEN + IDB_LEN +
+                                  per_segment * (EPB_LEN + 1500 + 4),
+               "full segment not cut: %ld", segment_size(0));
+
+  // old segments are removed, the spare counts
+  frame_send(1500, 0x0800, 0);
+  fail_unless (capture_stat("rotations") == 2, "segment not rotated");
+  run_for(50);
+  fail_unless (segment_size(0) == -1 && segment_size(3) == SEGMENT_SIZE,
+               "segment 3 not prepared in place of segment 0");
+  fail_unless (segment_size(1) == SHB_LEN + IDB_LEN +
+                                  per_segment * (EPB_LEN + 1500 + 4),
+               "full segment not cut: %ld", segment_size(1));
+  fail_unless (capture_stat("errors") == 0, "errors counted");
+}
+END_TEST
+
+V_START_TEST (test_prepare_retry)
+{
+  char moved[80];
+
+  fail_unless (capture_new("") == 0, "cannot create capture engine");
+  // the spare cannot be created while the directory is away
+  snprintf(moved, sizeof(moved), "%s.moved", f_dir);
+  fail_unless (rename(f_dir, moved) == 0, "cannot move directory");
+  run_for(50);
+  fail_unless (rename(moved, f_dir) == 0, "cannot move directory back");
+  fail_unless (capture_stat("errors") == 1, "error not counted");
+  fail_unless (capture_rotate() == -1 && errno == EAGAIN,
+               "rotated without a spare");
+
+  // it is tried again later
+  run_for(1100);
+  fail_unless (capture_stat("errors") == 1 && capture_rotate() == 0,
+               "spare not prepared again");
+}
+END_TEST
+
+Suite *
+engine_capture_suite (void)
+{
+  Suite *s = suite_create ("engine_capture");
+
+  /* BPF filter test case */
+  TCase *tc_bpf = tcase_create ("Bpf");
+  tcase_add_checked_fixture (tc_bpf, setup, teardown);
+  tcase_add_test (tc_bpf, test_bpf_check);
+  tcase_add_test (tc_bpf, test_bpf_run);
+  tcase_add_test (tc_bpf, test_bpf_headers);
+  suite_add_tcase (s, tc_bpf);
+
+  /* Segment files test case, prepared by the event loop */
+  TCase *tc_segment = tcase_create ("Segment");
+  tcase_add_checked_fixture (tc_segment, setup, teardown);
+  tcase_add_test (tc_segment, test_epb_layout);
+  tcase_add_test (tc_segment, test_rotation);
+  tcase_add_test (tc_segment, test_prepare_retry);
+  suite_add_tcase (s, tc_segment);
+
+  /* Segment files test case, prepared by a worker */
+  TCase *tc_worker = tcase_create ("Worker");
+  tcase_add_checked_fixture (tc_worker, setup_workers, teardown);
+  tcase_add_test (tc_worker, test_epb_layout);
+  tcase_add_test (tc_worker, test_rotation);
+  tcase_add_test (tc_worker, test_prepare_retry);
+  tcase_set_timeout (tc_worker, 10);
+  suite_add_tcase (s, tc_worker);
+
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = engine_capture_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
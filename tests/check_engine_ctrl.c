@@ -0,0 +1,622 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/component.h>
+#include <vde3/connection.h>
+#include <vde3/context.h>
+#include <vde3/engine.h>
+#include <vde3/packet.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+#define MAX_CONNS 2
+#define OUT_SZ 8192
+
+// fixture event handler, events are dummies and the coalescing window of the
+// last subscription that opened one is kept to be closed by tests
+event_cb f_window_cb;
+void *f_window_arg;
+char f_window;
+
+static void *f_event_add(int fd, short events, const struct timeval *timeout,
+                         event_cb cb, void *arg)
+{
+  return (void *)0x1;
+}
+
+static void f_event_del(void *ev)
+{
+}
+
+static void *f_timeout_add(const struct timeval *timeout, short events,
+                           event_cb cb, void *arg)
+{
+  // windows are shorter than a second, hub stats are not
+  if (timeout->tv_sec > 0) {
+    return (void *)0x1;
+  }
+  f_window_cb = cb;
+  f_window_arg = arg;
+  return &f_window;
+}
+
+static void f_timeout_del(void *tout)
+{
+  if (tout == &f_window) {
+    f_window_cb = NULL;
+  }
+}
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_event_handler f_eh = {f_event_add, f_event_del, f_timeout_add,
+                          f_timeout_del};
+vde_component *f_ctrl;
+vde_component *f_hub;
+
+// what each ctrl connection wrote, messages are read from pos on
+typedef struct {
+  char buf[OUT_SZ];
+  size_t len;
+  size_t pos;
+  unsigned int writes;
+} out_buf;
+
+out_buf f_out[MAX_CONNS];
+vde_connection *f_conns[MAX_CONNS];
+
+static int be_write(vde_connection *conn, vde_pkt *pkt)
+{
+  out_buf *out = vde_connection_get_priv(conn);
+
+  fail_unless (out->len + pkt->hdr->pkt_len <= OUT_SZ, "output overflow");
+  memcpy(out->buf + out->len, pkt->payload, pkt->hdr->pkt_len);
+  out->len += pkt->hdr->pkt_len;
+  out->writes++;
+  return 0;
+}
+
+static void be_close(vde_connection *conn)
+{
+}
+
+void
+setup (void)
+{
+  char *mpath[] = {"src/.libs", NULL};
+  unsigned int i;
+
+  f_window_cb = NULL;
+  memset(f_out, 0, sizeof(f_out));
+  vde_context_new(&f_ctx);
+  fail_unless (vde_context_init(f_ctx, &f_eh, mpath) == 0,
+               "cannot init context %s", strerror(errno));
+  fail_unless (vde_context_new_component(f_ctx, VDE_ENGINE, "ctrl", "ctrl",
+                                         &f_ctrl, NULL) == 0,
+               "cannot create ctrl engine %s", strerror(errno));
+  fail_unless (vde_context_new_component(f_ctx, VDE_ENGINE, "hub", "hub",
+                                         &f_hub, NULL) == 0,
+               "cannot create hub %s", strerror(errno));
+
+  // the second connection chunks messages at 16 bytes
+  for (i = 0; i < MAX_CONNS; i++) {
+    fail_unless (vde_connection_new(&f_conns[i]) == 0,
+                 "cannot create connection");
+    fail_unless (vde_connection_init(f_conns[i], f_ctx, i ? 16 : 0, &be_write,
+                                     &be_close, &f_out[i]) == 0,
+                 "cannot init connection");
+    fail_unless (vde_engine_new_connection(f_ctrl, f_conns[i], NULL) == 0,
+                 "cannot attach connection %s", strerror(errno));
+  }
+}
+
+void
+teardown (void)
+{
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+}
+
+// feed len bytes of data to ctrl connection i in a single packet
+static void ctrl_send(unsigned int i, const char *data, size_t len)
+{
+  vde_pkt *pkt;
+
+  pkt = vde_pkt_new(f_ctx, len, 0, 0);
+  fail_unless (pkt != NULL, "cannot allocate packet");
+  memcpy(pkt->payload, data, len);
+  pkt->hdr->pkt_len = len;
+  vde_connection_call_read(f_conns[i], pkt);
+  vde_pkt_put(pkt);
+}
+
+// send a message, separator included
+static void ctrl_send_msg(unsigned int i, const char *msg)
+{
+  ctrl_send(i, msg, strlen(msg) + 1);
+}
+
+static int ctrl_pending(unsigned int i)
+{
+  return f_out[i].pos < f_out[i].len;
+}
+
+// the next message written to ctrl connection i, to be released
+static vde_sobj *ctrl_recv(unsigned int i)
+{
+  out_buf *out = &f_out[i];
+  char *msg = out->buf + out->pos;
+  char *sep;
+  vde_sobj *obj;
+
+  fail_unless (ctrl_pending(i), "no message on connection %u", i);
+  sep = memchr(msg, 0, out->len - out->pos);
+  fail_unless (sep != NULL, "message not terminated on connection %u", i);
+  obj = vde_sobj_from_string(msg);
+  fail_unless (obj != NULL, "cannot parse %s", msg);
+  out->pos += sep - msg + 1;
+  return obj;
+}
+
+// send a call and return its reply, the only message sent back
+static vde_sobj *ctrl_call(unsigned int i, const char *call)
+{
+  vde_sobj *reply;
+
+  ctrl_send_msg(i, call);
+  reply = ctrl_recv(i);
+  fail_unless (!ctrl_pending(i), "more than a reply to %s", call);
+  return reply;
+}
+
+// id is -1 when null
+static void check_id(vde_sobj *reply, int id)
+{
+  vde_sobj *id_obj = vde_sobj_hash_lookup(reply, "id");
+
+  if (id < 0) {
+    fail_unless (id_obj == NULL, "id not null in %s",
+                 vde_sobj_to_string(reply));
+  } else {
+    fail_unless (id_obj != NULL && vde_sobj_get_int(id_obj) == id,
+                 "id not %d in %s", id, vde_sobj_to_string(reply));
+  }
+}
+
+static void check_result(vde_sobj *reply, int id, const char *result)
+{
+  vde_sobj *result_obj = vde_sobj_hash_lookup(reply, "result");
+
+  check_id(reply, id);
+  fail_unless (vde_sobj_hash_lookup(reply, "error") == NULL,
+               "error in %s", vde_sobj_to_string(reply));
+  fail_unless (result_obj != NULL &&
+               strcmp(vde_sobj_get_string(result_obj), result) == 0,
+               "result not \"%s\" in %s", result, vde_sobj_to_string(reply));
+}
+
+static void check_error(vde_sobj *reply, int id, int code,
+                        const char *message)
+{
+  vde_sobj *error = vde_sobj_hash_lookup(reply, "error");
+  vde_sobj *code_obj, *message_obj;
+
+  check_id(reply, id);
+  fail_unless (vde_sobj_hash_lookup(reply, "result") == NULL,
+               "result in %s", vde_sobj_to_string(reply));
+  fail_unless (error != NULL, "no error in %s", vde_sobj_to_string(reply));
+  code_obj = vde_sobj_hash_lookup(error, "code");
+  message_obj = vde_sobj_hash_lookup(error, "message");
+  fail_unless (code_obj != NULL && vde_sobj_get_int(code_obj) == code,
+               "code not %d in %s", code, vde_sobj_to_string(reply));
+  fail_unless (message_obj != NULL &&
+               strcmp(vde_sobj_get_string(message_obj), message) == 0,
+               "message not \"%s\" in %s", message,
+               vde_sobj_to_string(reply));
+}
+
+static void call_result(unsigned int i, const char *call, int id,
+                        const char *result)
+{
+  vde_sobj *reply = ctrl_call(i, call);
+
+  check_result(reply, id, result);
+  vde_sobj_put(reply);
+}
+
+static void call_error(unsigned int i, const char *call, int id, int code,
+                       const char *message)
+{
+  vde_sobj *reply = ctrl_call(i, call);
+
+  check_error(reply, id, code, message);
+  vde_sobj_put(reply);
+}
+
+// a notice for signal path with the int info, count is 0 if absent
+static void check_notice(vde_sobj *notice, const char *path, int info,
+                         int count)
+{
+  vde_sobj *method = vde_sobj_hash_lookup(notice, "method");
+  vde_sobj *params = vde_sobj_hash_lookup(notice, "params");
+  vde_sobj *count_obj = vde_sobj_hash_lookup(notice, "count");
+
+  check_id(notice, -1);
+  fail_unless (method != NULL &&
+               strcmp(vde_sobj_get_string(method), path) == 0,
+               "method not %s in %s", path, vde_sobj_to_string(notice));
+  fail_unless (params != NULL && vde_sobj_array_length(params) == 1 &&
+               vde_sobj_get_int(vde_sobj_array_get_idx(params, 0)) == info,
+               "params not [%d] in %s", info, vde_sobj_to_string(notice));
+  if (count) {
+    fail_unless (count_obj != NULL && vde_sobj_get_int(count_obj) == count,
+                 "count not %d in %s", count, vde_sobj_to_string(notice));
+  } else {
+    fail_unless (count_obj == NULL, "count in %s",
+                 vde_sobj_to_string(notice));
+  }
+}
+
+static void recv_notice(unsigned int i, const char *path, int info,
+                        int count)
+{
+  vde_sobj *notice = ctrl_recv(i);
+
+  check_notice(notice, path, info, count);
+  vde_sobj_put(notice);
+  fail_unless (!ctrl_pending(i), "more than a notice on connection %u", i);
+}
+
+static void hub_raise(const char *signal, int info)
+{
+  vde_sobj *info_obj = vde_sobj_new_array();
+
+  vde_sobj_array_add(info_obj, vde_sobj_new_int(info));
+  vde_component_signal_raise(f_hub, signal, info_obj);
+  vde_sobj_put(info_obj);
+}
+
+V_START_TEST (test_call)
+{
+  call_result(0, "{\"method\":\"ctrl.trace_sample\",\"params\":[3],\"id\":1}",
+              1, "Sampling rate set");
+  fail_unless (f_ctx->trace_sample == 3, "sampling rate not set");
+  call_result(0, "{\"method\":\"ctrl.trace_sample\",\"params\":[0],\"id\":0}",
+              0, "Sampling rate set");
+  fail_unless (f_ctx->trace_sample == 0, "sampling rate not reset");
+  // commands of other components
+  call_result(0, "{\"method\":\"hub.storm_control\","
+                 "\"params\":[\"broadcast\",0,0],\"id\":2}",
+              2, "Storm control set");
+  fail_unless (f_out[1].len == 0, "reply on the other connection");
+}
+END_TEST
+
+V_START_TEST (test_invalid_call)
+{
+  const char *calls[] = {
+    "42",
+    "{\"method\":\"ctrl.trace_sample\",\"params\":[0]}",
+    "{\"method\":\"ctrl.trace_sample\",\"params\":[0],\"id\":-1}",
+    "{\"method\":\"ctrl.trace_sample\",\"params\":[0],\"id\":\"1\"}",
+    "{\"method\":\"ctrl.trace_sample\",\"params\":0,\"id\":1}",
+    "{\"params\":[0],\"id\":1}",
+    "{\"method\":7,\"params\":[0],\"id\":1}",
+    NULL
+  };
+  unsigned int i;
+
+  for (i = 0; calls[i] != NULL; i++) {
+    call_error(0, calls[i], -1, EINVAL, "Invalid method call received");
+  }
+}
+END_TEST
+
+V_START_TEST (test_method_errors)
+{
+  call_error(0, "{\"method\":\"trace_sample\",\"params\":[0],\"id\":1}",
+             1, EINVAL, "Method name not well-formed");
+  call_error(0, "{\"method\":\".trace_sample\",\"params\":[0],\"id\":2}",
+             2, EINVAL, "Method name not well-formed");
+  call_error(0, "{\"method\":\"ctrl.\",\"params\":[0],\"id\":3}",
+             3, EINVAL, "Method name not well-formed");
+  call_error(0, "{\"method\":\"nohub.status\",\"params\":[],\"id\":4}",
+             4, ENOENT, "Component not found");
+  call_error(0, "{\"method\":\"ctrl.nocommand\",\"params\":[],\"id\":5}",
+             5, ENOENT, "Command not found");
+  // command failures carry errno and the message of the command
+  call_error(0, "{\"method\":\"ctrl.trace_sample\",\"params\":[-1],\"id\":6}",
+             6, EINVAL, "Sampling rate must not be negative");
+  call_error(0, "{\"method\":\"ctrl.trace_sample\",\"params\":[],\"id\":7}",
+             7, EINVAL, "Expected 1 params");
+  call_error(0, "{\"method\":\"ctrl.config_load\","
+                "\"params\":[\"/nonexistent/vde.conf\"],\"id\":8}",
+             8, ENOENT, strerror(ENOENT));
+  call_error(0, "{\"method\":\"ctrl.config_save\","
+                "\"params\":[\"/nonexistent/vde.conf\"],\"id\":9}",
+             9, ENOENT, strerror(ENOENT));
+}
+END_TEST
+
+V_START_TEST (test_config_save)
+{
+  char dir[] = "/tmp/check_ctrl.XXXXXX";
+  char path[64], call[128];
+
+  fail_unless (mkdtemp(dir) != NULL, "cannot create directory");
+  snprintf(path, sizeof(path), "%s/vde.conf", dir);
+  snprintf(call, sizeof(call), "{\"method\":\"ctrl.config_save\","
+                               "\"params\":[\"%s\"],\"id\":1}", path);
+  call_result(0, call, 1, "Configuration saved");
+  fail_unless (access(path, R_OK) == 0, "configuration not written");
+  unlink(path);
+  rmdir(dir);
+}
+END_TEST
+
+V_START_TEST (test_stream)
+{
+  const char call[] =
+    "{\"method\":\"ctrl.trace_sample\",\"params\":[1],\"id\":1}";
+  char two[2 * sizeof(call)];
+  vde_sobj *reply;
+  unsigned int i;
+
+  // garbage is replied to once, up to its separator
+  call_error(0, "{oops, not json", -1, EINVAL, "Cannot deserialize command");
+  // a message split over packets is run once its object is complete
+  for (i = 0; i < sizeof(call) - 2; i++) {
+    ctrl_send(0, call + i, 1);
+    fail_unless (!ctrl_pending(0), "reply to a partial message");
+  }
+  ctrl_send(0, call + i, 1);
+  reply = ctrl_recv(0);
+  check_result(reply, 1, "Sampling rate set");
+  vde_sobj_put(reply);
+  ctrl_send(0, "", 1);
+  fail_unless (!ctrl_pending(0), "more than a reply");
+
+  // two messages in a packet are replied to in order by a single write
+  memcpy(two, call, sizeof(call));
+  memcpy(two + sizeof(call), call, sizeof(call));
+  two[sizeof(two) - 3] = '2';
+  f_out[0].writes = 0;
+  ctrl_send(0, two, sizeof(two));
+  fail_unless (f_out[0].writes == 1, "%u writes for two replies",
+               f_out[0].writes);
+  reply = ctrl_recv(0);
+  check_result(reply, 1, "Sampling rate set");
+  vde_sobj_put(reply);
+  reply = ctrl_recv(0);
+  check_result(reply, 2, "Sampling rate set");
+  vde_sobj_put(reply);
+  fail_unless (!ctrl_pending(0), "more than two replies");
+
+  // anything after the first object of a message is discarded
+  call_result(0, "{\"method\":\"ctrl.trace_sample\",\"params\":[1],\"id\":3}"
+                 " {\"method\":\"ctrl.nocommand\",\"params\":[],\"id\":4}",
+              3, "Sampling rate set");
+  // so is garbage after a message error
+  call_error(0, "][{\"method\":\"ctrl.trace_sample\",\"params\":[1],\"id\":5}",
+             -1, EINVAL, "Cannot deserialize command");
+}
+END_TEST
+
+V_START_TEST (test_batch)
+{
+  vde_sobj *replies, *reply;
+
+  replies = ctrl_call(0, "["
+    "{\"method\":\"ctrl.trace_sample\",\"params\":[2],\"id\":1},"
+    "{\"method\":\"ctrl.trace_sample\",\"params\":[2]},"
+    "{\"method\":\"nohub.status\",\"params\":[],\"id\":3},"
+    "{\"method\":\"ctrl.trace_sample\",\"params\":[-1],\"id\":4},"
+    "{\"method\":\"ctrl.trace_sample\",\"params\":[5],\"id\":5}"
+    "]");
+  fail_unless (vde_sobj_is_type(replies, vde_sobj_type_array) &&
+               vde_sobj_array_length(replies) == 5,
+               "not 5 replies in %s", vde_sobj_to_string(replies));
+  check_result(vde_sobj_array_get_idx(replies, 0), 1, "Sampling rate set");
+  reply = vde_sobj_array_get_idx(replies, 1);
+  check_error(reply, -1, EINVAL, "Invalid method call received");
+  reply = vde_sobj_array_get_idx(replies, 2);
+  check_error(reply, 3, ENOENT, "Component not found");
+  reply = vde_sobj_array_get_idx(replies, 3);
+  check_error(reply, 4, EINVAL, "Sampling rate must not be negative");
+  check_result(vde_sobj_array_get_idx(replies, 4), 5, "Sampling rate set");
+  vde_sobj_put(replies);
+  // calls are run in order
+  fail_unless (f_ctx->trace_sample == 5, "sampling rate not set last");
+
+  call_error(0, "[]", -1, EINVAL, "Empty batch received");
+}
+END_TEST
+
+V_START_TEST (test_chunks)
+{
+  vde_sobj *reply;
+
+  // the reply is split at the connection payload size
+  reply = ctrl_call(1, "{\"method\":\"ctrl.trace_sample\",\"params\":[-1],"
+                       "\"id\":1}");
+  check_error(reply, 1, EINVAL, "Sampling rate must not be negative");
+  vde_sobj_put(reply);
+  fail_unless (f_out[1].writes == (f_out[1].len + 15) / 16,
+               "%u writes for %u bytes", f_out[1].writes, f_out[1].len);
+  fail_unless (f_out[0].len == 0, "reply on the other connection");
+}
+END_TEST
+
+V_START_TEST (test_notify)
+{
+  call_result(0, "{\"method\":\"ctrl.notify_add\","
+                 "\"params\":[\"hub.port_new\"],\"id\":1}",
+              1, "Signal attached");
+  call_error(0, "{\"method\":\"ctrl.notify_add\","
+                "\"params\":[\"hub.port_new\"],\"id\":2}",
+             2, EEXIST, "Failed to attach to signal");
+  call_error(0, "{\"method\":\"ctrl.notify_add\","
+                "\"params\":[\"hubport_new\"],\"id\":3}",
+             3, EINVAL, "Signal path not well-formed");
+  call_error(0, "{\"method\":\"ctrl.notify_add\","
+                "\"params\":[\"nohub.port_new\"],\"id\":4}",
+             4, ENOENT, "Component not found");
+  call_error(0, "{\"method\":\"ctrl.notify_add\","
+                "\"params\":[\"hub.nosignal\"],\"id\":5}",
+             5, ENOENT, "Failed to attach to signal");
+  call_result(1, "{\"method\":\"ctrl.notify_add\","
+                 "\"params\":[\"hub.port_new\"],\"id\":6}",
+              6, "Signal attached");
+
+  // both subscribers get the notice, whatever their payload size
+  hub_raise("port_new", 7);
+  recv_notice(0, "hub.port_new", 7, 0);
+  recv_notice(1, "hub.port_new", 7, 0);
+  hub_raise("port_del", 7);
+  fail_unless (!ctrl_pending(0) && !ctrl_pending(1),
+               "notice of a signal not subscribed");
+
+  call_result(0, "{\"method\":\"ctrl.notify_del\","
+                 "\"params\":[\"hub.port_new\"],\"id\":7}",
+              7, "Signal detached");
+  call_error(0, "{\"method\":\"ctrl.notify_del\","
+                "\"params\":[\"hub.port_new\"],\"id\":8}",
+             8, ENOENT, "Signal not registered in connection");
+  call_error(0, "{\"method\":\"ctrl.notify_del\","
+                "\"params\":[\"hub.port_del\"],\"id\":9}",
+             9, ENOENT, "Signal not registered in connection");
+  hub_raise("port_new", 8);
+  fail_unless (!ctrl_pending(0), "notice after detaching");
+  recv_notice(1, "hub.port_new", 8, 0);
+
+  // the hub going away drops the subscription, the engine stays usable
+  fail_unless (vde_context_component_del(f_ctx, f_hub) == 0,
+               "cannot delete hub %s", strerror(errno));
+  call_error(1, "{\"method\":\"ctrl.notify_del\","
+                "\"params\":[\"hub.port_new\"],\"id\":10}",
+             10, ENOENT, "Signal not registered in connection");
+  call_error(1, "{\"method\":\"ctrl.notify_add\","
+                "\"params\":[\"hub.port_new\"],\"id\":11}",
+             11, ENOENT, "Component not found");
+}
+END_TEST
+
+V_START_TEST (test_coalesce)
+{
+  call_error(0, "{\"method\":\"ctrl.notify_coalesce\","
+                "\"params\":[\"hub.port_new\",100],\"id\":1}",
+             1, ENOENT, "Signal not registered in connection");
+  call_result(0, "{\"method\":\"ctrl.notify_add\","
+                 "\"params\":[\"hub.port_new\"],\"id\":2}",
+              2, "Signal attached");
+  call_error(0, "{\"method\":\"ctrl.notify_coalesce\","
+                "\"params\":[\"hub.port_new\",-1],\"id\":3}",
+             3, EINVAL, "Coalescing window must not be negative");
+  call_result(0, "{\"method\":\"ctrl.notify_coalesce\","
+                 "\"params\":[\"hub.port_new\",100],\"id\":4}",
+              4, "Coalescing window set");
+
+  // the first raise is sent at once and opens a window
+  hub_raise("port_new", 1);
+  recv_notice(0, "hub.port_new", 1, 0);
+  fail_unless (f_window_cb != NULL, "no window opened");
+
+  // the following ones are held, the last is sent when the window ends
+  hub_raise("port_new", 2);
+  hub_raise("port_new", 3);
+  hub_raise("port_new", 4);
+  fail_unless (!ctrl_pending(0), "notice within the window");
+  f_window_cb(-1, VDE_EV_TIMEOUT, f_window_arg);
+  recv_notice(0, "hub.port_new", 4, 3);
+  fail_unless (f_window_cb != NULL, "window not reopened");
+
+  // a window without raises ends the burst
+  f_window_cb(-1, VDE_EV_TIMEOUT, f_window_arg);
+  fail_unless (!ctrl_pending(0), "notice of an empty window");
+  fail_unless (f_window_cb == NULL, "window still open");
+  hub_raise("port_new", 5);
+  recv_notice(0, "hub.port_new", 5, 0);
+
+  // with coalescing disabled the open window is the last one
+  call_result(0, "{\"method\":\"ctrl.notify_coalesce\","
+                 "\"params\":[\"hub.port_new\",0],\"id\":5}",
+              5, "Coalescing window set");
+  hub_raise("port_new", 6);
+  f_window_cb(-1, VDE_EV_TIMEOUT, f_window_arg);
+  recv_notice(0, "hub.port_new", 6, 0);
+  fail_unless (f_window_cb == NULL, "window reopened");
+  hub_raise("port_new", 7);
+  recv_notice(0, "hub.port_new", 7, 0);
+
+  // an open window is closed along with the subscription
+  call_result(0, "{\"method\":\"ctrl.notify_coalesce\","
+                 "\"params\":[\"hub.port_new\",100],\"id\":6}",
+              6, "Coalescing window set");
+  hub_raise("port_new", 8);
+  recv_notice(0, "hub.port_new", 8, 0);
+  hub_raise("port_new", 9);
+  call_result(0, "{\"method\":\"ctrl.notify_del\","
+                 "\"params\":[\"hub.port_new\"],\"id\":7}",
+              7, "Signal detached");
+  fail_unless (f_window_cb == NULL, "window left open");
+}
+END_TEST
+
+Suite *
+engine_ctrl_suite (void)
+{
+  Suite *s = suite_create ("engine_ctrl");
+
+  /* Method call test case */
+  TCase *tc_call = tcase_create ("Call");
+  tcase_add_checked_fixture (tc_call, setup, teardown);
+  tcase_add_test (tc_call, test_call);
+  tcase_add_test (tc_call, test_invalid_call);
+  tcase_add_test (tc_call, test_method_errors);
+  tcase_add_test (tc_call, test_config_save);
+  suite_add_tcase (s, tc_call);
+
+  /* Message framing test case */
+  TCase *tc_stream = tcase_create ("Stream");
+  tcase_add_checked_fixture (tc_stream, setup, teardown);
+  tcase_add_test (tc_stream, test_stream);
+  tcase_add_test (tc_stream, test_batch);
+  tcase_add_test (tc_stream, test_chunks);
+  suite_add_tcase (s, tc_stream);
+
+  /* Signal notices test case */
+  TCase *tc_notify = tcase_create ("Notify");
+  tcase_add_checked_fixture (tc_notify, setup, teardown);
+  tcase_add_test (tc_notify, test_notify);
+  tcase_add_test (tc_notify, test_coalesce);
+  suite_add_tcase (s, tc_notify);
+
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = engine_ctrl_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,588 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/command.h>
+#include <vde3/component.h>
+#include <vde3/connection.h>
+#include <vde3/engine.h>
+#include <vde3/packet.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+// seconds between two aging passes of the switch
+#define AGING_TICK 5
+#define FRAME_LEN 60
+#define MAX_PORTS 8
+
+// fixture event handler, events are dummies and the aging timeout of the last
+// switch created is kept to be run by tests
+event_cb f_aging_cb;
+void *f_aging_arg;
+
+static void *f_event_add(int fd, short events, const struct timeval *timeout,
+                         event_cb cb, void *arg)
+{
+  return (void *)0x1;
+}
+
+static void f_event_del(void *ev)
+{
+}
+
+static void *f_timeout_add(const struct timeval *timeout, short events,
+                           event_cb cb, void *arg)
+{
+  if (timeout->tv_sec == AGING_TICK) {
+    f_aging_cb = cb;
+    f_aging_arg = arg;
+  }
+  return (void *)0x1;
+}
+
+static void f_timeout_del(void *tout)
+{
+}
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_event_handler f_eh = {f_event_add, f_event_del, f_timeout_add,
+                          f_timeout_del};
+// frames written to each port, ports are numbered as they are created, with
+// the length and the vlan tag (0 if untagged) of the last one
+unsigned int f_tx[MAX_PORTS];
+unsigned int f_len[MAX_PORTS];
+unsigned int f_tag[MAX_PORTS];
+vde_connection *f_ports[MAX_PORTS];
+unsigned int f_nports;
+
+static int be_write(vde_connection *conn, vde_pkt *pkt)
+{
+  unsigned int *tx = vde_connection_get_priv(conn);
+  unsigned char *frame = (unsigned char *)pkt->payload;
+
+  (*tx)++;
+  f_len[tx - f_tx] = pkt->hdr->pkt_len;
+  f_tag[tx - f_tx] = frame[12] == 0x81 && frame[13] == 0x00 ?
+                     ((frame[14] & 0x0f) << 8) | frame[15] : 0;
+  return 0;
+}
+
+static void be_close(vde_connection *conn)
+{
+}
+
+void
+setup (void)
+{
+  char *mpath[] = {"src/.libs", NULL};
+
+  f_aging_cb = NULL;
+  f_nports = 0;
+  memset(f_tx, 0, sizeof(f_tx));
+  vde_context_new(&f_ctx);
+  fail_unless (vde_context_init(f_ctx, &f_eh, mpath) == 0,
+               "cannot init context %s", strerror(errno));
+}
+
+void
+teardown (void)
+{
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+}
+
+static vde_component *switch_new(const char *name, const char *params)
+{
+  vde_component *sw;
+
+  fail_unless (vde_context_new_component(f_ctx, VDE_ENGINE, "switch", name,
+                                         &sw, vde_sobj_from_string(params))
+               == 0, "cannot create switch %s", strerror(errno));
+  fail_unless (f_aging_cb != NULL, "no aging timeout");
+  return sw;
+}
+
+// a port of sw, its connection handed over as id by the transport scope
+static unsigned int port_new(vde_component *sw, const char *scope,
+                             uint32_t id)
+{
+  vde_connection *conn;
+  unsigned int port = f_nports++;
+
+  fail_unless (port < MAX_PORTS, "too many ports");
+  fail_unless (vde_connection_new(&conn) == 0, "cannot create connection");
+  fail_unless (vde_connection_init(conn, f_ctx, 0, &be_write, &be_close,
+                                   &f_tx[port]) == 0,
+               "cannot init connection");
+  vde_connection_set_handoff_id(conn, vde_quark_from_string(scope), id);
+  fail_unless (vde_engine_new_connection(sw, conn, NULL) == 0,
+               "cannot attach port %s", strerror(errno));
+  f_ports[port] = conn;
+  return port;
+}
+
+// a frame from the address ending in src to the one ending in dst, 0xff for
+// broadcast, tagged if vlan is not 0, with room for a tag before it
+static vde_pkt *frame_new(unsigned char dst, unsigned char src,
+                          unsigned int vlan)
+{
+  vde_pkt *pkt;
+  unsigned char *frame;
+  unsigned int len = FRAME_LEN + (vlan ? 4 : 0);
+
+  pkt = vde_pkt_new(f_ctx, len, 4, 0);
+  fail_unless (pkt != NULL, "cannot allocate packet");
+  pkt->hdr->pkt_len = len;
+  frame = (unsigned char *)pkt->payload;
+  memset(frame, 0, len);
+  memset(frame, dst == 0xff ? 0xff : 0, 6);
+  frame[0] = dst == 0xff ? 0xff : 0x02;
+  frame[5] = dst;
+  frame[6] = 0x02;
+  frame[11] = src;
+  if (vlan) {
+    frame[12] = 0x81;
+    frame[14] = vlan >> 8;
+    frame[15] = vlan & 0xff;
+    frame[16] = 0x08;
+  } else {
+    frame[12] = 0x08;
+  }
+  return pkt;
+}
+
+static void frame_send(unsigned int port, unsigned char dst, unsigned char src,
+                       unsigned int vlan)
+{
+  vde_pkt *pkt = frame_new(dst, src, vlan);
+
+  vde_connection_call_read(f_ports[port], pkt);
+  vde_pkt_put(pkt);
+}
+
+// run a command of the switch taking the arguments in, which is released
+static int switch_command(vde_component *sw, const char *name, vde_sobj *in,
+                          vde_sobj **out)
+{
+  vde_command *command = vde_component_command_get(sw, name);
+  int rv;
+
+  fail_unless (command != NULL, "no %s command", name);
+  *out = NULL;
+  rv = vde_command_get_func(command)(sw, in, out);
+  vde_sobj_put(in);
+  return rv;
+}
+
+// the saved state of sw, serialized
+static char *state_save(vde_component *sw)
+{
+  vde_sobj *out;
+  char *state;
+
+  fail_unless (switch_command(sw, "state_save", vde_sobj_new_array(), &out)
+               == 0, "cannot save state");
+  state = strdup(vde_sobj_to_string(out));
+  vde_sobj_put(out);
+  return state;
+}
+
+static int state_load(vde_component *sw, const char *state)
+{
+  vde_sobj *in, *out;
+  int rv;
+
+  in = vde_sobj_new_array();
+  vde_sobj_array_add(in, vde_sobj_new_string(state));
+  rv = switch_command(sw, "state_load", in, &out);
+  vde_sobj_put(out);
+  return rv;
+}
+
+static int vlan_access(vde_component *sw, int port, int vlan)
+{
+  vde_sobj *in, *out;
+  int rv;
+
+  in = vde_sobj_new_array();
+  vde_sobj_array_add(in, vde_sobj_new_int(port));
+  vde_sobj_array_add(in, vde_sobj_new_int(vlan));
+  rv = switch_command(sw, "vlan_access", in, &out);
+  vde_sobj_put(out);
+  return rv;
+}
+
+static void vlan_trunk(vde_component *sw, unsigned int port, int native,
+                       const char *vlans)
+{
+  vde_sobj *in, *out;
+
+  in = vde_sobj_new_array();
+  vde_sobj_array_add(in, vde_sobj_new_int(port));
+  vde_sobj_array_add(in, vde_sobj_new_int(native));
+  vde_sobj_array_add(in, vde_sobj_new_string(vlans));
+  fail_unless (switch_command(sw, "vlan_trunk", in, &out) == 0,
+               "cannot make port %u a trunk", port);
+  vde_sobj_put(out);
+}
+
+// number of entries in a saved state
+static int state_entries(const char *state)
+{
+  vde_sobj *obj;
+  int count;
+
+  obj = vde_sobj_from_string(state);
+  fail_unless (obj != NULL, "invalid state %s", state);
+  count = vde_sobj_array_length(vde_sobj_hash_lookup(obj, "entries"));
+  vde_sobj_put(obj);
+  return count;
+}
+
+static const char f_empty_state[] =
+  "{ \"version\": 2, \"entries\": [ ], \"ports\": [ ] }";
+
+// a vlan aware switch with a trunk and an access port, both with an address
+// learned, and its state
+static char *state_fixture(void)
+{
+  vde_component *sw;
+
+  sw = switch_new("sw", "{'vlan_aware': true, 'stats_interval': 0}");
+  port_new(sw, "tr", 1);
+  port_new(sw, "tr", 2);
+  vlan_trunk(sw, 0, 0, "10,20-29");
+  frame_send(0, 0xff, 1, 10);
+  frame_send(1, 0xff, 2, 0);
+  return state_save(sw);
+}
+
+V_START_TEST (test_state_round_trip)
+{
+  vde_component *sw2;
+  char *state, *restored;
+
+  state = state_fixture();
+  sw2 = switch_new("sw2", "{'vlan_aware': true, 'stats_interval': 0}");
+  fail_unless (state_load(sw2, state) == 0, "cannot load state");
+  port_new(sw2, "tr", 1);
+  port_new(sw2, "tr", 2);
+  restored = state_save(sw2);
+  fail_unless (strcmp(state, restored) == 0, "state not restored: %s, %s",
+               state, restored);
+
+  // frames to the addresses restored are not flooded to the other trunks
+  port_new(sw2, "tr", 3);
+  port_new(sw2, "tr", 4);
+  vlan_trunk(sw2, 2, 0, "10");
+  vlan_trunk(sw2, 3, 0, "10");
+  memset(f_tx, 0, sizeof(f_tx));
+  frame_send(4, 1, 3, 10);
+  fail_unless (f_tx[2] == 1 && f_tx[5] == 0, "frame flooded");
+  free(state);
+  free(restored);
+}
+END_TEST
+
+V_START_TEST (test_state_scope)
+{
+  vde_component *sw2;
+  char *state, *restored;
+
+  state = state_fixture();
+  sw2 = switch_new("sw2", "{'vlan_aware': true, 'stats_interval': 0}");
+  fail_unless (state_load(sw2, state) == 0, "cannot load state");
+  // same ids, handed over by another transport
+  port_new(sw2, "other", 1);
+  port_new(sw2, "other", 2);
+  restored = state_save(sw2);
+  fail_unless (state_entries(restored) == 0,
+               "entries restored on the wrong ports: %s", restored);
+  fail_unless (strstr(restored, "\"10,20-29\"") == NULL,
+               "vlans restored on the wrong port: %s", restored);
+  free(state);
+  free(restored);
+}
+END_TEST
+
+V_START_TEST (test_state_aging)
+{
+  vde_component *sw2;
+  char *state, *restored;
+
+  state = state_fixture();
+  sw2 = switch_new("sw2", "{'vlan_aware': true, 'stats_interval': 0}");
+  fail_unless (state_load(sw2, state) == 0, "cannot load state");
+  // ports back within a tick still get their state
+  f_aging_cb(-1, 0, f_aging_arg);
+  port_new(sw2, "tr", 1);
+  restored = state_save(sw2);
+  fail_unless (strstr(restored, "\"10,20-29\"") != NULL &&
+               state_entries(restored) == 1,
+               "state dropped too early: %s", restored);
+  free(restored);
+
+  // what is left is gone after the second one
+  f_aging_cb(-1, 0, f_aging_arg);
+  port_new(sw2, "tr", 2);
+  restored = state_save(sw2);
+  fail_unless (state_entries(restored) == 1,
+               "leftover state not dropped: %s", restored);
+  free(state);
+  free(restored);
+}
+END_TEST
+
+V_START_TEST (test_state_invalid)
+{
+  vde_component *sw;
+
+  sw = switch_new("sw", "{'stats_interval': 0}");
+  fail_unless (state_load(sw, "[ ]") == -1 && errno == EINVAL,
+               "array loaded");
+  // version 1 had no transport names
+  fail_unless (state_load(sw, "{ \"version\": 1, \"entries\": "
+                              "[ [ 1, 2199023255553 ] ], \"ports\": [ ] }")
+               == -1 && errno == EINVAL, "version 1 loaded");
+  fail_unless (state_load(sw, "{ \"version\": 2, \"entries\": "
+                              "[ [ \"tr\", 0, 2199023255553 ] ], "
+                              "\"ports\": [ ] }") == -1 && errno == EINVAL,
+               "id 0 loaded");
+  fail_unless (state_load(sw, f_empty_state) == 0, "empty state not loaded");
+}
+END_TEST
+
+// a vlan aware switch with ports of vlan 10: an access port, a trunk and a
+// trunk where it is native, plus an access port of vlan 1
+static vde_component *vlan_fixture(void)
+{
+  vde_component *sw;
+
+  sw = switch_new("sw", "{'vlan_aware': true, 'stats_interval': 0}");
+  port_new(sw, "tr", 1);
+  port_new(sw, "tr", 2);
+  port_new(sw, "tr", 3);
+  port_new(sw, "tr", 4);
+  fail_unless (vlan_access(sw, 0, 10) == 0, "cannot set port 0 vlan");
+  vlan_trunk(sw, 1, 0, "10");
+  vlan_trunk(sw, 2, 10, "20");
+  return sw;
+}
+
+V_START_TEST (test_vlan_ingress)
+{
+  vlan_fixture();
+
+  // tagged frames are not accepted by access ports
+  frame_send(0, 0xff, 1, 10);
+  frame_send(3, 0xff, 1, 1);
+  // nor by trunks of other vlans
+  frame_send(1, 0xff, 2, 20);
+  fail_unless (f_tx[0] + f_tx[1] + f_tx[2] + f_tx[3] == 0,
+               "frame accepted: %u %u %u %u", f_tx[0], f_tx[1], f_tx[2],
+               f_tx[3]);
+
+  // untagged frames of a trunk belong to its native vlan, if any
+  frame_send(1, 0xff, 2, 0);
+  fail_unless (f_tx[0] + f_tx[2] + f_tx[3] == 0, "untagged frame accepted");
+  frame_send(2, 0xff, 3, 0);
+  fail_unless (f_tx[0] == 1 && f_tx[1] == 1 && f_tx[3] == 0,
+               "native frame not flooded to vlan 10");
+  frame_send(1, 0xff, 2, 10);
+  fail_unless (f_tx[0] == 2 && f_tx[2] == 1 && f_tx[3] == 0,
+               "tagged frame not flooded to vlan 10");
+}
+END_TEST
+
+V_START_TEST (test_vlan_tagging)
+{
+  vlan_fixture();
+
+  // tags are pushed towards trunks and popped towards the others
+  frame_send(0, 0xff, 1, 0);
+  fail_unless (f_tag[1] == 10 && f_len[1] == FRAME_LEN + 4,
+               "frame to trunk not tagged: vlan %u len %u", f_tag[1],
+               f_len[1]);
+  fail_unless (f_tag[2] == 0 && f_len[2] == FRAME_LEN,
+               "frame to native vlan tagged: vlan %u len %u", f_tag[2],
+               f_len[2]);
+  frame_send(1, 0xff, 2, 10);
+  fail_unless (f_tag[0] == 0 && f_len[0] == FRAME_LEN,
+               "frame to access port tagged: vlan %u len %u", f_tag[0],
+               f_len[0]);
+  fail_unless (f_tag[2] == 0 && f_len[2] == FRAME_LEN,
+               "frame to native vlan tagged: vlan %u len %u", f_tag[2],
+               f_len[2]);
+
+  // the same for frames to learned addresses
+  memset(f_tx, 0, sizeof(f_tx));
+  frame_send(1, 1, 2, 10);
+  fail_unless (f_tx[0] == 1 && f_tx[2] == 0 && f_tag[0] == 0 &&
+               f_len[0] == FRAME_LEN, "frame to access port not untagged");
+  frame_send(0, 2, 1, 0);
+  fail_unless (f_tx[1] == 1 && f_tx[2] == 0 && f_tag[1] == 10 &&
+               f_len[1] == FRAME_LEN + 4, "frame to trunk not tagged");
+}
+END_TEST
+
+V_START_TEST (test_vlan_flood)
+{
+  vde_component *sw;
+
+  sw = vlan_fixture();
+  port_new(sw, "tr", 5);
+  port_new(sw, "tr", 6);
+  fail_unless (vlan_access(sw, 4, 20) == 0, "cannot set port 4 vlan");
+  vlan_trunk(sw, 5, 1, "10,20");
+
+  // floods reach the members of the vlan of the frame only
+  frame_send(3, 0xff, 1, 0);
+  fail_unless (f_tx[0] + f_tx[1] + f_tx[2] + f_tx[4] == 0 && f_tx[5] == 1 &&
+               f_tag[5] == 0, "vlan 1 flood");
+  frame_send(4, 0xff, 2, 0);
+  fail_unless (f_tx[0] + f_tx[1] + f_tx[3] == 0 && f_tx[2] == 1 &&
+               f_tag[2] == 20 && f_tx[5] == 2 && f_tag[5] == 20,
+               "vlan 20 flood");
+  frame_send(0, 0xff, 3, 0);
+  fail_unless (f_tx[0] + f_tx[3] + f_tx[4] == 0 && f_tx[1] == 1 &&
+               f_tx[2] == 2 && f_tx[5] == 3 && f_tag[5] == 10,
+               "vlan 10 flood");
+
+  // a port leaving a vlan leaves its flood
+  fail_unless (vlan_access(sw, 5, 1) == 0, "cannot set port 5 vlan");
+  frame_send(0, 0xff, 3, 0);
+  fail_unless (f_tx[1] == 2 && f_tx[2] == 3 && f_tx[5] == 3,
+               "port 5 still in vlan 10");
+}
+END_TEST
+
+V_START_TEST (test_vlan_unshared)
+{
+  vde_pkt *pkt;
+  unsigned char frame[FRAME_LEN];
+
+  vlan_fixture();
+
+  // a packet read by the switch is not retagged in place, even if the switch
+  // holds the only other reference on it
+  pkt = frame_new(0xff, 1, 0);
+  memcpy(frame, pkt->payload, FRAME_LEN);
+  vde_connection_call_read(f_ports[0], pkt);
+  fail_unless (f_tx[1] == 1 && f_tag[1] == 10, "frame not tagged");
+  fail_unless (pkt->hdr->pkt_len == FRAME_LEN &&
+               memcmp(pkt->payload, frame, FRAME_LEN) == 0,
+               "flooded frame mangled");
+
+  // to a learned address
+  frame_send(1, 0xff, 2, 10);
+  memset(pkt->payload, 0, 6);
+  pkt->payload[0] = 0x02;
+  pkt->payload[5] = 2;
+  memcpy(frame, pkt->payload, FRAME_LEN);
+  vde_connection_call_read(f_ports[0], pkt);
+  fail_unless (f_tx[1] == 2 && f_tag[1] == 10, "frame not tagged");
+  fail_unless (pkt->hdr->pkt_len == FRAME_LEN &&
+               memcmp(pkt->payload, frame, FRAME_LEN) == 0,
+               "forwarded frame mangled");
+  vde_pkt_put(pkt);
+}
+END_TEST
+
+V_START_TEST (test_vlan_commands)
+{
+  vde_component *sw;
+  vde_sobj *in, *out;
+
+  sw = switch_new("sw0", "{'stats_interval': 0}");
+  port_new(sw, "tr", 1);
+  fail_unless (vlan_access(sw, 0, 10) == -1 && errno == ENOTSUP,
+               "vlans set on a switch not vlan aware");
+
+  sw = vlan_fixture();
+  fail_unless (vlan_access(sw, 4, 10) == -1 && errno == ENOENT,
+               "missing port set");
+  fail_unless (vlan_access(sw, 0, 0) == -1 && errno == EINVAL,
+               "vlan 0 set");
+  fail_unless (vlan_access(sw, 0, 4095) == -1 && errno == EINVAL,
+               "vlan 4095 set");
+
+  in = vde_sobj_new_array();
+  vde_sobj_array_add(in, vde_sobj_new_int(1));
+  vde_sobj_array_add(in, vde_sobj_new_int(0));
+  vde_sobj_array_add(in, vde_sobj_new_string("29-20"));
+  fail_unless (switch_command(sw, "vlan_trunk", in, &out) == -1 &&
+               errno == EINVAL, "reversed range set");
+  vde_sobj_put(out);
+  in = vde_sobj_new_array();
+  vde_sobj_array_add(in, vde_sobj_new_int(1));
+  vde_sobj_array_add(in, vde_sobj_new_int(0));
+  vde_sobj_array_add(in, vde_sobj_new_string("10,,20"));
+  fail_unless (switch_command(sw, "vlan_trunk", in, &out) == -1 &&
+               errno == EINVAL, "empty item set");
+  vde_sobj_put(out);
+
+  // the members of each vlan
+  fail_unless (switch_command(sw, "vlan_print", vde_sobj_new_array(), &out)
+               == 0, "cannot print vlans");
+  fail_unless (strcmp(vde_sobj_to_string(out),
+                      "[ { \"vlan\": 1, \"untagged\": [ 3 ], "
+                      "\"tagged\": [ ] }, { \"vlan\": 10, \"untagged\": "
+                      "[ 0, 2 ], \"tagged\": [ 1 ] }, { \"vlan\": 20, "
+                      "\"untagged\": [ ], \"tagged\": [ 2 ] } ]") == 0,
+               "wrong vlans: %s", vde_sobj_to_string(out));
+  vde_sobj_put(out);
+}
+END_TEST
+
+Suite *
+engine_switch_suite (void)
+{
+  Suite *s = suite_create ("engine_switch");
+
+  /* Hot restart state test case */
+  TCase *tc_state = tcase_create ("State");
+  tcase_add_checked_fixture (tc_state, setup, teardown);
+  tcase_add_test (tc_state, test_state_round_trip);
+  tcase_add_test (tc_state, test_state_scope);
+  tcase_add_test (tc_state, test_state_aging);
+  tcase_add_test (tc_state, test_state_invalid);
+  suite_add_tcase (s, tc_state);
+
+  /* 802.1Q test case */
+  TCase *tc_vlan = tcase_create ("Vlan");
+  tcase_add_checked_fixture (tc_vlan, setup, teardown);
+  tcase_add_test (tc_vlan, test_vlan_ingress);
+  tcase_add_test (tc_vlan, test_vlan_tagging);
+  tcase_add_test (tc_vlan, test_vlan_flood);
+  tcase_add_test (tc_vlan, test_vlan_unshared);
+  tcase_add_test (tc_vlan, test_vlan_commands);
+  suite_add_tcase (s, tc_vlan);
+
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = engine_switch_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
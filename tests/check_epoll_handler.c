@@ -0,0 +1,284 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <check.h>
+#include <vde3.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+extern vde_event_handler epoll_eh;
+extern vde_event_loop epoll_loop;
+
+static void *loop;
+static int fired;
+static short fired_events;
+static void *event;
+
+static void setup(void)
+{
+  loop = epoll_loop.loop_new();
+  fail_unless (loop != NULL, "cannot create loop");
+  epoll_loop.loop_enter(loop);
+  fired = 0;
+  fired_events = 0;
+  event = NULL;
+}
+
+static void teardown(void)
+{
+  epoll_loop.loop_enter(NULL);
+  epoll_loop.loop_delete(loop);
+}
+
+static void stop_cb(int fd, short events, void *arg)
+{
+  epoll_loop.loop_break(loop);
+}
+
+// run the loop until a timeout of msec milliseconds
+static void run_for(int msec)
+{
+  void *stop;
+  struct timeval tv = { 0, msec * 1000 };
+
+  stop = epoll_eh.timeout_add(&tv, 0, &stop_cb, NULL);
+  fail_unless (stop != NULL, "cannot add stop timeout");
+  fail_unless (epoll_loop.loop_run(loop) == 0, "loop failed");
+  epoll_eh.timeout_del(stop);
+}
+
+static void count_cb(int fd, short events, void *arg)
+{
+  fired++;
+  fired_events |= events;
+}
+
+static void count_del_cb(int fd, short events, void *arg)
+{
+  fired++;
+  fired_events |= events;
+  epoll_eh.event_del(event);
+  event = NULL;
+}
+
+V_START_TEST (test_read)
+{
+  int fds[2];
+  char c = 0;
+
+  fail_unless (pipe(fds) == 0, "cannot create pipe");
+  event = epoll_eh.event_add(fds[0], VDE_EV_READ | VDE_EV_PERSIST, NULL,
+                             &count_cb, NULL);
+  fail_unless (event != NULL, "cannot add read event");
+  fail_unless (epoll_eh.event_add(fds[0], VDE_EV_READ, NULL, &count_cb,
+                                  NULL) == NULL && errno == EEXIST,
+               "second read event on the same fd");
+
+  run_for(10);
+  fail_unless (fired == 0, "read event without data");
+
+  // level triggered: unread data keeps firing
+  fail_unless (write(fds[1], &c, 1) == 1, "cannot write");
+  run_for(10);
+  fail_unless (fired > 1 && fired_events == VDE_EV_READ,
+               "read event fired %d times", fired);
+
+  epoll_eh.event_del(event);
+  fired = 0;
+  run_for(10);
+  fail_unless (fired == 0, "deleted read event fired");
+
+  close(fds[0]);
+  close(fds[1]);
+}
+END_TEST
+
+V_START_TEST (test_read_oneshot)
+{
+  int fds[2];
+  char c = 0;
+
+  fail_unless (pipe(fds) == 0, "cannot create pipe");
+  fail_unless (write(fds[1], &c, 1) == 1, "cannot write");
+  event = epoll_eh.event_add(fds[0], VDE_EV_READ, NULL, &count_del_cb, NULL);
+  fail_unless (event != NULL, "cannot add read event");
+
+  run_for(10);
+  fail_unless (fired == 1, "one-shot event fired %d times", fired);
+
+  // fd is free again once the event is gone
+  event = epoll_eh.event_add(fds[0], VDE_EV_READ, NULL, &count_del_cb, NULL);
+  fail_unless (event != NULL, "cannot add read event again");
+  run_for(10);
+  fail_unless (fired == 2, "one-shot event fired %d times", fired);
+
+  close(fds[0]);
+  close(fds[1]);
+}
+END_TEST
+
+V_START_TEST (test_write_toggle)
+{
+  int fds[2];
+
+  fail_unless (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == 0,
+               "cannot create socketpair");
+
+  // edge triggered: one run after add, none while nothing changes
+  event = epoll_eh.event_add(fds[0], VDE_EV_WRITE | VDE_EV_PERSIST, NULL,
+                             &count_cb, NULL);
+  fail_unless (event != NULL, "cannot add write event");
+  run_for(10);
+  fail_unless (fired == 1 && fired_events == VDE_EV_WRITE,
+               "write event fired %d times", fired);
+
+  epoll_eh.event_del(event);
+  event = epoll_eh.event_add(fds[0], VDE_EV_WRITE | VDE_EV_PERSIST, NULL,
+                             &count_cb, NULL);
+  fail_unless (event != NULL, "cannot add write event again");
+  run_for(10);
+  fail_unless (fired == 2, "write event fired %d times", fired);
+
+  // deleting before the loop runs cancels the first run
+  epoll_eh.event_del(event);
+  event = epoll_eh.event_add(fds[0], VDE_EV_WRITE | VDE_EV_PERSIST, NULL,
+                             &count_cb, NULL);
+  epoll_eh.event_del(event);
+  run_for(10);
+  fail_unless (fired == 2, "deleted write event fired");
+
+  close(fds[0]);
+  close(fds[1]);
+}
+END_TEST
+
+V_START_TEST (test_read_write)
+{
+  int fds[2];
+  void *rd;
+  char c = 0;
+
+  fail_unless (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == 0,
+               "cannot create socketpair");
+  rd = epoll_eh.event_add(fds[0], VDE_EV_READ | VDE_EV_PERSIST, NULL,
+                          &count_cb, NULL);
+  fail_unless (rd != NULL, "cannot add read event");
+  event = epoll_eh.event_add(fds[0], VDE_EV_WRITE, NULL, &count_del_cb, NULL);
+  fail_unless (event != NULL, "cannot add write event");
+
+  run_for(10);
+  fail_unless (fired == 1 && fired_events == VDE_EV_WRITE,
+               "write event fired %d times", fired);
+
+  // the read event survives the write one
+  fail_unless (write(fds[1], &c, 1) == 1, "cannot write");
+  fired_events = 0;
+  run_for(10);
+  fail_unless (fired > 1 && fired_events == VDE_EV_READ,
+               "read event not fired");
+
+  epoll_eh.event_del(rd);
+  close(fds[0]);
+  close(fds[1]);
+}
+END_TEST
+
+V_START_TEST (test_timeout)
+{
+  struct timeval tv = { 0, 1000 };
+
+  event = epoll_eh.timeout_add(&tv, 0, &count_cb, NULL);
+  fail_unless (event != NULL, "cannot add timeout");
+  run_for(20);
+  fail_unless (fired == 1 && fired_events == VDE_EV_TIMEOUT,
+               "timeout fired %d times", fired);
+  epoll_eh.timeout_del(event);
+
+  fired = 0;
+  event = epoll_eh.timeout_add(&tv, VDE_EV_PERSIST, &count_cb, NULL);
+  fail_unless (event != NULL, "cannot add persistent timeout");
+  run_for(20);
+  fail_unless (fired > 1, "persistent timeout fired %d times", fired);
+  epoll_eh.timeout_del(event);
+
+  fired = 0;
+  run_for(10);
+  fail_unless (fired == 0, "deleted timeout fired");
+}
+END_TEST
+
+V_START_TEST (test_timeout_del_in_cb)
+{
+  struct timeval tv = { 0, 0 };
+
+  event = epoll_eh.timeout_add(&tv, VDE_EV_PERSIST, &count_del_cb, NULL);
+  fail_unless (event != NULL, "cannot add persistent timeout");
+  run_for(10);
+  fail_unless (fired == 1, "timeout deleted by callback fired %d times",
+               fired);
+}
+END_TEST
+
+V_START_TEST (test_event_timeout)
+{
+  int fds[2];
+  struct timeval tv = { 0, 1000 };
+
+  fail_unless (pipe(fds) == 0, "cannot create pipe");
+  event = epoll_eh.event_add(fds[0], VDE_EV_READ | VDE_EV_PERSIST, &tv,
+                             &count_cb, NULL);
+  fail_unless (event != NULL, "cannot add read event");
+  run_for(20);
+  fail_unless (fired > 1 && fired_events == VDE_EV_TIMEOUT,
+               "event timeout fired %d times", fired);
+  epoll_eh.event_del(event);
+
+  close(fds[0]);
+  close(fds[1]);
+}
+END_TEST
+
+Suite *
+epoll_handler_suite (void)
+{
+  Suite *s = suite_create ("epoll_handler");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_read);
+  tcase_add_test (tc_core, test_read_oneshot);
+  tcase_add_test (tc_core, test_write_toggle);
+  tcase_add_test (tc_core, test_read_write);
+  tcase_add_test (tc_core, test_timeout);
+  tcase_add_test (tc_core, test_timeout_del_in_cb);
+  tcase_add_test (tc_core, test_event_timeout);
+  suite_add_tcase (s, tc_core);
+
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = epoll_handler_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
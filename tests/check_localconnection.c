@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/localconnection.h>
+#include <vde3/packet.h>
+
+#include "bench.h"
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+extern vde_event_handler epoll_eh;
+extern vde_event_loop epoll_loop;
+extern int epoll_eh_init(void);
+
+// ms waited for packets to cross workers before giving up
+#define WAIT_MS 3000
+
+// fixture components, always present: a traffic generator in each worker
+vde_context *f_ctx;
+vde_component *f_tg[2];
+// packets received by f_tg[1], written by its worker
+unsigned long f_rx;
+unsigned int f_rx_len;
+// microseconds spent by the reader on each packet
+unsigned int f_rx_delay;
+
+// busy wait for us microseconds
+static void spin(unsigned int us)
+{
+  struct timespec start, now;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while ((now.tv_sec - start.tv_sec) * 1000000 +
+           (now.tv_nsec - start.tv_nsec) / 1000 < us);
+}
+
+static void rx_cb(vde_component *trafgen, vde_pkt *pkt, void *arg)
+{
+  __atomic_store_n(&f_rx_len, pkt->hdr->pkt_len, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&f_rx, 1, __ATOMIC_RELEASE);
+  spin(f_rx_delay);
+}
+
+// workers of the fixture context, each runs a traffic generator connected to
+// the other one with a cross-worker queued local connection
+static void workers_setup(const char *params)
+{
+  unsigned int i;
+  char name[8];
+
+  f_rx = f_rx_len = f_rx_delay = 0;
+  fail_unless (epoll_eh_init() == 0, "cannot init epoll handler");
+  vde_context_new(&f_ctx);
+  vde_context_init(f_ctx, &epoll_eh, NULL);
+  fail_unless (bench_trafgen_register(f_ctx) == 0, "cannot register trafgen");
+  fail_unless (vde_context_set_workers(f_ctx, 2, &epoll_loop) == 0,
+               "cannot set workers");
+  for (i = 0; i < 2; i++) {
+    snprintf(name, sizeof(name), "tg%u", i);
+    fail_unless (vde_context_new_component(vde_context_get_worker(f_ctx, i),
+                                           VDE_ENGINE, "trafgen", name,
+                                           &f_tg[i],
+                                           params ?
+                                           vde_sobj_from_string(params) :
+                                           NULL) == 0,
+                 "cannot create trafgen %s", strerror(errno));
+  }
+  bench_trafgen_set_rx_cb(f_tg[1], &rx_cb, NULL);
+  fail_unless (vde_connect_engines_queued(f_ctx, f_tg[0], NULL, f_tg[1], NULL,
+                                          0) == 0,
+               "cannot connect workers %s", strerror(errno));
+  fail_unless (vde_context_start_workers(f_ctx) == 0, "cannot start workers");
+}
+
+void
+teardown (void)
+{
+  vde_context_stop_workers(f_ctx);
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+}
+
+struct send_args {
+  vde_component *tg;
+  unsigned int count;
+  // written by the worker: packets accepted by the connection, packets
+  // refused when the ring is full are not counted, and the end of the send
+  unsigned long sent;
+  int done;
+};
+
+static void send_fn(vde_context *worker, void *arg)
+{
+  struct send_args *args = (struct send_args *)arg;
+  int rv;
+
+  rv = bench_trafgen_send(args->tg, args->count);
+  __atomic_store_n(&args->sent, rv > 0 ? rv : 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&args->done, 1, __ATOMIC_RELEASE);
+}
+
+// send packets one at a time while the reader is busy with the previous ones,
+// so that they are committed in the middle of a partial batch
+static void send_slow_fn(vde_context *worker, void *arg)
+{
+  struct send_args *args = (struct send_args *)arg;
+  unsigned int i;
+  unsigned long sent = 0;
+
+  for (i = 0; i < args->count; i++) {
+    if (bench_trafgen_send(args->tg, 1) == 1) {
+      sent++;
+    }
+    spin(i % 7);
+  }
+  __atomic_store_n(&args->sent, sent, __ATOMIC_RELAXED);
+  __atomic_store_n(&args->done, 1, __ATOMIC_RELEASE);
+}
+
+// wait until the send is over and every packet accepted has been received,
+// for at most WAIT_MS
+static int wait_rx(struct send_args *args)
+{
+  struct timespec start, now;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    if (__atomic_load_n(&args->done, __ATOMIC_ACQUIRE) &&
+        __atomic_load_n(&f_rx, __ATOMIC_ACQUIRE) >= args->sent) {
+      return 0;
+    }
+    usleep(1000);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while ((now.tv_sec - start.tv_sec) * 1000 +
+           (now.tv_nsec - start.tv_nsec) / 1000000 < WAIT_MS);
+  return -1;
+}
+
+V_START_TEST (test_xlc_burst)
+{
+  struct send_args args = { NULL, 20000, 0, 0 };
+
+  workers_setup(NULL);
+  f_rx_delay = 2;
+  args.tg = f_tg[0];
+  fail_unless (vde_context_worker_call(vde_context_get_worker(f_ctx, 0),
+                                       &send_slow_fn, &args) == 0,
+               "cannot call worker");
+  fail_unless (wait_rx(&args) == 0, "reader stalled: %lu of %lu received",
+               f_rx, args.sent);
+  fail_unless (args.sent > 0, "no packet sent");
+}
+END_TEST
+
+V_START_TEST (test_xlc_jumbo)
+{
+  struct send_args args = { NULL, 16, 0, 0 };
+
+  workers_setup("{'pkt_len': 9018}");
+  args.tg = f_tg[0];
+  fail_unless (vde_context_worker_call(vde_context_get_worker(f_ctx, 0),
+                                       &send_fn, &args) == 0,
+               "cannot call worker");
+  fail_unless (wait_rx(&args) == 0, "jumbo frames lost: %lu received",
+               f_rx);
+  // the ring holds them all
+  fail_unless (args.sent == args.count, "%lu frames sent", args.sent);
+  fail_unless (f_rx_len == 9018, "wrong frame length %u", f_rx_len);
+}
+END_TEST
+
+Suite *
+localconnection_suite (void)
+{
+  Suite *s = suite_create ("localconnection");
+
+  /* Cross-worker test case */
+  TCase *tc_xlc = tcase_create ("Xlc");
+  tcase_add_checked_fixture (tc_xlc, NULL, teardown);
+  tcase_add_test (tc_xlc, test_xlc_burst);
+  tcase_add_test (tc_xlc, test_xlc_jumbo);
+  suite_add_tcase (s, tc_xlc);
+
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = localconnection_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <check.h>
+
+// compile in every priority, the runtime level is tested
+#define VDE3_LOG_LEVEL VDE3_LOG_DEBUG
+#include <vde3.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+#define BURST 3
+#define SLOTS 4
+
+static int logged;
+static int suppressed;
+static int dropped;
+static int last_priority;
+static char last_msg[256];
+static pthread_t log_thread;
+
+static void count_handler(int priority, const char *format, va_list arg)
+{
+  unsigned int n;
+
+  vsnprintf(last_msg, sizeof(last_msg), format, arg);
+  last_priority = priority;
+  log_thread = pthread_self();
+  if (sscanf(last_msg, "%*[^:]:%*d: %u messages suppressed", &n) == 1) {
+    suppressed += n;
+  } else if (strstr(last_msg, "log messages dropped")) {
+    sscanf(strstr(last_msg, ": ") + 2, "%u", &n);
+    dropped += n;
+  } else {
+    logged++;
+  }
+}
+
+static void setup(void)
+{
+  logged = suppressed = dropped = 0;
+  last_priority = -1;
+  last_msg[0] = '\0';
+  vde_log_set_handler(&count_handler);
+  vde_log_set_level(VDE3_LOG_DEBUG);
+  vde_log_set_ratelimit(60000, 0);
+}
+
+static void teardown(void)
+{
+  vde_log_set_handler(NULL);
+}
+
+static void log_from_site(int i)
+{
+  vde_warning("message %d", i);
+}
+
+V_START_TEST (test_log_level)
+{
+  vde_debug("debug %d", 1);
+  fail_unless (logged == 1 && last_priority == VDE3_LOG_DEBUG,
+               "debug not logged");
+  fail_unless (strcmp(last_msg, "debug 1") == 0, "wrong message '%s'",
+               last_msg);
+
+  vde_log_set_level(VDE3_LOG_WARNING);
+  vde_debug("debug");
+  vde_info("info");
+  vde_notice("notice");
+  fail_unless (logged == 1, "messages beyond the level logged");
+  vde_warning("warning");
+  vde_error("error");
+  fail_unless (logged == 3 && last_priority == VDE3_LOG_ERROR,
+               "messages within the level not logged");
+}
+END_TEST
+
+V_START_TEST (test_ratelimit)
+{
+  int i;
+
+  vde_log_set_ratelimit(60000, BURST);
+  for (i = 0; i < BURST + 5; i++) {
+    log_from_site(i);
+  }
+  fail_unless (logged == BURST, "logged %d messages", logged);
+  fail_unless (suppressed == 0, "suppressed reported too early");
+
+  // a new window reports what has been suppressed
+  vde_log_set_ratelimit(0, BURST);
+  log_from_site(i);
+  fail_unless (suppressed == 5, "suppressed %d messages", suppressed);
+  fail_unless (logged == BURST + 1, "logged %d messages", logged);
+
+  // sites are limited independently
+  vde_log_set_ratelimit(60000, BURST);
+  vde_warning("other site");
+  fail_unless (logged == BURST + 2, "other site limited");
+}
+END_TEST
+
+V_START_TEST (test_async)
+{
+  int i;
+
+  fail_unless (vde_log_start_async(0) == -1 && errno == EINVAL,
+               "fail on zero slots");
+  fail_unless (vde_log_start_async(SLOTS) == 0, "cannot start async sink");
+  fail_unless (vde_log_start_async(SLOTS) == -1 && errno == EBUSY,
+               "started twice");
+  for (i = 0; i < SLOTS; i++) {
+    vde_warning("async %d", i);
+  }
+  vde_log_stop_async();
+
+  fail_unless (logged + dropped == SLOTS, "logged %d dropped %d", logged,
+               dropped);
+  fail_unless (!pthread_equal(log_thread, pthread_self()),
+               "logged from the caller thread");
+
+  // messages are written in place again
+  vde_warning("sync");
+  fail_unless (pthread_equal(log_thread, pthread_self()),
+               "logged from another thread");
+}
+END_TEST
+
+V_START_TEST (test_async_drop)
+{
+  int i;
+
+  // the ring overflows unless the consumer is faster than this loop
+  fail_unless (vde_log_start_async(1) == 0, "cannot start async sink");
+  for (i = 0; i < 1000; i++) {
+    vde_warning("async %d", i);
+  }
+  vde_log_stop_async();
+
+  fail_unless (logged + dropped == 1000, "logged %d dropped %d", logged,
+               dropped);
+}
+END_TEST
+
+Suite *
+logging_suite (void)
+{
+  Suite *s = suite_create ("logging");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_log_level);
+  tcase_add_test (tc_core, test_ratelimit);
+  tcase_add_test (tc_core, test_async);
+  tcase_add_test (tc_core, test_async_drop);
+  suite_add_tcase (s, tc_core);
+
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = logging_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
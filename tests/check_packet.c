@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/packet.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+#define PAYLOAD "some payload"
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_event_handler f_eh = {(void *)0x1, (void *)0x1, (void *)0x1, (void *)0x1};
+
+void
+setup (void)
+{
+  vde_context_new(&f_ctx);
+  vde_context_init(f_ctx, &f_eh, NULL);
+}
+
+void
+teardown (void)
+{
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+}
+
+static void fill_pkt(vde_pkt *pkt)
+{
+  memcpy(pkt->payload, PAYLOAD, sizeof(PAYLOAD));
+  pkt->hdr->pkt_len = sizeof(PAYLOAD);
+}
+
+V_START_TEST (test_pkt_new)
+{
+  vde_pkt *pkt;
+
+  pkt = vde_pkt_new(f_ctx, 64, 4, 2);
+  fail_unless (pkt != NULL, "fail on valid arguments");
+  fail_unless (pkt->refcount == 1, "new packet refcount %u", pkt->refcount);
+  fail_unless (pkt->payload - pkt->head == 4, "wrong head size");
+  fail_unless (pkt->data + pkt->data_size - pkt->tail == 2,
+               "wrong tail size");
+  fail_unless (pkt->hdr->pkt_len == 0, "header not zeroed");
+  fail_unless (!vde_pkt_is_shared(pkt), "new packet is shared");
+  vde_pkt_put(pkt);
+}
+END_TEST
+
+V_START_TEST (test_pkt_get_put)
+{
+  vde_pkt *pkt;
+
+  pkt = vde_pkt_new(f_ctx, 64, 0, 0);
+  fail_unless (vde_pkt_get(pkt) == pkt, "get returned a different packet");
+  fail_unless (pkt->refcount == 2, "refcount %u after get", pkt->refcount);
+  fail_unless (vde_pkt_is_shared(pkt), "packet not shared after get");
+  vde_pkt_put(pkt);
+  fail_unless (pkt->refcount == 1, "refcount %u after put", pkt->refcount);
+  vde_pkt_put(pkt);
+}
+END_TEST
+
+V_START_TEST (test_pkt_share_pooled)
+{
+  vde_pkt *pkt, *shared;
+
+  pkt = vde_pkt_new(f_ctx, 64, 0, 0);
+  shared = vde_pkt_share(f_ctx, pkt);
+  fail_unless (shared == pkt, "pooled packet has been copied");
+  fail_unless (pkt->refcount == 2, "refcount %u after share", pkt->refcount);
+  vde_pkt_put(shared);
+  vde_pkt_put(pkt);
+}
+END_TEST
+
+V_START_TEST (test_pkt_share_stack)
+{
+  struct {
+    vde_pkt pkt;
+    char data[sizeof(vde_hdr) + 4 + 64];
+  } stack_pkt;
+  vde_pkt *shared;
+
+  vde_pkt_init(&stack_pkt.pkt, sizeof(stack_pkt.data), 4, 0);
+  fill_pkt(&stack_pkt.pkt);
+  fail_unless (!vde_pkt_is_refcounted(&stack_pkt.pkt),
+               "stack packet is refcounted");
+
+  shared = vde_pkt_share(f_ctx, &stack_pkt.pkt);
+  fail_unless (shared != NULL && shared != &stack_pkt.pkt,
+               "stack packet has not been copied");
+  fail_unless (shared->refcount == 1, "copy refcount %u", shared->refcount);
+  fail_unless (shared->payload - shared->head == 4, "head size not kept");
+  fail_unless (shared->hdr->pkt_len == sizeof(PAYLOAD), "wrong pkt_len");
+  fail_unless (!memcmp(shared->payload, PAYLOAD, sizeof(PAYLOAD)),
+               "payload differs");
+  vde_pkt_put(shared);
+}
+END_TEST
+
+V_START_TEST (test_pkt_share_view)
+{
+  char ring[8 + sizeof(PAYLOAD) + 2];
+  vde_pkt view, *shared;
+  vde_hdr hdr;
+
+  memcpy(ring + 8, PAYLOAD, sizeof(PAYLOAD));
+  vde_pkt_init_view(&view, &hdr, ring + 4, 4, sizeof(PAYLOAD), 2);
+  fail_unless (view.payload == ring + 8 && hdr.pkt_len == sizeof(PAYLOAD),
+               "wrong view layout");
+
+  shared = vde_pkt_share(f_ctx, &view);
+  fail_unless (shared != NULL && shared != &view,
+               "view has not been copied");
+  fail_unless (shared->payload - shared->head == 4, "head size not kept");
+  fail_unless (shared->data + shared->data_size - shared->tail == 2,
+               "tail size not kept");
+  fail_unless (!memcmp(shared->payload, PAYLOAD, sizeof(PAYLOAD)),
+               "payload differs");
+  vde_pkt_put(shared);
+}
+END_TEST
+
+V_START_TEST (test_pkt_dup)
+{
+  vde_pkt *pkt, *dup;
+
+  pkt = vde_pkt_new(f_ctx, 64, 4, 4);
+  fill_pkt(pkt);
+  dup = vde_pkt_dup(f_ctx, pkt);
+  fail_unless (dup != NULL && dup != pkt, "fail on valid arguments");
+  fail_unless (pkt->refcount == 1, "dup changed original refcount");
+  fail_unless (dup->data_size == pkt->data_size, "wrong data size");
+  fail_unless (!memcmp(dup->payload, PAYLOAD, sizeof(PAYLOAD)),
+               "payload differs");
+  vde_pkt_put(pkt);
+  vde_pkt_put(dup);
+}
+END_TEST
+
+Suite *
+packet_suite (void)
+{
+  Suite *s = suite_create ("packet");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_pkt_new);
+  tcase_add_test (tc_core, test_pkt_dup);
+  suite_add_tcase (s, tc_core);
+
+  /* Reference counting test case */
+  TCase *tc_ref = tcase_create ("Refcount");
+  tcase_add_checked_fixture (tc_ref, setup, teardown);
+  tcase_add_test (tc_ref, test_pkt_get_put);
+  tcase_add_test (tc_ref, test_pkt_share_pooled);
+  tcase_add_test (tc_ref, test_pkt_share_stack);
+  tcase_add_test (tc_ref, test_pkt_share_view);
+  suite_add_tcase (s, tc_ref);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = packet_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+#include <vde3/pool.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+// fixture components, always present
+vde_pool *f_pool;
+
+void
+setup (void)
+{
+  f_pool = vde_pool_new();
+}
+
+void
+teardown (void)
+{
+  vde_pool_delete(f_pool);
+}
+
+static void get_stats_for(size_t size, vde_pool_stats *stats)
+{
+  unsigned int i;
+  size_t cls_size;
+
+  for (i = 0; i < vde_pool_num_classes(f_pool); i++) {
+    vde_pool_get_stats(f_pool, i, &cls_size, stats);
+    if (size <= cls_size) {
+      return;
+    }
+  }
+  vde_pool_get_stats(f_pool, i, NULL, stats);
+}
+
+
+V_START_TEST (test_pool_alloc_free)
+{
+  void *chunk;
+  vde_pool_stats stats;
+
+  chunk = vde_pool_alloc(f_pool, 1500);
+  fail_unless (chunk != NULL, "could not allocate chunk");
+  memset(chunk, 0xff, 1500);
+
+  get_stats_for(1500, &stats);
+  fail_unless (stats.allocs == 1 && stats.misses == 1 && stats.in_use == 1,
+               "wrong counters after first alloc");
+
+  vde_pool_free(chunk);
+  get_stats_for(1500, &stats);
+  fail_unless (stats.frees == 1 && stats.in_use == 0 && stats.cached == 1,
+               "chunk not cached after free");
+}
+END_TEST
+
+V_START_TEST (test_pool_reuse)
+{
+  void *chunk, *again;
+  vde_pool_stats stats;
+
+  chunk = vde_pool_alloc(f_pool, 100);
+  vde_pool_free(chunk);
+  again = vde_pool_alloc(f_pool, 120);
+  fail_unless (again == chunk, "cached chunk not reused");
+
+  get_stats_for(100, &stats);
+  fail_unless (stats.hits == 1 && stats.misses == 1,
+               "reuse not accounted as hit");
+  fail_unless (stats.peak_in_use == 1, "wrong peak");
+
+  vde_pool_free(again);
+}
+END_TEST
+
+V_START_TEST (test_pool_oversize)
+{
+  void *chunk;
+  vde_pool_stats stats;
+  size_t max_size;
+
+  vde_pool_get_stats(f_pool, vde_pool_num_classes(f_pool) - 1, &max_size,
+                     &stats);
+
+  chunk = vde_pool_alloc(f_pool, max_size + 1);
+  fail_unless (chunk != NULL, "could not allocate oversized chunk");
+  memset(chunk, 0xff, max_size + 1);
+
+  vde_pool_get_stats(f_pool, vde_pool_num_classes(f_pool), NULL, &stats);
+  fail_unless (stats.in_use == 1, "oversized chunk not accounted");
+
+  vde_pool_free(chunk);
+  vde_pool_get_stats(f_pool, vde_pool_num_classes(f_pool), NULL, &stats);
+  fail_unless (stats.in_use == 0 && stats.cached == 0,
+               "oversized chunk must not be cached");
+}
+END_TEST
+
+V_START_TEST (test_pool_watermarks)
+{
+  void *chunks[8];
+  vde_pool_stats stats;
+  int i, rv;
+
+  rv = vde_pool_set_watermarks(f_pool, 1500, 4, 2);
+  fail_unless (rv == -1 && errno == EINVAL, "success on low > high");
+
+  rv = vde_pool_set_watermarks(f_pool, 1500, 2, 4);
+  fail_unless (rv == 0, "fail on valid watermarks");
+  get_stats_for(1500, &stats);
+  fail_unless (stats.cached == 2, "low watermark not preallocated");
+
+  for (i = 0; i < 8; i++) {
+    chunks[i] = vde_pool_alloc(f_pool, 1500);
+  }
+  get_stats_for(1500, &stats);
+  fail_unless (stats.hits == 2 && stats.misses == 6, "wrong hits/misses");
+
+  for (i = 0; i < 8; i++) {
+    vde_pool_free(chunks[i]);
+  }
+  get_stats_for(1500, &stats);
+  fail_unless (stats.cached == 4, "high watermark not honoured");
+  fail_unless (stats.releases == 4, "wrong releases");
+
+  vde_pool_trim(f_pool);
+  get_stats_for(1500, &stats);
+  fail_unless (stats.cached == 2, "trim did not stop at low watermark");
+}
+END_TEST
+
+V_START_TEST (test_pool_stats_invalid)
+{
+  vde_pool_stats stats;
+  int rv;
+
+  rv = vde_pool_get_stats(f_pool, vde_pool_num_classes(f_pool) + 1, NULL,
+                          &stats);
+  fail_unless (rv == -1 && errno == EINVAL, "success on invalid class");
+}
+END_TEST
+
+Suite *
+vde_pool_suite (void)
+{
+  Suite *s = suite_create ("vde_pool");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_pool_alloc_free);
+  tcase_add_test (tc_core, test_pool_reuse);
+  tcase_add_test (tc_core, test_pool_oversize);
+  suite_add_tcase (s, tc_core);
+
+  /* Watermarks test case */
+  TCase *tc_wm = tcase_create ("Watermarks");
+  tcase_add_checked_fixture (tc_wm, setup, teardown);
+  tcase_add_test (tc_wm, test_pool_watermarks);
+  tcase_add_test (tc_wm, test_pool_stats_invalid);
+  suite_add_tcase (s, tc_wm);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = vde_pool_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
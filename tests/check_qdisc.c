@@ -0,0 +1,259 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/packet.h>
+#include <vde3/qdisc.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+#define PKT_LEN 1500
+#define ENTRIES 16
+#define MS 1000000ULL
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_event_handler f_eh = {(void *)0x1, (void *)0x1, (void *)0x1, (void *)0x1};
+vde_pkt *f_bulk, *f_sparse;
+vde_qentry f_entries[ENTRIES + 1];
+int f_drops;
+int f_freed;
+
+static void drop_cb(vde_qentry *entry, void *arg)
+{
+  f_drops++;
+}
+
+static void free_cb(vde_qentry *entry, void *arg)
+{
+  f_freed++;
+}
+
+static vde_pkt *new_pkt(char src)
+{
+  vde_pkt *pkt = vde_pkt_new(f_ctx, PKT_LEN, 0, 0);
+
+  memset(pkt->payload, 0, PKT_LEN);
+  memset(pkt->payload, 0xff, ETH_ALEN);
+  pkt->payload[ETH_ALEN + ETH_ALEN - 1] = src;
+  pkt->hdr->pkt_len = PKT_LEN;
+  return pkt;
+}
+
+static vde_qdisc *new_qdisc(const char *params_str)
+{
+  vde_sobj *params = vde_sobj_from_string(params_str);
+  vde_qdisc_conf conf;
+  vde_qdisc *qdisc;
+
+  fail_unless (vde_qdisc_conf_parse(params, &conf) == 0,
+               "cannot parse %s", params_str);
+  vde_sobj_put(params);
+  qdisc = vde_qdisc_new(&conf, &drop_cb, NULL);
+  fail_unless (qdisc != NULL, "cannot create %s", params_str);
+  return qdisc;
+}
+
+void
+setup (void)
+{
+  unsigned int i;
+
+  vde_context_new(&f_ctx);
+  vde_context_init(f_ctx, &f_eh, NULL);
+  f_bulk = new_pkt(0x01);
+  f_sparse = new_pkt(0x02);
+  for (i = 0; i < ENTRIES + 1; i++) {
+    f_entries[i].pkt = f_bulk;
+  }
+  f_drops = f_freed = 0;
+}
+
+void
+teardown (void)
+{
+  vde_pkt_put(f_bulk);
+  vde_pkt_put(f_sparse);
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+}
+
+V_START_TEST (test_conf_parse)
+{
+  vde_qdisc_conf conf;
+  vde_sobj *params;
+
+  fail_unless (vde_qdisc_conf_parse(NULL, &conf) == 0 &&
+               strcmp(conf.ops->name, "fifo") == 0, "fifo not the default");
+
+  params = vde_sobj_from_string("{'type': 'fq', 'flows': 64}");
+  fail_unless (vde_qdisc_conf_parse(params, &conf) == 0 &&
+               strcmp(conf.ops->name, "fq") == 0 && conf.flows == 64 &&
+               conf.target_ns == 5 * MS && conf.interval_ns == 100 * MS,
+               "fq hash not parsed");
+  vde_sobj_put(params);
+
+  params = vde_sobj_from_string("{'type': 'fq', 'flows': 3}");
+  fail_unless (vde_qdisc_conf_parse(params, &conf) == -1 && errno == EINVAL,
+               "flows not a power of two accepted");
+  vde_sobj_put(params);
+
+  params = vde_sobj_from_string("{'type': 'fq', 'quantum': 70000}");
+  fail_unless (vde_qdisc_conf_parse(params, &conf) == -1 && errno == EINVAL,
+               "quantum above the maximum accepted");
+  vde_sobj_put(params);
+
+  params = vde_sobj_from_string("'red'");
+  fail_unless (vde_qdisc_conf_parse(params, &conf) == -1 && errno == EINVAL,
+               "unknown discipline accepted");
+  vde_sobj_put(params);
+}
+END_TEST
+
+V_START_TEST (test_fifo_requeue)
+{
+  unsigned int i;
+  vde_qdisc *qdisc = new_qdisc("'fifo'");
+
+  for (i = 0; i < ENTRIES; i++) {
+    vde_qdisc_enqueue(qdisc, &f_entries[i], 0);
+  }
+  fail_unless (vde_qdisc_dequeue(qdisc, 0) == &f_entries[0], "not fifo");
+  fail_unless (vde_qdisc_dequeue(qdisc, 0) == &f_entries[1], "not fifo");
+  // as a sender putting back a batch
+  vde_qdisc_requeue(qdisc, &f_entries[1]);
+  vde_qdisc_requeue(qdisc, &f_entries[0]);
+  fail_unless (vde_qdisc_get_length(qdisc) == ENTRIES, "wrong length %u",
+               vde_qdisc_get_length(qdisc));
+  for (i = 0; i < ENTRIES; i++) {
+    fail_unless (vde_qdisc_dequeue(qdisc, 0) == &f_entries[i],
+                 "wrong entry %u", i);
+  }
+  fail_unless (vde_qdisc_dequeue(qdisc, 0) == NULL, "queue not empty");
+  fail_unless (qdisc->bytes == 0, "bytes %u left", qdisc->bytes);
+
+  vde_qdisc_delete(qdisc, &free_cb, NULL);
+}
+END_TEST
+
+V_START_TEST (test_codel_drops)
+{
+  unsigned int i;
+  vde_qdisc *qdisc = new_qdisc("'codel'");
+
+  // short sojourn times never drop
+  for (i = 0; i < ENTRIES; i++) {
+    vde_qdisc_enqueue(qdisc, &f_entries[i], 0);
+  }
+  for (i = 0; i < ENTRIES; i++) {
+    fail_unless (vde_qdisc_dequeue(qdisc, MS) == &f_entries[i],
+                 "wrong entry %u", i);
+  }
+  fail_unless (f_drops == 0, "dropped below target");
+
+  for (i = 0; i < ENTRIES; i++) {
+    vde_qdisc_enqueue(qdisc, &f_entries[i], 0);
+  }
+  // above target, a whole interval has to pass before dropping
+  fail_unless (vde_qdisc_dequeue(qdisc, 10 * MS) == &f_entries[0],
+               "dropped too early");
+  fail_unless (vde_qdisc_dequeue(qdisc, 100 * MS) == &f_entries[1],
+               "dropped too early");
+  fail_unless (f_drops == 0, "dropped within the interval");
+
+  fail_unless (vde_qdisc_dequeue(qdisc, 120 * MS) == &f_entries[3] &&
+               f_drops == 1, "head not dropped");
+  // next drop after interval / sqrt(1)
+  fail_unless (vde_qdisc_dequeue(qdisc, 200 * MS) == &f_entries[4] &&
+               f_drops == 1, "dropped before drop_next");
+  fail_unless (vde_qdisc_dequeue(qdisc, 221 * MS) == &f_entries[6] &&
+               f_drops == 2, "not dropped at drop_next");
+  // then after interval / sqrt(2)
+  fail_unless (vde_qdisc_dequeue(qdisc, 290 * MS) == &f_entries[7] &&
+               f_drops == 2, "dropped before drop_next");
+  fail_unless (vde_qdisc_dequeue(qdisc, 292 * MS) == &f_entries[9] &&
+               f_drops == 3, "not dropped at drop_next");
+  fail_unless (vde_qdisc_get_length(qdisc) == ENTRIES - 10,
+               "wrong length %u", vde_qdisc_get_length(qdisc));
+  fail_unless (qdisc->drops == 3, "drops %llu",
+               (unsigned long long)qdisc->drops);
+
+  vde_qdisc_delete(qdisc, &free_cb, NULL);
+  fail_unless (f_freed == ENTRIES - 10, "freed %d", f_freed);
+}
+END_TEST
+
+V_START_TEST (test_fq_sparse)
+{
+  unsigned int i;
+  vde_qdisc *qdisc = new_qdisc("{'type': 'fq', 'quantum': 3000}");
+  vde_qentry *sparse = &f_entries[ENTRIES];
+
+  sparse->pkt = f_sparse;
+  for (i = 0; i < ENTRIES; i++) {
+    vde_qdisc_enqueue(qdisc, &f_entries[i], 0);
+  }
+  vde_qdisc_enqueue(qdisc, sparse, 0);
+
+  // the bulk flow sends its quantum, then the sparse flow goes first
+  fail_unless (vde_qdisc_dequeue(qdisc, 0) == &f_entries[0], "wrong entry");
+  fail_unless (vde_qdisc_dequeue(qdisc, 0) == &f_entries[1], "wrong entry");
+  fail_unless (vde_qdisc_dequeue(qdisc, 0) == sparse,
+               "sparse flow queued behind the bulk one");
+  for (i = 2; i < ENTRIES; i++) {
+    fail_unless (vde_qdisc_dequeue(qdisc, 0) == &f_entries[i],
+                 "wrong entry %u", i);
+  }
+  fail_unless (vde_qdisc_dequeue(qdisc, 0) == NULL, "queue not empty");
+
+  // purged from every flow on delete
+  vde_qdisc_enqueue(qdisc, &f_entries[0], 0);
+  vde_qdisc_enqueue(qdisc, sparse, 0);
+  vde_qdisc_requeue(qdisc, &f_entries[1]);
+  vde_qdisc_delete(qdisc, &free_cb, NULL);
+  fail_unless (f_freed == 3, "freed %d", f_freed);
+  fail_unless (f_drops == 0, "dropped %d", f_drops);
+}
+END_TEST
+
+Suite *
+qdisc_suite (void)
+{
+  Suite *s = suite_create ("qdisc");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_conf_parse);
+  tcase_add_test (tc_core, test_fifo_requeue);
+  tcase_add_test (tc_core, test_codel_drops);
+  tcase_add_test (tc_core, test_fq_sparse);
+  suite_add_tcase (s, tc_core);
+
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = qdisc_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
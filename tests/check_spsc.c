@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/spsc.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+#define RING_SIZE 8
+#define STRESS_COUNT 1000000
+
+V_START_TEST (test_spsc_new)
+{
+  vde_spsc_ring *ring;
+
+  ring = vde_spsc_ring_new(0, sizeof(int));
+  fail_unless (ring == NULL && errno == EINVAL, "fail on zero count");
+  ring = vde_spsc_ring_new(RING_SIZE, 0);
+  fail_unless (ring == NULL && errno == EINVAL, "fail on zero slot size");
+
+  ring = vde_spsc_ring_new(RING_SIZE - 1, sizeof(int));
+  fail_unless (ring != NULL, "fail on valid arguments");
+  fail_unless (vde_spsc_ring_size(ring) == RING_SIZE,
+               "size %u not rounded up", vde_spsc_ring_size(ring));
+  fail_unless (vde_spsc_ring_peek(ring) == NULL, "new ring not empty");
+  vde_spsc_ring_delete(ring);
+}
+END_TEST
+
+V_START_TEST (test_spsc_fifo)
+{
+  int i, *slot;
+  vde_spsc_ring *ring;
+
+  ring = vde_spsc_ring_new(RING_SIZE, sizeof(int));
+
+  for (i = 0; i < RING_SIZE; i++) {
+    slot = vde_spsc_ring_reserve(ring);
+    fail_unless (slot != NULL, "ring full after %d slots", i);
+    *slot = i;
+    fail_unless (vde_spsc_ring_commit(ring) == (i == 0),
+                 "wrong wake up hint on slot %d", i);
+  }
+  fail_unless (vde_spsc_ring_reserve(ring) == NULL, "ring not full");
+
+  for (i = 0; i < RING_SIZE; i++) {
+    slot = vde_spsc_ring_peek(ring);
+    fail_unless (slot != NULL && *slot == i, "wrong slot %d", i);
+    vde_spsc_ring_release(ring);
+  }
+  fail_unless (vde_spsc_ring_peek(ring) == NULL, "ring not empty");
+
+  vde_spsc_ring_delete(ring);
+}
+END_TEST
+
+V_START_TEST (test_spsc_batch)
+{
+  int i, *slot, *slots[RING_SIZE];
+  unsigned int count;
+  vde_spsc_ring *ring;
+
+  ring = vde_spsc_ring_new(RING_SIZE, sizeof(int));
+
+  // wrap around the end of the ring
+  for (i = 0; i < RING_SIZE + RING_SIZE / 2; i++) {
+    slot = vde_spsc_ring_reserve(ring);
+    *slot = i;
+    vde_spsc_ring_commit(ring);
+    if (i < RING_SIZE) {
+      vde_spsc_ring_peek(ring);
+      vde_spsc_ring_release(ring);
+    }
+  }
+
+  count = vde_spsc_ring_peek_n(ring, (void **)slots, 2);
+  fail_unless (count == 2, "peeked %u slots", count);
+  count = vde_spsc_ring_peek_n(ring, (void **)slots, RING_SIZE);
+  fail_unless (count == RING_SIZE / 2, "peeked %u slots", count);
+  for (i = 0; i < count; i++) {
+    fail_unless (*slots[i] == RING_SIZE + i, "wrong slot %d", i);
+  }
+  vde_spsc_ring_release_n(ring, count);
+  fail_unless (vde_spsc_ring_peek(ring) == NULL, "ring not empty");
+
+  vde_spsc_ring_delete(ring);
+}
+END_TEST
+
+V_START_TEST (test_spsc_attach)
+{
+  int i, *slot, *slots[RING_SIZE];
+  int shared_slots[RING_SIZE];
+  vde_spsc_index index;
+  vde_spsc_ring tx, rx;
+
+  memset(&index, 0, sizeof(index));
+  fail_unless (vde_spsc_ring_attach(&tx, &index, shared_slots, RING_SIZE - 1,
+                                    sizeof(int)) == -1 && errno == EINVAL,
+               "count not a power of two accepted");
+  fail_unless (vde_spsc_ring_attach(&tx, &index, shared_slots, RING_SIZE,
+                                    sizeof(int)) == 0, "cannot attach");
+
+  for (i = 0; i < RING_SIZE / 2; i++) {
+    slot = vde_spsc_ring_reserve(&tx);
+    *slot = i;
+    vde_spsc_ring_commit(&tx);
+  }
+  // the other side attaches after the first commits
+  fail_unless (vde_spsc_ring_attach(&rx, &index, shared_slots, RING_SIZE,
+                                    sizeof(int)) == 0, "cannot attach");
+  slot = vde_spsc_ring_reserve(&tx);
+  *slot = RING_SIZE / 2;
+  fail_unless (vde_spsc_ring_commit(&tx) == 0, "wrong wake up hint");
+  fail_unless (vde_spsc_ring_peek_n(&rx, (void **)slots, RING_SIZE) ==
+               RING_SIZE / 2 + 1, "slots not seen by the other side");
+  for (i = 0; i <= RING_SIZE / 2; i++) {
+    fail_unless (*slots[i] == i, "wrong slot %d", i);
+  }
+  vde_spsc_ring_release_n(&rx, RING_SIZE / 2 + 1);
+
+  // a broken producer can't make the consumer go past the slots
+  index.head = index.tail + RING_SIZE + 1;
+  fail_unless (vde_spsc_ring_peek_n(&rx, (void **)slots, RING_SIZE) == 0,
+               "slots beyond the ring peeked");
+}
+END_TEST
+
+static void *producer(void *arg)
+{
+  unsigned int i, *slot;
+  vde_spsc_ring *ring = (vde_spsc_ring *)arg;
+
+  for (i = 0; i < STRESS_COUNT; i++) {
+    while ((slot = vde_spsc_ring_reserve(ring)) == NULL) {
+      sched_yield();
+    }
+    *slot = i;
+    vde_spsc_ring_commit(ring);
+  }
+  return NULL;
+}
+
+V_START_TEST (test_spsc_threads)
+{
+  unsigned int i, *slot;
+  pthread_t thread;
+  vde_spsc_ring *ring;
+
+  ring = vde_spsc_ring_new(RING_SIZE, sizeof(unsigned int));
+  fail_unless (pthread_create(&thread, NULL, producer, ring) == 0,
+               "cannot create producer");
+
+  for (i = 0; i < STRESS_COUNT; i++) {
+    while ((slot = vde_spsc_ring_peek(ring)) == NULL) {
+      sched_yield();
+    }
+    fail_unless (*slot == i, "got %u, expected %u", *slot, i);
+    vde_spsc_ring_release(ring);
+  }
+
+  pthread_join(thread, NULL);
+  fail_unless (vde_spsc_ring_peek(ring) == NULL, "ring not empty");
+  vde_spsc_ring_delete(ring);
+}
+END_TEST
+
+V_START_TEST (test_doorbell)
+{
+  vde_doorbell db;
+  uint64_t c;
+
+  fail_unless (vde_doorbell_init(&db) == 0, "cannot init doorbell");
+  vde_doorbell_ring(&db);
+  vde_doorbell_ring(&db);
+  vde_doorbell_clear(&db);
+  fail_unless (read(db.rfd, &c, sizeof(c)) == -1 && errno == EAGAIN,
+               "doorbell not cleared");
+  vde_doorbell_fini(&db);
+}
+END_TEST
+
+Suite *
+spsc_suite (void)
+{
+  Suite *s = suite_create ("spsc");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_test (tc_core, test_spsc_new);
+  tcase_add_test (tc_core, test_spsc_fifo);
+  tcase_add_test (tc_core, test_spsc_batch);
+  tcase_add_test (tc_core, test_spsc_attach);
+  tcase_add_test (tc_core, test_doorbell);
+  suite_add_tcase (s, tc_core);
+
+  /* Concurrency test case */
+  TCase *tc_threads = tcase_create ("Threads");
+  tcase_set_timeout (tc_threads, 30);
+  tcase_add_test (tc_threads, test_spsc_threads);
+  suite_add_tcase (s, tc_threads);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = spsc_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
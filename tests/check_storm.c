@@ -0,0 +1,202 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/storm.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+static int f_timeouts;
+
+static void *f_event_add(int fd, short events, const struct timeval *timeout,
+                         event_cb cb, void *arg)
+{
+  return (void *)0x1;
+}
+
+static void f_event_del(void *ev)
+{
+}
+
+static void *f_timeout_add(const struct timeval *timeout, short events,
+                           event_cb cb, void *arg)
+{
+  f_timeouts++;
+  return (void *)0x1;
+}
+
+static void f_timeout_del(void *tout)
+{
+  f_timeouts--;
+}
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_event_handler f_eh = {f_event_add, f_event_del, f_timeout_add,
+                          f_timeout_del};
+vde_storm f_storm;
+
+void
+setup (void)
+{
+  vde_context_new(&f_ctx);
+  vde_context_init(f_ctx, &f_eh, NULL);
+  f_timeouts = 0;
+  vde_storm_init(&f_storm, f_ctx);
+}
+
+void
+teardown (void)
+{
+  vde_storm_fini(&f_storm);
+  fail_unless (f_timeouts == 0, "timeout not removed");
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+}
+
+V_START_TEST (test_classify)
+{
+  unsigned char bcast[ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+  unsigned char mcast[ETH_ALEN] = {0x01, 0x00, 0x5e, 0x00, 0x00, 0x01};
+  unsigned char ucast[ETH_ALEN] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+
+  fail_unless (vde_storm_classify(bcast) == VDE_STORM_BROADCAST,
+               "broadcast not classified");
+  fail_unless (vde_storm_classify(mcast) == VDE_STORM_MULTICAST,
+               "multicast not classified");
+  fail_unless (vde_storm_classify(ucast) == VDE_STORM_UNKNOWN,
+               "unicast not classified");
+}
+END_TEST
+
+V_START_TEST (test_set_parse)
+{
+  vde_sobj *params, *out;
+
+  fail_unless (f_storm.enabled == 0 && f_timeouts == 0, "enabled at init");
+
+  errno = 0;
+  fail_unless (vde_storm_set(&f_storm, "anycast", 10, 1) == -1 &&
+               errno == EINVAL, "unknown class accepted");
+  fail_unless (vde_storm_set(&f_storm, "broadcast", -1, 1) == -1 &&
+               errno == EINVAL, "negative rate accepted");
+
+  // the burst defaults to a tenth of a second of rate
+  fail_unless (vde_storm_set(&f_storm, "multicast", 500, 0) == 0,
+               "cannot set multicast");
+  fail_unless (f_storm.enabled && f_storm.burst[VDE_STORM_MULTICAST] == 50,
+               "burst %u", f_storm.burst[VDE_STORM_MULTICAST]);
+  fail_unless (f_timeouts == 1, "timer not started");
+
+  params = vde_sobj_from_string("{'broadcast': {'rate': 100, 'burst': 5},"
+                                " 'multicast': {'rate': 0}}");
+  fail_unless (vde_storm_parse(&f_storm, params) == 0, "cannot parse");
+  vde_sobj_put(params);
+  fail_unless (f_storm.rate[VDE_STORM_BROADCAST] == 100 &&
+               f_storm.burst[VDE_STORM_BROADCAST] == 5 &&
+               f_storm.rate[VDE_STORM_MULTICAST] == 0,
+               "limits not parsed");
+  fail_unless (f_timeouts == 1, "timer started twice");
+
+  params = vde_sobj_from_string("{'unknown': {'burst': 5}}");
+  fail_unless (vde_storm_parse(&f_storm, params) == -1 && errno == EINVAL,
+               "limit without rate accepted");
+  vde_sobj_put(params);
+
+  out = vde_storm_serialize(&f_storm);
+  fail_unless (out != NULL, "cannot serialize");
+  fail_unless (vde_sobj_get_int(vde_sobj_hash_lookup(
+                 vde_sobj_hash_lookup(out, "broadcast"), "rate")) == 100,
+               "rate not serialized");
+  vde_sobj_put(out);
+
+  fail_unless (vde_storm_set(&f_storm, "broadcast", 0, 0) == 0,
+               "cannot disable broadcast");
+  fail_unless (f_storm.enabled == 0, "still enabled");
+}
+END_TEST
+
+V_START_TEST (test_admit)
+{
+  unsigned int i;
+  vde_storm_bucket bucket;
+
+  fail_unless (vde_storm_set(&f_storm, "broadcast", 100, 5) == 0,
+               "cannot set broadcast");
+  vde_storm_bucket_init(&f_storm, &bucket);
+
+  // a full bucket admits a burst
+  for (i = 0; i < 5; i++) {
+    fail_unless (vde_storm_admit(&f_storm, &bucket, VDE_STORM_BROADCAST),
+                 "frame %u of the burst dropped", i);
+  }
+  fail_unless (!vde_storm_admit(&f_storm, &bucket, VDE_STORM_BROADCAST),
+               "frame over the burst admitted");
+  fail_unless (f_storm.drops[VDE_STORM_BROADCAST] == 1, "drop not counted");
+
+  // classes without limits are not policed
+  for (i = 0; i < 100; i++) {
+    fail_unless (vde_storm_admit(&f_storm, &bucket, VDE_STORM_MULTICAST),
+                 "multicast dropped");
+  }
+
+  // 100 frames per second is a frame each tick
+  f_storm.now++;
+  fail_unless (vde_storm_admit(&f_storm, &bucket, VDE_STORM_BROADCAST),
+               "frame of a tick dropped");
+  fail_unless (!vde_storm_admit(&f_storm, &bucket, VDE_STORM_BROADCAST),
+               "second frame of a tick admitted");
+
+  // idle ports fill up to the burst only
+  f_storm.now += VDE_STORM_HZ;
+  for (i = 0; i < 5; i++) {
+    fail_unless (vde_storm_admit(&f_storm, &bucket, VDE_STORM_BROADCAST),
+                 "frame %u of the burst dropped", i);
+  }
+  fail_unless (!vde_storm_admit(&f_storm, &bucket, VDE_STORM_BROADCAST),
+               "frame over the burst admitted");
+  fail_unless (f_storm.drops[VDE_STORM_BROADCAST] == 3, "drops %llu",
+               (unsigned long long)f_storm.drops[VDE_STORM_BROADCAST]);
+}
+END_TEST
+
+Suite *
+storm_suite (void)
+{
+  Suite *s = suite_create ("storm");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_classify);
+  tcase_add_test (tc_core, test_set_parse);
+  tcase_add_test (tc_core, test_admit);
+  suite_add_tcase (s, tc_core);
+
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = storm_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,236 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <check.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+// the classifiers are private to the switch module
+#include "engine_switch.c"
+
+#define NFRAMES 4096
+#define MAX_LEN 64
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_event_handler f_eh = {(void *)0x1, (void *)0x1, (void *)0x1, (void *)0x1};
+vde_pkt *f_pkts[NFRAMES];
+
+void
+setup (void)
+{
+  unsigned int i;
+
+  vde_context_new(&f_ctx);
+  fail_unless (vde_context_init(f_ctx, &f_eh, NULL) == 0,
+               "cannot init context %s", strerror(errno));
+  for (i = 0; i < NFRAMES; i++) {
+    f_pkts[i] = vde_pkt_new(f_ctx, MAX_LEN, 0, 0);
+    fail_unless (f_pkts[i] != NULL, "cannot allocate packet");
+  }
+}
+
+void
+teardown (void)
+{
+  unsigned int i;
+
+  for (i = 0; i < NFRAMES; i++) {
+    vde_pkt_put(f_pkts[i]);
+  }
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+}
+
+static void frame_fill(vde_pkt *pkt, unsigned int len, unsigned char byte)
+{
+  pkt->hdr->pkt_len = len;
+  memset(pkt->payload, byte, MAX_LEN);
+}
+
+static void frame_tag(vde_pkt *pkt, unsigned char tci_high,
+                      unsigned char tci_low)
+{
+  unsigned char *frame = (unsigned char *)pkt->payload;
+
+  frame[12] = 0x81;
+  frame[13] = 0x00;
+  frame[14] = tci_high;
+  frame[15] = tci_low;
+}
+
+// frames of every length up to MAX_LEN, random or built to hit the corners
+static void frames_build(void)
+{
+  unsigned int i, j, n = 0;
+  unsigned char *frame;
+  unsigned int lens[] = { 0, 1, 13, 14, 15, 16, 17, 18, 19, 60, MAX_LEN };
+
+  for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+    // all zeros and all ones, multicast everywhere
+    frame_fill(f_pkts[n++], lens[i], 0x00);
+    frame_fill(f_pkts[n++], lens[i], 0xff);
+    // priority tagged, highest vid, priority bits and cfi set
+    frame_fill(f_pkts[n], lens[i], 0x02);
+    frame_tag(f_pkts[n++], 0x00, 0x00);
+    frame_fill(f_pkts[n], lens[i], 0x02);
+    frame_tag(f_pkts[n++], 0x0f, 0xff);
+    frame_fill(f_pkts[n], lens[i], 0x03);
+    frame_tag(f_pkts[n++], 0xf0, 0x0a);
+    // byte swapped tpid, qinq tpid
+    frame_fill(f_pkts[n], lens[i], 0x02);
+    frame_tag(f_pkts[n], 0x00, 0x0a);
+    f_pkts[n]->payload[12] = 0x00;
+    f_pkts[n++]->payload[13] = 0x81;
+    frame_fill(f_pkts[n], lens[i], 0x02);
+    frame_tag(f_pkts[n], 0x00, 0x0a);
+    f_pkts[n]->payload[12] = 0x88;
+    f_pkts[n++]->payload[13] = 0xa8;
+    // multicast source only
+    frame_fill(f_pkts[n], lens[i], 0x02);
+    f_pkts[n++]->payload[6] = 0x01;
+  }
+
+  srandom(42);
+  for (; n < NFRAMES; n++) {
+    frame = (unsigned char *)f_pkts[n]->payload;
+    for (j = 0; j < MAX_LEN; j++) {
+      frame[j] = random();
+    }
+    // half of them tagged
+    if (random() & 1) {
+      frame_tag(f_pkts[n], random(), random());
+    }
+    f_pkts[n]->hdr->pkt_len = random() % (MAX_LEN + 1);
+  }
+}
+
+static void classify_compare(switch_classify_fn classify, const char *name)
+{
+  unsigned int i, n;
+  switch_class expected[CLASS_BATCH], got[CLASS_BATCH];
+
+  frames_build();
+  for (n = 0; n < NFRAMES; n += CLASS_BATCH) {
+    memset(expected, 0, sizeof(expected));
+    memset(got, 0, sizeof(got));
+    switch_classify_scalar(&f_pkts[n], CLASS_BATCH, expected);
+    classify(&f_pkts[n], CLASS_BATCH, got);
+    for (i = 0; i < CLASS_BATCH; i++) {
+      fail_unless (got[i].flags == expected[i].flags,
+                   "%s: frame %u of len %u: flags %x, expected %x", name,
+                   n + i, f_pkts[n + i]->hdr->pkt_len, got[i].flags,
+                   expected[i].flags);
+      if (expected[i].flags & CLASS_SHORT) {
+        continue;
+      }
+      fail_unless (got[i].src_key == expected[i].src_key &&
+                   got[i].dst_key == expected[i].dst_key,
+                   "%s: frame %u of len %u: keys %llx %llx, expected %llx "
+                   "%llx", name, n + i, f_pkts[n + i]->hdr->pkt_len,
+                   (unsigned long long)got[i].src_key,
+                   (unsigned long long)got[i].dst_key,
+                   (unsigned long long)expected[i].src_key,
+                   (unsigned long long)expected[i].dst_key);
+    }
+  }
+}
+
+V_START_TEST (test_scalar)
+{
+  switch_class cls;
+
+  // the reference itself, on a tagged frame
+  frame_fill(f_pkts[0], 60, 0x02);
+  frame_tag(f_pkts[0], 0xe0, 0x0a);
+  f_pkts[0]->payload[0] = 0x01;
+  switch_classify_scalar(f_pkts, 1, &cls);
+  fail_unless (cls.flags == CLASS_DST_MCAST, "wrong flags %x", cls.flags);
+  fail_unless (cls.src_key == (KEY_USED | (10ULL << 48) | 0x020202020202ULL),
+               "wrong source key %llx", (unsigned long long)cls.src_key);
+  fail_unless (cls.dst_key == (KEY_USED | (10ULL << 48) | 0x010202020202ULL),
+               "wrong destination key %llx",
+               (unsigned long long)cls.dst_key);
+}
+END_TEST
+
+#ifdef HAVE_CLASSIFY_X86
+V_START_TEST (test_ssse3)
+{
+  __builtin_cpu_init();
+  if (!__builtin_cpu_supports("ssse3")) {
+    return;
+  }
+  classify_compare(&switch_classify_ssse3, "ssse3");
+}
+END_TEST
+#endif
+
+#ifdef HAVE_CLASSIFY_NEON
+V_START_TEST (test_neon)
+{
+  classify_compare(&switch_classify_neon, "neon");
+}
+END_TEST
+#endif
+
+V_START_TEST (test_select)
+{
+  const char *name;
+  switch_classify_fn classify;
+
+  fail_unless (switch_classifier_select(0, &name) == &switch_classify_scalar &&
+               strcmp(name, "scalar") == 0, "simd not disabled");
+  // whatever is picked matches the reference
+  classify = switch_classifier_select(1, &name);
+  classify_compare(classify, name);
+#ifndef HAVE_CLASSIFY_X86
+  fail_unless (strcmp(name, "scalar") == 0, "%s picked by default", name);
+#endif
+}
+END_TEST
+
+Suite *
+switch_classify_suite (void)
+{
+  Suite *s = suite_create ("switch_classify");
+
+  /* Classifier equivalence test case */
+  TCase *tc_classify = tcase_create ("Classify");
+  tcase_add_checked_fixture (tc_classify, setup, teardown);
+  tcase_add_test (tc_classify, test_scalar);
+#ifdef HAVE_CLASSIFY_X86
+  tcase_add_test (tc_classify, test_ssse3);
+#endif
+#ifdef HAVE_CLASSIFY_NEON
+  tcase_add_test (tc_classify, test_neon);
+#endif
+  tcase_add_test (tc_classify, test_select);
+  suite_add_tcase (s, tc_classify);
+
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = switch_classify_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
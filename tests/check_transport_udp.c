@@ -0,0 +1,303 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/component.h>
+#include <vde3/connection.h>
+#include <vde3/context.h>
+#include <vde3/packet.h>
+#include <vde3/transport.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+extern vde_event_handler epoll_eh;
+extern int epoll_eh_init(void);
+extern int epoll_eh_dispatch(void);
+extern void epoll_eh_break(void);
+
+// datagrams sent by a single sendmmsg, see transport_udp.c
+#define MAX_BATCH 64
+#define FRAME_LEN 60
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_component *f_listen_tr;
+unsigned int f_port;
+// the connection of the connecting transport, the one accepted by the
+// listening transport and the frames it read
+vde_connection *f_conn;
+vde_connection *f_peer;
+unsigned int f_rx;
+
+static int conn_read(vde_connection *conn, vde_pkt *pkt, void *arg)
+{
+  f_rx++;
+  return 0;
+}
+
+static int conn_write(vde_connection *conn, vde_pkt *pkt, void *arg)
+{
+  return 0;
+}
+
+static int conn_error(vde_connection *conn, vde_pkt *pkt, vde_conn_error err,
+                      void *arg)
+{
+  return 0;
+}
+
+static void f_cm_connect(vde_connection *conn, void *arg)
+{
+  vde_connection_set_callbacks(conn, &conn_read, &conn_write, &conn_error,
+                               NULL);
+  f_conn = conn;
+}
+
+static void f_cm_accept(vde_connection *conn, void *arg)
+{
+  vde_connection_set_callbacks(conn, &conn_read, &conn_write, &conn_error,
+                               NULL);
+  f_peer = conn;
+}
+
+static void f_cm_error(vde_connection *conn, int tr_errno, void *arg)
+{
+  fail("transport error %s", strerror(tr_errno));
+}
+
+// a loopback port nobody is bound to
+static unsigned int port_free(void)
+{
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  int fd;
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  fail_unless (fd >= 0, "cannot create socket");
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  fail_unless (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0 &&
+               getsockname(fd, (struct sockaddr *)&sin, &len) == 0,
+               "cannot bind socket %s", strerror(errno));
+  close(fd);
+  return ntohs(sin.sin_port);
+}
+
+static vde_component *transport_new(const char *name, const char *params)
+{
+  vde_component *tr;
+
+  fail_unless (vde_context_new_component(f_ctx, VDE_TRANSPORT, "udp", name,
+                                         &tr, vde_sobj_from_string(params))
+               == 0, "cannot create transport %s", strerror(errno));
+  vde_transport_set_cm_callbacks(tr, &f_cm_connect, &f_cm_accept,
+                                 &f_cm_error, NULL);
+  return tr;
+}
+
+void
+setup (void)
+{
+  char *mpath[] = {"src/.libs", NULL};
+  char params[64];
+
+  f_conn = f_peer = NULL;
+  f_rx = 0;
+  fail_unless (epoll_eh_init() == 0, "cannot init epoll handler");
+  vde_context_new(&f_ctx);
+  fail_unless (vde_context_init(f_ctx, &epoll_eh, mpath) == 0,
+               "cannot init context %s", strerror(errno));
+  f_port = port_free();
+  snprintf(params, sizeof(params), "{'host': '127.0.0.1', 'port': %u}",
+           f_port);
+  f_listen_tr = transport_new("listen", params);
+  fail_unless (vde_transport_listen(f_listen_tr) == 0, "cannot listen %s",
+               strerror(errno));
+}
+
+void
+teardown (void)
+{
+  if (f_conn != NULL) {
+    vde_connection_fini(f_conn);
+    vde_connection_delete(f_conn);
+  }
+  if (f_peer != NULL) {
+    vde_connection_fini(f_peer);
+    vde_connection_delete(f_peer);
+  }
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+}
+
+static void stop_cb(int fd, short events, void *arg)
+{
+  epoll_eh_break();
+}
+
+// run the loop for msec milliseconds
+static void run_for(int msec)
+{
+  void *stop;
+  struct timeval tv = { msec / 1000, (msec % 1000) * 1000 };
+
+  stop = epoll_eh.timeout_add(&tv, 0, &stop_cb, NULL);
+  fail_unless (stop != NULL, "cannot add stop timeout");
+  fail_unless (epoll_eh_dispatch() == 0, "loop failed");
+  epoll_eh.timeout_del(stop);
+}
+
+// connect a transport to port, f_conn is its connection
+static void transport_connect(unsigned int port)
+{
+  char params[96];
+  vde_component *tr;
+  vde_connection *conn;
+
+  snprintf(params, sizeof(params), "{'peer_host': '127.0.0.1', "
+                                   "'peer_port': %u}", port);
+  tr = transport_new("connect", params);
+  fail_unless (vde_connection_new(&conn) == 0, "cannot create connection");
+  fail_unless (vde_transport_connect(tr, conn) == 0, "cannot connect %s",
+               strerror(errno));
+  fail_unless (f_conn == conn, "connection not handed over");
+}
+
+// write count frames of len bytes to f_conn
+static void frames_write(unsigned int count, unsigned int len)
+{
+  vde_pkt *pkt;
+  unsigned int i;
+
+  for (i = 0; i < count; i++) {
+    pkt = vde_pkt_new(f_ctx, len, 0, 0);
+    fail_unless (pkt != NULL, "cannot allocate packet");
+    memset(pkt->payload, 0, len);
+    pkt->hdr->pkt_len = len;
+    fail_unless (vde_connection_write(f_conn, pkt) == 0, "cannot write %s",
+                 strerror(errno));
+    vde_pkt_put(pkt);
+  }
+}
+
+V_START_TEST (test_tx_sent)
+{
+  const vde_conn_stats *stats;
+
+  transport_connect(f_port);
+  stats = vde_connection_get_stats(f_conn);
+
+  // frames are queued until the loop runs, they are not sent yet
+  frames_write(10, FRAME_LEN);
+  fail_unless (stats->tx_pkts == 0, "%llu queued frames counted as sent",
+               (unsigned long long)stats->tx_pkts);
+  run_for(50);
+  fail_unless (stats->tx_pkts == 10 && stats->tx_bytes == 10 * FRAME_LEN,
+               "tx_pkts %llu tx_bytes %llu",
+               (unsigned long long)stats->tx_pkts,
+               (unsigned long long)stats->tx_bytes);
+  fail_unless (f_peer != NULL && f_rx == 10, "%u frames received", f_rx);
+
+  // a full batch is sent at once
+  frames_write(MAX_BATCH, FRAME_LEN);
+  fail_unless (stats->tx_pkts == 10 + MAX_BATCH, "batch not sent, tx_pkts "
+               "%llu", (unsigned long long)stats->tx_pkts);
+  run_for(50);
+  fail_unless (f_rx == 10 + MAX_BATCH, "%u frames received", f_rx);
+}
+END_TEST
+
+V_START_TEST (test_tx_oversize)
+{
+  const vde_conn_stats *stats;
+  unsigned int len;
+  vde_pkt *pkt;
+
+  transport_connect(f_port);
+  stats = vde_connection_get_stats(f_conn);
+
+  len = vde_connection_max_payload(f_conn) + 1;
+  pkt = vde_pkt_new(f_ctx, len, 0, 0);
+  fail_unless (pkt != NULL, "cannot allocate packet");
+  pkt->hdr->pkt_len = len;
+  fail_unless (vde_connection_write(f_conn, pkt) == -1 && errno == EMSGSIZE,
+               "oversize frame written");
+  vde_pkt_put(pkt);
+  run_for(20);
+  fail_unless (stats->drops[VDE_CONN_DROP_WRITE_ERROR] == 1 &&
+               stats->tx_pkts == 0 && stats->tx_bytes == 0,
+               "drops %llu tx_pkts %llu",
+               (unsigned long long)stats->drops[VDE_CONN_DROP_WRITE_ERROR],
+               (unsigned long long)stats->tx_pkts);
+}
+END_TEST
+
+V_START_TEST (test_tx_refused)
+{
+  const vde_conn_stats *stats;
+  uint64_t drops;
+
+  // nobody listens there, the port unreachable error of the first batch
+  // fails the next send
+  transport_connect(port_free());
+  stats = vde_connection_get_stats(f_conn);
+  frames_write(MAX_BATCH, FRAME_LEN);
+  usleep(20000);
+  frames_write(MAX_BATCH, FRAME_LEN);
+
+  drops = stats->drops[VDE_CONN_DROP_WRITE_ERROR];
+  fail_unless (drops > 0, "no drop");
+  fail_unless (stats->tx_pkts + drops == 2 * MAX_BATCH,
+               "tx_pkts %llu with %llu drops of %u frames",
+               (unsigned long long)stats->tx_pkts,
+               (unsigned long long)drops, 2 * MAX_BATCH);
+  fail_unless (stats->tx_bytes == stats->tx_pkts * FRAME_LEN,
+               "tx_bytes %llu", (unsigned long long)stats->tx_bytes);
+}
+END_TEST
+
+Suite *
+transport_udp_suite (void)
+{
+  Suite *s = suite_create ("transport_udp");
+
+  /* Send accounting test case */
+  TCase *tc_tx = tcase_create ("Send");
+  tcase_add_checked_fixture (tc_tx, setup, teardown);
+  tcase_add_test (tc_tx, test_tx_sent);
+  tcase_add_test (tc_tx, test_tx_oversize);
+  tcase_add_test (tc_tx, test_tx_refused);
+  suite_add_tcase (s, tc_tx);
+
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = transport_udp_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,562 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <check.h>
+#include <vde3.h>
+#include <vde3/command.h>
+#include <vde3/component.h>
+#include <vde3/connection.h>
+#include <vde3/context.h>
+#include <vde3/transport.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+extern vde_event_handler epoll_eh;
+extern int epoll_eh_init(void);
+extern int epoll_eh_dispatch(void);
+extern void epoll_eh_break(void);
+
+#define NTRANSPORTS 2
+
+// a vde2 request as sent by vde_plug, see transport_vde2.c
+#define SWITCH_MAGIC 0xfeedface
+#define REQ_NEW_CONTROL 0
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t type;
+  struct sockaddr_un sock;
+  char description[8];
+} __attribute__((packed)) peer_request;
+
+// a vde2 peer speaking the datagram protocol, connections backed by shared
+// memory are not handed over
+typedef struct {
+  int ctl_fd;
+  int data_fd;
+  struct sockaddr_un local_sa;
+  struct sockaddr_un remote_sa;
+} peer;
+
+// fixture directories, one for each transport
+char f_dirs[NTRANSPORTS][32];
+
+void
+setup (void)
+{
+  unsigned int i;
+
+  for (i = 0; i < NTRANSPORTS; i++) {
+    snprintf(f_dirs[i], sizeof(f_dirs[i]), "/tmp/check_vde2.XXXXXX");
+    fail_unless (mkdtemp(f_dirs[i]) != NULL, "cannot create directory %s",
+                 strerror(errno));
+  }
+}
+
+void
+teardown (void)
+{
+  char cmd[64];
+  unsigned int i;
+
+  for (i = 0; i < NTRANSPORTS; i++) {
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", f_dirs[i]);
+    if (system(cmd) != 0) {
+      fprintf(stderr, "cannot remove %s\n", f_dirs[i]);
+    }
+  }
+}
+
+static void stop_cb(int fd, short events, void *arg)
+{
+  epoll_eh_break();
+}
+
+// run the loop for msec milliseconds
+static void run_for(int msec)
+{
+  void *stop;
+  struct timeval tv = { msec / 1000, (msec % 1000) * 1000 };
+
+  stop = epoll_eh.timeout_add(&tv, 0, &stop_cb, NULL);
+  fail_unless (stop != NULL, "cannot add stop timeout");
+  fail_unless (epoll_eh_dispatch() == 0, "loop failed");
+  epoll_eh.timeout_del(stop);
+}
+
+/*
+ * A context with a switch "sw" reached through a vde2 transport "trN" for each
+ * fixture directory, each with its connection manager
+ */
+static vde_context *switch_new(const char *tr_params)
+{
+  vde_context *ctx;
+  vde_component *tr, *sw, *cm;
+  char name[8], params[128];
+  char *mpath[] = {"src/.libs", NULL};
+  unsigned int i;
+
+  fail_unless (epoll_eh_init() == 0, "cannot init epoll handler");
+  vde_context_new(&ctx);
+  fail_unless (vde_context_init(ctx, &epoll_eh, mpath) == 0,
+               "cannot init context %s", strerror(errno));
+  fail_unless (vde_context_new_component(ctx, VDE_ENGINE, "switch", "sw", &sw,
+                 vde_sobj_from_string("{'stats_interval': 0}")) == 0,
+               "cannot create switch %s", strerror(errno));
+  for (i = 0; i < NTRANSPORTS; i++) {
+    snprintf(name, sizeof(name), "tr%u", i);
+    snprintf(params, sizeof(params), "{'path': '%s', %s}", f_dirs[i],
+             tr_params);
+    fail_unless (vde_context_new_component(ctx, VDE_TRANSPORT, "vde2", name,
+                   &tr, vde_sobj_from_string(params)) == 0,
+                 "cannot create transport %s", strerror(errno));
+    snprintf(params, sizeof(params), "{'transport': 'tr%u', 'engine': 'sw'}",
+             i);
+    snprintf(name, sizeof(name), "cm%u", i);
+    fail_unless (vde_context_new_component(ctx, VDE_CONNECTION_MANAGER,
+                   "default", name, &cm, vde_sobj_from_string(params)) == 0,
+                 "cannot create connection manager %s", strerror(errno));
+    fail_unless (vde_conn_manager_listen(cm) == 0, "cannot listen %s",
+                 strerror(errno));
+  }
+  return ctx;
+}
+
+static void switch_delete(vde_context *ctx)
+{
+  vde_context_fini(ctx);
+  vde_context_delete(ctx);
+}
+
+// connect to the transport listening in dir, named after idx
+static void peer_connect(peer *p, const char *dir, unsigned int idx)
+{
+  struct sockaddr_un sa;
+  peer_request req;
+
+  p->data_fd = socket(PF_UNIX, SOCK_DGRAM, 0);
+  fail_unless (p->data_fd >= 0, "cannot create data socket");
+  p->local_sa.sun_family = AF_UNIX;
+  snprintf(p->local_sa.sun_path, sizeof(p->local_sa.sun_path), "%s/peer%u",
+           dir, idx);
+  fail_unless (bind(p->data_fd, (struct sockaddr *)&p->local_sa,
+                    sizeof(p->local_sa)) == 0, "cannot bind data socket");
+
+  p->ctl_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+  fail_unless (p->ctl_fd >= 0, "cannot create control socket");
+  sa.sun_family = AF_UNIX;
+  snprintf(sa.sun_path, sizeof(sa.sun_path), "%s/ctl", dir);
+  fail_unless (connect(p->ctl_fd, (struct sockaddr *)&sa, sizeof(sa)) == 0,
+               "cannot connect to %s %s", sa.sun_path, strerror(errno));
+
+  memset(&req, 0, sizeof(req));
+  req.magic = SWITCH_MAGIC;
+  req.version = 3;
+  req.type = REQ_NEW_CONTROL;
+  req.sock = p->local_sa;
+  strcpy(req.description, "check");
+  fail_unless (write(p->ctl_fd, &req, sizeof(req)) == sizeof(req),
+               "cannot send request");
+}
+
+// the reply comes once the transport has run
+static void peer_get_reply(peer *p)
+{
+  fail_unless (read(p->ctl_fd, &p->remote_sa, sizeof(p->remote_sa)) ==
+               sizeof(p->remote_sa), "no reply from transport");
+}
+
+// a broadcast frame from the address ending in src
+static void peer_send(peer *p, unsigned char src)
+{
+  unsigned char frame[60];
+
+  memset(frame, 0, sizeof(frame));
+  memset(frame, 0xff, 6);
+  frame[6] = 0x02;
+  frame[11] = src;
+  frame[12] = 0x08;
+  fail_unless (sendto(p->data_fd, frame, sizeof(frame), 0,
+                      (struct sockaddr *)&p->remote_sa,
+                      sizeof(p->remote_sa)) == sizeof(frame),
+               "cannot send frame %s", strerror(errno));
+}
+
+static void peer_close(peer *p)
+{
+  close(p->ctl_fd);
+  close(p->data_fd);
+}
+
+// connect to the control socket in dir without sending a request
+static int ctl_connect(const char *dir)
+{
+  struct sockaddr_un sa;
+  int fd;
+
+  fd = socket(PF_UNIX, SOCK_STREAM, 0);
+  fail_unless (fd >= 0, "cannot create control socket");
+  sa.sun_family = AF_UNIX;
+  snprintf(sa.sun_path, sizeof(sa.sun_path), "%s/ctl", dir);
+  fail_unless (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0,
+               "cannot connect to %s %s", sa.sun_path, strerror(errno));
+  return fd;
+}
+
+// true if the transport has closed the other end of fd
+static int ctl_closed(int fd)
+{
+  char c;
+  int len = recv(fd, &c, 1, MSG_DONTWAIT);
+
+  fail_unless (len == 0 || (len < 0 && errno == EAGAIN),
+               "unexpected data on control socket");
+  return len == 0;
+}
+
+static int switch_status(vde_context *ctx)
+{
+  vde_component *sw;
+  vde_command *command;
+  vde_sobj *in, *out = NULL;
+  int status;
+
+  sw = vde_context_get_component(ctx, "sw");
+  command = vde_component_command_get(sw, "status");
+  fail_unless (command != NULL, "no status command");
+  in = vde_sobj_new_array();
+  fail_unless (vde_command_get_func(command)(sw, in, &out) == 0,
+               "status failed");
+  status = vde_sobj_get_int(out);
+  vde_sobj_put(in);
+  vde_sobj_put(out);
+  vde_component_put(sw, NULL);
+  return status;
+}
+
+// true if the switch of ctx has learned the address ending in src on the
+// connection id of transport scope
+static int switch_has_entry(vde_context *ctx, const char *scope, int64_t id,
+                            unsigned char src)
+{
+  vde_sobj *states, *state, *entries, *entry;
+  int64_t key = 0x020000000000LL | src;
+  int i, found = 0;
+
+  states = vde_context_state_save(ctx);
+  fail_unless (vde_sobj_array_length(states) == 1, "no switch state");
+  state = vde_sobj_array_get_idx(vde_sobj_array_get_idx(states, 0), 1);
+  entries = vde_sobj_hash_lookup(state, "entries");
+  for (i = 0; !found && i < vde_sobj_array_length(entries); i++) {
+    entry = vde_sobj_array_get_idx(entries, i);
+    found = !strcmp(vde_sobj_get_string(vde_sobj_array_get_idx(entry, 0)),
+                    scope) &&
+            vde_sobj_get_int64(vde_sobj_array_get_idx(entry, 1)) == id &&
+            vde_sobj_get_int64(vde_sobj_array_get_idx(entry, 2)) == key;
+  }
+  vde_sobj_put(states);
+  return found;
+}
+
+static void quit_cb(int fd, short events, void *arg)
+{
+  *(int *)arg = 1;
+  epoll_eh_break();
+}
+
+// the running process, handing its connections over until the pipe is closed
+static int old_process(int ready_fd, int quit_fd)
+{
+  vde_context *ctx;
+  void *quit_ev;
+  int quit = 0;
+
+  ctx = switch_new("'handoff': true");
+  quit_ev = vde_context_event_add(ctx, quit_fd, VDE_EV_READ, NULL, &quit_cb,
+                                  &quit);
+  if (quit_ev == NULL || write(ready_fd, "r", 1) != 1) {
+    return 1;
+  }
+  while (!quit) {
+    run_for(100);
+  }
+  switch_delete(ctx);
+  return 0;
+}
+
+V_START_TEST (test_handoff)
+{
+  int ready[2], quit[2], status;
+  unsigned int i;
+  char c;
+  pid_t pid;
+  peer peers[NTRANSPORTS];
+  vde_context *ctx;
+
+  fail_unless (pipe(ready) == 0 && pipe(quit) == 0, "cannot create pipes");
+  pid = fork();
+  fail_unless (pid >= 0, "cannot fork");
+  if (pid == 0) {
+    close(ready[0]);
+    close(quit[1]);
+    _exit(old_process(ready[1], quit[0]));
+  }
+  close(ready[1]);
+  close(quit[0]);
+  fail_unless (read(ready[0], &c, 1) == 1, "old process not started");
+
+  // both transports number their first connection 1, each peer has its own
+  // address learned by the old switch once its port is there
+  for (i = 0; i < NTRANSPORTS; i++) {
+    peer_connect(&peers[i], f_dirs[i], i);
+    peer_get_reply(&peers[i]);
+  }
+  usleep(100000);
+  for (i = 0; i < NTRANSPORTS; i++) {
+    peer_send(&peers[i], i + 1);
+  }
+  usleep(100000);
+
+  // the transports resume one after the other, before any port is back
+  ctx = switch_new("'resume': true");
+  run_for(100);
+  fail_unless (switch_status(ctx) == NTRANSPORTS, "%d ports taken over",
+               switch_status(ctx));
+  for (i = 0; i < NTRANSPORTS; i++) {
+    fail_unless (switch_has_entry(ctx, i ? "tr1" : "tr0", 1, i + 1),
+                 "address of peer %u not restored", i);
+    fail_unless (!switch_has_entry(ctx, i ? "tr0" : "tr1", 1, i + 1),
+                 "address of peer %u restored on the wrong port", i);
+  }
+
+  // peers go on talking to the same sockets
+  for (i = 0; i < NTRANSPORTS; i++) {
+    peer_send(&peers[i], i + 3);
+  }
+  run_for(100);
+  for (i = 0; i < NTRANSPORTS; i++) {
+    fail_unless (switch_has_entry(ctx, i ? "tr1" : "tr0", 1, i + 3),
+                 "frame of peer %u lost after the handoff", i);
+  }
+
+  close(quit[1]);
+  fail_unless (waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+               WEXITSTATUS(status) == 0, "old process failed");
+  for (i = 0; i < NTRANSPORTS; i++) {
+    peer_close(&peers[i]);
+  }
+  switch_delete(ctx);
+}
+END_TEST
+
+V_START_TEST (test_srv_deadline)
+{
+  vde_context *ctx;
+  peer p;
+  int fd;
+
+  ctx = switch_new("'handshake_timeout_ms': 100");
+  fd = ctl_connect(f_dirs[0]);
+  run_for(50);
+  fail_unless (!ctl_closed(fd), "closed before the deadline");
+  // a peer sending its request in time is not affected
+  peer_connect(&p, f_dirs[0], 0);
+  run_for(20);
+  peer_get_reply(&p);
+  run_for(130);
+  fail_unless (ctl_closed(fd), "not closed at the deadline");
+  fail_unless (!ctl_closed(p.ctl_fd), "peer closed");
+  fail_unless (switch_status(ctx) == 1, "%d ports", switch_status(ctx));
+
+  close(fd);
+  peer_close(&p);
+  switch_delete(ctx);
+}
+END_TEST
+
+V_START_TEST (test_half_open)
+{
+  vde_context *ctx;
+  peer p;
+  int fds[3];
+  unsigned int i;
+
+  ctx = switch_new("'handshake_timeout_ms': 200, 'max_half_open': 2");
+  for (i = 0; i < 3; i++) {
+    fds[i] = ctl_connect(f_dirs[0]);
+  }
+  run_for(50);
+  // over the cap connections are closed at once
+  fail_unless (!ctl_closed(fds[0]) && !ctl_closed(fds[1]),
+               "half open connection closed");
+  fail_unless (ctl_closed(fds[2]), "connection over the cap not closed");
+
+  // the cap is released as handshakes end
+  run_for(200);
+  fail_unless (ctl_closed(fds[0]) && ctl_closed(fds[1]),
+               "half open connection not closed at the deadline");
+  peer_connect(&p, f_dirs[0], 0);
+  run_for(20);
+  peer_get_reply(&p);
+  fail_unless (switch_status(ctx) == 1, "%d ports", switch_status(ctx));
+
+  for (i = 0; i < 3; i++) {
+    close(fds[i]);
+  }
+  peer_close(&p);
+  switch_delete(ctx);
+}
+END_TEST
+
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_EVENTFD_H)
+// outcome of a connect through the vde2 transport
+int f_clt_connected;
+int f_clt_errno;
+
+static void clt_connect_cb(vde_connection *conn, void *arg)
+{
+  f_clt_connected = 1;
+}
+
+static void clt_accept_cb(vde_connection *conn, void *arg)
+{
+}
+
+static void clt_error_cb(vde_connection *conn, int tr_errno, void *arg)
+{
+  f_clt_errno = tr_errno;
+}
+
+// read whatever is waiting on the fd in arg
+static void drain_cb(int fd, short events, void *arg)
+{
+  char buf[64];
+  int clt_fd = *(int *)arg;
+
+  fail_unless (read(fd, buf, 1) == 1, "cannot read pipe");
+  while (recv(clt_fd, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+}
+
+V_START_TEST (test_clt_deadline)
+{
+  struct sockaddr_un sa;
+  vde_context *ctx;
+  vde_component *tr;
+  vde_connection *conn;
+  char *mpath[] = {"src/.libs", NULL};
+  char params[96], c = 0, buf[256];
+  int srv_fd, fd, clt_fd, pipe_fds[2];
+
+  // a switch which never replies
+  srv_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+  fail_unless (srv_fd >= 0, "cannot create socket");
+  sa.sun_family = AF_UNIX;
+  snprintf(sa.sun_path, sizeof(sa.sun_path), "%s/ctl", f_dirs[0]);
+  fail_unless (bind(srv_fd, (struct sockaddr *)&sa, sizeof(sa)) == 0 &&
+               listen(srv_fd, 1) == 0, "cannot listen %s", strerror(errno));
+
+  fail_unless (epoll_eh_init() == 0, "cannot init epoll handler");
+  vde_context_new(&ctx);
+  fail_unless (vde_context_init(ctx, &epoll_eh, mpath) == 0,
+               "cannot init context %s", strerror(errno));
+  snprintf(params, sizeof(params), "{'path': '%s', "
+                                   "'handshake_timeout_ms': 100}", f_dirs[0]);
+  fail_unless (vde_context_new_component(ctx, VDE_TRANSPORT, "vde2", "tr",
+                 &tr, vde_sobj_from_string(params)) == 0,
+               "cannot create transport %s", strerror(errno));
+  vde_transport_set_cm_callbacks(tr, &clt_connect_cb, &clt_accept_cb,
+                                 &clt_error_cb, NULL);
+  f_clt_connected = f_clt_errno = 0;
+
+  // the control socket of the transport is the lowest free descriptor
+  clt_fd = dup(0);
+  close(clt_fd);
+  fail_unless (vde_connection_new(&conn) == 0, "cannot create connection");
+  fail_unless (vde_transport_connect(tr, conn) == 0, "cannot connect %s",
+               strerror(errno));
+  fd = accept(srv_fd, NULL, NULL);
+  fail_unless (fd >= 0, "no connection from transport");
+  fail_unless (read(fd, buf, sizeof(buf)) > 0, "no request from transport");
+
+  // a spurious wake up: the byte sent by the switch is read in the same loop
+  // iteration, before the transport gets to it
+  fail_unless (pipe(pipe_fds) == 0, "cannot create pipe");
+  fail_unless (vde_context_event_add(ctx, pipe_fds[0], VDE_EV_READ, NULL,
+                                     &drain_cb, &clt_fd) != NULL,
+               "cannot add event");
+  fail_unless (write(pipe_fds[1], &c, 1) == 1 && write(fd, &c, 1) == 1,
+               "cannot wake transport up");
+  run_for(30);
+  fail_unless (f_clt_errno == 0, "spurious wake up failed the handshake: %s",
+               strerror(f_clt_errno));
+
+  // no reply, the deadline is the one of the first wait
+  run_for(100);
+  fail_unless (f_clt_errno == ETIMEDOUT && !f_clt_connected,
+               "handshake not timed out: %s", strerror(f_clt_errno));
+
+  vde_connection_fini(conn);
+  vde_connection_delete(conn);
+  close(fd);
+  close(srv_fd);
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+  vde_context_fini(ctx);
+  vde_context_delete(ctx);
+}
+END_TEST
+#endif
+
+Suite *
+vde2_suite (void)
+{
+  Suite *s = suite_create ("vde2");
+
+  /* Handshake test case */
+  TCase *tc_handshake = tcase_create ("Handshake");
+  tcase_add_checked_fixture (tc_handshake, setup, teardown);
+  tcase_add_test (tc_handshake, test_srv_deadline);
+  tcase_add_test (tc_handshake, test_half_open);
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_EVENTFD_H)
+  tcase_add_test (tc_handshake, test_clt_deadline);
+#endif
+  suite_add_tcase (s, tc_handshake);
+
+  /* Hot restart test case */
+  TCase *tc_handoff = tcase_create ("Handoff");
+  tcase_add_checked_fixture (tc_handoff, setup, teardown);
+  tcase_add_test (tc_handoff, test_handoff);
+  tcase_set_timeout (tc_handoff, 10);
+  suite_add_tcase (s, tc_handoff);
+
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = vde2_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
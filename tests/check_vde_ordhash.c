@@ -136,6 +136,49 @@ V_START_TEST (test_ordhash_iterator_iterates)
 }
 END_TEST
 
+V_START_TEST (test_ordhash_iterator_after_remove)
+{
+  long i;
+  vde_ordhash_entry *e;
+
+  for (i=1; i<=9; i++) {
+    fail_unless (vde_ordhash_insert(f_oh, (void *)i, (void *)i) == 0,
+                 "insert failed");
+  }
+
+  // remove every odd key: the head, the tail and elements in the middle
+  for (i=1; i<=9; i+=2) {
+    fail_unless (vde_ordhash_remove(f_oh, (void *)i) != 0,
+                 "remove returned zero");
+  }
+
+  i = 2;
+  for (e = vde_ordhash_first(f_oh); e != NULL; e = vde_ordhash_next(e)) {
+    fail_unless ((long)vde_ordhash_entry_getkey(f_oh, e) == i,
+                 "the iterator is not following insertion order");
+    i += 2;
+  }
+  fail_unless (i==10, "the iterator has not iterated the whole ordhash");
+
+  i = 8;
+  for (e = vde_ordhash_last(f_oh); e != NULL; e = vde_ordhash_prev(e)) {
+    fail_unless ((long)vde_ordhash_entry_lookup(f_oh, e) == i,
+                 "the iterator is not following insertion order");
+    i -= 2;
+  }
+  fail_unless (i==0, "the iterator has not iterated the whole ordhash");
+
+  // a removed key can be inserted again as the youngest element
+  vde_ordhash_insert(f_oh, (void *)1, (void *)1);
+  e = vde_ordhash_last(f_oh);
+  fail_unless ((long)vde_ordhash_entry_getkey(f_oh, e) == 1,
+               "reinserted element is not the youngest");
+
+  vde_ordhash_remove_all(f_oh);
+  fail_unless (vde_ordhash_first(f_oh) == NULL, "remove_all left elements");
+}
+END_TEST
+
 Suite *
 vde_ordhash_suite (void)
 {
@@ -154,6 +197,7 @@ vde_ordhash_suite (void)
   tcase_add_checked_fixture (tc_iterators, setup, teardown);
   tcase_add_test (tc_iterators, test_ordhash_iterator_empty);
   tcase_add_test (tc_iterators, test_ordhash_iterator_iterates);
+  tcase_add_test (tc_iterators, test_ordhash_iterator_after_remove);
   suite_add_tcase (s, tc_iterators);
   return s;
 }